@@ -0,0 +1,128 @@
+//! Protocol codec and streamed-text matching benchmarks.
+//!
+//! Run with `cargo bench -p common`.
+
+use bytes::BytesMut;
+use common::markers::{MarkerSet, MarkerStream, PhaseSplitter};
+use common::{
+    read_command, write_command, Command, CommandV1, DevicesInfo, OutputPhase, SystemInfo,
+};
+use criterion::{black_box, criterion_group, criterion_main, Criterion, Throughput};
+use std::sync::OnceLock;
+
+fn result_chunk() -> Command {
+    Command::V1(CommandV1::InferenceResultChunk {
+        task_id: "5f0c2f6e-8d7a-4a53-9c1e-2b1b7f0e9d41".to_string(),
+        seq: 42,
+        delta: "The quick brown fox jumps over the lazy dog, again and ".to_string(),
+        phase: OutputPhase::Final,
+        done: false,
+        error: None,
+        prompt_tokens: 0,
+        completion_tokens: 57,
+        analysis_tokens: 0,
+        final_tokens: 57,
+    })
+}
+
+fn heartbeat() -> Command {
+    Command::V1(CommandV1::Heartbeat {
+        client_id: [7; 16],
+        system_info: SystemInfo::default(),
+        device_count: 4,
+        device_memtotal_gb: 96,
+        device_total_tflops: 320,
+        devices_info: vec![DevicesInfo::default(); 4],
+    })
+}
+
+fn bench_codec(c: &mut Criterion) {
+    let rt = tokio::runtime::Builder::new_current_thread()
+        .build()
+        .unwrap();
+    let mut group = c.benchmark_group("codec");
+    for (name, command) in [("result_chunk", result_chunk()), ("heartbeat", heartbeat())] {
+        let mut frame = Vec::new();
+        rt.block_on(write_command(&mut frame, &command)).unwrap();
+        group.throughput(Throughput::Bytes(frame.len() as u64));
+
+        let mut out = Vec::with_capacity(frame.len());
+        group.bench_function(format!("write_command/{name}"), |b| {
+            b.iter(|| {
+                out.clear();
+                rt.block_on(write_command(&mut out, black_box(&command)))
+                    .unwrap()
+            })
+        });
+
+        let mut buf = BytesMut::with_capacity(frame.len());
+        group.bench_function(format!("read_command/{name}"), |b| {
+            b.iter(|| {
+                let mut reader = black_box(frame.as_slice());
+                rt.block_on(read_command(&mut reader, &mut buf)).unwrap()
+            })
+        });
+    }
+    group.finish();
+}
+
+/// Generated text as a worker streams it: a reasoning block, then the
+/// answer, a few bytes per token.
+fn token_stream() -> Vec<String> {
+    let text = "<think>The user wants a summary. Keep it short and plain.</think>\
+                Final: Rust prevents data races at compile time through ownership, \
+                borrowing and lifetimes, so concurrent code stays safe without a \
+                garbage collector.<|eot_id|>";
+    text.as_bytes()
+        .chunks(4)
+        .map(|c| String::from_utf8_lossy(c).into_owned())
+        .collect()
+}
+
+fn stop_markers() -> &'static MarkerSet<()> {
+    static SET: OnceLock<MarkerSet<()>> = OnceLock::new();
+    SET.get_or_init(|| {
+        MarkerSet::new(&[
+            ("<|eot_id|>", ()),
+            ("<|im_end|>", ()),
+            ("<|end|>", ()),
+            ("\n\n###", ()),
+        ])
+    })
+}
+
+fn bench_markers(c: &mut Criterion) {
+    let tokens = token_stream();
+    let bytes: usize = tokens.iter().map(String::len).sum();
+    let mut group = c.benchmark_group("markers");
+    group.throughput(Throughput::Bytes(bytes as u64));
+
+    group.bench_function("phase_splitter", |b| {
+        b.iter(|| {
+            let mut splitter = PhaseSplitter::default();
+            let mut out = 0;
+            for token in &tokens {
+                out += splitter
+                    .push(black_box(token))
+                    .map(|(_, s)| s.len())
+                    .sum::<usize>();
+            }
+            out
+        })
+    });
+
+    group.bench_function("stop_stream", |b| {
+        b.iter(|| {
+            let mut stream = MarkerStream::new(stop_markers());
+            let mut pieces = 0;
+            for token in &tokens {
+                pieces += stream.push(black_box(token)).count();
+            }
+            pieces
+        })
+    });
+    group.finish();
+}
+
+criterion_group!(benches, bench_codec, bench_markers);
+criterion_main!(benches);
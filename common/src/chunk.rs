@@ -0,0 +1,321 @@
+//! Helpers for streaming inference output back to the server.
+//!
+//! Workers produce one piece of text per generated token. Sending each piece
+//! as its own frame costs a syscall (and a TLS record) per token, so
+//! [`ChunkCoalescer`] buffers pieces until a byte budget or a time window is
+//! reached. [`ChunkTarget`] builds the frame itself, choosing the compact
+//! handle-addressed variant when the server assigned a handle at dispatch.
+//! [`TaskClock`] collects the stage times reported with TaskTimings.
+
+use crate::{ChunkEnd, CommandV1, OutputPhase, TaskTimings, TIMING_TOKEN_STRIDE};
+use std::time::{Duration, Instant};
+
+/// How result chunks for one task are addressed.
+#[derive(Debug, Clone)]
+pub enum ChunkTarget {
+    TaskId(String),
+    Handle(u32),
+}
+
+/// Token counters reported with result chunks.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct ChunkUsage {
+    pub prompt_tokens: u32,
+    pub completion_tokens: u32,
+    pub analysis_tokens: u32,
+    pub final_tokens: u32,
+}
+
+impl ChunkTarget {
+    pub fn new(task_id: String, handle: Option<u32>) -> Self {
+        match handle {
+            Some(handle) => Self::Handle(handle),
+            None => Self::TaskId(task_id),
+        }
+    }
+
+    /// Intermediate chunk carrying `delta`.
+    pub fn delta(
+        &self,
+        seq: u32,
+        delta: String,
+        phase: OutputPhase,
+        usage: ChunkUsage,
+    ) -> CommandV1 {
+        self.build(seq, delta, phase, false, None, usage)
+    }
+
+    /// Final chunk; `error` marks the task as failed.
+    pub fn done(
+        &self,
+        seq: u32,
+        phase: OutputPhase,
+        error: Option<String>,
+        usage: ChunkUsage,
+    ) -> CommandV1 {
+        self.build(seq, String::new(), phase, true, error, usage)
+    }
+
+    fn build(
+        &self,
+        seq: u32,
+        delta: String,
+        phase: OutputPhase,
+        done: bool,
+        error: Option<String>,
+        usage: ChunkUsage,
+    ) -> CommandV1 {
+        match self {
+            Self::TaskId(task_id) => CommandV1::InferenceResultChunk {
+                task_id: task_id.clone(),
+                seq,
+                delta,
+                phase,
+                done,
+                error,
+                prompt_tokens: usage.prompt_tokens,
+                completion_tokens: usage.completion_tokens,
+                analysis_tokens: usage.analysis_tokens,
+                final_tokens: usage.final_tokens,
+            },
+            Self::Handle(handle) => CommandV1::InferenceResultChunkCompact {
+                handle: *handle,
+                seq,
+                delta,
+                phase,
+                end: done.then(|| ChunkEnd {
+                    error,
+                    prompt_tokens: usage.prompt_tokens,
+                    completion_tokens: usage.completion_tokens,
+                    analysis_tokens: usage.analysis_tokens,
+                    final_tokens: usage.final_tokens,
+                }),
+            },
+        }
+    }
+}
+
+/// Buffers streamed text per output phase and releases it when `max_bytes`
+/// have accumulated or `max_delay` has passed since the first buffered byte.
+/// A zero `max_delay` disables the time window. `push` only sees the window
+/// when the next piece arrives, so callers also wait on [`Self::deadline`]
+/// and flush when it passes with nothing new.
+#[derive(Debug)]
+pub struct ChunkCoalescer {
+    max_bytes: usize,
+    max_delay: Duration,
+    buf: String,
+    phase: OutputPhase,
+    started: Option<Instant>,
+}
+
+impl ChunkCoalescer {
+    pub fn new(max_bytes: usize, max_delay: Duration) -> Self {
+        Self {
+            max_bytes: max_bytes.max(1),
+            max_delay,
+            buf: String::new(),
+            phase: OutputPhase::Unknown,
+            started: None,
+        }
+    }
+
+    /// Buffer `seg` and return any deltas that are ready to send, in order.
+    pub fn push(&mut self, phase: OutputPhase, seg: &str) -> Vec<(OutputPhase, String)> {
+        self.push_at(phase, seg, Instant::now())
+    }
+
+    fn push_at(
+        &mut self,
+        phase: OutputPhase,
+        seg: &str,
+        now: Instant,
+    ) -> Vec<(OutputPhase, String)> {
+        let mut ready = Vec::new();
+        if seg.is_empty() {
+            return ready;
+        }
+        // Deltas never mix phases.
+        if !self.buf.is_empty() && self.phase != phase {
+            ready.extend(self.flush());
+        }
+        if self.buf.is_empty() {
+            self.phase = phase;
+            self.started = Some(now);
+        }
+        self.buf.push_str(seg);
+
+        let window_elapsed = !self.max_delay.is_zero()
+            && self
+                .started
+                .map_or(false, |t| now.duration_since(t) >= self.max_delay);
+        if self.buf.len() >= self.max_bytes || window_elapsed {
+            ready.extend(self.flush());
+        }
+        ready
+    }
+
+    /// When the buffered text is due, if anything is buffered and the time
+    /// window is enabled.
+    pub fn deadline(&self) -> Option<Instant> {
+        if self.max_delay.is_zero() {
+            return None;
+        }
+        self.started.map(|t| t + self.max_delay)
+    }
+
+    /// Take whatever is buffered.
+    pub fn flush(&mut self) -> Option<(OutputPhase, String)> {
+        self.started = None;
+        if self.buf.is_empty() {
+            return None;
+        }
+        Some((self.phase, std::mem::take(&mut self.buf)))
+    }
+}
+
+/// Stage times of one task, measured from when the worker read it.
+#[derive(Debug, Clone)]
+pub struct TaskClock {
+    received: Instant,
+    tokens: u32,
+    timings: TaskTimings,
+}
+
+impl TaskClock {
+    pub fn start() -> Self {
+        Self::started_at(Instant::now())
+    }
+
+    pub fn started_at(received: Instant) -> Self {
+        Self {
+            received,
+            tokens: 0,
+            timings: TaskTimings::default(),
+        }
+    }
+
+    fn now_us(&self) -> u32 {
+        u32::try_from(self.received.elapsed().as_micros())
+            .unwrap_or(u32::MAX)
+            .max(1)
+    }
+
+    pub fn prompt_ready(&mut self) {
+        self.timings.prompt_ready_us = self.now_us();
+    }
+
+    pub fn submitted(&mut self) {
+        self.timings.submitted_us = self.now_us();
+    }
+
+    /// Call once per sampled token.
+    pub fn token(&mut self) {
+        let now = self.now_us();
+        if self.tokens == 0 {
+            self.timings.first_token_us = now;
+        } else if self.tokens % TIMING_TOKEN_STRIDE == 0 {
+            self.timings.token_marks_us.push(now);
+        }
+        self.tokens += 1;
+        self.timings.done_us = now;
+    }
+
+    pub fn finish(self) -> TaskTimings {
+        self.timings
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_coalescer_flushes_on_bytes_and_phase() {
+        let mut c = ChunkCoalescer::new(4, Duration::ZERO);
+        assert!(c.push(OutputPhase::Final, "ab").is_empty());
+        assert_eq!(
+            c.push(OutputPhase::Final, "cd"),
+            vec![(OutputPhase::Final, "abcd".to_string())]
+        );
+        assert!(c.push(OutputPhase::Analysis, "x").is_empty());
+        assert_eq!(
+            c.push(OutputPhase::Final, "y"),
+            vec![(OutputPhase::Analysis, "x".to_string())]
+        );
+        assert_eq!(c.flush(), Some((OutputPhase::Final, "y".to_string())));
+        assert_eq!(c.flush(), None);
+    }
+
+    #[test]
+    fn test_coalescer_flushes_on_time_window() {
+        let mut c = ChunkCoalescer::new(1024, Duration::from_millis(20));
+        let t0 = Instant::now();
+        assert!(c.push_at(OutputPhase::Final, "a", t0).is_empty());
+        assert!(c
+            .push_at(OutputPhase::Final, "b", t0 + Duration::from_millis(5))
+            .is_empty());
+        assert_eq!(
+            c.push_at(OutputPhase::Final, "c", t0 + Duration::from_millis(25)),
+            vec![(OutputPhase::Final, "abc".to_string())]
+        );
+    }
+
+    #[test]
+    fn test_coalescer_deadline_without_next_piece() {
+        let mut c = ChunkCoalescer::new(1024, Duration::from_millis(20));
+        assert_eq!(c.deadline(), None);
+        let t0 = Instant::now();
+        assert!(c.push_at(OutputPhase::Final, "a", t0).is_empty());
+        let due = t0 + Duration::from_millis(20);
+        assert_eq!(c.deadline(), Some(due));
+        // Later pieces do not push the deadline back.
+        assert!(c
+            .push_at(OutputPhase::Final, "b", t0 + Duration::from_millis(5))
+            .is_empty());
+        assert_eq!(c.deadline(), Some(due));
+        // No further piece comes; the caller flushes once the deadline passes.
+        assert_eq!(c.flush(), Some((OutputPhase::Final, "ab".to_string())));
+        assert_eq!(c.deadline(), None);
+
+        let mut c = ChunkCoalescer::new(1024, Duration::ZERO);
+        assert!(c.push(OutputPhase::Final, "a").is_empty());
+        assert_eq!(c.deadline(), None);
+    }
+
+    #[test]
+    fn test_clock_marks_every_stride_tokens() {
+        let mut clock = TaskClock::start();
+        clock.prompt_ready();
+        clock.submitted();
+        for _ in 0..=2 * TIMING_TOKEN_STRIDE {
+            clock.token();
+        }
+        let t = clock.finish();
+        assert!(t.prompt_ready_us > 0 && t.submitted_us >= t.prompt_ready_us);
+        assert!(t.first_token_us >= t.submitted_us);
+        assert_eq!(t.token_marks_us.len(), 2);
+        assert_eq!(t.done_us, t.token_marks_us[1]);
+    }
+
+    #[test]
+    fn test_target_uses_compact_variant_with_handle() {
+        let usage = ChunkUsage {
+            completion_tokens: 3,
+            ..Default::default()
+        };
+        match ChunkTarget::new("t".to_string(), Some(7)).done(2, OutputPhase::Final, None, usage) {
+            CommandV1::InferenceResultChunkCompact {
+                handle: 7,
+                seq: 2,
+                end: Some(end),
+                ..
+            } => assert_eq!(end.completion_tokens, 3),
+            other => panic!("unexpected {:?}", other),
+        }
+        assert!(matches!(
+            ChunkTarget::new("t".to_string(), None).delta(0, "x".into(), OutputPhase::Final, usage),
+            CommandV1::InferenceResultChunk { done: false, .. }
+        ));
+    }
+}
@@ -3,9 +3,13 @@ use bincode::{self as bincode, config as bincode_config, Decode, Encode};
 use serde::{Deserialize, Serialize};
 use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
 use tracing::warn;
+pub mod chunk;
 pub mod config;
+pub mod markers;
+pub mod relay;
 use bytes::BytesMut;
 use config::GpuModelConfig;
+use std::cell::RefCell;
 
 #[derive(Serialize, Deserialize, Encode, Decode, Debug, Clone)]
 pub struct Model {
@@ -28,7 +32,7 @@ pub struct DeviceInfo {
 }
 
 // Device information from client to server (max num: 8)
-#[derive(Encode, Decode, Debug, Clone)]
+#[derive(Encode, Decode, Debug, Clone, PartialEq)]
 pub struct DevicesInfo {
     //pod info
     pub num: u16,
@@ -274,6 +278,230 @@ pub enum CommandV1 {
         status: DownloadStatus,
         error: Option<String>,
     },
+
+    // Numeric handle for a dispatched task, sent from server to client just
+    // before the task to clients whose login version is at least
+    // COMPACT_CHUNK_MIN_VERSION. New variants go last to keep bincode tags stable.
+    TaskHandle {
+        task_id: String,
+        handle: u32,
+    },
+
+    // Compact InferenceResultChunk addressed by TaskHandle; `end` is set on
+    // the final chunk only.
+    InferenceResultChunkCompact {
+        handle: u32,
+        seq: u32,
+        delta: String,
+        phase: OutputPhase,
+        end: Option<ChunkEnd>,
+    },
+
+    // Per-task decode options, sent from server to client just before a
+    // ChatInferenceTask to clients whose login version is at least
+    // SPECULATIVE_MIN_VERSION. `draft_tokens` > 0 asks for speculative
+    // decoding with up to that many draft tokens per step.
+    TaskDecodeOptions {
+        task_id: String,
+        draft_tokens: u32,
+    },
+
+    // Speculative decoding counters for a task that received
+    // TaskDecodeOptions, sent from client to server just before its final
+    // result chunk.
+    TaskDecodeStats {
+        task_id: String,
+        draft_tokens: u32,
+        accepted_tokens: u32,
+    },
+
+    // Sent from server to client just before LoginResult to clients whose
+    // login version is at least CONTEXT_PROFILE_MIN_VERSION; the client
+    // answers with ContextProfile.
+    RequestContextProfile,
+
+    // Context settings the client chose for its hardware, sent from client
+    // to server in reply to RequestContextProfile.
+    ContextProfile {
+        client_id: [u8; 16],
+        profile: ContextProfile,
+    },
+
+    // Sent from server to client just before LoginResult to clients whose
+    // login version is at least DEVICE_STATE_MIN_VERSION; the client then
+    // reports DeviceState with every heartbeat and whenever its level changes.
+    RequestDeviceState,
+
+    // Thermal and battery state of a client that received
+    // RequestDeviceState. `temp_c` is 0 and `battery_pct` 255 when unknown.
+    DeviceState {
+        client_id: [u8; 16],
+        level: ThrottleLevel,
+        temp_c: u32,
+        battery_pct: u8,
+        charging: bool,
+    },
+
+    // Sent from server to client just before LoginResult to clients whose
+    // login version is at least LOAD_BEACON_MIN_VERSION. The client then
+    // sends LoadBeacon when its load changes, at most every `interval_ms`,
+    // and may send Heartbeat with empty `devices_info` while its device
+    // inventory is unchanged.
+    RequestLoadBeacon {
+        interval_ms: u32,
+    },
+
+    // Load changes since the client's previous Heartbeat or LoadBeacon, sent
+    // over the logged-in connection that received RequestLoadBeacon.
+    LoadBeacon {
+        delta: LoadDelta,
+    },
+
+    // Sent from server to client just before LoginResult to clients whose
+    // login version is at least TASK_TIMINGS_MIN_VERSION. The client then
+    // sends TaskTimings just before the final result chunk of every task.
+    RequestTaskTimings,
+
+    // Worker-side stage times of a task, sent over the logged-in connection
+    // that received RequestTaskTimings.
+    TaskTimings {
+        task_id: String,
+        timings: TaskTimings,
+    },
+}
+
+/// Completion details carried by the last compact result chunk.
+#[derive(Encode, Decode, Debug, Clone, Default)]
+pub struct ChunkEnd {
+    pub error: Option<String>,
+    pub prompt_tokens: u32,
+    pub completion_tokens: u32,
+    pub analysis_tokens: u32,
+    pub final_tokens: u32,
+}
+
+/// Worker-side stage times of one task, in microseconds from when the worker
+/// read it; 0 for a stage the task did not reach.
+#[derive(Encode, Decode, Debug, Clone, Default, PartialEq, Eq)]
+pub struct TaskTimings {
+    /// Prompt text built, chat template applied.
+    pub prompt_ready_us: u32,
+    /// Prompt tokenized and queued for decoding.
+    pub submitted_us: u32,
+    /// First token sampled; prefill ends here.
+    pub first_token_us: u32,
+    /// Every [`TIMING_TOKEN_STRIDE`]th token after the first.
+    pub token_marks_us: Vec<u32>,
+    /// Last token sampled.
+    pub done_us: u32,
+}
+
+/// Tokens between two entries of [`TaskTimings::token_marks_us`].
+pub const TIMING_TOKEN_STRIDE: u32 = 16;
+
+/// Lowest client protocol version that understands TaskHandle and sends
+/// InferenceResultChunkCompact.
+pub const COMPACT_CHUNK_MIN_VERSION: u32 = 2;
+
+/// Lowest client protocol version that understands TaskDecodeOptions and
+/// reports TaskDecodeStats.
+pub const SPECULATIVE_MIN_VERSION: u32 = 4;
+
+/// Lowest client protocol version that answers RequestContextProfile.
+pub const CONTEXT_PROFILE_MIN_VERSION: u32 = 5;
+
+/// Lowest client protocol version that answers RequestDeviceState.
+pub const DEVICE_STATE_MIN_VERSION: u32 = 6;
+
+/// Lowest client protocol version that answers RequestLoadBeacon.
+pub const LOAD_BEACON_MIN_VERSION: u32 = 7;
+
+/// Lowest client protocol version that answers RequestTaskTimings.
+pub const TASK_TIMINGS_MIN_VERSION: u32 = 8;
+
+/// Element type of the KV cache.
+#[derive(Encode, Decode, Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+pub enum KvCacheType {
+    F16,
+    Q8_0,
+    Q4_0,
+}
+
+impl KvCacheType {
+    /// The matching `enum ggml_type` value.
+    pub fn ggml_type(self) -> i32 {
+        match self {
+            Self::F16 => 1,
+            Self::Q4_0 => 2,
+            Self::Q8_0 => 8,
+        }
+    }
+}
+
+/// llama.cpp context settings a client derived from its memory, cores and
+/// thermal state.
+#[derive(Encode, Decode, Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+pub struct ContextProfile {
+    pub n_ctx: u32,
+    pub n_batch: u32,
+    pub n_ubatch: u32,
+    pub n_threads: u32,
+    pub n_threads_batch: u32,
+    pub kv_cache: KvCacheType,
+}
+
+/// How hard a client is throttling for heat or battery, from least to most.
+#[derive(
+    Encode, Decode, Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Serialize, Deserialize,
+)]
+pub enum ThrottleLevel {
+    Normal,
+    Warm,
+    /// Fewer threads and paced decoding.
+    Hot,
+    /// Refuses new tasks until it cools down or is charged.
+    Critical,
+}
+
+impl Default for ThrottleLevel {
+    fn default() -> Self {
+        Self::Normal
+    }
+}
+
+impl ThrottleLevel {
+    pub fn as_u8(self) -> u8 {
+        self as u8
+    }
+
+    pub fn from_u8(v: u8) -> Self {
+        match v {
+            0 => Self::Normal,
+            1 => Self::Warm,
+            2 => Self::Hot,
+            _ => Self::Critical,
+        }
+    }
+}
+
+/// Load figures carried by LoadBeacon; `None` fields are unchanged.
+#[derive(Encode, Decode, Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct LoadDelta {
+    pub cpu_usage: Option<u8>,
+    pub memory_usage: Option<u8>,
+    /// Sequences decoding on the device.
+    pub inflight: Option<u16>,
+    /// Sequences waiting for a decode slot.
+    pub queued: Option<u16>,
+    /// Recent decode throughput in tenths of a token per second.
+    pub tokens_per_sec_x10: Option<u32>,
+    pub throttle: Option<ThrottleLevel>,
+}
+
+impl LoadDelta {
+    pub fn is_empty(&self) -> bool {
+        *self == Self::default()
+    }
 }
 
 #[derive(Encode, Decode, Debug, Clone)]
@@ -365,8 +593,58 @@ pub enum CommandV2 {
         connection_id: [u8; 16],
         error: String,
     },
+
+    /// gpuf-c tells gpuf-s which pieces of a model file it can serve to peers.
+    /// `have` is a bitmap (bit i of byte i / 8, LSB first); `piece_hashes` is
+    /// only sent once the whole file has passed its checksum.
+    ModelPiecesAvailable {
+        checksum: String,
+        total_size: u64,
+        piece_size: u32,
+        have: Vec<u8>,
+        piece_hashes: Vec<[u8; 32]>,
+        seed_port: u16,
+        seed_addrs: Vec<String>,
+    },
+
+    /// gpuf-s sends peers holding a model just before the LoginResult or
+    /// PullModelResult naming it, to clients whose login version is at least
+    /// MODEL_PEERS_MIN_VERSION.
+    ModelPeers {
+        checksum: String,
+        total_size: u64,
+        piece_size: u32,
+        piece_hashes: Vec<[u8; 32]>,
+        peers: Vec<ModelPeer>,
+    },
+
+    /// Peer to seed, on a gpuf-c seed port.
+    ModelPieceRequest {
+        checksum: String,
+        index: u32,
+    },
+
+    /// Seed to peer; `len` raw bytes of the piece follow when `error` is None.
+    ModelPieceResponse {
+        index: u32,
+        len: u32,
+        error: Option<String>,
+    },
 }
 
+/// A worker that holds some pieces of a model file.
+#[derive(Encode, Decode, Debug, Clone, PartialEq)]
+pub struct ModelPeer {
+    pub client_id: [u8; 16],
+    /// `ip:port` seed addresses, nearest first.
+    pub addrs: Vec<String>,
+    pub have: Vec<u8>,
+}
+
+/// Lowest client protocol version that understands ModelPeers and serves
+/// ModelPieceRequest.
+pub const MODEL_PEERS_MIN_VERSION: u32 = 3;
+
 #[derive(Encode, Decode, Debug, Clone, PartialEq)]
 pub struct P2PCandidate {
     pub candidate_type: P2PCandidateType,
@@ -451,106 +729,165 @@ pub fn process_id(id: &[u8; 32]) -> &str {
 // Max message size 10MB
 pub const MAX_MESSAGE_SIZE: usize = 10 * 1024 * 1024;
 
-/// Reads a command from an async reader.
-/// The format is a 4-byte length prefix (u32) followed by the bin-encoded command.
-pub async fn read_command<R: AsyncRead + Unpin>(
-    reader: &mut R,
-    buf: &mut BytesMut,
-) -> Result<Command> {
-    let mut len_buf = [0u8; 4];
-    reader.read_exact(&mut len_buf).await?;
-    let len = u32::from_be_bytes(len_buf) as usize;
+fn frame_config() -> impl bincode_config::Config {
+    bincode_config::standard()
+        .with_fixed_int_encoding()
+        .with_little_endian()
+}
+
+// Frame buffers kept per thread so encoding reuses capacity instead of
+// allocating per command. Oversized buffers are dropped rather than cached.
+const FRAME_BUF_POOL: usize = 4;
+const FRAME_BUF_KEEP: usize = 256 * 1024;
+
+thread_local! {
+    static FRAME_BUFS: RefCell<Vec<Vec<u8>>> = const { RefCell::new(Vec::new()) };
+}
+
+fn take_frame_buf() -> Vec<u8> {
+    FRAME_BUFS
+        .with(|bufs| bufs.borrow_mut().pop())
+        .unwrap_or_default()
+}
+
+fn put_frame_buf(mut buf: Vec<u8>) {
+    if buf.capacity() > FRAME_BUF_KEEP {
+        return;
+    }
+    buf.clear();
+    FRAME_BUFS.with(|bufs| {
+        let mut bufs = bufs.borrow_mut();
+        if bufs.len() < FRAME_BUF_POOL {
+            bufs.push(buf);
+        }
+    });
+}
+
+/// Appends one length-prefixed frame for `command` to `buf`.
+/// The payload is encoded in place after a placeholder prefix, so the whole
+/// frame goes out in a single write.
+pub fn encode_frame(buf: &mut Vec<u8>, command: &Command) -> Result<()> {
+    let start = buf.len();
+    buf.extend_from_slice(&[0u8; 4]);
+    if let Err(e) = bincode::encode_into_std_write(command, &mut *buf, frame_config()) {
+        buf.truncate(start);
+        return Err(e.into());
+    }
+    let len = buf.len() - start - 4;
     if len > MAX_MESSAGE_SIZE {
         warn!(
-            "read_command: Message too large: {} bytes (max: {} bytes)",
+            "encode_frame: Message too large: {} bytes (max: {} bytes)",
             len, MAX_MESSAGE_SIZE
         );
+        buf.truncate(start);
         return Err(anyhow!("Message too large"));
     }
+    buf[start..start + 4].copy_from_slice(&(len as u32).to_be_bytes());
+    Ok(())
+}
 
-    let config = bincode_config::standard()
-        .with_fixed_int_encoding()
-        .with_little_endian();
-
-    buf.clear();
-    buf.resize(len, 0);
-    reader.read_exact(buf).await?;
-
-    let (command, _) = bincode::decode_from_slice(buf.as_ref(), config)
+fn decode_frame(payload: &[u8]) -> Result<Command> {
+    let (command, _) = bincode::decode_from_slice(payload, frame_config())
         .map_err(|e| anyhow!("Failed to deserialize command: {}", e))?;
     Ok(command)
 }
 
-/// Writes a command to an async writer.
-/// The format is a 4-byte length prefix (u32) followed by the JSON-encoded command.
-pub async fn write_command<W: AsyncWrite + Unpin>(writer: &mut W, command: &Command) -> Result<()> {
-    let config = bincode_config::standard()
-        .with_fixed_int_encoding()
-        .with_little_endian();
-    let buf = bincode::encode_to_vec(command, config)?;
-    let len = buf.len() as u32;
-    if len as usize > MAX_MESSAGE_SIZE {
+fn check_frame_len(len: usize, caller: &str) -> Result<()> {
+    if len > MAX_MESSAGE_SIZE {
         warn!(
-            "write_command: Message too large: {} bytes (max: {} bytes)",
-            len, MAX_MESSAGE_SIZE
+            "{}: Message too large: {} bytes (max: {} bytes)",
+            caller, len, MAX_MESSAGE_SIZE
         );
         return Err(anyhow!("Message too large"));
     }
-
-    writer.write_all(&len.to_be_bytes()).await?;
-    writer.write_all(&buf).await?;
-    writer.flush().await?;
     Ok(())
 }
 
-/// Synchronous version: Reads a command from a blocking reader.
-/// The format is a 4-byte length prefix (u32) followed by the bincode-encoded command.
-pub fn read_command_sync<R: std::io::Read>(reader: &mut R) -> Result<Command> {
+/// Reads a command from an async reader.
+/// The format is a 4-byte length prefix (u32) followed by the bin-encoded command.
+/// The payload is read straight into the spare capacity of `buf`; keep one
+/// `buf` per connection so its capacity is reused across frames.
+pub async fn read_command<R: AsyncRead + Unpin>(
+    reader: &mut R,
+    buf: &mut BytesMut,
+) -> Result<Command> {
     let mut len_buf = [0u8; 4];
-    reader.read_exact(&mut len_buf)?;
+    reader.read_exact(&mut len_buf).await?;
     let len = u32::from_be_bytes(len_buf) as usize;
+    check_frame_len(len, "read_command")?;
 
-    if len > MAX_MESSAGE_SIZE {
-        warn!(
-            "read_command_sync: Message too large: {} bytes (max: {} bytes)",
-            len, MAX_MESSAGE_SIZE
-        );
-        return Err(anyhow!("Message too large"));
+    buf.clear();
+    buf.reserve(len);
+    while buf.len() < len {
+        let mut limited = (&mut *reader).take((len - buf.len()) as u64);
+        if limited.read_buf(buf).await? == 0 {
+            return Err(std::io::Error::from(std::io::ErrorKind::UnexpectedEof).into());
+        }
     }
 
-    let config = bincode_config::standard()
-        .with_fixed_int_encoding()
-        .with_little_endian();
+    decode_frame(buf.as_ref())
+}
 
-    let mut buf = vec![0u8; len];
-    reader.read_exact(&mut buf)?;
+/// Writes a command to an async writer.
+/// The format is a 4-byte length prefix (u32) followed by the bincode-encoded command.
+pub async fn write_command<W: AsyncWrite + Unpin>(writer: &mut W, command: &Command) -> Result<()> {
+    write_commands(writer, std::slice::from_ref(command)).await
+}
 
-    let (command, _) = bincode::decode_from_slice(&buf, config)
-        .map_err(|e| anyhow!("Failed to deserialize command: {}", e))?;
-    Ok(command)
+/// Writes several commands with one write and one flush.
+/// Use this when frames are queued back to back, e.g. a header command
+/// followed by the task it describes.
+pub async fn write_commands<W: AsyncWrite + Unpin>(
+    writer: &mut W,
+    commands: &[Command],
+) -> Result<()> {
+    let mut buf = take_frame_buf();
+    let result = async {
+        for command in commands {
+            encode_frame(&mut buf, command)?;
+        }
+        writer.write_all(&buf).await?;
+        writer.flush().await?;
+        Ok::<(), anyhow::Error>(())
+    }
+    .await;
+    put_frame_buf(buf);
+    result
+}
+
+/// Synchronous version: Reads a command from a blocking reader.
+/// The format is a 4-byte length prefix (u32) followed by the bincode-encoded command.
+pub fn read_command_sync<R: std::io::Read>(reader: &mut R) -> Result<Command> {
+    let mut len_buf = [0u8; 4];
+    reader.read_exact(&mut len_buf)?;
+    let len = u32::from_be_bytes(len_buf) as usize;
+    check_frame_len(len, "read_command_sync")?;
+
+    let mut buf = take_frame_buf();
+    let result = (|| -> Result<Command> {
+        buf.reserve(len);
+        std::io::Read::read_to_end(&mut std::io::Read::take(&mut *reader, len as u64), &mut buf)?;
+        if buf.len() < len {
+            return Err(std::io::Error::from(std::io::ErrorKind::UnexpectedEof).into());
+        }
+        decode_frame(&buf)
+    })();
+    put_frame_buf(buf);
+    result
 }
 
 /// Synchronous version: Writes a command to a blocking writer.
 /// The format is a 4-byte length prefix (u32) followed by the bincode-encoded command.
 pub fn write_command_sync<W: std::io::Write>(writer: &mut W, command: &Command) -> Result<()> {
-    let config = bincode_config::standard()
-        .with_fixed_int_encoding()
-        .with_little_endian();
-    let buf = bincode::encode_to_vec(command, config)?;
-    let len = buf.len() as u32;
-
-    if len as usize > MAX_MESSAGE_SIZE {
-        warn!(
-            "write_command_sync: Message too large: {} bytes (max: {} bytes)",
-            len, MAX_MESSAGE_SIZE
-        );
-        return Err(anyhow!("Message too large"));
-    }
-
-    writer.write_all(&len.to_be_bytes())?;
-    writer.write_all(&buf)?;
-    writer.flush()?;
-    Ok(())
+    let mut buf = take_frame_buf();
+    let result = (|| -> Result<()> {
+        encode_frame(&mut buf, command)?;
+        writer.write_all(&buf)?;
+        writer.flush()?;
+        Ok(())
+    })();
+    put_frame_buf(buf);
+    result
 }
 
 /// Joins two streams, copying data in both directions.
@@ -559,24 +896,9 @@ where
     A: AsyncRead + AsyncWrite + Unpin,
     B: AsyncRead + AsyncWrite + Unpin,
 {
-    let (mut a_reader, mut a_writer) = tokio::io::split(a);
-    let (mut b_reader, mut b_writer) = tokio::io::split(b);
-    let a_to_b = async {
-        let result = tokio::io::copy(&mut a_reader, &mut b_writer).await;
-        let _ = b_writer.shutdown().await;
-        result
-    };
-
-    let b_to_a = async {
-        let result = tokio::io::copy(&mut b_reader, &mut a_writer).await;
-        let _ = a_writer.shutdown().await;
-        result
-    };
-    tokio::select! {
-        res = a_to_b => res?,
-        res = b_to_a => res?,
-    };
-    Ok(())
+    let mut a_to_b = BytesMut::with_capacity(relay::RELAY_BUFFER_SIZE);
+    let mut b_to_a = BytesMut::with_capacity(relay::RELAY_BUFFER_SIZE);
+    relay::join_streams_with_buffers(a, b, &mut a_to_b, &mut b_to_a).await
 }
 
 //TODO: vendor to id apple and apple
@@ -717,6 +1039,40 @@ fn test_format_bytes() {
     assert_eq!(value, value2);
 }
 
+#[tokio::test]
+async fn test_write_commands_batches_frames() {
+    let cancel = |id: &str| {
+        Command::V1(CommandV1::CancelInference {
+            task_id: id.to_string(),
+        })
+    };
+    let mut wire: Vec<u8> = Vec::new();
+    write_commands(&mut wire, &[cancel("a"), cancel("b")])
+        .await
+        .unwrap();
+    write_command_sync(&mut wire, &cancel("c")).unwrap();
+
+    let mut reader = std::io::Cursor::new(&wire[..]);
+    let mut read_buf = BytesMut::new();
+    for expected in ["a", "b", "c"] {
+        match read_command(&mut reader, &mut read_buf).await.unwrap() {
+            Command::V1(CommandV1::CancelInference { task_id }) => assert_eq!(task_id, expected),
+            other => panic!("unexpected {:?}", other),
+        }
+    }
+
+    // A truncated payload surfaces as EOF, like a dropped connection.
+    let mut short = std::io::Cursor::new(&wire[..wire.len() - 1]);
+    for _ in 0..2 {
+        read_command_sync(&mut short).unwrap();
+    }
+    let err = read_command_sync(&mut short).unwrap_err();
+    assert_eq!(
+        err.downcast_ref::<std::io::Error>().map(|e| e.kind()),
+        Some(std::io::ErrorKind::UnexpectedEof)
+    );
+}
+
 #[tokio::test]
 async fn test_command_serialization_roundtrip() {
     // Create a Vec<u8> buffer for writing
@@ -0,0 +1,407 @@
+//! Incremental multi-pattern matching over streamed text.
+//!
+//! Stop sequences and phase markers (`<think>`, `Final:`, ...) have to be
+//! found in text that arrives a token at a time, with markers split across
+//! tokens. Re-joining a carry with each token and running `str::find` once
+//! per pattern allocates per token and rescans the same bytes. A
+//! [`MarkerSet`] compiles the patterns once into an Aho-Corasick automaton
+//! with a dense transition table, and a [`MarkerStream`] feeds each byte
+//! through it exactly once. The depth of the automaton's state is the length
+//! of the longest tail that could still grow into a marker, so that is all a
+//! stream holds back: never more than the longest pattern.
+
+use crate::OutputPhase;
+use std::ops::Range;
+use std::sync::OnceLock;
+
+const ROOT: u16 = 0;
+/// Marks a missing trie edge while the automaton is built.
+const NONE: u16 = u16::MAX;
+
+/// Bytes that end a plain `final` / `analysis` line marker. `:` is not here
+/// because `final:` and `analysis:` are markers of their own that consume it.
+const WORD_BOUNDARY: [u8; 4] = [b' ', b'\n', b'\r', b'\t'];
+
+#[derive(Debug, Clone, Copy)]
+struct Pattern<T> {
+    /// Bytes matched, including the context around the marker.
+    len: u16,
+    /// Context bytes before the marker (a `\n` for line markers).
+    lead: u16,
+    /// Context bytes after the marker, left in the text.
+    trail: u16,
+    tag: T,
+    /// State to continue from after a match, with the trail already fed.
+    resume: u16,
+}
+
+/// A compiled set of markers, each carrying a tag reported on a match.
+///
+/// Where several markers complete at the same byte the longest wins, and a
+/// marker is reported as soon as its last byte arrives, so the earliest
+/// ending match is taken.
+#[derive(Debug)]
+pub struct MarkerSet<T> {
+    next: Vec<[u16; 256]>,
+    depth: Vec<u16>,
+    /// Pattern (index + 1) completed on entering each state, 0 for none.
+    hit: Vec<u16>,
+    patterns: Vec<Pattern<T>>,
+    /// State a stream starts in, and resumes in after a match.
+    start: u16,
+}
+
+impl<T: Copy> MarkerSet<T> {
+    /// Markers matched anywhere in the text.
+    pub fn new(markers: &[(&str, T)]) -> Self {
+        let specs = markers
+            .iter()
+            .map(|(m, tag)| (m.as_bytes().to_vec(), 0, 0, *tag))
+            .collect();
+        Self::build(specs, false)
+    }
+
+    /// Length of the longest pattern, which bounds what a stream holds back.
+    pub fn max_len(&self) -> usize {
+        self.patterns
+            .iter()
+            .map(|p| p.len as usize)
+            .max()
+            .unwrap_or(0)
+    }
+
+    /// Build from `(bytes, lead, trail, tag)` specs. With `line_start` the
+    /// text is treated as if preceded by a newline, so line markers (which
+    /// lead with `\n`) also match at the very start and right after another
+    /// marker.
+    fn build(specs: Vec<(Vec<u8>, u16, u16, T)>, line_start: bool) -> Self {
+        let mut next: Vec<[u16; 256]> = vec![[NONE; 256]];
+        let mut depth: Vec<u16> = vec![0];
+        let mut term: Vec<u16> = vec![0];
+        for (i, (bytes, ..)) in specs.iter().enumerate() {
+            let mut s = ROOT as usize;
+            for &b in bytes {
+                if next[s][b as usize] == NONE {
+                    assert!(next.len() < NONE as usize, "too many marker states");
+                    next[s][b as usize] = next.len() as u16;
+                    next.push([NONE; 256]);
+                    depth.push(depth[s] + 1);
+                    term.push(0);
+                }
+                s = next[s][b as usize] as usize;
+            }
+            if term[s] == 0 {
+                term[s] = i as u16 + 1;
+            }
+        }
+
+        // Breadth-first, so a state's failure target is complete before its
+        // own missing edges are copied from it.
+        let mut fail = vec![ROOT; next.len()];
+        let mut hit = term.clone();
+        let mut queue = std::collections::VecDeque::new();
+        for b in 0..256 {
+            match next[0][b] {
+                NONE => next[0][b] = ROOT,
+                child => queue.push_back(child),
+            }
+        }
+        while let Some(s) = queue.pop_front() {
+            let s = s as usize;
+            for b in 0..256 {
+                let f = fail[s] as usize;
+                match next[s][b] {
+                    NONE => next[s][b] = next[f][b],
+                    child => {
+                        let c = child as usize;
+                        fail[c] = next[f][b];
+                        // The state's own pattern is the longest ending here.
+                        if hit[c] == 0 {
+                            hit[c] = hit[fail[c] as usize];
+                        }
+                        queue.push_back(child);
+                    }
+                }
+            }
+        }
+
+        let mut set = Self {
+            next,
+            depth,
+            hit,
+            patterns: Vec::with_capacity(specs.len()),
+            start: ROOT,
+        };
+        if line_start {
+            set.start = set.step(ROOT, b'\n');
+        }
+        for (bytes, lead, trail, tag) in specs {
+            let resume = bytes[bytes.len() - trail as usize..]
+                .iter()
+                .fold(set.start, |s, &b| set.step(s, b));
+            set.patterns.push(Pattern {
+                len: bytes.len() as u16,
+                lead,
+                trail,
+                tag,
+                resume,
+            });
+        }
+        set
+    }
+
+    #[inline]
+    fn step(&self, state: u16, byte: u8) -> u16 {
+        self.next[state as usize][byte as usize]
+    }
+}
+
+/// Output of [`MarkerStream::push`], in text order.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Piece<'a, T> {
+    Text(&'a str),
+    Marker(T),
+}
+
+#[derive(Debug, Clone)]
+enum Span<T> {
+    Text(Range<usize>),
+    Marker(T),
+}
+
+/// Streaming matcher over one `MarkerSet`. The buffer and span list are
+/// reused, so after the first few tokens pushing allocates nothing.
+#[derive(Debug)]
+pub struct MarkerStream<T: 'static> {
+    set: &'static MarkerSet<T>,
+    state: u16,
+    buf: String,
+    /// Bytes at the front of `buf` handed out by the previous push.
+    spent: usize,
+    spans: Vec<Span<T>>,
+}
+
+impl<T: Copy + 'static> MarkerStream<T> {
+    pub fn new(set: &'static MarkerSet<T>) -> Self {
+        Self {
+            set,
+            state: set.start,
+            buf: String::new(),
+            spent: 0,
+            spans: Vec::new(),
+        }
+    }
+
+    /// Scan `text` and return it split around the markers found. A tail that
+    /// may still turn into a marker is held back for the next push.
+    pub fn push(&mut self, text: &str) -> impl Iterator<Item = Piece<'_, T>> {
+        self.scan(text);
+        self.pieces()
+    }
+
+    fn scan(&mut self, text: &str) {
+        let set = self.set;
+        self.buf.drain(..self.spent);
+        self.spans.clear();
+        let scanned = self.buf.len();
+        self.buf.push_str(text);
+
+        // Start of the text not yet handed out.
+        let mut from = 0;
+        for (i, &b) in self.buf.as_bytes().iter().enumerate().skip(scanned) {
+            self.state = set.step(self.state, b);
+            let hit = set.hit[self.state as usize];
+            if hit == 0 {
+                continue;
+            }
+            let p = &set.patterns[hit as usize - 1];
+            let end = i + 1;
+            // Computed from the end: a line marker's lead may be the
+            // newline assumed before the stream, which is not in `buf`.
+            let marker_start = end - (p.len - p.lead) as usize;
+            if marker_start > from {
+                self.spans.push(Span::Text(from..marker_start));
+            }
+            self.spans.push(Span::Marker(p.tag));
+            from = end - p.trail as usize;
+            self.state = p.resume;
+        }
+
+        let len = self.buf.len();
+        let held = (set.depth[self.state as usize] as usize).min(len - from);
+        let mut keep = len - held;
+        while !self.buf.is_char_boundary(keep) {
+            keep -= 1;
+        }
+        if keep > from {
+            self.spans.push(Span::Text(from..keep));
+        }
+        self.spent = keep;
+    }
+
+    fn pieces(&self) -> impl Iterator<Item = Piece<'_, T>> {
+        let buf = &self.buf;
+        self.spans.iter().map(move |span| match span {
+            Span::Text(r) => Piece::Text(&buf[r.clone()]),
+            Span::Marker(tag) => Piece::Marker(*tag),
+        })
+    }
+
+    /// At the end of the stream, the held-back tail as plain text.
+    pub fn finish(&mut self) -> &str {
+        let from = self.spent;
+        self.spent = self.buf.len();
+        self.state = self.set.start;
+        &self.buf[from..]
+    }
+}
+
+/// Markers switching between analysis and final output: tags anywhere, and
+/// headings or labels at the start of a line.
+pub fn phase_markers() -> &'static MarkerSet<OutputPhase> {
+    static SET: OnceLock<MarkerSet<OutputPhase>> = OnceLock::new();
+    SET.get_or_init(|| {
+        use OutputPhase::{Analysis, Final};
+        let tags = [
+            ("<analysis>", Analysis),
+            ("<think>", Analysis),
+            ("<reasoning>", Analysis),
+            ("<final>", Final),
+            ("</analysis>", Final),
+            ("</think>", Final),
+            ("</reasoning>", Final),
+            ("</final>", Final),
+        ];
+        let lines = [
+            ("### Final", Final),
+            ("Final:", Final),
+            ("final:", Final),
+            ("### Answer", Final),
+            ("### 思考", Analysis),
+            ("思考：", Analysis),
+            ("分析：", Analysis),
+            ("analysis:", Analysis),
+            ("### 答案", Final),
+            ("答案：", Final),
+        ];
+        // Bare words need a boundary after them, so "analysis-based" or
+        // "finally" at the start of a line stay text.
+        let words = [("final", Final), ("analysis", Analysis)];
+
+        let mut specs = Vec::new();
+        for (tag, phase) in tags {
+            specs.push((tag.as_bytes().to_vec(), 0, 0, phase));
+        }
+        for (line, phase) in lines {
+            specs.push(([b"\n", line.as_bytes()].concat(), 1, 0, phase));
+        }
+        for (word, phase) in words {
+            for b in WORD_BOUNDARY {
+                specs.push(([b"\n", word.as_bytes(), &[b]].concat(), 1, 1, phase));
+            }
+        }
+        MarkerSet::build(specs, true)
+    })
+}
+
+/// Splits streamed output into analysis and final segments.
+#[derive(Debug)]
+pub struct PhaseSplitter {
+    stream: MarkerStream<OutputPhase>,
+    phase: OutputPhase,
+}
+
+impl Default for PhaseSplitter {
+    fn default() -> Self {
+        Self {
+            stream: MarkerStream::new(phase_markers()),
+            phase: OutputPhase::Final,
+        }
+    }
+}
+
+impl PhaseSplitter {
+    /// Phase of the text most recently pushed.
+    pub fn phase(&self) -> OutputPhase {
+        self.phase
+    }
+
+    /// Split `text` into segments tagged with their phase; markers are
+    /// dropped from the output.
+    pub fn push(&mut self, text: &str) -> impl Iterator<Item = (OutputPhase, &str)> {
+        let mut phase = self.phase;
+        self.stream.scan(text);
+        // Settle the new phase up front so it is right even if the caller
+        // stops iterating early.
+        for span in &self.stream.spans {
+            if let Span::Marker(to) = span {
+                self.phase = *to;
+            }
+        }
+        self.stream.pieces().filter_map(move |piece| match piece {
+            Piece::Text(s) => Some((phase, s)),
+            Piece::Marker(to) => {
+                phase = to;
+                None
+            }
+        })
+    }
+
+    /// At the end of the stream, the held-back tail, if any.
+    pub fn finish(&mut self) -> Option<(OutputPhase, &str)> {
+        let phase = self.phase;
+        let tail = self.stream.finish();
+        (!tail.is_empty()).then_some((phase, tail))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn split(tokens: &[&str]) -> Vec<(OutputPhase, String)> {
+        let mut splitter = PhaseSplitter::default();
+        let mut out: Vec<(OutputPhase, String)> = Vec::new();
+        let mut add = |phase, s: &str| match out.last_mut() {
+            Some((p, text)) if *p == phase => text.push_str(s),
+            _ => out.push((phase, s.to_string())),
+        };
+        for t in tokens {
+            for (phase, s) in splitter.push(t) {
+                add(phase, s);
+            }
+        }
+        if let Some((phase, s)) = splitter.finish() {
+            add(phase, s);
+        }
+        out
+    }
+
+    #[test]
+    fn test_markers_across_tokens() {
+        use OutputPhase::{Analysis, Final};
+        assert_eq!(
+            split(&["<th", "ink>plan", " it</thi", "nk>", "done"]),
+            vec![(Analysis, "plan it".into()), (Final, "done".into())]
+        );
+        // Line markers only at the start of a line, bare words only before
+        // a boundary.
+        assert_eq!(
+            split(&["analysis", " step\nfinal", "ly\nFin", "al: 42"]),
+            vec![(Analysis, " step\nfinally\n".into()), (Final, " 42".into())]
+        );
+        assert_eq!(
+            split(&["思考：想", "\n答案：好"]),
+            vec![(Analysis, "想\n".into()), (Final, "好".into())]
+        );
+
+        static STOP: OnceLock<MarkerSet<()>> = OnceLock::new();
+        let set = STOP.get_or_init(|| MarkerSet::new(&[("<|eot_id|>", ()), ("\n\n###", ())]));
+        let mut stream = MarkerStream::new(set);
+        let first: Vec<_> = stream.push("hi <|eot").collect();
+        assert_eq!(first, vec![Piece::Text("hi ")]);
+        let second: Vec<_> = stream.push("_id|> more").collect();
+        assert_eq!(second, vec![Piece::Marker(()), Piece::Text(" more")]);
+        assert!(set.max_len() <= 10);
+    }
+}
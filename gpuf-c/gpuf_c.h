@@ -163,8 +163,38 @@ typedef struct gpuf_multimodal_model {
   const struct llama_vocab *vocab;
   bool is_multimodal;
   CString _media_marker;
+  /**
+   * Projector outputs of recently seen images, keyed by pixel hash.
+   */
+  Mutex_VisionCache vision_cache;
 } gpuf_multimodal_model;
 
+/**
+ * Image encoded once by `gpuf_multimodal_encode_image` and reused across
+ * generations; keeps its pixels for tokenization and pins its encoding.
+ */
+typedef struct gpuf_image_embedding gpuf_image_embedding;
+
+/**
+ * Opaque generation session: its own context, KV cache and decode thread on
+ * a shared model.
+ */
+typedef struct gpuf_session gpuf_session;
+
+/**
+ * Context settings for `gpuf_session_create`. Zero fields take the value
+ * from the device profile, as `gpuf_session_default_params` reports it.
+ */
+typedef struct gpuf_session_params {
+  uint32_t n_ctx;
+  uint32_t n_batch;
+  /**
+   * Concurrent sequences decoded together within the session.
+   */
+  uint32_t n_seq_max;
+  int n_threads;
+} gpuf_session_params;
+
 /**
  * Token callback: called for each generated token
  * Parameters: user_data, token_text, token_id
@@ -177,6 +207,13 @@ typedef void (*TokenCallback)(void*, const char*, int);
  */
 typedef void (*CompletionCallback)(void*, const char*, int);
 
+/**
+ * Receives generated text in batches: `len` bytes of UTF-8 (not
+ * NUL-terminated, never split inside a character) completing `n_tokens`
+ * tokens. `data` is only valid during the call; return false to stop.
+ */
+typedef bool (*TokenBatchCallback)(const char *data, int len, int n_tokens, void *user_data);
+
 extern int llama_backend_init(void);
 
 extern void llama_backend_free(void);
@@ -238,6 +275,34 @@ extern int mtmd_helper_eval_chunks(struct MtmdContext *ctx,
 
 extern float *mtmd_get_output_embd(struct MtmdContext *ctx);
 
+extern uintptr_t mtmd_input_chunks_size(const struct MtmdInputChunks *chunks);
+
+extern const void *mtmd_input_chunks_get(const struct MtmdInputChunks *chunks, uintptr_t idx);
+
+extern int mtmd_input_chunk_get_type(const void *chunk);
+
+extern uintptr_t mtmd_input_chunk_get_n_tokens(const void *chunk);
+
+extern int mtmd_helper_eval_chunk_single(struct MtmdContext *ctx,
+                                         struct llama_context *lctx,
+                                         const void *chunk,
+                                         MtmdLlamaPos n_past,
+                                         MtmdLlamaSeqId seq_id,
+                                         int n_batch,
+                                         bool logits_last,
+                                         MtmdLlamaPos *new_n_past);
+
+extern int mtmd_helper_decode_image_chunk(struct MtmdContext *ctx,
+                                          struct llama_context *lctx,
+                                          const void *chunk,
+                                          float *encoded_embd,
+                                          MtmdLlamaPos n_past,
+                                          MtmdLlamaSeqId seq_id,
+                                          int n_batch,
+                                          MtmdLlamaPos *new_n_past);
+
+extern int llama_model_n_embd(const struct llama_model *model);
+
 extern struct llama_sampler *llama_sampler_init_top_k(int k);
 
 extern struct llama_sampler *llama_sampler_init_top_p(float p, uintptr_t min_keep);
@@ -257,6 +322,8 @@ extern int llama_vocab_n_tokens(const struct llama_vocab *vocab);
 
 extern int llama_n_batch(struct llama_context *ctx);
 
+extern uint32_t llama_n_seq_max(const struct llama_context *ctx);
+
 extern struct llama_batch llama_batch_init(int n_tokens, int embd, int n_seq_max);
 
 extern void llama_batch_free(struct llama_batch batch);
@@ -352,7 +419,8 @@ bool gpuf_load_model_async_start(const char *path);
 int32_t gpuf_load_model_get_status(void);
 
 /**
- * Get loading progress (limited but realistic)
+ * Get loading progress; while loading this is llama.cpp's own progress
+ * through the model's tensors
  */
 float gpuf_load_model_get_progress(void);
 
@@ -412,6 +480,9 @@ bool gpuf_is_context_ready(void);
 int gpuf_get_model_status(void);
 
 /**
+ *
+ * Loading a file that is already loaded with the same options returns the
+ * same model; release each result with gpuf_release_model.
  *
  * # Safety
  * `path` must be a valid, NUL-terminated C string pointer and must remain valid for the duration
@@ -419,6 +490,43 @@ int gpuf_get_model_status(void);
  */
 struct llama_model *gpuf_load_model(const char *path);
 
+/**
+ * Set how later gpuf_load_model calls load models. `prefetch` is 0 (off),
+ * 1 (MADV_WILLNEED the tensor data) or 2 (read it in sequentially on a
+ * helper thread). mlock may be refused by RLIMIT_MEMLOCK, in which case
+ * llama.cpp logs a warning and loads unlocked.
+ *
+ * Returns 0 on success, -1 for an unknown prefetch mode.
+ */
+int gpuf_set_model_load_options(bool use_mmap, bool use_mlock, int prefetch);
+
+/**
+ * Drop one use of a model returned by gpuf_load_model, freeing it once no
+ * one else holds it. Contexts created on it must be freed first.
+ */
+void gpuf_release_model(struct llama_model *model);
+
+/**
+ * Load `path` with gpuf_load_model as the draft model for speculative
+ * decoding, replacing any previous one; NULL turns speculation off.
+ * `n_draft` (at most 16) is the draft length used by local generation calls;
+ * remote tasks choose their own. The draft model must share the target's
+ * vocabulary, otherwise sequences decode normally.
+ *
+ * Returns 0 on success, -1 if the model failed to load.
+ *
+ * # Safety
+ * `path` must be NULL or a valid, NUL-terminated C string pointer.
+ */
+int gpuf_set_draft_model(const char *path, int n_draft);
+
+/**
+ * Report the device temperature and battery state for the throttling
+ * governor, for hosts where the library cannot read them (iOS). Pass -1 for
+ * values that are unknown. Reports expire after a minute.
+ */
+void gpuf_report_device_state(int temp_c, int battery_pct, bool charging);
+
 /**
  *
  * # Safety
@@ -475,6 +583,62 @@ int gpuf_generate_multimodal_stream(struct gpuf_multimodal_model *multimodal_mod
 
 void gpuf_free_multimodal_model(struct gpuf_multimodal_model *multimodal_model);
 
+/**
+ * Encode an image once so later generations about it skip the projector.
+ * The encoding also lands in the model's image cache, so passing the same
+ * pixels to `gpuf_generate_multimodal_stream` hits it while it stays cached;
+ * the returned handle keeps it available regardless of eviction.
+ *
+ * Returns null on failure. Release with `gpuf_free_image_embedding`.
+ *
+ * # Safety
+ * - `multimodal_model` must be a valid pointer returned by `gpuf_load_multimodal_model`.
+ * - `image_data` must be a valid pointer to `image_size` bytes of RGB pixels.
+ */
+struct gpuf_image_embedding *gpuf_multimodal_encode_image(struct gpuf_multimodal_model *multimodal_model,
+                                                          const uint8_t *image_data,
+                                                          unsigned long long image_size);
+
+/**
+ * Streaming generation about an image encoded by `gpuf_multimodal_encode_image`.
+ * Behaves like `gpuf_generate_multimodal_stream` without re-running the projector.
+ *
+ * # Safety
+ * - `multimodal_model` must be the model `image` was encoded with.
+ * - `ctx` may be null; if non-null it must be a valid `llama_context` for the model.
+ * - `text_prompt` must be a valid, NUL-terminated C string pointer containing the media marker.
+ * - `image` must be a live handle from `gpuf_multimodal_encode_image`.
+ */
+int gpuf_generate_multimodal_stream_with_image(struct gpuf_multimodal_model *multimodal_model,
+                                               struct llama_context *ctx,
+                                               const char *text_prompt,
+                                               const struct gpuf_image_embedding *image,
+                                               int max_tokens,
+                                               float temperature,
+                                               int top_k,
+                                               float top_p,
+                                               float repeat_penalty,
+                                               TokenCallback on_token,
+                                               CompletionCallback on_complete,
+                                               void *user_data);
+
+/**
+ * # Safety
+ * `image` must be null or a handle from `gpuf_multimodal_encode_image` that
+ * has not been freed yet.
+ */
+void gpuf_free_image_embedding(struct gpuf_image_embedding *image);
+
+/**
+ * Set the byte budget of the model's image-encoding cache, evicting the
+ * least recently used images to fit. Zero disables the cache.
+ *
+ * # Safety
+ * `multimodal_model` must be a valid pointer returned by `gpuf_load_multimodal_model`.
+ */
+int gpuf_multimodal_set_image_cache_bytes(struct gpuf_multimodal_model *multimodal_model,
+                                          unsigned long long bytes);
+
 bool gpuf_multimodal_supports_vision(struct gpuf_multimodal_model *multimodal_model);
 
 int gpuf_get_multimodal_info(struct gpuf_multimodal_model *multimodal_model, bool *has_vision);
@@ -514,9 +678,10 @@ int gpuf_init(void);
 int gpuf_cleanup(void);
 
 /**
- * Stop ongoing generation
+ * Stop the generations the app started on `ctx`, or on every context when
+ * `ctx` is null. Worker tasks on the same context keep running.
  */
-int gpuf_stop_generation(struct llama_context *_ctx);
+int gpuf_stop_generation(struct llama_context *ctx);
 
 /**
  * Start async generation with streaming callback (simplified version)
@@ -531,6 +696,102 @@ int gpuf_start_generation_async(struct llama_context *ctx,
                                 void (*on_token_callback)(const char*, void*),
                                 void *user_data);
 
+/**
+ * Streaming generation that hands text to `on_batch` once `batch_bytes`
+ * have accumulated or `batch_ms` passed since the first pending token, so
+ * a bridge crosses into its runtime once per batch instead of per token.
+ * `batch_ms` of 0 flushes on size only. Runs on the calling thread.
+ *
+ * Returns the number of generated tokens, or -1 on error.
+ *
+ * # Safety
+ * `prompt` must be a valid, NUL-terminated C string pointer.
+ */
+int gpuf_start_generation_batched(struct llama_context *ctx,
+                                  const char *prompt,
+                                  int max_tokens,
+                                  float temperature,
+                                  int top_k,
+                                  float top_p,
+                                  float repeat_penalty,
+                                  int batch_bytes,
+                                  int batch_ms,
+                                  TokenBatchCallback on_batch,
+                                  void *user_data);
+
+struct gpuf_session_params gpuf_session_default_params(void);
+
+/**
+ * Create a session with its own context on `model`. `params` may be null
+ * for the defaults. Models loaded with `gpuf_load_model` stay alive until
+ * the last session on them is freed, so the caller may release its own
+ * reference early.
+ *
+ * Returns null on failure.
+ *
+ * # Safety
+ * `model` must be a valid model pointer and `params`, if not null, must
+ * point to a `gpuf_session_params`.
+ */
+struct gpuf_session *gpuf_session_create(struct llama_model *model,
+                                         const struct gpuf_session_params *params);
+
+/**
+ * Generate a completion into `output` (NUL-terminated, truncated to
+ * `output_len`). Safe to call from several threads on one session; their
+ * sequences are batched together.
+ *
+ * Returns the number of bytes written, or -1 on error.
+ *
+ * # Safety
+ * `session` must come from `gpuf_session_create`, `prompt` must be a valid
+ * NUL-terminated string and `output` must have room for `output_len` bytes.
+ */
+int gpuf_session_generate(struct gpuf_session *session,
+                          const char *prompt,
+                          int max_tokens,
+                          float temperature,
+                          int top_k,
+                          float top_p,
+                          float repeat_penalty,
+                          char *output,
+                          int output_len);
+
+/**
+ * Streaming variant of `gpuf_session_generate` that hands text to
+ * `on_batch` the way `gpuf_start_generation_batched` does.
+ *
+ * Returns the number of generated tokens, or -1 on error.
+ *
+ * # Safety
+ * As for `gpuf_session_generate`.
+ */
+int gpuf_session_generate_batched(struct gpuf_session *session,
+                                  const char *prompt,
+                                  int max_tokens,
+                                  float temperature,
+                                  int top_k,
+                                  float top_p,
+                                  float repeat_penalty,
+                                  int batch_bytes,
+                                  int batch_ms,
+                                  TokenBatchCallback on_batch,
+                                  void *user_data);
+
+/**
+ * Cancel every sequence running on `session`; other sessions are unaffected.
+ */
+void gpuf_session_cancel(struct gpuf_session *session);
+
+/**
+ * Stop the session's engine and free its context. Generation calls still
+ * running on the session return an error.
+ *
+ * # Safety
+ * `session` must come from `gpuf_session_create` and not be used afterwards.
+ */
+void gpuf_session_free(struct gpuf_session *session);
+
 /**
  * Simple single token generation for testing
  */
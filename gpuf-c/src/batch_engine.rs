@@ -0,0 +1,1401 @@
+//! Continuous batching engine for the llama.cpp FFI generation path.
+//!
+//! A single decode thread owns a `llama_context` created with `n_seq_max > 1`.
+//! Every submitted request is assigned its own `seq_id`, sampler chain and
+//! event channel. Each step packs the pending prompt prefill of new sequences
+//! and the next token of every decoding sequence into one `llama_batch`, so
+//! several callers share the context instead of queueing on
+//! `GLOBAL_INFERENCE_MUTEX`.
+//!
+//! Finished sequences keep their KV cells. A new request is placed on the idle
+//! `seq_id` whose cached tokens share the longest prefix with its prompt, and
+//! only the diverging tail is removed and re-prefilled, so follow-up chat turns
+//! skip the system prompt and history.
+//!
+//! With a draft model set (`set_draft_model`), sequences submitted with
+//! `draft_tokens > 0` decode speculatively: the draft model greedily proposes
+//! up to that many tokens, they ride in the same batch as the sequence's next
+//! token, and the target keeps every proposal its own sampler reproduces plus
+//! one token of its own. Output follows the target's sampling exactly; only
+//! the number of target decode steps changes.
+
+use crate::util::governor;
+use crate::{
+    llama_batch, llama_batch_free, llama_batch_init, llama_context, llama_context_default_params,
+    llama_decode, llama_free, llama_get_memory, llama_get_model, llama_init_from_model,
+    llama_memory_clear, llama_memory_seq_rm, llama_model, llama_model_get_vocab, llama_n_batch,
+    llama_n_ctx, llama_n_seq_max, llama_n_threads, llama_sampler, llama_sampler_chain_add,
+    llama_sampler_chain_init, llama_sampler_chain_params, llama_sampler_free,
+    llama_sampler_init_dist, llama_sampler_init_greedy, llama_sampler_init_penalties,
+    llama_sampler_init_temp, llama_sampler_init_top_k, llama_sampler_init_top_p,
+    llama_sampler_sample, llama_set_n_threads, llama_token_to_piece, llama_tokenize, llama_vocab,
+    llama_vocab_is_eog, llama_vocab_n_tokens, LlamaToken, Utf8EmitBuffer, DEFAULT_LLAMA_THREADS,
+};
+use once_cell::sync::Lazy;
+use std::collections::{HashMap, VecDeque};
+use std::ffi::{c_char, c_int, c_void};
+use std::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering};
+use std::sync::mpsc::{self, RecvTimeoutError};
+use std::sync::{Arc, Condvar, Mutex, Weak};
+use std::thread::JoinHandle;
+use std::time::{Duration, Instant};
+
+/// Upper bound on concurrent sequences regardless of what the context allows.
+const MAX_ENGINE_SLOTS: usize = 16;
+const DEFAULT_BATCH_SIZE: c_int = 128;
+/// Upper bound on draft tokens proposed per step.
+pub const MAX_DRAFT_TOKENS: u32 = 16;
+
+#[derive(Debug, Clone, Copy)]
+pub struct SamplingParams {
+    pub temperature: f32,
+    pub top_k: c_int,
+    pub top_p: f32,
+    pub repeat_penalty: f32,
+    /// Draft tokens per step when a draft model is set; 0 decodes normally.
+    pub draft_tokens: u32,
+}
+
+#[derive(Debug)]
+pub enum SequenceEvent {
+    /// A valid UTF-8 piece of generated text.
+    Token(String),
+    Done {
+        prompt_tokens: u32,
+        completion_tokens: u32,
+        /// Draft tokens proposed and kept by the target, for speculative
+        /// sequences.
+        draft_tokens: u32,
+        accepted_tokens: u32,
+    },
+    Error(String),
+}
+
+/// Caller side of a submitted sequence.
+pub struct SequenceHandle {
+    pub events: mpsc::Receiver<SequenceEvent>,
+    cancel: Arc<AtomicBool>,
+}
+
+impl SequenceHandle {
+    /// Ask the engine to stop this sequence after the current step.
+    pub fn cancel(&self) {
+        self.cancel.store(true, Ordering::SeqCst);
+    }
+
+    pub fn is_cancelled(&self) -> bool {
+        self.cancel.load(Ordering::SeqCst)
+    }
+
+    /// Register this sequence under `task_id` so `cancel_task` stops it
+    /// without touching other tasks. Unregistered when the binding drops.
+    pub fn bind_task(&self, task_id: &str) -> TaskBinding {
+        TASK_SEQUENCES
+            .lock()
+            .unwrap_or_else(|e| e.into_inner())
+            .insert(task_id.to_string(), self.cancel.clone());
+        TaskBinding {
+            task_id: task_id.to_string(),
+            cancel: self.cancel.clone(),
+        }
+    }
+
+    /// Let `cancel_app_sequences(ctx)` stop this sequence. For sequences the
+    /// app starts itself; worker tasks use `bind_task` so an app-side stop
+    /// leaves them running. The entry lapses with the sequence.
+    pub fn bind_app(&self, ctx: *mut llama_context) {
+        let mut sequences = APP_SEQUENCES.lock().unwrap_or_else(|e| e.into_inner());
+        sequences.retain(|(_, cancel)| cancel.strong_count() > 0);
+        sequences.push((ContextPtr(ctx), Arc::downgrade(&self.cancel)));
+    }
+
+    /// Drain the sequence, handing its text to `sink` in batches of at most
+    /// `max_bytes` (at least 4, so any character fits), released early once
+    /// `max_delay` has passed since the first pending piece; a zero delay
+    /// disables the time window. `sink` gets the text and the number of
+    /// tokens it completes, and returns false to cancel the sequence.
+    /// Returns the completion token count.
+    pub fn stream_batches(
+        &self,
+        max_bytes: usize,
+        max_delay: Duration,
+        mut sink: impl FnMut(&str, u32) -> bool,
+    ) -> Result<u32, String> {
+        let mut batch = TextBatch {
+            max_bytes: max_bytes.max(4),
+            text: String::new(),
+            tokens: 0,
+            started: None,
+            open: true,
+        };
+        loop {
+            let deadline = batch.started.filter(|_| !max_delay.is_zero());
+            let event = match deadline {
+                Some(started) => {
+                    let wait = (started + max_delay).saturating_duration_since(Instant::now());
+                    match self.events.recv_timeout(wait) {
+                        Ok(event) => Some(event),
+                        Err(RecvTimeoutError::Timeout) => None,
+                        Err(RecvTimeoutError::Disconnected) => {
+                            return Err("batch engine stopped".to_string())
+                        }
+                    }
+                }
+                None => Some(
+                    self.events
+                        .recv()
+                        .map_err(|_| "batch engine stopped".to_string())?,
+                ),
+            };
+            match event {
+                None => batch.flush(&mut sink),
+                Some(SequenceEvent::Token(piece)) => batch.push(&piece, &mut sink),
+                Some(SequenceEvent::Done {
+                    completion_tokens, ..
+                }) => {
+                    batch.flush(&mut sink);
+                    return Ok(completion_tokens);
+                }
+                Some(SequenceEvent::Error(e)) => {
+                    batch.flush(&mut sink);
+                    return Err(e);
+                }
+            }
+            if !batch.open && !self.is_cancelled() {
+                self.cancel();
+            }
+        }
+    }
+}
+
+/// Keeps a sequence reachable by its task id; see `SequenceHandle::bind_task`.
+pub struct TaskBinding {
+    task_id: String,
+    cancel: Arc<AtomicBool>,
+}
+
+impl Drop for TaskBinding {
+    fn drop(&mut self) {
+        let mut tasks = TASK_SEQUENCES.lock().unwrap_or_else(|e| e.into_inner());
+        // A retried task may have rebound the id to a newer sequence.
+        if tasks
+            .get(&self.task_id)
+            .is_some_and(|c| Arc::ptr_eq(c, &self.cancel))
+        {
+            tasks.remove(&self.task_id);
+        }
+    }
+}
+
+/// Pending text for `SequenceHandle::stream_batches`.
+struct TextBatch {
+    max_bytes: usize,
+    text: String,
+    tokens: u32,
+    started: Option<Instant>,
+    /// Cleared once the sink declines more text.
+    open: bool,
+}
+
+impl TextBatch {
+    fn push(&mut self, piece: &str, sink: &mut impl FnMut(&str, u32) -> bool) {
+        if self.text.len() + piece.len() > self.max_bytes {
+            self.flush(sink);
+        }
+        // A piece longer than a whole batch goes out in character-aligned parts.
+        let mut rest = piece;
+        while rest.len() > self.max_bytes {
+            let mut cut = self.max_bytes;
+            while !rest.is_char_boundary(cut) {
+                cut -= 1;
+            }
+            self.text.push_str(&rest[..cut]);
+            self.flush(sink);
+            rest = &rest[cut..];
+        }
+        self.text.push_str(rest);
+        self.tokens += 1;
+        self.started.get_or_insert_with(Instant::now);
+        if self.text.len() >= self.max_bytes {
+            self.flush(sink);
+        }
+    }
+
+    fn flush(&mut self, sink: &mut impl FnMut(&str, u32) -> bool) {
+        if (!self.text.is_empty() || self.tokens > 0) && self.open {
+            self.open = sink(&self.text, self.tokens);
+        }
+        self.text.clear();
+        self.tokens = 0;
+        self.started = None;
+    }
+}
+
+struct PendingSequence {
+    tokens: Vec<LlamaToken>,
+    max_tokens: i32,
+    params: SamplingParams,
+    events: mpsc::Sender<SequenceEvent>,
+    cancel: Arc<AtomicBool>,
+}
+
+struct Slot {
+    seq_id: c_int,
+    prompt: Vec<LlamaToken>,
+    n_prefilled: usize,
+    n_past: i32,
+    sampler: *mut llama_sampler,
+    /// Token sampled in the previous step, fed back on the next decode.
+    next_token: Option<LlamaToken>,
+    /// Index inside the current batch whose logits belong to this slot.
+    i_batch: c_int,
+    generated: i32,
+    max_tokens: i32,
+    /// KV cells this sequence may grow into; see `kv_reservation`.
+    reserved: usize,
+    /// Admission order, so the newest sequence is the one preempted.
+    admitted: u64,
+    draft_tokens: usize,
+    /// Draft tokens queued after `i_batch` in the current batch.
+    drafted: Vec<LlamaToken>,
+    n_drafted: u32,
+    n_accepted: u32,
+    utf8: Utf8EmitBuffer,
+    events: mpsc::Sender<SequenceEvent>,
+    cancel: Arc<AtomicBool>,
+}
+
+#[derive(Clone, Copy, PartialEq, Eq, Hash)]
+struct ContextPtr(*mut llama_context);
+
+// The context is only ever driven from the engine thread.
+unsafe impl Send for ContextPtr {}
+unsafe impl Sync for ContextPtr {}
+
+struct EngineQueue {
+    pending: VecDeque<PendingSequence>,
+    active: Vec<Arc<AtomicBool>>,
+    shutdown: bool,
+    /// Refuse new work and stop once the admitted sequences finish.
+    draining: bool,
+    /// Set when someone cleared the KV cache behind the engine's back.
+    cache_invalid: bool,
+}
+
+/// Tokens resident in the KV cache for each `seq_id`.
+struct PrefixCache {
+    seqs: Vec<Vec<LlamaToken>>,
+    last_used: Vec<u64>,
+    tick: u64,
+}
+
+impl PrefixCache {
+    fn new(n_seqs: usize) -> Self {
+        Self {
+            seqs: vec![Vec::new(); n_seqs],
+            last_used: vec![0; n_seqs],
+            tick: 0,
+        }
+    }
+
+    /// Choose the free sequence that can reuse the most of `prompt`.
+    ///
+    /// Returns `(seq_id, reusable_len)`. The reusable length is capped one
+    /// short of the prompt so the last prompt token is always decoded and
+    /// produces logits. Ties go to the least recently used sequence so hot
+    /// prefixes survive.
+    fn pick(&self, free: &[usize], prompt: &[LlamaToken]) -> (usize, usize) {
+        let mut best = (free[0], 0usize);
+        for &seq in free {
+            let keep = common_prefix_len(&self.seqs[seq], prompt).min(prompt.len() - 1);
+            let better = keep > best.1
+                || (keep == best.1 && self.last_used[seq] < self.last_used[best.0]);
+            if better {
+                best = (seq, keep);
+            }
+        }
+        best
+    }
+
+    /// Idle sequences to drop, oldest first, until `needed` cells fit beside
+    /// the idle ones left. `needed` covers the busy sequences and `keep`.
+    fn evict_for(&self, needed: usize, capacity: usize, keep: usize, busy: &[bool]) -> Vec<usize> {
+        let mut idle: Vec<usize> = (0..self.seqs.len())
+            .filter(|&i| i != keep && !busy[i] && !self.seqs[i].is_empty())
+            .collect();
+        idle.sort_by_key(|&i| self.last_used[i]);
+        let mut resident: usize = idle.iter().map(|&i| self.seqs[i].len()).sum();
+
+        let mut victims = Vec::new();
+        for seq in idle {
+            if resident + needed <= capacity {
+                break;
+            }
+            resident -= self.seqs[seq].len();
+            victims.push(seq);
+        }
+        victims
+    }
+
+    /// The least recently used idle sequence holding tokens.
+    fn oldest_idle(&self, busy: &[bool]) -> Option<usize> {
+        (0..self.seqs.len())
+            .filter(|&i| !busy[i] && !self.seqs[i].is_empty())
+            .min_by_key(|&i| self.last_used[i])
+    }
+
+    fn truncate(&mut self, seq: usize, len: usize) {
+        self.seqs[seq].truncate(len);
+    }
+
+    fn clear(&mut self, seq: usize) {
+        self.seqs[seq].clear();
+    }
+
+    fn clear_all(&mut self) {
+        self.seqs.iter_mut().for_each(|t| t.clear());
+    }
+
+    fn push(&mut self, seq: usize, token: LlamaToken) {
+        self.seqs[seq].push(token);
+    }
+
+    fn touch(&mut self, seq: usize) {
+        self.tick += 1;
+        self.last_used[seq] = self.tick;
+    }
+}
+
+/// KV cells a sequence may occupy by the time it finishes: its prompt plus
+/// every token it may still generate, up to the whole context.
+fn kv_reservation(prompt_len: usize, max_tokens: i32, n_ctx: usize) -> usize {
+    (prompt_len + max_tokens.max(1) as usize).min(n_ctx)
+}
+
+fn common_prefix_len(a: &[LlamaToken], b: &[LlamaToken]) -> usize {
+    a.iter().zip(b).take_while(|(x, y)| x == y).count()
+}
+
+/// A model loaded with `gpuf_load_model` for drafting; released with the
+/// last engine that uses it.
+struct DraftModel(*mut llama_model);
+
+unsafe impl Send for DraftModel {}
+unsafe impl Sync for DraftModel {}
+
+impl Drop for DraftModel {
+    fn drop(&mut self) {
+        crate::gpuf_release_model(self.0);
+    }
+}
+
+/// An engine's draft context, with one sequence per target `seq_id`.
+/// Driven only from the engine thread.
+struct Draft {
+    model: Arc<DraftModel>,
+    ctx: *mut llama_context,
+    mem: *mut c_void,
+    vocab: *const llama_vocab,
+    batch: llama_batch,
+    n_batch: c_int,
+    greedy: *mut llama_sampler,
+    /// Tokens resident in the draft KV cache for each `seq_id`.
+    seqs: Vec<Vec<LlamaToken>>,
+}
+
+impl Draft {
+    /// Create a draft context shaped like `target`. Fails if the draft
+    /// model's vocabulary differs, since its tokens could not be verified.
+    unsafe fn new(
+        model: Arc<DraftModel>,
+        target: *mut llama_context,
+        n_seqs: usize,
+    ) -> Option<Self> {
+        let target_vocab = llama_model_get_vocab(llama_get_model(target));
+        let vocab = llama_model_get_vocab(model.0);
+        if target_vocab.is_null()
+            || vocab.is_null()
+            || llama_vocab_n_tokens(vocab) != llama_vocab_n_tokens(target_vocab)
+        {
+            println!("⚠️ Draft model vocabulary does not match the target; decoding normally");
+            return None;
+        }
+
+        let n_batch = match llama_n_batch(target) {
+            nb if nb > 0 => nb,
+            _ => DEFAULT_BATCH_SIZE,
+        };
+        let mut params = llama_context_default_params();
+        params.n_ctx = llama_n_ctx(target) as u32;
+        params.n_batch = n_batch as u32;
+        params.n_seq_max = n_seqs as u32;
+        params.n_threads = DEFAULT_LLAMA_THREADS;
+        params.n_threads_batch = DEFAULT_LLAMA_THREADS;
+        params.embeddings = false;
+        params.offload_kqv = false;
+        params.kv_unified = true;
+        let ctx = llama_init_from_model(model.0, params);
+        if ctx.is_null() {
+            println!("❌ Failed to create draft context");
+            return None;
+        }
+        println!("🚀 Draft context created: ctx={:p}", ctx);
+
+        Some(Self {
+            model,
+            ctx,
+            mem: llama_get_memory(ctx),
+            vocab,
+            batch: llama_batch_init(n_batch, 0, 1),
+            n_batch,
+            greedy: llama_sampler_init_greedy(),
+            seqs: vec![Vec::new(); n_seqs],
+        })
+    }
+
+    /// Greedily draft up to `n` tokens continuing `history`, the tokens the
+    /// target holds for `seq`. Whatever `history` adds over the draft cache
+    /// is decoded first.
+    unsafe fn propose(&mut self, seq: usize, history: &[LlamaToken], n: usize) -> Vec<LlamaToken> {
+        let seq_id = seq as c_int;
+        let mut keep = common_prefix_len(&self.seqs[seq], history).min(history.len() - 1);
+        if !llama_memory_seq_rm(self.mem, seq_id, keep as i32, -1) {
+            llama_memory_seq_rm(self.mem, seq_id, -1, -1);
+            keep = 0;
+        }
+        self.seqs[seq].truncate(keep);
+
+        // Only the last history token needs logits.
+        while self.seqs[seq].len() < history.len() {
+            self.batch.n_tokens = 0;
+            while self.seqs[seq].len() < history.len() && self.batch.n_tokens < self.n_batch {
+                let pos = self.seqs[seq].len();
+                let last = pos + 1 == history.len();
+                batch_push(&mut self.batch, history[pos], pos as i32, seq_id, last);
+                self.seqs[seq].push(history[pos]);
+            }
+            if llama_decode(self.ctx, self.batch.clone()) != 0 {
+                self.forget(seq);
+                return Vec::new();
+            }
+        }
+
+        let mut drafted = Vec::with_capacity(n);
+        let mut i_logits = self.batch.n_tokens - 1;
+        loop {
+            let token = llama_sampler_sample(self.greedy, self.ctx, i_logits);
+            if llama_vocab_is_eog(self.vocab, token) {
+                break;
+            }
+            drafted.push(token);
+            if drafted.len() == n {
+                break;
+            }
+            self.batch.n_tokens = 0;
+            let pos = self.seqs[seq].len() as i32;
+            batch_push(&mut self.batch, token, pos, seq_id, true);
+            if llama_decode(self.ctx, self.batch.clone()) != 0 {
+                self.forget(seq);
+                break;
+            }
+            self.seqs[seq].push(token);
+            i_logits = 0;
+        }
+        drafted
+    }
+
+    unsafe fn forget(&mut self, seq: usize) {
+        llama_memory_seq_rm(self.mem, seq as c_int, -1, -1);
+        self.seqs[seq].clear();
+    }
+}
+
+impl Drop for Draft {
+    fn drop(&mut self) {
+        unsafe {
+            llama_sampler_free(self.greedy);
+            llama_batch_free(self.batch.clone());
+            llama_free(self.ctx);
+        }
+        // `model` is released after its context.
+    }
+}
+
+pub struct BatchEngine {
+    ctx: ContextPtr,
+    n_slots: usize,
+    queue: Mutex<EngineQueue>,
+    wake: Condvar,
+    thread: Mutex<Option<JoinHandle<()>>>,
+    /// Tokens sampled since the engine started.
+    generated: AtomicU64,
+}
+
+/// Live engines, one per context, so callers on another context never stop
+/// the engine serving the worker's tasks.
+static ENGINES: Lazy<Mutex<HashMap<ContextPtr, Arc<BatchEngine>>>> =
+    Lazy::new(|| Mutex::new(HashMap::new()));
+/// Engines finishing their sequences on a context that was swapped out.
+static RETIRING_ENGINES: Lazy<Mutex<Vec<Arc<BatchEngine>>>> = Lazy::new(|| Mutex::new(Vec::new()));
+static DRAFT_MODEL: Lazy<Mutex<Option<Arc<DraftModel>>>> = Lazy::new(|| Mutex::new(None));
+/// Draft length for FFI generations, which carry no per-task choice.
+static DEFAULT_DRAFT_TOKENS: AtomicU32 = AtomicU32::new(0);
+/// Cancel flags of sequences bound to a task id.
+static TASK_SEQUENCES: Lazy<Mutex<HashMap<String, Arc<AtomicBool>>>> =
+    Lazy::new(|| Mutex::new(HashMap::new()));
+/// Cancel flags of sequences the app started, with their context.
+static APP_SEQUENCES: Lazy<Mutex<Vec<(ContextPtr, Weak<AtomicBool>)>>> =
+    Lazy::new(|| Mutex::new(Vec::new()));
+
+/// Return the engine driving `ctx`, starting it on first use. Each context
+/// gets its own engine; engines on other contexts keep running. A retired
+/// context takes no new work, since its old engine still drives it.
+pub fn engine_for(ctx: *mut llama_context) -> Option<Arc<BatchEngine>> {
+    if ctx.is_null() {
+        return None;
+    }
+    let mut engines = ENGINES.lock().ok()?;
+    if !engines.contains_key(&ContextPtr(ctx))
+        && RETIRING_ENGINES
+            .lock()
+            .map_or(true, |r| r.iter().any(|e| e.ctx == ContextPtr(ctx)))
+    {
+        return None;
+    }
+    let engine = engines
+        .entry(ContextPtr(ctx))
+        .or_insert_with(|| BatchEngine::start(ctx));
+    Some(engine.clone())
+}
+
+/// Stop the engine attached to `ctx` (if any) before the context is freed.
+/// A retiring engine is left to finish its sequences; this waits for it.
+pub fn detach(ctx: *mut llama_context) {
+    let engine = ENGINES
+        .lock()
+        .ok()
+        .and_then(|mut engines| engines.remove(&ContextPtr(ctx)));
+    if let Some(engine) = engine {
+        engine.shutdown();
+    }
+
+    let retiring = RETIRING_ENGINES.lock().ok().and_then(|mut engines| {
+        let i = engines.iter().position(|e| e.ctx == ContextPtr(ctx))?;
+        Some(engines.swap_remove(i))
+    });
+    if let Some(engine) = retiring {
+        engine.join();
+        println!("🛑 Batch engine drained: ctx={:p}", ctx);
+    }
+}
+
+/// Stop taking work on `ctx` but let the sequences already submitted run to
+/// completion, so a model swap does not cut them off. The next `engine_for`
+/// on the context that replaces it starts a fresh engine alongside it.
+pub fn retire(ctx: *mut llama_context) {
+    let engine = ENGINES
+        .lock()
+        .ok()
+        .and_then(|mut engines| engines.remove(&ContextPtr(ctx)));
+    let Some(engine) = engine else { return };
+    if let Ok(mut q) = engine.queue.lock() {
+        q.draining = true;
+    }
+    engine.wake.notify_all();
+    if let Ok(mut engines) = RETIRING_ENGINES.lock() {
+        engines.push(engine);
+    }
+}
+
+/// Cancel the sequences the app started on `ctx` (on any context when null),
+/// including those finishing on a retiring engine. Worker tasks and session
+/// sequences sharing the engine keep running.
+pub fn cancel_app_sequences(ctx: *mut llama_context) {
+    {
+        let sequences = APP_SEQUENCES.lock().unwrap_or_else(|e| e.into_inner());
+        for (seq_ctx, cancel) in sequences.iter() {
+            if ctx.is_null() || *seq_ctx == ContextPtr(ctx) {
+                if let Some(cancel) = cancel.upgrade() {
+                    cancel.store(true, Ordering::SeqCst);
+                }
+            }
+        }
+    }
+    let mut engines: Vec<Arc<BatchEngine>> = ENGINES
+        .lock()
+        .map(|engines| engines.values().cloned().collect())
+        .unwrap_or_default();
+    if let Ok(retiring) = RETIRING_ENGINES.lock() {
+        engines.extend(retiring.iter().cloned());
+    }
+    for engine in engines {
+        if ctx.is_null() || engine.ctx == ContextPtr(ctx) {
+            engine.wake.notify_all();
+        }
+    }
+}
+
+/// Cancel the sequence bound to `task_id`, leaving every other sequence
+/// running. Returns false when no sequence is bound to it.
+pub fn cancel_task(task_id: &str) -> bool {
+    let cancel = TASK_SEQUENCES
+        .lock()
+        .unwrap_or_else(|e| e.into_inner())
+        .get(task_id)
+        .cloned();
+    match cancel {
+        Some(cancel) => {
+            cancel.store(true, Ordering::SeqCst);
+            true
+        }
+        None => false,
+    }
+}
+
+/// Tell the engine on `ctx` that its KV cache was cleared externally, so no
+/// cached prefix may be reused.
+pub fn invalidate_prefix_cache(ctx: *mut llama_context) {
+    let engine = ENGINES
+        .lock()
+        .ok()
+        .and_then(|engines| engines.get(&ContextPtr(ctx)).cloned());
+    if let Some(engine) = engine {
+        if let Ok(mut q) = engine.queue.lock() {
+            q.cache_invalid = true;
+        }
+    }
+}
+
+/// Draft speculative sequences with `model`, taking over the caller's
+/// `gpuf_load_model` reference; null turns speculation off. Engines switch
+/// on their next speculative step, and the previous model is released once
+/// no engine drafts with it. `default_draft_tokens` is used by local
+/// generations.
+pub fn set_draft_model(model: *mut llama_model, default_draft_tokens: u32) {
+    let model = (!model.is_null()).then(|| Arc::new(DraftModel(model)));
+    let enabled = model.is_some();
+    *DRAFT_MODEL.lock().unwrap_or_else(|e| e.into_inner()) = model;
+    let n = if enabled {
+        default_draft_tokens.min(MAX_DRAFT_TOKENS)
+    } else {
+        0
+    };
+    DEFAULT_DRAFT_TOKENS.store(n, Ordering::Relaxed);
+}
+
+/// Sequences running and queued, and tokens generated, across the global
+/// and retiring engines.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct EngineLoad {
+    pub active: u32,
+    pub pending: u32,
+    pub generated: u64,
+}
+
+pub fn load() -> EngineLoad {
+    let mut engines: Vec<Arc<BatchEngine>> = ENGINES
+        .lock()
+        .map(|engines| engines.values().cloned().collect())
+        .unwrap_or_default();
+    if let Ok(retiring) = RETIRING_ENGINES.lock() {
+        engines.extend(retiring.iter().cloned());
+    }
+    let mut load = EngineLoad::default();
+    for engine in engines {
+        if let Ok(q) = engine.queue.lock() {
+            load.active += q.active.len() as u32;
+            load.pending += q.pending.len() as u32;
+        }
+        load.generated += engine.generated.load(Ordering::Relaxed);
+    }
+    load
+}
+
+pub fn default_draft_tokens() -> u32 {
+    DEFAULT_DRAFT_TOKENS.load(Ordering::Relaxed)
+}
+
+fn current_draft_model() -> Option<Arc<DraftModel>> {
+    DRAFT_MODEL
+        .lock()
+        .unwrap_or_else(|e| e.into_inner())
+        .clone()
+}
+
+impl BatchEngine {
+    /// Start an engine on `ctx`. Engines started here rather than through
+    /// `engine_for` belong to the caller, who must `shutdown` them before
+    /// freeing `ctx`.
+    pub(crate) fn start(ctx: *mut llama_context) -> Arc<Self> {
+        let n_seq_max = unsafe { llama_n_seq_max(ctx) } as usize;
+        let n_slots = n_seq_max.clamp(1, MAX_ENGINE_SLOTS);
+
+        let engine = Arc::new(Self {
+            ctx: ContextPtr(ctx),
+            n_slots,
+            queue: Mutex::new(EngineQueue {
+                pending: VecDeque::new(),
+                active: Vec::new(),
+                shutdown: false,
+                draining: false,
+                cache_invalid: false,
+            }),
+            wake: Condvar::new(),
+            thread: Mutex::new(None),
+            generated: AtomicU64::new(0),
+        });
+
+        let worker = engine.clone();
+        let handle = std::thread::Builder::new()
+            .name("gpuf-batch-engine".to_string())
+            .spawn(move || worker.run())
+            .expect("failed to spawn batch engine thread");
+        if let Ok(mut t) = engine.thread.lock() {
+            *t = Some(handle);
+        }
+
+        println!("🚀 Batch engine started: ctx={:p}, slots={}", ctx, n_slots);
+        engine
+    }
+
+    pub fn n_slots(&self) -> usize {
+        self.n_slots
+    }
+
+    /// Tokenize `prompt` on the calling thread and queue it for decoding.
+    pub fn submit(
+        &self,
+        prompt: &str,
+        max_tokens: i32,
+        params: SamplingParams,
+    ) -> Result<SequenceHandle, String> {
+        let tokens = unsafe { tokenize_prompt(self.ctx.0, prompt) }?;
+        self.submit_tokens(tokens, max_tokens, params)
+    }
+
+    pub fn submit_tokens(
+        &self,
+        tokens: Vec<LlamaToken>,
+        max_tokens: i32,
+        params: SamplingParams,
+    ) -> Result<SequenceHandle, String> {
+        if tokens.is_empty() {
+            return Err("empty prompt".to_string());
+        }
+        let (tx, rx) = mpsc::channel();
+        let cancel = Arc::new(AtomicBool::new(false));
+        {
+            let mut q = self.queue.lock().map_err(|_| "engine queue poisoned")?;
+            if q.shutdown || q.draining {
+                return Err("batch engine is shutting down".to_string());
+            }
+            q.pending.push_back(PendingSequence {
+                tokens,
+                max_tokens,
+                params,
+                events: tx,
+                cancel: cancel.clone(),
+            });
+        }
+        self.wake.notify_one();
+        Ok(SequenceHandle { events: rx, cancel })
+    }
+
+    /// Cancel every queued and running sequence on this engine.
+    pub fn cancel_sequences(&self) {
+        if let Ok(q) = self.queue.lock() {
+            for p in q.pending.iter() {
+                p.cancel.store(true, Ordering::SeqCst);
+            }
+            for c in q.active.iter() {
+                c.store(true, Ordering::SeqCst);
+            }
+        }
+        self.wake.notify_all();
+    }
+
+    pub(crate) fn shutdown(&self) {
+        if let Ok(mut q) = self.queue.lock() {
+            q.shutdown = true;
+        }
+        self.wake.notify_all();
+        self.join();
+        println!("🛑 Batch engine stopped: ctx={:p}", self.ctx.0);
+    }
+
+    fn join(&self) {
+        let handle = self.thread.lock().ok().and_then(|mut t| t.take());
+        if let Some(handle) = handle {
+            let _ = handle.join();
+        }
+    }
+
+    fn run(self: Arc<Self>) {
+        let ctx = self.ctx.0;
+        unsafe {
+            let model = llama_get_model(ctx);
+            let vocab = if model.is_null() {
+                std::ptr::null()
+            } else {
+                llama_model_get_vocab(model)
+            };
+            let mem = llama_get_memory(ctx);
+            let n_ctx = llama_n_ctx(ctx);
+            let n_batch = match llama_n_batch(ctx) {
+                nb if nb > 0 => nb,
+                _ => DEFAULT_BATCH_SIZE,
+            };
+            let mut batch = llama_batch_init(n_batch, 0, 1);
+            let base_threads = llama_n_threads(ctx);
+            let mut n_threads = base_threads;
+
+            let mut slots: Vec<Option<Slot>> = (0..self.n_slots).map(|_| None).collect();
+            let mut cache = PrefixCache::new(self.n_slots);
+            let mut draft: Option<Draft> = None;
+            let mut draft_rejected: Weak<DraftModel> = Weak::new();
+            let mut admissions: u64 = 0;
+
+            loop {
+                // Admit queued requests into free slots, or park until work arrives.
+                let shutdown = {
+                    let Ok(mut q) = self.queue.lock() else { break };
+                    while !q.shutdown
+                        && !q.draining
+                        && q.pending.is_empty()
+                        && slots.iter().all(|s| s.is_none())
+                    {
+                        q = match self.wake.wait(q) {
+                            Ok(q) => q,
+                            Err(_) => return,
+                        };
+                    }
+                    if q.cache_invalid {
+                        q.cache_invalid = false;
+                        cache.clear_all();
+                    }
+                    loop {
+                        let free: Vec<usize> =
+                            (0..slots.len()).filter(|&i| slots[i].is_none()).collect();
+                        if free.is_empty() {
+                            break;
+                        }
+                        let Some(req) = q.pending.pop_front() else { break };
+                        if req.cancel.load(Ordering::SeqCst) {
+                            let _ = req.events.send(SequenceEvent::Done {
+                                prompt_tokens: req.tokens.len() as u32,
+                                completion_tokens: 0,
+                                draft_tokens: 0,
+                                accepted_tokens: 0,
+                            });
+                            continue;
+                        }
+                        if req.tokens.len() as i32 >= n_ctx {
+                            let _ = req.events.send(SequenceEvent::Error(format!(
+                                "prompt of {} tokens does not fit context of {}",
+                                req.tokens.len(),
+                                n_ctx
+                            )));
+                            continue;
+                        }
+
+                        // Admit only what fits beside the growth already
+                        // promised to running sequences, so one tenant can
+                        // never run the shared cache out of cells. Later
+                        // requests wait behind this one.
+                        let reserve =
+                            kv_reservation(req.tokens.len(), req.max_tokens, n_ctx as usize);
+                        let reserved: usize = slots.iter().flatten().map(|s| s.reserved).sum();
+                        if reserved + reserve > n_ctx as usize {
+                            q.pending.push_front(req);
+                            break;
+                        }
+
+                        let (seq, keep) = cache.pick(&free, &req.tokens);
+                        let busy: Vec<bool> = slots.iter().map(|s| s.is_some()).collect();
+                        for victim in
+                            cache.evict_for(reserved + reserve, n_ctx as usize, seq, &busy)
+                        {
+                            llama_memory_seq_rm(mem, victim as c_int, -1, -1);
+                            cache.clear(victim);
+                        }
+                        // Drop only the diverging tail of the reused sequence.
+                        if !llama_memory_seq_rm(mem, seq as c_int, keep as i32, -1) {
+                            llama_memory_seq_rm(mem, seq as c_int, -1, -1);
+                            cache.clear(seq);
+                        }
+                        let keep = keep.min(cache.seqs[seq].len());
+                        cache.truncate(seq, keep);
+                        cache.touch(seq);
+                        if keep > 0 {
+                            println!(
+                                "♻️ Batch engine: seq {} reuses {}/{} prompt tokens",
+                                seq,
+                                keep,
+                                req.tokens.len()
+                            );
+                        }
+
+                        q.active.push(req.cancel.clone());
+                        admissions += 1;
+                        slots[seq] = Some(Slot {
+                            seq_id: seq as c_int,
+                            n_prefilled: keep,
+                            n_past: keep as i32,
+                            sampler: build_sampler(req.params),
+                            next_token: None,
+                            i_batch: -1,
+                            generated: 0,
+                            max_tokens: req.max_tokens,
+                            reserved: reserve,
+                            admitted: admissions,
+                            draft_tokens: req.params.draft_tokens.min(MAX_DRAFT_TOKENS) as usize,
+                            drafted: Vec::new(),
+                            n_drafted: 0,
+                            n_accepted: 0,
+                            prompt: req.tokens,
+                            utf8: Utf8EmitBuffer::new(),
+                            events: req.events,
+                            cancel: req.cancel,
+                        });
+                    }
+                    q.shutdown
+                        || (q.draining && q.pending.is_empty() && slots.iter().all(|s| s.is_none()))
+                };
+
+                if shutdown {
+                    for slot in slots.iter_mut() {
+                        if let Some(s) = slot.take() {
+                            finish_slot(mem, s, Some("batch engine stopped".to_string()));
+                        }
+                    }
+                    cache.clear_all();
+                    if let Ok(mut q) = self.queue.lock() {
+                        for p in q.pending.drain(..) {
+                            let _ = p
+                                .events
+                                .send(SequenceEvent::Error("batch engine stopped".to_string()));
+                        }
+                        q.active.clear();
+                    }
+                    break;
+                }
+
+                // Retire cancelled sequences before they take part in another step.
+                for slot in slots.iter_mut() {
+                    let retire = slot
+                        .as_ref()
+                        .map(|s| s.cancel.load(Ordering::SeqCst))
+                        .unwrap_or(false);
+                    if retire {
+                        let s = slot.take().unwrap();
+                        self.forget_active(&s.cancel);
+                        cache.touch(s.seq_id as usize);
+                        finish_slot(mem, s, None);
+                    }
+                }
+
+                let speculating = slots
+                    .iter()
+                    .flatten()
+                    .any(|s| s.draft_tokens > 0 && s.next_token.is_some());
+                if speculating || draft.is_some() {
+                    sync_draft(&mut draft, &mut draft_rejected, ctx, self.n_slots);
+                }
+
+                // What building the batch changes, so a step llama_decode
+                // could not place can be undone.
+                let undo: Vec<Option<(i32, usize, Option<LlamaToken>)>> = slots
+                    .iter()
+                    .map(|s| s.as_ref().map(|s| (s.n_past, s.n_prefilled, s.next_token)))
+                    .collect();
+
+                // Build one batch: one token per decoding slot, followed by its
+                // draft tokens if it speculates, then prefill chunks.
+                batch.n_tokens = 0;
+                let mut decoding = slots
+                    .iter()
+                    .flatten()
+                    .filter(|s| s.next_token.is_some())
+                    .count();
+                for slot in slots.iter_mut().flatten() {
+                    slot.i_batch = -1;
+                    if let Some(token) = slot.next_token.take() {
+                        decoding -= 1;
+                        slot.i_batch = batch.n_tokens;
+                        batch_push(&mut batch, token, slot.n_past, slot.seq_id, true);
+                        cache.push(slot.seq_id as usize, token);
+                        slot.n_past += 1;
+
+                        let Some(d) = draft.as_mut().filter(|_| slot.draft_tokens > 0) else {
+                            continue;
+                        };
+                        // Leave room for the other decoding slots, the context
+                        // and the token the target adds after the drafts.
+                        let room = (n_batch - batch.n_tokens - decoding as c_int)
+                            .min(n_ctx - slot.n_past)
+                            .min(slot.max_tokens - slot.generated - 1);
+                        let n = slot.draft_tokens.min(room.max(0) as usize);
+                        if n == 0 {
+                            continue;
+                        }
+                        let seq = slot.seq_id as usize;
+                        slot.drafted = d.propose(seq, &cache.seqs[seq], n);
+                        for (j, &t) in slot.drafted.iter().enumerate() {
+                            batch_push(&mut batch, t, slot.n_past + j as i32, slot.seq_id, true);
+                        }
+                    }
+                }
+                for slot in slots.iter_mut().flatten() {
+                    while slot.n_prefilled < slot.prompt.len() && batch.n_tokens < n_batch {
+                        let is_last = slot.n_prefilled + 1 == slot.prompt.len();
+                        if is_last {
+                            slot.i_batch = batch.n_tokens;
+                        }
+                        batch_push(
+                            &mut batch,
+                            slot.prompt[slot.n_prefilled],
+                            slot.n_past,
+                            slot.seq_id,
+                            is_last,
+                        );
+                        cache.push(slot.seq_id as usize, slot.prompt[slot.n_prefilled]);
+                        slot.n_prefilled += 1;
+                        slot.n_past += 1;
+                    }
+                }
+
+                if batch.n_tokens == 0 {
+                    continue;
+                }
+
+                // Back off threads and pace steps while the device is hot or
+                // low on battery.
+                let level = governor::level();
+                let cap = governor::thread_cap(base_threads, level);
+                if cap != n_threads {
+                    llama_set_n_threads(ctx, cap, cap);
+                    n_threads = cap;
+                }
+                let pause = governor::step_pause(level);
+                if !pause.is_zero() {
+                    std::thread::sleep(pause);
+                }
+
+                let rc = llama_decode(ctx, batch.clone());
+                if rc > 0 {
+                    // The step did not run (1: no room in the KV cache). Put
+                    // every sequence back where it was, drop any cells the
+                    // step left behind, and try again next iteration.
+                    for (slot, undo) in slots.iter_mut().zip(&undo) {
+                        let (Some(s), Some((n_past, n_prefilled, next_token))) =
+                            (slot.as_mut(), *undo)
+                        else {
+                            continue;
+                        };
+                        s.n_past = n_past;
+                        s.n_prefilled = n_prefilled;
+                        s.next_token = next_token;
+                        s.drafted.clear();
+                        s.i_batch = -1;
+                        cache.truncate(s.seq_id as usize, n_past as usize);
+                        llama_memory_seq_rm(mem, s.seq_id, n_past, -1);
+                    }
+                    if rc == 1 {
+                        // Free cells: a cached prefix first, else the newest
+                        // sequence, so the others keep running.
+                        let busy: Vec<bool> = slots.iter().map(|s| s.is_some()).collect();
+                        if let Some(victim) = cache.oldest_idle(&busy) {
+                            llama_memory_seq_rm(mem, victim as c_int, -1, -1);
+                            cache.clear(victim);
+                        } else if let Some(i) = (0..slots.len())
+                            .filter(|&i| slots[i].is_some())
+                            .max_by_key(|&i| slots[i].as_ref().map_or(0, |s| s.admitted))
+                        {
+                            let s = slots[i].take().unwrap();
+                            println!("⚠️ Batch engine: KV cache full, preempting seq {}", s.seq_id);
+                            self.forget_active(&s.cancel);
+                            cache.clear(s.seq_id as usize);
+                            finish_slot(mem, s, Some("KV cache full".to_string()));
+                        }
+                    }
+                    continue;
+                }
+                if rc < 0 {
+                    // The KV state of every sequence in the step is unknown now,
+                    // so fail them all and start again from an empty cache.
+                    println!("❌ Batch engine decode failed: {}", rc);
+                    for slot in slots.iter_mut() {
+                        if let Some(s) = slot.take() {
+                            self.forget_active(&s.cancel);
+                            finish_slot(mem, s, Some(format!("llama_decode failed: {}", rc)));
+                        }
+                    }
+                    llama_memory_clear(mem, false);
+                    cache.clear_all();
+                    continue;
+                }
+
+                // Sample every slot whose logits were requested. A speculating
+                // slot keeps sampling along its drafts while they match what
+                // the target picks; the first mismatch is its next token.
+                for slot in slots.iter_mut() {
+                    let Some(s) = slot.as_mut() else { continue };
+                    if s.i_batch < 0 {
+                        continue;
+                    }
+                    let drafted = std::mem::take(&mut s.drafted);
+                    let mut accepted = 0;
+                    let finished = loop {
+                        let token =
+                            llama_sampler_sample(s.sampler, ctx, s.i_batch + accepted as c_int);
+                        if vocab.is_null() || llama_vocab_is_eog(vocab, token) {
+                            break true;
+                        }
+                        s.generated += 1;
+                        self.generated.fetch_add(1, Ordering::Relaxed);
+                        let piece = token_piece(vocab, token, &mut s.utf8);
+                        let receiver_gone = !piece.is_empty()
+                            && s.events.send(SequenceEvent::Token(piece)).is_err();
+                        // An accepted draft token is already in the KV cache.
+                        let in_cache = drafted.get(accepted) == Some(&token);
+                        if in_cache {
+                            cache.push(s.seq_id as usize, token);
+                            s.n_past += 1;
+                            accepted += 1;
+                        }
+                        if receiver_gone || s.generated >= s.max_tokens || s.n_past >= n_ctx {
+                            break true;
+                        }
+                        if !in_cache {
+                            s.next_token = Some(token);
+                            break false;
+                        }
+                    };
+                    if accepted < drafted.len() {
+                        llama_memory_seq_rm(mem, s.seq_id, s.n_past, -1);
+                    }
+                    s.n_drafted += drafted.len() as u32;
+                    s.n_accepted += accepted as u32;
+                    if !finished {
+                        continue;
+                    }
+                    let s = slot.take().unwrap();
+                    self.forget_active(&s.cancel);
+                    cache.touch(s.seq_id as usize);
+                    finish_slot(mem, s, None);
+                }
+            }
+
+            llama_batch_free(batch);
+        }
+    }
+
+    fn forget_active(&self, cancel: &Arc<AtomicBool>) {
+        if let Ok(mut q) = self.queue.lock() {
+            q.active.retain(|c| !Arc::ptr_eq(c, cancel));
+        }
+    }
+}
+
+/// Bring `draft` in line with the configured draft model. A model whose
+/// context could not be created is remembered in `rejected` and not retried.
+unsafe fn sync_draft(
+    draft: &mut Option<Draft>,
+    rejected: &mut Weak<DraftModel>,
+    ctx: *mut llama_context,
+    n_slots: usize,
+) {
+    let Some(model) = current_draft_model() else {
+        *draft = None;
+        return;
+    };
+    if draft
+        .as_ref()
+        .is_some_and(|d| Arc::ptr_eq(&d.model, &model))
+    {
+        return;
+    }
+    *draft = None;
+    if Weak::as_ptr(rejected) == Arc::as_ptr(&model) {
+        return;
+    }
+    *draft = Draft::new(model.clone(), ctx, n_slots);
+    if draft.is_none() {
+        *rejected = Arc::downgrade(&model);
+    }
+}
+
+unsafe fn tokenize_prompt(ctx: *mut llama_context, prompt: &str) -> Result<Vec<LlamaToken>, String> {
+    let model = llama_get_model(ctx);
+    if model.is_null() {
+        return Err("model is null".to_string());
+    }
+    let vocab = llama_model_get_vocab(model);
+    if vocab.is_null() {
+        return Err("vocab is null".to_string());
+    }
+
+    let text = prompt.as_ptr() as *const c_char;
+    let len = prompt.len() as c_int;
+    let mut tokens: Vec<LlamaToken> = vec![0; prompt.len() + 2];
+    let mut n = llama_tokenize(vocab, text, len, tokens.as_mut_ptr(), tokens.len() as c_int, true, true);
+    if n < 0 {
+        tokens = vec![0; (-n) as usize];
+        n = llama_tokenize(vocab, text, len, tokens.as_mut_ptr(), tokens.len() as c_int, true, true);
+    }
+    if n <= 0 {
+        return Err(format!("tokenization failed: {}", n));
+    }
+    tokens.truncate(n as usize);
+    Ok(tokens)
+}
+
+unsafe fn build_sampler(params: SamplingParams) -> *mut llama_sampler {
+    let sampler = llama_sampler_chain_init(llama_sampler_chain_params { no_perf: true });
+    llama_sampler_chain_add(sampler, llama_sampler_init_temp(params.temperature));
+    llama_sampler_chain_add(sampler, llama_sampler_init_top_k(params.top_k));
+    llama_sampler_chain_add(sampler, llama_sampler_init_top_p(params.top_p, 1));
+    llama_sampler_chain_add(
+        sampler,
+        llama_sampler_init_penalties(-1, params.repeat_penalty, 0.0, 0.0),
+    );
+    llama_sampler_chain_add(sampler, llama_sampler_init_dist(1234));
+    sampler
+}
+
+unsafe fn batch_push(batch: &mut llama_batch, token: LlamaToken, pos: i32, seq_id: c_int, logits: bool) {
+    let i = batch.n_tokens as usize;
+    *batch.token.add(i) = token;
+    *batch.pos.add(i) = pos;
+    *batch.n_seq_id.add(i) = 1;
+    *(*batch.seq_id.add(i)) = seq_id;
+    *batch.logits.add(i) = logits as i8;
+    batch.n_tokens += 1;
+}
+
+unsafe fn token_piece(vocab: *const llama_vocab, token: LlamaToken, utf8: &mut Utf8EmitBuffer) -> String {
+    let mut buf = [0u8; 64];
+    let n = llama_token_to_piece(
+        vocab,
+        token,
+        buf.as_mut_ptr() as *mut c_char,
+        buf.len() as c_int,
+        0,
+        false,
+    );
+    if n <= 0 {
+        return String::new();
+    }
+    utf8.push_and_take_valid(&buf[..n as usize])
+}
+
+/// Release a sequence's sampler and report its outcome. Successful sequences
+/// keep their KV cells for prefix reuse; failed ones are removed.
+unsafe fn finish_slot(mem: *mut std::ffi::c_void, mut slot: Slot, error: Option<String>) {
+    if error.is_some() && !mem.is_null() {
+        llama_memory_seq_rm(mem, slot.seq_id, -1, -1);
+    }
+    llama_sampler_free(slot.sampler);
+
+    let tail = slot.utf8.flush_lossy();
+    if !tail.is_empty() {
+        let _ = slot.events.send(SequenceEvent::Token(tail));
+    }
+    let _ = slot.events.send(match error {
+        Some(e) => SequenceEvent::Error(e),
+        None => SequenceEvent::Done {
+            prompt_tokens: slot.prompt.len() as u32,
+            completion_tokens: slot.generated.max(0) as u32,
+            draft_tokens: slot.n_drafted,
+            accepted_tokens: slot.n_accepted,
+        },
+    });
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_prefix_cache_picks_longest_prefix() {
+        let mut cache = PrefixCache::new(3);
+        cache.seqs[0] = vec![1, 2, 9];
+        cache.seqs[1] = vec![1, 2, 3, 4];
+        cache.touch(0);
+        cache.touch(1);
+
+        // A follow-up turn that extends seq 1's history reuses all of it.
+        assert_eq!(cache.pick(&[0, 1, 2], &[1, 2, 3, 4, 5, 6]), (1, 4));
+        // An identical prompt still re-decodes its last token for logits.
+        assert_eq!(cache.pick(&[0, 1, 2], &[1, 2, 3, 4]), (1, 3));
+        // With no shared prefix the least recently used sequence is chosen.
+        assert_eq!(cache.pick(&[0, 1, 2], &[7, 8]), (2, 0));
+    }
+
+    #[test]
+    fn test_stream_batches_splits_on_char_boundaries() {
+        let (tx, rx) = mpsc::channel();
+        let handle = SequenceHandle {
+            events: rx,
+            cancel: Arc::new(AtomicBool::new(false)),
+        };
+        for piece in ["ab", "c", "日本語", "d"] {
+            tx.send(SequenceEvent::Token(piece.to_string())).unwrap();
+        }
+        tx.send(SequenceEvent::Done {
+            prompt_tokens: 1,
+            completion_tokens: 4,
+            draft_tokens: 0,
+            accepted_tokens: 0,
+        })
+        .unwrap();
+
+        let mut batches = Vec::new();
+        let n = handle
+            .stream_batches(4, Duration::ZERO, |text, tokens| {
+                batches.push((text.to_string(), tokens));
+                true
+            })
+            .unwrap();
+        assert_eq!(n, 4);
+        // "日本語" is 9 bytes: it is cut after whole characters only.
+        assert_eq!(
+            batches,
+            vec![
+                ("abc".to_string(), 2),
+                ("日".to_string(), 0),
+                ("本".to_string(), 0),
+                ("語d".to_string(), 2),
+            ]
+        );
+    }
+
+    #[test]
+    fn test_prefix_cache_evicts_oldest_idle() {
+        let mut cache = PrefixCache::new(3);
+        cache.seqs[0] = vec![0; 40];
+        cache.seqs[1] = vec![0; 40];
+        cache.seqs[2] = vec![0; 10];
+        cache.touch(1);
+        cache.touch(0);
+
+        // Seq 2 is busy and counted in `needed`; seq 1 is older than seq 0
+        // and goes first.
+        let busy = [false, false, true];
+        assert_eq!(cache.evict_for(30, 100, usize::MAX, &busy), vec![1]);
+        assert_eq!(cache.evict_for(90, 100, usize::MAX, &busy), vec![1, 0]);
+        assert!(cache.evict_for(20, 100, usize::MAX, &busy).is_empty());
+        assert_eq!(cache.oldest_idle(&busy), Some(1));
+        assert_eq!(cache.oldest_idle(&[true, true, true]), None);
+    }
+
+    #[test]
+    fn test_kv_reservation_covers_generation() {
+        // Two 4090-token generations cannot share a 4096-cell cache.
+        let one = kv_reservation(100, 4090, 4096);
+        assert_eq!(one, 4096);
+        assert!(one + kv_reservation(10, 4090, 4096) > 4096);
+        assert_eq!(kv_reservation(100, 200, 4096), 300);
+        assert_eq!(kv_reservation(100, 0, 4096), 101);
+    }
+}
@@ -14,12 +14,14 @@ use common::{ChatMessage, Command, CommandV1, Model, OsType, OutputPhase, System
 use std::ffi::{CStr, CString};
 
 #[cfg(target_os = "android")]
-use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::atomic::{AtomicBool, AtomicU32, AtomicU8, Ordering};
 use std::sync::{Arc, Mutex, OnceLock};
 
 #[cfg(target_os = "android")]
 use super::{Args, AutoWorker, WorkerHandle};
 #[cfg(target_os = "android")]
+use common::markers::PhaseSplitter;
+#[cfg(target_os = "android")]
 use common::{DevicesInfo, EngineType};
 #[cfg(target_os = "android")]
 use std::io::Write;
@@ -31,6 +33,11 @@ use tracing::info;
 #[cfg(target_os = "android")]
 use std::time::Duration;
 
+#[cfg(target_os = "android")]
+use crate::util::arena::{self, Arena, ArenaLease};
+#[cfg(target_os = "android")]
+use crate::util::load_beacon::{self, BeaconState};
+
 #[cfg(target_os = "android")]
 fn build_chat_prompt(messages: &[ChatMessage]) -> String {
     let mut out = String::new();
@@ -94,7 +101,11 @@ extern "C" {
 }
 
 #[cfg(target_os = "android")]
-fn count_prompt_tokens(ctx: *mut crate::llama_context, prompt: *const std::os::raw::c_char) -> u32 {
+fn count_prompt_tokens(
+    arena: &Arena,
+    ctx: *mut crate::llama_context,
+    prompt: *const std::os::raw::c_char,
+) -> u32 {
     if ctx.is_null() || prompt.is_null() {
         return 0;
     }
@@ -110,7 +121,7 @@ fn count_prompt_tokens(ctx: *mut crate::llama_context, prompt: *const std::os::r
 
     let prompt_len = unsafe { std::ffi::CStr::from_ptr(prompt) }.to_bytes().len();
 
-    let mut tokens: Vec<i32> = vec![0; 512];
+    let mut tokens: &mut [i32] = arena.alloc_slice(512, 0);
     let mut n = unsafe {
         llama_tokenize(
             vocab,
@@ -124,7 +135,7 @@ fn count_prompt_tokens(ctx: *mut crate::llama_context, prompt: *const std::os::r
     };
     if n < 0 {
         let needed = (-n) as usize;
-        tokens = vec![0; needed.max(1)];
+        tokens = arena.alloc_slice(needed.max(1), 0);
         n = unsafe {
             llama_tokenize(
                 vocab,
@@ -237,187 +248,6 @@ fn token_should_be_suppressed(token: &str) -> bool {
         || token.contains("Ok produce answer")
 }
 
-#[cfg(target_os = "android")]
-#[derive(Debug, Clone)]
-struct PhaseSplitter {
-    phase: OutputPhase,
-    carry: String,
-}
-
-#[cfg(target_os = "android")]
-impl Default for PhaseSplitter {
-    fn default() -> Self {
-        Self {
-            phase: OutputPhase::Final,
-            carry: String::new(),
-        }
-    }
-}
-
-#[cfg(target_os = "android")]
-impl PhaseSplitter {
-    fn next_marker(rest: &str) -> Option<(usize, OutputPhase, usize)> {
-        let mut best: Option<(usize, OutputPhase, usize)> = None;
-
-        for (tag, to_phase) in [
-            ("<analysis>", OutputPhase::Analysis),
-            ("<think>", OutputPhase::Analysis),
-            ("<reasoning>", OutputPhase::Analysis),
-            ("<final>", OutputPhase::Final),
-        ] {
-            if let Some(idx) = rest.find(tag) {
-                let cand = (idx, to_phase, tag.len());
-                best = Some(match best {
-                    None => cand,
-                    Some(cur) => if cand.0 < cur.0 { cand } else { cur },
-                });
-            }
-        }
-
-        for tag in ["</analysis>", "</think>", "</reasoning>", "</final>"] {
-            if let Some(idx) = rest.find(tag) {
-                let cand = (idx, OutputPhase::Final, tag.len());
-                best = Some(match best {
-                    None => cand,
-                    Some(cur) => if cand.0 < cur.0 { cand } else { cur },
-                });
-            }
-        }
-
-        for (pat, to_phase) in [
-            ("### Final", OutputPhase::Final),
-            ("Final:", OutputPhase::Final),
-            ("final:", OutputPhase::Final),
-            ("final", OutputPhase::Final),
-            ("### Answer", OutputPhase::Final),
-            ("### 思考", OutputPhase::Analysis),
-            ("思考：", OutputPhase::Analysis),
-            ("分析：", OutputPhase::Analysis),
-            ("analysis:", OutputPhase::Analysis),
-            ("analysis", OutputPhase::Analysis),
-            ("### 答案", OutputPhase::Final),
-            ("答案：", OutputPhase::Final),
-        ] {
-            if rest.starts_with(pat) {
-                if (pat == "analysis" || pat == "final")
-                    && rest.len() > pat.len()
-                    && !rest[pat.len()..].starts_with([' ', '\n', '\r', '\t', ':'])
-                {
-                } else {
-                    let cand = (0usize, to_phase, pat.len());
-                    best = Some(match best {
-                        None => cand,
-                        Some(cur) => if cand.0 < cur.0 { cand } else { cur },
-                    });
-                }
-            }
-            let needle = format!("\n{}", pat);
-            if let Some(idx) = rest.find(&needle) {
-                let cand = (idx + 1, to_phase, pat.len());
-                best = Some(match best {
-                    None => cand,
-                    Some(cur) => if cand.0 < cur.0 { cand } else { cur },
-                });
-            }
-        }
-
-        best
-    }
-
-    fn split_tail_for_carry<'a>(tail: &'a str) -> (&'a str, &'a str) {
-        let markers = [
-            "<analysis>", "</analysis>",
-            "<think>", "</think>",
-            "<reasoning>", "</reasoning>",
-            "<final>", "</final>",
-            "### Final", "Final:", "### Answer",
-            "final:", "final",
-            "### 思考", "思考：", "分析：",
-            "analysis:", "analysis",
-            "### 答案", "答案：",
-        ];
-        let max_len = markers.iter().map(|s| s.len()).max().unwrap_or(0);
-
-        let mut carry_len: usize = 0;
-        let max_scan = (max_len.saturating_sub(1)).min(tail.len());
-
-        for l in 1..=max_scan {
-            let start = tail.len() - l;
-            if !tail.is_char_boundary(start) {
-                continue;
-            }
-            let suf = &tail[start..];
-            if markers.iter().any(|m| m.starts_with(suf)) {
-                carry_len = l;
-            }
-            if markers.iter().any(|m| {
-                let nm = format!("\n{}", m);
-                nm.starts_with(suf)
-            }) {
-                carry_len = l;
-            }
-        }
-
-        if carry_len == 0 {
-            return (tail, "");
-        }
-
-        let split = tail.len() - carry_len;
-        if !tail.is_char_boundary(split) {
-            return (tail, "");
-        }
-        (&tail[..split], &tail[split..])
-    }
-
-    fn push(&mut self, text: &str) -> Vec<(OutputPhase, String)> {
-        if text.is_empty() {
-            return Vec::new();
-        }
-
-        let mut combined = String::new();
-        if !self.carry.is_empty() {
-            combined.push_str(&self.carry);
-            self.carry.clear();
-        }
-        combined.push_str(text);
-
-        let mut out: Vec<(OutputPhase, String)> = Vec::new();
-        let mut pos: usize = 0;
-
-        while pos < combined.len() {
-            let rest = &combined[pos..];
-
-            let Some((rel_pos, to_phase, marker_len)) = Self::next_marker(rest) else {
-                let tail = &combined[pos..];
-                let (safe, carry) = Self::split_tail_for_carry(tail);
-                if !safe.is_empty() {
-                    out.push((self.phase, safe.to_string()));
-                }
-                self.carry = carry.to_string();
-                break;
-            };
-
-            let tag_pos = pos + rel_pos;
-            if tag_pos > pos {
-                let seg = &combined[pos..tag_pos];
-                if !seg.is_empty() {
-                    out.push((self.phase, seg.to_string()));
-                }
-            }
-
-            if tag_pos + marker_len > combined.len() {
-                self.carry = combined[tag_pos..].to_string();
-                break;
-            }
-
-            self.phase = to_phase;
-            pos = tag_pos + marker_len;
-        }
-
-        out
-    }
-}
-
 #[cfg(target_os = "android")]
 fn derive_model_id_from_path(model_path: &str) -> String {
     let lower = model_path.to_ascii_lowercase();
@@ -644,8 +474,17 @@ pub static ANDROID_CONTROL_PORT: OnceLock<Mutex<Option<u16>>> = OnceLock::new();
 /// Global client_id storage for Android background tasks
 pub static ANDROID_CLIENT_ID: OnceLock<Mutex<Option<[u8; 16]>>> = OnceLock::new();
 
+/// Set once the server sent RequestDeviceState.
 #[cfg(target_os = "android")]
-static ANDROID_ACTIVE_TASK_ID: OnceLock<Mutex<Option<String>>> = OnceLock::new();
+static DEVICE_STATE_REQUESTED: AtomicBool = AtomicBool::new(false);
+
+/// Throttle level last reported with DeviceState, `u8::MAX` before the first.
+#[cfg(target_os = "android")]
+static REPORTED_THROTTLE: AtomicU8 = AtomicU8::new(u8::MAX);
+
+/// Beacon interval from RequestLoadBeacon; 0 until the server asks.
+#[cfg(target_os = "android")]
+static LOAD_BEACON_INTERVAL_MS: AtomicU32 = AtomicU32::new(0);
 
 #[cfg(target_os = "android")]
 /// Global worker task handle for background operations
@@ -686,8 +525,6 @@ pub async fn perform_android_login(
 
     info!("✅ Android: TCP connection established");
 
-    let _ = ANDROID_ACTIVE_TASK_ID.set(Mutex::new(None));
-
     // Collect system and device information
     info!("🔧 Android: Collecting system information...");
     let (cpu_usage, memory_usage, disk_usage, _system_name) =
@@ -707,8 +544,11 @@ pub async fn perform_android_login(
         network_rx: 0,
         network_tx: 0,
     };
-    // Create Login command (same structure as TCPWorker::login())
-    const CURRENT_VERSION: u32 = 1;
+    // Create Login command (same structure as TCPWorker::login()). Versions
+    // 5 to 7 add RequestContextProfile, RequestDeviceState and
+    // RequestLoadBeacon; TaskHandle, TaskDecodeOptions and V2 commands from
+    // the versions in between are ignored by this loop.
+    const CURRENT_VERSION: u32 = 7;
 
     // Calculate device metrics from actual device info
     let device_memtotal_gb = devices_info.memsize_gb.try_into().unwrap_or(0);
@@ -791,6 +631,63 @@ pub fn get_android_tcp_stream() -> Option<Arc<Mutex<std::net::TcpStream>>> {
         .and_then(|m| m.lock().ok().and_then(|g| g.clone()))
 }
 
+/// Send DeviceState over the main connection if the server asked for it, on
+/// every heartbeat (`force`) and whenever the throttle level changed.
+#[cfg(target_os = "android")]
+fn report_device_state(writer: Option<&mut std::net::TcpStream>, force: bool) {
+    let Some(writer) = writer else { return };
+    if !DEVICE_STATE_REQUESTED.load(Ordering::Relaxed) {
+        return;
+    }
+    let (state, level) = crate::util::governor::sample();
+    if !force && REPORTED_THROTTLE.load(Ordering::Relaxed) == level.as_u8() {
+        return;
+    }
+    let client_id = ANDROID_CLIENT_ID
+        .get()
+        .and_then(|m| m.lock().ok().and_then(|g| *g))
+        .unwrap_or([0u8; 16]);
+    let report = CommandV1::DeviceState {
+        client_id,
+        level,
+        temp_c: state.temp_c.unwrap_or(0),
+        battery_pct: state.battery_pct.unwrap_or(u8::MAX),
+        charging: state.charging,
+    };
+    match common::write_command_sync(writer, &Command::V1(report)) {
+        Ok(()) => REPORTED_THROTTLE.store(level.as_u8(), Ordering::Relaxed),
+        Err(e) => eprintln!("❌ Android: Failed to report device state: {}", e),
+    }
+}
+
+/// Send a LoadBeacon over the main connection if the load moved. Returns
+/// false while the server has not asked for beacons.
+#[cfg(target_os = "android")]
+fn send_load_beacon(
+    writer: Option<&mut std::net::TcpStream>,
+    beacon: &mut Option<BeaconState>,
+) -> bool {
+    let interval_ms = LOAD_BEACON_INTERVAL_MS.load(Ordering::Relaxed);
+    if interval_ms == 0 {
+        return false;
+    }
+    let beacon =
+        beacon.get_or_insert_with(|| BeaconState::new(Duration::from_millis(interval_ms as u64)));
+    let now = std::time::Instant::now();
+    let Some(writer) = writer.filter(|_| beacon.due(now)) else {
+        return true;
+    };
+    let (cpu_usage, memory_usage, _) = get_realtime_system_usage();
+    let snapshot = load_beacon::sample(cpu_usage.min(100) as u8, memory_usage.min(100) as u8);
+    if let Some(delta) = beacon.poll(snapshot, now) {
+        let beacon_cmd = CommandV1::LoadBeacon { delta };
+        if let Err(e) = common::write_command_sync(writer, &Command::V1(beacon_cmd)) {
+            eprintln!("❌ Android: Failed to send load beacon: {}", e);
+        }
+    }
+    true
+}
+
 /// Initialize global worker for Android
 #[cfg(target_os = "android")]
 pub async fn init_global_worker(args: Args) -> Result<()> {
@@ -835,6 +732,13 @@ pub async fn start_worker_tasks() -> Result<()> {
     let heartbeat_stop_signal = stop_signal.clone();
     let heartbeat_handle = thread::spawn(move || {
         println!("🔧 Android: Heartbeat thread started");
+        // DeviceState must go over the logged-in connection; the heartbeat
+        // connections below are not tied to this client by the server.
+        let mut state_writer = heartbeat_stream
+            .lock()
+            .ok()
+            .and_then(|s| s.try_clone().ok());
+        let mut beacon: Option<BeaconState> = None;
 
         loop {
             // Check stop signal before sleeping
@@ -866,7 +770,7 @@ pub async fn start_worker_tasks() -> Result<()> {
                 usage: 0,
                 mem_usage: 0,
                 power_usage: 0,
-                temp: 0,
+                temp: crate::util::governor::sample().0.temp_c.unwrap_or(0) as u64,
                 vendor_id: 0x41, // ARM
                 device_id: 0x1000,
                 memsize_gb: 4096,
@@ -902,6 +806,12 @@ pub async fn start_worker_tasks() -> Result<()> {
                 }
             };
 
+            // With beacons on, the server keeps the last inventory it was sent.
+            let devices_info = match beacon.as_mut() {
+                Some(b) if !b.inventory_changed(std::slice::from_ref(&device_info)) => Vec::new(),
+                _ => vec![device_info.clone()],
+            };
+
             // Create heartbeat command
             let client_id = ANDROID_CLIENT_ID
                 .get()
@@ -919,7 +829,7 @@ pub async fn start_worker_tasks() -> Result<()> {
                 device_memtotal_gb: device_info.memtotal_gb.try_into().unwrap_or(0),
                 device_total_tflops: device_info.total_tflops.into(),
                 device_count: device_info.num as u16,
-                devices_info: vec![device_info],
+                devices_info,
             };
 
             // Send heartbeat using common library function
@@ -930,12 +840,17 @@ pub async fn start_worker_tasks() -> Result<()> {
                 println!("🔧 Android: Continuing heartbeat loop despite send failure...");
             } else {
                 println!("✅ Android: Heartbeat sent successfully");
+                if let Some(b) = beacon.as_mut() {
+                    b.rebase(cpu_usage as u8, memory_usage as u8);
+                }
             }
 
             // Close the connection after sending heartbeat
             drop(heartbeat_stream);
             println!("🔧 Android: Heartbeat connection closed, starting next iteration...");
 
+            report_device_state(state_writer.as_mut(), true);
+
             // Sleep with periodic stop signal checks
             for _ in 0..120 {
                 // 120 seconds / 1 second intervals
@@ -944,6 +859,9 @@ pub async fn start_worker_tasks() -> Result<()> {
                     println!("🔧 Android: Heartbeat thread received stop signal during sleep");
                     break;
                 }
+                if !send_load_beacon(state_writer.as_mut(), &mut beacon) {
+                    report_device_state(state_writer.as_mut(), false);
+                }
             }
 
             // Check stop signal after sleep
@@ -1065,25 +983,28 @@ pub async fn start_worker_tasks() -> Result<()> {
                                 println!("⚙️ Android: Parameters: max_tokens={}, temp={}, top_k={}, top_p={}", 
                                                              max_tokens, temperature, top_k, top_p);
 
+                                use crate::generate_for_task;
                                 use crate::llama_context;
-                                use crate::{
-                                    gpuf_start_generation_async, GLOBAL_CONTEXT_PTR,
-                                    GLOBAL_INFERENCE_MUTEX,
-                                };
                                 use std::ffi::CString;
                                 use std::os::raw::c_void;
-                                let context_ptr = GLOBAL_CONTEXT_PTR.load(Ordering::SeqCst);
-                                if context_ptr.is_null() {
+                                // Keeps the pair alive across model swaps.
+                                let lease = crate::lease_current_model();
+                                let context_ptr = lease
+                                    .as_ref()
+                                    .map_or(std::ptr::null_mut(), |lease| lease.context());
+                                let refusal = if context_ptr.is_null() {
+                                    Some("Model not loaded - please load a model first".to_string())
+                                } else {
+                                    crate::util::governor::admit().err()
+                                };
+                                if let Some(err) = refusal {
                                     let result_command = CommandV1::InferenceResultChunk {
                                         task_id: task_id.clone(),
                                         seq: 0,
                                         delta: String::new(),
                                         phase: OutputPhase::Unknown,
                                         done: true,
-                                        error: Some(
-                                            "Model not loaded - please load a model first"
-                                                .to_string(),
-                                        ),
+                                        error: Some(err),
                                         prompt_tokens: 0,
                                         completion_tokens: 0,
                                         analysis_tokens: 0,
@@ -1096,15 +1017,6 @@ pub async fn start_worker_tasks() -> Result<()> {
                                     continue;
                                 }
 
-                                {
-                                    let mut active = ANDROID_ACTIVE_TASK_ID
-                                        .get()
-                                        .expect("ANDROID_ACTIVE_TASK_ID is set")
-                                        .lock()
-                                        .unwrap();
-                                    *active = Some(task_id.clone());
-                                }
-
                                 let writer_stream = match stream.try_clone() {
                                     Ok(s) => s,
                                     Err(e) => {
@@ -1134,6 +1046,7 @@ pub async fn start_worker_tasks() -> Result<()> {
                                 let context_ptr_usize = context_ptr as usize;
                                 std::thread::spawn(move || {
                                     let context_ptr = context_ptr_usize as *mut llama_context;
+                                    let _lease = lease;
                                     #[repr(C)]
                                     struct TokenCallbackState {
                                         stream: std::net::TcpStream,
@@ -1147,6 +1060,8 @@ pub async fn start_worker_tasks() -> Result<()> {
                                         final_tokens: u32,
                                         buf_phase: OutputPhase,
                                         splitter: PhaseSplitter,
+                                        /// Scratch for this request; reset and pooled when the state drops.
+                                        _arena: ArenaLease,
                                         suppress: bool,
                                     }
 
@@ -1255,7 +1170,6 @@ pub async fn start_worker_tasks() -> Result<()> {
                                         );
                                     }
 
-                                    let _lock = GLOBAL_INFERENCE_MUTEX.lock().unwrap();
                                     let start_time = std::time::Instant::now();
                                     let prompt_cstr = match CString::new(prompt_for_thread) {
                                         Ok(s) => s,
@@ -1282,8 +1196,12 @@ pub async fn start_worker_tasks() -> Result<()> {
                                         }
                                     };
 
-                                    let prompt_tokens: u32 =
-                                        count_prompt_tokens(context_ptr, prompt_cstr.as_ptr());
+                                    let arena = arena::lease();
+                                    let prompt_tokens: u32 = count_prompt_tokens(
+                                        &arena,
+                                        context_ptr,
+                                        prompt_cstr.as_ptr(),
+                                    );
 
                                     let mut cb_state = TokenCallbackState {
                                         stream: writer_stream,
@@ -1297,23 +1215,22 @@ pub async fn start_worker_tasks() -> Result<()> {
                                         final_tokens: 0,
                                         buf_phase: OutputPhase::Final,
                                         splitter: PhaseSplitter::default(),
+                                        _arena: arena,
                                         suppress: false,
                                     };
 
-                                    let completion_tokens_i32 = unsafe {
-                                        gpuf_start_generation_async(
-                                            context_ptr,
-                                            prompt_cstr.as_ptr(),
-                                            max_tokens as i32,
-                                            temperature,
-                                            top_k as i32,
-                                            top_p,
-                                            repeat_penalty,
-                                            Some(on_token),
-                                            (&mut cb_state as *mut TokenCallbackState)
-                                                as *mut c_void,
-                                        )
-                                    };
+                                    let completion_tokens_i32 = generate_for_task(
+                                        context_ptr,
+                                        &task_id_for_thread,
+                                        &prompt_cstr,
+                                        max_tokens as i32,
+                                        temperature,
+                                        top_k as i32,
+                                        top_p,
+                                        repeat_penalty,
+                                        Some(on_token),
+                                        (&mut cb_state as *mut TokenCallbackState) as *mut c_void,
+                                    );
 
                                     if completion_tokens_i32 > 0 {
                                         cb_state.completion_tokens = completion_tokens_i32 as u32;
@@ -1357,17 +1274,6 @@ pub async fn start_worker_tasks() -> Result<()> {
                                         &Command::V1(done_chunk),
                                     );
 
-                                    {
-                                        let mut active = ANDROID_ACTIVE_TASK_ID
-                                            .get()
-                                            .expect("ANDROID_ACTIVE_TASK_ID is set")
-                                            .lock()
-                                            .unwrap();
-                                        if active.as_deref() == Some(task_id_for_thread.as_str()) {
-                                            *active = None;
-                                        }
-                                    }
-
                                     let execution_time = start_time.elapsed().as_millis() as u64;
                                     println!(
                                         "✅ Android: Streaming inference finished in {}ms",
@@ -1389,25 +1295,28 @@ pub async fn start_worker_tasks() -> Result<()> {
                             } => {
                                 println!("🔧 Android: Received chat inference task: {}", task_id);
 
+                                use crate::generate_for_task;
                                 use crate::llama_context;
-                                use crate::{
-                                    gpuf_start_generation_async, GLOBAL_CONTEXT_PTR,
-                                    GLOBAL_INFERENCE_MUTEX,
-                                };
                                 use std::ffi::CString;
                                 use std::os::raw::c_void;
-                                let context_ptr = GLOBAL_CONTEXT_PTR.load(Ordering::SeqCst);
-                                if context_ptr.is_null() {
+                                // Keeps the pair alive across model swaps.
+                                let lease = crate::lease_current_model();
+                                let context_ptr = lease
+                                    .as_ref()
+                                    .map_or(std::ptr::null_mut(), |lease| lease.context());
+                                let refusal = if context_ptr.is_null() {
+                                    Some("Model not loaded - please load a model first".to_string())
+                                } else {
+                                    crate::util::governor::admit().err()
+                                };
+                                if let Some(err) = refusal {
                                     let result_command = CommandV1::InferenceResultChunk {
                                         task_id: task_id.clone(),
                                         seq: 0,
                                         delta: String::new(),
                                         phase: OutputPhase::Unknown,
                                         done: true,
-                                        error: Some(
-                                            "Model not loaded - please load a model first"
-                                                .to_string(),
-                                        ),
+                                        error: Some(err),
                                         prompt_tokens: 0,
                                         completion_tokens: 0,
                                         analysis_tokens: 0,
@@ -1425,15 +1334,6 @@ pub async fn start_worker_tasks() -> Result<()> {
                                         .unwrap_or_else(|| build_chat_prompt(&messages));
                                 println!("📝 Android: Prompt: {}", prompt);
 
-                                {
-                                    let mut active = ANDROID_ACTIVE_TASK_ID
-                                        .get()
-                                        .expect("ANDROID_ACTIVE_TASK_ID is set")
-                                        .lock()
-                                        .unwrap();
-                                    *active = Some(task_id.clone());
-                                }
-
                                 let writer_stream = match stream.try_clone() {
                                     Ok(s) => s,
                                     Err(e) => {
@@ -1463,6 +1363,7 @@ pub async fn start_worker_tasks() -> Result<()> {
                                 let context_ptr_usize = context_ptr as usize;
                                 std::thread::spawn(move || {
                                     let context_ptr = context_ptr_usize as *mut llama_context;
+                                    let _lease = lease;
                                     #[repr(C)]
                                     struct TokenCallbackState {
                                         stream: std::net::TcpStream,
@@ -1536,7 +1437,6 @@ pub async fn start_worker_tasks() -> Result<()> {
                                         );
                                     }
 
-                                    let _lock = GLOBAL_INFERENCE_MUTEX.lock().unwrap();
                                     let prompt_cstr = match CString::new(prompt_for_thread) {
                                         Ok(s) => s,
                                         Err(e) => {
@@ -1562,8 +1462,12 @@ pub async fn start_worker_tasks() -> Result<()> {
                                         }
                                     };
 
-                                    let prompt_tokens: u32 =
-                                        count_prompt_tokens(context_ptr, prompt_cstr.as_ptr());
+                                    let arena = arena::lease();
+                                    let prompt_tokens: u32 = count_prompt_tokens(
+                                        &arena,
+                                        context_ptr,
+                                        prompt_cstr.as_ptr(),
+                                    );
 
                                     let mut cb_state = TokenCallbackState {
                                         stream: writer_stream,
@@ -1576,20 +1480,18 @@ pub async fn start_worker_tasks() -> Result<()> {
                                         suppress: false,
                                     };
 
-                                    let completion_tokens_i32 = unsafe {
-                                        gpuf_start_generation_async(
-                                            context_ptr,
-                                            prompt_cstr.as_ptr(),
-                                            max_tokens as i32,
-                                            temperature,
-                                            top_k as i32,
-                                            top_p,
-                                            repeat_penalty,
-                                            Some(on_token),
-                                            (&mut cb_state as *mut TokenCallbackState)
-                                                as *mut c_void,
-                                        )
-                                    };
+                                    let completion_tokens_i32 = generate_for_task(
+                                        context_ptr,
+                                        &task_id_for_thread,
+                                        &prompt_cstr,
+                                        max_tokens as i32,
+                                        temperature,
+                                        top_k as i32,
+                                        top_p,
+                                        repeat_penalty,
+                                        Some(on_token),
+                                        (&mut cb_state as *mut TokenCallbackState) as *mut c_void,
+                                    );
 
                                     if completion_tokens_i32 > 0 {
                                         cb_state.completion_tokens = completion_tokens_i32 as u32;
@@ -1632,35 +1534,35 @@ pub async fn start_worker_tasks() -> Result<()> {
                                         &mut cb_state.stream,
                                         &Command::V1(done_chunk),
                                     );
-
-                                    {
-                                        let mut active = ANDROID_ACTIVE_TASK_ID
-                                            .get()
-                                            .expect("ANDROID_ACTIVE_TASK_ID is set")
-                                            .lock()
-                                            .unwrap();
-                                        if active.as_deref() == Some(task_id_for_thread.as_str()) {
-                                            *active = None;
-                                        }
-                                    }
                                 });
                             }
-                            CommandV1::CancelInference { task_id } => {
-                                let should_cancel = {
-                                    let active_lock = ANDROID_ACTIVE_TASK_ID
-                                        .get()
-                                        .expect("ANDROID_ACTIVE_TASK_ID is set")
-                                        .lock()
-                                        .unwrap();
-                                    active_lock.as_deref() == Some(task_id.as_str())
+                            CommandV1::RequestDeviceState => {
+                                DEVICE_STATE_REQUESTED.store(true, Ordering::Relaxed);
+                            }
+                            CommandV1::RequestLoadBeacon { interval_ms } => {
+                                LOAD_BEACON_INTERVAL_MS
+                                    .store(interval_ms.max(1000), Ordering::Relaxed);
+                            }
+                            CommandV1::RequestContextProfile => {
+                                let client_id = ANDROID_CLIENT_ID
+                                    .get()
+                                    .and_then(|m| m.lock().ok().and_then(|g| *g))
+                                    .unwrap_or([0u8; 16]);
+                                let reply = CommandV1::ContextProfile {
+                                    client_id,
+                                    profile: crate::util::device_profile::current(),
                                 };
-
-                                if should_cancel {
-                                    use crate::{gpuf_stop_generation, GLOBAL_CONTEXT_PTR};
-                                    let context_ptr = GLOBAL_CONTEXT_PTR.load(Ordering::SeqCst);
-                                    if !context_ptr.is_null() {
-                                        unsafe { gpuf_stop_generation(context_ptr) };
-                                    }
+                                println!("📐 Android: Reporting context profile: {:?}", reply);
+                                let _ =
+                                    common::write_command_sync(&mut *stream, &Command::V1(reply));
+                            }
+                            CommandV1::CancelInference { task_id } => {
+                                // Stops only this task's sequence; other tasks keep decoding.
+                                if !crate::batch_engine::cancel_task(&task_id) {
+                                    println!(
+                                        "⚠️ Android: No running sequence for task {}",
+                                        task_id
+                                    );
                                 }
                             }
                             _ => {
@@ -1774,6 +1676,13 @@ pub async fn start_worker_tasks_with_callback_ptr(
     let heartbeat_stop_signal = stop_signal.clone();
     let heartbeat_handle = thread::spawn(move || {
         println!("🔧 Android: Heartbeat thread started");
+        // DeviceState must go over the logged-in connection; the heartbeat
+        // connections below are not tied to this client by the server.
+        let mut state_writer = heartbeat_stream
+            .lock()
+            .ok()
+            .and_then(|s| s.try_clone().ok());
+        let mut beacon: Option<BeaconState> = None;
 
         loop {
             // Check stop signal before sleeping
@@ -1804,7 +1713,10 @@ pub async fn start_worker_tasks_with_callback_ptr(
             let (network_rx, network_tx) = get_network_usage();
 
             // Use dynamically collected device info (cloned from async context)
-            let device_info = device_info_for_heartbeat.clone();
+            let mut device_info = device_info_for_heartbeat.clone();
+            if let Some(temp_c) = crate::util::governor::sample().0.temp_c {
+                device_info.temp = temp_c as u64;
+            }
 
             println!(
                 "💓 Android: Sending heartbeat - CPU: {}% MEM: {}% DISK: {}% NET: ↑{}B ↓{}B MEM_TOTAL: {}GB",
@@ -1856,6 +1768,12 @@ pub async fn start_worker_tasks_with_callback_ptr(
                     }
                 };
 
+            // With beacons on, the server keeps the last inventory it was sent.
+            let devices_info = match beacon.as_mut() {
+                Some(b) if !b.inventory_changed(std::slice::from_ref(&device_info)) => Vec::new(),
+                _ => vec![device_info.clone()],
+            };
+
             // Create heartbeat command
             let client_id = ANDROID_CLIENT_ID
                 .get()
@@ -1873,7 +1791,7 @@ pub async fn start_worker_tasks_with_callback_ptr(
                 device_memtotal_gb: device_info.memtotal_gb.try_into().unwrap_or(0),
                 device_total_tflops: device_info.total_tflops.into(),
                 device_count: device_info.num as u16,
-                devices_info: vec![device_info],
+                devices_info,
             };
 
             // Send heartbeat using common library function
@@ -1892,6 +1810,9 @@ pub async fn start_worker_tasks_with_callback_ptr(
                 }
             } else {
                 println!("✅ Android: Heartbeat sent successfully");
+                if let Some(b) = beacon.as_mut() {
+                    b.rebase(cpu_usage as u8, memory_usage as u8);
+                }
                 {
                     let current_model_path = crate::MODEL_STATUS
                         .lock()
@@ -1934,6 +1855,8 @@ pub async fn start_worker_tasks_with_callback_ptr(
             drop(stream);
             println!("🔧 Android: Heartbeat connection closed, starting next iteration...");
 
+            report_device_state(state_writer.as_mut(), true);
+
             // Sleep with periodic stop signal checks
             for _ in 0..120 {
                 // 120 seconds / 1 second intervals
@@ -1942,6 +1865,9 @@ pub async fn start_worker_tasks_with_callback_ptr(
                     println!("🔧 Android: Heartbeat thread received stop signal during sleep");
                     break;
                 }
+                if !send_load_beacon(state_writer.as_mut(), &mut beacon) {
+                    report_device_state(state_writer.as_mut(), false);
+                }
             }
 
             // Check stop signal after sleep
@@ -2168,17 +2094,24 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                         &format!("Task: {}", task_id),
                                     );
 
+                                    use crate::generate_for_task;
                                     use crate::llama_context;
-                                    use crate::{
-                                        gpuf_start_generation_async, GLOBAL_CONTEXT_PTR,
-                                        GLOBAL_INFERENCE_MUTEX,
-                                    };
                                     use std::ffi::CString;
                                     use std::os::raw::c_void;
-                                    let context_ptr = GLOBAL_CONTEXT_PTR.load(Ordering::SeqCst);
-                                    if context_ptr.is_null() {
-                                        let err = "Model not loaded - please load a model first"
-                                            .to_string();
+                                    // Keeps the pair alive across model swaps.
+                                    let lease = crate::lease_current_model();
+                                    let context_ptr = lease
+                                        .as_ref()
+                                        .map_or(std::ptr::null_mut(), |lease| lease.context());
+                                    let refusal = if context_ptr.is_null() {
+                                        Some(
+                                            "Model not loaded - please load a model first"
+                                                .to_string(),
+                                        )
+                                    } else {
+                                        crate::util::governor::admit().err()
+                                    };
+                                    if let Some(err) = refusal {
                                         let result_command = CommandV1::InferenceResultChunk {
                                             task_id: task_id.clone(),
                                             seq: 0,
@@ -2202,16 +2135,6 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                         continue;
                                     }
 
-                                    {
-                                        let mut active = ANDROID_ACTIVE_TASK_ID
-                                            .get()
-                                            .expect("ANDROID_ACTIVE_TASK_ID is set")
-                                            .lock()
-                                            .unwrap();
-                                        *active = Some(task_id.clone());
-
-                                    }
-
                                     let writer_stream = match stream.try_clone() {
                                         Ok(s) => s,
                                         Err(e) => {
@@ -2245,6 +2168,7 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                     let context_ptr_usize = context_ptr as usize;
                                     std::thread::spawn(move || {
                                         let context_ptr = context_ptr_usize as *mut llama_context;
+                                        let _lease = lease;
                                         #[repr(C)]
                                         struct TokenCallbackState {
                                             stream: std::net::TcpStream,
@@ -2258,6 +2182,8 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                             final_tokens: u32,
                                             buf_phase: OutputPhase,
                                             splitter: PhaseSplitter,
+                                            /// Scratch for this request; reset and pooled when the state drops.
+                                            _arena: ArenaLease,
                                             suppress: bool,
                                         }
 
@@ -2368,7 +2294,6 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                                 &Command::V1(chunk),
                                             );
                                         }
- let _lock = GLOBAL_INFERENCE_MUTEX.lock().unwrap();
                                         let start_time = std::time::Instant::now();
                                         let prompt_cstr = match CString::new(prompt_for_thread) {
                                             Ok(s) => s,
@@ -2403,8 +2328,12 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                             }
                                         };
 
-                                        let prompt_tokens: u32 =
-                                            count_prompt_tokens(context_ptr, prompt_cstr.as_ptr());
+                                        let arena = arena::lease();
+                                        let prompt_tokens: u32 = count_prompt_tokens(
+                                            &arena,
+                                            context_ptr,
+                                            prompt_cstr.as_ptr(),
+                                        );
 
                                         let mut cb_state = TokenCallbackState {
                                             stream: writer_stream,
@@ -2418,23 +2347,23 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                             final_tokens: 0,
                                             buf_phase: OutputPhase::Final,
                                             splitter: PhaseSplitter::default(),
+                                            _arena: arena,
                                             suppress: false,
                                         };
 
-                                        let completion_tokens_i32 = unsafe {
-                                            gpuf_start_generation_async(
-                                                context_ptr,
-                                                prompt_cstr.as_ptr(),
-                                                max_tokens as i32,
-                                                temperature,
-                                                top_k as i32,
-                                                top_p,
-                                                repeat_penalty,
-                                                Some(on_token),
-                                                (&mut cb_state as *mut TokenCallbackState)
-                                                    as *mut c_void,
-                                            )
-                                        };
+                                        let completion_tokens_i32 = generate_for_task(
+                                            context_ptr,
+                                            &task_id_for_thread,
+                                            &prompt_cstr,
+                                            max_tokens as i32,
+                                            temperature,
+                                            top_k as i32,
+                                            top_p,
+                                            repeat_penalty,
+                                            Some(on_token),
+                                            (&mut cb_state as *mut TokenCallbackState)
+                                                as *mut c_void,
+                                        );
 
                                         if completion_tokens_i32 > 0 {
                                             cb_state.completion_tokens =
@@ -2479,19 +2408,6 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                             &Command::V1(done_chunk),
                                         );
 
-                                        {
-                                            let mut active = ANDROID_ACTIVE_TASK_ID
-                                                .get()
-                                                .expect("ANDROID_ACTIVE_TASK_ID is set")
-                                                .lock()
-                                                .unwrap();
-                                            if active.as_deref()
-                                                == Some(task_id_for_thread.as_str())
-                                            {
-                                                *active = None;
-                                            }
-                                        }
-
                                         let execution_time =
                                             start_time.elapsed().as_millis() as u64;
                                         invoke_callback(
@@ -2530,18 +2446,25 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                         &format!("Task: {}", task_id),
                                     );
 
+                                    use crate::generate_for_task;
                                     use crate::llama_context;
-                                    use crate::{
-                                        gpuf_start_generation_async, GLOBAL_CONTEXT_PTR,
-                                        GLOBAL_INFERENCE_MUTEX,
-                                    };
                                     use std::ffi::CString;
                                     use std::os::raw::c_void;
 
-                                    let context_ptr = GLOBAL_CONTEXT_PTR.load(Ordering::SeqCst);
-                                    if context_ptr.is_null() {
-                                        let err = "Model not loaded - please load a model first"
-                                            .to_string();
+                                    // Keeps the pair alive across model swaps.
+                                    let lease = crate::lease_current_model();
+                                    let context_ptr = lease
+                                        .as_ref()
+                                        .map_or(std::ptr::null_mut(), |lease| lease.context());
+                                    let refusal = if context_ptr.is_null() {
+                                        Some(
+                                            "Model not loaded - please load a model first"
+                                                .to_string(),
+                                        )
+                                    } else {
+                                        crate::util::governor::admit().err()
+                                    };
+                                    if let Some(err) = refusal {
                                         let result_command = CommandV1::InferenceResultChunk {
                                             task_id: task_id.clone(),
                                             seq: 0,
@@ -2571,15 +2494,6 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                     )
                                     .unwrap_or_else(|| build_chat_prompt(&messages));
 
-                                    {
-                                        let mut active = ANDROID_ACTIVE_TASK_ID
-                                            .get()
-                                            .expect("ANDROID_ACTIVE_TASK_ID is set")
-                                            .lock()
-                                            .unwrap();
-                                        *active = Some(task_id.clone());
-                                    }
-
                                     let writer_stream = match stream.try_clone() {
                                         Ok(s) => s,
                                         Err(e) => {
@@ -2613,6 +2527,7 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                     let context_ptr_usize = context_ptr as usize;
                                     std::thread::spawn(move || {
                                         let context_ptr = context_ptr_usize as *mut llama_context;
+                                        let _lease = lease;
 
                                         #[repr(C)]
                                         struct TokenCallbackState {
@@ -2627,6 +2542,8 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                             final_tokens: u32,
                                             buf_phase: OutputPhase,
                                             splitter: PhaseSplitter,
+                                            /// Scratch for this request; reset and pooled when the state drops.
+                                            _arena: ArenaLease,
                                             suppress: bool,
                                         }
 
@@ -2738,7 +2655,6 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                             );
                                         }
 
-                                        let _lock = GLOBAL_INFERENCE_MUTEX.lock().unwrap();
                                         let start_time = std::time::Instant::now();
                                         let prompt_cstr = match CString::new(prompt_for_thread) {
                                             Ok(s) => s,
@@ -2773,8 +2689,12 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                             }
                                         };
 
-                                        let prompt_tokens: u32 =
-                                            count_prompt_tokens(context_ptr, prompt_cstr.as_ptr());
+                                        let arena = arena::lease();
+                                        let prompt_tokens: u32 = count_prompt_tokens(
+                                            &arena,
+                                            context_ptr,
+                                            prompt_cstr.as_ptr(),
+                                        );
 
                                         let mut cb_state = TokenCallbackState {
                                             stream: writer_stream,
@@ -2788,23 +2708,23 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                             final_tokens: 0,
                                             buf_phase: OutputPhase::Final,
                                             splitter: PhaseSplitter::default(),
+                                            _arena: arena,
                                             suppress: false,
                                         };
 
-                                        let completion_tokens = unsafe {
-                                            gpuf_start_generation_async(
-                                                context_ptr,
-                                                prompt_cstr.as_ptr(),
-                                                max_tokens as i32,
-                                                temperature,
-                                                top_k as i32,
-                                                top_p,
-                                                repeat_penalty,
-                                                Some(on_token),
-                                                (&mut cb_state as *mut TokenCallbackState)
-                                                    as *mut c_void,
-                                            )
-                                        };
+                                        let completion_tokens = generate_for_task(
+                                            context_ptr,
+                                            &task_id_for_thread,
+                                            &prompt_cstr,
+                                            max_tokens as i32,
+                                            temperature,
+                                            top_k as i32,
+                                            top_p,
+                                            repeat_penalty,
+                                            Some(on_token),
+                                            (&mut cb_state as *mut TokenCallbackState)
+                                                as *mut c_void,
+                                        );
 
                                         cb_state.completion_tokens = completion_tokens as u32;
 
@@ -2846,19 +2766,6 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                             &Command::V1(done_chunk),
                                         );
 
-                                        {
-                                            let mut active = ANDROID_ACTIVE_TASK_ID
-                                                .get()
-                                                .expect("ANDROID_ACTIVE_TASK_ID is set")
-                                                .lock()
-                                                .unwrap();
-                                            if active.as_deref()
-                                                == Some(task_id_for_thread.as_str())
-                                            {
-                                                *active = None;
-                                            }
-                                        }
-
                                         let execution_time =
                                             start_time.elapsed().as_millis() as u64;
                                         invoke_callback(
@@ -2871,22 +2778,35 @@ pub async fn start_worker_tasks_with_callback_ptr(
                                     });
                                 }
 
-                                CommandV1::CancelInference { task_id } => {
-                                    let should_cancel = {
-                                        let active_lock = ANDROID_ACTIVE_TASK_ID
-                                            .get()
-                                            .expect("ANDROID_ACTIVE_TASK_ID is set")
-                                            .lock()
-                                            .unwrap();
-                                        active_lock.as_deref() == Some(task_id.as_str())
+                                CommandV1::RequestDeviceState => {
+                                    DEVICE_STATE_REQUESTED.store(true, Ordering::Relaxed);
+                                }
+                                CommandV1::RequestLoadBeacon { interval_ms } => {
+                                    LOAD_BEACON_INTERVAL_MS
+                                        .store(interval_ms.max(1000), Ordering::Relaxed);
+                                }
+                                CommandV1::RequestContextProfile => {
+                                    let client_id = ANDROID_CLIENT_ID
+                                        .get()
+                                        .and_then(|m| m.lock().ok().and_then(|g| *g))
+                                        .unwrap_or([0u8; 16]);
+                                    let reply = CommandV1::ContextProfile {
+                                        client_id,
+                                        profile: crate::util::device_profile::current(),
                                     };
-
-                                    if should_cancel {
-                                        use crate::{gpuf_stop_generation, GLOBAL_CONTEXT_PTR};
-                                        let context_ptr = GLOBAL_CONTEXT_PTR.load(Ordering::SeqCst);
-                                        if !context_ptr.is_null() {
-                                            unsafe { gpuf_stop_generation(context_ptr) };
-                                        }
+                                    println!("📐 Android: Reporting context profile: {:?}", reply);
+                                    let _ = common::write_command_sync(
+                                        &mut *stream,
+                                        &Command::V1(reply),
+                                    );
+                                }
+                                CommandV1::CancelInference { task_id } => {
+                                    // Stops only this task's sequence; other tasks keep decoding.
+                                    if !crate::batch_engine::cancel_task(&task_id) {
+                                        println!(
+                                            "⚠️ Android: No running sequence for task {}",
+                                            task_id
+                                        );
                                     }
                                 }
                                 _ => {
@@ -3014,7 +2934,10 @@ pub async fn stop_global_worker() {
 pub async fn get_worker_status() -> Result<String> {
     // Check if TCP connection is available (new architecture)
     if let Some(_tcp_stream) = get_android_tcp_stream() {
-        Ok("Worker is running".to_string())
+        Ok(format!(
+            "Worker is running (generation arena high-water: {} KB)",
+            arena::high_water_mark() / 1024
+        ))
     } else {
         Ok("Worker not available".to_string())
     }
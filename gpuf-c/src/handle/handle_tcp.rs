@@ -1,17 +1,29 @@
 use super::*;
 // LLM engine is not available in lightweight Android version
 #[cfg(not(target_os = "android"))]
-use crate::llm_engine::{self, llama_engine::LlamaEngine};
+use crate::llm_engine::{
+    self,
+    http_stream::{stream_generation, EngineInput, GenerationParams, StreamPiece},
+    llama_engine::LlamaEngine,
+};
 use crate::util::system_info::{
-    collect_device_info, collect_system_info, get_engine_models, pull_ollama_model,
+    collect_device_info, collect_system_info, engine_http_client, get_engine_models,
+    pull_ollama_model,
 };
+use crate::util::chat_template::FallbackTemplate;
 use crate::util::log_icon;
+use crate::util::model_peers::{self, PeerPieces, SeedRegistry};
+use crate::util::reliable_udp::Reassembler;
 use anyhow::{anyhow, Result};
 use common::{
-    format_bytes, format_duration, join_streams, read_command, write_command, Command, CommandV1,
-    CommandV2, DownloadStatus, EngineType as ClientEngineType, Model, OsType, OutputPhase,
-    P2PCandidate, P2PCandidateType, P2PConnectionType, P2PTransport, PodModel, SystemInfo,
-    MAX_MESSAGE_SIZE,
+    chunk::{ChunkCoalescer, ChunkTarget, ChunkUsage, TaskClock},
+    format_bytes, format_duration, join_streams,
+    markers::PhaseSplitter,
+    read_command,
+    relay::join_tcp_streams,
+    write_command, Command, CommandV1, CommandV2, DownloadStatus, EngineType as ClientEngineType,
+    Model, OsType, OutputPhase, P2PCandidate, P2PCandidateType, P2PConnectionType, P2PTransport,
+    PodModel, SystemInfo, MAX_MESSAGE_SIZE,
 };
 use tokio::io::AsyncWriteExt;
 
@@ -31,6 +43,9 @@ use tokio::net::UdpSocket;
 use tokio::time::interval;
 use tokio::time::timeout;
 
+/// Set once the server sent RequestTaskTimings on the current session.
+static TASK_TIMINGS_REQUESTED: AtomicBool = AtomicBool::new(false);
+
 // Global flag to track if HTTP server is already running
 #[cfg(not(target_os = "android"))]
 static HTTP_SERVER_STARTED: AtomicBool = AtomicBool::new(false);
@@ -114,199 +129,6 @@ fn filter_control_tokens(text: &str) -> String {
         .replace("<|message|>", "")
 }
 
-#[derive(Debug, Clone)]
-struct PhaseSplitter {
-    phase: OutputPhase,
-    carry: String,
-}
-
-impl Default for PhaseSplitter {
-    fn default() -> Self {
-        Self {
-            phase: OutputPhase::Final,
-            carry: String::new(),
-        }
-    }
-}
-
-impl PhaseSplitter {
-    fn next_marker(rest: &str) -> Option<(usize, OutputPhase, usize)> {
-        let mut best: Option<(usize, OutputPhase, usize)> = None;
-
-        // Tag markers (explicit and cross-model common patterns)
-        for (tag, to_phase) in [
-            ("<analysis>", OutputPhase::Analysis),
-            ("<think>", OutputPhase::Analysis),
-            ("<reasoning>", OutputPhase::Analysis),
-            ("<final>", OutputPhase::Final),
-        ] {
-            if let Some(idx) = rest.find(tag) {
-                let cand = (idx, to_phase, tag.len());
-                best = Some(match best {
-                    None => cand,
-                    Some(cur) => if cand.0 < cur.0 { cand } else { cur },
-                });
-            }
-        }
-
-        // End tags: go back to Final.
-        for tag in ["</analysis>", "</think>", "</reasoning>", "</final>"] {
-            if let Some(idx) = rest.find(tag) {
-                let cand = (idx, OutputPhase::Final, tag.len());
-                best = Some(match best {
-                    None => cand,
-                    Some(cur) => if cand.0 < cur.0 { cand } else { cur },
-                });
-            }
-        }
-
-        // Line-based markers (must be at beginning-of-line).
-        // We consider both start-of-string and after '\n'.
-        for (pat, to_phase) in [
-            ("### Final", OutputPhase::Final),
-            ("Final:", OutputPhase::Final),
-            ("final:", OutputPhase::Final),
-            ("final", OutputPhase::Final),
-            ("### Answer", OutputPhase::Final),
-            ("### 思考", OutputPhase::Analysis),
-            ("思考：", OutputPhase::Analysis),
-            ("分析：", OutputPhase::Analysis),
-            ("analysis:", OutputPhase::Analysis),
-            ("analysis", OutputPhase::Analysis),
-            ("### 答案", OutputPhase::Final),
-            ("答案：", OutputPhase::Final),
-        ] {
-            if rest.starts_with(pat) {
-                // Guard: for plain "analysis"/"final" tokens, require boundary (space/newline/:) to reduce false positives.
-                if (pat == "analysis" || pat == "final")
-                    && rest.len() > pat.len()
-                    && !rest[pat.len()..].starts_with([' ', '\n', '\r', '\t', ':'])
-                {
-                    // Likely normal word usage (e.g. "analysis-based"), ignore.
-                } else {
-                    let cand = (0usize, to_phase, pat.len());
-                    best = Some(match best {
-                        None => cand,
-                        Some(cur) => if cand.0 < cur.0 { cand } else { cur },
-                    });
-                }
-            }
-            let needle = format!("\n{}", pat);
-            if let Some(idx) = rest.find(&needle) {
-                // idx points to '\n', marker starts right after it.
-                let cand = (idx + 1, to_phase, pat.len());
-                best = Some(match best {
-                    None => cand,
-                    Some(cur) => if cand.0 < cur.0 { cand } else { cur },
-                });
-            }
-        }
-
-        best
-    }
-
-    fn split_tail_for_carry<'a>(tail: &'a str) -> (&'a str, &'a str) {
-        // Keep at most max_marker_len-1 chars as carry if it could be a prefix of any marker.
-        // This allows markers to cross chunk boundaries.
-        let markers = [
-            "<analysis>", "</analysis>",
-            "<think>", "</think>",
-            "<reasoning>", "</reasoning>",
-            "<final>", "</final>",
-            "### Final", "Final:", "### Answer",
-            "final:", "final",
-            "### 思考", "思考：", "分析：",
-            "analysis:", "analysis",
-            "### 答案", "答案：",
-        ];
-        let max_len = markers.iter().map(|s| s.len()).max().unwrap_or(0);
-
-        let mut carry_len: usize = 0;
-        let max_scan = (max_len.saturating_sub(1)).min(tail.len());
-
-        for l in 1..=max_scan {
-            let start = tail.len() - l;
-            if !tail.is_char_boundary(start) {
-                continue;
-            }
-            let suf = &tail[start..];
-            if markers.iter().any(|m| m.starts_with(suf)) {
-                carry_len = l;
-            }
-            // also allow line-markers preceded by '\n'
-            if markers.iter().any(|m| {
-                let nm = format!("\n{}", m);
-                nm.starts_with(suf)
-            }) {
-                carry_len = l;
-            }
-        }
-
-        if carry_len == 0 {
-            return (tail, "");
-        }
-
-        let split = tail.len() - carry_len;
-        if !tail.is_char_boundary(split) {
-            return (tail, "");
-        }
-        (&tail[..split], &tail[split..])
-    }
-
-    fn phase(&self) -> OutputPhase {
-        self.phase
-    }
-
-    fn push(&mut self, text: &str) -> Vec<(OutputPhase, String)> {
-        if text.is_empty() {
-            return Vec::new();
-        }
-
-        let mut combined = String::new();
-        if !self.carry.is_empty() {
-            combined.push_str(&self.carry);
-            self.carry.clear();
-        }
-        combined.push_str(text);
-
-        let mut out: Vec<(OutputPhase, String)> = Vec::new();
-        let mut pos: usize = 0;
-
-        while pos < combined.len() {
-            let rest = &combined[pos..];
-
-            let Some((rel_pos, to_phase, marker_len)) = Self::next_marker(rest) else {
-                let tail = &combined[pos..];
-                let (safe, carry) = Self::split_tail_for_carry(tail);
-                if !safe.is_empty() {
-                    out.push((self.phase, safe.to_string()));
-                }
-                self.carry = carry.to_string();
-                break;
-            };
-
-            let tag_pos = pos + rel_pos;
-
-            if tag_pos > pos {
-                let seg = &combined[pos..tag_pos];
-                if !seg.is_empty() {
-                    out.push((self.phase, seg.to_string()));
-                }
-            }
-
-            // If the tag is incomplete at the end, save to carry and stop.
-            if tag_pos + marker_len > combined.len() {
-                self.carry = combined[tag_pos..].to_string();
-                break;
-            }
-
-            self.phase = to_phase;
-            pos = tag_pos + marker_len;
-        }
-        out
-    }
-}
-
 fn derive_model_id_from_path(model_path: &str) -> String {
     let lower = model_path.to_ascii_lowercase();
     if lower.contains("llama-3") || lower.contains("llama3") {
@@ -340,7 +162,46 @@ fn derive_model_id_from_path(model_path: &str) -> String {
     base.to_string()
 }
 
-const CURRENT_VERSION: u32 = 1;
+const CURRENT_VERSION: u32 = 8;
+
+/// Piece size of model downloads; peers must agree on it to share pieces.
+const MODEL_PIECE_SIZE: usize = 8 * 1024 * 1024;
+/// How often a downloading worker re-announces the pieces it holds.
+const SEED_ADVERTISE_INTERVAL: Duration = Duration::from_secs(30);
+/// How long a proxy connection may sit idle before its first request. The
+/// server opens them ahead of requests and recycles them after two minutes.
+const PROXY_IDLE_TIMEOUT: Duration = Duration::from_secs(150);
+
+/// Wait for the first bytes of a request on a proxy connection, which may
+/// have been opened before there was one. None if it closes idle.
+async fn read_first_request<S: tokio::io::AsyncRead + Unpin>(
+    proxy_stream: &mut S,
+    proxy_conn_id: &[u8; 16],
+) -> Result<Option<Vec<u8>>> {
+    use tokio::io::AsyncReadExt;
+
+    let mut first = vec![0u8; 16 * 1024];
+    match timeout(PROXY_IDLE_TIMEOUT, proxy_stream.read(&mut first)).await {
+        Ok(Ok(0)) | Err(_) => {
+            debug!("proxy_conn_id {:?} closed while idle", proxy_conn_id);
+            Ok(None)
+        }
+        Ok(Ok(n)) => {
+            first.truncate(n);
+            Ok(Some(first))
+        }
+        Ok(Err(e)) => Err(e.into()),
+    }
+}
+
+/// Aborts a background task when dropped.
+struct AbortOnDrop(tokio::task::JoinHandle<()>);
+
+impl Drop for AbortOnDrop {
+    fn drop(&mut self) {
+        self.0.abort();
+    }
+}
 
 impl ClientWorker {
     /// Execute inference task using local LLM engine (Android specific)
@@ -389,23 +250,14 @@ impl ClientWorker {
 
         #[cfg(target_os = "android")]
         {
-            use crate::{
-                gpuf_generate_final_solution_text, GLOBAL_CONTEXT_PTR, GLOBAL_INFERENCE_MUTEX,
-                GLOBAL_MODEL_PTR,
-            };
+            use crate::gpuf_generate_final_solution_text;
             use std::ffi::CString;
-            use std::sync::atomic::Ordering;
-
-            // Acquire global inference lock to prevent concurrent execution
-            let _lock = GLOBAL_INFERENCE_MUTEX.lock().unwrap();
 
-            // Get global model and context pointers
-            let model_ptr = GLOBAL_MODEL_PTR.load(Ordering::SeqCst);
-            let context_ptr = GLOBAL_CONTEXT_PTR.load(Ordering::SeqCst);
-
-            if model_ptr.is_null() || context_ptr.is_null() {
-                return Err(anyhow!("Model not loaded - please load a model first"));
-            }
+            // The lease keeps the pair alive if a model swap lands mid-call.
+            let lease = crate::lease_current_model()
+                .ok_or_else(|| anyhow!("Model not loaded - please load a model first"))?;
+            let model_ptr = lease.model();
+            let context_ptr = lease.context();
 
             // Convert prompt to CString
             let prompt_cstr = CString::new(prompt).map_err(|e| anyhow!("Invalid prompt: {}", e))?;
@@ -415,7 +267,7 @@ impl ClientWorker {
 
             // Execute inference using existing JNI function
             // SAFETY: We're calling an FFI function with valid pointers:
-            // - model_ptr and context_ptr are checked for null above
+            // - model_ptr and context_ptr belong to the lease held above
             // - prompt_cstr.as_ptr() is a valid C string pointer
             // - output buffer is properly sized and mutable
             let result = gpuf_generate_final_solution_text(
@@ -440,9 +292,13 @@ impl ClientWorker {
         }
     }
 
+    /// Stream one task's output to the server. `clock` started when the task
+    /// arrived and has its prompt marked ready.
     async fn stream_inference_task_to_server(
         &self,
         task_id: String,
+        target: ChunkTarget,
+        mut clock: TaskClock,
         prompt: String,
         max_tokens: u32,
         temperature: f32,
@@ -459,6 +315,25 @@ impl ClientWorker {
                 .as_ref()
                 .ok_or_else(|| anyhow!("Engine not initialized"))?;
 
+            if let Some(http) = engine.http_target() {
+                let http = http?;
+                drop(engine_guard);
+                let params = GenerationParams {
+                    max_tokens,
+                    temperature,
+                    top_k,
+                    top_p,
+                    repeat_penalty,
+                    repeat_last_n,
+                };
+                let stream =
+                    stream_generation(&http, &EngineInput::Prompt(prompt), &params).await?;
+                clock.submitted();
+                return self
+                    .forward_generation_stream(&task_id, &target, clock, stream, 0)
+                    .await;
+            }
+
             let AnyEngine::Llama(llama) = engine else {
                 return Err(anyhow!(
                     "stream_inference_task_to_server is only supported for LLAMA engine"
@@ -501,202 +376,176 @@ impl ClientWorker {
             let stream = llama
                 .stream_with_cached_model_sampling(&prompt, max_tokens as usize, &sampling)
                 .await?;
+            clock.submitted();
 
-            let mut stream = Box::pin(stream);
+            let stream = stream.map(|piece| piece.map(StreamPiece::Token));
+            return self
+                .forward_generation_stream(&task_id, &target, clock, stream, prompt_tokens)
+                .await;
+        }
 
-            let max_bytes: usize = self.args.stream_chunk_bytes.max(1);
-            let mut seq: u32 = 0;
-            let mut buf = String::new();
-            let mut buf_phase: OutputPhase = OutputPhase::Unknown;
-            let mut completion_tokens: u32 = 0;
-            let mut analysis_tokens: u32 = 0;
-            let mut final_tokens: u32 = 0;
-            let mut splitter = PhaseSplitter::default();
+        #[cfg(target_os = "android")]
+        {
+            let _ = (
+                task_id,
+                target,
+                clock,
+                prompt,
+                max_tokens,
+                temperature,
+                top_k,
+                top_p,
+                repeat_penalty,
+                repeat_last_n,
+                min_keep,
+            );
+            Err(anyhow!("Android streaming is not implemented"))
+        }
+    }
 
-            let mut cancelled_early = false;
-            loop {
-                {
+    /// Forward generated pieces to the server as coalesced chunks until the
+    /// stream ends or the task is cancelled. Returning drops the stream,
+    /// which for the HTTP engines closes the upstream request. Stage times
+    /// from `clock` precede the final chunk once the server asked for them.
+    #[cfg(not(target_os = "android"))]
+    async fn forward_generation_stream<S>(
+        &self,
+        task_id: &str,
+        target: &ChunkTarget,
+        mut clock: TaskClock,
+        stream: S,
+        prompt_tokens: u32,
+    ) -> Result<()>
+    where
+        S: futures_util::Stream<Item = Result<StreamPiece>>,
+    {
+        let mut stream = Box::pin(stream);
+
+        let mut coalescer = ChunkCoalescer::new(
+            self.args.stream_chunk_bytes,
+            Duration::from_millis(self.args.stream_chunk_interval_ms),
+        );
+        let mut seq: u32 = 0;
+        let mut usage = ChunkUsage {
+            prompt_tokens,
+            ..Default::default()
+        };
+        let mut splitter = PhaseSplitter::default();
+
+        let mut cancelled_early = false;
+        loop {
+            {
+                let cancelled = self.cancel_state.cancelled.lock().await;
+                if cancelled.contains(task_id) {
+                    cancelled_early = true;
+                    debug!(task_id = %task_id, "Cancellation observed in stream loop");
+                    break;
+                }
+            }
+
+            // The coalescer only checks its window when a piece arrives, so
+            // also wake at its deadline.
+            let deadline = coalescer.deadline();
+            let flush_at = deadline.unwrap_or_else(std::time::Instant::now);
+            tokio::select! {
+                _ = self.cancel_state.notify.notified() => {
                     let cancelled = self.cancel_state.cancelled.lock().await;
-                    if cancelled.contains(&task_id) {
+                    if cancelled.contains(task_id) {
                         cancelled_early = true;
-                        debug!(task_id = %task_id, "Cancellation observed in stream loop");
+                        debug!(task_id = %task_id, "Cancellation notified during streaming");
                         break;
                     }
                 }
-
-                tokio::select! {
-                    _ = self.cancel_state.notify.notified() => {
-                        let cancelled = self.cancel_state.cancelled.lock().await;
-                        if cancelled.contains(&task_id) {
-                            cancelled_early = true;
-                            debug!(task_id = %task_id, "Cancellation notified during streaming");
-                            break;
-                        }
+                _ = tokio::time::sleep_until(flush_at.into()), if deadline.is_some() => {
+                    if let Some((phase, delta)) = coalescer.flush() {
+                        self.send_command(target.delta(seq, delta, phase, usage))
+                            .await?;
+                        seq = seq.wrapping_add(1);
                     }
-                    piece_res = stream.next() => {
-                        let Some(piece_res) = piece_res else {
-                            break;
-                        };
-                        let piece = piece_res?;
-                        let filtered = filter_control_tokens(&piece);
-                        // Each streamed `piece` corresponds to (at most) one generated token.
-                        // Never count bytes/chars here, otherwise completion_tokens can greatly exceed max_tokens.
-                        completion_tokens = completion_tokens.saturating_add(1);
-
-                        let segs = splitter.push(&filtered);
-                        for (phase, seg) in segs {
-                            if seg.is_empty() {
-                                continue;
-                            }
-                            match phase {
-                                OutputPhase::Analysis => {
-                                    analysis_tokens = analysis_tokens.saturating_add(1);
-                                }
-                                OutputPhase::Final => {
-                                    final_tokens = final_tokens.saturating_add(1);
-                                }
-                                OutputPhase::Unknown => {}
+                }
+                piece_res = stream.next() => {
+                    let Some(piece_res) = piece_res else {
+                        break;
+                    };
+                    let piece = match piece_res? {
+                        StreamPiece::Token(piece) => {
+                            clock.token();
+                            piece
+                        }
+                        StreamPiece::Usage { prompt_tokens, completion_tokens } => {
+                            // Engine-reported counts are authoritative
+                            usage.prompt_tokens = prompt_tokens;
+                            usage.completion_tokens = completion_tokens;
+                            continue;
+                        }
+                    };
+                    let filtered = filter_control_tokens(&piece);
+                    // Each streamed `piece` corresponds to (at most) one generated token.
+                    // Never count bytes/chars here, otherwise completion_tokens can greatly exceed max_tokens.
+                    usage.completion_tokens = usage.completion_tokens.saturating_add(1);
+
+                    let segs = splitter.push(&filtered);
+                    for (phase, seg) in segs {
+                        if seg.is_empty() {
+                            continue;
+                        }
+                        match phase {
+                            OutputPhase::Analysis => {
+                                usage.analysis_tokens = usage.analysis_tokens.saturating_add(1);
                             }
-
-                            if buf.is_empty() {
-                                buf_phase = phase;
-                            } else if buf_phase != phase {
-                                let delta = std::mem::take(&mut buf);
-                                let chunk = CommandV1::InferenceResultChunk {
-                                    task_id: task_id.clone(),
-                                    seq,
-                                    delta,
-                                    phase: buf_phase,
-                                    done: false,
-                                    error: None,
-                                    prompt_tokens,
-                                    completion_tokens,
-                                    analysis_tokens,
-                                    final_tokens,
-                                };
-                                self.send_command(chunk).await?;
-                                seq = seq.wrapping_add(1);
-                                buf_phase = phase;
+                            OutputPhase::Final => {
+                                usage.final_tokens = usage.final_tokens.saturating_add(1);
                             }
+                            OutputPhase::Unknown => {}
+                        }
 
-                            buf.push_str(&seg);
-                            if buf.len() >= max_bytes {
-                                let delta = std::mem::take(&mut buf);
-                                let chunk = CommandV1::InferenceResultChunk {
-                                    task_id: task_id.clone(),
-                                    seq,
-                                    delta,
-                                    phase: buf_phase,
-                                    done: false,
-                                    error: None,
-                                    prompt_tokens,
-                                    completion_tokens,
-                                    analysis_tokens,
-                                    final_tokens,
-                                };
-                                self.send_command(chunk).await?;
-                                seq = seq.wrapping_add(1);
-                            }
+                        for (phase, delta) in coalescer.push(phase, &seg) {
+                            self.send_command(target.delta(seq, delta, phase, usage))
+                                .await?;
+                            seq = seq.wrapping_add(1);
                         }
                     }
                 }
             }
+        }
+        drop(stream);
 
-            if !buf.is_empty() {
-                let chunk = CommandV1::InferenceResultChunk {
-                    task_id: task_id.clone(),
-                    seq,
-                    delta: buf,
-                    phase: buf_phase,
-                    done: false,
-                    error: None,
-                    prompt_tokens,
-                    completion_tokens,
-                    analysis_tokens,
-                    final_tokens,
-                };
-                self.send_command(chunk).await?;
+        if let Some((phase, tail)) = splitter.finish() {
+            for (phase, delta) in coalescer.push(phase, tail) {
+                self.send_command(target.delta(seq, delta, phase, usage))
+                    .await?;
                 seq = seq.wrapping_add(1);
             }
+        }
+        if let Some((phase, delta)) = coalescer.flush() {
+            self.send_command(target.delta(seq, delta, phase, usage))
+                .await?;
+            seq = seq.wrapping_add(1);
+        }
 
-            let done_chunk = CommandV1::InferenceResultChunk {
-                task_id: task_id.clone(),
-                seq,
-                delta: String::new(),
-                phase: splitter.phase(),
-                done: true,
-                error: None,
-                prompt_tokens,
-                completion_tokens,
-                analysis_tokens,
-                final_tokens,
-            };
-            self.send_command(done_chunk).await?;
-
-            if cancelled_early {
-                debug!(task_id = %task_id, "Sent done chunk after cancellation");
-            }
+        if TASK_TIMINGS_REQUESTED.load(Ordering::Relaxed) {
+            self.send_command(CommandV1::TaskTimings {
+                task_id: task_id.to_string(),
+                timings: clock.finish(),
+            })
+            .await?;
+        }
+        self.send_command(target.done(seq, splitter.phase(), None, usage))
+            .await?;
 
-            {
-                let mut cancelled = self.cancel_state.cancelled.lock().await;
-                cancelled.remove(&task_id);
-            }
-            return Ok(());
+        if cancelled_early {
+            debug!(task_id = %task_id, "Sent done chunk after cancellation");
         }
 
-        #[cfg(target_os = "android")]
         {
-            let _ = (
-                task_id,
-                prompt,
-                max_tokens,
-                temperature,
-                top_k,
-                top_p,
-                repeat_penalty,
-                repeat_last_n,
-                min_keep,
-            );
-            Err(anyhow!("Android streaming is not implemented"))
+            let mut cancelled = self.cancel_state.cancelled.lock().await;
+            cancelled.remove(task_id);
         }
+        Ok(())
     }
 
     fn build_chat_prompt_fallback(&self, messages: &[common::ChatMessage]) -> String {
-        let template = std::env::var("CHAT_TEMPLATE").unwrap_or_else(|_| "simple".to_string());
-        match template.to_ascii_lowercase().as_str() {
-            "chatml" => {
-                let mut prompt = String::new();
-                for msg in messages {
-                    prompt.push_str(&format!("{}\n{}\n", msg.role, msg.content));
-                }
-                prompt.push_str("\nassistant\n");
-                prompt
-            }
-            "llama3" => {
-                let mut prompt = String::from("<|begin_of_text|>");
-                for msg in messages {
-                    prompt.push_str(&format!(
-                        "<|start_header_id|>{}\n\n{}\n<|eot_id|>",
-                        msg.role, msg.content
-                    ));
-                }
-                prompt.push_str("<|start_header_id|>assistant\n\n");
-                prompt
-            }
-            _ => {
-                let mut prompt = String::new();
-                for msg in messages {
-                    let role = match msg.role.as_str() {
-                        "user" => "Human",
-                        "assistant" => "Assistant",
-                        _ => "System",
-                    };
-                    prompt.push_str(&format!("{}: {}\n\n", role, msg.content));
-                }
-                prompt.push_str("Assistant: ");
-                prompt
-            }
-        }
+        FallbackTemplate::from_env_or(FallbackTemplate::Simple).render(messages)
     }
 
     /// Send command to server
@@ -1597,8 +1446,62 @@ impl ClientWorker {
         Ok(())
     }
 
-    /// Download and manage model for Llama engine with progress reporting
-    pub async fn deal_with_pod_model(&self, pod_model: &PodModel) -> Result<()> {
+    async fn seed_addrs(&self, port: u16) -> Vec<String> {
+        match self
+            .get_advertise_ip()
+            .await
+            .map(|ip| ip.parse::<std::net::IpAddr>())
+        {
+            Ok(Ok(ip)) => vec![std::net::SocketAddr::new(ip, port).to_string()],
+            _ => Vec::new(),
+        }
+    }
+
+    /// Serve a complete local copy of a model to peers and tell the server.
+    /// A copy without a `.pieces` file is hashed first, so this runs in the
+    /// background.
+    async fn seed_local_model(&self, model_path: &std::path::Path, checksum: Option<&String>) {
+        let seeds = model_peers::start_seeding(self.args.p2p_seed_port);
+        let (Some(seeds), Some(checksum)) = (seeds, checksum.cloned()) else {
+            return;
+        };
+        let seed_addrs = self.seed_addrs(seeds.port()).await;
+        let writer = self.writer.clone();
+        let path = model_path.to_path_buf();
+        tokio::spawn(async move {
+            if seeds.get(&checksum).is_none() {
+                match model_peers::open_seed(&path, &checksum, MODEL_PIECE_SIZE as u64).await {
+                    Ok(seed) => seeds.insert(seed),
+                    Err(e) => {
+                        warn!("Not seeding {:?}: {}", path, e);
+                        return;
+                    }
+                }
+            }
+            Self::advertise_seed(writer, &seeds, &checksum, seed_addrs).await;
+        });
+    }
+
+    async fn advertise_seed(
+        writer: Arc<Mutex<WriteHalf<TcpStream>>>,
+        seeds: &SeedRegistry,
+        checksum: &str,
+        seed_addrs: Vec<String>,
+    ) {
+        if let Some(cmd) = seeds.advertisement(checksum, seed_addrs) {
+            if let Err(e) = Self::send_command_v2_on_writer(writer, cmd).await {
+                debug!("Failed to advertise model pieces: {}", e);
+            }
+        }
+    }
+
+    /// Download and manage model for Llama engine with progress reporting.
+    /// Pieces come from `peers` where they can.
+    pub async fn deal_with_pod_model(
+        &self,
+        pod_model: &PodModel,
+        peers: Option<Arc<PeerPieces>>,
+    ) -> Result<()> {
         let model_name = match &pod_model.model_name {
             Some(name) => name.clone(),
             None => return Ok(()),
@@ -1626,13 +1529,15 @@ impl ClientWorker {
         let model_path_str = model_path.to_string_lossy().to_string();
 
         // Check if model is already loaded
-        if let Ok(status) = crate::MODEL_STATUS.lock() {
-            if let Some(current_model) = &status.current_model {
-                if current_model == &model_path_str && status.is_loaded {
-                    info!("Model {} is already loaded, skipping", model_name);
-                    return Ok(());
-                }
-            }
+        let already_loaded = crate::MODEL_STATUS.lock().is_ok_and(|status| {
+            status.is_loaded && status.current_model.as_deref() == Some(model_path_str.as_str())
+        });
+        if already_loaded {
+            info!("Model {} is already loaded, skipping", model_name);
+            // The server forgets what a worker seeds when it disconnects.
+            self.seed_local_model(&model_path, pod_model.checksum.as_ref())
+                .await;
+            return Ok(());
         }
 
         // Check if model file already exists and is complete
@@ -1650,6 +1555,8 @@ impl ClientWorker {
         // If model exists and is complete, load it directly without downloading
         if model_exists_and_complete {
             info!("Model {} already exists locally, loading directly", model_name);
+            self.seed_local_model(&model_path, pod_model.checksum.as_ref())
+                .await;
             
             // Update MODEL_STATUS
             if let Ok(mut status) = crate::MODEL_STATUS.lock() {
@@ -1688,7 +1595,7 @@ impl ClientWorker {
         info!("Starting download for model: {} from {}", model_name, download_url);
 
         // Check existing bytes for resume.
-        // Note: parallel downloads store partial progress in a "<model>.parts" directory.
+        // Note: parallel downloads keep partial progress in "<model>.part" until complete.
         let mut already_downloaded = if model_path.exists() {
             tokio::fs::metadata(&model_path)
                 .await
@@ -1700,19 +1607,8 @@ impl ClientWorker {
         };
 
         if already_downloaded == 0 {
-            let mut p = model_path.to_string_lossy().to_string();
-            p.push_str(".parts");
-            let parts_dir = std::path::PathBuf::from(p);
-
-            if let Ok(mut dir) = tokio::fs::read_dir(&parts_dir).await {
-                while let Ok(Some(entry)) = dir.next_entry().await {
-                    if let Ok(meta) = entry.metadata().await {
-                        if meta.is_file() {
-                            already_downloaded = already_downloaded.saturating_add(meta.len());
-                        }
-                    }
-                }
-            }
+            already_downloaded =
+                crate::util::model_downloader::partial_download_size(&model_path).await;
         }
 
         // Only send an initial progress event when we have non-zero progress to report.
@@ -1739,7 +1635,7 @@ impl ClientWorker {
             url: download_url.clone(),
             output_path: model_path.clone(),
             parallel_chunks: 4,
-            chunk_size: 8 * 1024 * 1024,
+            chunk_size: MODEL_PIECE_SIZE,
             expected_size: pod_model.expected_size,
             checksum: pod_model.checksum.clone(),
             resume: true,
@@ -1751,7 +1647,37 @@ impl ClientWorker {
         let model_name_clone = model_name.clone();
         let last_report_time = Arc::new(std::sync::Mutex::new(std::time::Instant::now()));
 
+        let seeds = model_peers::start_seeding(self.args.p2p_seed_port);
+        let seed_addrs = match &seeds {
+            Some(seeds) => self.seed_addrs(seeds.port()).await,
+            None => Vec::new(),
+        };
+        // Share pieces while still downloading.
+        let _advertiser = match (&seeds, &pod_model.checksum) {
+            (Some(seeds), Some(checksum)) if peers.is_some() => {
+                let (seeds, checksum, seed_addrs) =
+                    (seeds.clone(), checksum.clone(), seed_addrs.clone());
+                let writer = self.writer.clone();
+                Some(AbortOnDrop(tokio::spawn(async move {
+                    let mut ticker = interval(SEED_ADVERTISE_INTERVAL);
+                    ticker.tick().await;
+                    loop {
+                        ticker.tick().await;
+                        Self::advertise_seed(writer.clone(), &seeds, &checksum, seed_addrs.clone())
+                            .await;
+                    }
+                })))
+            }
+            _ => None,
+        };
+
         let mut downloader = crate::util::model_downloader::ModelDownloader::new(config);
+        if let Some(peers) = &peers {
+            downloader.set_peers(peers.clone());
+        }
+        if let Some(seeds) = &seeds {
+            downloader.set_seed_registry(seeds.clone());
+        }
         downloader.set_progress_callback({
             let last_report_time = last_report_time.clone();
             let model_name = model_name_clone.clone();
@@ -1798,6 +1724,15 @@ impl ClientWorker {
             match downloader.download().await {
                 Ok(_) => {
                     info!("Model {} downloaded successfully to {:?}", model_name, model_path);
+                    if let (Some(seeds), Some(checksum)) = (&seeds, &pod_model.checksum) {
+                        Self::advertise_seed(
+                            self.writer.clone(),
+                            seeds,
+                            checksum,
+                            seed_addrs.clone(),
+                        )
+                        .await;
+                    }
                     self.send_download_progress(
                         &model_name,
                         pod_model.expected_size.unwrap_or(0),
@@ -1856,12 +1791,18 @@ impl ClientWorker {
                             url: download_url.clone(),
                             output_path: model_path.clone(),
                             parallel_chunks: 4,
-                            chunk_size: 8 * 1024 * 1024,
+                            chunk_size: MODEL_PIECE_SIZE,
                             expected_size: pod_model.expected_size,
                             checksum: pod_model.checksum.clone(),
                             resume: true,
                         };
                         downloader = crate::util::model_downloader::ModelDownloader::new(config);
+                        if let Some(peers) = &peers {
+                            downloader.set_peers(peers.clone());
+                        }
+                        if let Some(seeds) = &seeds {
+                            downloader.set_seed_registry(seeds.clone());
+                        }
                         downloader.set_progress_callback({
                             let last_report_time = last_report_time.clone();
                             let model_name = model_name_clone.clone();
@@ -1993,7 +1934,7 @@ async fn check_and_restart_ollama() -> Result<()> {
     // Wait for Ollama to be ready
     let max_retries = 10;
     let mut retry_count = 0;
-    let client = reqwest::Client::new();
+    let client = engine_http_client();
 
     while retry_count < max_retries {
         match client
@@ -2031,6 +1972,8 @@ impl WorkerHandle for ClientWorker {
     fn login(&self) -> impl Future<Output = Result<()>> + Send {
         async move {
             info!("{} Starting login process...", log_icon("🔧", "[LOGIN]"));
+            // Re-requested by servers that want timings on this session.
+            TASK_TIMINGS_REQUESTED.store(false, Ordering::Relaxed);
             let login_cmd = CommandV1::Login {
                 version: CURRENT_VERSION,
                 auto_models: self.args.llama_model_path.is_none(),
@@ -2230,6 +2173,10 @@ impl WorkerHandle for ClientWorker {
             let mut p2p_turn_config: HashMap<[u8; 16], (Vec<String>, String, String, String)> =
                 HashMap::new();
             // (turn_urls, username, password, peer_id as hex) - peer_id used only for debugging/selection
+            // Compact chunk handles announced by the server ahead of each task.
+            let mut task_handles: HashMap<String, u32> = HashMap::new();
+            // Peers announced by the server ahead of the result naming a model.
+            let mut model_peers: HashMap<String, Arc<PeerPieces>> = HashMap::new();
             loop {
                 let cmd_result = read_command(&mut *self.reader.lock().await, &mut buf).await;
                 
@@ -2262,6 +2209,20 @@ impl WorkerHandle for ClientWorker {
                                 }
                                 self.cancel_state.notify.notify_waiters();
                             }
+                            CommandV1::TaskHandle { task_id, handle } => {
+                                task_handles.insert(task_id, handle);
+                            }
+                            CommandV1::RequestTaskTimings => {
+                                TASK_TIMINGS_REQUESTED.store(true, Ordering::Relaxed);
+                            }
+                            // Optional for protocol 4-7 clients; the desktop
+                            // agent leaves these to the server's defaults.
+                            CommandV1::TaskDecodeOptions { .. }
+                            | CommandV1::RequestContextProfile
+                            | CommandV1::RequestDeviceState
+                            | CommandV1::RequestLoadBeacon { .. } => {
+                                debug!("Ignoring optional request: {:?}", cmd_v1);
+                            }
                             CommandV1::LoginResult {
                                 success,
                                 pods_model,
@@ -2290,7 +2251,11 @@ impl WorkerHandle for ClientWorker {
                                             if self.engine_type == common::EngineType::Llama {
                                                 // Download errors should not crash the handler - just log and continue
                                                 // The download will be retried on next PullModelResult
-                                                if let Err(e) = self.deal_with_pod_model(pod_model).await {
+                                                let peers = pod_model
+                                                    .checksum
+                                                    .as_ref()
+                                                    .and_then(|c| model_peers.remove(c));
+                                                if let Err(e) = self.deal_with_pod_model(pod_model, peers).await {
                                                     error!("Failed to download/load model: {}. Will retry later.", e);
                                                 }
                                             } else if let Some(ref model_name) = pod_model.model_name {
@@ -2333,7 +2298,11 @@ impl WorkerHandle for ClientWorker {
                                         if self.engine_type == common::EngineType::Llama {
                                             // Download errors should not crash the handler - just log and continue
                                             // The download will be retried on next PullModelResult
-                                            if let Err(e) = self.deal_with_pod_model(pod_model).await {
+                                            let peers = pod_model
+                                                .checksum
+                                                .as_ref()
+                                                .and_then(|c| model_peers.remove(c));
+                                            if let Err(e) = self.deal_with_pod_model(pod_model, peers).await {
                                                 error!("Failed to download/load model: {}. Will retry later.", e);
                                             }
                                         } else if let Some(ref model_name) = pod_model.model_name {
@@ -2379,12 +2348,60 @@ impl WorkerHandle for ClientWorker {
                                 repeat_last_n,
                                 min_keep,
                             } => {
+                                let mut clock = TaskClock::start();
                                 info!(
                                     "Received chat inference task: {} messages: {} max_tokens: {}",
                                     task_id,
                                     messages.len(),
                                     max_tokens
                                 );
+                                let target = ChunkTarget::new(
+                                    task_id.clone(),
+                                    task_handles.remove(&task_id),
+                                );
+
+                                // HTTP engines render the chat with their own template
+                                #[cfg(not(target_os = "android"))]
+                                {
+                                    let http = {
+                                        let engine_guard = self.engine.lock().await;
+                                        engine_guard.as_ref().and_then(AnyEngine::http_target)
+                                    };
+                                    if let Some(http) = http {
+                                        let params = GenerationParams {
+                                            max_tokens,
+                                            temperature,
+                                            top_k,
+                                            top_p,
+                                            repeat_penalty,
+                                            repeat_last_n,
+                                        };
+                                        let input = EngineInput::Chat(messages);
+                                        // The engine renders the prompt server-side.
+                                        clock.prompt_ready();
+                                        let result = async {
+                                            let stream =
+                                                stream_generation(&http?, &input, &params).await?;
+                                            clock.submitted();
+                                            self.forward_generation_stream(
+                                                &task_id, &target, clock, stream, 0,
+                                            )
+                                            .await
+                                        }
+                                        .await;
+                                        if let Err(e) = result {
+                                            let chunk = target.done(
+                                                0,
+                                                OutputPhase::Unknown,
+                                                Some(e.to_string()),
+                                                ChunkUsage::default(),
+                                            );
+                                            self.send_command(chunk).await?;
+                                        }
+                                        continue;
+                                    }
+                                }
+
                                 let prompt = {
                                     #[cfg(target_os = "android")]
                                     {
@@ -2463,9 +2480,12 @@ impl WorkerHandle for ClientWorker {
                                         }
                                     }
                                 };
+                                clock.prompt_ready();
                                 let result = self
                                     .stream_inference_task_to_server(
                                         task_id.clone(),
+                                        target.clone(),
+                                        clock,
                                         prompt,
                                         max_tokens,
                                         temperature,
@@ -2478,18 +2498,12 @@ impl WorkerHandle for ClientWorker {
                                     .await;
 
                                 if let Err(e) = result {
-                                    let chunk = CommandV1::InferenceResultChunk {
-                                        task_id,
-                                        seq: 0,
-                                        delta: String::new(),
-                                        phase: OutputPhase::Unknown,
-                                        done: true,
-                                        completion_tokens: 0,
-                                        prompt_tokens: 0,
-                                        error: Some(e.to_string()),
-                                        analysis_tokens: 0,
-                                        final_tokens: 0,
-                                    };
+                                    let chunk = target.done(
+                                        0,
+                                        OutputPhase::Unknown,
+                                        Some(e.to_string()),
+                                        ChunkUsage::default(),
+                                    );
                                     self.send_command(chunk).await?;
                                 }
                             }
@@ -2504,10 +2518,16 @@ impl WorkerHandle for ClientWorker {
                                 repeat_last_n,
                                 min_keep,
                             } => {
+                                let mut clock = TaskClock::start();
+                                clock.prompt_ready();
                                 info!(
                                     "Received inference task: {} max_tokens: {}",
                                     task_id, max_tokens
                                 );
+                                let target = ChunkTarget::new(
+                                    task_id.clone(),
+                                    task_handles.remove(&task_id),
+                                );
 
                                 let start_time = std::time::Instant::now();
 
@@ -2516,6 +2536,8 @@ impl WorkerHandle for ClientWorker {
                                     let result = self
                                         .stream_inference_task_to_server(
                                             task_id.clone(),
+                                            target.clone(),
+                                            clock,
                                             prompt.clone(),
                                             max_tokens,
                                             temperature,
@@ -2529,24 +2551,20 @@ impl WorkerHandle for ClientWorker {
 
                                     let _execution_time = start_time.elapsed().as_millis() as u64;
                                     if let Err(e) = result {
-                                        let chunk = CommandV1::InferenceResultChunk {
-                                            task_id,
-                                            seq: 0,
-                                            delta: String::new(),
-                                            phase: OutputPhase::Unknown,
-                                            done: true,
-                                            completion_tokens: 0,
-                                            prompt_tokens: 0,
-                                            error: Some(e.to_string()),
-                                            analysis_tokens: 0,
-                                            final_tokens: 0,
-                                        };
+                                        let chunk = target.done(
+                                            0,
+                                            OutputPhase::Unknown,
+                                            Some(e.to_string()),
+                                            ChunkUsage::default(),
+                                        );
                                         self.send_command(chunk).await?;
                                     }
                                 }
 
                                 #[cfg(target_os = "android")]
                                 {
+                                    // Output is sent whole; there are no stages to report.
+                                    drop(clock);
                                     let result = self
                                         .execute_inference_task(
                                             &prompt,
@@ -2584,50 +2602,32 @@ impl WorkerHandle for ClientWorker {
                                                 }
 
                                                 let delta = output[start..end].to_string();
-                                                let chunk = CommandV1::InferenceResultChunk {
-                                                    task_id: task_id.clone(),
+                                                let chunk = target.delta(
                                                     seq,
                                                     delta,
-                                                    phase: OutputPhase::Unknown,
-                                                    done: false,
-                                                    error: None,
-                                                    prompt_tokens: 0,
-                                                    completion_tokens: 0,
-                                                    analysis_tokens: 0,
-                                                    final_tokens: 0,
-                                                };
+                                                    OutputPhase::Unknown,
+                                                    ChunkUsage::default(),
+                                                );
                                                 self.send_command(chunk).await?;
                                                 seq = seq.wrapping_add(1);
                                                 start = end;
                                             }
 
-                                            let done_chunk = CommandV1::InferenceResultChunk {
-                                                task_id,
+                                            let done_chunk = target.done(
                                                 seq,
-                                                delta: String::new(),
-                                                phase: OutputPhase::Unknown,
-                                                done: true,
-                                                error: None,
-                                                prompt_tokens: 0,
-                                                completion_tokens: 0,
-                                                analysis_tokens: 0,
-                                                final_tokens: 0,
-                                            };
+                                                OutputPhase::Unknown,
+                                                None,
+                                                ChunkUsage::default(),
+                                            );
                                             self.send_command(done_chunk).await?;
                                         }
                                         Err(e) => {
-                                            let chunk = CommandV1::InferenceResultChunk {
-                                                task_id,
-                                                seq: 0,
-                                                delta: String::new(),
-                                                phase: OutputPhase::Unknown,
-                                                done: true,
-                                                error: Some(e.to_string()),
-                                                prompt_tokens: 0,
-                                                completion_tokens: 0,
-                                                analysis_tokens: 0,
-                                                final_tokens: 0,
-                                            };
+                                            let chunk = target.done(
+                                                0,
+                                                OutputPhase::Unknown,
+                                                Some(e.to_string()),
+                                                ChunkUsage::default(),
+                                            );
                                             self.send_command(chunk).await?;
                                         }
                                     }
@@ -2679,10 +2679,8 @@ impl WorkerHandle for ClientWorker {
                                     let socket = Arc::clone(&socket);
                                     tokio::spawn(async move {
                                         let mut next_msg_id: u32 = 1;
-                                        let mut inflight: std::collections::HashMap<
-                                            u32,
-                                            std::collections::HashMap<u16, Vec<u8>>,
-                                        > = std::collections::HashMap::new();
+                                        let mut inflight =
+                                            Reassembler::new(Self::P2P_UDP_FRAGMENT_LEN);
                                         let mut buf = vec![0u8; 64 * 1024];
                                         loop {
                                             let (n, from) = match socket.recv_from(&mut buf).await {
@@ -2704,19 +2702,19 @@ impl WorkerHandle for ClientWorker {
                                                 continue;
                                             }
 
-                                            // For now, ACK every fragment with msg_id.
-                                            Self::p2p_udp_send_ack(&socket, from, msg_id)
-                                                .await;
-
                                             let payload = &buf[Self::P2P_UDP_HEADER_LEN..n];
-                                            let entry = inflight.entry(msg_id).or_default();
-                                            entry.insert(frag_idx, payload.to_vec());
-                                            let Some(full) =
-                                                Self::p2p_udp_try_reassemble(entry, frag_cnt)
-                                            else {
+                                            let Some((ack, full)) = inflight.accept(
+                                                msg_id, frag_idx, frag_cnt, payload,
+                                            ) else {
+                                                continue;
+                                            };
+                                            Self::p2p_udp_send_ack(
+                                                &socket, from, msg_id, frag_cnt, ack,
+                                            )
+                                            .await;
+                                            let Some(full) = full else {
                                                 continue;
                                             };
-                                            inflight.remove(&msg_id);
 
                                             let cmd = match Self::udp_decode_command(&full) {
                                                 Ok(c) => c,
@@ -3038,10 +3036,8 @@ impl WorkerHandle for ClientWorker {
 
                                                 let mut permitted: HashSet<std::net::SocketAddr> =
                                                     HashSet::new();
-                                                let mut inflight: HashMap<
-                                                    u32,
-                                                    HashMap<u16, Vec<u8>>,
-                                                > = HashMap::new();
+                                                let mut inflight =
+                                                    Reassembler::new(Self::P2P_UDP_FRAGMENT_LEN);
                                                 let mut inbox: VecDeque<(
                                                     std::net::SocketAddr,
                                                     Vec<u8>,
@@ -3102,34 +3098,27 @@ impl WorkerHandle for ClientWorker {
                                                         {
                                                             continue;
                                                         }
-                                                        // ACK over TURN by sending an indication carrying only header.
-                                                        let hdr = Self::p2p_udp_make_header(
-                                                            Self::P2P_UDP_FLAG_ACK,
-                                                            msg_id,
-                                                            0,
-                                                            0,
-                                                        );
-                                                        let _ = Self::turn_send_indication(
-                                                            &turn_sock, peer, &hdr,
-                                                        )
-                                                        .await;
-
                                                         if data.len() < Self::P2P_UDP_HEADER_LEN {
                                                             continue;
                                                         }
                                                         let payload =
                                                             &data[Self::P2P_UDP_HEADER_LEN..];
-                                                        let entry =
-                                                            inflight.entry(msg_id).or_default();
-                                                        entry.insert(frag_idx, payload.to_vec());
-                                                        let Some(full) =
-                                                            Self::p2p_udp_try_reassemble(
-                                                                entry, frag_cnt,
-                                                            )
-                                                        else {
+                                                        let Some((ack, full)) = inflight.accept(
+                                                            msg_id, frag_idx, frag_cnt, payload,
+                                                        ) else {
+                                                            continue;
+                                                        };
+                                                        // ACK over TURN by sending an indication carrying the SACK.
+                                                        let ack = Self::p2p_udp_make_ack(
+                                                            msg_id, frag_cnt, ack,
+                                                        );
+                                                        let _ = Self::turn_send_indication(
+                                                            &turn_sock, peer, &ack,
+                                                        )
+                                                        .await;
+                                                        let Some(full) = full else {
                                                             continue;
                                                         };
-                                                        inflight.remove(&msg_id);
 
                                                         let cmd =
                                                             match Self::udp_decode_command(
@@ -3579,6 +3568,32 @@ impl WorkerHandle for ClientWorker {
                                 }
                             }
 
+                            CommandV2::ModelPeers {
+                                checksum,
+                                total_size,
+                                piece_size,
+                                piece_hashes,
+                                peers,
+                            } => {
+                                match PeerPieces::new(
+                                    checksum.clone(),
+                                    total_size,
+                                    piece_size,
+                                    piece_hashes,
+                                    peers,
+                                ) {
+                                    Some(peers) => {
+                                        debug!(
+                                            "{} peers can serve model {}",
+                                            peers.peer_count(),
+                                            checksum
+                                        );
+                                        model_peers.insert(checksum, Arc::new(peers));
+                                    }
+                                    None => warn!("Ignoring malformed peer list for {}", checksum),
+                                }
+                            }
+
                             _ => {
                                 // Ignore other V2 commands for now.
                             }
@@ -3711,7 +3726,11 @@ pub async fn create_proxy_connection(
         Err(e) => error!("Failed to send new proxy connection notification: {}", e),
     };
 
-    let local_stream =
+    let Some(first) = read_first_request(&mut tls_proxy_stream, &proxy_conn_id).await? else {
+        return Ok(());
+    };
+
+    let mut local_stream =
         match TcpStream::connect(format!("{}:{}", args.local_addr, args.local_port)).await {
             Ok(stream) => stream,
             Err(e) => {
@@ -3719,6 +3738,7 @@ pub async fn create_proxy_connection(
                 return Err(anyhow!("Failed to connect to local service: {}", e));
             }
         };
+    local_stream.write_all(&first).await?;
     info!(
         "proxy_conn_id {:?} Connected to local service at {}:{}",
         proxy_conn_id, args.local_addr, args.local_port
@@ -3804,7 +3824,11 @@ pub async fn create_proxy_connection(
         Err(e) => error!("Failed to send new proxy connection notification: {}", e),
     };
 
-    let local_stream =
+    let Some(first) = read_first_request(&mut tcp_stream, &proxy_conn_id).await? else {
+        return Ok(());
+    };
+
+    let mut local_stream =
         match TcpStream::connect(format!("{}:{}", args.local_addr, args.local_port)).await {
             Ok(stream) => stream,
             Err(e) => {
@@ -3822,10 +3846,11 @@ pub async fn create_proxy_connection(
     };
 
     info!("proxy_conn_id {:?} Connected to local port.", proxy_conn_id);
+    local_stream.write_all(&first).await?;
 
     info!("proxy_conn_id {:?} Joining streams...", proxy_conn_id);
 
-    match join_streams(tcp_stream, local_stream).await {
+    match join_tcp_streams(tcp_stream, local_stream).await {
         Ok(_) => {
             info!(
                 "proxy_conn_id {:?} Streams joined and finished.",
@@ -9,18 +9,104 @@ use std::sync::Arc;
 use std::time::Duration;
 use tokio::io::AsyncReadExt;
 use tokio::net::UdpSocket;
-use tokio::time::timeout;
+use tokio::time::{timeout, timeout_at};
 use url::Url;
 
+use crate::util::reliable_udp::{self, SackAck, SendWindow, SACK_LEN};
 use anyhow::{anyhow, Result};
 use common::Command;
 
+/// Where the fragments of a reliable send go and their ACKs come from.
+enum ReliableLink<'a> {
+    Direct {
+        socket: &'a UdpSocket,
+        to: std::net::SocketAddr,
+    },
+    #[cfg(not(target_os = "android"))]
+    Turn {
+        sock: &'a UdpSocket,
+        peer: std::net::SocketAddr,
+        /// Indications that are not our ACKs, for the caller's receive loop.
+        inbox: &'a mut VecDeque<(std::net::SocketAddr, Vec<u8>)>,
+    },
+}
+
+enum P2pUdpAck {
+    Sack(SackAck),
+    /// From a peer that does not say which fragment arrived.
+    Legacy,
+}
+
+impl ReliableLink<'_> {
+    fn peer(&self) -> std::net::SocketAddr {
+        match self {
+            ReliableLink::Direct { to, .. } => *to,
+            #[cfg(not(target_os = "android"))]
+            ReliableLink::Turn { peer, .. } => *peer,
+        }
+    }
+
+    async fn send(&mut self, pkt: &[u8]) -> Result<()> {
+        match self {
+            ReliableLink::Direct { socket, to } => {
+                socket.send_to(pkt, *to).await?;
+            }
+            #[cfg(not(target_os = "android"))]
+            ReliableLink::Turn { sock, peer, .. } => {
+                ClientWorker::turn_send_indication(sock, *peer, pkt).await?;
+            }
+        }
+        Ok(())
+    }
+
+    /// Wait for an ACK of `msg_id`. Receive errors are skipped like lost
+    /// packets; the caller bounds the wait.
+    async fn recv_ack(&mut self, msg_id: u32, frag_cnt: u16) -> P2pUdpAck {
+        let mut buf = vec![0u8; 4096];
+        loop {
+            match self {
+                ReliableLink::Direct { socket, to } => {
+                    let Ok((n, from)) = socket.recv_from(&mut buf).await else {
+                        continue;
+                    };
+                    if from != *to {
+                        continue;
+                    }
+                    if let Some(ack) = ClientWorker::p2p_udp_parse_ack(&buf[..n], msg_id, frag_cnt)
+                    {
+                        return ack;
+                    }
+                }
+                #[cfg(not(target_os = "android"))]
+                ReliableLink::Turn { sock, inbox, .. } => {
+                    let Ok(n) = sock.recv(&mut buf).await else {
+                        continue;
+                    };
+                    let Some((src, data)) = ClientWorker::turn_parse_data_indication(&buf[..n])
+                    else {
+                        continue;
+                    };
+                    if let Some(ack) = ClientWorker::p2p_udp_parse_ack(&data, msg_id, frag_cnt) {
+                        return ack;
+                    }
+                    inbox.push_back((src, data));
+                }
+            }
+        }
+    }
+}
+
 impl ClientWorker {
     pub(super) const P2P_UDP_MAGIC: [u8; 4] = *b"P2PU";
     pub(super) const P2P_UDP_VERSION: u8 = 1;
     pub(super) const P2P_UDP_FLAG_ACK: u8 = 0x01;
+    /// With ACK: frag_idx is the first missing fragment and a bitmap of the
+    /// ones after it follows the header.
+    pub(super) const P2P_UDP_FLAG_SACK: u8 = 0x02;
     pub(super) const P2P_UDP_HEADER_LEN: usize = 4 + 1 + 1 + 4 + 2 + 2; // magic + version + flags + msg_id + frag_idx + frag_cnt
     pub(super) const P2P_UDP_MTU_PAYLOAD: usize = 1200;
+    pub(super) const P2P_UDP_FRAGMENT_LEN: usize =
+        Self::P2P_UDP_MTU_PAYLOAD - Self::P2P_UDP_HEADER_LEN;
 
     pub(super) fn p2p_udp_make_header(
         flags: u8,
@@ -55,86 +141,113 @@ impl ClientWorker {
         Some((flags, msg_id, frag_idx, frag_cnt))
     }
 
-    pub(super) async fn p2p_udp_send_ack(socket: &UdpSocket, to: std::net::SocketAddr, msg_id: u32) {
-        let hdr = Self::p2p_udp_make_header(Self::P2P_UDP_FLAG_ACK, msg_id, 0, 0);
-        let _ = socket.send_to(&hdr, to).await;
+    /// Selective ACK for a fragment of `msg_id`. Older peers only look at the
+    /// ACK flag and the message id.
+    pub(super) fn p2p_udp_make_ack(
+        msg_id: u32,
+        frag_cnt: u16,
+        ack: SackAck,
+    ) -> [u8; Self::P2P_UDP_HEADER_LEN + SACK_LEN] {
+        let flags = Self::P2P_UDP_FLAG_ACK | Self::P2P_UDP_FLAG_SACK;
+        let mut pkt = [0u8; Self::P2P_UDP_HEADER_LEN + SACK_LEN];
+        pkt[..Self::P2P_UDP_HEADER_LEN].copy_from_slice(&Self::p2p_udp_make_header(
+            flags, msg_id, ack.base, frag_cnt,
+        ));
+        pkt[Self::P2P_UDP_HEADER_LEN..].copy_from_slice(&ack.encode());
+        pkt
+    }
+
+    fn p2p_udp_parse_ack(buf: &[u8], msg_id: u32, frag_cnt: u16) -> Option<P2pUdpAck> {
+        let (flags, ack_id, base, ack_cnt) = Self::p2p_udp_parse_header(buf)?;
+        if (flags & Self::P2P_UDP_FLAG_ACK) == 0 || ack_id != msg_id {
+            return None;
+        }
+        if (flags & Self::P2P_UDP_FLAG_SACK) == 0 {
+            return Some(P2pUdpAck::Legacy);
+        }
+        if ack_cnt != frag_cnt {
+            return None;
+        }
+        SackAck::decode(base, &buf[Self::P2P_UDP_HEADER_LEN..]).map(P2pUdpAck::Sack)
     }
 
-    pub(super) async fn p2p_udp_send_reliable(
+    pub(super) async fn p2p_udp_send_ack(
         socket: &UdpSocket,
         to: std::net::SocketAddr,
         msg_id: u32,
+        frag_cnt: u16,
+        ack: SackAck,
+    ) {
+        let pkt = Self::p2p_udp_make_ack(msg_id, frag_cnt, ack);
+        let _ = socket.send_to(&pkt, to).await;
+    }
+
+    /// Send `payload` as fragments, keeping as many in flight as the path
+    /// allows, until every one is acknowledged.
+    async fn p2p_udp_send_windowed(
+        mut link: ReliableLink<'_>,
+        msg_id: u32,
         payload: &[u8],
     ) -> Result<()> {
-        let max_payload = Self::P2P_UDP_MTU_PAYLOAD.saturating_sub(Self::P2P_UDP_HEADER_LEN);
-        if max_payload == 0 {
-            return Err(anyhow!("p2p udp mtu too small"));
-        }
-        let frag_cnt = ((payload.len() + max_payload - 1) / max_payload).max(1);
+        let frag_len = Self::P2P_UDP_FRAGMENT_LEN;
+        let frag_cnt = payload.len().div_ceil(frag_len).max(1);
         if frag_cnt > u16::MAX as usize {
             return Err(anyhow!("p2p udp too many fragments"));
         }
+        let frag_cnt = frag_cnt as u16;
+        let peer = link.peer();
+        let mut window = SendWindow::new(reliable_udp::path(peer), frag_cnt);
+        let mut pkt = Vec::with_capacity(Self::P2P_UDP_MTU_PAYLOAD);
+
+        while !window.is_done() {
+            while let Some(frag_idx) = window.next_to_send() {
+                let start = frag_idx as usize * frag_len;
+                let end = (start + frag_len).min(payload.len());
+                pkt.clear();
+                pkt.extend_from_slice(&Self::p2p_udp_make_header(0, msg_id, frag_idx, frag_cnt));
+                pkt.extend_from_slice(&payload[start..end]);
+                link.send(&pkt).await?;
+                window.on_sent(frag_idx, std::time::Instant::now());
+
+                let gap = window.pacing_gap();
+                if gap >= Duration::from_millis(1) && window.next_to_send().is_some() {
+                    tokio::time::sleep(gap).await;
+                }
+            }
 
-        for frag_idx in 0..frag_cnt {
-            let start = frag_idx * max_payload;
-            let end = ((frag_idx + 1) * max_payload).min(payload.len());
-            let hdr = Self::p2p_udp_make_header(0, msg_id, frag_idx as u16, frag_cnt as u16);
-            let mut pkt = Vec::with_capacity(Self::P2P_UDP_HEADER_LEN + (end - start));
-            pkt.extend_from_slice(&hdr);
-            pkt.extend_from_slice(&payload[start..end]);
-
-            // Stop-and-wait per fragment.
-            let mut tries = 0u32;
-            loop {
-                tries += 1;
-                socket.send_to(&pkt, to).await?;
-
-                let mut ack_buf = [0u8; 64];
-                let ack_res = timeout(Duration::from_millis(400), socket.recv_from(&mut ack_buf)).await;
-                if let Ok(Ok((n, from))) = ack_res {
-                    if from != to {
-                        continue;
-                    }
-                    if let Some((flags, ack_id, _fi, _fc)) = Self::p2p_udp_parse_header(&ack_buf[..n]) {
-                        if (flags & Self::P2P_UDP_FLAG_ACK) != 0 && ack_id == msg_id {
-                            break;
-                        }
+            let deadline = window
+                .next_deadline()
+                .unwrap_or_else(std::time::Instant::now);
+            let deadline = tokio::time::Instant::from_std(deadline);
+            match timeout_at(deadline, link.recv_ack(msg_id, frag_cnt)).await {
+                Ok(P2pUdpAck::Sack(ack)) => window.on_ack(ack, std::time::Instant::now()),
+                Ok(P2pUdpAck::Legacy) => window.on_legacy_ack(std::time::Instant::now()),
+                Err(_) => {
+                    if !window.on_timeout(std::time::Instant::now()) {
+                        reliable_udp::store_path(peer, window.path());
+                        return Err(anyhow!("p2p udp send timeout msg_id={msg_id}"));
                     }
                 }
-                if tries >= 10 {
-                    return Err(anyhow!("p2p udp send timeout msg_id={msg_id}"));
-                }
             }
         }
+        reliable_udp::store_path(peer, window.path());
         Ok(())
     }
 
+    pub(super) async fn p2p_udp_send_reliable(
+        socket: &UdpSocket,
+        to: std::net::SocketAddr,
+        msg_id: u32,
+        payload: &[u8],
+    ) -> Result<()> {
+        Self::p2p_udp_send_windowed(ReliableLink::Direct { socket, to }, msg_id, payload).await
+    }
+
     pub(super) fn p2p_udp_encode_command_payload(command: &Command) -> Result<Vec<u8>> {
         // payload uses same framing as udp_encode_command (len + bincode) so we can reuse decode.
         Self::udp_encode_command(command)
     }
 
-    pub(super) fn p2p_udp_try_reassemble(
-        parts: &mut std::collections::HashMap<u16, Vec<u8>>,
-        frag_cnt: u16,
-    ) -> Option<Vec<u8>> {
-        if frag_cnt == 0 {
-            return None;
-        }
-        for i in 0..frag_cnt {
-            if !parts.contains_key(&i) {
-                return None;
-            }
-        }
-        let mut out = Vec::new();
-        for i in 0..frag_cnt {
-            if let Some(p) = parts.remove(&i) {
-                out.extend_from_slice(&p);
-            }
-        }
-        Some(out)
-    }
-
     pub(super) fn stun_new_txid() -> [u8; 12] {
         uuid::Uuid::new_v4().as_bytes()[..12]
             .try_into()
@@ -495,47 +608,7 @@ impl ClientWorker {
         payload: &[u8],
         inbox: &mut VecDeque<(std::net::SocketAddr, Vec<u8>)>,
     ) -> Result<()> {
-        let max_payload = Self::P2P_UDP_MTU_PAYLOAD.saturating_sub(Self::P2P_UDP_HEADER_LEN);
-        if max_payload == 0 {
-            return Err(anyhow!("p2p udp mtu too small"));
-        }
-        let frag_cnt = ((payload.len() + max_payload - 1) / max_payload).max(1);
-        if frag_cnt > u16::MAX as usize {
-            return Err(anyhow!("p2p udp too many fragments"));
-        }
-
-        for frag_idx in 0..frag_cnt {
-            let start = frag_idx * max_payload;
-            let end = ((frag_idx + 1) * max_payload).min(payload.len());
-            let hdr = Self::p2p_udp_make_header(0, msg_id, frag_idx as u16, frag_cnt as u16);
-            let mut pkt = Vec::with_capacity(Self::P2P_UDP_HEADER_LEN + (end - start));
-            pkt.extend_from_slice(&hdr);
-            pkt.extend_from_slice(&payload[start..end]);
-
-            let mut tries = 0u32;
-            loop {
-                tries += 1;
-                Self::turn_send_indication(sock, peer, &pkt).await?;
-
-                let mut buf = vec![0u8; 4096];
-                let recv_res = timeout(Duration::from_millis(400), sock.recv(&mut buf)).await;
-                if let Ok(Ok(n)) = recv_res {
-                    if let Some((src, data)) = Self::turn_parse_data_indication(&buf[..n]) {
-                        if let Some((flags, ack_id, _fi, _fc)) = Self::p2p_udp_parse_header(&data) {
-                            if (flags & Self::P2P_UDP_FLAG_ACK) != 0 && ack_id == msg_id {
-                                break;
-                            }
-                        }
-                        inbox.push_back((src, data));
-                    }
-                }
-
-                if tries >= 10 {
-                    return Err(anyhow!("p2p udp send timeout msg_id={msg_id}"));
-                }
-            }
-        }
-        Ok(())
+        Self::p2p_udp_send_windowed(ReliableLink::Turn { sock, peer, inbox }, msg_id, payload).await
     }
 
     pub(super) fn stun_attr_iter(msg: &[u8]) -> Result<Vec<(u16, Vec<u8>)>> {
@@ -1,11 +1,18 @@
+use crate::util::load_beacon::{self, BeaconState};
 use anyhow::{anyhow, Result};
+use common::chunk::{ChunkCoalescer, ChunkTarget, ChunkUsage, TaskClock};
+use common::markers::PhaseSplitter;
 use common::{Command, CommandV1, DevicesInfo, EngineType as CommonEngineType, Model, OsType, SystemInfo};
 use std::ffi::{c_char, c_void};
 use std::io::Write;
-use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::atomic::{AtomicBool, AtomicU32, AtomicU8, Ordering};
 use std::sync::{Arc, Mutex, OnceLock};
 
-const CURRENT_VERSION: u32 = 1;
+const CURRENT_VERSION: u32 = 8;
+// Streamed output is coalesced until this many bytes or milliseconds have
+// accumulated. Override with GPUF_STREAM_CHUNK_BYTES / GPUF_STREAM_CHUNK_MS.
+const DEFAULT_STREAM_CHUNK_BYTES: usize = 64;
+const DEFAULT_STREAM_CHUNK_MS: u64 = 30;
 
 fn client_id_to_hex(client_id: [u8; 16]) -> String {
     hex::encode(client_id)
@@ -39,6 +46,14 @@ static WORKER_SERVER_ADDR: OnceLock<Mutex<Option<String>>> = OnceLock::new();
 static WORKER_CONTROL_PORT: OnceLock<Mutex<Option<u16>>> = OnceLock::new();
 static WORKER_CLIENT_ID: OnceLock<Mutex<Option<[u8; 16]>>> = OnceLock::new();
 static WORKER_STOP_SIGNAL: OnceLock<Arc<AtomicBool>> = OnceLock::new();
+/// Set once the server sent RequestDeviceState.
+static DEVICE_STATE_REQUESTED: AtomicBool = AtomicBool::new(false);
+/// Throttle level last reported with DeviceState, `u8::MAX` before the first.
+static REPORTED_THROTTLE: AtomicU8 = AtomicU8::new(u8::MAX);
+/// Beacon interval from RequestLoadBeacon; 0 until the server asks.
+static LOAD_BEACON_INTERVAL_MS: AtomicU32 = AtomicU32::new(0);
+/// Set once the server sent RequestTaskTimings.
+static TASK_TIMINGS_REQUESTED: AtomicBool = AtomicBool::new(false);
 
 fn os_type() -> OsType {
     #[cfg(target_os = "ios")]
@@ -168,6 +183,7 @@ pub async fn start_worker_tasks_with_callback_ptr(
     let heartbeat_callback = callback;
     let heartbeat_stream = tcp_stream.clone();
     std::thread::spawn(move || {
+        let mut beacon: Option<BeaconState> = None;
         loop {
             if heartbeat_stop.load(Ordering::Relaxed) {
                 break;
@@ -187,6 +203,16 @@ pub async fn start_worker_tasks_with_callback_ptr(
             fixed_devices_info.engine_type = CommonEngineType::Llama;
             fixed_devices_info.vendor_id = 0x41;
             fixed_devices_info.device_id = 0x1000;
+            fixed_devices_info.temp = crate::util::governor::sample().0.temp_c.unwrap_or(0) as u64;
+
+            let (cpu_usage, memory_usage) = (system_info.cpu_usage, system_info.memory_usage);
+            // With beacons on, the server keeps the last inventory it was sent.
+            let devices_info = match beacon.as_mut() {
+                Some(b) if !b.inventory_changed(std::slice::from_ref(&fixed_devices_info)) => {
+                    Vec::new()
+                }
+                _ => vec![fixed_devices_info],
+            };
 
             let hb = CommandV1::Heartbeat {
                 client_id,
@@ -194,7 +220,7 @@ pub async fn start_worker_tasks_with_callback_ptr(
                 device_count: 1,
                 device_memtotal_gb: 0,
                 device_total_tflops: 0,
-                devices_info: vec![fixed_devices_info],
+                devices_info,
             };
 
             let send_result = (|| {
@@ -207,6 +233,10 @@ pub async fn start_worker_tasks_with_callback_ptr(
                 Ok::<(), anyhow::Error>(())
             })();
 
+            if let (true, Some(b)) = (send_result.is_ok(), beacon.as_mut()) {
+                b.rebase(cpu_usage, memory_usage);
+            }
+
             if let Some(cb) = heartbeat_callback {
                 let client_hex = client_id_to_hex(client_id);
                 let msg = match send_result {
@@ -218,12 +248,27 @@ pub async fn start_worker_tasks_with_callback_ptr(
                 }
             }
 
+            report_device_state(&heartbeat_stream, true);
+
             // Sleep 120s, but check stop signal every 1s so stop is responsive.
+            // Load and throttle level changes are reported as they happen.
             for _ in 0..120 {
                 if heartbeat_stop.load(Ordering::Relaxed) {
                     break;
                 }
                 std::thread::sleep(std::time::Duration::from_secs(1));
+                let interval_ms = LOAD_BEACON_INTERVAL_MS.load(Ordering::Relaxed);
+                if interval_ms == 0 {
+                    report_device_state(&heartbeat_stream, false);
+                    continue;
+                }
+                let b = beacon.get_or_insert_with(|| {
+                    BeaconState::new(std::time::Duration::from_millis(interval_ms as u64))
+                });
+                let snapshot = load_beacon::sample(cpu_usage, memory_usage);
+                if let Some(delta) = b.poll(snapshot, std::time::Instant::now()) {
+                    let _ = send_command(&heartbeat_stream, CommandV1::LoadBeacon { delta });
+                }
             }
         }
     });
@@ -298,6 +343,26 @@ pub async fn start_worker_tasks_with_callback_ptr(
                 .set_read_timeout(Some(std::time::Duration::from_secs(2)))
                 .ok();
             
+            // Inference tasks run on their own threads and share this writer with
+            // the heartbeat thread so frames never interleave on the socket.
+            let task_writer = match get_tcp_stream() {
+                Some(w) => w,
+                None => match stream.try_clone() {
+                    Ok(s) => Arc::new(Mutex::new(s)),
+                    Err(e) => {
+                        emit_callback(handler_callback, &format!("STREAM_ERROR - {}", e));
+                        continue;
+                    }
+                },
+            };
+
+            // Compact chunk handles announced by the server ahead of each task.
+            let mut task_handles: std::collections::HashMap<String, u32> =
+                std::collections::HashMap::new();
+            // Speculative draft lengths requested ahead of chat tasks.
+            let mut task_draft_tokens: std::collections::HashMap<String, u32> =
+                std::collections::HashMap::new();
+
             // Process commands with this stream
             let mut stream_valid = true;
             while stream_valid && !handler_stop.load(Ordering::Relaxed) {
@@ -364,6 +429,36 @@ pub async fn start_worker_tasks_with_callback_ptr(
                     let _ = common::write_command_sync(&mut stream, &Command::V1(model_status));
                     emit_callback(handler_callback, "MODEL_STATUS_SENT");
                 }
+                CommandV1::TaskHandle { task_id, handle } => {
+                    task_handles.insert(task_id, handle);
+                }
+                CommandV1::TaskDecodeOptions {
+                    task_id,
+                    draft_tokens,
+                } => {
+                    task_draft_tokens.insert(task_id, draft_tokens);
+                }
+                CommandV1::RequestDeviceState => {
+                    DEVICE_STATE_REQUESTED.store(true, Ordering::Relaxed);
+                }
+                CommandV1::RequestLoadBeacon { interval_ms } => {
+                    LOAD_BEACON_INTERVAL_MS.store(interval_ms.max(1000), Ordering::Relaxed);
+                }
+                CommandV1::RequestTaskTimings => {
+                    TASK_TIMINGS_REQUESTED.store(true, Ordering::Relaxed);
+                }
+                CommandV1::RequestContextProfile => {
+                    let client_id = WORKER_CLIENT_ID
+                        .get()
+                        .and_then(|m| m.lock().ok().and_then(|g| *g))
+                        .unwrap_or([0u8; 16]);
+                    let reply = CommandV1::ContextProfile {
+                        client_id,
+                        profile: crate::util::device_profile::current(),
+                    };
+                    let _ = common::write_command_sync(&mut stream, &Command::V1(reply));
+                    emit_callback(handler_callback, "CONTEXT_PROFILE_SENT");
+                }
                 CommandV1::InferenceTask {
                     task_id,
                     prompt,
@@ -374,6 +469,7 @@ pub async fn start_worker_tasks_with_callback_ptr(
                     repeat_penalty,
                     ..
                 } => {
+                    let clock = TaskClock::start();
                     emit_callback(handler_callback, &format!("INFERENCE_TASK - {task_id}"));
                     let effective_max_tokens = std::cmp::min(max_tokens, 512);
                     if effective_max_tokens != max_tokens {
@@ -385,24 +481,22 @@ pub async fn start_worker_tasks_with_callback_ptr(
                         );
                     }
                     emit_callback(handler_callback, &format!("INFERENCE_START - {task_id}"));
-                    // Execute inference synchronously and send back chunks.
-                    if let Err(e) = handle_inference_task(
-                        &mut stream,
-                        task_id.clone(),
-                        &prompt,
+                    // Tasks run concurrently; the batch engine interleaves their decode steps.
+                    let target = ChunkTarget::new(task_id.clone(), task_handles.remove(&task_id));
+                    spawn_inference_task(
+                        task_writer.clone(),
+                        handler_callback,
+                        task_id,
+                        target,
+                        clock,
+                        TaskPrompt::Text(prompt),
                         effective_max_tokens,
                         temperature,
                         std::cmp::min(top_k, i32::MAX as u32) as i32,
                         top_p,
                         repeat_penalty,
-                    ) {
-                        emit_callback(
-                            handler_callback,
-                            &format!("INFERENCE_FAILED - {task_id} - {e}"),
-                        );
-                    } else {
-                        emit_callback(handler_callback, &format!("INFERENCE_DONE - {task_id}"));
-                    }
+                        None,
+                    );
                 }
                 CommandV1::ChatInferenceTask {
                     task_id,
@@ -415,6 +509,7 @@ pub async fn start_worker_tasks_with_callback_ptr(
                     repeat_penalty,
                     ..
                 } => {
+                    let clock = TaskClock::start();
                     emit_callback(handler_callback, &format!("CHAT_INFERENCE_TASK - {task_id}"));
                     let effective_max_tokens = std::cmp::min(max_tokens, 512);
                     if effective_max_tokens != max_tokens {
@@ -427,25 +522,27 @@ pub async fn start_worker_tasks_with_callback_ptr(
                     }
                     emit_callback(handler_callback, &format!("INFERENCE_START - {task_id}"));
 
-                    let prompt = build_chat_prompt_with_template(&messages);
-
-                    if let Err(e) = handle_inference_task(
-                        &mut stream,
-                        task_id.clone(),
-                        &prompt,
+                    let target = ChunkTarget::new(task_id.clone(), task_handles.remove(&task_id));
+                    let draft_tokens = task_draft_tokens.remove(&task_id);
+                    spawn_inference_task(
+                        task_writer.clone(),
+                        handler_callback,
+                        task_id,
+                        target,
+                        clock,
+                        TaskPrompt::Chat(messages),
                         effective_max_tokens,
                         temperature,
                         std::cmp::min(top_k, i32::MAX as u32) as i32,
                         top_p,
                         repeat_penalty,
-                    ) {
-                        emit_callback(
-                            handler_callback,
-                            &format!("INFERENCE_FAILED - {task_id} - {e}"),
-                        );
-                    } else {
-                        emit_callback(handler_callback, &format!("INFERENCE_DONE - {task_id}"));
-                    }
+                        draft_tokens,
+                    );
+                }
+                CommandV1::CancelInference { task_id } => {
+                    #[cfg(any(target_os = "android", target_os = "ios"))]
+                    crate::batch_engine::cancel_task(&task_id);
+                    emit_callback(handler_callback, &format!("INFERENCE_CANCEL - {task_id}"));
                 }
                 _ => {}
             }
@@ -461,87 +558,121 @@ pub async fn start_worker_tasks_with_callback_ptr(
     Ok(())
 }
 
-fn build_chat_prompt_with_template(messages: &[common::ChatMessage]) -> String {
-    #[cfg(any(target_os = "android", target_os = "ios"))]
-    {
-        use crate::llama_chat_message;
-        
-        // Try to use model's built-in chat template first
-        let model_ptr = crate::GLOBAL_MODEL_PTR.load(std::sync::atomic::Ordering::SeqCst);
-        if !model_ptr.is_null() {
-            // Convert messages to C-style array
-            let mut c_messages: Vec<llama_chat_message> = Vec::with_capacity(messages.len());
-            let mut c_roles: Vec<std::ffi::CString> = Vec::with_capacity(messages.len());
-            let mut c_contents: Vec<std::ffi::CString> = Vec::with_capacity(messages.len());
-            
-            for msg in messages {
-                c_roles.push(std::ffi::CString::new(msg.role.clone()).unwrap_or_default());
-                c_contents.push(std::ffi::CString::new(msg.content.clone()).unwrap_or_default());
-                c_messages.push(llama_chat_message {
-                    role: c_roles.last().unwrap().as_ptr(),
-                    content: c_contents.last().unwrap().as_ptr(),
-                });
-            }
-            
-            // Try to apply model's built-in template (tmpl=nullptr)
-            let mut buffer = vec![0u8; 8192]; // 8KB buffer for template
-            let result = unsafe {
-                crate::llama_chat_apply_template(
-                    std::ptr::null(), // Use model's built-in template
-                    c_messages.as_ptr(),
-                    messages.len(),
-                    true, // add_ass=true
-                    buffer.as_mut_ptr() as *mut i8,
-                    buffer.len() as i32,
-                )
-            };
-            
-            if result > 0 {
-                if let Ok(prompt) = std::ffi::CStr::from_bytes_until_nul(&buffer[..result as usize]) {
-                    if let Ok(prompt_str) = prompt.to_str() {
-                        return prompt_str.to_string();
-                    }
-                }
-            }
-        }
-        
-        // Fallback to llama3 template
-        let mut prompt = String::from("<|begin_of_text|>");
-        for msg in messages {
-            prompt.push_str(&format!(
-                "<|start_header_id|>{}\n\n{}\n<|eot_id|>",
-                msg.role, msg.content
-            ));
+/// What a task asks the model to continue. Chat messages are rendered and
+/// tokenized at submit time, under the inference lock, so the prompt cache
+/// always tokenizes with the loaded model.
+enum TaskPrompt {
+    Text(String),
+    Chat(Vec<common::ChatMessage>),
+}
+
+#[allow(clippy::too_many_arguments)]
+fn spawn_inference_task(
+    writer: Arc<Mutex<std::net::TcpStream>>,
+    handler_callback: Option<extern "C" fn(*const c_char, *mut c_void)>,
+    task_id: String,
+    target: ChunkTarget,
+    clock: TaskClock,
+    prompt: TaskPrompt,
+    max_tokens: u32,
+    temperature: f32,
+    top_k: i32,
+    top_p: f32,
+    repeat_penalty: f32,
+    draft_tokens: Option<u32>,
+) {
+    std::thread::spawn(move || {
+        if let Err(e) = handle_inference_task(
+            &writer,
+            &task_id,
+            target,
+            clock,
+            prompt,
+            max_tokens,
+            temperature,
+            top_k,
+            top_p,
+            repeat_penalty,
+            draft_tokens,
+        ) {
+            emit_callback(
+                handler_callback,
+                &format!("INFERENCE_FAILED - {task_id} - {e}"),
+            );
+        } else {
+            emit_callback(handler_callback, &format!("INFERENCE_DONE - {task_id}"));
         }
-        prompt.push_str("<|start_header_id|>assistant\n\n");
-        prompt
+    });
+}
+
+fn send_command(writer: &Mutex<std::net::TcpStream>, cmd: CommandV1) -> Result<()> {
+    let mut stream = writer
+        .lock()
+        .map_err(|_| anyhow!("worker stream mutex poisoned"))?;
+    common::write_command_sync(&mut *stream, &Command::V1(cmd))?;
+    stream.flush().ok();
+    Ok(())
+}
+
+/// Send DeviceState if the server asked for it, on every heartbeat (`force`)
+/// and whenever the throttle level changed.
+fn report_device_state(writer: &Mutex<std::net::TcpStream>, force: bool) {
+    if !DEVICE_STATE_REQUESTED.load(Ordering::Relaxed) {
+        return;
     }
-    
-    #[cfg(not(any(target_os = "android", target_os = "ios")))]
-    {
-        // For non-mobile platforms, use simple concatenation as fallback
-        let mut prompt = String::new();
-        for msg in messages {
-            prompt.push_str(&format!("{}: {}\n", msg.role, msg.content));
-        }
-        prompt.push_str("assistant: ");
-        prompt
+    let (state, level) = crate::util::governor::sample();
+    if !force && REPORTED_THROTTLE.load(Ordering::Relaxed) == level.as_u8() {
+        return;
+    }
+    let client_id = WORKER_CLIENT_ID
+        .get()
+        .and_then(|m| m.lock().ok().and_then(|g| *g))
+        .unwrap_or([0u8; 16]);
+    let report = CommandV1::DeviceState {
+        client_id,
+        level,
+        temp_c: state.temp_c.unwrap_or(0),
+        battery_pct: state.battery_pct.unwrap_or(u8::MAX),
+        charging: state.charging,
+    };
+    if send_command(writer, report).is_ok() {
+        REPORTED_THROTTLE.store(level.as_u8(), Ordering::Relaxed);
     }
 }
 
+fn stream_coalescer() -> ChunkCoalescer {
+    let max_bytes = std::env::var("GPUF_STREAM_CHUNK_BYTES")
+        .ok()
+        .and_then(|v| v.parse::<usize>().ok())
+        .filter(|n| *n > 0)
+        .unwrap_or(DEFAULT_STREAM_CHUNK_BYTES);
+    let max_delay_ms = std::env::var("GPUF_STREAM_CHUNK_MS")
+        .ok()
+        .and_then(|v| v.parse::<u64>().ok())
+        .unwrap_or(DEFAULT_STREAM_CHUNK_MS);
+    ChunkCoalescer::new(max_bytes, std::time::Duration::from_millis(max_delay_ms))
+}
+
+/// `draft_tokens` is set for tasks that came with TaskDecodeOptions; those
+/// report their speculative counters before the final chunk. Stage times
+/// from `clock` go out the same way once the server asked for them.
+#[allow(clippy::too_many_arguments)]
 fn handle_inference_task(
-    stream: &mut std::net::TcpStream,
-    task_id: String,
-    prompt: &str,
+    writer: &Arc<Mutex<std::net::TcpStream>>,
+    task_id: &str,
+    target: ChunkTarget,
+    mut clock: TaskClock,
+    prompt: TaskPrompt,
     max_tokens: u32,
     temperature: f32,
     top_k: i32,
     top_p: f32,
     repeat_penalty: f32,
+    draft_tokens: Option<u32>,
 ) -> Result<()> {
     #[cfg(any(target_os = "android", target_os = "ios"))]
     {
-        use crate::{gpuf_start_generation_async, GLOBAL_CONTEXT_PTR, GLOBAL_MODEL_PTR, GLOBAL_INFERENCE_MUTEX};
+        use crate::GLOBAL_INFERENCE_MUTEX;
 
     fn filter_control_tokens(text: &str) -> String {
         text.replace("<|end|>", "")
@@ -553,226 +684,93 @@ fn handle_inference_task(
             .replace("<|end_header_id|>", "")
     }
 
-    #[derive(Debug, Clone)]
-    struct PhaseSplitter {
-        phase: common::OutputPhase,
-        carry: String,
-    }
-
-    impl Default for PhaseSplitter {
-        fn default() -> Self {
-            Self {
-                phase: common::OutputPhase::Final,
-                carry: String::new(),
-            }
-        }
-    }
-
-    impl PhaseSplitter {
-        fn next_marker(rest: &str) -> Option<(usize, common::OutputPhase, usize)> {
-            let mut best: Option<(usize, common::OutputPhase, usize)> = None;
-
-            for (tag, to_phase) in [
-                ("<analysis>", common::OutputPhase::Analysis),
-                ("<think>", common::OutputPhase::Analysis),
-                ("<reasoning>", common::OutputPhase::Analysis),
-                ("<final>", common::OutputPhase::Final),
-            ] {
-                if let Some(idx) = rest.find(tag) {
-                    let cand = (idx, to_phase, tag.len());
-                    best = Some(match best {
-                        None => cand,
-                        Some(cur) => if cand.0 < cur.0 { cand } else { cur },
-                    });
-                }
-            }
-
-            for tag in ["</analysis>", "</think>", "</reasoning>", "</final>"] {
-                if let Some(idx) = rest.find(tag) {
-                    let cand = (idx, common::OutputPhase::Final, tag.len());
-                    best = Some(match best {
-                        None => cand,
-                        Some(cur) => if cand.0 < cur.0 { cand } else { cur },
-                    });
-                }
-            }
-
-            for (pat, to_phase) in [
-                ("### Final", common::OutputPhase::Final),
-                ("Final:", common::OutputPhase::Final),
-                ("final:", common::OutputPhase::Final),
-                ("final", common::OutputPhase::Final),
-                ("### Answer", common::OutputPhase::Final),
-                ("### 思考", common::OutputPhase::Analysis),
-                ("思考：", common::OutputPhase::Analysis),
-                ("分析：", common::OutputPhase::Analysis),
-                ("analysis:", common::OutputPhase::Analysis),
-                ("analysis", common::OutputPhase::Analysis),
-                ("### 答案", common::OutputPhase::Final),
-                ("答案：", common::OutputPhase::Final),
-            ] {
-                if rest.starts_with(pat) {
-                    if (pat == "analysis" || pat == "final")
-                        && rest.len() > pat.len()
-                        && !rest[pat.len()..].starts_with([' ', '\n', '\r', '\t', ':'])
-                    {
-                    } else {
-                        let cand = (0usize, to_phase, pat.len());
-                        best = Some(match best {
-                            None => cand,
-                            Some(cur) => if cand.0 < cur.0 { cand } else { cur },
-                        });
+    // The lease keeps the pair alive until the task ends, across model swaps.
+    // GLOBAL_INFERENCE_MUTEX only covers queueing the sequence, so the chat
+    // prompt cache is not rendered against two models at once; other tasks
+    // share the batch engine while this one decodes.
+    let lease = crate::lease_current_model();
+    let submitted = {
+        let _lock = GLOBAL_INFERENCE_MUTEX.lock().unwrap();
+
+        let model_ptr = lease
+            .as_ref()
+            .map_or(std::ptr::null_mut(), |lease| lease.model());
+        let ctx_ptr = lease
+            .as_ref()
+            .map_or(std::ptr::null_mut(), |lease| lease.context());
+
+        if model_ptr.is_null() || ctx_ptr.is_null() {
+            Err("Model not loaded - please load a model first".to_string())
+        } else if let Err(e) = crate::util::governor::admit() {
+            Err(e)
+        } else {
+            match crate::batch_engine::engine_for(ctx_ptr) {
+                Some(engine) => {
+                    let params = crate::batch_engine::SamplingParams {
+                        temperature,
+                        top_k,
+                        top_p,
+                        repeat_penalty,
+                        draft_tokens: draft_tokens.unwrap_or(0),
+                    };
+                    match prompt {
+                        TaskPrompt::Text(text) => {
+                            clock.prompt_ready();
+                            engine.submit(&text, max_tokens as i32, params)
+                        }
+                        TaskPrompt::Chat(messages) => {
+                            use crate::util::chat_template::{self, FallbackTemplate};
+
+                            let rendered = unsafe {
+                                chat_template::chat_prompt(
+                                    model_ptr,
+                                    &messages,
+                                    FallbackTemplate::from_env_or(FallbackTemplate::Llama3),
+                                )
+                            };
+                            clock.prompt_ready();
+                            rendered.and_then(|prompt| {
+                                engine.submit_tokens(prompt.tokens, max_tokens as i32, params)
+                            })
+                        }
                     }
                 }
-                let needle = format!("\n{}", pat);
-                if let Some(idx) = rest.find(&needle) {
-                    let cand = (idx + 1, to_phase, pat.len());
-                    best = Some(match best {
-                        None => cand,
-                        Some(cur) => if cand.0 < cur.0 { cand } else { cur },
-                    });
-                }
+                None => Err("Batch engine unavailable".to_string()),
             }
-
-            best
         }
+    };
 
-        fn split_tail_for_carry<'a>(tail: &'a str) -> (&'a str, &'a str) {
-            let markers = [
-                "<analysis>", "</analysis>",
-                "<think>", "</think>",
-                "<reasoning>", "</reasoning>",
-                "<final>", "</final>",
-                "### Final", "Final:", "### Answer",
-                "final:", "final",
-                "### 思考", "思考：", "分析：",
-                "analysis:", "analysis",
-                "### 答案", "答案：",
-            ];
-            let max_len = markers.iter().map(|s| s.len()).max().unwrap_or(0);
-
-            let mut carry_len: usize = 0;
-            let max_scan = (max_len.saturating_sub(1)).min(tail.len());
-
-            for l in 1..=max_scan {
-                let start = tail.len() - l;
-                if !tail.is_char_boundary(start) {
-                    continue;
-                }
-                let suf = &tail[start..];
-                if markers.iter().any(|m| m.starts_with(suf)) {
-                    carry_len = l;
-                }
-                if markers.iter().any(|m| {
-                    let nm = format!("\n{}", m);
-                    nm.starts_with(suf)
-                }) {
-                    carry_len = l;
-                }
-            }
-
-            if carry_len == 0 {
-                return (tail, "");
-            }
-
-            let split = tail.len() - carry_len;
-            if !tail.is_char_boundary(split) {
-                return (tail, "");
-            }
-            (&tail[..split], &tail[split..])
+    let sequence = match submitted {
+        Ok(sequence) => {
+            clock.submitted();
+            sequence
         }
-
-        fn phase(&self) -> common::OutputPhase {
-            self.phase
+        Err(e) => {
+            let result_command =
+                target.done(0, common::OutputPhase::Unknown, Some(e), ChunkUsage::default());
+            send_command(writer, result_command)?;
+            return Ok(());
         }
-
-        fn push(&mut self, text: &str) -> Vec<(common::OutputPhase, String)> {
-            if text.is_empty() {
-                return Vec::new();
-            }
-
-            let mut combined = String::new();
-            if !self.carry.is_empty() {
-                combined.push_str(&self.carry);
-                self.carry.clear();
-            }
-            combined.push_str(text);
-
-            let mut out: Vec<(common::OutputPhase, String)> = Vec::new();
-            let mut pos: usize = 0;
-
-            while pos < combined.len() {
-                let rest = &combined[pos..];
-
-                let Some((rel_pos, to_phase, marker_len)) = Self::next_marker(rest) else {
-                    let tail = &combined[pos..];
-                    let (safe, carry) = Self::split_tail_for_carry(tail);
-                    if !safe.is_empty() {
-                        out.push((self.phase, safe.to_string()));
-                    }
-                    self.carry = carry.to_string();
-                    break;
-                };
-
-                let tag_pos = pos + rel_pos;
-
-                if tag_pos > pos {
-                    let seg = &combined[pos..tag_pos];
-                    if !seg.is_empty() {
-                        out.push((self.phase, seg.to_string()));
-                    }
-                }
-
-                if tag_pos + marker_len > combined.len() {
-                    self.carry = combined[tag_pos..].to_string();
-                    break;
-                }
-
-                self.phase = to_phase;
-                pos = tag_pos + marker_len;
-            }
-            out
-        }
-    }
-
-    let _lock = GLOBAL_INFERENCE_MUTEX.lock().unwrap();
-
-    let model_ptr = GLOBAL_MODEL_PTR.load(Ordering::SeqCst);
-    let ctx_ptr = GLOBAL_CONTEXT_PTR.load(Ordering::SeqCst);
-
-    if model_ptr.is_null() || ctx_ptr.is_null() {
-        let result_command = CommandV1::InferenceResultChunk {
-            task_id,
-            seq: 0,
-            delta: String::new(),
-            phase: common::OutputPhase::Unknown,
-            done: true,
-            error: Some("Model not loaded - please load a model first".to_string()),
-            prompt_tokens: 0,
-            completion_tokens: 0,
-            analysis_tokens: 0,
-            final_tokens: 0,
-        };
-        common::write_command_sync(stream, &Command::V1(result_command))?;
-        stream.flush().ok();
-        return Ok(());
-    }
-
-    let prompt_c = std::ffi::CString::new(prompt).map_err(|e| anyhow!("Invalid prompt: {}", e))?;
+    };
+    // CancelInference for this task stops this sequence only.
+    let _binding = sequence.bind_task(task_id);
 
     #[repr(C)]
     struct TokenCallbackState {
-        stream: std::net::TcpStream,
-        task_id: String,
+        stream: Arc<Mutex<std::net::TcpStream>>,
+        target: ChunkTarget,
         seq: u32,
-        buf: String,
-        max_bytes: usize,
-        buf_phase: common::OutputPhase,
+        coalescer: ChunkCoalescer,
         splitter: PhaseSplitter,
-        prompt_tokens: u32,
-        completion_tokens: u32,
-        analysis_tokens: u32,
-        final_tokens: u32,
+        usage: ChunkUsage,
+    }
+
+    impl TokenCallbackState {
+        fn send_delta(&mut self, phase: common::OutputPhase, delta: String) {
+            let chunk = self.target.delta(self.seq, delta, phase, self.usage);
+            self.seq = self.seq.wrapping_add(1);
+            let _ = send_command(&self.stream, chunk);
+        }
     }
 
     extern "C" fn on_token(token: *const c_char, user_data: *mut std::ffi::c_void) {
@@ -790,156 +788,148 @@ fn handle_inference_task(
             return;
         }
 
-        state.completion_tokens = state.completion_tokens.saturating_add(1);
+        state.usage.completion_tokens = state.usage.completion_tokens.saturating_add(1);
 
         let filtered = filter_control_tokens(token_str);
         if filtered.is_empty() {
             return;
         }
 
-        let segs = state.splitter.push(&filtered);
-        for (phase, seg) in segs {
+        // Collected first: sending needs all of `state`, which the splitter's
+        // segments borrow from.
+        let mut deltas = Vec::new();
+        for (phase, seg) in state.splitter.push(&filtered) {
             if seg.is_empty() {
                 continue;
             }
 
             match phase {
                 common::OutputPhase::Analysis => {
-                    state.analysis_tokens = state.analysis_tokens.saturating_add(1);
+                    state.usage.analysis_tokens = state.usage.analysis_tokens.saturating_add(1);
                 }
                 common::OutputPhase::Final => {
-                    state.final_tokens = state.final_tokens.saturating_add(1);
+                    state.usage.final_tokens = state.usage.final_tokens.saturating_add(1);
                 }
                 common::OutputPhase::Unknown => {}
             }
 
-            if state.buf.is_empty() {
-                state.buf_phase = phase;
-            } else if state.buf_phase != phase {
-                let delta = std::mem::take(&mut state.buf);
-                let chunk = CommandV1::InferenceResultChunk {
-                    task_id: state.task_id.clone(),
-                    seq: state.seq,
-                    delta,
-                    phase: state.buf_phase,
-                    done: false,
-                    error: None,
-                    prompt_tokens: state.prompt_tokens,
-                    completion_tokens: state.completion_tokens,
-                    analysis_tokens: state.analysis_tokens,
-                    final_tokens: state.final_tokens,
-                };
-                state.seq = state.seq.wrapping_add(1);
-                let _ = common::write_command_sync(&mut state.stream, &Command::V1(chunk));
-                let _ = state.stream.flush();
-                state.buf_phase = phase;
-            }
-
-            state.buf.push_str(&seg);
-            if state.buf.len() < state.max_bytes {
-                continue;
-            }
-
-            let delta = std::mem::take(&mut state.buf);
-            let chunk = CommandV1::InferenceResultChunk {
-                task_id: state.task_id.clone(),
-                seq: state.seq,
-                delta,
-                phase: state.buf_phase,
-                done: false,
-                error: None,
-                prompt_tokens: state.prompt_tokens,
-                completion_tokens: state.completion_tokens,
-                analysis_tokens: state.analysis_tokens,
-                final_tokens: state.final_tokens,
-            };
-            state.seq = state.seq.wrapping_add(1);
-            let _ = common::write_command_sync(&mut state.stream, &Command::V1(chunk));
-            let _ = state.stream.flush();
+            deltas.extend(state.coalescer.push(phase, seg));
+        }
+        for (phase, delta) in deltas {
+            state.send_delta(phase, delta);
         }
     }
 
-    let writer_stream = stream.try_clone()?;
     let mut cb_state = TokenCallbackState {
-        stream: writer_stream,
-        task_id: task_id.clone(),
+        stream: writer.clone(),
+        target,
         seq: 0,
-        buf: String::new(),
-        max_bytes: 8,
-        buf_phase: common::OutputPhase::Unknown,
+        coalescer: stream_coalescer(),
         splitter: PhaseSplitter::default(),
-        prompt_tokens: 0,
-        completion_tokens: 0,
-        analysis_tokens: 0,
-        final_tokens: 0,
+        usage: ChunkUsage::default(),
     };
 
-    let rc = unsafe {
-        gpuf_start_generation_async(
-            ctx_ptr,
-            prompt_c.as_ptr(),
-            max_tokens as i32,
-            temperature,
-            top_k,
-            top_p,
-            repeat_penalty,
-            Some(on_token),
-            (&mut cb_state as *mut TokenCallbackState) as *mut std::ffi::c_void,
-        )
-    };
-
-    if rc < 0 {
-        let result_command = CommandV1::InferenceResultChunk {
-            task_id,
-            seq: 0,
-            delta: String::new(),
-            phase: common::OutputPhase::Final,
-            done: true,
-            error: Some(format!("Inference failed: {}", rc)),
-            prompt_tokens: 0,
-            completion_tokens: 0,
-            analysis_tokens: 0,
-            final_tokens: 0,
+    let mut failure: Option<String> = None;
+    let mut decode_stats = (0, 0);
+    loop {
+        // Wake at the coalescer's deadline so a buffered piece is not held
+        // until the next token.
+        let event = match cb_state.coalescer.deadline() {
+            Some(deadline) => {
+                let wait = deadline.saturating_duration_since(std::time::Instant::now());
+                match sequence.events.recv_timeout(wait) {
+                    Ok(event) => event,
+                    Err(std::sync::mpsc::RecvTimeoutError::Timeout) => {
+                        if let Some((phase, delta)) = cb_state.coalescer.flush() {
+                            cb_state.send_delta(phase, delta);
+                        }
+                        continue;
+                    }
+                    Err(std::sync::mpsc::RecvTimeoutError::Disconnected) => break,
+                }
+            }
+            None => match sequence.events.recv() {
+                Ok(event) => event,
+                Err(_) => break,
+            },
         };
-        common::write_command_sync(stream, &Command::V1(result_command))?;
-        stream.flush().ok();
+        match event {
+            crate::batch_engine::SequenceEvent::Token(piece) => {
+                clock.token();
+                let Ok(piece_c) = std::ffi::CString::new(piece) else {
+                    continue;
+                };
+                on_token(
+                    piece_c.as_ptr(),
+                    (&mut cb_state as *mut TokenCallbackState) as *mut std::ffi::c_void,
+                );
+            }
+            crate::batch_engine::SequenceEvent::Done {
+                prompt_tokens,
+                draft_tokens,
+                accepted_tokens,
+                ..
+            } => {
+                cb_state.usage.prompt_tokens = prompt_tokens;
+                decode_stats = (draft_tokens, accepted_tokens);
+                break;
+            }
+            crate::batch_engine::SequenceEvent::Error(e) => {
+                failure = Some(e);
+                break;
+            }
+        }
+    }
+
+    if let Some(e) = failure {
+        let result_command = cb_state.target.done(
+            cb_state.seq,
+            common::OutputPhase::Final,
+            Some(format!("Inference failed: {}", e)),
+            cb_state.usage,
+        );
+        send_command(writer, result_command)?;
         return Ok(());
     }
 
-    if !cb_state.buf.is_empty() {
-        let delta = std::mem::take(&mut cb_state.buf);
-        let chunk = CommandV1::InferenceResultChunk {
-            task_id: task_id.clone(),
-            seq: cb_state.seq,
-            delta,
-            phase: cb_state.buf_phase,
-            done: false,
-            error: None,
-            prompt_tokens: cb_state.prompt_tokens,
-            completion_tokens: cb_state.completion_tokens,
-            analysis_tokens: cb_state.analysis_tokens,
-            final_tokens: cb_state.final_tokens,
-        };
-        cb_state.seq = cb_state.seq.wrapping_add(1);
-        common::write_command_sync(stream, &Command::V1(chunk))?;
-        stream.flush().ok();
-    }
-
-    let done_cmd = CommandV1::InferenceResultChunk {
-        task_id,
-        seq: cb_state.seq,
-        delta: String::new(),
-        phase: cb_state.splitter.phase(),
-        done: true,
-        error: None,
-        prompt_tokens: cb_state.prompt_tokens,
-        completion_tokens: cb_state.completion_tokens,
-        analysis_tokens: cb_state.analysis_tokens,
-        final_tokens: cb_state.final_tokens,
-    };
+    if let Some((phase, tail)) = cb_state.splitter.finish() {
+        for (phase, delta) in cb_state.coalescer.push(phase, tail) {
+            cb_state.send_delta(phase, delta);
+        }
+    }
+    if let Some((phase, delta)) = cb_state.coalescer.flush() {
+        cb_state.send_delta(phase, delta);
+    }
 
-    common::write_command_sync(stream, &Command::V1(done_cmd))?;
-    stream.flush().ok();
+    if draft_tokens.is_some() {
+        let (draft_tokens, accepted_tokens) = decode_stats;
+        send_command(
+            writer,
+            CommandV1::TaskDecodeStats {
+                task_id: task_id.to_string(),
+                draft_tokens,
+                accepted_tokens,
+            },
+        )?;
+    }
+    if TASK_TIMINGS_REQUESTED.load(Ordering::Relaxed) {
+        send_command(
+            writer,
+            CommandV1::TaskTimings {
+                task_id: task_id.to_string(),
+                timings: clock.finish(),
+            },
+        )?;
+    }
+
+    let done_cmd = cb_state.target.done(
+        cb_state.seq,
+        cb_state.splitter.phase(),
+        None,
+        cb_state.usage,
+    );
+
+    send_command(writer, done_cmd)?;
 
     Ok(())
     }
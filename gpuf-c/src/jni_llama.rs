@@ -9,9 +9,11 @@
 // ============================================================================
 
 #[cfg(target_os = "android")]
-use jni::objects::{JClass, JObject, JString};
+use jni::objects::{JByteBuffer, JClass, JObject, JString};
 #[cfg(target_os = "android")]
-use jni::sys::{jboolean, jbyteArray, jfloat, jint, jlong, jstring};
+use jni::signature::{Primitive, ReturnType};
+#[cfg(target_os = "android")]
+use jni::sys::{jboolean, jbyteArray, jfloat, jint, jlong, jstring, jvalue};
 #[cfg(target_os = "android")]
 use jni::JNIEnv;
 
@@ -24,7 +26,7 @@ use crate::{
     gpuf_is_context_ready, gpuf_is_model_loaded, gpuf_load_model, gpuf_load_model_async,
     gpuf_load_multimodal_model, gpuf_multimodal_model, gpuf_multimodal_supports_vision,
     gpuf_start_generation_async, gpuf_stop_generation, gpuf_system_info, gpuf_version,
-    llama_context, llama_model, manual_llama_completion, should_stop_generation,
+    llama_context, llama_model, should_stop_generation,
     GLOBAL_CONTEXT_PTR, GLOBAL_MODEL_PTR, MODEL_STATUS,
 };
 
@@ -639,51 +641,37 @@ pub extern "C" fn Java_com_gpuf_c_GPUEngine_generateText(
         Err(_) => return std::ptr::null_mut(),
     };
 
-    // Get global model and context pointers
-    let model_ptr = GLOBAL_MODEL_PTR.load(Ordering::SeqCst);
-    let context_ptr = GLOBAL_CONTEXT_PTR.load(Ordering::SeqCst);
-
-    if model_ptr.is_null() || context_ptr.is_null() {
+    // The lease keeps the loaded pair alive across a concurrent model swap
+    let Some(lease) = crate::lease_current_model() else {
         eprintln!("🔥 GPUFabric JNI: Model or context not initialized");
         return match env.new_string("Error: Model not loaded") {
             Ok(jstring) => jstring.into_raw(),
             Err(_) => std::ptr::null_mut(),
         };
-    }
-
-    let prompt_cstr = match CString::new(prompt_text) {
-        Ok(s) => s,
-        Err(_) => return std::ptr::null_mut(),
     };
 
-    // Create a buffer for output
-    let mut output = vec![0u8; 4096];
-
-    let result = gpuf_generate_final_solution_text(
-        model_ptr,
-        context_ptr,
-        prompt_cstr.as_ptr(),
-        max_tokens as i32,
-        output.as_mut_ptr() as *mut c_char,
-        output.len() as i32,
-    );
-
-    if result > 0 {
-        let output_str = unsafe {
-            CStr::from_ptr(output.as_ptr() as *const c_char)
-                .to_str()
-                .unwrap_or("")
-        };
+    // Decodes as one sequence of the context's batch engine, alongside any
+    // worker tasks on the same context
+    let params = crate::batch_engine::SamplingParams {
+        temperature: 0.7,
+        top_k: 40,
+        top_p: 0.9,
+        repeat_penalty: 1.1,
+        draft_tokens: crate::batch_engine::default_draft_tokens(),
+    };
+    generated_jstring(
+        &mut env,
+        crate::generate_text(lease.context(), prompt_text, max_tokens, params),
+    )
+}
 
-        match env.new_string(output_str) {
-            Ok(jstring) => jstring.into_raw(),
-            Err(_) => std::ptr::null_mut(),
-        }
-    } else {
-        match env.new_string(format!("Error: Generation failed with code {}", result)) {
-            Ok(jstring) => jstring.into_raw(),
-            Err(_) => std::ptr::null_mut(),
-        }
+/// Java string for a `generate_text` result, or an error message.
+#[cfg(target_os = "android")]
+fn generated_jstring(env: &mut JNIEnv, text: Option<String>) -> jstring {
+    let text = text.unwrap_or_else(|| "Error: Generation failed".to_string());
+    match env.new_string(text) {
+        Ok(jstring) => jstring.into_raw(),
+        Err(_) => std::ptr::null_mut(),
     }
 }
 
@@ -715,56 +703,26 @@ pub extern "C" fn Java_com_gpuf_c_GPUEngine_generateTextWithSampling(
         Err(_) => return std::ptr::null_mut(),
     };
 
-    // Get global model and context pointers
-    let model_ptr = GLOBAL_MODEL_PTR.load(Ordering::SeqCst);
-    let context_ptr = GLOBAL_CONTEXT_PTR.load(Ordering::SeqCst);
-
-    if model_ptr.is_null() || context_ptr.is_null() {
+    // The lease keeps the loaded pair alive across a concurrent model swap
+    let Some(lease) = crate::lease_current_model() else {
         eprintln!("🔥 GPUFabric JNI: Model or context not initialized");
         return match env.new_string("Error: Model not loaded") {
             Ok(jstring) => jstring.into_raw(),
             Err(_) => std::ptr::null_mut(),
         };
-    }
-
-    let prompt_cstr = match CString::new(prompt_text) {
-        Ok(s) => s,
-        Err(_) => return std::ptr::null_mut(),
     };
 
-    // Create a buffer for output
-    let mut output = vec![0u8; 4096];
-
-    let result = manual_llama_completion(
-        model_ptr,
-        context_ptr,
-        prompt_cstr.as_ptr(),
-        max_tokens,
+    let params = crate::batch_engine::SamplingParams {
         temperature,
         top_k,
         top_p,
         repeat_penalty,
-        output.as_mut_ptr(),
-        output.len() as c_int,
-    );
-
-    if result > 0 {
-        let output_str = unsafe {
-            CStr::from_ptr(output.as_ptr() as *const c_char)
-                .to_str()
-                .unwrap_or("")
-        };
-
-        match env.new_string(output_str) {
-            Ok(jstring) => jstring.into_raw(),
-            Err(_) => std::ptr::null_mut(),
-        }
-    } else {
-        match env.new_string(format!("Error: Generation failed with code {}", result)) {
-            Ok(jstring) => jstring.into_raw(),
-            Err(_) => std::ptr::null_mut(),
-        }
-    }
+        draft_tokens: crate::batch_engine::default_draft_tokens(),
+    };
+    generated_jstring(
+        &mut env,
+        crate::generate_text(lease.context(), prompt_text, max_tokens, params),
+    )
 }
 
 /// Check inference service health
@@ -879,6 +837,120 @@ pub extern "C" fn Java_com_gpuf_c_GPUEngine_startGenerationAsync(
     result
 }
 
+/// Start generation that streams into a direct ByteBuffer
+///
+/// Java signature:
+/// public static native int startGenerationStreaming(long ctxPtr, String prompt, int maxTokens, float temperature, int topK, float topP, float repeatPenalty, java.nio.ByteBuffer buffer, int batchMs, Object listener);
+///
+/// Runs on the calling thread. Native code writes UTF-8 into `buffer` from
+/// offset 0, at most its capacity per batch and never splitting a character,
+/// then calls `listener.onTokens(int length, int tokenCount)` (signature
+/// `(II)Z`), so Java decodes many tokens per JNI crossing without a String
+/// per token. A batch is released when the buffer is full or `batchMs` has
+/// passed since its first token; returning false from `onTokens` stops
+/// generation. Returns the number of generated tokens, or -1 on error.
+#[no_mangle]
+#[cfg(target_os = "android")]
+pub extern "C" fn Java_com_gpuf_c_GPUEngine_startGenerationStreaming(
+    mut env: JNIEnv,
+    _class: JClass,
+    ctx_ptr: jlong,
+    prompt: JString,
+    max_tokens: jint,
+    temperature: jfloat,
+    top_k: jint,
+    top_p: jfloat,
+    repeat_penalty: jfloat,
+    buffer: JByteBuffer,
+    batch_ms: jint,
+    listener: JObject,
+) -> jint {
+    let ctx = ctx_ptr as *mut llama_context;
+    if ctx.is_null() {
+        println!("❌ JNI: Invalid context pointer");
+        return -1;
+    }
+    let prompt_str: String = match env.get_string(&prompt) {
+        Ok(s) => s.into(),
+        Err(e) => {
+            println!("❌ JNI: Failed to get prompt string: {:?}", e);
+            return -1;
+        }
+    };
+    let (data, capacity) = match (
+        env.get_direct_buffer_address(&buffer),
+        env.get_direct_buffer_capacity(&buffer),
+    ) {
+        (Ok(data), Ok(capacity)) if !data.is_null() && capacity >= 4 => (data, capacity),
+        _ => {
+            println!(
+                "❌ JNI: startGenerationStreaming needs a direct ByteBuffer of at least 4 bytes"
+            );
+            return -1;
+        }
+    };
+    let on_tokens = match env
+        .get_object_class(&listener)
+        .and_then(|class| env.get_method_id(&class, "onTokens", "(II)Z"))
+    {
+        Ok(id) => id,
+        Err(e) => {
+            println!(
+                "❌ JNI: listener has no onTokens(int, int) boolean: {:?}",
+                e
+            );
+            return -1;
+        }
+    };
+
+    let params = crate::batch_engine::SamplingParams {
+        temperature,
+        top_k,
+        top_p,
+        repeat_penalty,
+        draft_tokens: crate::batch_engine::default_draft_tokens(),
+    };
+    let Some(handle) = crate::submit_generation(ctx, &prompt_str, max_tokens, params) else {
+        return -1;
+    };
+    handle.bind_app(ctx);
+
+    let result = handle.stream_batches(
+        capacity,
+        std::time::Duration::from_millis(batch_ms.max(0) as u64),
+        |text, n_tokens| {
+            unsafe { std::ptr::copy_nonoverlapping(text.as_ptr(), data, text.len()) };
+            let args = [
+                jvalue {
+                    i: text.len() as jint,
+                },
+                jvalue {
+                    i: n_tokens as jint,
+                },
+            ];
+            // SAFETY: `on_tokens` was looked up on the listener's class with
+            // this signature.
+            let keep_going = unsafe {
+                env.call_method_unchecked(
+                    &listener,
+                    on_tokens,
+                    ReturnType::Primitive(Primitive::Boolean),
+                    &args,
+                )
+            };
+            // A Java exception stays pending and surfaces when we return.
+            matches!(keep_going.and_then(|v| v.z()), Ok(true))
+        },
+    );
+    match result {
+        Ok(n) => n as jint,
+        Err(e) => {
+            println!("❌ JNI: Streaming generation failed: {}", e);
+            -1
+        }
+    }
+}
+
 /// Stop ongoing generation
 ///
 /// Java signature:
@@ -26,11 +26,17 @@ use std::ffi::{c_char, c_int, c_void, CStr, CString};
 use std::io::Write;
 #[cfg(any(target_os = "android", target_os = "ios"))]
 use std::os::raw::c_ulonglong;
-use std::sync::atomic::{AtomicPtr, Ordering};
+use std::sync::atomic::{AtomicBool, AtomicPtr, AtomicU32, Ordering};
 use std::sync::{Arc, Mutex};
+#[cfg(target_os = "android")]
+use util::vision_cache::image_key;
+use util::vision_cache::{ImageEmbedding, ImageKey, VisionCache};
 
 const DEFAULT_LLAMA_THREADS: i32 = 4;
 const DEFAULT_MTMD_THREADS: i32 = 4;
+// Sequences a context can decode concurrently through the batch engine.
+// Override with GPUF_BATCH_SLOTS (1 restores single-sequence contexts).
+const DEFAULT_BATCH_SLOTS: u32 = 4;
 struct Utf8EmitBuffer {
     buf: Vec<u8>,
 }
@@ -100,6 +106,11 @@ pub mod handle;
 pub mod llm_engine;
 pub mod util;
 
+#[cfg(any(target_os = "android", target_os = "ios"))]
+pub mod batch_engine;
+#[cfg(any(target_os = "android", target_os = "ios"))]
+pub mod session;
+
 // iOS builds don't compile the full `handle` module (it depends on llm_engine).
 // Expose worker runtime directly.
 #[cfg(target_os = "ios")]
@@ -245,6 +256,13 @@ pub type LlamaSeqId = c_int;
 pub type MtmdLlamaPos = c_int;
 pub type MtmdLlamaSeqId = c_int;
 
+/// `MTMD_INPUT_CHUNK_TYPE_IMAGE` from mtmd.h.
+#[cfg(target_os = "android")]
+const MTMD_INPUT_CHUNK_TYPE_IMAGE: c_int = 1;
+/// Side of the RGB bitmap the multimodal entrypoints expect.
+#[cfg(target_os = "android")]
+const MULTIMODAL_IMAGE_SIDE: u32 = 224;
+
 // Batch structure for llama_decode
 #[repr(C)]
 #[derive(Clone)]
@@ -320,47 +338,17 @@ pub struct llama_sampler_chain_params {
 // Global Engine State Management
 // ============================================================================
 
-// Global context position tracking for continuous inference
-static mut GLOBAL_CONTEXT_POSITION: i32 = 0;
-
 // Async generation control
-static GENERATION_STOP_FLAG: AtomicPtr<bool> = AtomicPtr::new(std::ptr::null_mut());
+static GENERATION_STOP_FLAG: AtomicBool = AtomicBool::new(false);
 static GENERATION_MUTEX: Mutex<()> = Mutex::new(());
 
 // Thread-safe generation stop control
 fn should_stop_generation() -> bool {
-    unsafe {
-        let stop_ptr = GENERATION_STOP_FLAG.load(Ordering::SeqCst);
-        if !stop_ptr.is_null() {
-            *stop_ptr
-        } else {
-            false
-        }
-    }
+    GENERATION_STOP_FLAG.load(Ordering::SeqCst)
 }
 
 fn set_generation_stop(stop: bool) {
-    unsafe {
-        let stop_ptr = GENERATION_STOP_FLAG.load(Ordering::SeqCst);
-        if !stop_ptr.is_null() {
-            *stop_ptr = stop;
-        }
-    }
-}
-
-fn init_generation_control() {
-    let stop_flag = Box::into_raw(Box::new(false));
-    GENERATION_STOP_FLAG.store(stop_flag, Ordering::SeqCst);
-}
-
-fn cleanup_generation_control() {
-    unsafe {
-        let stop_ptr = GENERATION_STOP_FLAG.load(Ordering::SeqCst);
-        if !stop_ptr.is_null() {
-            let _ = Box::from_raw(stop_ptr);
-            GENERATION_STOP_FLAG.store(std::ptr::null_mut(), Ordering::SeqCst);
-        }
-    }
+    GENERATION_STOP_FLAG.store(stop, Ordering::SeqCst);
 }
 
 // Global model state management
@@ -484,6 +472,31 @@ extern "C" {
         new_n_past: *mut MtmdLlamaPos,
     ) -> c_int;
     fn mtmd_get_output_embd(ctx: *mut MtmdContext) -> *mut f32;
+    fn mtmd_input_chunks_size(chunks: *const MtmdInputChunks) -> usize;
+    fn mtmd_input_chunks_get(chunks: *const MtmdInputChunks, idx: usize) -> *const c_void;
+    fn mtmd_input_chunk_get_type(chunk: *const c_void) -> c_int;
+    fn mtmd_input_chunk_get_n_tokens(chunk: *const c_void) -> usize;
+    fn mtmd_helper_eval_chunk_single(
+        ctx: *mut MtmdContext,
+        lctx: *mut llama_context,
+        chunk: *const c_void,
+        n_past: MtmdLlamaPos,
+        seq_id: MtmdLlamaSeqId,
+        n_batch: c_int,
+        logits_last: bool,
+        new_n_past: *mut MtmdLlamaPos,
+    ) -> c_int;
+    fn mtmd_helper_decode_image_chunk(
+        ctx: *mut MtmdContext,
+        lctx: *mut llama_context,
+        chunk: *const c_void,
+        encoded_embd: *mut f32,
+        n_past: MtmdLlamaPos,
+        seq_id: MtmdLlamaSeqId,
+        n_batch: c_int,
+        new_n_past: *mut MtmdLlamaPos,
+    ) -> c_int;
+    fn llama_model_n_embd(model: *const llama_model) -> c_int;
 
     fn llama_sampler_init_top_k(k: c_int) -> *mut llama_sampler;
     fn llama_sampler_init_top_p(p: f32, min_keep: usize) -> *mut llama_sampler;
@@ -498,6 +511,9 @@ extern "C" {
     ) -> *mut llama_sampler;
     fn llama_vocab_n_tokens(vocab: *const llama_vocab) -> c_int;
     fn llama_n_batch(ctx: *mut llama_context) -> c_int;
+    fn llama_n_seq_max(ctx: *const llama_context) -> u32;
+    fn llama_n_threads(ctx: *mut llama_context) -> i32;
+    fn llama_set_n_threads(ctx: *mut llama_context, n_threads: i32, n_threads_batch: i32);
     fn llama_batch_init(n_tokens: c_int, embd: c_int, n_seq_max: c_int) -> llama_batch;
     fn llama_batch_free(batch: llama_batch);
     fn llama_batch_get_one(tokens: *mut LlamaToken, n_tokens: c_int) -> llama_batch;
@@ -554,6 +570,12 @@ extern "C" {
     fn llama_model_default_params() -> llama_model_params;
     fn llama_context_default_params() -> llama_context_params;
 
+    fn llama_model_meta_val_str(
+        model: *const llama_model,
+        key: *const c_char,
+        buf: *mut c_char,
+        buf_size: usize,
+    ) -> i32;
     fn llama_chat_apply_template(
         tmpl: *const c_char,
         chat: *const llama_chat_message,
@@ -610,19 +632,6 @@ fn real_llama_free(ctx: *mut llama_context) {
     unsafe { llama_free(ctx) }
 }
 
-//
-#[cfg(target_os = "android")]
-fn safe_llama_tokenize_with_pool(
-    ctx: *mut llama_context,
-    text: *const c_char,
-    tokens: *mut LlamaToken,
-    n_max_tokens: c_int,
-    add_bos: bool,
-) -> c_int {
-    // Temporarily disabled - use safe_tokenize instead
-    0
-}
-
 #[cfg(any(target_os = "android", target_os = "ios"))]
 // llama-cpp-rs
 pub(crate) unsafe fn safe_tokenize(
@@ -842,343 +851,6 @@ fn decode_token_to_text(model: *const llama_model, token: LlamaToken) -> String
     }
 }
 
-#[cfg(any(target_os = "android", target_os = "ios"))]
-pub fn manual_llama_completion(
-    model: *const llama_model,
-    ctx: *mut llama_context,
-    prompt: *const c_char,
-    max_tokens: c_int,
-    temperature: f32,
-    top_k: c_int,
-    top_p: f32,
-    repeat_penalty: f32,
-    output: *mut c_char,
-    output_len: c_int,
-) -> c_int {
-    unsafe {
-        // DEBUG: Temporarily remove memory pool reset to test llama_tokenize
-        // reset_pool();
-
-        // Step 1: Use safe tokenization inspired by llama-cpp-rs
-        let mut tokens = [0i32; 512]; // Static array, no allocation
-        let mut token_count = 0;
-
-        // DEBUG: Check raw input string before tokenization
-        let prompt_str = if prompt.is_null() {
-            println!(" Prompt pointer is NULL!");
-            return 0;
-        } else {
-            unsafe {
-                let c_str = std::ffi::CStr::from_ptr(prompt);
-                match c_str.to_str() {
-                    Ok(s) => {
-                        println!(" RAW INPUT DEBUG:");
-                        println!("  Pointer: {:p}", prompt);
-                        println!("  Length: {} bytes", s.len());
-                        println!("  Content: \"{}\"", s);
-                        println!("  Bytes as hex: {:?}", s.as_bytes());
-                        s
-                    }
-                    Err(e) => {
-                        println!(" Invalid UTF-8 in prompt: {:?}", e);
-                        return 0;
-                    }
-                }
-            }
-        };
-
-        // Use safe tokenization with fallback
-        let tokenize_result = safe_tokenize(ctx, prompt, tokens.as_mut_ptr(), 512, true);
-
-        if tokenize_result > 0 {
-            token_count = tokenize_result;
-            println!(" Safe tokenization successful! Got {} tokens", token_count);
-
-            // DEBUG: Print actual input tokens and decoded text
-            println!(" INPUT DEBUG - Prompt tokens:");
-            for i in 0..token_count {
-                let decoded = decode_token_to_text(model, tokens[i as usize]);
-                println!("  Token[{}]: {} -> \"{}\"", i, tokens[i as usize], decoded);
-            }
-        } else {
-            println!(" Safe tokenization failed, using emergency fallback");
-            // Emergency fallback to BOS only
-            tokens[0] = 1; // BOS
-            token_count = 1;
-        }
-
-        println!(" Using {} tokens for inference", token_count);
-
-        // Step 2: Clear KV cache for clean inference
-        let kv = llama_get_memory(ctx);
-        if !kv.is_null() {
-            // Clear all sequences from KV cache
-            let clear_result = llama_memory_seq_rm(kv, -1, -1, -1);
-            if clear_result {
-                println!(" KV cache cleared successfully");
-            } else {
-                println!(" KV cache clear failed, trying full clear...");
-                llama_memory_clear(kv, false);
-            }
-        }
-
-        // Step 3: Global position tracking for continuous context
-        // CRITICAL FIX: Reset position for new independent inference
-        let current_pos = 0; // Always start from 0 for clean inference
-        GLOBAL_CONTEXT_POSITION = 0; // Reset global state
-        println!(
-            " GLOBAL CONTEXT: Reset to position {} for clean inference",
-            current_pos
-        );
-
-        // Step 3: Create batch with global position tracking and logits request
-        let mut batch_pos_array = [0i32; 512]; // Position array for batch
-        let mut logits_array = [0i8; 512]; // Logits request array
-
-        for i in 0..token_count {
-            batch_pos_array[i as usize] = current_pos + i;
-            // Request logits for the last token only (for sampling)
-            logits_array[i as usize] = if i == token_count - 1 { 1 } else { 0 };
-        }
-
-        println!("🔍 Creating initial batch with {} tokens", token_count);
-
-        let initial_batch = llama_batch {
-            n_tokens: token_count,
-            token: tokens.as_ptr() as *mut LlamaToken,
-            embd: std::ptr::null_mut(),
-            pos: batch_pos_array.as_ptr() as *mut LlamaPos,
-            n_seq_id: std::ptr::null_mut(),
-            seq_id: std::ptr::null_mut(),
-            logits: logits_array.as_ptr() as *mut i8, // Request logits for last token
-        };
-
-        println!("🔍 Initial batch created, about to decode...");
-
-        println!(
-            " Created batch with {} tokens, positions {} to {}",
-            token_count,
-            current_pos,
-            current_pos + token_count - 1
-        );
-
-        // Decode prompt
-        let decode_result = llama_decode(ctx, initial_batch);
-        if decode_result != 0 {
-            println!(" Initial decode failed with code {}", decode_result);
-            let msg = format!("Initial decode failed: code {}", decode_result);
-            let msg_bytes = msg.as_bytes();
-            let copy_len = std::cmp::min(msg_bytes.len(), output_len as usize - 1);
-            std::ptr::copy_nonoverlapping(msg.as_ptr(), output as *mut u8, copy_len);
-            *output.add(copy_len) = 0;
-            return copy_len as c_int;
-        }
-
-        println!(" Initial decode successful");
-
-        // Step 4: Generate tokens and update global position
-        let mut generated_tokens = 0;
-        let mut result_text = String::new();
-        let mut next_pos = current_pos + token_count;
-
-        // Generate tokens with reasonable safety limits
-        // Context window is now 4096, support much longer generation
-        // Allow up to 4096 tokens, but ensure we don't exceed context window
-        let context_available = 4096 - current_pos - token_count;
-        let safe_generation_limit =
-            std::cmp::min(max_tokens, std::cmp::min(4096, context_available));
-        println!(
-            " Generation limit: {} (requested: {}, context_available: {}, max_safe: 4096)",
-            safe_generation_limit, max_tokens, context_available
-        );
-
-        // PROPER SAMPLER: Use actual sampling parameters
-        println!(
-            " Creating sampler with params: temp={}, top_k={}, top_p={}, repeat_penalty={}",
-            temperature, top_k, top_p, repeat_penalty
-        );
-
-        // Create sampler chain
-        let chain_params = llama_sampler_chain_params { no_perf: false };
-        let persistent_sampler = unsafe { llama_sampler_chain_init(chain_params) };
-
-        if persistent_sampler.is_null() {
-            println!(" Failed to create persistent sampler chain");
-            return 0;
-        }
-
-        // Add samplers in proper order (like llama.cpp examples)
-
-        // 1. Repeat penalty sampler
-        if repeat_penalty != 1.0 {
-            let repeat_sampler =
-                unsafe { llama_sampler_init_penalties(-1, repeat_penalty, 0.0, 0.0) };
-            if !repeat_sampler.is_null() {
-                unsafe { llama_sampler_chain_add(persistent_sampler, repeat_sampler) };
-                println!(
-                    " Added Repeat penalty sampler (penalty: {})",
-                    repeat_penalty
-                );
-            }
-        }
-
-        // 2. Top-K sampler
-        if top_k > 0 {
-            let top_k_sampler = unsafe { llama_sampler_init_top_k(top_k) };
-            if !top_k_sampler.is_null() {
-                unsafe { llama_sampler_chain_add(persistent_sampler, top_k_sampler) };
-                println!(" Added Top-K sampler (k: {})", top_k);
-            }
-        }
-
-        // 3. Top-P sampler
-        if top_p < 1.0 {
-            let top_p_sampler = unsafe { llama_sampler_init_top_p(top_p, 1) };
-            if !top_p_sampler.is_null() {
-                unsafe { llama_sampler_chain_add(persistent_sampler, top_p_sampler) };
-                println!(" Added Top-P sampler (p: {})", top_p);
-            }
-        }
-
-        // 4. Temperature sampler
-        if temperature > 0.0 {
-            let temp_sampler = unsafe { llama_sampler_init_temp(temperature) };
-            if !temp_sampler.is_null() {
-                unsafe { llama_sampler_chain_add(persistent_sampler, temp_sampler) };
-                println!(" Added Temperature sampler (temp: {})", temperature);
-            }
-        }
-
-        // 5. Distribution sampler (for actual sampling)
-        let dist_sampler = unsafe { llama_sampler_init_dist(1234) };
-        if !dist_sampler.is_null() {
-            unsafe { llama_sampler_chain_add(persistent_sampler, dist_sampler) };
-            println!(" Added Distribution sampler");
-        }
-
-        println!(" Sampler chain configured with all parameters");
-
-        // Track current batch size (starts with initial token_count)
-        let mut current_batch_size = token_count;
-
-        for i in 0..safe_generation_limit {
-            // Step 1: Sample from the last decoded position
-            // After decode, logits are available at index (n_tokens - 1) for single token batches
-            // For initial batch, logits are at the last token position
-            let sampling_index = if i == 0 {
-                token_count - 1 // First iteration: sample from initial batch's last token
-            } else {
-                0 // Subsequent iterations: single token batch, logits at index 0
-            };
-
-            println!(
-                " Sampling iteration {}: from logits index {} (batch_size: {})",
-                i, sampling_index, current_batch_size
-            );
-
-            // Use persistent sampler
-            let sampled_token =
-                unsafe { llama_sampler_sample(persistent_sampler, ctx, sampling_index) };
-
-            println!(" Sampled token: {} at position {}", sampled_token, next_pos);
-
-            // Check for EOS
-            if sampled_token == 2 {
-                // EOS token
-                println!(" Reached EOS token");
-                break;
-            }
-
-            println!(
-                " Generated token {} at sequence position {} (temp:{}, top_k:{}, top_p:{})",
-                sampled_token, next_pos, temperature, top_k, top_p
-            );
-
-            // Decode and add to result
-            let decoded_text = decode_token_to_text(model, sampled_token);
-            result_text.push_str(&decoded_text);
-            println!(" Token text: \"{}\"", decoded_text);
-
-            generated_tokens += 1;
-            next_pos += 1;
-
-            // Step 2: CLEAR batch and add single new token (llama-cpp-rs style)
-            println!(
-                " Clearing batch and adding new token at position {}",
-                next_pos - 1
-            );
-
-            // Create new single token batch (exactly like llama-cpp-rs)
-            let mut single_token_pos = [0i32; 1];
-            let mut single_token_logits = [1i8; 1]; // Always request logits for single token
-
-            single_token_pos[0] = next_pos - 1; // Current sequence position
-            single_token_logits[0] = 1; // Request logits
-
-            let new_batch = llama_batch {
-                n_tokens: 1,           // Single token batch
-                token: (&sampled_token as *const LlamaToken) as *mut LlamaToken, // The new token
-                embd: std::ptr::null_mut(),
-                pos: single_token_pos.as_ptr() as *mut LlamaPos,
-                n_seq_id: std::ptr::null_mut(),
-                seq_id: std::ptr::null_mut(),
-                logits: single_token_logits.as_ptr() as *mut i8,
-            };
-
-            // Step 3: Decode the new single token batch
-            let decode_result = unsafe { llama_decode(ctx, new_batch) };
-            if decode_result != 0 {
-                println!(" Decode failed at step {} with code {}", i, decode_result);
-                break;
-            }
-
-            // Step 4: Update batch size for next iteration
-            current_batch_size = 1; // Now we have a single token batch
-            println!(
-                " Completed iteration {}, batch_size reset to {}, next_pos: {}",
-                i, current_batch_size, next_pos
-            );
-
-            // Safety check
-            if generated_tokens >= max_tokens {
-                break;
-            }
-        }
-
-        // Cleanup persistent sampler at the end
-        unsafe { llama_sampler_free(persistent_sampler) };
-        println!(" Cleaned up persistent sampler");
-
-        GLOBAL_CONTEXT_POSITION = next_pos;
-        println!(
-            " GLOBAL CONTEXT: Updated position to {}",
-            GLOBAL_CONTEXT_POSITION
-        );
-
-        // Step 6: Return only the generated text (no debug info)
-        let final_text = if generated_tokens > 0 {
-            println!(
-                " CONTINUOUS CONTEXT: Generated {} tokens from pos {} (next: {})",
-                generated_tokens, current_pos, GLOBAL_CONTEXT_POSITION
-            );
-            result_text
-        } else {
-            println!(
-                " No tokens generated - continuous context ready from pos {} (next: {})",
-                current_pos, GLOBAL_CONTEXT_POSITION
-            );
-            String::new() // Return empty string if no tokens generated
-        };
-
-        let text_bytes = final_text.as_bytes();
-        let copy_len = std::cmp::min(text_bytes.len(), output_len as usize - 1);
-        std::ptr::copy_nonoverlapping(text_bytes.as_ptr(), output as *mut u8, copy_len);
-        *output.add(copy_len) = 0;
-
-        copy_len as c_int
-    }
-}
-
 #[cfg(any(target_os = "android", target_os = "ios"))]
 fn real_llama_n_ctx(ctx: *const llama_context) -> c_int {
     unsafe { llama_n_ctx(ctx) }
@@ -1434,6 +1106,36 @@ fn simulate_llama_context_default_params() -> llama_context_params {
 
 // Final solution: Use real llama.cpp API on Android, simulated on other platforms
 
+#[cfg(any(target_os = "android", target_os = "ios"))]
+fn batch_slots() -> u32 {
+    std::env::var("GPUF_BATCH_SLOTS")
+        .ok()
+        .and_then(|v| v.parse::<u32>().ok())
+        .filter(|n| *n > 0)
+        .unwrap_or(DEFAULT_BATCH_SLOTS)
+}
+
+/// `enum llama_flash_attn_type` value that forces flash attention on.
+const LLAMA_FLASH_ATTN_TYPE_ENABLED: i32 = 1;
+
+/// Size `params` from the device profile. llama.cpp only supports a
+/// quantized V cache with flash attention, so that is enabled with it.
+pub(crate) fn apply_context_profile(
+    params: &mut llama_context_params,
+    profile: &common::ContextProfile,
+) {
+    params.n_ctx = profile.n_ctx;
+    params.n_batch = profile.n_batch;
+    params.n_ubatch = profile.n_ubatch;
+    params.n_threads = profile.n_threads as i32;
+    params.n_threads_batch = profile.n_threads_batch as i32;
+    params.type_k = profile.kv_cache.ggml_type();
+    params.type_v = profile.kv_cache.ggml_type();
+    if profile.kv_cache != common::KvCacheType::F16 {
+        params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+    }
+}
+
 /// # Safety
 /// `model` must be a valid pointer to a `llama_model` created by this library (or the linked
 /// llama.cpp bindings) and must remain valid for the duration of this call.
@@ -1444,15 +1146,17 @@ pub extern "C" fn gpuf_create_context(model: *mut llama_model) -> *mut llama_con
         return std::ptr::null_mut();
     }
 
-    println!("🔧 Creating context with correct llama.cpp parameters...");
+    let profile = crate::util::device_profile::current();
+    println!("🔧 Creating context with device profile: {:?}", profile);
 
     let mut params = unsafe { llama_context_default_params() };
-    params.n_ctx = 4096;
-    params.n_batch = 128;
-    params.n_threads = DEFAULT_LLAMA_THREADS;
-    params.n_threads_batch = DEFAULT_LLAMA_THREADS;
+    apply_context_profile(&mut params, &profile);
     params.embeddings = false;
     params.offload_kqv = false;
+    // Sequences share one unified KV cache so a single long prompt can still
+    // use the whole window while short ones are batched together.
+    params.n_seq_max = batch_slots();
+    params.kv_unified = true;
 
     println!("📍 About to call real_llama_init_from_model...");
     let result = real_llama_init_from_model(model, params);
@@ -1516,13 +1220,6 @@ pub extern "C" fn gpuf_load_model_async_start(path: *const c_char) -> bool {
     let handle = std::thread::spawn(move || {
         println!("📊 Background thread: Starting REAL model load...");
 
-        // Update state to show we're actually loading
-        unsafe {
-            if let Some(ref mut state) = ASYNC_LOADING_STATE {
-                state.progress = 0.1; // 10% - started loading
-            }
-        }
-
         // Actually load the model (this is the real work)
         let path_cstr = std::ffi::CString::new(path_str).unwrap();
         let model_ptr = gpuf_load_model(path_cstr.as_ptr());
@@ -1572,12 +1269,16 @@ pub extern "C" fn gpuf_load_model_get_status() -> i32 {
     }
 }
 
-/// Get loading progress (limited but realistic)
+/// Get loading progress; while loading this is llama.cpp's own progress
+/// through the model's tensors
 #[no_mangle]
 pub extern "C" fn gpuf_load_model_get_progress() -> f32 {
     unsafe {
         ASYNC_LOADING_STATE
-            .map(|state| state.progress)
+            .map(|state| match state.status {
+                1 => f32::from_bits(MODEL_LOAD_PROGRESS.load(Ordering::Relaxed)),
+                _ => state.progress,
+            })
             .unwrap_or(-1.0) // -1.0 = not started
     }
 }
@@ -1676,8 +1377,17 @@ pub extern "C" fn gpuf_load_model_async(
         callback(0.0, user_data); // 0% - starting
     }
 
-    // Load model (this is the slow part)
-    let model_ptr = gpuf_load_model(path);
+    // Load model (this is the slow part), passing llama.cpp's progress through
+    let model_ptr = match on_progress {
+        Some(callback) => load_shared_model(
+            path,
+            Some(&LoadProgressSink {
+                callback,
+                user_data,
+            }),
+        ),
+        None => gpuf_load_model(path),
+    };
 
     if model_ptr.is_null() {
         // Report failure
@@ -1823,6 +1533,16 @@ pub struct gpuf_multimodal_model {
     pub is_multimodal: bool,
     // 🆕 Keep CString alive for media_marker
     _media_marker: CString,
+    /// Projector outputs of recently seen images, keyed by pixel hash.
+    vision_cache: Mutex<VisionCache>,
+}
+
+/// Image encoded once by `gpuf_multimodal_encode_image` and reused across
+/// generations; keeps its pixels for tokenization and pins its encoding.
+pub struct gpuf_image_embedding {
+    key: ImageKey,
+    pixels: Vec<u8>,
+    embedding: Arc<ImageEmbedding>,
 }
 
 pub struct MultimodalModel {
@@ -1836,38 +1556,249 @@ pub struct MultimodalModel {
 
 // Load model with multimodal support
 ///
+/// Loading a file that is already loaded with the same options returns the
+/// same model; release each result with gpuf_release_model.
+///
 /// # Safety
 /// `path` must be a valid, NUL-terminated C string pointer and must remain valid for the duration
 /// of this call.
 #[no_mangle]
 #[cfg(any(target_os = "android", target_os = "ios"))]
 pub extern "C" fn gpuf_load_model(path: *const c_char) -> *mut llama_model {
+    load_shared_model(path, None)
+}
+
+/// How gpuf_load_model maps model files; see gpuf_set_model_load_options.
+#[cfg(any(target_os = "android", target_os = "ios"))]
+#[derive(Clone, Copy)]
+struct ModelLoadOptions {
+    use_mmap: bool,
+    use_mlock: bool,
+    prefetch: util::model_prefetch::Prefetch,
+}
+
+#[cfg(any(target_os = "android", target_os = "ios"))]
+static MODEL_LOAD_OPTIONS: Mutex<ModelLoadOptions> = Mutex::new(ModelLoadOptions {
+    use_mmap: true, // Weights stay in the page cache instead of the heap
+    use_mlock: false,
+    prefetch: util::model_prefetch::Prefetch::WillNeed,
+});
+
+/// Progress llama.cpp last reported for the running load, as f32 bits.
+static MODEL_LOAD_PROGRESS: AtomicU32 = AtomicU32::new(0);
+
+/// Models loaded through gpuf_load_model. Loading a file that is already
+/// loaded with the same options hands out the same model, so every context
+/// on it shares one mapping; gpuf_release_model frees it with the last user.
+#[cfg(any(target_os = "android", target_os = "ios"))]
+struct SharedModel {
+    path: String,
+    use_mmap: bool,
+    use_mlock: bool,
+    model: usize,
+    refs: usize,
+}
+
+#[cfg(any(target_os = "android", target_os = "ios"))]
+static SHARED_MODELS: Mutex<Vec<SharedModel>> = Mutex::new(Vec::new());
+
+/// Forwards llama.cpp load progress to a caller's callback.
+#[cfg(any(target_os = "android", target_os = "ios"))]
+struct LoadProgressSink {
+    callback: extern "C" fn(f32, *mut c_void),
+    user_data: *mut c_void,
+}
+
+#[cfg(any(target_os = "android", target_os = "ios"))]
+extern "C" fn report_model_load_progress(progress: f32, user_data: *mut c_void) -> bool {
+    MODEL_LOAD_PROGRESS.store(progress.to_bits(), Ordering::Relaxed);
+    if let Some(sink) = unsafe { (user_data as *const LoadProgressSink).as_ref() } {
+        (sink.callback)(progress, sink.user_data);
+    }
+    true // Keep loading
+}
+
+#[cfg(any(target_os = "android", target_os = "ios"))]
+fn load_shared_model(path: *const c_char, sink: Option<&LoadProgressSink>) -> *mut llama_model {
     if path.is_null() {
         return std::ptr::null_mut();
     }
+    let path_str = match unsafe { CStr::from_ptr(path) }.to_str() {
+        Ok(s) => s.to_owned(),
+        Err(_) => return std::ptr::null_mut(),
+    };
+    let options = *MODEL_LOAD_OPTIONS.lock().unwrap_or_else(|e| e.into_inner());
+    MODEL_LOAD_PROGRESS.store(0f32.to_bits(), Ordering::Relaxed);
+
+    if let Some(shared) = SHARED_MODELS
+        .lock()
+        .unwrap_or_else(|e| e.into_inner())
+        .iter_mut()
+        .find(|m| {
+            m.path == path_str && m.use_mmap == options.use_mmap && m.use_mlock == options.use_mlock
+        })
+    {
+        shared.refs += 1;
+        MODEL_LOAD_PROGRESS.store(1f32.to_bits(), Ordering::Relaxed);
+        println!(
+            "♻️ Reusing loaded model {} ({} users)",
+            path_str, shared.refs
+        );
+        return shared.model as *mut llama_model;
+    }
 
-    println!("🔧 Loading model with safe parameters...");
+    // Warm the page cache in tensor order while llama.cpp parses the file,
+    // so the first decode does not fault the weights in piecemeal.
+    if let Some(layout) =
+        util::model_prefetch::start(std::path::Path::new(&path_str), options.prefetch)
+    {
+        println!(
+            "📥 Prefetching {} tensors ({} MB) with {:?}",
+            layout.tensor_count,
+            layout.data_len() >> 20,
+            options.prefetch
+        );
+    }
 
-    // Use safer parameter settings
+    println!(
+        "🔧 Loading model (mmap: {}, mlock: {})...",
+        options.use_mmap, options.use_mlock
+    );
     let mut params = unsafe { llama_model_default_params() };
     params.vocab_only = false;
-    params.use_mmap = true; // Enable mmap to reduce memory pressure
-    params.use_mlock = false;
+    params.use_mmap = options.use_mmap;
+    params.use_mlock = options.use_mlock;
     params.n_gpu_layers = 0; // Force CPU usage to avoid GPU-related issues
+    params.progress_callback = Some(report_model_load_progress);
+    params.progress_callback_user_data = sink.map_or(std::ptr::null_mut(), |sink| {
+        sink as *const LoadProgressSink as *mut c_void
+    });
 
-    println!("📍 About to call real_llama_model_load_from_file...");
     let result = real_llama_model_load_from_file(path, params);
     println!("✅ real_llama_model_load_from_file returned: {:p}", result);
-
+    if !result.is_null() {
+        SHARED_MODELS
+            .lock()
+            .unwrap_or_else(|e| e.into_inner())
+            .push(SharedModel {
+                path: path_str,
+                use_mmap: options.use_mmap,
+                use_mlock: options.use_mlock,
+                model: result as usize,
+                refs: 1,
+            });
+    }
     result
 }
 
+/// Set how later gpuf_load_model calls load models. `prefetch` is 0 (off),
+/// 1 (MADV_WILLNEED the tensor data) or 2 (read it in sequentially on a
+/// helper thread). mlock may be refused by RLIMIT_MEMLOCK, in which case
+/// llama.cpp logs a warning and loads unlocked.
+///
+/// Returns 0 on success, -1 for an unknown prefetch mode.
 #[no_mangle]
-#[cfg(target_os = "ios")]
-pub extern "C" fn gpuf_load_model(_path: *const c_char) -> *mut llama_model {
-    std::ptr::null_mut()
-}
-
+#[cfg(any(target_os = "android", target_os = "ios"))]
+pub extern "C" fn gpuf_set_model_load_options(
+    use_mmap: bool,
+    use_mlock: bool,
+    prefetch: c_int,
+) -> c_int {
+    let Some(prefetch) = util::model_prefetch::Prefetch::from_raw(prefetch) else {
+        return -1;
+    };
+    *MODEL_LOAD_OPTIONS.lock().unwrap_or_else(|e| e.into_inner()) = ModelLoadOptions {
+        use_mmap,
+        use_mlock,
+        prefetch,
+    };
+    0
+}
+
+/// Drop one use of a model returned by gpuf_load_model, freeing it once no
+/// one else holds it. Contexts created on it must be freed first.
+#[no_mangle]
+#[cfg(any(target_os = "android", target_os = "ios"))]
+pub extern "C" fn gpuf_release_model(model: *mut llama_model) {
+    if model.is_null() {
+        return;
+    }
+    let mut shared = SHARED_MODELS.lock().unwrap_or_else(|e| e.into_inner());
+    match shared.iter().position(|m| m.model == model as usize) {
+        Some(i) if shared[i].refs > 1 => {
+            shared[i].refs -= 1;
+            return;
+        }
+        Some(i) => {
+            shared.swap_remove(i);
+        }
+        // Not loaded through gpuf_load_model; it has a single owner.
+        None => {}
+    }
+    drop(shared);
+    unsafe { llama_model_free(model) };
+}
+
+/// Take another use of `model` if it was loaded through gpuf_load_model, so
+/// it outlives the caller's reference until gpuf_release_model. Returns false
+/// for models the library does not track.
+#[cfg(any(target_os = "android", target_os = "ios"))]
+pub(crate) fn retain_shared_model(model: *mut llama_model) -> bool {
+    let mut shared = SHARED_MODELS.lock().unwrap_or_else(|e| e.into_inner());
+    match shared.iter_mut().find(|m| m.model == model as usize) {
+        Some(m) => {
+            m.refs += 1;
+            true
+        }
+        None => false,
+    }
+}
+
+/// Load `path` with gpuf_load_model as the draft model for speculative
+/// decoding, replacing any previous one; NULL turns speculation off.
+/// `n_draft` (at most 16) is the draft length used by local generation calls;
+/// remote tasks choose their own. The draft model must share the target's
+/// vocabulary, otherwise sequences decode normally.
+///
+/// Returns 0 on success, -1 if the model failed to load.
+///
+/// # Safety
+/// `path` must be NULL or a valid, NUL-terminated C string pointer.
+#[no_mangle]
+#[cfg(any(target_os = "android", target_os = "ios"))]
+pub extern "C" fn gpuf_set_draft_model(path: *const c_char, n_draft: c_int) -> c_int {
+    if path.is_null() {
+        batch_engine::set_draft_model(std::ptr::null_mut(), 0);
+        return 0;
+    }
+    let model = load_shared_model(path, None);
+    if model.is_null() {
+        return -1;
+    }
+    batch_engine::set_draft_model(model, n_draft.max(0) as u32);
+    println!("✅ Draft model set: {:p}, n_draft={}", model, n_draft);
+    0
+}
+
+/// Report the device temperature and battery state for the throttling
+/// governor, for hosts where the library cannot read them (iOS). Pass -1 for
+/// values that are unknown. Reports expire after a minute.
+#[no_mangle]
+#[cfg(any(target_os = "android", target_os = "ios"))]
+pub extern "C" fn gpuf_report_device_state(temp_c: c_int, battery_pct: c_int, charging: bool) {
+    util::governor::report(util::governor::DeviceState {
+        temp_c: u32::try_from(temp_c).ok(),
+        battery_pct: u8::try_from(battery_pct).ok().filter(|&p| p <= 100),
+        charging,
+    });
+}
+
+#[no_mangle]
+#[cfg(target_os = "ios")]
+pub extern "C" fn gpuf_load_model(_path: *const c_char) -> *mut llama_model {
+    std::ptr::null_mut()
+}
+
 // 🆕 Helper function to detect model type from filename
 fn detect_model_type_from_path(model_path: &str) -> ProjectorType {
     if model_path.contains("Qwen2-VL") || model_path.contains("qwen2vl") {
@@ -1910,7 +1841,10 @@ pub extern "C" fn gpuf_load_multimodal_model(
         println!("  MMProj: {}", mmproj_path_str);
 
         // Load text model first
-        let model_params = llama_model_default_params();
+        let options = *MODEL_LOAD_OPTIONS.lock().unwrap_or_else(|e| e.into_inner());
+        let mut model_params = llama_model_default_params();
+        model_params.use_mmap = options.use_mmap;
+        model_params.use_mlock = options.use_mlock;
         let text_model = llama_load_model_from_file(text_model_path, model_params);
         if text_model.is_null() {
             eprintln!("❌ Failed to load text model");
@@ -1984,6 +1918,7 @@ pub extern "C" fn gpuf_load_multimodal_model(
             vocab,          // Store vocab pointer like official
             is_multimodal: true,
             _media_marker: media_marker, // 🆕 Keep CString alive
+            vision_cache: Mutex::new(VisionCache::default()),
         });
 
         println!("✅ Multimodal model loaded successfully");
@@ -2036,6 +1971,109 @@ pub extern "C" fn gpuf_create_multimodal_context(
     std::ptr::null_mut()
 }
 
+// Encode an image chunk through the projector and copy its output, which
+// mtmd overwrites on the next encode.
+#[cfg(target_os = "android")]
+unsafe fn encode_image_chunk(
+    model: &gpuf_multimodal_model,
+    chunk: *const c_void,
+) -> Option<Arc<ImageEmbedding>> {
+    if mtmd_encode_chunk(model.mtmd_context, chunk) != 0 {
+        return None;
+    }
+    let embd = mtmd_get_output_embd(model.mtmd_context);
+    let n_embd = llama_model_n_embd(model.text_model);
+    if embd.is_null() || n_embd <= 0 {
+        return None;
+    }
+    let n_tokens = mtmd_input_chunk_get_n_tokens(chunk);
+    let data = std::slice::from_raw_parts(embd, n_tokens * n_embd as usize).to_vec();
+    Some(Arc::new(ImageEmbedding { n_tokens, data }))
+}
+
+#[cfg(target_os = "android")]
+unsafe fn first_image_chunk(chunks: *const MtmdInputChunks) -> Option<*const c_void> {
+    (0..mtmd_input_chunks_size(chunks))
+        .map(|i| mtmd_input_chunks_get(chunks, i))
+        .find(|&chunk| mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_IMAGE)
+}
+
+// Evaluate tokenized input like mtmd_helper_eval_chunks, but decode the
+// request's image from `pinned` or the model's vision cache instead of running
+// the projector again. Only the first image chunk is cached: the multimodal
+// entrypoints take a single image.
+#[cfg(target_os = "android")]
+unsafe fn eval_chunks_cached(
+    model: &gpuf_multimodal_model,
+    ctx: *mut llama_context,
+    chunks: *mut MtmdInputChunks,
+    mut image: Option<(&ImageKey, Option<&Arc<ImageEmbedding>>)>,
+    n_batch: c_int,
+    new_n_past: &mut MtmdLlamaPos,
+) -> c_int {
+    let n_embd = llama_model_n_embd(model.text_model).max(0) as usize;
+    let mut n_past: MtmdLlamaPos = 0;
+    let n_chunks = mtmd_input_chunks_size(chunks);
+
+    for i in 0..n_chunks {
+        let chunk = mtmd_input_chunks_get(chunks, i);
+        let is_image = mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_IMAGE;
+        let request_image = if is_image { image.take() } else { None };
+        let result = match request_image {
+            Some((key, pinned)) => {
+                let n_tokens = mtmd_input_chunk_get_n_tokens(chunk);
+                let fits = |e: &Arc<ImageEmbedding>| {
+                    e.n_tokens == n_tokens && e.data.len() == n_tokens * n_embd
+                };
+                let cached = pinned.cloned().filter(fits).or_else(|| {
+                    let mut cache = model.vision_cache.lock().unwrap_or_else(|e| e.into_inner());
+                    cache.get(key).filter(fits)
+                });
+                let embedding = match cached {
+                    Some(embedding) => Some(embedding),
+                    None => encode_image_chunk(model, chunk).map(|embedding| {
+                        model
+                            .vision_cache
+                            .lock()
+                            .unwrap_or_else(|e| e.into_inner())
+                            .insert(*key, Arc::clone(&embedding));
+                        embedding
+                    }),
+                };
+                match embedding {
+                    Some(embedding) => mtmd_helper_decode_image_chunk(
+                        model.mtmd_context,
+                        ctx,
+                        chunk,
+                        embedding.data.as_ptr() as *mut f32,
+                        n_past,
+                        0,
+                        n_batch,
+                        &mut n_past,
+                    ),
+                    None => -1,
+                }
+            }
+            None => mtmd_helper_eval_chunk_single(
+                model.mtmd_context,
+                ctx,
+                chunk,
+                n_past,
+                0,
+                n_batch,
+                i + 1 == n_chunks,
+                &mut n_past,
+            ),
+        };
+        if result != 0 {
+            return result;
+        }
+    }
+
+    *new_n_past = n_past;
+    0
+}
+
 /// # Safety
 /// - `multimodal_model` must be a valid pointer returned by `gpuf_load_multimodal_model`.
 /// - `ctx` may be null (a fresh context may be created internally); if non-null it must be a valid
@@ -2148,7 +2186,7 @@ pub extern "C" fn gpuf_generate_multimodal(
             println!("🔍 DEBUG: Starting image processing...");
 
             // For demo purposes, assume image is 224x224 RGB
-            let image = mtmd_bitmap_init(224, 224, image_data);
+            let image = mtmd_bitmap_init(MULTIMODAL_IMAGE_SIDE, MULTIMODAL_IMAGE_SIDE, image_data);
             if !image.is_null() {
                 // Tokenize with image
                 let image_ptr = &image;
@@ -2168,8 +2206,8 @@ pub extern "C" fn gpuf_generate_multimodal(
 
                     // For multimodal models, the tokenization should have already prepared the context
                     // Let's check if we can proceed directly to generation
-                    // Always use mtmd_helper_eval_chunks to encode and get correct n_past position
-                    println!("🔍 Encoding multimodal input with mtmd_helper_eval_chunks...");
+                    // Evaluate through the vision cache to encode and get correct n_past position
+                    println!("🔍 Encoding multimodal input with eval_chunks_cached...");
                     println!("🔍 Before encoding - current_pos: {}", current_pos);
 
                     unsafe {
@@ -2181,18 +2219,21 @@ pub extern "C" fn gpuf_generate_multimodal(
                             pre_encode_n_ctx, pre_encode_vocab
                         );
 
-                        encode_result = mtmd_helper_eval_chunks(
-                            mtmd_ctx,
+                        let key = image_key(
+                            std::slice::from_raw_parts(image_data, image_size as usize),
+                            MULTIMODAL_IMAGE_SIDE,
+                            MULTIMODAL_IMAGE_SIDE,
+                        );
+                        encode_result = eval_chunks_cached(
+                            model_ref,
                             ctx,
-                            chunks as *mut c_void,
-                            current_pos,
-                            0,    // seq_id
-                            128,  // n_batch
-                            true, // logits_last
+                            chunks,
+                            Some((&key, None)),
+                            128, // n_batch
                             &mut new_n_past,
                         );
 
-                        println!("🔍 mtmd_helper_eval_chunks result: {}", encode_result);
+                        println!("🔍 eval_chunks_cached result: {}", encode_result);
                         println!("🔍 New n_past: {} (was: {})", new_n_past, current_pos);
 
                         // Check context state after encoding
@@ -2235,10 +2276,7 @@ pub extern "C" fn gpuf_generate_multimodal(
 
                     if encode_result == 0 {
                         println!("✅ Multimodal encoding successful - proceeding with generation");
-                        println!(
-                            "🔍 Using position {} from mtmd_helper_eval_chunks",
-                            new_n_past
-                        );
+                        println!("🔍 Using position {} from eval_chunks_cached", new_n_past);
 
                         // Always use direct vocab pointer approach for consistency
                         // This avoids issues with llama_n_vocab(ctx) returning 0 after multimodal encoding
@@ -2402,6 +2440,43 @@ pub extern "C" fn gpuf_generate_multimodal_stream(
     on_token: TokenCallback,
     on_complete: CompletionCallback,
     user_data: *mut c_void,
+) -> c_int {
+    generate_multimodal_stream(
+        multimodal_model,
+        ctx,
+        text_prompt,
+        image_data,
+        image_size,
+        None,
+        max_tokens,
+        temperature,
+        top_k,
+        top_p,
+        repeat_penalty,
+        on_token,
+        on_complete,
+        user_data,
+    )
+}
+
+// Streaming generation shared by the raw-image and pre-encoded entrypoints;
+// `pinned` supplies the image encoding when the caller already has one.
+#[cfg(target_os = "android")]
+fn generate_multimodal_stream(
+    multimodal_model: *mut gpuf_multimodal_model,
+    ctx: *mut llama_context,
+    text_prompt: *const c_char,
+    image_data: *const u8,
+    image_size: c_ulonglong,
+    pinned: Option<&gpuf_image_embedding>,
+    max_tokens: c_int,
+    temperature: f32,
+    top_k: c_int,
+    top_p: f32,
+    repeat_penalty: f32,
+    on_token: TokenCallback,
+    on_complete: CompletionCallback,
+    user_data: *mut c_void,
 ) -> c_int {
     println!("🔍 Starting streaming multimodal generation...");
 
@@ -2469,7 +2544,7 @@ pub extern "C" fn gpuf_generate_multimodal_stream(
         if !image_data.is_null() && image_size > 0 {
             println!("🔍 DEBUG: Image data found - {} bytes", image_size);
 
-            let bitmap = mtmd_bitmap_init(224, 224, image_data);
+            let bitmap = mtmd_bitmap_init(MULTIMODAL_IMAGE_SIDE, MULTIMODAL_IMAGE_SIDE, image_data);
 
             if !bitmap.is_null() {
                 bitmaps.push(bitmap);
@@ -2498,18 +2573,21 @@ pub extern "C" fn gpuf_generate_multimodal_stream(
             return -1;
         }
 
-        // Encode with mtmd_helper_eval_chunks
+        // Encode, reusing the image's projector output when it is cached
+        let key = match pinned {
+            Some(handle) => Some(handle.key),
+            None if !image_data.is_null() && image_size > 0 => Some(image_key(
+                std::slice::from_raw_parts(image_data, image_size as usize),
+                MULTIMODAL_IMAGE_SIDE,
+                MULTIMODAL_IMAGE_SIDE,
+            )),
+            None => None,
+        };
+        let image = key
+            .as_ref()
+            .map(|key| (key, pinned.map(|handle| &handle.embedding)));
         let mut new_n_past: MtmdLlamaPos = 0;
-        let encode_result = mtmd_helper_eval_chunks(
-            mtmd_ctx,
-            ctx,
-            chunks as *mut c_void,
-            0,
-            0,
-            128,
-            true,
-            &mut new_n_past,
-        );
+        let encode_result = eval_chunks_cached(model_ref, ctx, chunks, image, 128, &mut new_n_past);
 
         if encode_result != 0 {
             println!("❌ Multimodal encoding failed: {}", encode_result);
@@ -2687,6 +2765,223 @@ pub extern "C" fn gpuf_free_multimodal_model(multimodal_model: *mut gpuf_multimo
     }
 }
 
+/// Encode an image once so later generations about it skip the projector.
+/// The encoding also lands in the model's image cache, so passing the same
+/// pixels to `gpuf_generate_multimodal_stream` hits it while it stays cached;
+/// the returned handle keeps it available regardless of eviction.
+///
+/// Returns null on failure. Release with `gpuf_free_image_embedding`.
+///
+/// # Safety
+/// - `multimodal_model` must be a valid pointer returned by `gpuf_load_multimodal_model`.
+/// - `image_data` must be a valid pointer to `image_size` bytes of RGB pixels.
+#[no_mangle]
+#[cfg(target_os = "android")]
+pub extern "C" fn gpuf_multimodal_encode_image(
+    multimodal_model: *mut gpuf_multimodal_model,
+    image_data: *const u8,
+    image_size: c_ulonglong,
+) -> *mut gpuf_image_embedding {
+    if multimodal_model.is_null() || image_data.is_null() || image_size == 0 {
+        return std::ptr::null_mut();
+    }
+
+    unsafe {
+        let model_ref = &*multimodal_model;
+        if model_ref.mtmd_context.is_null() {
+            return std::ptr::null_mut();
+        }
+
+        let pixels = std::slice::from_raw_parts(image_data, image_size as usize).to_vec();
+        let key = image_key(&pixels, MULTIMODAL_IMAGE_SIDE, MULTIMODAL_IMAGE_SIDE);
+        let cached = model_ref
+            .vision_cache
+            .lock()
+            .unwrap_or_else(|e| e.into_inner())
+            .get(&key);
+
+        let embedding = match cached {
+            Some(embedding) => embedding,
+            None => {
+                // Tokenize the bare media marker to get the image's chunk.
+                let bitmap = mtmd_bitmap_init(
+                    MULTIMODAL_IMAGE_SIDE,
+                    MULTIMODAL_IMAGE_SIDE,
+                    pixels.as_ptr(),
+                );
+                if bitmap.is_null() {
+                    return std::ptr::null_mut();
+                }
+                let chunks = mtmd_input_chunks_init();
+                if chunks.is_null() {
+                    mtmd_bitmap_free(bitmap);
+                    return std::ptr::null_mut();
+                }
+                let input_text = MtmdInputText {
+                    text: model_ref._media_marker.as_ptr(),
+                    add_special: false,
+                    parse_special: true,
+                };
+                let tokenized =
+                    mtmd_tokenize(model_ref.mtmd_context, chunks, &input_text, &bitmap, 1);
+                mtmd_bitmap_free(bitmap);
+
+                let encoded = if tokenized == 0 {
+                    first_image_chunk(chunks).and_then(|chunk| encode_image_chunk(model_ref, chunk))
+                } else {
+                    None
+                };
+                mtmd_input_chunks_free(chunks);
+
+                match encoded {
+                    Some(embedding) => {
+                        model_ref
+                            .vision_cache
+                            .lock()
+                            .unwrap_or_else(|e| e.into_inner())
+                            .insert(key, Arc::clone(&embedding));
+                        embedding
+                    }
+                    None => {
+                        println!("❌ Failed to encode image");
+                        return std::ptr::null_mut();
+                    }
+                }
+            }
+        };
+
+        Box::into_raw(Box::new(gpuf_image_embedding {
+            key,
+            pixels,
+            embedding,
+        }))
+    }
+}
+
+#[no_mangle]
+#[cfg(target_os = "ios")]
+pub extern "C" fn gpuf_multimodal_encode_image(
+    _multimodal_model: *mut gpuf_multimodal_model,
+    _image_data: *const u8,
+    _image_size: c_ulonglong,
+) -> *mut gpuf_image_embedding {
+    std::ptr::null_mut()
+}
+
+/// Streaming generation about an image encoded by `gpuf_multimodal_encode_image`.
+/// Behaves like `gpuf_generate_multimodal_stream` without re-running the projector.
+///
+/// # Safety
+/// - `multimodal_model` must be the model `image` was encoded with.
+/// - `ctx` may be null; if non-null it must be a valid `llama_context` for the model.
+/// - `text_prompt` must be a valid, NUL-terminated C string pointer containing the media marker.
+/// - `image` must be a live handle from `gpuf_multimodal_encode_image`.
+#[no_mangle]
+#[cfg(target_os = "android")]
+pub extern "C" fn gpuf_generate_multimodal_stream_with_image(
+    multimodal_model: *mut gpuf_multimodal_model,
+    ctx: *mut llama_context,
+    text_prompt: *const c_char,
+    image: *const gpuf_image_embedding,
+    max_tokens: c_int,
+    temperature: f32,
+    top_k: c_int,
+    top_p: f32,
+    repeat_penalty: f32,
+    on_token: TokenCallback,
+    on_complete: CompletionCallback,
+    user_data: *mut c_void,
+) -> c_int {
+    if image.is_null() {
+        return -1;
+    }
+
+    let image = unsafe { &*image };
+    generate_multimodal_stream(
+        multimodal_model,
+        ctx,
+        text_prompt,
+        image.pixels.as_ptr(),
+        image.pixels.len() as c_ulonglong,
+        Some(image),
+        max_tokens,
+        temperature,
+        top_k,
+        top_p,
+        repeat_penalty,
+        on_token,
+        on_complete,
+        user_data,
+    )
+}
+
+#[no_mangle]
+#[cfg(target_os = "ios")]
+pub extern "C" fn gpuf_generate_multimodal_stream_with_image(
+    _multimodal_model: *mut gpuf_multimodal_model,
+    _ctx: *mut llama_context,
+    _text_prompt: *const c_char,
+    _image: *const gpuf_image_embedding,
+    _max_tokens: c_int,
+    _temperature: f32,
+    _top_k: c_int,
+    _top_p: f32,
+    _repeat_penalty: f32,
+    _on_token: TokenCallback,
+    _on_complete: CompletionCallback,
+    _user_data: *mut c_void,
+) -> c_int {
+    -1
+}
+
+/// # Safety
+/// `image` must be null or a handle from `gpuf_multimodal_encode_image` that
+/// has not been freed yet.
+#[no_mangle]
+#[cfg(target_os = "android")]
+pub extern "C" fn gpuf_free_image_embedding(image: *mut gpuf_image_embedding) {
+    if !image.is_null() {
+        unsafe { drop(Box::from_raw(image)) };
+    }
+}
+
+#[no_mangle]
+#[cfg(target_os = "ios")]
+pub extern "C" fn gpuf_free_image_embedding(_image: *mut gpuf_image_embedding) {}
+
+/// Set the byte budget of the model's image-encoding cache, evicting the
+/// least recently used images to fit. Zero disables the cache.
+///
+/// # Safety
+/// `multimodal_model` must be a valid pointer returned by `gpuf_load_multimodal_model`.
+#[no_mangle]
+#[cfg(target_os = "android")]
+pub extern "C" fn gpuf_multimodal_set_image_cache_bytes(
+    multimodal_model: *mut gpuf_multimodal_model,
+    bytes: c_ulonglong,
+) -> c_int {
+    if multimodal_model.is_null() {
+        return -1;
+    }
+
+    let model_ref = unsafe { &*multimodal_model };
+    model_ref
+        .vision_cache
+        .lock()
+        .unwrap_or_else(|e| e.into_inner())
+        .set_budget(bytes as usize);
+    0
+}
+
+#[no_mangle]
+#[cfg(target_os = "ios")]
+pub extern "C" fn gpuf_multimodal_set_image_cache_bytes(
+    _multimodal_model: *mut gpuf_multimodal_model,
+    _bytes: c_ulonglong,
+) -> c_int {
+    -1
+}
+
 // Check if multimodal model supports vision
 #[no_mangle]
 #[cfg(target_os = "android")]
@@ -3303,27 +3598,34 @@ pub extern "C" fn gpuf_generate_with_sampling(
         return -2;
     }
 
-    unsafe {
-        println!("🔥 Using manual completion like llama.rn implements");
-        println!(
-            "🎛️ Sampling params: temp={:.2}, top_k={}, top_p={:.2}, repeat_penalty={:.2}",
-            temperature, top_k, top_p, repeat_penalty
-        );
+    let prompt_str = match unsafe { CStr::from_ptr(prompt) }.to_str() {
+        Ok(s) => s,
+        Err(_) => return -1,
+    };
 
-        // Use manual completion implementation based on actual llama.cpp API
-        manual_llama_completion(
-            model,
-            ctx,
-            prompt,
-            max_tokens,
-            temperature,
-            top_k,
-            top_p,
-            repeat_penalty,
-            output,
-            output_len,
-        )
+    println!(
+        "🎛️ Sampling params: temp={:.2}, top_k={}, top_p={:.2}, repeat_penalty={:.2}",
+        temperature, top_k, top_p, repeat_penalty
+    );
+
+    let params = batch_engine::SamplingParams {
+        temperature,
+        top_k,
+        top_p,
+        repeat_penalty,
+        draft_tokens: batch_engine::default_draft_tokens(),
+    };
+    let Some(result_text) = generate_text(ctx, prompt_str, max_tokens, params) else {
+        return -1;
+    };
+
+    let text_bytes = result_text.as_bytes();
+    let copy_len = std::cmp::min(text_bytes.len(), output_len as usize - 1);
+    unsafe {
+        std::ptr::copy_nonoverlapping(text_bytes.as_ptr(), output as *mut u8, copy_len);
+        *output.add(copy_len) = 0;
     }
+    copy_len as c_int
 }
 
 #[no_mangle]
@@ -3363,17 +3665,7 @@ pub extern "C" fn gpuf_init() -> c_int {
 
     #[cfg(target_os = "android")]
     {
-        // Step 1: Initialize memory pool first
-        if !init_memory_pool() {
-            println!("❌ Failed to initialize memory pool");
-            return -1;
-        }
-        println!(
-            "✅ Memory pool initialized: {}MB",
-            MEMORY_POOL_SIZE / (1024 * 1024)
-        );
-
-        // Step 2: Setup C++ runtime
+        // Step 1: Setup C++ runtime
         use std::env;
 
         if env::var("LD_PRELOAD").is_err() {
@@ -3403,7 +3695,7 @@ pub extern "C" fn gpuf_init() -> c_int {
             }
         }
 
-        // Step 3: Initialize llama.cpp backend
+        // Step 2: Initialize llama.cpp backend
         real_llama_backend_init();
 
         // Force reference to GGML backend symbols to ensure they are linked
@@ -3432,137 +3724,32 @@ pub extern "C" fn gpuf_init() -> c_int {
 pub extern "C" fn gpuf_cleanup() -> c_int {
     println!("🧹 GPUFabric Android LLaMA.cpp solution cleaned up");
 
-    #[cfg(target_os = "android")]
-    {
-        // Cleanup memory pool
-        cleanup_memory_pool();
-        println!("✅ Memory pool cleaned up");
-    }
-
     real_llama_backend_free();
     0
 }
 
 // ============================================================================
-// Static buffers for Android memory safety
+// Async Generation Control Functions
 // ============================================================================
 
-static mut TOKEN_BUFFER: [LlamaToken; 32] = [0; 32];
-static mut TEXT_BUFFER: [u8; 128] = [0; 128];
-
-// 🆕 Memory pool for llama.cpp internal allocations
-#[repr(C)]
-pub struct MemoryPool {
-    buffer: *mut u8,
-    size: usize,
-    used: usize,
-    initialized: bool,
-}
+/// Stop the generations the app started on `ctx`, or on every context when
+/// `ctx` is null. Worker tasks on the same context keep running.
+#[no_mangle]
+pub extern "C" fn gpuf_stop_generation(ctx: *mut llama_context) -> c_int {
+    println!("🛑 Stopping generation...");
+    set_generation_stop(true);
+    #[cfg(any(target_os = "android", target_os = "ios"))]
+    batch_engine::cancel_app_sequences(ctx);
+    #[cfg(not(any(target_os = "android", target_os = "ios")))]
+    let _ = ctx;
 
-static mut MEMORY_POOL: MemoryPool = MemoryPool {
-    buffer: std::ptr::null_mut(),
-    size: 0,
-    used: 0,
-    initialized: false,
-};
+    // Wait a bit for generation to stop
+    std::thread::sleep(std::time::Duration::from_millis(100));
+    set_generation_stop(false);
 
-// Memory pool size: 64MB for llama.cpp internal allocations
-const MEMORY_POOL_SIZE: usize = 64 * 1024 * 1024; // 64MB
-
-#[cfg(target_os = "android")]
-pub fn init_memory_pool() -> bool {
-    unsafe {
-        if MEMORY_POOL.initialized {
-            return true;
-        }
-
-        // Allocate memory pool using mmap for better control
-        let buffer = libc::mmap(
-            std::ptr::null_mut(),
-            MEMORY_POOL_SIZE,
-            libc::PROT_READ | libc::PROT_WRITE,
-            libc::MAP_PRIVATE | libc::MAP_ANONYMOUS,
-            -1,
-            0,
-        );
-
-        if buffer == libc::MAP_FAILED {
-            return false;
-        }
-
-        MEMORY_POOL = MemoryPool {
-            buffer: buffer as *mut u8,
-            size: MEMORY_POOL_SIZE,
-            used: 0,
-            initialized: true,
-        };
-
-        true
-    }
-}
-
-#[cfg(target_os = "android")]
-pub fn allocate_from_pool(size: usize, alignment: usize) -> *mut u8 {
-    unsafe {
-        if !MEMORY_POOL.initialized || MEMORY_POOL.buffer.is_null() {
-            return std::ptr::null_mut();
-        }
-
-        // Calculate aligned offset
-        let current_offset = MEMORY_POOL.used;
-        let aligned_offset = (current_offset + alignment - 1) & !(alignment - 1);
-        let new_used = aligned_offset + size;
-
-        // Check if we have enough space
-        if new_used > MEMORY_POOL.size {
-            return std::ptr::null_mut();
-        }
-
-        // Update pool state and return pointer
-        MEMORY_POOL.used = new_used;
-        MEMORY_POOL.buffer.add(aligned_offset)
-    }
-}
-
-#[cfg(any(target_os = "android", target_os = "ios"))]
-pub fn reset_pool() {
-    #[cfg(target_os = "android")]
-    unsafe {
-        MEMORY_POOL.used = 0;
-    }
-
-    #[cfg(target_os = "ios")]
-    {
-        let _ = ();
-    }
-}
-
-#[cfg(target_os = "android")]
-pub fn cleanup_memory_pool() {
-    unsafe {
-        if MEMORY_POOL.initialized && !MEMORY_POOL.buffer.is_null() {
-            libc::munmap(MEMORY_POOL.buffer as *mut libc::c_void, MEMORY_POOL.size);
-            MEMORY_POOL.initialized = false;
-        }
-    }
-}
-
-// ============================================================================
-// Async Generation Control Functions
-// ============================================================================
-
-/// Stop ongoing generation
-#[no_mangle]
-pub extern "C" fn gpuf_stop_generation(_ctx: *mut llama_context) -> c_int {
-    println!("🛑 Stopping generation...");
-    set_generation_stop(true);
-
-    // Wait a bit for generation to stop
-    std::thread::sleep(std::time::Duration::from_millis(100));
-
-    println!("✅ Generation stop signal sent");
-    0
-}
+    println!("✅ Generation stop signal sent");
+    0
+}
 
 /// Start async generation with streaming callback (simplified version)
 #[no_mangle]
@@ -3583,270 +3770,253 @@ pub extern "C" fn gpuf_start_generation_async(
         return -1;
     }
 
-    // Initialize generation control
-    init_generation_control();
-    set_generation_stop(false);
-
     println!("🚀 Starting streaming generation...");
 
-    // For now, use synchronous generation with callbacks
-    // This avoids thread safety issues while providing streaming
-    unsafe {
-        // Get prompt string
-        let prompt_str = std::ffi::CStr::from_ptr(prompt).to_str().unwrap_or("");
-
-        // Reset memory pool
-        reset_pool();
-
-        // Clear KV cache for sequence 0 (remove all positions)
-        let kv = llama_get_memory(ctx);
-        let clear_result = llama_memory_seq_rm(kv, 0, -1, -1);
-        if !clear_result {
-            println!("⚠️ llama_memory_seq_rm failed, trying full clear...");
-            llama_memory_clear(kv, false);
-        }
-        println!("✅ KV cache cleared for clean generation");
+    let prompt_str = unsafe { std::ffi::CStr::from_ptr(prompt) }
+        .to_str()
+        .unwrap_or("");
 
-        // Tokenize prompt using real llama.cpp tokenizer
-        let model = llama_get_model(ctx);
-        if model.is_null() {
-            println!("🔍 Early return due to null model");
-            return -1;
-        }
-
-        let vocab = llama_model_get_vocab(model);
-        if vocab.is_null() {
-            println!("🔍 Early return due to null vocab");
-            return -1;
-        }
-
-        let mut tokens: Vec<i32> = vec![0; 512];
-        let mut token_count = llama_tokenize(
-            vocab,
-            prompt,
-            prompt_str.len() as c_int,
-            tokens.as_mut_ptr(),
-            tokens.len() as c_int,
-            true,
-            true,
-        );
-        if token_count < 0 {
-            let needed = (-token_count) as usize;
-            tokens = vec![0; needed.max(1)];
-            token_count = llama_tokenize(
-                vocab,
-                prompt,
-                prompt_str.len() as c_int,
-                tokens.as_mut_ptr(),
-                tokens.len() as c_int,
-                true,
-                true,
-            );
-        }
-
-        println!("🔍 After tokenization: token_count={}", token_count);
-
-        if token_count <= 0 {
-            println!("🔍 Early return due to token_count <= 0");
-            return -1;
-        }
-
-        // Prefill prompt in chunks to respect ctx n_batch (llama.cpp asserts otherwise)
-        let n_batch = {
-            let nb = llama_n_batch(ctx);
-            if nb > 0 {
-                nb
-            } else {
-                128
-            }
-        };
-
-        println!(
-            "🔍 Prefill: token_count={}, n_batch={}",
-            token_count, n_batch
-        );
-
-        let mut batch_pos_array = [0i32; 512];
-        let mut logits_array = [0i8; 512];
+    let params = batch_engine::SamplingParams {
+        temperature,
+        top_k,
+        top_p,
+        repeat_penalty,
+        draft_tokens: batch_engine::default_draft_tokens(),
+    };
+    let Some(handle) = submit_generation(ctx, prompt_str, max_tokens, params) else {
+        return -1;
+    };
+    handle.bind_app(ctx);
+    drain_to_callback(&handle, on_token_callback, user_data)
+}
 
-        let mut n_past: i32 = 0;
-        let mut start: i32 = 0;
-        while start < token_count {
-            let end = std::cmp::min(start + n_batch, token_count);
-            let n = end - start;
+/// `gpuf_start_generation_async` for a worker task: the sequence is bound to
+/// `task_id`, so `batch_engine::cancel_task` stops only this task, and
+/// GLOBAL_INFERENCE_MUTEX is held while the prompt is queued, not while it
+/// decodes. The caller keeps its `ModelLease` until this returns.
+#[cfg(any(target_os = "android", target_os = "ios"))]
+#[allow(clippy::too_many_arguments)]
+pub(crate) fn generate_for_task(
+    ctx: *mut llama_context,
+    task_id: &str,
+    prompt: &CStr,
+    max_tokens: c_int,
+    temperature: f32,
+    top_k: c_int,
+    top_p: f32,
+    repeat_penalty: f32,
+    on_token_callback: Option<extern "C" fn(*const c_char, *mut c_void)>,
+    user_data: *mut c_void,
+) -> c_int {
+    let params = batch_engine::SamplingParams {
+        temperature,
+        top_k,
+        top_p,
+        repeat_penalty,
+        draft_tokens: batch_engine::default_draft_tokens(),
+    };
+    let submitted = {
+        let _lock = GLOBAL_INFERENCE_MUTEX
+            .lock()
+            .unwrap_or_else(|e| e.into_inner());
+        submit_generation(ctx, prompt.to_str().unwrap_or(""), max_tokens, params)
+    };
+    let Some(handle) = submitted else {
+        return -1;
+    };
+    let _binding = handle.bind_task(task_id);
+    drain_to_callback(&handle, on_token_callback, user_data)
+}
 
-            for i in 0..n {
-                batch_pos_array[i as usize] = n_past + i;
-                // Request logits only for the last token of the final chunk
-                logits_array[i as usize] = if end == token_count && i == n - 1 {
-                    1
-                } else {
-                    0
-                };
+/// Hand every piece of `handle` to `on_token_callback` (stdout without one)
+/// and return the completion token count, or -1 on error.
+#[cfg(any(target_os = "android", target_os = "ios"))]
+fn drain_to_callback(
+    handle: &batch_engine::SequenceHandle,
+    on_token_callback: Option<extern "C" fn(*const c_char, *mut c_void)>,
+    user_data: *mut c_void,
+) -> c_int {
+    // Tokens are decoded on the engine thread; callbacks still run on the
+    // caller's thread so existing callers keep their threading assumptions.
+    let mut completion_tokens: c_int = 0;
+    for event in handle.events.iter() {
+        let piece = match event {
+            batch_engine::SequenceEvent::Token(piece) => piece,
+            batch_engine::SequenceEvent::Done {
+                completion_tokens: n,
+                ..
+            } => {
+                completion_tokens = n as c_int;
+                break;
             }
-
-            let batch = llama_batch {
-                n_tokens: n,
-                token: tokens.as_ptr().add(start as usize) as *mut LlamaToken,
-                embd: std::ptr::null_mut(),
-                pos: batch_pos_array.as_ptr() as *mut LlamaPos,
-                n_seq_id: std::ptr::null_mut(),
-                seq_id: std::ptr::null_mut(),
-                logits: logits_array.as_ptr() as *mut i8,
-            };
-
-            println!(
-                "🔍 Prefill llama_decode: start={}, end={}, n_tokens={}, n_past={} ",
-                start, end, n, n_past
-            );
-            let decode_result = llama_decode(ctx, batch);
-            if decode_result != 0 {
-                println!("🔍 Early return due to decode failure: {}", decode_result);
+            batch_engine::SequenceEvent::Error(e) => {
+                println!("❌ Streaming generation failed: {}", e);
                 return -1;
             }
-            n_past += n;
-            start = end;
-        }
-
-        println!("🔍 Model and vocab ready, starting generation loop...");
-
-        // Initialize sampler
-        let temp_sampler = llama_sampler_init_temp(temperature);
-        let top_k_sampler = llama_sampler_init_top_k(top_k);
-        let top_p_sampler = llama_sampler_init_top_p(top_p, 1);
-        let repeat_sampler = llama_sampler_init_penalties(-1, repeat_penalty, 0.0, 0.0);
-        let dist_sampler = llama_sampler_init_dist(1234);
-
-        let chain_params = llama_sampler_chain_params { no_perf: false };
-        let sampler = llama_sampler_chain_init(chain_params);
-
-        llama_sampler_chain_add(sampler, temp_sampler);
-        llama_sampler_chain_add(sampler, top_k_sampler);
-        llama_sampler_chain_add(sampler, top_p_sampler);
-        llama_sampler_chain_add(sampler, repeat_sampler);
-        llama_sampler_chain_add(sampler, dist_sampler);
-
-        // Generate tokens with streaming callbacks
-        let n_ctx = llama_n_ctx(ctx) as i32;
-        let context_available = n_ctx - n_past;
-        let safe_generation_limit = std::cmp::min(max_tokens, context_available);
-        let mut next_pos = n_past;
-        let mut utf8_buf = Utf8EmitBuffer::new();
+        };
 
-        let mut completion_tokens: c_int = 0;
-        for _i in 0..safe_generation_limit {
-            // Check for stop signal
-            if should_stop_generation() {
-                println!("⏹️ Generation stopped by user");
-                break;
+        if let Some(callback) = on_token_callback {
+            match std::ffi::CString::new(piece.as_str()) {
+                Ok(token_cstr) => callback(token_cstr.as_ptr(), user_data),
+                Err(_) => {
+                    println!("⚠️ Token callback skipped - CString conversion failed");
+                }
             }
+        } else {
+            print!("{}", piece);
+            use std::io::Write;
+            std::io::stdout().flush().ok();
+        }
+    }
 
-            // Sample next token using llama.cpp sampler
-            let sampled_token = llama_sampler_sample(sampler, ctx, -1);
-
-            println!(
-                "🔍 Sampled token: {} (EOS: {})",
-                sampled_token,
-                llama_vocab_is_eog(vocab, sampled_token)
-            );
-
-            // Check EOS
-            if llama_vocab_is_eog(vocab, sampled_token) {
-                println!("🔍 EOS token detected, stopping generation");
-                break;
-            }
+    println!(
+        "✅ Streaming generation completed (generated {} tokens)",
+        completion_tokens
+    );
+    completion_tokens
+}
 
-            completion_tokens = completion_tokens.saturating_add(1);
+/// A submitted sequence together with the lease on its model, so a model
+/// swap cannot free the context while the caller is still draining it.
+#[cfg(any(target_os = "android", target_os = "ios"))]
+pub(crate) struct LeasedSequence {
+    handle: batch_engine::SequenceHandle,
+    _lease: Option<ModelLease>,
+}
 
-            // Convert token to text
-            let mut token_buf = [0u8; 32];
-            let token_len = llama_token_to_piece(
-                vocab,
-                sampled_token,
-                token_buf.as_mut_ptr() as *mut c_char,
-                token_buf.len() as c_int,
-                0,
-                false,
-            );
+#[cfg(any(target_os = "android", target_os = "ios"))]
+impl std::ops::Deref for LeasedSequence {
+    type Target = batch_engine::SequenceHandle;
 
-            println!(
-                "🔍 Token debug: sampled_token={}, token_len={}",
-                sampled_token, token_len
-            );
+    fn deref(&self) -> &Self::Target {
+        &self.handle
+    }
+}
 
-            if token_len > 0 {
-                let emitted = utf8_buf.push_and_take_valid(&token_buf[..token_len as usize]);
-                println!(
-                    "🔍 Token content: \"{}\" (bytes: {:?})",
-                    emitted,
-                    &token_buf[..token_len as usize]
-                );
+/// Queue `prompt` as a sequence on the batch engine driving `ctx`. When
+/// `ctx` is the loaded model's context the returned sequence holds a lease
+/// on it; contexts the caller created stay the caller's to keep alive.
+#[cfg(any(target_os = "android", target_os = "ios"))]
+pub(crate) fn submit_generation(
+    ctx: *mut llama_context,
+    prompt: &str,
+    max_tokens: c_int,
+    params: batch_engine::SamplingParams,
+) -> Option<LeasedSequence> {
+    // Leased before the engine lookup: a swap that lands first retires the
+    // context, and engine_for then refuses it.
+    let lease = lease_current_model().filter(|lease| lease.context() == ctx);
+    let engine = batch_engine::engine_for(ctx)?;
+    match engine.submit(prompt, max_tokens, params) {
+        Ok(handle) => Some(LeasedSequence {
+            handle,
+            _lease: lease,
+        }),
+        Err(e) => {
+            println!("❌ Failed to submit sequence: {}", e);
+            None
+        }
+    }
+}
 
-                // Call callback only if it's not None
-                if !emitted.is_empty() {
-                    if let Some(callback) = on_token_callback {
-                        println!("🔍 Calling callback with token...");
-                        match std::ffi::CString::new(emitted.as_str()) {
-                            Ok(token_cstr) => {
-                                callback(token_cstr.as_ptr(), user_data);
-                                println!("🔍 Callback completed");
-                            }
-                            Err(_) => {
-                                println!("⚠️ Token callback skipped - CString conversion failed");
-                            }
-                        }
-                    } else {
-                        // Just print the token if no callback provided
-                        println!("🔍 No callback - printing directly");
-                        print!("{}", emitted);
-                        use std::io::Write;
-                        std::io::stdout().flush().ok();
-                    }
+/// Run `prompt` to completion on the batch engine driving `ctx` and return
+/// its text, so concurrent callers on the same context decode together.
+/// None when the sequence could not be queued or failed before any text.
+#[cfg(any(target_os = "android", target_os = "ios"))]
+pub(crate) fn generate_text(
+    ctx: *mut llama_context,
+    prompt: &str,
+    max_tokens: c_int,
+    params: batch_engine::SamplingParams,
+) -> Option<String> {
+    let handle = submit_generation(ctx, prompt, max_tokens, params)?;
+    handle.bind_app(ctx);
+    let mut result_text = String::new();
+    for event in handle.events.iter() {
+        match event {
+            batch_engine::SequenceEvent::Token(piece) => result_text.push_str(&piece),
+            batch_engine::SequenceEvent::Done { .. } => break,
+            batch_engine::SequenceEvent::Error(e) => {
+                println!("❌ Sequence failed: {}", e);
+                if result_text.is_empty() {
+                    return None;
                 }
-            } else {
-                println!("🔍 Empty token skipped");
-            }
-
-            // Create single token batch
-            let single_token_batch = llama_batch {
-                n_tokens: 1,
-                token: (&sampled_token as *const LlamaToken) as *mut LlamaToken,
-                embd: std::ptr::null_mut(),
-                pos: (&next_pos as *const LlamaPos) as *mut LlamaPos,
-                n_seq_id: std::ptr::null_mut(),
-                seq_id: std::ptr::null_mut(),
-                logits: std::ptr::null_mut(),
-            };
-
-            // Decode token
-            if llama_decode(ctx, single_token_batch) != 0 {
                 break;
             }
-
-            next_pos += 1;
         }
+    }
+    Some(result_text)
+}
 
-        // Cleanup sampler
-        llama_sampler_free(sampler);
+/// Receives generated text in batches: `len` bytes of UTF-8 (not
+/// NUL-terminated, never split inside a character) completing `n_tokens`
+/// tokens. `data` is only valid during the call; return false to stop.
+pub type TokenBatchCallback =
+    extern "C" fn(data: *const c_char, len: c_int, n_tokens: c_int, user_data: *mut c_void) -> bool;
 
-        // Flush any remaining buffered bytes (best-effort)
-        let tail = utf8_buf.flush_lossy();
+/// Streaming generation that hands text to `on_batch` once `batch_bytes`
+/// have accumulated or `batch_ms` passed since the first pending token, so
+/// a bridge crosses into its runtime once per batch instead of per token.
+/// `batch_ms` of 0 flushes on size only. Runs on the calling thread.
+///
+/// Returns the number of generated tokens, or -1 on error.
+///
+/// # Safety
+/// `prompt` must be a valid, NUL-terminated C string pointer.
+#[no_mangle]
+#[cfg(any(target_os = "android", target_os = "ios"))]
+pub extern "C" fn gpuf_start_generation_batched(
+    ctx: *mut llama_context,
+    prompt: *const c_char,
+    max_tokens: c_int,
+    temperature: f32,
+    top_k: c_int,
+    top_p: f32,
+    repeat_penalty: f32,
+    batch_bytes: c_int,
+    batch_ms: c_int,
+    on_batch: Option<TokenBatchCallback>,
+    user_data: *mut c_void,
+) -> c_int {
+    let Some(on_batch) = on_batch else {
+        return -1;
+    };
+    if ctx.is_null() || prompt.is_null() {
+        println!("❌ Invalid context or prompt for batched generation");
+        return -1;
+    }
+    let prompt_str = unsafe { CStr::from_ptr(prompt) }.to_str().unwrap_or("");
 
-        if !tail.is_empty() {
-            if let Some(callback) = on_token_callback {
-                if let Ok(token_cstr) = std::ffi::CString::new(tail.as_str()) {
-                    callback(token_cstr.as_ptr(), user_data);
-                }
-            }
+    let params = batch_engine::SamplingParams {
+        temperature,
+        top_k,
+        top_p,
+        repeat_penalty,
+        draft_tokens: batch_engine::default_draft_tokens(),
+    };
+    let Some(handle) = submit_generation(ctx, prompt_str, max_tokens, params) else {
+        return -1;
+    };
+    handle.bind_app(ctx);
+
+    let result = handle.stream_batches(
+        batch_bytes.max(0) as usize,
+        std::time::Duration::from_millis(batch_ms.max(0) as u64),
+        |text, n_tokens| {
+            on_batch(
+                text.as_ptr() as *const c_char,
+                text.len() as c_int,
+                n_tokens as c_int,
+                user_data,
+            )
+        },
+    );
+    match result {
+        Ok(n) => n as c_int,
+        Err(e) => {
+            println!("❌ Batched generation failed: {}", e);
+            -1
         }
-
-        // Cleanup
-        cleanup_generation_control();
-        println!(
-            "✅ Streaming generation completed (generated {} tokens)",
-            completion_tokens
-        );
-        completion_tokens
     }
 }
 
@@ -4049,6 +4219,8 @@ pub extern "C" fn start_remote_worker(
         local_port: 0,
         p2p_advertise_ip: None,
         p2p_udp_port: 40000,
+        // Mobile devices fetch from peers but do not upload.
+        p2p_seed_port: 0,
         cert_chain_path: "".to_string(),
         auto_models: false,
         hugging_face_hub_token: None,
@@ -4061,6 +4233,7 @@ pub extern "C" fn start_remote_worker(
         llama_main_gpu: 0,
         llama_devices: None,
         stream_chunk_bytes: 256,
+        stream_chunk_interval_ms: 30,
     };
 
 
@@ -4137,6 +4310,181 @@ static BACKEND_INITIALIZED: std::sync::atomic::AtomicBool =
 // Coordination mutex for safe hot swapping
 static MODEL_SWAP_LOCK: std::sync::Mutex<()> = std::sync::Mutex::new(());
 
+/// A model and context installed as the worker's current pair. Tasks lease
+/// it, so a swap can install the next pair while they finish on this one.
+#[cfg(any(target_os = "android", target_os = "ios"))]
+struct ModelGeneration {
+    model: usize,
+    context: usize,
+    /// False for pairs installed outside set_remote_worker_model (e.g. by the
+    /// JNI loaders), which their installer still owns.
+    owned: bool,
+}
+
+#[cfg(any(target_os = "android", target_os = "ios"))]
+impl ModelGeneration {
+    /// Free the pair on a thread of its own. Drop can run wherever the last
+    /// lease ends, possibly under GLOBAL_INFERENCE_MUTEX.
+    fn free_in_background(&mut self) {
+        if !std::mem::take(&mut self.owned) {
+            return;
+        }
+        let (model, context) = (self.model, self.context);
+        let spawned = std::thread::Builder::new()
+            .name("gpuf-model-reaper".to_string())
+            .spawn(move || free_model_pair(model, context));
+        if let Err(e) = spawned {
+            eprintln!("❌ Failed to spawn model reaper, leaking old model: {}", e);
+        }
+    }
+
+    /// Wait for every lease to end, then free the pair on this thread.
+    fn free_when_idle(self: Arc<Self>) {
+        let mut generation = self;
+        loop {
+            match Arc::try_unwrap(generation) {
+                Ok(mut last) => {
+                    if std::mem::take(&mut last.owned) {
+                        free_model_pair(last.model, last.context);
+                    }
+                    return;
+                }
+                Err(shared) => {
+                    generation = shared;
+                    std::thread::sleep(std::time::Duration::from_millis(20));
+                }
+            }
+        }
+    }
+}
+
+#[cfg(any(target_os = "android", target_os = "ios"))]
+impl Drop for ModelGeneration {
+    fn drop(&mut self) {
+        self.free_in_background();
+    }
+}
+
+#[cfg(any(target_os = "android", target_os = "ios"))]
+fn free_model_pair(model: usize, context: usize) {
+    let (model, context) = (model as *mut llama_model, context as *mut llama_context);
+    // Worker tasks and the FFI/JNI entry points decode through the batch
+    // engine while holding a lease (see `submit_generation`), and the last
+    // lease is gone by now, so draining the engine is the only wait.
+    batch_engine::detach(context);
+    unsafe { llama_free(context) };
+    gpuf_release_model(model);
+    println!("✅ Previous model/context freed after their last task");
+}
+
+#[cfg(any(target_os = "android", target_os = "ios"))]
+static CURRENT_GENERATION: Mutex<Option<Arc<ModelGeneration>>> = Mutex::new(None);
+
+/// Keeps the current model and context alive for one task across swaps.
+#[cfg(any(target_os = "android", target_os = "ios"))]
+pub struct ModelLease(Arc<ModelGeneration>);
+
+#[cfg(any(target_os = "android", target_os = "ios"))]
+impl ModelLease {
+    pub fn model(&self) -> *mut llama_model {
+        self.0.model as *mut llama_model
+    }
+
+    pub fn context(&self) -> *mut llama_context {
+        self.0.context as *mut llama_context
+    }
+}
+
+/// Lease the pair new tasks should run on, or None when no model is loaded.
+#[cfg(any(target_os = "android", target_os = "ios"))]
+pub fn lease_current_model() -> Option<ModelLease> {
+    let mut current = CURRENT_GENERATION.lock().unwrap_or_else(|e| e.into_inner());
+    let model = GLOBAL_MODEL_PTR.load(Ordering::SeqCst) as usize;
+    let context = GLOBAL_CONTEXT_PTR.load(Ordering::SeqCst) as usize;
+    if model == 0 || context == 0 {
+        return None;
+    }
+    match current.as_ref() {
+        Some(g) if g.model == model && g.context == context => {}
+        // Installed directly through the globals; not ours to free.
+        _ => {
+            *current = Some(Arc::new(ModelGeneration {
+                model,
+                context,
+                owned: false,
+            }))
+        }
+    }
+    current.clone().map(ModelLease)
+}
+
+/// Clear the globals and hand back the pair they held. Pointers stored by
+/// other loaders are adopted, since the swap used to free them too.
+#[cfg(any(target_os = "android", target_os = "ios"))]
+fn take_current_generation() -> Option<Arc<ModelGeneration>> {
+    let mut current = CURRENT_GENERATION.lock().unwrap_or_else(|e| e.into_inner());
+    let model = GLOBAL_MODEL_PTR.swap(std::ptr::null_mut(), Ordering::SeqCst) as usize;
+    let context = GLOBAL_CONTEXT_PTR.swap(std::ptr::null_mut(), Ordering::SeqCst) as usize;
+    let generation = match current.take() {
+        Some(g) if g.model == model && g.context == context => Some(g),
+        _ if model != 0 && context != 0 => Some(Arc::new(ModelGeneration {
+            model,
+            context,
+            owned: true,
+        })),
+        _ => None,
+    };
+    if let Some(g) = &generation {
+        batch_engine::retire(g.context as *mut llama_context);
+        util::chat_template::reset_prompt_cache();
+    }
+    generation
+}
+
+#[cfg(any(target_os = "android", target_os = "ios"))]
+fn install_generation(model: *mut llama_model, context: *mut llama_context) {
+    let mut current = CURRENT_GENERATION.lock().unwrap_or_else(|e| e.into_inner());
+    GLOBAL_MODEL_PTR.store(model, Ordering::SeqCst);
+    GLOBAL_CONTEXT_PTR.store(context, Ordering::SeqCst);
+    *current = Some(Arc::new(ModelGeneration {
+        model: model as usize,
+        context: context as usize,
+        owned: true,
+    }));
+}
+
+/// Whether the next model can load while the current one stays resident.
+/// `GPUF_HOT_SWAP=1` always double-buffers, `0` never does; by default it
+/// does when available memory covers the new model file with some slack.
+#[cfg(any(target_os = "android", target_os = "ios"))]
+fn hot_swap_has_headroom(new_path: &str) -> bool {
+    match std::env::var("GPUF_HOT_SWAP").as_deref() {
+        Ok("1") => return true,
+        Ok("0") => return false,
+        _ => {}
+    }
+    let current = MODEL_STATUS
+        .lock()
+        .ok()
+        .and_then(|status| status.current_model.clone());
+    // The same file is shared, so only a second context is needed.
+    if GLOBAL_MODEL_PTR.load(Ordering::SeqCst).is_null() || current.as_deref() == Some(new_path) {
+        return true;
+    }
+    let Ok(size) = std::fs::metadata(new_path).map(|m| m.len()) else {
+        return true;
+    };
+    available_memory_bytes().map_or(true, |available| available > size / 4 * 5)
+}
+
+#[cfg(any(target_os = "android", target_os = "ios"))]
+fn available_memory_bytes() -> Option<u64> {
+    let meminfo = std::fs::read_to_string("/proc/meminfo").ok()?;
+    let line = meminfo.lines().find(|l| l.starts_with("MemAvailable:"))?;
+    let kb: u64 = line.split_whitespace().nth(1)?.parse().ok()?;
+    Some(kb * 1024)
+}
+
 /// Initialize backend (thread-safe, idempotent)
 fn ensure_backend_initialized() -> c_int {
     use std::sync::atomic::Ordering;
@@ -4176,8 +4524,10 @@ fn ensure_backend_initialized() -> c_int {
 ///
 /// # Hot Swapping
 /// This function can be called multiple times without stopping the worker.
-/// Inference requests will be briefly paused during the swap but the worker
-/// remains connected and continues processing afterward.
+/// The new model loads while the current one keeps serving; new tasks move
+/// to it once its context is ready and tasks already running finish on the
+/// old one. When memory will not hold both (see `GPUF_HOT_SWAP`), the old
+/// model is unloaded before the new one loads instead.
 #[cfg(any(target_os = "android", target_os = "ios"))]
 #[no_mangle]
 pub extern "C" fn set_remote_worker_model(model_path: *const c_char) -> c_int {
@@ -4208,13 +4558,25 @@ pub extern "C" fn set_remote_worker_model(model_path: *const c_char) -> c_int {
         }
     };
 
+    // One swap at a time; the current model keeps serving while this loads.
+    let _swap_lock = MODEL_SWAP_LOCK.lock().unwrap_or_else(|e| e.into_inner());
+    let double_buffer = hot_swap_has_headroom(path_str);
+
     // 3. Update model status to loading
     {
         let mut status = MODEL_STATUS.lock().unwrap();
         status.set_loading(path_str);
     }
 
-    // 4. Load new model and context
+    // 4. Without room for both models, retire the current one first
+    if !double_buffer {
+        println!("🧹 C API: Not enough memory for two models, unloading the current one first");
+        if let Some(old) = take_current_generation() {
+            old.free_when_idle();
+        }
+    }
+
+    // 5. Load new model and context
     let model_ptr = gpuf_load_model(model_path);
     if model_ptr.is_null() {
         eprintln!("❌ C API: Failed to load model");
@@ -4229,46 +4591,28 @@ pub extern "C" fn set_remote_worker_model(model_path: *const c_char) -> c_int {
         eprintln!("❌ C API: Failed to create context");
         let mut status = MODEL_STATUS.lock().unwrap();
         status.set_error("Failed to create context");
-        unsafe { llama_model_free(model_ptr) }; // Clean up loaded model
+        gpuf_release_model(model_ptr); // Clean up loaded model
         return -4;
     }
     println!("✅ C API: Context created");
 
-    // 5. Atomically swap model/context using inference mutex
-    // This blocks both other swaps AND inference requests briefly
-    println!("🔄 C API: Swapping model (blocking inference briefly)...");
+    // 6. Flip the global pointers. Tasks already running keep their lease on
+    // the old pair, whose batch engine finishes the sequences it has; the old
+    // pair is freed in the background after the last of them.
+    println!("🔄 C API: Swapping model...");
     {
-        let _swap_lock = MODEL_SWAP_LOCK.lock().unwrap();
         let _inference_lock = GLOBAL_INFERENCE_MUTEX.lock().unwrap();
-
-        // Get old model/context for cleanup
-        let old_model = GLOBAL_MODEL_PTR.load(Ordering::SeqCst);
-        let old_context = GLOBAL_CONTEXT_PTR.load(Ordering::SeqCst);
-
-        // Update to new model/context atomically
-        GLOBAL_MODEL_PTR.store(model_ptr, Ordering::SeqCst);
-        GLOBAL_CONTEXT_PTR.store(context_ptr, Ordering::SeqCst);
-
+        let old = take_current_generation();
+        install_generation(model_ptr, context_ptr);
         println!("✅ C API: Global pointers updated");
-
-        // Clean up old resources AFTER updating pointers
-        if !old_model.is_null() || !old_context.is_null() {
-            println!("🧹 C API: Cleaning up previous model/context");
-
-            if !old_context.is_null() {
-                unsafe { llama_free(old_context) };
-                println!("✅ C API: Old context freed");
-            }
-            if !old_model.is_null() {
-                unsafe { llama_model_free(old_model) };
-                println!("✅ C API: Old model freed");
-            }
+        if old.is_some() {
+            println!("🧹 C API: Previous model/context will be freed after their last task");
         }
     }
 
     println!("✅ C API: Model swap completed");
 
-    // 6. Update status to loaded
+    // 7. Update status to loaded
     {
         let mut status = MODEL_STATUS.lock().unwrap();
         status.set_loaded(path_str);
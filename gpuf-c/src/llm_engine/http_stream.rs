@@ -0,0 +1,477 @@
+//! Token streaming from the engines served over HTTP (Ollama, vLLM).
+//!
+//! Both engines stream natively: Ollama answers with one JSON object per
+//! line, vLLM with OpenAI-style server-sent events. `stream_generation` opens
+//! the streaming endpoint on the shared pooled client and yields text pieces
+//! as they arrive, so the worker can forward them through the same phase
+//! splitting and coalescing as the llama engine. Dropping the stream closes
+//! the connection, which both engines treat as an abort of the request.
+
+use super::AnyEngine;
+use crate::util::system_info::engine_http_client;
+use anyhow::{anyhow, Result};
+use futures_util::{Stream, StreamExt};
+use serde_json::{json, Value};
+use std::collections::VecDeque;
+
+/// What the engine is asked to continue.
+pub enum EngineInput {
+    /// Raw text completion; no chat template is applied.
+    Prompt(String),
+    /// Messages rendered with the engine's own chat template.
+    Chat(Vec<common::ChatMessage>),
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct GenerationParams {
+    pub max_tokens: u32,
+    pub temperature: f32,
+    pub top_k: u32,
+    pub top_p: f32,
+    pub repeat_penalty: f32,
+    pub repeat_last_n: i32,
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub enum StreamPiece {
+    /// Text of (usually) one generated token.
+    Token(String),
+    /// Token counts reported by the engine at the end of the stream.
+    Usage {
+        prompt_tokens: u32,
+        completion_tokens: u32,
+    },
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum WireFormat {
+    /// Newline-delimited JSON from `/api/generate` and `/api/chat`.
+    Ollama,
+    /// Server-sent events from `/v1/completions` and `/v1/chat/completions`.
+    OpenAi,
+}
+
+/// Where and how to stream from one HTTP engine.
+#[derive(Debug, Clone)]
+pub struct HttpTarget {
+    pub base_url: String,
+    pub wire: WireFormat,
+    pub model: String,
+}
+
+impl AnyEngine {
+    /// Streaming endpoint of an HTTP engine; None for the in-process llama engine.
+    pub fn http_target(&self) -> Option<Result<HttpTarget>> {
+        let (base_url, wire, models) = match self {
+            AnyEngine::Ollama(engine) => {
+                (&engine.base_url, WireFormat::Ollama, &engine.models_name)
+            }
+            AnyEngine::VLLM(engine) => (&engine.base_url, WireFormat::OpenAi, &engine.models_name),
+            AnyEngine::Llama(_) => return None,
+        };
+        Some(
+            models
+                .first()
+                .map(|model| HttpTarget {
+                    base_url: base_url.clone(),
+                    wire,
+                    model: model.clone(),
+                })
+                .ok_or_else(|| anyhow!("No model configured for the engine")),
+        )
+    }
+}
+
+/// Endpoint path and JSON body of a streaming request.
+fn request(
+    target: &HttpTarget,
+    input: &EngineInput,
+    params: &GenerationParams,
+) -> (&'static str, Value) {
+    match target.wire {
+        WireFormat::Ollama => {
+            let options = json!({
+                "num_predict": params.max_tokens,
+                "temperature": params.temperature,
+                "top_k": params.top_k,
+                "top_p": params.top_p,
+                "repeat_penalty": params.repeat_penalty,
+                "repeat_last_n": params.repeat_last_n,
+            });
+            match input {
+                EngineInput::Prompt(prompt) => (
+                    "/api/generate",
+                    json!({
+                        "model": target.model,
+                        "prompt": prompt,
+                        "raw": true,
+                        "stream": true,
+                        "options": options,
+                    }),
+                ),
+                EngineInput::Chat(messages) => (
+                    "/api/chat",
+                    json!({
+                        "model": target.model,
+                        "messages": chat_messages(messages),
+                        "stream": true,
+                        "options": options,
+                    }),
+                ),
+            }
+        }
+        WireFormat::OpenAi => {
+            let mut body = json!({
+                "model": target.model,
+                "max_tokens": params.max_tokens,
+                "temperature": params.temperature,
+                // vLLM disables top-k with -1; the task protocol uses 0
+                "top_k": if params.top_k == 0 { -1 } else { params.top_k as i64 },
+                "top_p": params.top_p,
+                "repetition_penalty": params.repeat_penalty,
+                "stream": true,
+                "stream_options": { "include_usage": true },
+            });
+            let path = match input {
+                EngineInput::Prompt(prompt) => {
+                    body["prompt"] = json!(prompt);
+                    "/v1/completions"
+                }
+                EngineInput::Chat(messages) => {
+                    body["messages"] = chat_messages(messages);
+                    "/v1/chat/completions"
+                }
+            };
+            (path, body)
+        }
+    }
+}
+
+fn chat_messages(messages: &[common::ChatMessage]) -> Value {
+    Value::Array(
+        messages
+            .iter()
+            .map(|m| json!({ "role": m.role, "content": m.content }))
+            .collect(),
+    )
+}
+
+fn count(value: &Value) -> u32 {
+    value.as_u64().unwrap_or(0).min(u32::MAX as u64) as u32
+}
+
+/// Decode one line of a streaming response into pieces; the flag is set
+/// once the engine has said it is done.
+fn decode_line(wire: WireFormat, line: &str) -> Result<(Vec<StreamPiece>, bool)> {
+    let line = line.trim();
+    let mut pieces = Vec::new();
+    match wire {
+        WireFormat::Ollama => {
+            if line.is_empty() {
+                return Ok((pieces, false));
+            }
+            let event: Value = serde_json::from_str(line)
+                .map_err(|e| anyhow!("Invalid stream line from Ollama: {}", e))?;
+            if let Some(error) = event["error"].as_str() {
+                return Err(anyhow!("Ollama error: {}", error));
+            }
+            let text = event["response"]
+                .as_str()
+                .or_else(|| event["message"]["content"].as_str());
+            if let Some(text) = text.filter(|t| !t.is_empty()) {
+                pieces.push(StreamPiece::Token(text.to_string()));
+            }
+            let done = event["done"].as_bool().unwrap_or(false);
+            if done {
+                pieces.push(StreamPiece::Usage {
+                    prompt_tokens: count(&event["prompt_eval_count"]),
+                    completion_tokens: count(&event["eval_count"]),
+                });
+            }
+            Ok((pieces, done))
+        }
+        WireFormat::OpenAi => {
+            // Blank lines separate events; lines starting with ':' are comments
+            let Some(data) = line.strip_prefix("data:") else {
+                return Ok((pieces, false));
+            };
+            let data = data.trim();
+            if data == "[DONE]" {
+                return Ok((pieces, true));
+            }
+            let event: Value = serde_json::from_str(data)
+                .map_err(|e| anyhow!("Invalid stream event from vLLM: {}", e))?;
+            if let Some(error) = event.get("error") {
+                let message = error["message"].as_str().unwrap_or("unknown error");
+                return Err(anyhow!("vLLM error: {}", message));
+            }
+            let choice = &event["choices"][0];
+            let text = choice["text"]
+                .as_str()
+                .or_else(|| choice["delta"]["content"].as_str());
+            if let Some(text) = text.filter(|t| !t.is_empty()) {
+                pieces.push(StreamPiece::Token(text.to_string()));
+            }
+            let usage = &event["usage"];
+            if usage.is_object() {
+                pieces.push(StreamPiece::Usage {
+                    prompt_tokens: count(&usage["prompt_tokens"]),
+                    completion_tokens: count(&usage["completion_tokens"]),
+                });
+            }
+            Ok((pieces, false))
+        }
+    }
+}
+
+/// Splits a byte stream into lines. Network chunks may end mid-line or
+/// mid-character, so bytes are held until the newline arrives.
+#[derive(Default)]
+struct LineBuffer {
+    buf: Vec<u8>,
+    start: usize,
+}
+
+impl LineBuffer {
+    fn push(&mut self, bytes: &[u8]) {
+        if self.start > 0 {
+            self.buf.drain(..self.start);
+            self.start = 0;
+        }
+        self.buf.extend_from_slice(bytes);
+    }
+
+    fn next_line(&mut self) -> Option<String> {
+        let rest = &self.buf[self.start..];
+        let end = rest.iter().position(|&b| b == b'\n')?;
+        let line = String::from_utf8_lossy(&rest[..end]).into_owned();
+        self.start += end + 1;
+        Some(line)
+    }
+
+    /// Whatever followed the last newline when the body ended.
+    fn finish(&mut self) -> Option<String> {
+        let rest = &self.buf[self.start..];
+        let line = (!rest.is_empty()).then(|| String::from_utf8_lossy(rest).into_owned());
+        self.buf.clear();
+        self.start = 0;
+        line
+    }
+}
+
+struct DecodeState<B> {
+    body: B,
+    lines: LineBuffer,
+    pending: VecDeque<StreamPiece>,
+    done: bool,
+}
+
+/// Start a streaming generation on an HTTP engine.
+pub async fn stream_generation(
+    target: &HttpTarget,
+    input: &EngineInput,
+    params: &GenerationParams,
+) -> Result<impl Stream<Item = Result<StreamPiece>> + Send + 'static> {
+    let (path, body) = request(target, input, params);
+    let response = engine_http_client()
+        .post(format!("{}{}", target.base_url, path))
+        .json(&body)
+        .send()
+        .await
+        .map_err(|e| anyhow!("Failed to reach engine at {}: {}", target.base_url, e))?;
+
+    let status = response.status();
+    if !status.is_success() {
+        let text = response.text().await.unwrap_or_default();
+        return Err(anyhow!("Engine returned {}: {}", status, text));
+    }
+
+    let wire = target.wire;
+    let state = DecodeState {
+        body: Box::pin(response.bytes_stream()),
+        lines: LineBuffer::default(),
+        pending: VecDeque::new(),
+        done: false,
+    };
+    Ok(futures_util::stream::unfold(
+        state,
+        move |mut state| async move {
+            loop {
+                if let Some(piece) = state.pending.pop_front() {
+                    return Some((Ok(piece), state));
+                }
+                if state.done {
+                    return None;
+                }
+                let line = match state.lines.next_line() {
+                    Some(line) => line,
+                    None => match state.body.next().await {
+                        Some(Ok(bytes)) => {
+                            state.lines.push(&bytes);
+                            continue;
+                        }
+                        Some(Err(e)) => {
+                            state.done = true;
+                            return Some((Err(anyhow!("Engine stream failed: {}", e)), state));
+                        }
+                        None => {
+                            state.done = true;
+                            match state.lines.finish() {
+                                Some(line) => line,
+                                None => continue,
+                            }
+                        }
+                    },
+                };
+                match decode_line(wire, &line) {
+                    Ok((pieces, finished)) => {
+                        state.pending.extend(pieces);
+                        state.done |= finished;
+                    }
+                    Err(e) => {
+                        state.done = true;
+                        return Some((Err(e), state));
+                    }
+                }
+            }
+        },
+    ))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn tokens(pieces: &[StreamPiece]) -> Vec<&str> {
+        pieces
+            .iter()
+            .filter_map(|p| match p {
+                StreamPiece::Token(t) => Some(t.as_str()),
+                _ => None,
+            })
+            .collect()
+    }
+
+    #[test]
+    fn decodes_ollama_generate_and_chat_lines() {
+        let (pieces, done) =
+            decode_line(WireFormat::Ollama, r#"{"response":"Hel","done":false}"#).unwrap();
+        assert_eq!(tokens(&pieces), ["Hel"]);
+        assert!(!done);
+
+        let (pieces, done) = decode_line(
+            WireFormat::Ollama,
+            r#"{"message":{"role":"assistant","content":"lo"},"done":false}"#,
+        )
+        .unwrap();
+        assert_eq!(tokens(&pieces), ["lo"]);
+        assert!(!done);
+
+        let (pieces, done) = decode_line(
+            WireFormat::Ollama,
+            r#"{"response":"","done":true,"prompt_eval_count":7,"eval_count":2}"#,
+        )
+        .unwrap();
+        assert!(done);
+        assert_eq!(
+            pieces,
+            [StreamPiece::Usage {
+                prompt_tokens: 7,
+                completion_tokens: 2
+            }]
+        );
+
+        assert!(decode_line(WireFormat::Ollama, r#"{"error":"model not found"}"#).is_err());
+    }
+
+    #[test]
+    fn decodes_openai_events() {
+        let (pieces, _) = decode_line(
+            WireFormat::OpenAi,
+            r#"data: {"choices":[{"index":0,"text":" world"}]}"#,
+        )
+        .unwrap();
+        assert_eq!(tokens(&pieces), [" world"]);
+
+        let (pieces, _) = decode_line(
+            WireFormat::OpenAi,
+            r#"data: {"choices":[{"index":0,"delta":{"content":"hi"}}]}"#,
+        )
+        .unwrap();
+        assert_eq!(tokens(&pieces), ["hi"]);
+
+        let (pieces, done) = decode_line(
+            WireFormat::OpenAi,
+            r#"data: {"choices":[],"usage":{"prompt_tokens":5,"completion_tokens":3}}"#,
+        )
+        .unwrap();
+        assert!(!done);
+        assert_eq!(
+            pieces,
+            [StreamPiece::Usage {
+                prompt_tokens: 5,
+                completion_tokens: 3
+            }]
+        );
+
+        assert_eq!(
+            decode_line(WireFormat::OpenAi, "").unwrap(),
+            (vec![], false)
+        );
+        assert_eq!(
+            decode_line(WireFormat::OpenAi, ": ping").unwrap(),
+            (vec![], false)
+        );
+        assert!(decode_line(WireFormat::OpenAi, "data: [DONE]").unwrap().1);
+    }
+
+    #[test]
+    fn line_buffer_reassembles_split_lines_and_characters() {
+        let mut lines = LineBuffer::default();
+        let text = "α line\nsecond\ntail".as_bytes();
+        lines.push(&text[..1]);
+        assert_eq!(lines.next_line(), None);
+        lines.push(&text[1..9]);
+        assert_eq!(lines.next_line().as_deref(), Some("α line"));
+        assert_eq!(lines.next_line(), None);
+        lines.push(&text[9..]);
+        assert_eq!(lines.next_line().as_deref(), Some("second"));
+        assert_eq!(lines.next_line(), None);
+        assert_eq!(lines.finish().as_deref(), Some("tail"));
+        assert_eq!(lines.finish(), None);
+    }
+
+    #[test]
+    fn builds_streaming_requests() {
+        let params = GenerationParams {
+            max_tokens: 16,
+            temperature: 0.5,
+            top_k: 0,
+            top_p: 0.9,
+            repeat_penalty: 1.1,
+            repeat_last_n: 64,
+        };
+        let ollama = HttpTarget {
+            base_url: "http://localhost:11434".to_string(),
+            wire: WireFormat::Ollama,
+            model: "qwen".to_string(),
+        };
+        let (path, body) = request(&ollama, &EngineInput::Prompt("hi".to_string()), &params);
+        assert_eq!(path, "/api/generate");
+        assert_eq!(body["stream"], true);
+        assert_eq!(body["options"]["num_predict"], 16);
+
+        let vllm = HttpTarget {
+            wire: WireFormat::OpenAi,
+            ..ollama
+        };
+        let chat = EngineInput::Chat(vec![common::ChatMessage {
+            role: "user".to_string(),
+            content: "hi".to_string(),
+        }]);
+        let (path, body) = request(&vllm, &chat, &params);
+        assert_eq!(path, "/v1/chat/completions");
+        assert_eq!(body["top_k"], -1);
+        assert_eq!(body["messages"][0]["role"], "user");
+    }
+}
@@ -758,13 +758,14 @@ impl LlamaEngine {
                 return Err(anyhow!("Android: Model not loaded by SDK"));
             }
 
-            use crate::GLOBAL_CONTEXT_PTR;
-            use crate::GLOBAL_MODEL_PTR;
             use std::ffi::CString;
             use std::os::raw::c_char;
 
-            let model_ptr = GLOBAL_MODEL_PTR.load(std::sync::atomic::Ordering::SeqCst);
-            let context_ptr = GLOBAL_CONTEXT_PTR.load(std::sync::atomic::Ordering::SeqCst);
+            // Held for the call so a model swap cannot free the pair under it
+            let lease = crate::lease_current_model()
+                .ok_or_else(|| anyhow!("Android: Model not loaded by SDK"))?;
+            let model_ptr = lease.model();
+            let context_ptr = lease.context();
 
             // Convert prompt to C string
             let prompt_cstr =
@@ -1,3 +1,4 @@
+pub mod http_stream;
 pub mod inference_service;
 #[cfg(not(target_os = "ios"))]
 pub mod llama_engine;
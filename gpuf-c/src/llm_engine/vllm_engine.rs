@@ -227,7 +227,7 @@ impl VLLMEngine {
 
     async fn wait_until_ready(&self, timeout: Duration) -> Result<()> {
         let start = std::time::Instant::now();
-        let client = reqwest::Client::new();
+        let client = system_info::engine_http_client();
         let endpoint = format!("http://localhost:{}/health", VLLM_DEFAULT_PORT);
 
         info!("Waiting for VLLM to be ready at {}...", endpoint);
@@ -285,7 +285,7 @@ impl VLLMEngine {
     #[allow(dead_code)]
     async fn wait_for_vllm_ready(&self) -> Result<()> {
         info!("Waiting for VLLM to be ready...");
-        let client = reqwest::Client::new();
+        let client = system_info::engine_http_client();
         let health_url = format!("{}/health", self.base_url);
 
         for _ in 0..30 {
@@ -0,0 +1,278 @@
+//! Handle-based generation sessions for the C API.
+//!
+//! A `gpuf_session` owns its `llama_context`, KV cache, batch engine thread
+//! and, through the engine, a sampler chain and position per sequence. Nothing
+//! is shared between sessions except the (read-only) model weights, so several
+//! sessions created on one model decode concurrently without touching the
+//! global context used by the legacy `gpuf_*` entry points.
+
+use crate::batch_engine::{self, BatchEngine, SamplingParams, SequenceEvent};
+use crate::util::device_profile;
+use crate::{
+    apply_context_profile, batch_slots, gpuf_release_model, llama_context,
+    llama_context_default_params, llama_free, llama_model, real_llama_init_from_model,
+    retain_shared_model, TokenBatchCallback,
+};
+use std::ffi::{c_char, c_int, c_void, CStr};
+use std::sync::Arc;
+use std::time::Duration;
+
+/// Context settings for `gpuf_session_create`. Zero fields take the value
+/// from the device profile, as `gpuf_session_default_params` reports it.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+#[allow(non_camel_case_types)]
+pub struct gpuf_session_params {
+    pub n_ctx: u32,
+    pub n_batch: u32,
+    /// Concurrent sequences decoded together within the session.
+    pub n_seq_max: u32,
+    pub n_threads: c_int,
+}
+
+/// Opaque to C callers.
+#[allow(non_camel_case_types)]
+pub struct gpuf_session {
+    model: *mut llama_model,
+    ctx: *mut llama_context,
+    engine: Arc<BatchEngine>,
+    /// Whether the session holds a reference on a shared model.
+    retained: bool,
+}
+
+#[no_mangle]
+pub extern "C" fn gpuf_session_default_params() -> gpuf_session_params {
+    let profile = device_profile::current();
+    gpuf_session_params {
+        n_ctx: profile.n_ctx,
+        n_batch: profile.n_batch,
+        n_seq_max: batch_slots(),
+        n_threads: profile.n_threads as c_int,
+    }
+}
+
+/// Create a session with its own context on `model`. `params` may be null
+/// for the defaults. Models loaded with `gpuf_load_model` stay alive until
+/// the last session on them is freed, so the caller may release its own
+/// reference early.
+///
+/// Returns null on failure.
+///
+/// # Safety
+/// `model` must be a valid model pointer and `params`, if not null, must
+/// point to a `gpuf_session_params`.
+#[no_mangle]
+pub extern "C" fn gpuf_session_create(
+    model: *mut llama_model,
+    params: *const gpuf_session_params,
+) -> *mut gpuf_session {
+    if model.is_null() {
+        return std::ptr::null_mut();
+    }
+    let mut ctx_params = unsafe { llama_context_default_params() };
+    apply_context_profile(&mut ctx_params, &device_profile::current());
+    ctx_params.n_seq_max = batch_slots();
+    if !params.is_null() {
+        let requested = unsafe { *params };
+        if requested.n_ctx > 0 {
+            ctx_params.n_ctx = requested.n_ctx;
+        }
+        if requested.n_batch > 0 {
+            ctx_params.n_batch = requested.n_batch;
+            ctx_params.n_ubatch = requested.n_batch;
+        }
+        if requested.n_seq_max > 0 {
+            ctx_params.n_seq_max = requested.n_seq_max;
+        }
+        if requested.n_threads > 0 {
+            ctx_params.n_threads = requested.n_threads;
+            ctx_params.n_threads_batch = requested.n_threads;
+        }
+    }
+    ctx_params.embeddings = false;
+    ctx_params.offload_kqv = false;
+    ctx_params.kv_unified = true;
+
+    let ctx = real_llama_init_from_model(model, ctx_params);
+    if ctx.is_null() {
+        println!("❌ Failed to create session context");
+        return std::ptr::null_mut();
+    }
+
+    let retained = retain_shared_model(model);
+    let engine = BatchEngine::start(ctx);
+    println!(
+        "✅ Session created: ctx={:p}, n_ctx={}, slots={}",
+        ctx,
+        ctx_params.n_ctx,
+        engine.n_slots()
+    );
+    Box::into_raw(Box::new(gpuf_session {
+        model,
+        ctx,
+        engine,
+        retained,
+    }))
+}
+
+fn submit(
+    session: *mut gpuf_session,
+    prompt: *const c_char,
+    max_tokens: c_int,
+    params: SamplingParams,
+) -> Option<batch_engine::SequenceHandle> {
+    if session.is_null() || prompt.is_null() {
+        println!("❌ Invalid session or prompt");
+        return None;
+    }
+    let session = unsafe { &*session };
+    let prompt = unsafe { CStr::from_ptr(prompt) }.to_str().unwrap_or("");
+    match session.engine.submit(prompt, max_tokens, params) {
+        Ok(h) => Some(h),
+        Err(e) => {
+            println!("❌ Failed to submit session sequence: {}", e);
+            None
+        }
+    }
+}
+
+fn sampling(temperature: f32, top_k: c_int, top_p: f32, repeat_penalty: f32) -> SamplingParams {
+    SamplingParams {
+        temperature,
+        top_k,
+        top_p,
+        repeat_penalty,
+        draft_tokens: batch_engine::default_draft_tokens(),
+    }
+}
+
+/// Generate a completion into `output` (NUL-terminated, truncated to
+/// `output_len`). Safe to call from several threads on one session; their
+/// sequences are batched together.
+///
+/// Returns the number of bytes written, or -1 on error.
+///
+/// # Safety
+/// `session` must come from `gpuf_session_create`, `prompt` must be a valid
+/// NUL-terminated string and `output` must have room for `output_len` bytes.
+#[no_mangle]
+pub extern "C" fn gpuf_session_generate(
+    session: *mut gpuf_session,
+    prompt: *const c_char,
+    max_tokens: c_int,
+    temperature: f32,
+    top_k: c_int,
+    top_p: f32,
+    repeat_penalty: f32,
+    output: *mut c_char,
+    output_len: c_int,
+) -> c_int {
+    if output.is_null() || output_len <= 0 {
+        return -1;
+    }
+    let params = sampling(temperature, top_k, top_p, repeat_penalty);
+    let Some(handle) = submit(session, prompt, max_tokens, params) else {
+        return -1;
+    };
+
+    let mut text = String::new();
+    for event in handle.events.iter() {
+        match event {
+            SequenceEvent::Token(piece) => text.push_str(&piece),
+            SequenceEvent::Done { .. } => break,
+            SequenceEvent::Error(e) => {
+                println!("❌ Session generation failed: {}", e);
+                return -1;
+            }
+        }
+    }
+
+    let bytes = text.as_bytes();
+    let mut copy_len = bytes.len().min(output_len as usize - 1);
+    while !text.is_char_boundary(copy_len) {
+        copy_len -= 1;
+    }
+    unsafe {
+        std::ptr::copy_nonoverlapping(bytes.as_ptr(), output as *mut u8, copy_len);
+        *output.add(copy_len) = 0;
+    }
+    copy_len as c_int
+}
+
+/// Streaming variant of `gpuf_session_generate` that hands text to
+/// `on_batch` the way `gpuf_start_generation_batched` does.
+///
+/// Returns the number of generated tokens, or -1 on error.
+///
+/// # Safety
+/// As for `gpuf_session_generate`.
+#[no_mangle]
+pub extern "C" fn gpuf_session_generate_batched(
+    session: *mut gpuf_session,
+    prompt: *const c_char,
+    max_tokens: c_int,
+    temperature: f32,
+    top_k: c_int,
+    top_p: f32,
+    repeat_penalty: f32,
+    batch_bytes: c_int,
+    batch_ms: c_int,
+    on_batch: Option<TokenBatchCallback>,
+    user_data: *mut c_void,
+) -> c_int {
+    let Some(on_batch) = on_batch else {
+        return -1;
+    };
+    let params = sampling(temperature, top_k, top_p, repeat_penalty);
+    let Some(handle) = submit(session, prompt, max_tokens, params) else {
+        return -1;
+    };
+
+    let result = handle.stream_batches(
+        batch_bytes.max(0) as usize,
+        Duration::from_millis(batch_ms.max(0) as u64),
+        |text, n_tokens| {
+            on_batch(
+                text.as_ptr() as *const c_char,
+                text.len() as c_int,
+                n_tokens as c_int,
+                user_data,
+            )
+        },
+    );
+    match result {
+        Ok(n) => n as c_int,
+        Err(e) => {
+            println!("❌ Session batched generation failed: {}", e);
+            -1
+        }
+    }
+}
+
+/// Cancel every sequence running on `session`; other sessions are unaffected.
+#[no_mangle]
+pub extern "C" fn gpuf_session_cancel(session: *mut gpuf_session) {
+    if session.is_null() {
+        return;
+    }
+    unsafe { &*session }.engine.cancel_sequences();
+}
+
+/// Stop the session's engine and free its context. Generation calls still
+/// running on the session return an error.
+///
+/// # Safety
+/// `session` must come from `gpuf_session_create` and not be used afterwards.
+#[no_mangle]
+pub extern "C" fn gpuf_session_free(session: *mut gpuf_session) {
+    if session.is_null() {
+        return;
+    }
+    let session = unsafe { Box::from_raw(session) };
+    session.engine.shutdown();
+    unsafe { llama_free(session.ctx) };
+    if session.retained {
+        gpuf_release_model(session.model);
+    }
+    println!("✅ Session freed: ctx={:p}", session.ctx);
+}
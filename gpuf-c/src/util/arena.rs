@@ -0,0 +1,224 @@
+//! Per-request bump arena for the Rust-side scratch of the generation loop.
+//!
+//! Streaming a completion used to allocate several short-lived `String`s per
+//! token (marker scanning, phase splitting, carry buffers) plus a token buffer
+//! per prompt, which on low-end phones shows up as allocator jank. A request
+//! now leases an `Arena`, carves that scratch out of it with a pointer bump,
+//! and hands it back when done. Resetting only rewinds the offset, so the
+//! memory is reused by the next request without touching the allocator.
+
+use std::alloc::{alloc, dealloc, handle_alloc_error, Layout};
+use std::cell::{Cell, UnsafeCell};
+use std::ops::Deref;
+use std::ptr::NonNull;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Mutex;
+
+const CHUNK_ALIGN: usize = 16;
+const DEFAULT_CHUNK_BYTES: usize = 64 * 1024;
+/// Idle arenas kept for reuse; more concurrent requests allocate fresh ones.
+const MAX_POOLED_ARENAS: usize = 4;
+
+static POOL: Mutex<Vec<Arena>> = Mutex::new(Vec::new());
+/// Largest number of bytes any request used, across all arenas.
+static HIGH_WATER: AtomicUsize = AtomicUsize::new(0);
+
+struct Chunk {
+    ptr: NonNull<u8>,
+    size: usize,
+}
+
+// The chunk owns its allocation exclusively.
+unsafe impl Send for Chunk {}
+
+impl Chunk {
+    fn new(size: usize) -> Self {
+        let layout = Layout::from_size_align(size, CHUNK_ALIGN).expect("arena chunk layout");
+        let ptr = unsafe { alloc(layout) };
+        match NonNull::new(ptr) {
+            Some(ptr) => Self { ptr, size },
+            None => handle_alloc_error(layout),
+        }
+    }
+}
+
+impl Drop for Chunk {
+    fn drop(&mut self) {
+        let layout = Layout::from_size_align(self.size, CHUNK_ALIGN).expect("arena chunk layout");
+        unsafe { dealloc(self.ptr.as_ptr(), layout) };
+    }
+}
+
+/// Bump allocator whose allocations live until the next `reset`.
+///
+/// Allocation takes `&self` and returns borrows of the arena, so `reset`
+/// (which needs `&mut self`) cannot run while any of them is alive.
+pub struct Arena {
+    chunks: UnsafeCell<Vec<Chunk>>,
+    /// Bytes taken from the last chunk.
+    offset: Cell<usize>,
+    /// Bytes taken since the last reset, across chunks.
+    used: Cell<usize>,
+    high_water: Cell<usize>,
+}
+
+impl Arena {
+    pub fn with_capacity(bytes: usize) -> Self {
+        Self {
+            chunks: UnsafeCell::new(vec![Chunk::new(bytes.max(CHUNK_ALIGN))]),
+            offset: Cell::new(0),
+            used: Cell::new(0),
+            high_water: Cell::new(0),
+        }
+    }
+
+    fn alloc_raw(&self, size: usize, align: usize) -> NonNull<u8> {
+        debug_assert!(align.is_power_of_two() && align <= CHUNK_ALIGN);
+        // Safety: the arena is not Sync and no method hands out a reference
+        // to the chunk list, only to chunk memory, which this never moves.
+        let chunks = unsafe { &mut *self.chunks.get() };
+        let last = chunks.last().expect("arena has a chunk");
+        let start = (self.offset.get() + align - 1) & !(align - 1);
+        if start + size <= last.size {
+            self.used
+                .set(self.used.get() + start + size - self.offset.get());
+            self.offset.set(start + size);
+            return unsafe { NonNull::new_unchecked(last.ptr.as_ptr().add(start)) };
+        }
+
+        let chunk = Chunk::new((last.size * 2).max(size));
+        let ptr = chunk.ptr;
+        chunks.push(chunk);
+        self.used.set(self.used.get() + size);
+        self.offset.set(size);
+        ptr
+    }
+
+    pub fn alloc_str(&self, s: &str) -> &str {
+        self.concat(&[s])
+    }
+
+    /// Copy `parts` into one contiguous string.
+    pub fn concat(&self, parts: &[&str]) -> &str {
+        let len = parts.iter().map(|p| p.len()).sum();
+        if len == 0 {
+            return "";
+        }
+        let ptr = self.alloc_raw(len, 1).as_ptr();
+        let mut at = 0;
+        for p in parts {
+            unsafe { std::ptr::copy_nonoverlapping(p.as_ptr(), ptr.add(at), p.len()) };
+            at += p.len();
+        }
+        unsafe { std::str::from_utf8_unchecked(std::slice::from_raw_parts(ptr, len)) }
+    }
+
+    /// A slice of `len` copies of `value`.
+    #[allow(clippy::mut_from_ref)]
+    pub fn alloc_slice<T: Copy>(&self, len: usize, value: T) -> &mut [T] {
+        let size = std::mem::size_of::<T>() * len;
+        if size == 0 {
+            return &mut [];
+        }
+        let ptr = self.alloc_raw(size, std::mem::align_of::<T>()).as_ptr() as *mut T;
+        for i in 0..len {
+            unsafe { ptr.add(i).write(value) };
+        }
+        unsafe { std::slice::from_raw_parts_mut(ptr, len) }
+    }
+
+    /// Bytes handed out since the last reset.
+    pub fn used(&self) -> usize {
+        self.used.get()
+    }
+
+    /// Most bytes this arena has held between two resets.
+    pub fn high_water(&self) -> usize {
+        self.high_water.get().max(self.used.get())
+    }
+
+    /// Release every allocation. O(1) unless the request outgrew the first
+    /// chunk, in which case the chunks are merged into one that fits it.
+    pub fn reset(&mut self) {
+        let used = self.used.get();
+        self.high_water.set(self.high_water.get().max(used));
+        HIGH_WATER.fetch_max(used, Ordering::Relaxed);
+
+        let chunks = self.chunks.get_mut();
+        if chunks.len() > 1 {
+            let total = chunks.iter().map(|c| c.size).sum();
+            chunks.clear();
+            chunks.push(Chunk::new(total));
+        }
+        self.offset.set(0);
+        self.used.set(0);
+    }
+}
+
+/// An arena borrowed from the pool for one request; dropping it resets the
+/// arena and returns it.
+pub struct ArenaLease(Option<Arena>);
+
+impl Deref for ArenaLease {
+    type Target = Arena;
+
+    fn deref(&self) -> &Arena {
+        self.0.as_ref().expect("arena lease is live")
+    }
+}
+
+impl Drop for ArenaLease {
+    fn drop(&mut self) {
+        let Some(mut arena) = self.0.take() else {
+            return;
+        };
+        arena.reset();
+        let mut pool = POOL.lock().unwrap_or_else(|e| e.into_inner());
+        if pool.len() < MAX_POOLED_ARENAS {
+            pool.push(arena);
+        }
+    }
+}
+
+/// Take an idle arena from the pool, or a fresh one if all are in use.
+pub fn lease() -> ArenaLease {
+    let pooled = POOL.lock().unwrap_or_else(|e| e.into_inner()).pop();
+    ArenaLease(Some(
+        pooled.unwrap_or_else(|| Arena::with_capacity(DEFAULT_CHUNK_BYTES)),
+    ))
+}
+
+/// Largest number of arena bytes a finished request used.
+pub fn high_water_mark() -> usize {
+    HIGH_WATER.load(Ordering::Relaxed)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_arena_grows_and_resets_into_one_chunk() {
+        let mut arena = Arena::with_capacity(32);
+        let a = arena.concat(&["carry", "+token"]);
+        let tokens = arena.alloc_slice(16, 7i32);
+        assert_eq!(tokens.as_ptr() as usize % std::mem::align_of::<i32>(), 0);
+        let b = arena.alloc_str("spills into a second chunk");
+        assert_eq!(a, "carry+token");
+        assert_eq!(b, "spills into a second chunk");
+        assert!(tokens.iter().all(|&t| t == 7));
+
+        let used = arena.used();
+        arena.reset();
+        assert_eq!(arena.used(), 0);
+        assert_eq!(arena.high_water(), used);
+        assert_eq!(arena.chunks.get_mut().len(), 1);
+        assert!(high_water_mark() >= used);
+
+        // The merged chunk now fits the same request without growing.
+        arena.concat(&["carry", "+token"]);
+        arena.alloc_slice(16, 7i32);
+        arena.alloc_str("spills into a second chunk");
+        assert_eq!(arena.chunks.get_mut().len(), 1);
+    }
+}
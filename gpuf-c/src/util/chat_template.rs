@@ -0,0 +1,780 @@
+//! Chat prompt rendering and per-turn tokenization.
+//!
+//! Every chat request carries the whole conversation, and the prompt used to
+//! be rebuilt with `format!` and tokenized from scratch each turn. The
+//! worker now renders with the model's own GGUF `tokenizer.chat_template`,
+//! or with one of the `FallbackTemplate` formats when the model has none,
+//! and `PromptCache` keeps the tokens of every rendered message. A follow-up
+//! turn reuses the tokens of the unchanged leading messages (system prompt,
+//! history) and only tokenizes what is new, which lines the token sequence
+//! up with the batch engine's KV prefix reuse.
+//!
+//! Message boundaries are found by rendering growing prefixes of the
+//! conversation. Templates end every turn with a special token or a
+//! newline, which tokenizers do not merge across, so tokenizing message by
+//! message matches tokenizing the whole prompt. A template whose prefix
+//! renders do not line up with the full prompt is tokenized in one piece.
+
+use std::collections::hash_map::DefaultHasher;
+use std::hash::{Hash, Hasher};
+
+pub type Token = i32;
+
+/// Conversations kept by `PromptCache`; a worker serves few at a time.
+pub const DEFAULT_CONVERSATIONS: usize = 8;
+
+/// A chat message as seen by the renderers.
+pub trait ChatTurn {
+    fn role(&self) -> &str;
+    fn content(&self) -> &str;
+}
+
+impl ChatTurn for common::ChatMessage {
+    fn role(&self) -> &str {
+        &self.role
+    }
+
+    fn content(&self) -> &str {
+        &self.content
+    }
+}
+
+/// Hard-coded formats for models without a chat template, selected with the
+/// `CHAT_TEMPLATE` environment variable.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum FallbackTemplate {
+    /// ChatML (Qwen, GPT-4, etc.)
+    ChatMl,
+    /// Llama 3 header format
+    Llama3,
+    /// Alpaca/Vicuna (broad compatibility)
+    Alpaca,
+    /// Role-prefixed lines; works with almost any model
+    Simple,
+}
+
+impl FallbackTemplate {
+    pub fn from_name(name: &str) -> Option<Self> {
+        match name.to_ascii_lowercase().as_str() {
+            "chatml" => Some(Self::ChatMl),
+            "llama3" => Some(Self::Llama3),
+            "alpaca" => Some(Self::Alpaca),
+            "simple" => Some(Self::Simple),
+            _ => None,
+        }
+    }
+
+    /// `CHAT_TEMPLATE` if it names a known format, else `default`.
+    pub fn from_env_or(default: Self) -> Self {
+        std::env::var("CHAT_TEMPLATE")
+            .ok()
+            .and_then(|name| Self::from_name(&name))
+            .unwrap_or(default)
+    }
+
+    pub fn render<M: ChatTurn>(self, messages: &[M]) -> String {
+        let mut out = String::new();
+        self.render_into(messages, true, &mut out);
+        out
+    }
+
+    /// Render into `out`, which is cleared and grown once to the final size.
+    pub fn render_into<M: ChatTurn>(self, messages: &[M], add_ass: bool, out: &mut String) {
+        out.clear();
+        let text: usize = messages
+            .iter()
+            .map(|m| m.role().len() + m.content().len())
+            .sum();
+        out.reserve(text + (messages.len() + 1) * self.overhead());
+
+        if self == Self::Llama3 {
+            out.push_str("<|begin_of_text|>");
+        }
+        for m in messages {
+            self.push_message(m.role(), m.content(), out);
+        }
+        if add_ass {
+            self.push_assistant_prefix(out);
+        }
+    }
+
+    /// Upper bound of the markup added per message.
+    fn overhead(self) -> usize {
+        match self {
+            Self::ChatMl => 24,
+            Self::Llama3 => 48,
+            Self::Alpaca => 20,
+            Self::Simple => 14,
+        }
+    }
+
+    fn push_message(self, role: &str, content: &str, out: &mut String) {
+        match self {
+            Self::ChatMl => {
+                out.push_str("<|im_start|>");
+                out.push_str(role);
+                out.push('\n');
+                out.push_str(content);
+                out.push_str("<|im_end|>\n");
+            }
+            Self::Llama3 => {
+                out.push_str("<|start_header_id|>");
+                out.push_str(role);
+                out.push_str("<|end_header_id|>\n\n");
+                out.push_str(content);
+                out.push_str("<|eot_id|>");
+            }
+            Self::Alpaca => {
+                match role {
+                    "system" => out.push_str("### Instruction:\n"),
+                    "user" => out.push_str("### Input:\n"),
+                    "assistant" => out.push_str("### Response:\n"),
+                    _ => {
+                        out.push_str("### ");
+                        out.push_str(role);
+                        out.push_str(":\n");
+                    }
+                }
+                out.push_str(content);
+                out.push_str("\n\n");
+            }
+            Self::Simple => {
+                out.push_str(match role {
+                    "user" => "Human",
+                    "assistant" => "Assistant",
+                    "system" => "System",
+                    other => other,
+                });
+                out.push_str(": ");
+                out.push_str(content);
+                out.push_str("\n\n");
+            }
+        }
+    }
+
+    fn push_assistant_prefix(self, out: &mut String) {
+        out.push_str(match self {
+            Self::ChatMl => "<|im_start|>assistant\n",
+            Self::Llama3 => "<|start_header_id|>assistant<|end_header_id|>\n\n",
+            Self::Alpaca => "### Response:\n",
+            Self::Simple => "Assistant:",
+        });
+    }
+}
+
+/// Renders a bound conversation, or a leading part of it.
+pub trait ChatRenderer {
+    /// Prompt for the first `n_msg` messages; `add_ass` appends the opener
+    /// of the assistant's reply.
+    fn render(&mut self, n_msg: usize, add_ass: bool) -> Option<&str>;
+}
+
+/// `ChatRenderer` over a `FallbackTemplate`, reusing one output buffer.
+pub struct FallbackRenderer<'a, M> {
+    template: FallbackTemplate,
+    messages: &'a [M],
+    buf: String,
+}
+
+impl<'a, M: ChatTurn> FallbackRenderer<'a, M> {
+    pub fn new(template: FallbackTemplate, messages: &'a [M]) -> Self {
+        Self {
+            template,
+            messages,
+            buf: String::new(),
+        }
+    }
+}
+
+impl<M: ChatTurn> ChatRenderer for FallbackRenderer<'_, M> {
+    fn render(&mut self, n_msg: usize, add_ass: bool) -> Option<&str> {
+        let messages = self.messages.get(..n_msg)?;
+        self.template.render_into(messages, add_ass, &mut self.buf);
+        Some(&self.buf)
+    }
+}
+
+/// A rendered prompt and its tokens.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct ChatPrompt {
+    pub text: String,
+    pub tokens: Vec<Token>,
+    /// Leading tokens taken from the cache rather than tokenized.
+    pub reused_tokens: usize,
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct PromptCacheStats {
+    pub conversations: usize,
+    pub reused_tokens: u64,
+    pub tokenized_tokens: u64,
+}
+
+/// Rendered text and tokens of one conversation, split at message ends.
+struct Conversation {
+    hashes: Vec<u64>,
+    /// Byte length of `text` through message i.
+    text_ends: Vec<usize>,
+    /// Token count through message i.
+    token_ends: Vec<usize>,
+    text: String,
+    tokens: Vec<Token>,
+    last_used: u64,
+}
+
+impl Conversation {
+    fn text_end(&self, k: usize) -> usize {
+        if k == 0 {
+            0
+        } else {
+            self.text_ends[k - 1]
+        }
+    }
+
+    fn token_end(&self, k: usize) -> usize {
+        if k == 0 {
+            0
+        } else {
+            self.token_ends[k - 1]
+        }
+    }
+}
+
+fn message_hash<M: ChatTurn>(message: &M) -> u64 {
+    let mut hasher = DefaultHasher::new();
+    message.role().hash(&mut hasher);
+    message.content().hash(&mut hasher);
+    hasher.finish()
+}
+
+/// Token sequences of recent conversations, reused message by message.
+///
+/// Entries are only valid for the tokenizer and template they were built
+/// with; the owner clears the cache when either changes.
+pub struct PromptCache {
+    capacity: usize,
+    tick: u64,
+    conversations: Vec<Conversation>,
+    reused_tokens: u64,
+    tokenized_tokens: u64,
+}
+
+impl Default for PromptCache {
+    fn default() -> Self {
+        Self::new(DEFAULT_CONVERSATIONS)
+    }
+}
+
+impl PromptCache {
+    pub fn new(capacity: usize) -> Self {
+        Self {
+            capacity,
+            tick: 0,
+            conversations: Vec::new(),
+            reused_tokens: 0,
+            tokenized_tokens: 0,
+        }
+    }
+
+    pub fn clear(&mut self) {
+        self.conversations.clear();
+    }
+
+    pub fn stats(&self) -> PromptCacheStats {
+        PromptCacheStats {
+            conversations: self.conversations.len(),
+            reused_tokens: self.reused_tokens,
+            tokenized_tokens: self.tokenized_tokens,
+        }
+    }
+
+    /// Render and tokenize `messages`, reusing the tokens of the longest
+    /// cached run of identical leading messages.
+    ///
+    /// `renderer` must be bound to `messages`. `tokenize(text, add_special)`
+    /// is asked for BOS only on the segment that starts the prompt.
+    pub fn prepare<M, R, T>(
+        &mut self,
+        messages: &[M],
+        renderer: &mut R,
+        mut tokenize: T,
+    ) -> Result<ChatPrompt, String>
+    where
+        M: ChatTurn,
+        R: ChatRenderer,
+        T: FnMut(&str, bool) -> Result<Vec<Token>, String>,
+    {
+        let n = messages.len();
+        let full = renderer
+            .render(n, true)
+            .ok_or_else(|| "failed to render chat template".to_string())?
+            .to_string();
+        let hashes: Vec<u64> = messages.iter().map(message_hash).collect();
+
+        // Longest cached prefix whose rendering is still a prefix of `full`
+        let mut best: Option<(usize, usize)> = None;
+        for (idx, conv) in self.conversations.iter().enumerate() {
+            let mut k = conv
+                .hashes
+                .iter()
+                .zip(&hashes)
+                .take_while(|(a, b)| a == b)
+                .count();
+            while k > 0
+                && !full
+                    .as_bytes()
+                    .starts_with(&conv.text.as_bytes()[..conv.text_end(k)])
+            {
+                k -= 1;
+            }
+            if k > 0 && best.map_or(true, |(_, best_k)| k > best_k) {
+                best = Some((idx, k));
+            }
+        }
+
+        let mut text_ends = Vec::with_capacity(n);
+        let mut token_ends = Vec::with_capacity(n);
+        let mut tokens = Vec::new();
+        let mut pos = 0;
+        if let Some((idx, k)) = best {
+            let conv = &self.conversations[idx];
+            text_ends.extend_from_slice(&conv.text_ends[..k]);
+            token_ends.extend_from_slice(&conv.token_ends[..k]);
+            tokens.reserve(conv.token_end(k) + (full.len() - conv.text_end(k)) / 2);
+            tokens.extend_from_slice(&conv.tokens[..conv.token_end(k)]);
+            pos = conv.text_end(k);
+        }
+        let reused_tokens = tokens.len();
+
+        for i in text_ends.len()..n {
+            let end = match renderer.render(i + 1, false) {
+                Some(prefix) if prefix.len() >= pos && full.starts_with(prefix) => prefix.len(),
+                _ => break,
+            };
+            if end > pos {
+                tokens.extend(tokenize(&full[pos..end], pos == 0)?);
+            }
+            pos = end;
+            text_ends.push(end);
+            token_ends.push(tokens.len());
+        }
+        let cached_tokens = tokens.len();
+        if pos < full.len() {
+            tokens.extend(tokenize(&full[pos..], pos == 0)?);
+        }
+        if tokens.is_empty() {
+            return Err("empty prompt".to_string());
+        }
+
+        self.reused_tokens += reused_tokens as u64;
+        self.tokenized_tokens += (tokens.len() - reused_tokens) as u64;
+        if !text_ends.is_empty() {
+            self.tick += 1;
+            let conv = Conversation {
+                hashes: hashes[..text_ends.len()].to_vec(),
+                text_ends,
+                token_ends,
+                text: full[..pos].to_string(),
+                tokens: tokens[..cached_tokens].to_vec(),
+                last_used: self.tick,
+            };
+            self.store(best.map(|(idx, _)| idx), conv);
+        }
+
+        Ok(ChatPrompt {
+            text: full,
+            tokens,
+            reused_tokens,
+        })
+    }
+
+    /// Replace the conversation that was extended, or add a new one and
+    /// evict the least recently used beyond capacity.
+    fn store(&mut self, extended: Option<usize>, conv: Conversation) {
+        if let Some(idx) = extended {
+            self.conversations[idx] = conv;
+            return;
+        }
+        if self.capacity == 0 {
+            return;
+        }
+        if self.conversations.len() >= self.capacity {
+            if let Some(oldest) = self
+                .conversations
+                .iter()
+                .enumerate()
+                .min_by_key(|(_, c)| c.last_used)
+                .map(|(idx, _)| idx)
+            {
+                self.conversations.swap_remove(oldest);
+            }
+        }
+        self.conversations.push(conv);
+    }
+}
+
+#[cfg(any(target_os = "android", target_os = "ios"))]
+mod model {
+    use super::*;
+    use crate::{
+        llama_chat_apply_template, llama_chat_message, llama_model, llama_model_get_vocab,
+        llama_model_meta_val_str, llama_tokenize, llama_vocab, llama_vocab_n_tokens,
+    };
+    use std::ffi::{c_char, c_int, CStr, CString};
+    use std::sync::Mutex;
+
+    /// Token cache of the currently loaded model.
+    struct ModelPrompts {
+        model: usize,
+        n_vocab: i32,
+        template: Option<CString>,
+        cache: PromptCache,
+    }
+
+    static MODEL_PROMPTS: Mutex<Option<ModelPrompts>> = Mutex::new(None);
+
+    /// Forget cached prompts, e.g. after the model was replaced.
+    pub fn reset_prompt_cache() {
+        *MODEL_PROMPTS.lock().unwrap_or_else(|e| e.into_inner()) = None;
+    }
+
+    unsafe fn model_chat_template(model: *const llama_model) -> Option<CString> {
+        let key = CString::new("tokenizer.chat_template").ok()?;
+        let mut buf = vec![0u8; 8192];
+        let needed = llama_model_meta_val_str(
+            model,
+            key.as_ptr(),
+            buf.as_mut_ptr() as *mut c_char,
+            buf.len(),
+        );
+        if needed <= 0 {
+            return None;
+        }
+        if needed as usize >= buf.len() {
+            buf = vec![0u8; needed as usize + 1];
+            llama_model_meta_val_str(
+                model,
+                key.as_ptr(),
+                buf.as_mut_ptr() as *mut c_char,
+                buf.len(),
+            );
+        }
+        CStr::from_bytes_until_nul(&buf).ok().map(CStr::to_owned)
+    }
+
+    /// The model's GGUF template applied with `llama_chat_apply_template`.
+    struct ModelRenderer<'a> {
+        template: &'a CStr,
+        chat: Vec<llama_chat_message>,
+        // Owners of the pointers in `chat`
+        _strings: Vec<CString>,
+        buf: Vec<u8>,
+    }
+
+    impl<'a> ModelRenderer<'a> {
+        fn new<M: ChatTurn>(template: &'a CStr, messages: &[M]) -> Option<Self> {
+            let mut strings = Vec::with_capacity(messages.len() * 2);
+            let mut chat = Vec::with_capacity(messages.len());
+            let mut text = 0;
+            for m in messages {
+                let role = CString::new(m.role()).ok()?;
+                let content = CString::new(m.content()).ok()?;
+                text += m.role().len() + m.content().len();
+                chat.push(llama_chat_message {
+                    role: role.as_ptr(),
+                    content: content.as_ptr(),
+                });
+                strings.push(role);
+                strings.push(content);
+            }
+            Some(Self {
+                template,
+                chat,
+                _strings: strings,
+                buf: vec![0u8; text + 64 * (messages.len() + 1)],
+            })
+        }
+
+        fn apply(&mut self, n_msg: usize, add_ass: bool) -> c_int {
+            unsafe {
+                llama_chat_apply_template(
+                    self.template.as_ptr(),
+                    self.chat.as_ptr(),
+                    n_msg,
+                    add_ass,
+                    self.buf.as_mut_ptr() as *mut c_char,
+                    self.buf.len() as c_int,
+                )
+            }
+        }
+    }
+
+    impl ChatRenderer for ModelRenderer<'_> {
+        fn render(&mut self, n_msg: usize, add_ass: bool) -> Option<&str> {
+            if n_msg > self.chat.len() {
+                return None;
+            }
+            let mut n = self.apply(n_msg, add_ass);
+            if n > 0 && n as usize > self.buf.len() {
+                self.buf.resize(n as usize, 0);
+                n = self.apply(n_msg, add_ass);
+            }
+            if n < 0 || n as usize > self.buf.len() {
+                return None;
+            }
+            std::str::from_utf8(&self.buf[..n as usize]).ok()
+        }
+    }
+
+    unsafe fn tokenize(
+        vocab: *const llama_vocab,
+        text: &str,
+        add_special: bool,
+    ) -> Result<Vec<Token>, String> {
+        let ptr = text.as_ptr() as *const c_char;
+        let len = text.len() as c_int;
+        let mut tokens: Vec<Token> = vec![0; text.len() + 2];
+        let mut n = llama_tokenize(
+            vocab,
+            ptr,
+            len,
+            tokens.as_mut_ptr(),
+            tokens.len() as c_int,
+            add_special,
+            true,
+        );
+        if n < 0 {
+            tokens = vec![0; (-n) as usize];
+            n = llama_tokenize(
+                vocab,
+                ptr,
+                len,
+                tokens.as_mut_ptr(),
+                tokens.len() as c_int,
+                add_special,
+                true,
+            );
+        }
+        if n < 0 {
+            return Err(format!("tokenization failed: {}", n));
+        }
+        tokens.truncate(n as usize);
+        Ok(tokens)
+    }
+
+    /// Render `messages` with the model's chat template (or `fallback` when
+    /// it has none) and tokenize them, reusing the tokens of messages seen
+    /// in an earlier turn.
+    ///
+    /// # Safety
+    /// `model` must be a live model that stays loaded for the call.
+    pub unsafe fn chat_prompt<M: ChatTurn>(
+        model: *const llama_model,
+        messages: &[M],
+        fallback: FallbackTemplate,
+    ) -> Result<ChatPrompt, String> {
+        if model.is_null() {
+            return Err("model is null".to_string());
+        }
+        let vocab = llama_model_get_vocab(model);
+        if vocab.is_null() {
+            return Err("vocab is null".to_string());
+        }
+        let n_vocab = llama_vocab_n_tokens(vocab);
+
+        let mut guard = MODEL_PROMPTS.lock().unwrap_or_else(|e| e.into_inner());
+        let stale = guard
+            .as_ref()
+            .map_or(true, |p| p.model != model as usize || p.n_vocab != n_vocab);
+        if stale {
+            *guard = Some(ModelPrompts {
+                model: model as usize,
+                n_vocab,
+                template: model_chat_template(model),
+                cache: PromptCache::default(),
+            });
+        }
+        let prompts = guard.as_mut().expect("initialized above");
+
+        let tokenize = |text: &str, add_special: bool| tokenize(vocab, text, add_special);
+        if let Some(template) = prompts.template.as_deref() {
+            // Templates llama.cpp does not recognise fail to render; those
+            // conversations use the fallback format instead
+            if let Some(mut renderer) = ModelRenderer::new(template, messages) {
+                if renderer.render(messages.len(), true).is_some() {
+                    return prompts.cache.prepare(messages, &mut renderer, tokenize);
+                }
+            }
+        }
+        let mut renderer = FallbackRenderer::new(fallback, messages);
+        prompts.cache.prepare(messages, &mut renderer, tokenize)
+    }
+}
+
+#[cfg(any(target_os = "android", target_os = "ios"))]
+pub use model::{chat_prompt, reset_prompt_cache};
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use common::ChatMessage;
+
+    fn msg(role: &str, content: &str) -> ChatMessage {
+        ChatMessage {
+            role: role.to_string(),
+            content: content.to_string(),
+        }
+    }
+
+    /// One token per byte, so token counts are easy to predict.
+    fn byte_tokens(
+        calls: &std::cell::RefCell<Vec<String>>,
+    ) -> impl FnMut(&str, bool) -> Result<Vec<Token>, String> + '_ {
+        move |text, add_special| {
+            calls.borrow_mut().push(text.to_string());
+            let mut tokens: Vec<Token> = Vec::new();
+            if add_special {
+                tokens.push(-1);
+            }
+            tokens.extend(text.bytes().map(Token::from));
+            Ok(tokens)
+        }
+    }
+
+    #[test]
+    fn test_fallback_templates_render() {
+        let messages = [msg("system", "Be brief."), msg("user", "Hi")];
+        assert_eq!(
+            FallbackTemplate::ChatMl.render(&messages),
+            "<|im_start|>system\nBe brief.<|im_end|>\n<|im_start|>user\nHi<|im_end|>\n<|im_start|>assistant\n"
+        );
+        assert_eq!(
+            FallbackTemplate::Llama3.render(&messages),
+            "<|begin_of_text|><|start_header_id|>system<|end_header_id|>\n\nBe brief.<|eot_id|>\
+             <|start_header_id|>user<|end_header_id|>\n\nHi<|eot_id|>\
+             <|start_header_id|>assistant<|end_header_id|>\n\n"
+        );
+        assert_eq!(
+            FallbackTemplate::Alpaca.render(&[msg("tool", "x")]),
+            "### tool:\nx\n\n### Response:\n"
+        );
+        assert_eq!(
+            FallbackTemplate::Simple.render(&messages),
+            "System: Be brief.\n\nHuman: Hi\n\nAssistant:"
+        );
+        assert_eq!(
+            FallbackTemplate::from_name("ChatML"),
+            Some(FallbackTemplate::ChatMl)
+        );
+        assert_eq!(FallbackTemplate::from_name("unknown"), None);
+    }
+
+    #[test]
+    fn test_follow_up_tokenizes_only_new_messages() {
+        let calls = std::cell::RefCell::new(Vec::new());
+        let mut cache = PromptCache::default();
+        let template = FallbackTemplate::ChatMl;
+
+        let first = [msg("system", "Be brief."), msg("user", "Hi")];
+        let mut renderer = FallbackRenderer::new(template, &first);
+        let prompt = cache
+            .prepare(&first, &mut renderer, byte_tokens(&calls))
+            .unwrap();
+        assert_eq!(prompt.text, template.render(&first));
+        assert_eq!(prompt.reused_tokens, 0);
+        assert_eq!(prompt.tokens.len(), prompt.text.len() + 1);
+
+        let second = [
+            msg("system", "Be brief."),
+            msg("user", "Hi"),
+            msg("assistant", "Hello."),
+            msg("user", "Bye"),
+        ];
+        calls.borrow_mut().clear();
+        let mut renderer = FallbackRenderer::new(template, &second);
+        let prompt = cache
+            .prepare(&second, &mut renderer, byte_tokens(&calls))
+            .unwrap();
+        assert_eq!(prompt.text, template.render(&second));
+        assert_eq!(prompt.tokens.len(), prompt.text.len() + 1);
+        assert_eq!(prompt.tokens[0], -1);
+        let mut history = String::new();
+        template.render_into(&first, false, &mut history);
+        assert_eq!(prompt.reused_tokens, history.len() + 1);
+        // Only the two new messages and the assistant opener were tokenized
+        assert_eq!(
+            *calls.borrow(),
+            [
+                "<|im_start|>assistant\nHello.<|im_end|>\n",
+                "<|im_start|>user\nBye<|im_end|>\n",
+                "<|im_start|>assistant\n",
+            ]
+        );
+        assert_eq!(cache.stats().conversations, 1);
+    }
+
+    #[test]
+    fn test_edited_history_reuses_unchanged_prefix() {
+        let calls = std::cell::RefCell::new(Vec::new());
+        let mut cache = PromptCache::default();
+        let template = FallbackTemplate::Simple;
+
+        let first = [msg("system", "S"), msg("user", "A"), msg("user", "B")];
+        let mut renderer = FallbackRenderer::new(template, &first);
+        cache
+            .prepare(&first, &mut renderer, byte_tokens(&calls))
+            .unwrap();
+
+        let edited = [msg("system", "S"), msg("user", "A2")];
+        calls.borrow_mut().clear();
+        let mut renderer = FallbackRenderer::new(template, &edited);
+        let prompt = cache
+            .prepare(&edited, &mut renderer, byte_tokens(&calls))
+            .unwrap();
+        assert_eq!(prompt.text, template.render(&edited));
+        assert_eq!(prompt.reused_tokens, "System: S\n\n".len() + 1);
+        assert_eq!(*calls.borrow(), ["Human: A2\n\n", "Assistant:"]);
+    }
+
+    #[test]
+    fn test_unaligned_prefix_tokenized_whole() {
+        // A template that rewrites earlier turns once a new one is added
+        struct Shifting;
+        impl ChatRenderer for Shifting {
+            fn render(&mut self, n_msg: usize, _add_ass: bool) -> Option<&str> {
+                Some(if n_msg == 2 { "ab" } else { "x" })
+            }
+        }
+        let calls = std::cell::RefCell::new(Vec::new());
+        let mut cache = PromptCache::default();
+        let messages = [msg("user", "a"), msg("user", "b")];
+        let prompt = cache
+            .prepare(&messages, &mut Shifting, byte_tokens(&calls))
+            .unwrap();
+        assert_eq!(prompt.text, "ab");
+        assert_eq!(*calls.borrow(), ["ab"]);
+        assert_eq!(cache.stats().conversations, 0);
+    }
+
+    #[test]
+    fn test_evicts_least_recent_conversation() {
+        let calls = std::cell::RefCell::new(Vec::new());
+        let mut cache = PromptCache::new(2);
+        let template = FallbackTemplate::ChatMl;
+        for content in ["a", "b", "c"] {
+            let messages = [msg("user", content)];
+            let mut renderer = FallbackRenderer::new(template, &messages);
+            cache
+                .prepare(&messages, &mut renderer, byte_tokens(&calls))
+                .unwrap();
+        }
+        assert_eq!(cache.stats().conversations, 2);
+
+        let messages = [msg("user", "a"), msg("user", "again")];
+        let mut renderer = FallbackRenderer::new(template, &messages);
+        let prompt = cache
+            .prepare(&messages, &mut renderer, byte_tokens(&calls))
+            .unwrap();
+        assert_eq!(prompt.reused_tokens, 0);
+    }
+}
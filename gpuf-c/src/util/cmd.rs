@@ -69,6 +69,11 @@ pub struct Args {
     #[arg(long, default_value_t = 40000)]
     pub p2p_udp_port: u16,
 
+    /// TCP port serving model pieces to peer workers; off by default (0). Peers are
+    /// not authenticated, so anyone reaching the port can fetch models by checksum.
+    #[arg(long, default_value_t = 0)]
+    pub p2p_seed_port: u16,
+
     /// Certificate chain for TLS
     #[arg(long, default_value = "ca-cert.pem")]
     pub cert_chain_path: String,
@@ -139,10 +144,17 @@ pub struct Args {
 
     #[arg(
         long,
-        default_value_t = 1,
-        help = "Max bytes per streamed delta chunk sent to server"
+        default_value_t = 256,
+        help = "Max bytes buffered before a streamed delta chunk is sent to server"
     )]
     pub stream_chunk_bytes: usize,
+
+    #[arg(
+        long,
+        default_value_t = 30,
+        help = "Max milliseconds streamed output is buffered before it is sent to server (0 = bytes only)"
+    )]
+    pub stream_chunk_interval_ms: u64,
 }
 
 impl Args {
@@ -201,6 +213,7 @@ impl Args {
                 local_port: config_data.client.local_port,
                 p2p_advertise_ip: self.p2p_advertise_ip.clone(),
                 p2p_udp_port: self.p2p_udp_port,
+                p2p_seed_port: self.p2p_seed_port,
                 cert_chain_path: config_data.client.cert_chain_path,
                 worker_type: worker_type,
                 engine_type: engine_type,
@@ -219,6 +232,7 @@ impl Args {
                     .clone()
                     .or_else(|| self.llama_devices.clone()),
                 stream_chunk_bytes: self.stream_chunk_bytes,
+                stream_chunk_interval_ms: self.stream_chunk_interval_ms,
             })
         } else {
             // In standalone_llama mode, client_id is optional
@@ -0,0 +1,180 @@
+//! Device profile used to size llama.cpp contexts.
+//!
+//! Contexts used to get `n_ctx` 4096, `n_batch` 128 and four threads on every
+//! device. The profile reads total and available memory, the CPU cluster
+//! layout and the SoC temperature, and derives context size, batch sizes,
+//! thread count and KV cache type from them. The same `ContextProfile` is
+//! reported to the server so long-context requests only go to devices whose
+//! context fits them.
+
+use common::{ContextProfile, KvCacheType};
+
+/// Above this SoC temperature threads and batch size are backed off.
+const HOT_TEMP_C: u32 = 45;
+const MAX_THREADS: u32 = 8;
+/// Below this much available memory the profile drops one tier.
+const LOW_AVAILABLE_MB: u64 = 1536;
+
+/// Minimum total memory, context size, batch size and KV cache type per tier.
+const TIERS: [(u64, u32, u32, KvCacheType); 4] = [
+    (0, 2048, 64, KvCacheType::Q4_0),
+    (3 * 1024, 4096, 128, KvCacheType::Q8_0),
+    (6 * 1024, 8192, 256, KvCacheType::Q8_0),
+    (10 * 1024, 8192, 512, KvCacheType::F16),
+];
+
+/// Hardware facts the context settings are derived from.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct DeviceProfile {
+    /// 0 when unknown.
+    pub mem_total_mb: u64,
+    pub mem_available_mb: u64,
+    /// Cores outside the slowest cluster on big.LITTLE parts, else all cores.
+    pub big_cores: u32,
+    pub total_cores: u32,
+    pub temp_c: Option<u32>,
+}
+
+impl DeviceProfile {
+    pub fn probe() -> Self {
+        let (mem_total_mb, mem_available_mb) = read_meminfo_mb().unwrap_or((0, 0));
+        let (big_cores, total_cores) = read_core_layout();
+        #[cfg(target_os = "android")]
+        let temp_c = crate::util::system_info::read_thermal_info();
+        #[cfg(not(target_os = "android"))]
+        let temp_c = None;
+
+        Self {
+            mem_total_mb,
+            mem_available_mb,
+            big_cores,
+            total_cores,
+            temp_c,
+        }
+    }
+
+    pub fn context_profile(&self) -> ContextProfile {
+        let hot = self.temp_c.is_some_and(|t| t >= HOT_TEMP_C);
+        let mut n_threads = self.big_cores.clamp(1, MAX_THREADS);
+        if hot {
+            n_threads = (n_threads - 1).max(1);
+        }
+
+        // Without a memory reading keep the settings contexts always had.
+        if self.mem_total_mb == 0 {
+            return ContextProfile {
+                n_ctx: 4096,
+                n_batch: 128,
+                n_ubatch: 128,
+                n_threads,
+                n_threads_batch: n_threads,
+                kv_cache: KvCacheType::F16,
+            };
+        }
+
+        let mut tier = TIERS
+            .iter()
+            .rposition(|t| self.mem_total_mb >= t.0)
+            .unwrap_or(0);
+        if self.mem_available_mb < LOW_AVAILABLE_MB {
+            tier = tier.saturating_sub(1);
+        }
+        let (_, n_ctx, mut n_batch, kv_cache) = TIERS[tier];
+        if hot {
+            n_batch = (n_batch / 2).max(32);
+        }
+
+        ContextProfile {
+            n_ctx,
+            n_batch,
+            n_ubatch: n_batch,
+            n_threads,
+            n_threads_batch: n_threads,
+            kv_cache,
+        }
+    }
+}
+
+/// Context settings for this device as it is right now.
+pub fn current() -> ContextProfile {
+    DeviceProfile::probe().context_profile()
+}
+
+/// Total and available memory from /proc/meminfo, in MB.
+fn read_meminfo_mb() -> Option<(u64, u64)> {
+    let meminfo = std::fs::read_to_string("/proc/meminfo").ok()?;
+    let field = |name: &str| {
+        meminfo
+            .lines()
+            .find_map(|l| l.strip_prefix(name))
+            .and_then(|rest| rest.split_whitespace().next())
+            .and_then(|kb| kb.parse::<u64>().ok())
+            .map(|kb| kb / 1024)
+    };
+    let total = field("MemTotal:")?;
+    Some((total, field("MemAvailable:").unwrap_or(total)))
+}
+
+/// Big-core and total core counts from the per-core cpufreq limits.
+fn read_core_layout() -> (u32, u32) {
+    let mut max_freqs: Vec<u64> = Vec::new();
+    if let Ok(entries) = std::fs::read_dir("/sys/devices/system/cpu") {
+        for entry in entries.flatten() {
+            let name = entry.file_name();
+            let Some(id) = name.to_str().and_then(|n| n.strip_prefix("cpu")) else {
+                continue;
+            };
+            if id.is_empty() || !id.bytes().all(|b| b.is_ascii_digit()) {
+                continue;
+            }
+            let freq = std::fs::read_to_string(entry.path().join("cpufreq/cpuinfo_max_freq"))
+                .ok()
+                .and_then(|f| f.trim().parse::<u64>().ok());
+            if let Some(freq) = freq {
+                max_freqs.push(freq);
+            }
+        }
+    }
+
+    if max_freqs.is_empty() {
+        let n = std::thread::available_parallelism()
+            .map(|n| n.get() as u32)
+            .unwrap_or(4);
+        return (n, n);
+    }
+    let total = max_freqs.len() as u32;
+    let slowest = max_freqs.iter().copied().min().unwrap_or(0);
+    let big = max_freqs.iter().filter(|&&f| f > slowest).count() as u32;
+    (if big == 0 { total } else { big }, total)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn phone(mem_total_mb: u64, mem_available_mb: u64, temp_c: Option<u32>) -> DeviceProfile {
+        DeviceProfile {
+            mem_total_mb,
+            mem_available_mb,
+            big_cores: 4,
+            total_cores: 8,
+            temp_c,
+        }
+    }
+
+    #[test]
+    fn test_context_profile_follows_memory_and_temperature() {
+        let low_end = phone(2800, 1200, None).context_profile();
+        assert_eq!((low_end.n_ctx, low_end.kv_cache), (2048, KvCacheType::Q4_0));
+
+        let mid = phone(7400, 3000, None).context_profile();
+        assert_eq!((mid.n_ctx, mid.n_batch), (8192, 256));
+        assert_eq!((mid.kv_cache, mid.n_threads), (KvCacheType::Q8_0, 4));
+
+        // Little free memory drops a tier; heat trims threads and batch.
+        let squeezed = phone(7400, 1000, Some(50)).context_profile();
+        assert_eq!((squeezed.n_ctx, squeezed.n_batch), (4096, 64));
+        assert_eq!(squeezed.n_threads, 3);
+        assert_eq!(squeezed.n_ubatch, squeezed.n_batch);
+    }
+}
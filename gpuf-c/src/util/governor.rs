@@ -0,0 +1,199 @@
+//! Thermal and battery governor for mobile workers.
+//!
+//! A phone decoding for minutes heats up until the SoC throttles itself, and
+//! tokens/s collapses long before CPU or memory usage look busy. The governor
+//! turns the SoC temperature and battery state into a `ThrottleLevel` that
+//! caps decode threads, paces decode steps, refuses new tasks at `Critical`,
+//! and is reported to the server so hot devices are handed less work.
+//!
+//! The host app can push the state with `gpuf_report_device_state` (iOS has no
+//! sysfs to read); otherwise it is probed from sysfs on Android.
+
+use common::ThrottleLevel;
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+/// Temperatures (°C) at which each level starts.
+const WARM_C: u32 = 40;
+const HOT_C: u32 = 44;
+const CRITICAL_C: u32 = 48;
+/// A level is left only once the temperature is this far below its start.
+const HYSTERESIS_C: u32 = 2;
+/// On battery, at or below these charge levels.
+const LOW_BATTERY_PCT: u8 = 20;
+const CRITICAL_BATTERY_PCT: u8 = 10;
+
+/// Host reports older than this are ignored in favour of probing.
+const HOST_REPORT_TTL: Duration = Duration::from_secs(60);
+/// Probes are reused this long; the batch engine asks every decode step.
+const SAMPLE_INTERVAL: Duration = Duration::from_secs(2);
+
+/// Sensor readings the level is derived from.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+pub struct DeviceState {
+    pub temp_c: Option<u32>,
+    pub battery_pct: Option<u8>,
+    pub charging: bool,
+}
+
+struct Governor {
+    host: Option<(DeviceState, Instant)>,
+    sampled: Option<(DeviceState, Instant)>,
+    level: ThrottleLevel,
+}
+
+static GOVERNOR: Mutex<Governor> = Mutex::new(Governor {
+    host: None,
+    sampled: None,
+    level: ThrottleLevel::Normal,
+});
+
+/// Record the state reported by the host app.
+pub fn report(state: DeviceState) {
+    let mut g = GOVERNOR.lock().unwrap_or_else(|e| e.into_inner());
+    g.host = Some((state, Instant::now()));
+}
+
+/// The current readings and the level they put the device at.
+pub fn sample() -> (DeviceState, ThrottleLevel) {
+    let mut g = GOVERNOR.lock().unwrap_or_else(|e| e.into_inner());
+    let now = Instant::now();
+    let state = match (g.host, g.sampled) {
+        (Some((s, at)), _) if now.duration_since(at) < HOST_REPORT_TTL => s,
+        (_, Some((s, at))) if now.duration_since(at) < SAMPLE_INTERVAL => s,
+        _ => {
+            let s = probe();
+            g.sampled = Some((s, now));
+            s
+        }
+    };
+
+    let level = next_level(g.level, state);
+    if level != g.level {
+        println!(
+            "🌡️ Throttle level {:?} -> {:?} (temp {:?}°C, battery {:?}%, charging {})",
+            g.level, level, state.temp_c, state.battery_pct, state.charging
+        );
+        g.level = level;
+    }
+    (state, level)
+}
+
+pub fn level() -> ThrottleLevel {
+    sample().1
+}
+
+/// Refuse new tasks while the device is critical.
+pub fn admit() -> Result<(), String> {
+    match sample() {
+        (state, ThrottleLevel::Critical) => Err(format!(
+            "device is throttled (temp {:?}°C, battery {:?}%), try another worker",
+            state.temp_c, state.battery_pct
+        )),
+        _ => Ok(()),
+    }
+}
+
+/// Decode threads to use at `level` for a context created with `base`.
+pub fn thread_cap(base: i32, level: ThrottleLevel) -> i32 {
+    let cap = match level {
+        ThrottleLevel::Normal => base,
+        ThrottleLevel::Warm => base - base / 4,
+        ThrottleLevel::Hot => base / 2,
+        ThrottleLevel::Critical => base / 4,
+    };
+    cap.max(1)
+}
+
+/// Idle time inserted after each decode step at `level`.
+pub fn step_pause(level: ThrottleLevel) -> Duration {
+    match level {
+        ThrottleLevel::Normal | ThrottleLevel::Warm => Duration::ZERO,
+        ThrottleLevel::Hot => Duration::from_millis(15),
+        ThrottleLevel::Critical => Duration::from_millis(40),
+    }
+}
+
+fn threshold(level: ThrottleLevel) -> u32 {
+    match level {
+        ThrottleLevel::Normal => 0,
+        ThrottleLevel::Warm => WARM_C,
+        ThrottleLevel::Hot => HOT_C,
+        ThrottleLevel::Critical => CRITICAL_C,
+    }
+}
+
+fn next_level(current: ThrottleLevel, state: DeviceState) -> ThrottleLevel {
+    let by_temp = match state.temp_c {
+        None => ThrottleLevel::Normal,
+        Some(t) => {
+            let raw = match t {
+                t if t >= CRITICAL_C => ThrottleLevel::Critical,
+                t if t >= HOT_C => ThrottleLevel::Hot,
+                t if t >= WARM_C => ThrottleLevel::Warm,
+                _ => ThrottleLevel::Normal,
+            };
+            // Stay put until clearly below the current level's threshold so
+            // the level does not flap around it.
+            if raw < current && t + HYSTERESIS_C > threshold(current) {
+                current
+            } else {
+                raw
+            }
+        }
+    };
+    let by_battery = match state.battery_pct {
+        Some(p) if !state.charging && p <= CRITICAL_BATTERY_PCT => ThrottleLevel::Critical,
+        Some(p) if !state.charging && p <= LOW_BATTERY_PCT => ThrottleLevel::Hot,
+        _ => ThrottleLevel::Normal,
+    };
+    by_temp.max(by_battery)
+}
+
+#[cfg(target_os = "android")]
+fn probe() -> DeviceState {
+    let read = |name: &str| {
+        std::fs::read_to_string(format!("/sys/class/power_supply/battery/{}", name))
+            .ok()
+            .map(|s| s.trim().to_string())
+    };
+    let status = read("status");
+    DeviceState {
+        temp_c: crate::util::system_info::read_thermal_info(),
+        battery_pct: read("capacity").and_then(|c| c.parse::<u8>().ok()),
+        charging: matches!(status.as_deref(), Some("Charging") | Some("Full")),
+    }
+}
+
+#[cfg(not(target_os = "android"))]
+fn probe() -> DeviceState {
+    DeviceState::default()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn state(temp_c: u32, battery_pct: u8, charging: bool) -> DeviceState {
+        DeviceState {
+            temp_c: Some(temp_c),
+            battery_pct: Some(battery_pct),
+            charging,
+        }
+    }
+
+    #[test]
+    fn test_next_level_hysteresis_and_battery() {
+        use ThrottleLevel::*;
+        assert_eq!(next_level(Normal, state(45, 80, false)), Hot);
+        // 43°C is below Hot's threshold but within the hysteresis band.
+        assert_eq!(next_level(Hot, state(43, 80, false)), Hot);
+        assert_eq!(next_level(Hot, state(41, 80, false)), Warm);
+        assert_eq!(next_level(Normal, state(30, 15, false)), Hot);
+        assert_eq!(next_level(Normal, state(30, 8, false)), Critical);
+        assert_eq!(next_level(Normal, state(30, 8, true)), Normal);
+
+        assert_eq!(thread_cap(4, Hot), 2);
+        assert_eq!(thread_cap(2, Critical), 1);
+    }
+}
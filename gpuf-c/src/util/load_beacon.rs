@@ -0,0 +1,175 @@
+//! Load beacons sent between full heartbeats.
+//!
+//! A full Heartbeat carries the whole device inventory and goes out every
+//! 120 s, which is too stale for routing and mostly repeats itself. Once the
+//! server asks for beacons, the worker samples its load every beacon
+//! interval and sends only the fields that moved since the last report, and
+//! leaves the inventory out of heartbeats while it is unchanged.
+
+use common::{DevicesInfo, LoadDelta, ThrottleLevel};
+use std::time::{Duration, Instant};
+
+/// CPU and memory usage changes smaller than this (percentage points) are
+/// not reported.
+const USAGE_STEP: u8 = 5;
+/// Throughput changes smaller than this fraction are not reported.
+const THROUGHPUT_STEP: f64 = 0.1;
+
+/// Load figures at one point in time.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct LoadSnapshot {
+    pub cpu_usage: u8,
+    pub memory_usage: u8,
+    pub inflight: u16,
+    pub queued: u16,
+    /// Tokens generated so far, from which throughput is derived.
+    pub generated: u64,
+    pub throttle: ThrottleLevel,
+}
+
+/// What the server last heard from this worker.
+pub struct BeaconState {
+    interval: Duration,
+    reported: LoadSnapshot,
+    tokens_per_sec_x10: u32,
+    last_sample: Option<(u64, Instant)>,
+    last_sent: Option<Instant>,
+    inventory: Option<Vec<DevicesInfo>>,
+}
+
+impl BeaconState {
+    pub fn new(interval: Duration) -> Self {
+        Self {
+            interval,
+            reported: LoadSnapshot::default(),
+            tokens_per_sec_x10: 0,
+            last_sample: None,
+            last_sent: None,
+            inventory: None,
+        }
+    }
+
+    /// A full heartbeat just reported these usage figures.
+    pub fn rebase(&mut self, cpu_usage: u8, memory_usage: u8) {
+        self.reported.cpu_usage = cpu_usage;
+        self.reported.memory_usage = memory_usage;
+    }
+
+    /// Whether `devices` differs from the inventory last sent in full, in
+    /// which case it becomes the new reference.
+    pub fn inventory_changed(&mut self, devices: &[DevicesInfo]) -> bool {
+        if self.inventory.as_deref() == Some(devices) {
+            return false;
+        }
+        self.inventory = Some(devices.to_vec());
+        true
+    }
+
+    /// Whether a beacon may be sent at `at`; sampling can be skipped if not.
+    pub fn due(&self, at: Instant) -> bool {
+        self.last_sent
+            .map_or(true, |sent| at.duration_since(sent) >= self.interval)
+    }
+
+    /// Fields of `now` that moved since the last report, if any, and at
+    /// most once per interval.
+    pub fn poll(&mut self, now: LoadSnapshot, at: Instant) -> Option<LoadDelta> {
+        if !self.due(at) {
+            return None;
+        }
+
+        // Throughput over the time since the previous poll; idle intervals
+        // keep the last rate rather than reporting zero.
+        let mut tokens_per_sec_x10 = None;
+        if let Some((generated, then)) = self.last_sample {
+            let elapsed = at.duration_since(then).as_secs_f64();
+            let tokens = now.generated.saturating_sub(generated);
+            if tokens > 0 && elapsed > 0.0 {
+                let rate = (tokens as f64 * 10.0 / elapsed).min(u32::MAX as f64) as u32;
+                let old = self.tokens_per_sec_x10 as f64;
+                if (rate as f64 - old).abs() > old * THROUGHPUT_STEP {
+                    tokens_per_sec_x10 = Some(rate);
+                }
+            }
+        }
+        self.last_sample = Some((now.generated, at));
+
+        let moved = |old: u8, new: u8| (old.abs_diff(new) >= USAGE_STEP).then_some(new);
+        let changed = |old: u16, new: u16| (old != new).then_some(new);
+        let delta = LoadDelta {
+            cpu_usage: moved(self.reported.cpu_usage, now.cpu_usage),
+            memory_usage: moved(self.reported.memory_usage, now.memory_usage),
+            inflight: changed(self.reported.inflight, now.inflight),
+            queued: changed(self.reported.queued, now.queued),
+            tokens_per_sec_x10,
+            throttle: (self.reported.throttle != now.throttle).then_some(now.throttle),
+        };
+        if delta.is_empty() {
+            return None;
+        }
+
+        if delta.cpu_usage.is_some() {
+            self.reported.cpu_usage = now.cpu_usage;
+        }
+        if delta.memory_usage.is_some() {
+            self.reported.memory_usage = now.memory_usage;
+        }
+        if let Some(rate) = delta.tokens_per_sec_x10 {
+            self.tokens_per_sec_x10 = rate;
+        }
+        self.reported.inflight = now.inflight;
+        self.reported.queued = now.queued;
+        self.reported.throttle = now.throttle;
+        self.last_sent = Some(at);
+        Some(delta)
+    }
+}
+
+/// Batch engine and governor figures plus the given usage.
+#[cfg(any(target_os = "android", target_os = "ios"))]
+pub fn sample(cpu_usage: u8, memory_usage: u8) -> LoadSnapshot {
+    let engine = crate::batch_engine::load();
+    LoadSnapshot {
+        cpu_usage,
+        memory_usage,
+        inflight: engine.active.min(u16::MAX as u32) as u16,
+        queued: engine.pending.min(u16::MAX as u32) as u16,
+        generated: engine.generated,
+        throttle: crate::util::governor::level(),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_poll_reports_only_changes() {
+        let start = Instant::now();
+        let mut beacon = BeaconState::new(Duration::from_secs(1));
+        let mut load = LoadSnapshot {
+            cpu_usage: 20,
+            ..Default::default()
+        };
+        beacon.rebase(20, 0);
+        assert_eq!(beacon.poll(load, start), None);
+
+        load.inflight = 2;
+        load.cpu_usage = 22;
+        load.generated = 100;
+        let delta = beacon.poll(load, start + Duration::from_secs(2)).unwrap();
+        assert_eq!((delta.inflight, delta.cpu_usage), (Some(2), None));
+        assert_eq!(delta.tokens_per_sec_x10, Some(500));
+
+        // Rate-limited within the interval, then only what moved.
+        load.queued = 1;
+        assert_eq!(beacon.poll(load, start + Duration::from_millis(2500)), None);
+        let delta = beacon.poll(load, start + Duration::from_secs(3)).unwrap();
+        assert_eq!(delta.queued, Some(1));
+        assert_eq!((delta.inflight, delta.tokens_per_sec_x10), (None, None));
+
+        let devices = vec![DevicesInfo::default()];
+        assert!(beacon.inventory_changed(&devices));
+        assert!(!beacon.inventory_changed(&devices));
+    }
+}
@@ -1,14 +1,23 @@
+pub mod arena;
 pub mod asm;
+pub mod chat_template;
 pub mod cmd;
 pub mod config;
 pub mod device_info;
+pub mod device_profile;
+pub mod governor;
+pub mod load_beacon;
 pub mod model_downloader;
 #[cfg(not(target_os = "ios"))]
 pub mod model_downloader_example;
+pub mod model_peers;
+pub mod model_prefetch;
 pub mod network_info;
 pub mod nvswitch_check;
+pub mod reliable_udp;
 pub mod system_info;
 pub mod system_info_vulkan;
+pub mod vision_cache;
 
 use std::sync::OnceLock;
 use tracing::{debug, Level};
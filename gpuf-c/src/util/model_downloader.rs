@@ -1,21 +1,27 @@
 //! Model downloader with parallel downloading and resume support
 //!
 //! This module provides functionality to download large model files with:
-//! - Parallel chunk downloading for faster speeds
+//! - Parallel chunk downloading for faster speeds, written in place
 //! - Resume capability for interrupted downloads
 //! - Progress tracking and reporting
-//! - Integrity verification with checksums
+//! - Integrity verification with checksums, computed while downloading
+//! - Pieces fetched from peer workers when available (see `model_peers`)
 
+use super::model_peers::{self, PeerPieces, SeedFile, SeedRegistry};
 use anyhow::{anyhow, Result};
+use bytes::{Bytes, BytesMut};
 use futures_util::StreamExt;
 use reqwest::Client;
+use serde::{Deserialize, Serialize};
+use sha2::digest::generic_array::GenericArray;
+use std::collections::{BTreeMap, VecDeque};
 use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
 use std::sync::Arc;
 use tokio::io::{AsyncReadExt, AsyncWriteExt};
-use tokio::sync::{Mutex, Semaphore};
 use tokio::task::JoinSet;
 use tokio::time::{timeout, Duration};
-use tracing::{debug, error, info, warn};
+use tracing::{debug, info, warn};
 
 /// Configuration for model downloading
 #[derive(Debug, Clone)]
@@ -73,6 +79,8 @@ pub struct ModelDownloader {
     client: Client,
     config: DownloadConfig,
     progress_callback: Option<Arc<ProgressCallback>>,
+    peers: Option<Arc<PeerPieces>>,
+    seeds: Option<Arc<SeedRegistry>>,
 }
 
 impl ModelDownloader {
@@ -88,6 +96,8 @@ impl ModelDownloader {
             config,
             client,
             progress_callback: None,
+            peers: None,
+            seeds: None,
         }
     }
 
@@ -99,6 +109,32 @@ impl ModelDownloader {
         self.progress_callback = Some(Arc::new(Box::new(callback)));
     }
 
+    /// Fetch pieces from these peers first, in their piece layout.
+    pub fn set_peers(&mut self, peers: Arc<PeerPieces>) {
+        self.peers = Some(peers);
+    }
+
+    /// Serve pieces to other workers from `seeds` while downloading (when
+    /// peers vouch for piece hashes) and once the checksum has passed.
+    pub fn set_seed_registry(&mut self, seeds: Arc<SeedRegistry>) {
+        self.seeds = Some(seeds);
+    }
+
+    /// Peers matching the file the origin serves.
+    fn usable_peers(&self, total_size: u64) -> Option<Arc<PeerPieces>> {
+        self.peers.clone().filter(|peers| {
+            peers.total_size() == total_size
+                && self.config.checksum.as_deref() == Some(peers.checksum())
+        })
+    }
+
+    fn piece_size(&self, total_size: u64) -> u64 {
+        match self.usable_peers(total_size) {
+            Some(peers) => peers.piece_size(),
+            None => (self.config.chunk_size as u64).max(1),
+        }
+    }
+
     /// Start the download with parallel chunks and resume support
     pub async fn download(&self) -> Result<()> {
         info!("Starting download: {}", self.config.url);
@@ -148,7 +184,7 @@ impl ModelDownloader {
                 downloaded_size, file_size
             );
             let _ = tokio::fs::remove_file(&self.config.output_path).await;
-            let _ = tokio::fs::remove_dir_all(self.parts_dir()).await;
+            self.discard_partial().await;
             downloaded_size = 0;
         } else if downloaded_size == file_size && file_size > 0 {
             if let Some(checksum) = &self.config.checksum {
@@ -163,7 +199,7 @@ impl ModelDownloader {
                             e
                         );
                         let _ = tokio::fs::remove_file(&self.config.output_path).await;
-                        let _ = tokio::fs::remove_dir_all(self.parts_dir()).await;
+                        self.discard_partial().await;
                         downloaded_size = 0;
                     }
                 }
@@ -195,20 +231,15 @@ impl ModelDownloader {
 
         // Calculate chunks
         let chunks = self.calculate_chunks(downloaded_size, remaining_bytes, file_size);
-        info!("Downloading {} chunks in parallel", chunks.len());
-
-        // Debug: print chunk info
-        for (i, chunk) in chunks.iter().enumerate() {
-            info!("Chunk {}: bytes {}-{}", i, chunk.start, chunk.end);
-        }
-
-        // Download chunks
-        self.download_chunks(chunks, file_size, downloaded_size).await?;
+        info!(
+            "Downloading {} chunks, {} in parallel",
+            chunks.len(),
+            self.config.parallel_chunks
+        );
 
-        // Verify integrity if checksum provided
-        if let Some(checksum) = &self.config.checksum {
-            self.verify_checksum(checksum).await?;
-        }
+        // Download chunks; the checksum is verified as they complete
+        self.download_chunks(chunks, file_size, downloaded_size)
+            .await?;
 
         info!("Download completed successfully!");
         Ok(())
@@ -276,195 +307,348 @@ impl ModelDownloader {
         Ok(metadata.len())
     }
 
-    /// Calculate download chunks for parallel downloading
+    /// Split the file into `chunk_size` pieces (the peers' piece size when
+    /// fetching from peers). Pieces are fetched in order, `parallel_chunks`
+    /// at a time, so the checksum can follow right behind.
     fn calculate_chunks(
         &self,
         start_pos: u64,
         remaining: u64,
         total_size: u64,
     ) -> Vec<DownloadChunk> {
-        let mut chunks = Vec::new();
-        let chunk_size = self.config.chunk_size as u64;
-
-        // If file is small, use single chunk
-        if remaining <= chunk_size || self.config.parallel_chunks == 1 {
-            chunks.push(DownloadChunk {
-                start: start_pos,
-                end: total_size - 1,
-                index: 0,
-            });
-            return chunks;
-        }
-
-        // Calculate optimal chunk count
-        let chunk_count = (remaining / chunk_size).min(self.config.parallel_chunks as u64) as usize;
-        let actual_chunk_size = remaining / chunk_count as u64;
-
-        for i in 0..chunk_count {
-            let chunk_start = start_pos + (i as u64 * actual_chunk_size);
-            let chunk_end = if i == chunk_count - 1 {
-                total_size - 1
-            } else {
-                chunk_start + actual_chunk_size - 1
-            };
-
-            chunks.push(DownloadChunk {
-                start: chunk_start,
-                end: chunk_end,
-                index: i,
-            });
-        }
-
-        chunks
+        let chunk_size = self.piece_size(total_size);
+        let chunk_count = remaining.div_ceil(chunk_size).max(1) as usize;
+
+        (0..chunk_count)
+            .map(|i| {
+                let start = start_pos + i as u64 * chunk_size;
+                DownloadChunk {
+                    start,
+                    end: (start + chunk_size).min(total_size) - 1,
+                    index: i,
+                }
+            })
+            .collect()
     }
 
-    /// Download multiple chunks in parallel
+    /// Download all pieces straight into a preallocated `<output>.part` file,
+    /// hashing them in order as they complete, then rename it into place.
+    /// Progress and the hash state are saved to `<output>.part.state`, so an
+    /// interrupted download resumes with neither re-downloading nor
+    /// re-hashing finished pieces.
     async fn download_chunks(
         &self,
         chunks: Vec<DownloadChunk>,
         total_size: u64,
         initial_downloaded: u64,
     ) -> Result<()> {
-        let parts_dir = self.parts_dir();
-        tokio::fs::create_dir_all(&parts_dir).await?;
-
-        let mut existing = 0u64;
-        for chunk in chunks.iter() {
-            let part_path = Self::part_path(&parts_dir, chunk.index);
-            if let Ok(meta) = tokio::fs::metadata(&part_path).await {
-                let len = meta.len();
-                let max_len = (chunk.end - chunk.start) + 1;
-                if len <= max_len {
-                    existing += len;
-                } else {
-                    let _ = tokio::fs::remove_file(&part_path).await;
+        let output_path = &self.config.output_path;
+        let partial_path = partial_path(output_path);
+        let state_path = state_path(output_path);
+        // Left behind by versions that assembled separate part files.
+        let _ = tokio::fs::remove_dir_all(legacy_parts_dir(output_path)).await;
+
+        let piece_size = self.piece_size(total_size);
+        let mut state = match DownloadState::load(&state_path).await {
+            Some(state)
+                if partial_path.exists()
+                    && state.matches(&self.config, total_size, piece_size, chunks.len()) =>
+            {
+                state
+            }
+            _ => DownloadState::new(&self.config, total_size, piece_size, chunks.len()),
+        };
+        let fresh = state.done.iter().all(|done| !done);
+
+        let file = {
+            let partial_path = partial_path.clone();
+            tokio::task::spawn_blocking(move || -> std::io::Result<std::fs::File> {
+                let file = std::fs::OpenOptions::new()
+                    .read(true)
+                    .write(true)
+                    .create(true)
+                    .truncate(fresh)
+                    .open(&partial_path)?;
+                if fresh {
+                    preallocate(&file, total_size)?;
+                }
+                Ok(file)
+            })
+            .await??
+        };
+        let file = Arc::new(file);
+
+        let peers = self.usable_peers(total_size);
+        // Piece hashes are only worth computing when the file is seeded.
+        let seeds = self
+            .seeds
+            .clone()
+            .filter(|_| self.config.checksum.is_some());
+        let hash_pieces = seeds.is_some();
+        // Pieces matching the peers' hashes are served while downloading.
+        let live_seed = match (&seeds, &peers) {
+            (Some(seeds), Some(peers)) => {
+                let seed = Arc::new(SeedFile::new(
+                    peers.checksum().to_string(),
+                    total_size,
+                    piece_size,
+                    file.clone(),
+                ));
+                for (index, hash) in state.piece_hashes.iter().enumerate() {
+                    if state.done[index] && *hash == hex::encode(peers.piece_hashes()[index]) {
+                        seed.mark(index);
+                    }
                 }
+                seeds.insert(seed.clone());
+                Some(seed)
             }
+            _ => None,
+        };
+        if let Some(peers) = &peers {
+            info!(
+                "Fetching pieces from {} peers, falling back to {}",
+                peers.peer_count(),
+                self.config.url
+            );
+        }
+        let mut from_peers = 0usize;
+
+        let existing = state.done_bytes();
+        if existing > 0 {
+            info!(
+                "Resuming parallel download: {} of {} bytes present, {} bytes hashed",
+                existing,
+                total_size,
+                chunks[..state.settled]
+                    .iter()
+                    .map(DownloadChunk::len)
+                    .sum::<u64>()
+            );
         }
 
-        let semaphore = Arc::new(Semaphore::new(self.config.parallel_chunks));
         let baseline_downloaded = initial_downloaded + existing;
-        let downloaded_bytes = Arc::new(Mutex::new(baseline_downloaded));
+        let downloaded_bytes = Arc::new(AtomicU64::new(baseline_downloaded));
         let start_time = std::time::Instant::now();
-        let total_chunks = chunks.len();
-
+        let parallel = self.config.parallel_chunks.max(1);
+        // Finished pieces wait in memory until the hash reaches them.
+        let window = parallel * PENDING_PIECES_PER_WORKER;
+
+        let mut todo: VecDeque<DownloadChunk> = chunks
+            .iter()
+            .filter(|chunk| !state.done[chunk.index])
+            .copied()
+            .collect();
+        let mut pending: BTreeMap<usize, Bytes> = BTreeMap::new();
+        let mut unsaved = 0u64;
         let mut set = JoinSet::new();
 
-        for chunk in chunks {
-            let semaphore = semaphore.clone();
-            let client = self.client.clone();
-            let url = self.config.url.clone();
-            let output_path = self.config.output_path.clone();
-            let parts_dir = parts_dir.clone();
-            let downloaded_bytes = downloaded_bytes.clone();
-            let progress_callback = self.progress_callback.clone();
-            let baseline_downloaded = baseline_downloaded;
-
-            set.spawn(async move {
-                let _permit = semaphore.acquire().await?;
-
-                let result = Self::download_chunk_to_part(
-                    client,
-                    &url,
-                    &output_path,
-                    &parts_dir,
-                    chunk,
-                    downloaded_bytes.clone(),
-                    total_size,
-                    progress_callback,
-                    start_time,
-                    baseline_downloaded,
-                )
-                .await;
+        loop {
+            // Fold finished pieces into the hash, in order.
+            while let Some(chunk) = chunks.get(state.settled).copied() {
+                if !state.done[chunk.index] {
+                    break;
+                }
+                if let Some(mut hash) = state.hash.take() {
+                    let bytes = match pending.remove(&chunk.index) {
+                        Some(bytes) => bytes,
+                        // Finished before an interruption but not yet hashed.
+                        None => read_chunk(file.clone(), chunk).await?,
+                    };
+                    hash = tokio::task::spawn_blocking(move || {
+                        hash.update(&bytes);
+                        hash
+                    })
+                    .await?;
+                    state.hash = Some(hash);
+                }
+                state.settled += 1;
+            }
+            if state.settled == chunks.len() {
+                break;
+            }
 
-                // Return the chunk index for error reporting
-                match result {
-                    Ok(_) => Ok(chunk.index),
-                    Err(e) => {
-                        error!("Failed to download chunk {}: {}", chunk.index, e);
-                        Err(e)
+            while set.len() < parallel {
+                match todo.front() {
+                    Some(chunk) if chunk.index < state.settled + window => {
+                        let chunk = todo.pop_front().unwrap();
+                        set.spawn(Self::download_chunk_at(
+                            self.client.clone(),
+                            self.config.url.clone(),
+                            peers.clone(),
+                            file.clone(),
+                            chunk,
+                            state.hash.is_some(),
+                            hash_pieces,
+                            downloaded_bytes.clone(),
+                            total_size,
+                            self.progress_callback.clone(),
+                            start_time,
+                            baseline_downloaded,
+                        ));
                     }
+                    _ => break,
                 }
-            });
-        }
+            }
 
-        // Wait for all chunks to complete
-        let mut completed = 0;
-        while let Some(result) = set.join_next().await {
-            match result {
-                Ok(Ok(chunk_index)) => {
-                    completed += 1;
+            let failure = match set.join_next().await {
+                Some(Ok(Ok(FetchedPiece {
+                    chunk,
+                    bytes,
+                    digest,
+                    from_peer,
+                }))) => {
                     debug!(
                         "Chunk {} completed ({} / {})",
-                        chunk_index, completed, total_chunks
+                        chunk.index,
+                        state.done.iter().filter(|done| **done).count() + 1,
+                        chunks.len()
                     );
+                    state.done[chunk.index] = true;
+                    if state.hash.is_some() {
+                        pending.insert(chunk.index, bytes);
+                    }
+                    from_peers += from_peer as usize;
+                    if let Some(digest) = digest {
+                        if let (Some(seed), Some(peers)) = (&live_seed, &peers) {
+                            if peers.piece_hashes()[chunk.index] == digest {
+                                seed.mark(chunk.index);
+                            }
+                        }
+                        state.piece_hashes[chunk.index] = hex::encode(digest);
+                    }
+                    unsaved += chunk.len();
+                    if unsaved >= STATE_SAVE_BYTES {
+                        unsaved = 0;
+                        if let Err(e) = state.save(&file, &state_path).await {
+                            warn!("Failed to save download state: {}", e);
+                        }
+                    }
+                    continue;
                 }
-                Ok(Err(e)) => {
-                    return Err(anyhow!("Chunk download failed: {}", e));
-                }
-                Err(e) => {
-                    return Err(anyhow!("Task join error: {}", e));
-                }
+                Some(Ok(Err(e))) => anyhow!("Chunk download failed: {}", e),
+                Some(Err(e)) => anyhow!("Task join error: {}", e),
+                None => anyhow!("No chunk in flight for piece {}", state.settled),
+            };
+            set.abort_all();
+            // Keep what finished so the retry resumes from here.
+            if let Err(e) = state.save(&file, &state_path).await {
+                warn!("Failed to save download state: {}", e);
             }
+            return Err(failure);
         }
 
-        Self::assemble_parts(&parts_dir, &self.config.output_path, total_chunks).await?;
-
-        let _ = tokio::fs::remove_dir_all(&parts_dir).await;
-
-        Ok(())
-    }
-
-    fn parts_dir(&self) -> PathBuf {
-        let mut p = self.config.output_path.to_string_lossy().to_string();
-        p.push_str(".parts");
-        PathBuf::from(p)
-    }
+        if let (Some(expected), Some(hash)) = (&self.config.checksum, state.hash.take()) {
+            let actual = hex::encode(hash.finalize());
+            if !actual.eq_ignore_ascii_case(expected) {
+                if let Some(seeds) = &seeds {
+                    seeds.remove(expected);
+                }
+                drop(live_seed);
+                drop(file);
+                let _ = tokio::fs::remove_file(&partial_path).await;
+                let _ = tokio::fs::remove_file(&state_path).await;
+                return Err(anyhow!(
+                    "Checksum verification failed. Expected: {}, Actual: {}",
+                    expected,
+                    actual
+                ));
+            }
+            info!("Checksum verification passed");
+        }
 
-    fn part_path(parts_dir: &Path, index: usize) -> PathBuf {
-        parts_dir.join(format!("part-{}", index))
-    }
+        let sync = file.clone();
+        tokio::task::spawn_blocking(move || sync.sync_all()).await??;
+        tokio::fs::rename(&partial_path, output_path).await?;
+        let _ = tokio::fs::remove_file(&state_path).await;
+        if from_peers > 0 {
+            info!("{} of {} pieces came from peers", from_peers, chunks.len());
+        }
 
-    async fn assemble_parts(parts_dir: &Path, output_path: &Path, total_parts: usize) -> Result<()> {
-        let mut out = tokio::fs::File::create(output_path).await?;
-        for i in 0..total_parts {
-            let part = Self::part_path(parts_dir, i);
-            let mut f = tokio::fs::File::open(&part).await?;
-            tokio::io::copy(&mut f, &mut out).await?;
+        if let (Some(seeds), Some(checksum)) = (&seeds, &self.config.checksum) {
+            // Pieces finished before an older version resumed this download
+            // have no hash; open_seed indexes such files later.
+            let piece_hashes: Option<Vec<[u8; 32]>> = state
+                .piece_hashes
+                .iter()
+                .map(|h| hex::decode(h).ok()?.try_into().ok())
+                .collect();
+            if let Some(piece_hashes) = piece_hashes {
+                model_peers::save_piece_index(
+                    output_path,
+                    checksum,
+                    total_size,
+                    piece_size,
+                    &piece_hashes,
+                )
+                .await?;
+                let seed = live_seed.unwrap_or_else(|| {
+                    Arc::new(SeedFile::new(
+                        checksum.clone(),
+                        total_size,
+                        piece_size,
+                        file.clone(),
+                    ))
+                });
+                seed.finish(piece_hashes);
+                seeds.insert(seed);
+            }
         }
-        out.sync_all().await?;
+
         Ok(())
     }
 
-    async fn download_chunk_to_part(
+    /// Fetch one piece, from a peer if one has it or else from the origin,
+    /// and write it at its offset. The bytes are returned for hashing when
+    /// `keep` is set, and the piece's own hash when `hash_piece` is.
+    async fn download_chunk_at(
         client: Client,
-        url: &str,
-        output_path: &Path,
-        parts_dir: &Path,
+        url: String,
+        peers: Option<Arc<PeerPieces>>,
+        file: Arc<std::fs::File>,
         chunk: DownloadChunk,
-        downloaded_bytes: Arc<Mutex<u64>>,
+        keep: bool,
+        hash_piece: bool,
+        downloaded_bytes: Arc<AtomicU64>,
         total_size: u64,
         progress_callback: Option<Arc<ProgressCallback>>,
         start_time: std::time::Instant,
         baseline_downloaded: u64,
-    ) -> Result<()> {
-        let _ = output_path;
-        let part_path = Self::part_path(parts_dir, chunk.index);
-
-        let existing_len = match tokio::fs::metadata(&part_path).await {
-            Ok(meta) => meta.len(),
-            Err(_) => 0,
-        };
-
-        let max_len = (chunk.end - chunk.start) + 1;
-        let existing_len = existing_len.min(max_len);
-        let start = chunk.start + existing_len;
-        if start > chunk.end {
-            return Ok(());
+    ) -> Result<FetchedPiece> {
+        if let Some(peers) = &peers {
+            match peers.fetch(chunk.index, chunk.len() as usize).await {
+                Ok(bytes) => {
+                    let downloaded = downloaded_bytes
+                        .fetch_add(bytes.len() as u64, Ordering::Relaxed)
+                        + bytes.len() as u64;
+                    if let Some(callback) = progress_callback.as_ref() {
+                        callback(progress_at(
+                            downloaded,
+                            total_size,
+                            start_time,
+                            baseline_downloaded,
+                        ));
+                    }
+                    let write = bytes.clone();
+                    tokio::task::spawn_blocking(move || write_all_at(&file, &write, chunk.start))
+                        .await??;
+                    return Ok(FetchedPiece {
+                        chunk,
+                        bytes: if keep { bytes } else { Bytes::new() },
+                        // Already checked against this hash.
+                        digest: Some(peers.piece_hashes()[chunk.index]),
+                        from_peer: true,
+                    });
+                }
+                Err(e) => debug!("Piece {} from origin: {}", chunk.index, e),
+            }
         }
 
-        let range_header = format!("bytes={}-{}", start, chunk.end);
-        let response = client.get(url).header("Range", range_header).send().await?;
+        let range_header = format!("bytes={}-{}", chunk.start, chunk.end);
+        let response = client
+            .get(&url)
+            .header("Range", range_header)
+            .send()
+            .await?;
 
         if response.status() != 206 {
             return Err(anyhow!(
@@ -474,63 +658,71 @@ impl ModelDownloader {
             ));
         }
 
-        let mut file = tokio::fs::OpenOptions::new()
-            .write(true)
-            .create(true)
-            .append(true)
-            .open(&part_path)
-            .await?;
-
+        let mut buf = BytesMut::with_capacity(chunk.len() as usize);
         let mut stream = response.bytes_stream();
         let mut last_report = std::time::Instant::now();
 
-        loop {
+        let received = loop {
             let next = timeout(Duration::from_secs(30), stream.next()).await;
             match next {
-                Ok(Some(item)) => {
-                    let bytes = item?;
-                    file.write_all(&bytes).await?;
+                Ok(Some(Ok(bytes))) => {
+                    buf.extend_from_slice(&bytes);
 
-                    let mut downloaded = downloaded_bytes.lock().await;
-                    *downloaded += bytes.len() as u64;
+                    let downloaded = downloaded_bytes
+                        .fetch_add(bytes.len() as u64, Ordering::Relaxed)
+                        + bytes.len() as u64;
 
                     if let Some(callback) = progress_callback.as_ref() {
                         if last_report.elapsed().as_secs() >= 1 {
                             last_report = std::time::Instant::now();
-                            let elapsed_secs = start_time.elapsed().as_secs();
-                            let downloaded_since_start = downloaded.saturating_sub(baseline_downloaded);
-                            let speed_bps = if elapsed_secs > 0 {
-                                downloaded_since_start / elapsed_secs
-                            } else {
-                                0
-                            };
-                            let progress = DownloadProgress {
-                                downloaded_bytes: *downloaded,
-                                total_bytes: total_size,
-                                percentage: (*downloaded as f64) / (total_size as f64),
-                                speed_bps,
-                                eta_seconds: if speed_bps > 0 {
-                                    Some((total_size - *downloaded) / speed_bps)
-                                } else {
-                                    None
-                                },
-                            };
-                            callback(progress);
+                            callback(progress_at(
+                                downloaded,
+                                total_size,
+                                start_time,
+                                baseline_downloaded,
+                            ));
                         }
                     }
                 }
-                Ok(None) => break,
-                Err(_) => {
-                    return Err(anyhow!(
-                        "Chunk download stalled (timeout waiting for data)"
-                    ));
+                Ok(Some(Err(e))) => break Err(e.into()),
+                Ok(None) if buf.len() as u64 == chunk.len() => break Ok(()),
+                Ok(None) => {
+                    break Err(anyhow!(
+                        "Chunk {} ended early ({} of {} bytes)",
+                        chunk.index,
+                        buf.len(),
+                        chunk.len()
+                    ))
                 }
+                Err(_) => break Err(anyhow!("Chunk download stalled (timeout waiting for data)")),
             }
+        };
+        if let Err(e) = received {
+            // The piece is fetched again from its start.
+            downloaded_bytes.fetch_sub(buf.len() as u64, Ordering::Relaxed);
+            return Err(e);
         }
 
-        file.flush().await?;
+        let bytes = buf.freeze();
+        let write = bytes.clone();
+        let digest = tokio::task::spawn_blocking(move || -> std::io::Result<_> {
+            write_all_at(&file, &write, chunk.start)?;
+            Ok(hash_piece.then(|| model_peers::sha256(&write)))
+        })
+        .await??;
+
+        Ok(FetchedPiece {
+            chunk,
+            bytes: if keep { bytes } else { Bytes::new() },
+            digest,
+            from_peer: false,
+        })
+    }
 
-        Ok(())
+    /// Remove an interrupted parallel download.
+    async fn discard_partial(&self) {
+        let _ = tokio::fs::remove_file(partial_path(&self.config.output_path)).await;
+        let _ = tokio::fs::remove_file(state_path(&self.config.output_path)).await;
     }
 
     /// Verify file integrity using SHA256 checksum
@@ -703,6 +895,295 @@ struct DownloadChunk {
     index: usize,
 }
 
+impl DownloadChunk {
+    fn len(&self) -> u64 {
+        self.end - self.start + 1
+    }
+}
+
+struct FetchedPiece {
+    chunk: DownloadChunk,
+    /// Empty unless the whole-file hash still needs it.
+    bytes: Bytes,
+    digest: Option<[u8; 32]>,
+    from_peer: bool,
+}
+
+fn progress_at(
+    downloaded: u64,
+    total_size: u64,
+    start_time: std::time::Instant,
+    baseline_downloaded: u64,
+) -> DownloadProgress {
+    let elapsed_secs = start_time.elapsed().as_secs();
+    let speed_bps = if elapsed_secs > 0 {
+        downloaded.saturating_sub(baseline_downloaded) / elapsed_secs
+    } else {
+        0
+    };
+    DownloadProgress {
+        downloaded_bytes: downloaded,
+        total_bytes: total_size,
+        percentage: (downloaded as f64) / (total_size as f64),
+        speed_bps,
+        eta_seconds: if speed_bps > 0 {
+            Some(total_size.saturating_sub(downloaded) / speed_bps)
+        } else {
+            None
+        },
+    }
+}
+
+// Pieces each worker may run ahead of the hash.
+const PENDING_PIECES_PER_WORKER: usize = 2;
+// Finished bytes between saves of the download state.
+const STATE_SAVE_BYTES: u64 = 64 * 1024 * 1024;
+
+fn partial_path(output_path: &Path) -> PathBuf {
+    let mut p = output_path.as_os_str().to_owned();
+    p.push(".part");
+    PathBuf::from(p)
+}
+
+fn state_path(output_path: &Path) -> PathBuf {
+    let mut p = output_path.as_os_str().to_owned();
+    p.push(".part.state");
+    PathBuf::from(p)
+}
+
+fn legacy_parts_dir(output_path: &Path) -> PathBuf {
+    let mut p = output_path.as_os_str().to_owned();
+    p.push(".parts");
+    PathBuf::from(p)
+}
+
+/// Progress of a parallel download, saved next to its `.part` file.
+#[derive(Debug, Serialize, Deserialize)]
+struct DownloadState {
+    url: String,
+    total_size: u64,
+    chunk_size: u64,
+    /// Pieces written to the `.part` file.
+    done: Vec<bool>,
+    /// Leading pieces already folded into `hash`.
+    settled: usize,
+    /// Present when a checksum is being verified.
+    hash: Option<Sha256State>,
+    /// Hex SHA-256 of each finished piece, when seeding; empty otherwise.
+    #[serde(default)]
+    piece_hashes: Vec<String>,
+}
+
+impl DownloadState {
+    fn new(config: &DownloadConfig, total_size: u64, chunk_size: u64, chunk_count: usize) -> Self {
+        Self {
+            url: config.url.clone(),
+            total_size,
+            chunk_size,
+            done: vec![false; chunk_count],
+            settled: 0,
+            hash: config.checksum.as_ref().map(|_| Sha256State::new()),
+            piece_hashes: vec![String::new(); chunk_count],
+        }
+    }
+
+    fn matches(
+        &self,
+        config: &DownloadConfig,
+        total_size: u64,
+        chunk_size: u64,
+        chunk_count: usize,
+    ) -> bool {
+        self.url == config.url
+            && self.total_size == total_size
+            && self.chunk_size == chunk_size
+            && self.done.len() == chunk_count
+            && self.piece_hashes.len() == chunk_count
+            && self.settled <= chunk_count
+            && self.done[..self.settled].iter().all(|done| *done)
+            && self.hash.is_some() == config.checksum.is_some()
+    }
+
+    fn done_bytes(&self) -> u64 {
+        (0..self.done.len())
+            .filter(|&i| self.done[i])
+            .map(|i| {
+                let start = i as u64 * self.chunk_size;
+                (start + self.chunk_size).min(self.total_size) - start
+            })
+            .sum()
+    }
+
+    async fn load(path: &Path) -> Option<Self> {
+        let data = tokio::fs::read(path).await.ok()?;
+        serde_json::from_slice(&data).ok()
+    }
+
+    /// Flush `file` first, so pieces marked done are on disk.
+    async fn save(&self, file: &Arc<std::fs::File>, path: &Path) -> Result<()> {
+        let sync = file.clone();
+        tokio::task::spawn_blocking(move || sync.sync_data()).await??;
+        let mut tmp = path.as_os_str().to_owned();
+        tmp.push(".tmp");
+        tokio::fs::write(&tmp, serde_json::to_vec(self)?).await?;
+        tokio::fs::rename(&tmp, path).await?;
+        Ok(())
+    }
+}
+
+/// Bytes already downloaded by an interrupted parallel download of
+/// `output_path`, for reporting resume progress.
+pub async fn partial_download_size(output_path: &Path) -> u64 {
+    match DownloadState::load(&state_path(output_path)).await {
+        Some(state) => state.done_bytes(),
+        None => 0,
+    }
+}
+
+const SHA256_INIT: [u32; 8] = [
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+];
+
+/// SHA-256 whose intermediate state can be saved and restored, so a resumed
+/// download hashes only the bytes it has not hashed before.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+struct Sha256State {
+    h: [u32; 8],
+    len: u64,
+    /// Bytes of an incomplete 64-byte block.
+    tail: Vec<u8>,
+}
+
+impl Sha256State {
+    fn new() -> Self {
+        Self {
+            h: SHA256_INIT,
+            len: 0,
+            tail: Vec::with_capacity(64),
+        }
+    }
+
+    fn update(&mut self, mut data: &[u8]) {
+        self.len += data.len() as u64;
+        if !self.tail.is_empty() {
+            let take = (64 - self.tail.len()).min(data.len());
+            self.tail.extend_from_slice(&data[..take]);
+            data = &data[take..];
+            if self.tail.len() < 64 {
+                return;
+            }
+            let block = std::mem::take(&mut self.tail);
+            self.compress(&block);
+        }
+        let full = data.len() - data.len() % 64;
+        self.compress(&data[..full]);
+        self.tail.extend_from_slice(&data[full..]);
+    }
+
+    fn finalize(mut self) -> [u8; 32] {
+        let bit_len = self.len.wrapping_mul(8);
+        let mut last = std::mem::take(&mut self.tail);
+        last.push(0x80);
+        while last.len() % 64 != 56 {
+            last.push(0);
+        }
+        last.extend_from_slice(&bit_len.to_be_bytes());
+        self.compress(&last);
+
+        let mut out = [0u8; 32];
+        for (word, bytes) in self.h.iter().zip(out.chunks_exact_mut(4)) {
+            bytes.copy_from_slice(&word.to_be_bytes());
+        }
+        out
+    }
+
+    /// `data` must be a whole number of blocks.
+    fn compress(&mut self, data: &[u8]) {
+        for block in data.chunks_exact(64) {
+            sha2::compress256(
+                &mut self.h,
+                std::slice::from_ref(GenericArray::from_slice(block)),
+            );
+        }
+    }
+}
+
+async fn read_chunk(file: Arc<std::fs::File>, chunk: DownloadChunk) -> Result<Bytes> {
+    let bytes = tokio::task::spawn_blocking(move || -> std::io::Result<Vec<u8>> {
+        let mut buf = vec![0u8; chunk.len() as usize];
+        read_exact_at(&file, &mut buf, chunk.start)?;
+        Ok(buf)
+    })
+    .await??;
+    Ok(Bytes::from(bytes))
+}
+
+/// Reserve `len` bytes up front so pieces written out of order do not
+/// fragment the file (or fail half way when the disk fills up).
+fn preallocate(file: &std::fs::File, len: u64) -> std::io::Result<()> {
+    #[cfg(any(target_os = "linux", target_os = "android"))]
+    {
+        use std::os::fd::AsRawFd;
+        if let Ok(off) = libc::off_t::try_from(len) {
+            if unsafe { libc::fallocate(file.as_raw_fd(), 0, 0, off) } == 0 {
+                return Ok(());
+            }
+            let err = std::io::Error::last_os_error();
+            if err.raw_os_error() == Some(libc::ENOSPC) {
+                return Err(err);
+            }
+        }
+    }
+    // Not supported by the filesystem: a sparse file still works.
+    file.set_len(len)
+}
+
+fn write_all_at(file: &std::fs::File, buf: &[u8], offset: u64) -> std::io::Result<()> {
+    #[cfg(unix)]
+    {
+        std::os::unix::fs::FileExt::write_all_at(file, buf, offset)
+    }
+    #[cfg(windows)]
+    {
+        use std::os::windows::fs::FileExt;
+        let (mut buf, mut offset) = (buf, offset);
+        while !buf.is_empty() {
+            let n = file.seek_write(buf, offset)?;
+            if n == 0 {
+                return Err(std::io::ErrorKind::WriteZero.into());
+            }
+            buf = &buf[n..];
+            offset += n as u64;
+        }
+        Ok(())
+    }
+}
+
+pub(crate) fn read_exact_at(
+    file: &std::fs::File,
+    buf: &mut [u8],
+    offset: u64,
+) -> std::io::Result<()> {
+    #[cfg(unix)]
+    {
+        std::os::unix::fs::FileExt::read_exact_at(file, buf, offset)
+    }
+    #[cfg(windows)]
+    {
+        use std::os::windows::fs::FileExt;
+        let (mut buf, mut offset) = (buf, offset);
+        while !buf.is_empty() {
+            let n = file.seek_read(buf, offset)?;
+            if n == 0 {
+                return Err(std::io::ErrorKind::UnexpectedEof.into());
+            }
+            buf = &mut std::mem::take(&mut buf)[n..];
+            offset += n as u64;
+        }
+        Ok(())
+    }
+}
+
 /// Convenience function for simple downloads
 pub async fn download_model(url: &str, output_path: &Path) -> Result<()> {
     let config = DownloadConfig {
@@ -757,8 +1238,31 @@ mod tests {
         let chunks = downloader.calculate_chunks(0, 500, 500);
         assert_eq!(chunks.len(), 1);
 
-        // Test large file (multiple chunks)
+        // Test large file (chunk_size pieces covering the whole file)
         let chunks = downloader.calculate_chunks(0, 5000, 5000);
-        assert_eq!(chunks.len(), 4);
+        assert_eq!(chunks.len(), 5);
+        assert_eq!(chunks[4].start, 4096);
+        assert_eq!(chunks[4].end, 4999);
+        assert_eq!(chunks.iter().map(|c| c.len()).sum::<u64>(), 5000);
+    }
+
+    #[test]
+    fn test_sha256_state_resumes() {
+        use sha2::{Digest, Sha256};
+
+        let data: Vec<u8> = (0..10_000u32).map(|i| (i * 31 % 251) as u8).collect();
+        for split in [0, 1, 63, 64, 65, 4096, 9_999] {
+            let mut state = Sha256State::new();
+            state.update(&data[..split]);
+            let saved = serde_json::to_vec(&state).unwrap();
+            let mut state: Sha256State = serde_json::from_slice(&saved).unwrap();
+            state.update(&data[split..]);
+            assert_eq!(
+                state.finalize().as_slice(),
+                Sha256::digest(&data).as_slice(),
+                "split at {}",
+                split
+            );
+        }
     }
 }
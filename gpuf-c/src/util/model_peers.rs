@@ -0,0 +1,676 @@
+//! Model distribution between workers.
+//!
+//! A worker downloading a model gets a list of peers from the server
+//! (`CommandV2::ModelPeers`) and fetches each piece from a peer holding it
+//! before falling back to the origin URL. Every piece is checked against the
+//! hash list handed out by the server, and the whole file still has to pass
+//! its checksum before it is used.
+//!
+//! In turn every worker serves the pieces it holds on `--p2p-seed-port`,
+//! while downloading and afterwards. Pieces go over plain TCP straight
+//! between workers; relaying them through TURN would cost the same egress
+//! the peers are meant to save. A completed model keeps its piece hashes in
+//! a `<model>.pieces` file, so it can be seeded again after a restart.
+
+use super::model_downloader::read_exact_at;
+
+use anyhow::{anyhow, Result};
+use bytes::{Bytes, BytesMut};
+use common::{read_command, write_command, Command, CommandV2, ModelPeer};
+use serde::{Deserialize, Serialize};
+use sha2::{Digest, Sha256};
+use std::collections::HashMap;
+use std::io::Read;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::{Arc, Mutex, OnceLock, RwLock};
+use tokio::io::{AsyncReadExt, AsyncWriteExt};
+use tokio::net::{TcpListener, TcpStream};
+use tokio::sync::Semaphore;
+use tokio::time::{timeout, Duration};
+use tracing::{debug, info, warn};
+
+const CONNECT_TIMEOUT: Duration = Duration::from_secs(3);
+/// Allowed gap between reads of a piece, on either side.
+const IO_TIMEOUT: Duration = Duration::from_secs(30);
+/// Peers tried for one piece before falling back to the origin.
+const PEERS_PER_PIECE: usize = 3;
+/// Failed fetches after which a peer is no longer asked.
+const MAX_PEER_FAILURES: u32 = 3;
+/// Pieces uploaded at once; further requests are told to go elsewhere.
+const MAX_UPLOADS: usize = 4;
+// Limit on the seed addresses the server accepts.
+const MAX_SEED_ADDRS: usize = 8;
+
+pub fn bitmap_len(pieces: usize) -> usize {
+    pieces.div_ceil(8)
+}
+
+pub fn has_piece(bitmap: &[u8], index: usize) -> bool {
+    bitmap
+        .get(index / 8)
+        .is_some_and(|byte| byte & (1 << (index % 8)) != 0)
+}
+
+pub fn set_piece(bitmap: &mut [u8], index: usize) {
+    if let Some(byte) = bitmap.get_mut(index / 8) {
+        *byte |= 1 << (index % 8);
+    }
+}
+
+pub fn piece_count(total_size: u64, piece_size: u64) -> usize {
+    total_size.div_ceil(piece_size.max(1)) as usize
+}
+
+pub fn sha256(data: &[u8]) -> [u8; 32] {
+    Sha256::digest(data).into()
+}
+
+struct Peer {
+    addrs: Vec<String>,
+    have: Vec<u8>,
+    failures: AtomicU32,
+}
+
+/// Peers that can serve a model, as announced by the server.
+pub struct PeerPieces {
+    checksum: String,
+    total_size: u64,
+    piece_size: u64,
+    piece_hashes: Vec<[u8; 32]>,
+    peers: Vec<Peer>,
+}
+
+impl PeerPieces {
+    /// Returns None when the announcement does not describe a usable layout.
+    pub fn new(
+        checksum: String,
+        total_size: u64,
+        piece_size: u32,
+        piece_hashes: Vec<[u8; 32]>,
+        peers: Vec<ModelPeer>,
+    ) -> Option<Self> {
+        let pieces = piece_count(total_size, piece_size as u64);
+        if piece_size == 0 || pieces == 0 || piece_hashes.len() != pieces {
+            return None;
+        }
+        let peers: Vec<Peer> = peers
+            .into_iter()
+            .filter(|peer| peer.have.len() == bitmap_len(pieces) && !peer.addrs.is_empty())
+            .map(|peer| Peer {
+                addrs: peer.addrs,
+                have: peer.have,
+                failures: AtomicU32::new(0),
+            })
+            .collect();
+        if peers.is_empty() {
+            return None;
+        }
+        Some(Self {
+            checksum,
+            total_size,
+            piece_size: piece_size as u64,
+            piece_hashes,
+            peers,
+        })
+    }
+
+    pub fn checksum(&self) -> &str {
+        &self.checksum
+    }
+
+    pub fn total_size(&self) -> u64 {
+        self.total_size
+    }
+
+    pub fn piece_size(&self) -> u64 {
+        self.piece_size
+    }
+
+    pub fn piece_hashes(&self) -> &[[u8; 32]] {
+        &self.piece_hashes
+    }
+
+    pub fn peer_count(&self) -> usize {
+        self.peers.len()
+    }
+
+    /// Fetch piece `index` (`len` bytes) from a peer that holds it and check
+    /// it against its hash. Peers are tried in an order that depends on the
+    /// piece, so parallel fetches spread over them.
+    pub async fn fetch(&self, index: usize, len: usize) -> Result<Bytes> {
+        let expected = self
+            .piece_hashes
+            .get(index)
+            .ok_or_else(|| anyhow!("Piece {} out of range", index))?;
+        let holders: Vec<&Peer> = self
+            .peers
+            .iter()
+            .filter(|peer| {
+                has_piece(&peer.have, index)
+                    && peer.failures.load(Ordering::Relaxed) < MAX_PEER_FAILURES
+            })
+            .collect();
+        if holders.is_empty() {
+            return Err(anyhow!("No peer holds piece {}", index));
+        }
+
+        let mut last_error = None;
+        for i in 0..holders.len().min(PEERS_PER_PIECE) {
+            let peer = holders[(index + i) % holders.len()];
+            match self.fetch_from(peer, index, len, expected).await {
+                Ok(Some(bytes)) => {
+                    peer.failures.store(0, Ordering::Relaxed);
+                    return Ok(bytes);
+                }
+                // Busy, or the server's view of its pieces is stale.
+                Ok(None) => {}
+                Err(e) => {
+                    debug!("Piece {} from {:?} failed: {}", index, peer.addrs, e);
+                    peer.failures.fetch_add(1, Ordering::Relaxed);
+                    last_error = Some(e);
+                }
+            }
+        }
+        Err(last_error.unwrap_or_else(|| anyhow!("No peer could serve piece {}", index)))
+    }
+
+    /// None when the peer declined the request.
+    async fn fetch_from(
+        &self,
+        peer: &Peer,
+        index: usize,
+        len: usize,
+        expected: &[u8; 32],
+    ) -> Result<Option<Bytes>> {
+        let mut stream = connect_any(&peer.addrs).await?;
+        let request = Command::V2(CommandV2::ModelPieceRequest {
+            checksum: self.checksum.clone(),
+            index: index as u32,
+        });
+        write_command(&mut stream, &request).await?;
+
+        let mut frame = BytesMut::new();
+        let response = timeout(IO_TIMEOUT, read_command(&mut stream, &mut frame))
+            .await
+            .map_err(|_| anyhow!("Timed out waiting for piece {}", index))??;
+        match response {
+            Command::V2(CommandV2::ModelPieceResponse {
+                index: got,
+                len: got_len,
+                error: None,
+            }) if got as usize == index && got_len as usize == len => {}
+            Command::V2(CommandV2::ModelPieceResponse { error: Some(e), .. }) => {
+                debug!("Peer {:?} declined piece {}: {}", peer.addrs, index, e);
+                return Ok(None);
+            }
+            _ => return Err(anyhow!("Unexpected response to piece {}", index)),
+        }
+
+        let mut buf = BytesMut::with_capacity(len);
+        while buf.len() < len {
+            let mut limited = (&mut stream).take((len - buf.len()) as u64);
+            let n = timeout(IO_TIMEOUT, limited.read_buf(&mut buf))
+                .await
+                .map_err(|_| anyhow!("Piece {} stalled", index))??;
+            if n == 0 {
+                return Err(anyhow!("Peer closed during piece {}", index));
+            }
+        }
+
+        let bytes = buf.freeze();
+        let check = bytes.clone();
+        let actual = tokio::task::spawn_blocking(move || sha256(&check)).await?;
+        if &actual != expected {
+            return Err(anyhow!("Piece {} failed its hash", index));
+        }
+        Ok(Some(bytes))
+    }
+}
+
+async fn connect_any(addrs: &[String]) -> Result<TcpStream> {
+    let mut last_error = None;
+    for addr in addrs {
+        match timeout(CONNECT_TIMEOUT, TcpStream::connect(addr.as_str())).await {
+            Ok(Ok(stream)) => {
+                let _ = stream.set_nodelay(true);
+                return Ok(stream);
+            }
+            Ok(Err(e)) => last_error = Some(anyhow!("{}: {}", addr, e)),
+            Err(_) => last_error = Some(anyhow!("{}: connect timed out", addr)),
+        }
+    }
+    Err(last_error.unwrap_or_else(|| anyhow!("Peer has no addresses")))
+}
+
+struct SeedPieces {
+    have: Vec<u8>,
+    /// Set once the whole file has passed its checksum.
+    piece_hashes: Vec<[u8; 32]>,
+}
+
+/// A model file, complete or still downloading, served to peers.
+pub struct SeedFile {
+    checksum: String,
+    total_size: u64,
+    piece_size: u64,
+    file: Arc<std::fs::File>,
+    pieces: Mutex<SeedPieces>,
+}
+
+impl SeedFile {
+    /// A file being downloaded; pieces are served once marked.
+    pub fn new(
+        checksum: String,
+        total_size: u64,
+        piece_size: u64,
+        file: Arc<std::fs::File>,
+    ) -> Self {
+        let pieces = piece_count(total_size, piece_size);
+        Self {
+            checksum,
+            total_size,
+            piece_size,
+            file,
+            pieces: Mutex::new(SeedPieces {
+                have: vec![0; bitmap_len(pieces)],
+                piece_hashes: Vec::new(),
+            }),
+        }
+    }
+
+    fn complete(
+        checksum: String,
+        total_size: u64,
+        piece_size: u64,
+        file: Arc<std::fs::File>,
+        piece_hashes: Vec<[u8; 32]>,
+    ) -> Self {
+        let seed = Self::new(checksum, total_size, piece_size, file);
+        seed.finish(piece_hashes);
+        seed
+    }
+
+    pub fn checksum(&self) -> &str {
+        &self.checksum
+    }
+
+    /// Piece `index` was written and matches the announced hash.
+    pub fn mark(&self, index: usize) {
+        let mut pieces = self.pieces.lock().unwrap_or_else(|e| e.into_inner());
+        set_piece(&mut pieces.have, index);
+    }
+
+    /// Every piece is present and the file passed its checksum.
+    pub fn finish(&self, piece_hashes: Vec<[u8; 32]>) {
+        let count = piece_count(self.total_size, self.piece_size);
+        let mut pieces = self.pieces.lock().unwrap_or_else(|e| e.into_inner());
+        for index in 0..count {
+            set_piece(&mut pieces.have, index);
+        }
+        pieces.piece_hashes = piece_hashes;
+    }
+
+    fn piece_len(&self, index: usize) -> Option<u64> {
+        let start = index as u64 * self.piece_size;
+        (start < self.total_size).then(|| self.piece_size.min(self.total_size - start))
+    }
+
+    fn holds(&self, index: usize) -> bool {
+        let pieces = self.pieces.lock().unwrap_or_else(|e| e.into_inner());
+        has_piece(&pieces.have, index)
+    }
+
+    fn advertisement(&self, seed_port: u16, seed_addrs: Vec<String>) -> CommandV2 {
+        let pieces = self.pieces.lock().unwrap_or_else(|e| e.into_inner());
+        CommandV2::ModelPiecesAvailable {
+            checksum: self.checksum.clone(),
+            total_size: self.total_size,
+            piece_size: self.piece_size as u32,
+            have: pieces.have.clone(),
+            piece_hashes: pieces.piece_hashes.clone(),
+            seed_port,
+            seed_addrs,
+        }
+    }
+}
+
+/// Model files this worker serves, by checksum.
+pub struct SeedRegistry {
+    port: u16,
+    files: RwLock<HashMap<String, Arc<SeedFile>>>,
+    uploads: Semaphore,
+}
+
+static SEEDS: OnceLock<Option<Arc<SeedRegistry>>> = OnceLock::new();
+
+/// Start serving pieces on `port` (0 disables seeding). Only the first call
+/// binds; later calls return the same registry.
+pub fn start_seeding(port: u16) -> Option<Arc<SeedRegistry>> {
+    SEEDS
+        .get_or_init(|| {
+            if port == 0 {
+                return None;
+            }
+            let listener = std::net::TcpListener::bind(("0.0.0.0", port)).and_then(|listener| {
+                listener.set_nonblocking(true)?;
+                TcpListener::from_std(listener)
+            });
+            let listener = match listener {
+                Ok(listener) => listener,
+                Err(e) => {
+                    warn!(
+                        "Model seeding disabled, cannot listen on port {}: {}",
+                        port, e
+                    );
+                    return None;
+                }
+            };
+            let registry = Arc::new(SeedRegistry {
+                port,
+                files: RwLock::new(HashMap::new()),
+                uploads: Semaphore::new(MAX_UPLOADS),
+            });
+            info!("Serving model pieces to peers on port {}", port);
+            tokio::spawn(registry.clone().serve(listener));
+            Some(registry)
+        })
+        .clone()
+}
+
+impl SeedRegistry {
+    pub fn insert(&self, seed: Arc<SeedFile>) {
+        let mut files = self.files.write().unwrap_or_else(|e| e.into_inner());
+        files.insert(seed.checksum.clone(), seed);
+    }
+
+    pub fn get(&self, checksum: &str) -> Option<Arc<SeedFile>> {
+        let files = self.files.read().unwrap_or_else(|e| e.into_inner());
+        files.get(checksum).cloned()
+    }
+
+    pub fn remove(&self, checksum: &str) {
+        let mut files = self.files.write().unwrap_or_else(|e| e.into_inner());
+        files.remove(checksum);
+    }
+
+    /// What to tell the server about `checksum`; peers try `seed_addrs`
+    /// (host:port, nearest first) before the address the server sees.
+    pub fn advertisement(&self, checksum: &str, mut seed_addrs: Vec<String>) -> Option<CommandV2> {
+        seed_addrs.truncate(MAX_SEED_ADDRS - 1);
+        Some(self.get(checksum)?.advertisement(self.port, seed_addrs))
+    }
+
+    pub fn port(&self) -> u16 {
+        self.port
+    }
+
+    async fn serve(self: Arc<Self>, listener: TcpListener) {
+        loop {
+            match listener.accept().await {
+                Ok((stream, addr)) => {
+                    let registry = self.clone();
+                    tokio::spawn(async move {
+                        if let Err(e) = registry.serve_peer(stream).await {
+                            debug!("Seed connection from {} ended: {}", addr, e);
+                        }
+                    });
+                }
+                Err(e) => {
+                    warn!("Seed listener accept failed: {}", e);
+                    tokio::time::sleep(Duration::from_secs(1)).await;
+                }
+            }
+        }
+    }
+
+    async fn serve_peer(&self, mut stream: TcpStream) -> Result<()> {
+        let _ = stream.set_nodelay(true);
+        let mut frame = BytesMut::new();
+        loop {
+            let request = match timeout(IO_TIMEOUT, read_command(&mut stream, &mut frame)).await {
+                Ok(request) => request?,
+                Err(_) => return Ok(()),
+            };
+            let Command::V2(CommandV2::ModelPieceRequest { checksum, index }) = request else {
+                return Err(anyhow!("Unexpected command on seed port"));
+            };
+            let index = index as usize;
+
+            let seed = self.get(&checksum);
+            let piece = seed
+                .as_ref()
+                .filter(|seed| seed.holds(index))
+                .and_then(|seed| Some((seed.clone(), seed.piece_len(index)?)));
+            let Some((seed, len)) = piece else {
+                refuse(&mut stream, index, "piece not held").await?;
+                continue;
+            };
+            let Ok(_permit) = self.uploads.try_acquire() else {
+                refuse(&mut stream, index, "busy").await?;
+                continue;
+            };
+
+            let file = seed.file.clone();
+            let offset = index as u64 * seed.piece_size;
+            let bytes = tokio::task::spawn_blocking(move || -> std::io::Result<Vec<u8>> {
+                let mut buf = vec![0u8; len as usize];
+                read_exact_at(&file, &mut buf, offset)?;
+                Ok(buf)
+            })
+            .await??;
+
+            let response = Command::V2(CommandV2::ModelPieceResponse {
+                index: index as u32,
+                len: len as u32,
+                error: None,
+            });
+            write_command(&mut stream, &response).await?;
+            timeout(IO_TIMEOUT * 4, stream.write_all(&bytes))
+                .await
+                .map_err(|_| anyhow!("Peer stopped reading piece {}", index))??;
+            stream.flush().await?;
+        }
+    }
+}
+
+async fn refuse(stream: &mut TcpStream, index: usize, reason: &str) -> Result<()> {
+    let response = Command::V2(CommandV2::ModelPieceResponse {
+        index: index as u32,
+        len: 0,
+        error: Some(reason.to_string()),
+    });
+    write_command(stream, &response).await
+}
+
+pub fn pieces_path(model_path: &Path) -> PathBuf {
+    let mut p = model_path.as_os_str().to_owned();
+    p.push(".pieces");
+    PathBuf::from(p)
+}
+
+/// Piece hashes of a verified model file, kept next to it.
+#[derive(Serialize, Deserialize)]
+struct PieceIndex {
+    checksum: String,
+    total_size: u64,
+    piece_size: u64,
+    piece_hashes: Vec<String>,
+}
+
+pub async fn save_piece_index(
+    model_path: &Path,
+    checksum: &str,
+    total_size: u64,
+    piece_size: u64,
+    piece_hashes: &[[u8; 32]],
+) -> Result<()> {
+    let index = PieceIndex {
+        checksum: checksum.to_string(),
+        total_size,
+        piece_size,
+        piece_hashes: piece_hashes.iter().map(hex::encode).collect(),
+    };
+    tokio::fs::write(pieces_path(model_path), serde_json::to_vec(&index)?).await?;
+    Ok(())
+}
+
+/// Seed an existing, complete `model_path`; its piece hashes come from the
+/// `.pieces` file, or are computed (verifying `checksum`) when that is
+/// missing or stale. Hashing a large model takes a while, so run this off
+/// the control loop.
+pub async fn open_seed(
+    model_path: &Path,
+    checksum: &str,
+    piece_size: u64,
+) -> Result<Arc<SeedFile>> {
+    let path = model_path.to_path_buf();
+    let file = Arc::new(std::fs::File::open(&path)?);
+    let total_size = file.metadata()?.len();
+
+    if let Some((piece_size, piece_hashes)) = load_piece_index(&path, checksum, total_size).await {
+        return Ok(Arc::new(SeedFile::complete(
+            checksum.to_string(),
+            total_size,
+            piece_size,
+            file,
+            piece_hashes,
+        )));
+    }
+
+    info!("Indexing {:?} for seeding", path);
+    let hashing = file.clone();
+    let (piece_hashes, digest) = tokio::task::spawn_blocking(move || {
+        hash_pieces(&mut std::io::BufReader::new(&*hashing), piece_size)
+    })
+    .await??;
+    if !hex::encode(digest).eq_ignore_ascii_case(checksum) {
+        return Err(anyhow!("{:?} does not match its checksum", path));
+    }
+    save_piece_index(&path, checksum, total_size, piece_size, &piece_hashes).await?;
+    Ok(Arc::new(SeedFile::complete(
+        checksum.to_string(),
+        total_size,
+        piece_size,
+        file,
+        piece_hashes,
+    )))
+}
+
+async fn load_piece_index(
+    path: &Path,
+    checksum: &str,
+    total_size: u64,
+) -> Option<(u64, Vec<[u8; 32]>)> {
+    let data = tokio::fs::read(pieces_path(path)).await.ok()?;
+    let index: PieceIndex = serde_json::from_slice(&data).ok()?;
+    if !index.checksum.eq_ignore_ascii_case(checksum)
+        || index.total_size != total_size
+        || index.piece_size == 0
+        || index.piece_hashes.len() != piece_count(total_size, index.piece_size)
+    {
+        return None;
+    }
+    let piece_hashes = index
+        .piece_hashes
+        .iter()
+        .map(|h| hex::decode(h).ok()?.try_into().ok())
+        .collect::<Option<Vec<[u8; 32]>>>()?;
+    Some((index.piece_size, piece_hashes))
+}
+
+/// SHA-256 of each `piece_size` piece and of the whole stream.
+fn hash_pieces(
+    reader: &mut impl Read,
+    piece_size: u64,
+) -> std::io::Result<(Vec<[u8; 32]>, [u8; 32])> {
+    let mut whole = Sha256::new();
+    let mut piece_hashes = Vec::new();
+    let mut buf = vec![0u8; piece_size as usize];
+    loop {
+        let mut filled = 0;
+        while filled < buf.len() {
+            match reader.read(&mut buf[filled..])? {
+                0 => break,
+                n => filled += n,
+            }
+        }
+        if filled == 0 {
+            break;
+        }
+        whole.update(&buf[..filled]);
+        piece_hashes.push(sha256(&buf[..filled]));
+        if filled < buf.len() {
+            break;
+        }
+    }
+    Ok((piece_hashes, whole.finalize().into()))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_bitmap() {
+        let mut have = vec![0u8; bitmap_len(10)];
+        assert_eq!(have.len(), 2);
+        set_piece(&mut have, 0);
+        set_piece(&mut have, 9);
+        set_piece(&mut have, 16);
+        assert_eq!(have, vec![0b0000_0001, 0b0000_0010]);
+        assert!(has_piece(&have, 9) && !has_piece(&have, 8) && !has_piece(&have, 16));
+    }
+
+    #[tokio::test]
+    async fn test_fetch_piece_from_seed() {
+        let data: Vec<u8> = (0..10_000u32).map(|i| (i % 251) as u8).collect();
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("model.gguf");
+        std::fs::write(&path, &data).unwrap();
+
+        let (piece_hashes, digest) = hash_pieces(&mut &data[..], 4096).unwrap();
+        assert_eq!(piece_hashes.len(), 3);
+        assert_eq!(digest, sha256(&data));
+        let checksum = hex::encode(digest);
+
+        let registry = Arc::new(SeedRegistry {
+            port: 0,
+            files: RwLock::new(HashMap::new()),
+            uploads: Semaphore::new(MAX_UPLOADS),
+        });
+        let seed = Arc::new(SeedFile::new(
+            checksum.clone(),
+            data.len() as u64,
+            4096,
+            Arc::new(std::fs::File::open(&path).unwrap()),
+        ));
+        seed.mark(2);
+        registry.insert(seed);
+        let listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+        let addr = listener.local_addr().unwrap().to_string();
+        tokio::spawn(registry.clone().serve(listener));
+
+        let mut have = vec![0u8; 1];
+        set_piece(&mut have, 1);
+        set_piece(&mut have, 2);
+        let peers = PeerPieces::new(
+            checksum,
+            data.len() as u64,
+            4096,
+            piece_hashes,
+            vec![ModelPeer {
+                client_id: [1; 16],
+                addrs: vec![addr],
+                have,
+            }],
+        )
+        .unwrap();
+
+        let piece = peers.fetch(2, 10_000 - 8192).await.unwrap();
+        assert_eq!(&piece[..], &data[8192..]);
+        // Advertised by the server but not held yet.
+        assert!(peers.fetch(1, 4096).await.is_err());
+        assert!(peers.fetch(0, 4096).await.is_err());
+    }
+}
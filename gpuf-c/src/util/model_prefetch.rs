@@ -0,0 +1,344 @@
+//! Page-cache prefetch for GGUF model files.
+//!
+//! llama.cpp maps the model and faults tensor pages in as inference first
+//! touches them, which on phones turns into many small random reads right when
+//! the first token is wanted. Before a load we parse the GGUF header to find
+//! where tensor data starts and warm that region in file order from a helper
+//! thread. The pages land in the shared page cache, so llama.cpp's own mapping
+//! (and any later load of the same file) finds them resident.
+
+use std::ffi::c_int;
+use std::fs::File;
+use std::io::{self, BufReader, Read, Seek};
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+
+const GGUF_MAGIC: &[u8; 4] = b"GGUF";
+const DEFAULT_ALIGNMENT: u64 = 32;
+/// Bytes hinted or touched per step, so a newer prefetch can take over quickly.
+const WINDOW: usize = 64 * 1024 * 1024;
+// Bounds that only a corrupt header exceeds.
+const MAX_STRING_LEN: u64 = 1 << 24;
+const MAX_DIMS: u32 = 8;
+
+// GGUF metadata value types.
+const TYPE_U32: u32 = 4;
+const TYPE_STRING: u32 = 8;
+const TYPE_ARRAY: u32 = 9;
+
+/// Bumped by every prefetch; older threads stop when it moves on.
+static GENERATION: AtomicU64 = AtomicU64::new(0);
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Prefetch {
+    Off,
+    /// `MADV_WILLNEED` over the tensor data: the kernel reads it in
+    /// asynchronously and the helper returns at once.
+    WillNeed,
+    /// `MADV_SEQUENTIAL` and touch every page in file order, so the whole
+    /// model is resident once the helper finishes.
+    Sequential,
+}
+
+impl Prefetch {
+    /// Map the C API value (0 off, 1 willneed, 2 sequential).
+    pub fn from_raw(value: c_int) -> Option<Self> {
+        match value {
+            0 => Some(Self::Off),
+            1 => Some(Self::WillNeed),
+            2 => Some(Self::Sequential),
+            _ => None,
+        }
+    }
+}
+
+/// Where a GGUF file keeps its tensor data.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct TensorLayout {
+    /// File offset of the first tensor byte.
+    pub data_start: u64,
+    pub data_end: u64,
+    pub tensor_count: u64,
+}
+
+impl TensorLayout {
+    pub fn data_len(&self) -> u64 {
+        self.data_end - self.data_start
+    }
+}
+
+pub fn read_layout(path: &Path) -> io::Result<TensorLayout> {
+    let file = File::open(path)?;
+    let file_size = file.metadata()?.len();
+    parse_layout(&mut BufReader::new(file), file_size)
+}
+
+/// Start warming the tensor data of `path` in the background. Returns the
+/// layout being prefetched, or `None` when prefetch is off, the file is not
+/// GGUF, or the data would not fit comfortably in memory. The load proceeds
+/// the same either way.
+pub fn start(path: &Path, mode: Prefetch) -> Option<TensorLayout> {
+    if mode == Prefetch::Off {
+        return None;
+    }
+    let layout = read_layout(path).ok()?;
+    // Warming more than RAM only evicts what was just read.
+    if physical_memory().is_some_and(|mem| layout.data_len() > mem / 4 * 3) {
+        return None;
+    }
+    let file = File::open(path).ok()?;
+    let generation = GENERATION.fetch_add(1, Ordering::SeqCst) + 1;
+    std::thread::Builder::new()
+        .name("gpuf-prefetch".to_string())
+        .spawn(move || warm(&file, layout, mode, generation))
+        .ok()?;
+    Some(layout)
+}
+
+fn parse_layout<R: Read + Seek>(r: &mut BufReader<R>, file_size: u64) -> io::Result<TensorLayout> {
+    let mut magic = [0u8; 4];
+    r.read_exact(&mut magic)?;
+    if &magic != GGUF_MAGIC {
+        return Err(invalid("not a GGUF file"));
+    }
+    if read_u32(r)? < 2 {
+        return Err(invalid("GGUF v1 is not supported"));
+    }
+    let tensor_count = read_u64(r)?;
+    let kv_count = read_u64(r)?;
+
+    let mut alignment = DEFAULT_ALIGNMENT;
+    for _ in 0..kv_count {
+        let key = read_string(r)?;
+        let value_type = read_u32(r)?;
+        if key == b"general.alignment" && value_type == TYPE_U32 {
+            alignment = read_u32(r)? as u64;
+        } else {
+            skip_value(r, value_type)?;
+        }
+    }
+    if !alignment.is_power_of_two() {
+        return Err(invalid("bad general.alignment"));
+    }
+
+    let mut first_offset = if tensor_count == 0 { 0 } else { u64::MAX };
+    for _ in 0..tensor_count {
+        skip_string(r)?;
+        let n_dims = read_u32(r)?;
+        if n_dims > MAX_DIMS {
+            return Err(invalid("bad tensor rank"));
+        }
+        r.seek_relative(8 * n_dims as i64)?;
+        let _ggml_type = read_u32(r)?;
+        first_offset = first_offset.min(read_u64(r)?);
+    }
+
+    let data_start = r
+        .stream_position()?
+        .next_multiple_of(alignment)
+        .checked_add(first_offset)
+        .filter(|start| *start <= file_size)
+        .ok_or_else(|| invalid("tensor data past end of file"))?;
+    Ok(TensorLayout {
+        data_start,
+        data_end: file_size,
+        tensor_count,
+    })
+}
+
+fn skip_value<R: Read + Seek>(r: &mut BufReader<R>, value_type: u32) -> io::Result<()> {
+    match value_type {
+        TYPE_STRING => skip_string(r),
+        TYPE_ARRAY => {
+            let elem_type = read_u32(r)?;
+            let count = read_u64(r)?;
+            match scalar_size(elem_type) {
+                Some(size) => {
+                    let len = count
+                        .checked_mul(size)
+                        .filter(|len| *len <= i64::MAX as u64)
+                        .ok_or_else(|| invalid("array too long"))?;
+                    r.seek_relative(len as i64)
+                }
+                None => (0..count).try_for_each(|_| skip_value(r, elem_type)),
+            }
+        }
+        _ => {
+            let size = scalar_size(value_type).ok_or_else(|| invalid("unknown value type"))?;
+            r.seek_relative(size as i64)
+        }
+    }
+}
+
+fn scalar_size(value_type: u32) -> Option<u64> {
+    match value_type {
+        0 | 1 | 7 => Some(1),    // u8, i8, bool
+        2 | 3 => Some(2),        // u16, i16
+        4 | 5 | 6 => Some(4),    // u32, i32, f32
+        10 | 11 | 12 => Some(8), // u64, i64, f64
+        _ => None,
+    }
+}
+
+fn read_u32(r: &mut impl Read) -> io::Result<u32> {
+    let mut buf = [0u8; 4];
+    r.read_exact(&mut buf)?;
+    Ok(u32::from_le_bytes(buf))
+}
+
+fn read_u64(r: &mut impl Read) -> io::Result<u64> {
+    let mut buf = [0u8; 8];
+    r.read_exact(&mut buf)?;
+    Ok(u64::from_le_bytes(buf))
+}
+
+fn string_len(r: &mut impl Read) -> io::Result<u64> {
+    let len = read_u64(r)?;
+    if len > MAX_STRING_LEN {
+        return Err(invalid("string too long"));
+    }
+    Ok(len)
+}
+
+fn read_string(r: &mut impl Read) -> io::Result<Vec<u8>> {
+    let mut buf = vec![0u8; string_len(r)? as usize];
+    r.read_exact(&mut buf)?;
+    Ok(buf)
+}
+
+fn skip_string<R: Read + Seek>(r: &mut BufReader<R>) -> io::Result<()> {
+    let len = string_len(r)?;
+    r.seek_relative(len as i64)
+}
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+#[cfg(unix)]
+fn physical_memory() -> Option<u64> {
+    let pages = unsafe { libc::sysconf(libc::_SC_PHYS_PAGES) };
+    let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) };
+    (pages > 0 && page_size > 0).then(|| pages as u64 * page_size as u64)
+}
+
+#[cfg(not(unix))]
+fn physical_memory() -> Option<u64> {
+    None
+}
+
+/// Map the tensor data for this helper alone and advise or touch it
+/// window by window. Unmapping leaves the pages in the page cache.
+#[cfg(unix)]
+fn warm(file: &File, layout: TensorLayout, mode: Prefetch, generation: u64) {
+    use std::os::unix::io::AsRawFd;
+
+    let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) }.max(4096) as u64;
+    let map_start = layout.data_start / page_size * page_size;
+    let len = (layout.data_end - map_start) as usize;
+    if len == 0 {
+        return;
+    }
+    let base = unsafe {
+        libc::mmap(
+            std::ptr::null_mut(),
+            len,
+            libc::PROT_READ,
+            libc::MAP_SHARED,
+            file.as_raw_fd(),
+            map_start as libc::off_t,
+        )
+    };
+    if base == libc::MAP_FAILED {
+        return;
+    }
+    if mode == Prefetch::Sequential {
+        unsafe { libc::madvise(base, len, libc::MADV_SEQUENTIAL) };
+    }
+
+    let started = std::time::Instant::now();
+    let mut offset = 0;
+    let mut checksum = 0u8;
+    while offset < len && GENERATION.load(Ordering::SeqCst) == generation {
+        let n = WINDOW.min(len - offset);
+        let window = unsafe { (base as *mut u8).add(offset) };
+        match mode {
+            Prefetch::WillNeed => unsafe {
+                libc::madvise(window as *mut libc::c_void, n, libc::MADV_WILLNEED);
+            },
+            Prefetch::Sequential => {
+                for page in (0..n).step_by(page_size as usize) {
+                    checksum ^= unsafe { std::ptr::read_volatile(window.add(page)) };
+                }
+            }
+            Prefetch::Off => break,
+        }
+        offset += n;
+    }
+    std::hint::black_box(checksum);
+    unsafe { libc::munmap(base, len) };
+    println!(
+        "📥 Model prefetch ({:?}) covered {} MB in {:?}",
+        mode,
+        offset >> 20,
+        started.elapsed()
+    );
+}
+
+#[cfg(not(unix))]
+fn warm(_file: &File, _layout: TensorLayout, _mode: Prefetch, _generation: u64) {}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Cursor;
+
+    fn put_string(buf: &mut Vec<u8>, s: &str) {
+        buf.extend_from_slice(&(s.len() as u64).to_le_bytes());
+        buf.extend_from_slice(s.as_bytes());
+    }
+
+    #[test]
+    fn test_parse_layout() {
+        let mut buf = Vec::new();
+        buf.extend_from_slice(GGUF_MAGIC);
+        buf.extend_from_slice(&3u32.to_le_bytes());
+        buf.extend_from_slice(&2u64.to_le_bytes()); // tensors
+        buf.extend_from_slice(&3u64.to_le_bytes()); // metadata
+        put_string(&mut buf, "general.architecture");
+        buf.extend_from_slice(&TYPE_STRING.to_le_bytes());
+        put_string(&mut buf, "llama");
+        put_string(&mut buf, "tokenizer.ggml.tokens");
+        buf.extend_from_slice(&TYPE_ARRAY.to_le_bytes());
+        buf.extend_from_slice(&TYPE_STRING.to_le_bytes());
+        buf.extend_from_slice(&2u64.to_le_bytes());
+        put_string(&mut buf, "<s>");
+        put_string(&mut buf, "</s>");
+        put_string(&mut buf, "general.alignment");
+        buf.extend_from_slice(&TYPE_U32.to_le_bytes());
+        buf.extend_from_slice(&64u32.to_le_bytes());
+        for (name, offset) in [("output.weight", 64u64), ("token_embd.weight", 0)] {
+            put_string(&mut buf, name);
+            buf.extend_from_slice(&2u32.to_le_bytes());
+            buf.extend_from_slice(&4u64.to_le_bytes());
+            buf.extend_from_slice(&4u64.to_le_bytes());
+            buf.extend_from_slice(&0u32.to_le_bytes());
+            buf.extend_from_slice(&offset.to_le_bytes());
+        }
+        let data_start = (buf.len() as u64).next_multiple_of(64);
+        let file_size = data_start + 128;
+
+        let layout =
+            parse_layout(&mut BufReader::new(Cursor::new(buf.clone())), file_size).unwrap();
+        assert_eq!(
+            layout,
+            TensorLayout {
+                data_start,
+                data_end: file_size,
+                tensor_count: 2,
+            }
+        );
+        assert!(parse_layout(&mut BufReader::new(Cursor::new(buf)), data_start - 1).is_err());
+        assert!(parse_layout(&mut BufReader::new(Cursor::new(b"GGML".to_vec())), 4).is_err());
+    }
+}
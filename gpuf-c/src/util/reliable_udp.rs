@@ -0,0 +1,612 @@
+//! Windowed, selectively acknowledged delivery for the P2P UDP data plane.
+//!
+//! Messages travel as MTU-sized fragments. Waiting for an ACK after every
+//! fragment capped a message at one fragment per round trip, and a single
+//! loss stalled it for a whole retry timeout. [`SendWindow`] keeps up to a
+//! congestion window of fragments in flight, paces them across the round
+//! trip, and retransmits a fragment when its RTT-derived timer expires or
+//! once fragments sent after it have been acknowledged. Receivers answer
+//! every fragment with the first missing index plus a bitmap of what arrived
+//! after it ([`SackAck`]); [`Reassembler`] writes each fragment straight to
+//! its offset in the message buffer.
+//!
+//! Older peers acknowledge without saying which fragment arrived. A path
+//! whose first ACK is of that kind stays stop-and-wait. RTT and window
+//! estimates are kept per peer across messages, since most messages are a
+//! single fragment.
+
+use common::MAX_MESSAGE_SIZE;
+use std::collections::{HashMap, VecDeque};
+use std::net::SocketAddr;
+use std::sync::{Mutex, OnceLock};
+use std::time::{Duration, Instant};
+
+/// Fragments an ACK bitmap reaches past its base, and so the largest window.
+pub const SACK_BITS: usize = 64;
+/// Bitmap bytes following the header of a selective ACK.
+pub const SACK_LEN: usize = 8;
+
+const INITIAL_RTO: Duration = Duration::from_millis(400);
+const MIN_RTO: Duration = Duration::from_millis(100);
+const MAX_RTO: Duration = Duration::from_secs(4);
+/// Sends of one fragment before the message is given up.
+const MAX_TRIES: u32 = 10;
+/// A fragment counts as lost once one sent this many transmissions after it
+/// has been acknowledged.
+const REORDER_THRESHOLD: u64 = 3;
+const INITIAL_CWND: f64 = 4.0;
+const INITIAL_SSTHRESH: f64 = 32.0;
+/// Peers whose path state is remembered.
+const MAX_PATHS: usize = 256;
+/// Partly received messages kept per receiver; the oldest goes first.
+const MAX_PARTIAL: usize = 32;
+/// Bytes buffered across a receiver's partly received messages; the oldest
+/// goes first when a fragment would exceed it.
+const MAX_PARTIAL_BYTES: usize = 2 * MAX_MESSAGE_SIZE;
+/// Completed messages remembered so late duplicates are still acknowledged.
+const RECENT_DONE: usize = 64;
+
+/// Receiver state carried by a selective ACK.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct SackAck {
+    /// Every fragment below this one has arrived.
+    pub base: u16,
+    /// Bit i set: fragment `base + 1 + i` has arrived.
+    pub bitmap: u64,
+}
+
+impl SackAck {
+    pub fn encode(&self) -> [u8; SACK_LEN] {
+        self.bitmap.to_be_bytes()
+    }
+
+    pub fn decode(base: u16, bytes: &[u8]) -> Option<Self> {
+        let bitmap = u64::from_be_bytes(bytes.get(..SACK_LEN)?.try_into().ok()?);
+        Some(Self { base, bitmap })
+    }
+
+    pub fn covers(&self, idx: u16) -> bool {
+        if idx < self.base {
+            return true;
+        }
+        let bit = (idx - self.base) as usize;
+        bit > 0 && bit <= SACK_BITS && self.bitmap & (1 << (bit - 1)) != 0
+    }
+}
+
+/// RTT and congestion estimates for one peer.
+#[derive(Debug, Clone, Copy)]
+pub struct PathState {
+    srtt: Option<Duration>,
+    rttvar: Duration,
+    rto: Duration,
+    cwnd: f64,
+    ssthresh: f64,
+    /// Whether the peer sends selective ACKs; unknown until its first ACK.
+    sack: Option<bool>,
+}
+
+impl Default for PathState {
+    fn default() -> Self {
+        Self {
+            srtt: None,
+            rttvar: Duration::ZERO,
+            rto: INITIAL_RTO,
+            cwnd: INITIAL_CWND,
+            ssthresh: INITIAL_SSTHRESH,
+            sack: None,
+        }
+    }
+}
+
+impl PathState {
+    /// Fragments allowed in flight. One until the peer is known to send
+    /// selective ACKs, since a plain ACK cannot say which fragment it is for.
+    pub fn window(&self) -> usize {
+        match self.sack {
+            Some(true) => (self.cwnd as usize).clamp(1, SACK_BITS),
+            _ => 1,
+        }
+    }
+
+    /// Gap between sends that spreads a window over one round trip.
+    pub fn pacing_gap(&self) -> Duration {
+        self.srtt
+            .map_or(Duration::ZERO, |srtt| srtt / self.window() as u32)
+    }
+
+    /// RFC 6298 smoothing.
+    fn on_rtt_sample(&mut self, rtt: Duration) {
+        match self.srtt {
+            None => {
+                self.srtt = Some(rtt);
+                self.rttvar = rtt / 2;
+            }
+            Some(srtt) => {
+                let diff = if srtt > rtt { srtt - rtt } else { rtt - srtt };
+                self.rttvar = self.rttvar * 3 / 4 + diff / 4;
+                self.srtt = Some(srtt * 7 / 8 + rtt / 8);
+            }
+        }
+        let srtt = self.srtt.unwrap_or(rtt);
+        self.rto =
+            (srtt + (self.rttvar * 4).max(Duration::from_millis(10))).clamp(MIN_RTO, MAX_RTO);
+    }
+
+    fn on_acked(&mut self, newly: usize) {
+        if self.cwnd < self.ssthresh {
+            self.cwnd += newly as f64;
+        } else {
+            self.cwnd += newly as f64 / self.cwnd;
+        }
+        self.cwnd = self.cwnd.min(SACK_BITS as f64);
+    }
+
+    fn on_loss(&mut self) {
+        self.ssthresh = (self.cwnd / 2.0).max(2.0);
+        self.cwnd = self.ssthresh;
+    }
+
+    fn on_timeout(&mut self) {
+        self.ssthresh = (self.cwnd / 2.0).max(2.0);
+        self.cwnd = 1.0;
+        self.rto = (self.rto * 2).min(MAX_RTO);
+    }
+}
+
+fn paths() -> &'static Mutex<HashMap<SocketAddr, PathState>> {
+    static PATHS: OnceLock<Mutex<HashMap<SocketAddr, PathState>>> = OnceLock::new();
+    PATHS.get_or_init(|| Mutex::new(HashMap::new()))
+}
+
+/// What is known about the path to `peer`.
+pub fn path(peer: SocketAddr) -> PathState {
+    let paths = paths().lock().unwrap_or_else(|e| e.into_inner());
+    paths.get(&peer).copied().unwrap_or_default()
+}
+
+pub fn store_path(peer: SocketAddr, state: PathState) {
+    let mut paths = paths().lock().unwrap_or_else(|e| e.into_inner());
+    if paths.len() >= MAX_PATHS && !paths.contains_key(&peer) {
+        paths.clear();
+    }
+    paths.insert(peer, state);
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+struct Fragment {
+    sent_at: Option<Instant>,
+    tries: u32,
+    /// Transmission number of the latest send.
+    tx: u64,
+    acked: bool,
+    lost: bool,
+}
+
+/// Sender side of one message.
+pub struct SendWindow {
+    path: PathState,
+    frags: Vec<Fragment>,
+    /// Lowest unacknowledged fragment.
+    base: u16,
+    /// Lowest fragment never sent.
+    next: u16,
+    acked: usize,
+    tx: u64,
+    highest_acked_tx: u64,
+    /// In recovery until the base passes this fragment; one window cut per
+    /// loss episode.
+    recovery: Option<u16>,
+}
+
+impl SendWindow {
+    pub fn new(path: PathState, frag_cnt: u16) -> Self {
+        Self {
+            path,
+            frags: vec![Fragment::default(); frag_cnt as usize],
+            base: 0,
+            next: 0,
+            acked: 0,
+            tx: 0,
+            highest_acked_tx: 0,
+            recovery: None,
+        }
+    }
+
+    pub fn path(&self) -> PathState {
+        self.path
+    }
+
+    pub fn is_done(&self) -> bool {
+        self.acked == self.frags.len()
+    }
+
+    pub fn pacing_gap(&self) -> Duration {
+        self.path.pacing_gap()
+    }
+
+    fn in_flight(&self) -> usize {
+        self.outstanding()
+            .filter(|&i| {
+                let f = &self.frags[i as usize];
+                f.sent_at.is_some() && !f.lost
+            })
+            .count()
+    }
+
+    fn outstanding(&self) -> impl Iterator<Item = u16> + '_ {
+        (self.base..self.next).filter(|&i| !self.frags[i as usize].acked)
+    }
+
+    /// The fragment to send now, if the window has room: lost ones first,
+    /// then new ones within reach of the receiver's bitmap.
+    pub fn next_to_send(&self) -> Option<u16> {
+        if self.in_flight() >= self.path.window() {
+            return None;
+        }
+        if let Some(i) = self.outstanding().find(|&i| self.frags[i as usize].lost) {
+            return Some(i);
+        }
+        let reach = self.base as usize + SACK_BITS;
+        ((self.next as usize) < self.frags.len() && (self.next as usize) <= reach)
+            .then_some(self.next)
+    }
+
+    pub fn on_sent(&mut self, idx: u16, now: Instant) {
+        self.tx += 1;
+        let f = &mut self.frags[idx as usize];
+        f.sent_at = Some(now);
+        f.tries += 1;
+        f.tx = self.tx;
+        f.lost = false;
+        if idx == self.next {
+            self.next += 1;
+        }
+    }
+
+    /// When the oldest fragment in flight times out.
+    pub fn next_deadline(&self) -> Option<Instant> {
+        self.outstanding()
+            .filter_map(|i| {
+                let f = &self.frags[i as usize];
+                f.sent_at.filter(|_| !f.lost)
+            })
+            .min()
+            .map(|sent| sent + self.path.rto)
+    }
+
+    pub fn on_ack(&mut self, ack: SackAck, now: Instant) {
+        self.path.sack = Some(true);
+        let mut newly = 0;
+        for i in self.base..self.next {
+            let f = &mut self.frags[i as usize];
+            if f.acked || !ack.covers(i) {
+                continue;
+            }
+            f.acked = true;
+            newly += 1;
+            self.highest_acked_tx = self.highest_acked_tx.max(f.tx);
+            // Karn: a retransmitted fragment's ACK may be for either send.
+            if let (1, Some(sent)) = (f.tries, f.sent_at) {
+                self.path.on_rtt_sample(now.duration_since(sent));
+            }
+        }
+        self.acked += newly;
+        self.advance();
+        if newly > 0 {
+            self.path.on_acked(newly);
+        }
+
+        let mut loss = false;
+        for i in self.base..self.next {
+            let f = &mut self.frags[i as usize];
+            if !f.acked
+                && !f.lost
+                && f.sent_at.is_some()
+                && f.tx + REORDER_THRESHOLD <= self.highest_acked_tx
+            {
+                f.lost = true;
+                loss = true;
+            }
+        }
+        if loss && self.recovery.is_none() {
+            self.path.on_loss();
+            self.recovery = Some(self.next);
+        }
+    }
+
+    /// An ACK without fragment information: the peer is stop-and-wait, and
+    /// the ACK can only be placed when one fragment is in flight.
+    pub fn on_legacy_ack(&mut self, now: Instant) {
+        self.path.sack = Some(false);
+        let (first, second) = {
+            let mut sent = self
+                .outstanding()
+                .filter(|&i| self.frags[i as usize].sent_at.is_some());
+            (sent.next(), sent.next())
+        };
+        if let (Some(i), None) = (first, second) {
+            let base = if i == self.base { i + 1 } else { self.base };
+            let bitmap = if i == self.base {
+                0
+            } else {
+                1 << (i - self.base - 1)
+            };
+            self.on_ack(SackAck { base, bitmap }, now);
+            self.path.sack = Some(false);
+        }
+    }
+
+    /// Mark fragments whose timer expired as lost. False once one of them
+    /// has used up its tries.
+    pub fn on_timeout(&mut self, now: Instant) -> bool {
+        let rto = self.path.rto;
+        let mut expired = false;
+        for i in self.base..self.next {
+            let f = &mut self.frags[i as usize];
+            let Some(sent) = f.sent_at else {
+                continue;
+            };
+            if f.acked || f.lost || now < sent + rto {
+                continue;
+            }
+            if f.tries >= MAX_TRIES {
+                return false;
+            }
+            f.lost = true;
+            expired = true;
+        }
+        if expired {
+            self.path.on_timeout();
+            self.recovery = Some(self.next);
+        }
+        true
+    }
+
+    fn advance(&mut self) {
+        while (self.base as usize) < self.frags.len() && self.frags[self.base as usize].acked {
+            self.base += 1;
+        }
+        if self.recovery.is_some_and(|until| self.base >= until) {
+            self.recovery = None;
+        }
+    }
+}
+
+/// One message being received.
+struct Reassembly {
+    /// Grows to cover the furthest fragment received so far.
+    data: Vec<u8>,
+    have: Vec<u64>,
+    count: u16,
+    frag_cnt: u16,
+    /// Set once the last fragment, which may be short, has arrived.
+    len: Option<usize>,
+    started: Instant,
+}
+
+impl Reassembly {
+    fn has(&self, idx: u16) -> bool {
+        self.have[idx as usize / 64] & (1 << (idx % 64)) != 0
+    }
+
+    fn ack(&self) -> SackAck {
+        let mut base = 0;
+        while base < self.frag_cnt && self.has(base) {
+            base += 1;
+        }
+        let mut bitmap = 0u64;
+        for bit in 0..SACK_BITS {
+            let idx = base as usize + 1 + bit;
+            if idx >= self.frag_cnt as usize {
+                break;
+            }
+            if self.has(idx as u16) {
+                bitmap |= 1 << bit;
+            }
+        }
+        SackAck { base, bitmap }
+    }
+}
+
+/// Receiver side: fragments are copied once, into the message's buffer.
+pub struct Reassembler {
+    frag_len: usize,
+    partial: HashMap<u32, Reassembly>,
+    /// Sum of `data.len()` over `partial`.
+    held: usize,
+    done: VecDeque<(u32, u16)>,
+}
+
+impl Reassembler {
+    /// `frag_len` is the payload size of every fragment but the last.
+    pub fn new(frag_len: usize) -> Self {
+        Self {
+            frag_len,
+            partial: HashMap::new(),
+            held: 0,
+            done: VecDeque::new(),
+        }
+    }
+
+    /// Take in one fragment. Returns the ACK to send, and the whole message
+    /// once its last fragment is in. Malformed fragments are ignored.
+    pub fn accept(
+        &mut self,
+        msg_id: u32,
+        frag_idx: u16,
+        frag_cnt: u16,
+        payload: &[u8],
+    ) -> Option<(SackAck, Option<Vec<u8>>)> {
+        if frag_idx >= frag_cnt || payload.len() > self.frag_len {
+            return None;
+        }
+        if self.done.iter().any(|&(id, _)| id == msg_id) {
+            return Some((
+                SackAck {
+                    base: frag_cnt,
+                    bitmap: 0,
+                },
+                None,
+            ));
+        }
+        let capacity = frag_cnt as usize * self.frag_len;
+        if capacity > MAX_MESSAGE_SIZE {
+            return None;
+        }
+        let last = frag_idx + 1 == frag_cnt;
+        if !last && payload.len() != self.frag_len {
+            return None;
+        }
+
+        if !self.partial.contains_key(&msg_id) && self.partial.len() >= MAX_PARTIAL {
+            self.evict_oldest(msg_id);
+        }
+        if self
+            .partial
+            .get(&msg_id)
+            .is_some_and(|r| r.frag_cnt != frag_cnt)
+        {
+            return None;
+        }
+        let at = frag_idx as usize * self.frag_len;
+        let end = at + payload.len();
+        let held_here = self.partial.get(&msg_id).map_or(0, |r| r.data.len());
+        let growth = end.saturating_sub(held_here);
+        while self.held + growth > MAX_PARTIAL_BYTES {
+            if !self.evict_oldest(msg_id) {
+                return None;
+            }
+        }
+
+        let r = self.partial.entry(msg_id).or_insert_with(|| Reassembly {
+            data: Vec::new(),
+            have: vec![0; (frag_cnt as usize).div_ceil(64)],
+            count: 0,
+            frag_cnt,
+            len: None,
+            started: Instant::now(),
+        });
+        if !r.has(frag_idx) {
+            if r.data.len() < end {
+                r.data.resize(end, 0);
+                self.held += growth;
+            }
+            r.data[at..end].copy_from_slice(payload);
+            r.have[frag_idx as usize / 64] |= 1 << (frag_idx % 64);
+            r.count += 1;
+            if last {
+                r.len = Some(end);
+            }
+        }
+        if r.count < frag_cnt {
+            return Some((r.ack(), None));
+        }
+
+        let mut r = self.partial.remove(&msg_id)?;
+        self.held -= r.data.len();
+        r.data.truncate(r.len.unwrap_or(0));
+        if self.done.len() >= RECENT_DONE {
+            self.done.pop_front();
+        }
+        self.done.push_back((msg_id, frag_cnt));
+        Some((
+            SackAck {
+                base: frag_cnt,
+                bitmap: 0,
+            },
+            Some(r.data),
+        ))
+    }
+
+    /// Drop the oldest partly received message other than `keep`. Returns
+    /// false when there is none.
+    fn evict_oldest(&mut self, keep: u32) -> bool {
+        let oldest = self
+            .partial
+            .iter()
+            .filter(|&(&id, _)| id != keep)
+            .min_by_key(|(_, r)| r.started)
+            .map(|(&id, _)| id);
+        match oldest.and_then(|id| self.partial.remove(&id)) {
+            Some(r) => {
+                self.held -= r.data.len();
+                true
+            }
+            None => false,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_window_recovers_lost_fragment() {
+        let message: Vec<u8> = (0..22).collect();
+        let frags: Vec<&[u8]> = message.chunks(4).collect();
+        let n = frags.len() as u16;
+        let start = Instant::now();
+        let ms = |n| start + Duration::from_millis(n);
+        let pump = |win: &mut SendWindow, at| -> Vec<u16> {
+            std::iter::from_fn(|| {
+                let i = win.next_to_send()?;
+                win.on_sent(i, at);
+                Some(i)
+            })
+            .collect()
+        };
+
+        let mut rx = Reassembler::new(4);
+        let mut path = PathState::default();
+        path.sack = Some(true);
+        let mut win = SendWindow::new(path, n);
+        assert_eq!(pump(&mut win, start), vec![0, 1, 2, 3]);
+
+        // Fragment 1 is lost.
+        for i in [0u16, 2, 3] {
+            let (ack, full) = rx.accept(7, i, n, frags[i as usize]).unwrap();
+            assert!(full.is_none());
+            win.on_ack(ack, ms(50));
+        }
+        assert_eq!(pump(&mut win, ms(50)), vec![4, 5]);
+        let (ack, _) = rx.accept(7, 4, n, frags[4]).unwrap();
+        assert_eq!(ack.base, 1);
+        win.on_ack(ack, ms(100));
+        // Three later sends were acknowledged, so it goes again before its
+        // timer runs out.
+        assert_eq!(pump(&mut win, ms(100)), vec![1]);
+
+        let mut assembled = None;
+        for i in [5u16, 1] {
+            let (ack, full) = rx.accept(7, i, n, frags[i as usize]).unwrap();
+            win.on_ack(ack, ms(150));
+            assembled = assembled.or(full);
+        }
+        assert!(win.is_done());
+        assert_eq!(assembled.as_deref(), Some(&message[..]));
+        // Late duplicates are still acknowledged in full.
+        assert_eq!(rx.accept(7, 1, n, frags[1]).unwrap().0.base, n);
+    }
+
+    #[test]
+    fn test_reassembler_bounds_buffered_bytes() {
+        let frag_len = 1024;
+        let frag_cnt = (MAX_MESSAGE_SIZE / frag_len) as u16;
+        let mut rx = Reassembler::new(frag_len);
+
+        // One late fragment per message, as a flood of spoofed ids would send.
+        for msg_id in 0..MAX_PARTIAL as u32 {
+            rx.accept(msg_id, frag_cnt - 1, frag_cnt, &[1; 16]).unwrap();
+            assert!(rx.held <= MAX_PARTIAL_BYTES);
+        }
+        // An early fragment holds only what has arrived.
+        rx.accept(1000, 0, frag_cnt, &vec![2; frag_len]).unwrap();
+        assert_eq!(rx.partial[&1000].data.len(), frag_len);
+
+        let (_, full) = rx.accept(2000, 0, 1, b"hello").unwrap();
+        assert_eq!(full.as_deref(), Some(&b"hello"[..]));
+        assert_eq!(rx.held, rx.partial.values().map(|r| r.data.len()).sum());
+    }
+}
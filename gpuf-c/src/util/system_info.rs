@@ -3,6 +3,8 @@ use common::{DevicesInfo, Model};
 use futures_util::StreamExt;
 use serde::Deserialize;
 use serde_json;
+use std::sync::{Mutex, OnceLock};
+use std::time::Duration;
 use sysinfo::{Disks, System};
 use tracing::{debug, error, info};
 
@@ -18,9 +20,6 @@ use tracing::warn;
 #[cfg(target_os = "macos")]
 use crate::util::device_info::read_power_metrics;
 
-#[cfg(all(not(target_os = "macos"), not(target_os = "android"), feature = "nvml"))]
-use nvml_wrapper::NVML;
-
 #[cfg(target_os = "macos")]
 use std::process::Command;
 
@@ -100,7 +99,24 @@ pub fn get_pci_ids_by_lspci(device_index: u32) -> Result<(u16, u16)> {
     use std::fs;
     use std::process::Command;
 
-    // First try to use lspci to get device info
+    // sysfs has the same ids lspci prints, without spawning a process
+    let pci_bus_id = format!("/sys/bus/pci/devices/0000:{:02x}:00.0", device_index);
+    let read_id = |path: String| -> Option<u16> {
+        let content = fs::read_to_string(path).ok()?;
+        u16::from_str_radix(content.trim().trim_start_matches("0x"), 16).ok()
+    };
+    if let (Some(vendor_id), Some(device_id)) = (
+        read_id(format!("{}/vendor", pci_bus_id)),
+        read_id(format!("{}/device", pci_bus_id)),
+    ) {
+        info!(
+            "Found device via sysfs - Vendor: {:04x}, Device: {:04x}",
+            vendor_id, device_id
+        );
+        return Ok((vendor_id, device_id));
+    }
+
+    // Fallback to lspci when sysfs is not mounted
     let output = Command::new("lspci")
         .arg("-n")
         .arg("-s")
@@ -128,51 +144,30 @@ pub fn get_pci_ids_by_lspci(device_index: u32) -> Result<(u16, u16)> {
         }
     }
 
-    // Fallback to direct file reading
-    let pci_bus_id = format!("/sys/bus/pci/devices/0000:{:02x}:00.0", device_index);
-    info!("Trying to read device info from: {}", pci_bus_id);
-
-    // Read vendor and device IDs directly using command line as fallback
-    let read_id = |path: &str| -> Result<u16> {
-        // First try reading directly
-        if let Ok(content) = fs::read_to_string(path) {
-            if let Ok(id) = content.trim().trim_start_matches("0x").parse::<u16>() {
-                return Ok(id);
-            }
-        }
-
-        // If that fails, try using cat command
-        let output = Command::new("cat")
-            .arg(path)
-            .output()
-            .map_err(|e| anyhow::anyhow!("Failed to execute cat {}: {}", path, e))?;
-
-        if output.status.success() {
-            let content = String::from_utf8_lossy(&output.stdout);
-            content
-                .trim()
-                .trim_start_matches("0x")
-                .parse::<u16>()
-                .map_err(|e| anyhow::anyhow!("Failed to parse ID from {}: {}", path, e))
-        } else {
-            Err(anyhow::anyhow!("Failed to read device ID from {}", path))
-        }
-    };
-
-    let vendor_id = read_id(&format!("{}/vendor", pci_bus_id))?;
-    let device_id = read_id(&format!("{}/device", pci_bus_id))?;
+    Err(anyhow::anyhow!(
+        "Failed to get PCI IDs for device index {}",
+        device_index
+    ))
+}
 
-    info!(
-        "Found device - Vendor: {:04x}, Device: {:04x}",
-        vendor_id, device_id
-    );
-    Ok((vendor_id, device_id))
+/// NVML handle shared by every caller; initialising it loads the driver
+/// library and enumerates devices, which is too slow to repeat per heartbeat.
+#[cfg(all(
+    not(target_os = "macos"),
+    not(target_os = "android"),
+    any(feature = "nvml", feature = "cuda")
+))]
+fn shared_nvml() -> Result<&'static nvml_wrapper::NVML> {
+    static HANDLE: OnceLock<std::result::Result<nvml_wrapper::NVML, String>> = OnceLock::new();
+    HANDLE
+        .get_or_init(|| nvml_wrapper::NVML::init().map_err(|e| e.to_string()))
+        .as_ref()
+        .map_err(|e| anyhow!("NVML initialization failed: {}", e))
 }
 
 #[cfg(all(not(target_os = "macos"), not(target_os = "android"), feature = "nvml"))]
 pub fn get_gpu_count() -> Result<usize, Box<dyn std::error::Error>> {
-    // Initialize NVML
-    let nvml = NVML::init()?;
+    let nvml = shared_nvml()?;
     // Get GPU device count
     let device_count = nvml.device_count()?;
     if device_count > 1 && !is_power_of_two_divide(device_count as i32) {
@@ -216,11 +211,14 @@ async fn collect_device_info_vulkan() -> Result<(DevicesInfo, u32)> {
 async fn collect_android_device_info() -> Result<DevicesInfo> {
     use std::fs;
 
-    // Get memory information from /proc/meminfo
-    let memtotal_gb = read_memory_info().unwrap_or(0);
-
-    // Get CPU information
-    let cpu_cores = read_cpu_cores().unwrap_or(1);
+    // Memory size and core count never change, so read them once
+    static INVENTORY: OnceLock<(u32, u32)> = OnceLock::new();
+    let (memtotal_gb, cpu_cores) = *INVENTORY.get_or_init(|| {
+        (
+            read_memory_info().unwrap_or(0),
+            read_cpu_cores().unwrap_or(1),
+        )
+    });
 
     // Get device temperature (if available)
     let temp = read_thermal_info().unwrap_or(0);
@@ -307,7 +305,7 @@ fn read_cpu_cores() -> Option<u32> {
 
 /// Read thermal information from /sys/class/thermal/
 #[cfg(target_os = "android")]
-fn read_thermal_info() -> Option<u32> {
+pub(crate) fn read_thermal_info() -> Option<u32> {
     use std::fs;
 
     // Try to read from common thermal zones
@@ -357,40 +355,43 @@ fn read_system_usage() -> Option<(u32, u32, u32)> {
     Some((cpu_usage, memory_usage, disk_usage))
 }
 
-/// Read CPU usage percentage from /proc/stat
+/// Read CPU usage percentage since the previous call from /proc/stat
 #[cfg(target_os = "android")]
 fn read_cpu_usage() -> Option<u32> {
-    use std::fs::File;
-    use std::io::{BufRead, BufReader};
-
-    if let Ok(file) = File::open("/proc/stat") {
-        let reader = BufReader::new(file);
-        for line in reader.lines().flatten() {
-            if line.starts_with("cpu ") {
-                let parts: Vec<&str> = line.split_whitespace().collect();
-                if parts.len() >= 8 {
-                    // Parse CPU times: user, nice, system, idle, iowait, irq, softirq, steal
-                    let mut times = Vec::new();
-                    for i in 1..8 {
-                        if let Ok(time) = parts[i].parse::<u64>() {
-                            times.push(time);
-                        }
-                    }
-
-                    if times.len() >= 4 {
-                        let total_time: u64 = times.iter().sum();
-                        let idle_time = times[3]; // idle time is the 4th value
+    static LAST_SAMPLE: Mutex<Option<(u64, u64)>> = Mutex::new(None);
+
+    let stat = std::fs::read_to_string("/proc/stat").ok()?;
+    let sample = stat.lines().find_map(parse_proc_stat_cpu)?;
+    let previous = LAST_SAMPLE
+        .lock()
+        .unwrap_or_else(|e| e.into_inner())
+        .replace(sample);
+    // The first call has nothing to diff against and reports the average since boot
+    cpu_usage_between(previous.unwrap_or((0, 0)), sample)
+}
 
-                        if total_time > 0 {
-                            let usage_percent = ((total_time - idle_time) * 100) / total_time;
-                            return Some(usage_percent as u32);
-                        }
-                    }
-                }
-            }
-        }
+/// Busy and total jiffies from the aggregate `cpu ` line of /proc/stat.
+fn parse_proc_stat_cpu(line: &str) -> Option<(u64, u64)> {
+    // user, nice, system, idle, iowait, irq, softirq
+    let times: Vec<u64> = line
+        .strip_prefix("cpu ")?
+        .split_whitespace()
+        .take(7)
+        .map(|field| field.parse::<u64>())
+        .collect::<std::result::Result<_, _>>()
+        .ok()?;
+    if times.len() < 5 {
+        return None;
     }
-    None
+    let total: u64 = times.iter().sum();
+    let idle = times[3] + times[4];
+    Some((total - idle, total))
+}
+
+fn cpu_usage_between(previous: (u64, u64), current: (u64, u64)) -> Option<u32> {
+    let busy = current.0.checked_sub(previous.0)?;
+    let total = current.1.checked_sub(previous.1)?;
+    (total > 0).then(|| (busy * 100 / total) as u32)
 }
 
 /// Read memory usage percentage from /proc/meminfo
@@ -676,11 +677,7 @@ async fn collect_device_info_sysfs() -> Result<(DevicesInfo, u32)> {
     not(feature = "nvml")
 ))]
 async fn collect_device_info_cpu() -> Result<(DevicesInfo, u32)> {
-    let mut sys = System::new_all();
-    sys.refresh_all();
-
-    let total_memory = sys.total_memory();
-    let used_memory = sys.used_memory();
+    let (cpu_usage, used_memory, total_memory) = sample_cpu_memory();
 
     debug!("Using CPU mode: {} GB total memory", total_memory >> 30);
 
@@ -697,7 +694,7 @@ async fn collect_device_info_cpu() -> Result<(DevicesInfo, u32)> {
             common::OsType::LINUX
         },
         engine_type: common::EngineType::Llama,
-        usage: sys.global_cpu_usage() as u64,
+        usage: cpu_usage as u64,
         mem_usage: ((used_memory as f32 / total_memory as f32) * 100.0) as u64,
         power_usage: 0,
         temp: 0,
@@ -710,35 +707,37 @@ async fn collect_device_info_cpu() -> Result<(DevicesInfo, u32)> {
     Ok((device_info, (total_memory >> 30) as u32))
 }
 
+/// PCI ids are fixed for the life of the process but resolving them takes
+/// port I/O, so each device is probed once.
 #[cfg(all(not(target_os = "macos"), not(target_os = "android"), feature = "cuda"))]
-pub async fn collect_device_info(engine_type: common::EngineType) -> Result<(DevicesInfo, u32)> {
-    use common::{set_u16_to_u128, set_u8_to_u64, to_tflops};
-    use nvml_wrapper::NVML as NVMLWrapper;
-    use std::sync::Once;
-
-    static INIT: Once = Once::new();
-    static mut NVML: Option<Result<NVMLWrapper, nvml_wrapper::error::Error>> = None;
+fn cached_pci_ids(device_index: u32, probe: impl FnOnce() -> (u16, u16)) -> (u16, u16) {
+    use std::collections::HashMap;
 
-    // Initialize NVML only once
-    INIT.call_once(|| unsafe {
-        NVML = Some(NVMLWrapper::init());
-    });
+    static PCI_IDS: OnceLock<Mutex<HashMap<u32, (u16, u16)>>> = OnceLock::new();
+    let ids = PCI_IDS.get_or_init(Default::default);
+    if let Some(&cached) = ids
+        .lock()
+        .unwrap_or_else(|e| e.into_inner())
+        .get(&device_index)
+    {
+        return cached;
+    }
+    let probed = probe();
+    ids.lock()
+        .unwrap_or_else(|e| e.into_inner())
+        .insert(device_index, probed);
+    probed
+}
 
-    let nvml_ptr = &raw const NVML;
+#[cfg(all(not(target_os = "macos"), not(target_os = "android"), feature = "cuda"))]
+pub async fn collect_device_info(engine_type: common::EngineType) -> Result<(DevicesInfo, u32)> {
+    use common::{set_u16_to_u128, set_u8_to_u64, to_tflops};
 
-    // Get the NVML instance
-    let nvml = match unsafe { &*nvml_ptr } {
-        Some(Ok(nvml)) => nvml,
-        Some(Err(e)) => {
-            debug!(
-                "NVML initialization failed: {}. Returning empty device list.",
-                e
-            );
-            return Err(anyhow::anyhow!("{:?}", e));
-        }
-        None => {
-            debug!("NVML not initialized. Returning empty device list.");
-            return Err(anyhow::anyhow!("NVML not initialized"));
+    let nvml = match shared_nvml() {
+        Ok(nvml) => nvml,
+        Err(e) => {
+            debug!("{}. Returning empty device list.", e);
+            return Err(e);
         }
     };
 
@@ -756,7 +755,10 @@ pub async fn collect_device_info(engine_type: common::EngineType) -> Result<(Dev
                 if let Ok(device) = nvml.device_by_index(i) {
                     //get vendor_id and device_id from pci_info
                     let device_index = device.index().unwrap();
-                    let (vendor_id, device_id) = if let Ok(pci_info) = device.pci_info() {
+                    let (vendor_id, device_id) = cached_pci_ids(device_index, || {
+                        let Ok(pci_info) = device.pci_info() else {
+                            return (0, 0);
+                        };
                         //parse "0000:01:00.0" bus_id style
                         debug!(
                             "Device {} {} bus_id {}",
@@ -802,9 +804,7 @@ pub async fn collect_device_info(engine_type: common::EngineType) -> Result<(Dev
                         } else {
                             (0, 0)
                         }
-                    } else {
-                        (0, 0)
-                    };
+                    });
                     debug!(
                         "vendor_id {} device_id {} device_index {}",
                         vendor_id, device_id, device_index
@@ -903,9 +903,22 @@ fn _get_chip_info() -> String {
 }
 
 #[cfg(target_os = "macos")]
-pub async fn collect_device_info(engine_type: common::EngineType) -> Result<(DevicesInfo, u32)> {
-    use rand::Rng;
-    let output_gpu = Command::new("sudo")
+struct GpuSample {
+    busy: f64,
+    power_mw: u64,
+    thermal_level: String,
+}
+
+// powermetrics samples for a full second, so this runs on a blocking thread
+// rather than stalling the runtime that also drives the heartbeat.
+#[cfg(target_os = "macos")]
+fn sample_gpu_powermetrics() -> GpuSample {
+    let mut gpu_freq = 0.0;
+    let mut gpu_busy = 0.0;
+    let mut gpu_power = 0;
+    let mut thermal_level = String::from("Unknown");
+
+    let plist_gpu = Command::new("sudo")
         .args([
             "powermetrics",
             "--samplers",
@@ -918,14 +931,10 @@ pub async fn collect_device_info(engine_type: common::EngineType) -> Result<(Dev
             "plist",
         ])
         .output()
-        .expect("failed to execute powermetrics gpu_power");
-
-    let plist_gpu = plist::Value::from_reader_xml(output_gpu.stdout.as_slice()).unwrap();
-    let mut gpu_freq = 0.0;
-    let mut gpu_busy = 0.0;
-    let mut gpu_power = 0;
-    let mut thermal_level = String::from("Unknown");
-    if let Some(dict) = plist_gpu.as_dictionary() {
+        .map_err(|e| error!("Failed to execute powermetrics gpu_power: {}", e))
+        .ok()
+        .and_then(|output| plist::Value::from_reader_xml(output.stdout.as_slice()).ok());
+    if let Some(dict) = plist_gpu.as_ref().and_then(|v| v.as_dictionary()) {
         if let Some(gpu_dict) = dict.get("gpu").and_then(|v| v.as_dictionary()) {
             gpu_freq = gpu_dict
                 .get("freq_hz")
@@ -950,11 +959,6 @@ pub async fn collect_device_info(engine_type: common::EngineType) -> Result<(Dev
             thermal_level = level.to_string();
         }
     }
-    // Step2: memory
-    let mut sys = System::new_all();
-    sys.refresh_all();
-    let total_memory = sys.total_memory();
-    let used_memory = sys.used_memory();
     let power_metrics = read_power_metrics();
     if let Some(metrics) = power_metrics {
         info!(
@@ -964,6 +968,27 @@ pub async fn collect_device_info(engine_type: common::EngineType) -> Result<(Dev
         gpu_power = metrics.total_mw;
     }
 
+    GpuSample {
+        busy: gpu_busy,
+        power_mw: gpu_power,
+        thermal_level,
+    }
+}
+
+#[cfg(target_os = "macos")]
+pub async fn collect_device_info(engine_type: common::EngineType) -> Result<(DevicesInfo, u32)> {
+    use rand::Rng;
+    let GpuSample {
+        busy: gpu_busy,
+        power_mw: gpu_power,
+        thermal_level,
+    } = tokio::task::spawn_blocking(sample_gpu_powermetrics)
+        .await
+        .map_err(|e| anyhow!("powermetrics sampling failed: {}", e))?;
+
+    // Step2: memory
+    let (_, used_memory, total_memory) = sample_cpu_memory();
+
     let device_info = DevicesInfo {
         pod_id: 0,
         num: 1,
@@ -988,12 +1013,19 @@ pub async fn collect_device_info(engine_type: common::EngineType) -> Result<(Dev
     anyhow::Ok((device_info, (total_memory / 1024 / 1024) as u32))
 }
 
+// system_profiler takes seconds; the chipset cannot change while we run.
 #[cfg(target_os = "macos")]
 fn get_device_id() -> Option<u16> {
+    static DEVICE_ID: OnceLock<Option<u16>> = OnceLock::new();
+    *DEVICE_ID.get_or_init(probe_device_id)
+}
+
+#[cfg(target_os = "macos")]
+fn probe_device_id() -> Option<u16> {
     let output = Command::new("system_profiler")
         .arg("SPDisplaysDataType")
         .output()
-        .expect("failed to run system_profiler");
+        .ok()?;
 
     let out = String::from_utf8_lossy(&output.stdout);
 
@@ -1025,6 +1057,12 @@ fn map_thermal(level: &str) -> u32 {
 
 #[cfg(target_os = "macos")]
 pub fn get_apple_gpu_cores() -> Option<usize> {
+    static GPU_CORES: OnceLock<Option<usize>> = OnceLock::new();
+    *GPU_CORES.get_or_init(probe_apple_gpu_cores)
+}
+
+#[cfg(target_os = "macos")]
+fn probe_apple_gpu_cores() -> Option<usize> {
     let output = Command::new("system_profiler")
         .args(["SPDisplaysDataType", "-json"])
         .output()
@@ -1046,9 +1084,34 @@ pub fn get_apple_gpu_cores() -> Option<usize> {
         .ok()
 }
 
+/// Long-lived sysinfo handle. CPU usage is measured between refreshes, so a
+/// fresh `System` per call only ever saw its first sample, and `new_all`
+/// walked every process on the machine as well.
+fn shared_system() -> &'static Mutex<System> {
+    static SYSTEM: OnceLock<Mutex<System>> = OnceLock::new();
+    SYSTEM.get_or_init(|| {
+        let mut sys = System::new();
+        sys.refresh_cpu_usage();
+        sys.refresh_memory();
+        Mutex::new(sys)
+    })
+}
+
+/// Refreshes the shared handle and returns (CPU %, used bytes, total bytes).
+fn sample_cpu_memory() -> (f32, u64, u64) {
+    let mut sys = shared_system().lock().unwrap_or_else(|e| e.into_inner());
+    sys.refresh_cpu_usage();
+    sys.refresh_memory();
+    (
+        sys.global_cpu_usage(),
+        sys.used_memory(),
+        sys.total_memory(),
+    )
+}
+
 pub async fn collect_system_info() -> Result<(u8, u8, u8, String)> {
-    let mut sys = System::new_all();
-    sys.refresh_all();
+    static HOST_NAME: OnceLock<String> = OnceLock::new();
+    let (cpu_usage, used_memory, total_memory) = sample_cpu_memory();
 
     let disks = Disks::new_with_refreshed_list();
     let disk_usage = disks
@@ -1066,11 +1129,12 @@ pub async fn collect_system_info() -> Result<(u8, u8, u8, String)> {
         })
         .unwrap_or(0.0);
 
-    let computer_name = System::host_name().unwrap_or_else(|| "unknown".to_string());
+    let computer_name =
+        HOST_NAME.get_or_init(|| System::host_name().unwrap_or_else(|| "unknown".to_string()));
 
     Ok((
-        pct_to_u8(sys.global_cpu_usage()),
-        pct_to_u8((sys.used_memory() as f32 / sys.total_memory() as f32) * 100.0),
+        pct_to_u8(cpu_usage),
+        pct_to_u8((used_memory as f32 / total_memory as f32) * 100.0),
         pct_to_u8(disk_usage),
         computer_name.clone(),
     ))
@@ -1091,6 +1155,21 @@ pub fn is_power_of_two_divide(n: i32) -> bool {
     return n > 0 && (n & (n - 1)) == 0;
 }
 
+/// Pooled client for the local engine APIs (Ollama, vLLM). A client per call
+/// threw away its connection pool, so every poll opened a new socket.
+pub fn engine_http_client() -> &'static reqwest::Client {
+    static CLIENT: OnceLock<reqwest::Client> = OnceLock::new();
+    CLIENT.get_or_init(|| {
+        reqwest::Client::builder()
+            .pool_idle_timeout(Duration::from_secs(90))
+            .pool_max_idle_per_host(8)
+            .tcp_nodelay(true)
+            .connect_timeout(Duration::from_secs(5))
+            .build()
+            .unwrap_or_else(|_| reqwest::Client::new())
+    })
+}
+
 // This struct is to deserialize the top-level JSON from Ollama API
 #[derive(Deserialize, Debug)]
 struct OllamaModelsResponse {
@@ -1098,7 +1177,7 @@ struct OllamaModelsResponse {
 }
 
 pub async fn get_engine_models(port: u16) -> Result<Vec<Model>> {
-    let client = reqwest::Client::new();
+    let client = engine_http_client();
     let res = client
         .get(format!("http://localhost:{}/v1/models", port))
         .send()
@@ -1124,7 +1203,7 @@ struct PullStatus {
 }
 
 pub async fn pull_ollama_model(model_name: &str, port: u16) -> Result<()> {
-    let client = reqwest::Client::new();
+    let client = engine_http_client();
     let resp = match client
         .post(format!("http://localhost:{}/api/pull", port))
         .json(&serde_json::json!({ "name": model_name, "stream": true }))
@@ -1167,7 +1246,7 @@ pub async fn run_model(
     model_name: &str,
     prompt: &str,
 ) -> Result<String, Box<dyn std::error::Error>> {
-    let client = reqwest::Client::new();
+    let client = engine_http_client();
     let request_body = serde_json::json!({
         "model": model_name,
         "prompt": prompt,
@@ -1198,6 +1277,21 @@ pub async fn run_model(
     }
 }
 
+#[test]
+fn test_parse_proc_stat_cpu() {
+    let line = "cpu  100 20 30 800 50 0 0 0 0 0";
+    assert_eq!(parse_proc_stat_cpu(line), Some((150, 1000)));
+    assert_eq!(parse_proc_stat_cpu("cpu0 1 2 3 4 5 6 7"), None);
+    assert_eq!(parse_proc_stat_cpu("cpu  1 2 x 4 5"), None);
+}
+
+#[test]
+fn test_cpu_usage_between_samples() {
+    assert_eq!(cpu_usage_between((150, 1000), (200, 1100)), Some(50));
+    assert_eq!(cpu_usage_between((150, 1000), (150, 1000)), None);
+    assert_eq!(cpu_usage_between((0, 0), (150, 1000)), Some(15));
+}
+
 #[cfg(target_os = "macos")]
 #[test]
 fn test_get_device_id() {
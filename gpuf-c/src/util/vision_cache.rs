@@ -0,0 +1,240 @@
+//! Content-addressed cache of image encodings for the multimodal path.
+//!
+//! Every multimodal generation used to push the image through the CLIP
+//! projector again, which on a phone costs more than the rest of the prompt.
+//! Follow-up questions about the same picture are the common case, so the
+//! projector output for an image chunk is kept here, keyed by a hash of the
+//! pixels, and decoded straight into the context on the next request.
+//!
+//! Entries are reference counted: a handle returned by
+//! `gpuf_multimodal_encode_image` keeps its encoding alive even after the
+//! cache has evicted it to stay within its byte budget.
+
+use sha2::{Digest, Sha256};
+use std::collections::HashMap;
+use std::sync::Arc;
+
+/// Default byte budget; a 224x224 image is a few hundred KiB of floats on
+/// the small VLMs we ship, so this holds a conversation's worth of images.
+pub const DEFAULT_BUDGET_BYTES: usize = 32 * 1024 * 1024;
+
+pub type ImageKey = [u8; 32];
+
+/// Hash of an image's dimensions and pixels.
+pub fn image_key(pixels: &[u8], nx: u32, ny: u32) -> ImageKey {
+    let mut hasher = Sha256::new();
+    hasher.update(nx.to_le_bytes());
+    hasher.update(ny.to_le_bytes());
+    hasher.update(pixels);
+    hasher.finalize().into()
+}
+
+/// Projector output for one image chunk: `n_tokens` rows of `n_embd` floats.
+pub struct ImageEmbedding {
+    pub n_tokens: usize,
+    pub data: Vec<f32>,
+}
+
+impl ImageEmbedding {
+    pub fn bytes(&self) -> usize {
+        self.data.len() * std::mem::size_of::<f32>()
+    }
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct VisionCacheStats {
+    pub entries: usize,
+    pub bytes: usize,
+    pub hits: u64,
+    pub misses: u64,
+}
+
+struct Entry {
+    embedding: Arc<ImageEmbedding>,
+    last_used: u64,
+}
+
+/// Least-recently-used map from image hash to encoding, bounded in bytes.
+///
+/// The cache only holds a handful of images, so eviction scans for the
+/// oldest entry rather than maintaining a linked list.
+pub struct VisionCache {
+    budget: usize,
+    used: usize,
+    tick: u64,
+    entries: HashMap<ImageKey, Entry>,
+    hits: u64,
+    misses: u64,
+}
+
+impl Default for VisionCache {
+    fn default() -> Self {
+        Self::new(DEFAULT_BUDGET_BYTES)
+    }
+}
+
+impl VisionCache {
+    pub fn new(budget: usize) -> Self {
+        Self {
+            budget,
+            used: 0,
+            tick: 0,
+            entries: HashMap::new(),
+            hits: 0,
+            misses: 0,
+        }
+    }
+
+    pub fn get(&mut self, key: &ImageKey) -> Option<Arc<ImageEmbedding>> {
+        self.tick += 1;
+        match self.entries.get_mut(key) {
+            Some(entry) => {
+                entry.last_used = self.tick;
+                self.hits += 1;
+                Some(Arc::clone(&entry.embedding))
+            }
+            None => {
+                self.misses += 1;
+                None
+            }
+        }
+    }
+
+    /// Stores an encoding, evicting older ones to stay within budget. An
+    /// encoding larger than the whole budget is not cached.
+    pub fn insert(&mut self, key: ImageKey, embedding: Arc<ImageEmbedding>) {
+        let size = embedding.bytes();
+        if size > self.budget {
+            return;
+        }
+        if let Some(old) = self.entries.remove(&key) {
+            self.used -= old.embedding.bytes();
+        }
+        while self.used + size > self.budget {
+            if !self.evict_oldest() {
+                break;
+            }
+        }
+        self.tick += 1;
+        self.used += size;
+        self.entries.insert(
+            key,
+            Entry {
+                embedding,
+                last_used: self.tick,
+            },
+        );
+    }
+
+    /// Changes the byte budget, evicting until the cache fits. Zero
+    /// disables caching.
+    pub fn set_budget(&mut self, budget: usize) {
+        self.budget = budget;
+        while self.used > self.budget {
+            if !self.evict_oldest() {
+                break;
+            }
+        }
+    }
+
+    pub fn stats(&self) -> VisionCacheStats {
+        VisionCacheStats {
+            entries: self.entries.len(),
+            bytes: self.used,
+            hits: self.hits,
+            misses: self.misses,
+        }
+    }
+
+    fn evict_oldest(&mut self) -> bool {
+        let oldest = self
+            .entries
+            .iter()
+            .min_by_key(|(_, entry)| entry.last_used)
+            .map(|(key, _)| *key);
+        match oldest.and_then(|key| self.entries.remove(&key)) {
+            Some(entry) => {
+                self.used -= entry.embedding.bytes();
+                true
+            }
+            None => false,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn embedding(floats: usize) -> Arc<ImageEmbedding> {
+        Arc::new(ImageEmbedding {
+            n_tokens: 1,
+            data: vec![0.0; floats],
+        })
+    }
+
+    #[test]
+    fn key_depends_on_dimensions_and_pixels() {
+        let pixels = [1u8, 2, 3, 4, 5, 6];
+        assert_eq!(image_key(&pixels, 2, 1), image_key(&pixels, 2, 1));
+        assert_ne!(image_key(&pixels, 2, 1), image_key(&pixels, 1, 2));
+        assert_ne!(
+            image_key(&pixels, 2, 1),
+            image_key(&[1, 2, 3, 4, 5, 7], 2, 1)
+        );
+    }
+
+    #[test]
+    fn evicts_least_recently_used_within_budget() {
+        let mut cache = VisionCache::new(3 * 4 * 4);
+        cache.insert([1; 32], embedding(4));
+        cache.insert([2; 32], embedding(4));
+        cache.insert([3; 32], embedding(4));
+        assert!(cache.get(&[1; 32]).is_some());
+
+        cache.insert([4; 32], embedding(4));
+        assert!(cache.get(&[2; 32]).is_none());
+        assert!(cache.get(&[1; 32]).is_some());
+        assert!(cache.get(&[3; 32]).is_some());
+        assert!(cache.get(&[4; 32]).is_some());
+
+        let stats = cache.stats();
+        assert_eq!(stats.entries, 3);
+        assert_eq!(stats.bytes, 48);
+        assert_eq!(stats.hits, 4);
+        assert_eq!(stats.misses, 1);
+    }
+
+    #[test]
+    fn oversized_entries_and_zero_budget_are_not_cached() {
+        let mut cache = VisionCache::new(16);
+        cache.insert([1; 32], embedding(8));
+        assert_eq!(cache.stats().entries, 0);
+
+        cache.insert([2; 32], embedding(4));
+        assert_eq!(cache.stats().bytes, 16);
+        cache.set_budget(0);
+        assert_eq!(cache.stats().entries, 0);
+        assert_eq!(cache.stats().bytes, 0);
+    }
+
+    #[test]
+    fn reinserting_replaces_without_double_counting() {
+        let mut cache = VisionCache::new(64);
+        cache.insert([1; 32], embedding(4));
+        cache.insert([1; 32], embedding(8));
+        let stats = cache.stats();
+        assert_eq!(stats.entries, 1);
+        assert_eq!(stats.bytes, 32);
+    }
+
+    #[test]
+    fn evicted_embeddings_stay_alive_while_held() {
+        let mut cache = VisionCache::new(16);
+        cache.insert([1; 32], embedding(4));
+        let held = cache.get(&[1; 32]).unwrap();
+        cache.insert([2; 32], embedding(4));
+        assert!(cache.get(&[1; 32]).is_none());
+        assert_eq!(held.data.len(), 4);
+    }
+}
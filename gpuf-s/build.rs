@@ -0,0 +1,89 @@
+//! Compiles the XDP API-key prefilter when the `xdp` feature is enabled on
+//! Linux, so the embedded object always matches `xdp_auth_filter.c`. Without
+//! clang the build goes on with an empty object and a warning.
+
+use std::env;
+use std::path::{Path, PathBuf};
+use std::process::Command;
+
+const XDP_SOURCE: &str = "src/xdp/xdp_auth_filter.c";
+
+fn main() {
+    println!("cargo:rerun-if-changed={}", XDP_SOURCE);
+    println!("cargo:rerun-if-env-changed=CLANG");
+    println!("cargo:rerun-if-env-changed=XDP_CFLAGS");
+    println!("cargo:rerun-if-env-changed=CC");
+    println!("cargo:rerun-if-env-changed=HOST_CC");
+
+    let xdp = env::var_os("CARGO_FEATURE_XDP").is_some();
+    let linux = env::var("CARGO_CFG_TARGET_OS").as_deref() == Ok("linux");
+    if !xdp || !linux {
+        return;
+    }
+
+    let out = PathBuf::from(env::var("OUT_DIR").unwrap()).join("xdp_auth_filter.o");
+    if let Err(e) = compile_xdp(&out) {
+        // An empty object leaves the filter to --xdp-object at run time
+        // instead of failing every default build on hosts without clang.
+        println!(
+            "cargo:warning=XDP prefilter not built ({}); gpuf-s will need --xdp-object \
+             to attach it. Install clang and libbpf headers (`make -C src/xdp deps`), \
+             or set XDP_CFLAGS for a non-standard header layout.",
+            e
+        );
+        std::fs::write(&out, []).expect("failed to write empty XDP object");
+    }
+}
+
+fn compile_xdp(out: &Path) -> Result<(), String> {
+    let clang = env::var("CLANG").unwrap_or_else(|_| "clang".to_string());
+    let target_arch = env::var("CARGO_CFG_TARGET_ARCH").unwrap_or_default();
+    let bpf_arch = match target_arch.as_str() {
+        "x86_64" => "x86",
+        "aarch64" => "arm64",
+        other => other,
+    };
+
+    let mut cmd = Command::new(&clang);
+    cmd.args(["-O2", "-g", "-target", "bpf"])
+        .arg(format!("-D__TARGET_ARCH_{}", bpf_arch));
+    match env::var("XDP_CFLAGS") {
+        Ok(flags) => {
+            cmd.args(flags.split_whitespace());
+        }
+        Err(_) => {
+            if let Some(dir) = multiarch_include_dir() {
+                cmd.arg(format!("-I{}", dir.display()));
+            }
+        }
+    }
+    let status = cmd
+        .arg("-c")
+        .arg(XDP_SOURCE)
+        .arg("-o")
+        .arg(out)
+        .status()
+        .map_err(|e| format!("{}: {}", clang, e))?;
+    if status.success() {
+        Ok(())
+    } else {
+        Err(format!("{} failed to compile {}: {}", clang, XDP_SOURCE, status))
+    }
+}
+
+/// Kernel UAPI headers include <asm/types.h>, which Debian-style systems
+/// keep in a multiarch directory. Ask the host C compiler for it; Fedora,
+/// Arch and musl keep `asm/` directly under the default include path.
+fn multiarch_include_dir() -> Option<PathBuf> {
+    let cc = env::var("HOST_CC")
+        .or_else(|_| env::var("CC"))
+        .unwrap_or_else(|_| "cc".to_string());
+    let output = Command::new(cc).arg("-print-multiarch").output().ok()?;
+    let triple = String::from_utf8(output.stdout).ok()?;
+    let triple = triple.trim();
+    if !output.status.success() || triple.is_empty() {
+        return None;
+    }
+    let dir = Path::new("/usr/include").join(triple);
+    dir.is_dir().then_some(dir)
+}
@@ -17,6 +17,7 @@ use crate::db::stats::{ClientHeartbeatInfo, ClientMonitorInfo};
 use crate::db::{
     client::{self, ClientDeviceDetailResponse, ClientDeviceInfo},
     stats::{self, EditClientRequest},
+    token_cache,
 };
 
 // Create Client Request
@@ -77,6 +78,7 @@ pub async fn insert_client(
         &payload.name,
     )
     .await;
+    token_cache::invalidate_user(&app_state.redis_client, &payload.user_id).await;
     Ok(Json(ApiResponse::success(vec![])))
 }
 
@@ -210,7 +212,10 @@ pub async fn edit_client_info(
     }
 
     match stats::update_gpu_asset_status(&app_state.db_pool, &payload).await {
-        Ok(_) => Ok(Json(ApiResponse::success(()))),
+        Ok(_) => {
+            token_cache::invalidate_user(&app_state.redis_client, &payload.user_id).await;
+            Ok(Json(ApiResponse::success(())))
+        }
         Err(e) => {
             error!("Failed to update client info: {}", e);
             Ok(Json(ApiResponse::<()>::error(e.to_string())))
@@ -250,19 +255,31 @@ pub struct ClientMonitorQuery {
     #[validate(length(min = 1, max = 32))]
     pub user_id: String,
     pub client_id: Option<String>,
+    /// Keyset cursor: date and client_id of the last row already seen.
+    pub before_date: Option<chrono::NaiveDate>,
+    pub before_client_id: Option<String>,
+    pub limit: Option<i64>,
 }
 
 pub async fn get_client_monitor(
     State(app_state): State<Arc<ApiServer>>,
     Query(query): Query<ClientMonitorQuery>,
 ) -> Result<Json<ApiResponse<Vec<ClientMonitorInfo>>>, StatusCode> {
-    let devices_info =
-        stats::get_client_monitor(&app_state.db_pool, &query.user_id, query.client_id)
-            .await
-            .map_err(|e| {
-                tracing::error!("Failed to get client stats: {}", e);
-                StatusCode::INTERNAL_SERVER_ERROR
-            })?;
+    let before = query
+        .before_client_id
+        .map(|client_id| (query.before_date, client_id));
+    let devices_info = stats::get_client_monitor(
+        &app_state.db_pool,
+        &query.user_id,
+        query.client_id,
+        before,
+        stats::page_limit(query.limit),
+    )
+    .await
+    .map_err(|e| {
+        tracing::error!("Failed to get client stats: {}", e);
+        StatusCode::INTERNAL_SERVER_ERROR
+    })?;
 
     Ok(Json(ApiResponse::success(devices_info)))
 }
@@ -274,6 +291,13 @@ pub struct ClientHealthQuery {
     pub client_id: Option<String>,
     pub start_date: Option<String>,
     pub end_date: Option<String>,
+    /// "hour" reads the hourly rollup instead of raw heartbeats.
+    pub granularity: Option<String>,
+    /// Keyset cursor: RFC 3339 timestamp and client_id of the last row
+    /// already seen.
+    pub before: Option<String>,
+    pub before_client_id: Option<String>,
+    pub limit: Option<i64>,
 }
 
 pub async fn get_client_health(
@@ -286,6 +310,9 @@ pub async fn get_client_health(
         query.client_id,
         query.start_date,
         query.end_date,
+        query.granularity.as_deref() == Some("hour"),
+        query.before.zip(query.before_client_id),
+        stats::page_limit(query.limit),
     )
     .await
     .map_err(|e| {
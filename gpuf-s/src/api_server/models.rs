@@ -1,5 +1,6 @@
 use crate::api_server::ApiServer;
 use crate::db::models;
+use crate::util::db::{publish_invalidation, INVALIDATE_ALL};
 use crate::util::msg::ApiResponse;
 use axum::{
     extract::{Query, State},
@@ -66,7 +67,15 @@ pub async fn create_or_update_model(
     )
     .await
     {
-        Ok(_) => Ok(Json(ApiResponse::success(()))),
+        Ok(_) => {
+            publish_invalidation(
+                &app_state.redis_client,
+                models::MODEL_INVALIDATION_CHANNEL,
+                INVALIDATE_ALL,
+            )
+            .await;
+            Ok(Json(ApiResponse::success(())))
+        }
         Err(e) => {
             error!("Failed to create/update model: {}", e);
             Err(StatusCode::INTERNAL_SERVER_ERROR)
@@ -1,6 +1,7 @@
 use anyhow::Result;
 use clap::Parser;
 use gpuf_s::consumer;
+use gpuf_s::util::policy::HEARTBEAT_TOPIC;
 use tracing::{error, info};
 use tracing_subscriber::{fmt, EnvFilter};
 
@@ -122,7 +123,7 @@ async fn main() -> Result<()> {
     consumer::start_consumer_services(
         &args.bootstrap_server, // From your command line args
         "heartbeat-consumer-group",
-        "client-heartbeats",
+        HEARTBEAT_TOPIC,
         db_pool,
         args.batch_size,    // Batch size
         args.batch_timeout, // Batch timeout in seconds
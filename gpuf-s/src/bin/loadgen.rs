@@ -0,0 +1,393 @@
+//! Load generator for a running gpuf-s.
+//!
+//! Connects fake workers to the control port that log in, report one model,
+//! heartbeat, and answer every inference task by streaming result chunks at a
+//! fixed token rate. OpenAI-style clients then send streamed chat completions
+//! to the inference gateway and time the first SSE event (TTFT) and the end of
+//! each stream. Worker ids are read one hex id per line from `--worker-ids`;
+//! they must be registered clients that `--api-key` may route to.
+
+use anyhow::{anyhow, Context, Result};
+use bytes::BytesMut;
+use clap::Parser;
+use common::{
+    read_command, write_command, Command, CommandV1, DevicesInfo, Model, OsType, OutputPhase,
+    SystemInfo,
+};
+use gpuf_s::util::protoc::ClientId;
+use std::str::FromStr;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+use tokio::io::{AsyncReadExt, AsyncWriteExt};
+use tokio::net::tcp::{OwnedReadHalf, OwnedWriteHalf};
+use tokio::net::TcpStream;
+use tokio::sync::Mutex;
+use tracing::{info, warn};
+use tracing_subscriber::{fmt, EnvFilter};
+
+/// Protocol version the fake workers log in with: plain result chunks, no
+/// negotiated extensions.
+const WORKER_VERSION: u32 = 1;
+const HEARTBEAT_INTERVAL: Duration = Duration::from_secs(10);
+
+#[derive(Parser, Debug)]
+#[command(author, version, about, long_about = None)]
+pub struct Args {
+    /// gpuf-s control address the workers connect to
+    #[arg(long, default_value = "127.0.0.1:17000")]
+    pub control: String,
+
+    /// Inference gateway address the clients send requests to
+    #[arg(long, default_value = "127.0.0.1:8081")]
+    pub gateway: String,
+
+    /// File of registered worker client ids, one hex id per line
+    #[arg(long)]
+    pub worker_ids: String,
+
+    /// API key whose client ids include the worker ids
+    #[arg(long)]
+    pub api_key: String,
+
+    /// Model the workers report and the clients request
+    #[arg(long, default_value = "loadgen")]
+    pub model: String,
+
+    /// Fake workers to connect; at most one per id in --worker-ids
+    #[arg(long, default_value_t = 8)]
+    pub workers: usize,
+
+    /// Concurrent clients
+    #[arg(long, default_value_t = 32)]
+    pub clients: usize,
+
+    /// Requests sent by each client, one after another
+    #[arg(long, default_value_t = 20)]
+    pub requests: usize,
+
+    /// Tokens streamed per task
+    #[arg(long, default_value_t = 64)]
+    pub tokens: u32,
+
+    /// Delay between streamed tokens, in milliseconds
+    #[arg(long, default_value_t = 20)]
+    pub token_ms: u64,
+}
+
+#[tokio::main]
+async fn main() -> Result<()> {
+    fmt()
+        .with_env_filter(EnvFilter::from_default_env().add_directive("loadgen=info".parse()?))
+        .init();
+    let args = Arc::new(Args::try_parse()?);
+
+    let ids = std::fs::read_to_string(&args.worker_ids)
+        .with_context(|| format!("reading {}", args.worker_ids))?
+        .lines()
+        .map(str::trim)
+        .filter(|l| !l.is_empty())
+        .map(ClientId::from_str)
+        .collect::<Result<Vec<_>>>()?;
+    if ids.len() < args.workers {
+        return Err(anyhow!(
+            "--workers {} needs as many ids, {} has {}",
+            args.workers,
+            args.worker_ids,
+            ids.len()
+        ));
+    }
+
+    let mut ready = Vec::with_capacity(args.workers);
+    for id in ids.into_iter().take(args.workers) {
+        let (tx, rx) = tokio::sync::oneshot::channel();
+        let args = args.clone();
+        tokio::spawn(async move {
+            if let Err(e) = run_worker(&args, id, tx).await {
+                warn!("worker {} stopped: {}", id, e);
+            }
+        });
+        ready.push(rx);
+    }
+    for rx in ready {
+        rx.await
+            .map_err(|_| anyhow!("a worker failed to log in"))??;
+    }
+    info!("{} workers logged in", args.workers);
+
+    let started = Instant::now();
+    let clients: Vec<_> = (0..args.clients)
+        .map(|_| {
+            let args = args.clone();
+            tokio::spawn(async move { run_client(&args).await })
+        })
+        .collect();
+    let mut samples = Vec::new();
+    let mut failed = 0;
+    for client in clients {
+        for sample in client.await? {
+            match sample {
+                Ok(sample) => samples.push(sample),
+                Err(e) => {
+                    failed += 1;
+                    warn!("request failed: {}", e);
+                }
+            }
+        }
+    }
+    report(&samples, failed, started.elapsed());
+    Ok(())
+}
+
+async fn run_worker(
+    args: &Args,
+    id: ClientId,
+    ready: tokio::sync::oneshot::Sender<Result<()>>,
+) -> Result<()> {
+    let stream = TcpStream::connect(&args.control).await?;
+    stream.set_nodelay(true)?;
+    let (mut reader, writer) = stream.into_split();
+    let writer = Arc::new(Mutex::new(writer));
+    let devices_info = vec![DevicesInfo {
+        os_type: OsType::ANDROID,
+        ..Default::default()
+    }];
+
+    send(
+        &writer,
+        CommandV1::Login {
+            client_id: id.0,
+            version: WORKER_VERSION,
+            os_type: OsType::ANDROID,
+            auto_models: false,
+            system_info: SystemInfo::default(),
+            device_memtotal_gb: 8,
+            device_total_tflops: 10,
+            devices_info: devices_info.clone(),
+        },
+    )
+    .await?;
+
+    // Heartbeats go out from their own task: read_command is not cancel
+    // safe, so it cannot share a select! with a timer.
+    let heartbeat = {
+        let writer = writer.clone();
+        let devices_info = devices_info.clone();
+        tokio::spawn(async move {
+            let mut ticker = tokio::time::interval(HEARTBEAT_INTERVAL);
+            loop {
+                ticker.tick().await;
+                let beat = CommandV1::Heartbeat {
+                    client_id: id.0,
+                    system_info: SystemInfo::default(),
+                    device_count: 1,
+                    device_memtotal_gb: 8,
+                    device_total_tflops: 10,
+                    devices_info: devices_info.clone(),
+                };
+                if send(&writer, beat).await.is_err() {
+                    return;
+                }
+            }
+        })
+    };
+    let result = serve_tasks(args, id, &mut reader, &writer, ready).await;
+    heartbeat.abort();
+    result
+}
+
+async fn serve_tasks(
+    args: &Args,
+    id: ClientId,
+    reader: &mut OwnedReadHalf,
+    writer: &Arc<Mutex<OwnedWriteHalf>>,
+    ready: tokio::sync::oneshot::Sender<Result<()>>,
+) -> Result<()> {
+    let mut buf = BytesMut::with_capacity(8192);
+    let mut ready = Some(ready);
+    loop {
+        let Command::V1(command) = read_command(reader, &mut buf).await? else {
+            continue;
+        };
+        match command {
+            CommandV1::LoginResult { success, error, .. } => {
+                let result = if success {
+                    send(
+                        writer,
+                        CommandV1::ModelStatus {
+                            client_id: id.0,
+                            models: vec![Model {
+                                id: args.model.clone(),
+                                object: "model".to_string(),
+                                created: 0,
+                                owned_by: "loadgen".to_string(),
+                            }],
+                            auto_models_device: Vec::new(),
+                        },
+                    )
+                    .await
+                } else {
+                    Err(anyhow!("login of {} rejected: {:?}", id, error))
+                };
+                let failed = result.is_err();
+                if let Some(ready) = ready.take() {
+                    let _ = ready.send(result);
+                }
+                if failed {
+                    return Ok(());
+                }
+            }
+            CommandV1::InferenceTask { task_id, .. }
+            | CommandV1::ChatInferenceTask { task_id, .. } => {
+                let writer = writer.clone();
+                let (tokens, token_ms) = (args.tokens, args.token_ms);
+                tokio::spawn(async move {
+                    if let Err(e) = stream_task(&writer, task_id, tokens, token_ms).await {
+                        warn!("streaming a task failed: {}", e);
+                    }
+                });
+            }
+            _ => {}
+        }
+    }
+}
+
+/// Answer a task with `tokens` one-token chunks, then a final chunk.
+async fn stream_task(
+    writer: &Mutex<OwnedWriteHalf>,
+    task_id: String,
+    tokens: u32,
+    token_ms: u64,
+) -> Result<()> {
+    let chunk = |seq: u32, delta: &str, done: bool, completion_tokens: u32| {
+        CommandV1::InferenceResultChunk {
+            task_id: task_id.clone(),
+            seq,
+            delta: delta.to_string(),
+            phase: OutputPhase::Final,
+            done,
+            error: None,
+            prompt_tokens: 16,
+            completion_tokens,
+            analysis_tokens: 0,
+            final_tokens: completion_tokens,
+        }
+    };
+    let mut ticker = tokio::time::interval(Duration::from_millis(token_ms.max(1)));
+    for seq in 0..tokens {
+        ticker.tick().await;
+        send(writer, chunk(seq, " tok", false, seq + 1)).await?;
+    }
+    send(writer, chunk(tokens, "", true, tokens)).await
+}
+
+async fn send(writer: &Mutex<OwnedWriteHalf>, command: CommandV1) -> Result<()> {
+    write_command(&mut *writer.lock().await, &Command::V1(command)).await
+}
+
+struct Sample {
+    ttft: Duration,
+    total: Duration,
+}
+
+async fn run_client(args: &Args) -> Vec<Result<Sample>> {
+    let body = serde_json::json!({
+        "model": args.model,
+        "stream": true,
+        "max_tokens": args.tokens,
+        "messages": [{"role": "user", "content": "Say something."}],
+    })
+    .to_string();
+    let request = format!(
+        "POST /v1/chat/completions HTTP/1.1\r\n\
+         Host: {}\r\n\
+         Authorization: Bearer {}\r\n\
+         Content-Type: application/json\r\n\
+         Content-Length: {}\r\n\
+         Connection: close\r\n\
+         \r\n\
+         {}",
+        args.gateway,
+        args.api_key,
+        body.len(),
+        body
+    );
+    let mut samples = Vec::with_capacity(args.requests);
+    for _ in 0..args.requests {
+        samples.push(chat_stream(&args.gateway, request.as_bytes()).await);
+    }
+    samples
+}
+
+/// Send one streamed request and time its first event and its end.
+async fn chat_stream(gateway: &str, request: &[u8]) -> Result<Sample> {
+    let started = Instant::now();
+    let mut stream = TcpStream::connect(gateway).await?;
+    stream.set_nodelay(true)?;
+    stream.write_all(request).await?;
+
+    let mut response = Vec::with_capacity(16 * 1024);
+    let mut ttft = None;
+    loop {
+        let mut chunk = [0u8; 4096];
+        let n = stream.read(&mut chunk).await?;
+        if n == 0 {
+            return Err(anyhow!("stream closed before [DONE]"));
+        }
+        response.extend_from_slice(&chunk[..n]);
+        if !response.starts_with(b"HTTP/1.1 200") && response.len() >= 12 {
+            let head = String::from_utf8_lossy(&response[..response.len().min(256)]);
+            return Err(anyhow!(
+                "unexpected response: {}",
+                head.lines().next().unwrap_or("")
+            ));
+        }
+        if ttft.is_none() && contains(&response, b"data:") {
+            ttft = Some(started.elapsed());
+        }
+        if contains(&response, b"[DONE]") {
+            let total = started.elapsed();
+            return Ok(Sample {
+                ttft: ttft.unwrap_or(total),
+                total,
+            });
+        }
+    }
+}
+
+fn contains(haystack: &[u8], needle: &[u8]) -> bool {
+    memchr::memmem::find(haystack, needle).is_some()
+}
+
+fn percentile(sorted: &[Duration], p: usize) -> Duration {
+    if sorted.is_empty() {
+        return Duration::ZERO;
+    }
+    sorted[(sorted.len() - 1) * p / 100]
+}
+
+fn report(samples: &[Sample], failed: usize, elapsed: Duration) {
+    let mut ttft: Vec<Duration> = samples.iter().map(|s| s.ttft).collect();
+    let mut total: Vec<Duration> = samples.iter().map(|s| s.total).collect();
+    ttft.sort();
+    total.sort();
+    println!(
+        "requests: {} ok, {} failed in {:.2?}",
+        samples.len(),
+        failed,
+        elapsed
+    );
+    println!(
+        "throughput: {:.1} req/s",
+        samples.len() as f64 / elapsed.as_secs_f64()
+    );
+    println!(
+        "ttft:  p50 {:.2?}  p99 {:.2?}",
+        percentile(&ttft, 50),
+        percentile(&ttft, 99)
+    );
+    println!(
+        "total: p50 {:.2?}  p99 {:.2?}",
+        percentile(&total, 50),
+        percentile(&total, 99)
+    );
+}
@@ -1,14 +1,25 @@
 use anyhow::Result;
-use chrono::{TimeZone, Utc};
+use chrono::{NaiveDate, TimeZone, Utc};
 use rdkafka::message::Timestamp;
 use rdkafka::message::{Message, OwnedMessage};
 use sqlx::{Pool, Postgres};
+use std::collections::{HashMap, HashSet};
 use tokio::sync::mpsc;
-use tracing::{debug, error, info};
+use tracing::{debug, error, info, warn};
 
-use crate::db::stats::{insert_heartbeat, ClientDailyStats, DeviceDailyStats};
-use crate::util::protoc;
-use common::format_bytes;
+use crate::db::stats::{
+    device_name, heartbeat_intervals, insert_heartbeats, upsert_client_hourly, ClientDailyRow,
+    ClientDailyStats, ClientHourlyRow, DeviceDailyRow, DeviceDailyStats, HeartbeatRecord,
+};
+use crate::util::kafka;
+use crate::util::protoc::{self, ClientId};
+use common::{format_bytes, get_u8_from_u64};
+
+// Batches smaller than this are decoded inline; decoding is cheap per message.
+const PARALLEL_DECODE_MIN: usize = 512;
+const DEFAULT_HEARTBEAT_INTERVAL_SECS: i64 = 120;
+// Packed per-device fields hold at most eight devices.
+const MAX_DEVICES_PER_ENTRY: usize = 8;
 
 #[allow(dead_code)]
 pub async fn start_processor(
@@ -44,127 +55,419 @@ pub async fn start_processor(
     Ok(())
 }
 
-#[allow(dead_code)]
-async fn process_batch(messages: Vec<OwnedMessage>, db_pool: Pool<Postgres>) -> Result<()> {
-    for message in messages {
-        match message.key() {
-            Some(_key) => {
-                let event_ts = match message.timestamp() {
-                    Timestamp::NotAvailable => Utc::now(),
-                    Timestamp::CreateTime(ms) | Timestamp::LogAppendTime(ms) => Utc
-                        .timestamp_millis_opt(ms)
-                        .single()
-                        .unwrap_or_else(Utc::now),
-                };
-
-                // Parse the message payload
-                let payload = match message.payload() {
-                    Some(p) => p,
-                    None => {
-                        error!("Message has no payload, skipping");
-                        continue;
-                    }
-                };
-
-                // Log raw payload for debugging
-                debug!(
-                    "Raw payload: {:?}",
-                    std::str::from_utf8(payload).unwrap_or("[invalid utf8]")
-                );
-                let cfg = bincode::config::standard()
-                    .with_fixed_int_encoding()
-                    .with_little_endian();
-                // Try to deserialize as JSON first
-                let (heartbeat, _): (protoc::HeartbeatMessage, _) =
-                    match bincode::decode_from_slice(payload, cfg) {
-                        Ok(v) => v,
-                        Err(e) => {
-                            error!("Failed to deserialize heartbeat: {}", e);
-                            continue;
-                        }
-                    };
-
-                let mut transaction = match db_pool.begin().await {
-                    Ok(tx) => tx,
-                    Err(e) => {
-                        error!("Failed to start DB transaction: {}", e);
-                        continue;
-                    }
-                };
-
-                info!("Heartbeat received from client {} total_tflops {} cpu_usage {}% memory_usage {}% disk_usage {}% network_up {} network_down {}", heartbeat.client_id, heartbeat.total_tflops, heartbeat.system_info.cpu_usage, heartbeat.system_info.memory_usage, heartbeat.system_info.disk_usage,  format_bytes!(heartbeat.system_info.network_tx),format_bytes!(heartbeat.system_info.network_rx));
-                // Update last seen timestamp with safe type conversion
-                if let Err(e) = insert_heartbeat(
-                    &mut transaction,
-                    &heartbeat.client_id,
-                    &heartbeat.system_info,
-                    &heartbeat.devices_info,
-                    heartbeat.device_memtotal_gb.try_into().unwrap_or(0),
-                    heartbeat.device_count.try_into().unwrap_or(0),
-                    heartbeat.total_tflops.try_into().unwrap_or(0),
-                    Some(event_ts),
-                )
-                .await
-                {
-                    error!(
-                        "Failed to update heartbeat for client {:?}: {}",
-                        heartbeat.client_id, e
-                    );
-                    let _ = transaction.rollback().await;
-                    continue;
-                }
+fn decode_message(message: &OwnedMessage) -> Option<HeartbeatRecord> {
+    if message.key().is_none() {
+        debug!("Received message with no key, skipping");
+        return None;
+    }
 
-                if let Err(e) = ClientDailyStats::upsert(
-                    &mut transaction,
-                    &heartbeat.client_id,
-                    Some(heartbeat.system_info.cpu_usage as f64),
-                    Some(heartbeat.system_info.memory_usage as f64),
-                    Some(heartbeat.system_info.disk_usage as f64),
-                    Some(heartbeat.system_info.network_rx.try_into().unwrap_or(0)),
-                    Some(heartbeat.system_info.network_tx.try_into().unwrap_or(0)),
-                    event_ts,
-                )
-                .await
-                {
-                    error!(
-                        "Failed to update client heartbeat for client {}: {}",
-                        heartbeat.client_id, e
-                    );
-                    let _ = transaction.rollback().await;
-                    continue;
-                }
-                if let Err(e) = DeviceDailyStats::upsert_batch(
-                    &mut transaction,
-                    &heartbeat.client_id,
-                    &heartbeat.devices_info,
-                    event_ts,
-                )
-                .await
-                {
-                    error!(
-                        "Failed to update device heartbeat for client {}: {}",
-                        heartbeat.client_id, e
-                    );
-                    let _ = transaction.rollback().await;
-                    continue;
-                }
+    let timestamp = match message.timestamp() {
+        Timestamp::NotAvailable => Utc::now(),
+        Timestamp::CreateTime(ms) | Timestamp::LogAppendTime(ms) => Utc
+            .timestamp_millis_opt(ms)
+            .single()
+            .unwrap_or_else(Utc::now),
+    };
 
-                if let Err(e) = transaction.commit().await {
-                    error!("Failed to commit transaction for client {}: {}", heartbeat.client_id, e);
-                    continue;
-                }
+    let Some(payload) = message.payload() else {
+        error!("Message has no payload, skipping");
+        return None;
+    };
 
-                debug!(
-                    "Successfully processed heartbeat for client: {}",
-                    heartbeat.client_id
-                );
+    let (heartbeat, _): (protoc::HeartbeatMessage, _) =
+        match bincode::decode_from_slice(payload, kafka::wire_config()) {
+            Ok(v) => v,
+            Err(e) => {
+                error!("Failed to deserialize heartbeat: {}", e);
+                return None;
             }
-            None => {
-                debug!("Received message with no key, skipping");
-                continue;
+        };
+
+    debug!("Heartbeat received from client {} total_tflops {} cpu_usage {}% memory_usage {}% disk_usage {}% network_up {} network_down {}", heartbeat.client_id, heartbeat.total_tflops, heartbeat.system_info.cpu_usage, heartbeat.system_info.memory_usage, heartbeat.system_info.disk_usage,  format_bytes!(heartbeat.system_info.network_tx),format_bytes!(heartbeat.system_info.network_rx));
+
+    Some(HeartbeatRecord {
+        client_id: heartbeat.client_id,
+        system_info: heartbeat.system_info,
+        devices_info: heartbeat.devices_info,
+        device_memtotal_gb: heartbeat.device_memtotal_gb.try_into().unwrap_or(0),
+        device_count: heartbeat.device_count.try_into().unwrap_or(0),
+        total_tflops: heartbeat.total_tflops.try_into().unwrap_or(0),
+        timestamp,
+    })
+}
+
+/// Decode a batch, splitting large batches across blocking worker threads.
+async fn decode_batch(messages: Vec<OwnedMessage>) -> Vec<HeartbeatRecord> {
+    if messages.len() < PARALLEL_DECODE_MIN {
+        return messages.iter().filter_map(decode_message).collect();
+    }
+
+    let workers = std::thread::available_parallelism()
+        .map(|n| n.get())
+        .unwrap_or(1);
+    let chunk_len = messages
+        .len()
+        .div_ceil(workers)
+        .max(PARALLEL_DECODE_MIN / 2);
+    let mut chunks = Vec::new();
+    let mut messages = messages.into_iter();
+    loop {
+        let chunk: Vec<OwnedMessage> = messages.by_ref().take(chunk_len).collect();
+        if chunk.is_empty() {
+            break;
+        }
+        chunks.push(tokio::task::spawn_blocking(move || {
+            chunk.iter().filter_map(decode_message).collect::<Vec<_>>()
+        }));
+    }
+
+    let mut records = Vec::new();
+    for (i, decoded) in futures::future::join_all(chunks)
+        .await
+        .into_iter()
+        .enumerate()
+    {
+        match decoded {
+            Ok(mut part) => records.append(&mut part),
+            Err(e) => error!("Heartbeat decode worker {} failed: {}", i, e),
+        }
+    }
+    records
+}
+
+#[derive(Default)]
+struct ClientAcc {
+    buckets: HashSet<i64>,
+    cpu: f64,
+    memory: f64,
+    disk: f64,
+    network_in: i64,
+    network_out: i64,
+    last_heartbeat: Option<chrono::DateTime<Utc>>,
+    last_bucket: i64,
+}
+
+#[derive(Default)]
+struct HourAcc {
+    count: i32,
+    cpu: f64,
+    memory: f64,
+    disk: f64,
+    network_in: i64,
+    network_out: i64,
+    last_heartbeat: Option<chrono::DateTime<Utc>>,
+}
+
+#[derive(Default)]
+struct DeviceAcc {
+    name: String,
+    count: i32,
+    utilization: f64,
+    temperature: f64,
+    power: f64,
+    memory: f64,
+}
+
+/// Rows one batch adds to each rollup table.
+struct Rollups {
+    clients: Vec<ClientDailyRow>,
+    devices: Vec<DeviceDailyRow>,
+    hours: Vec<ClientHourlyRow>,
+}
+
+/// Aggregate a batch into per-client daily and hourly rows and per-device
+/// daily rows.
+///
+/// A heartbeat counts towards averages and totals only if its bucket
+/// (timestamp / interval) is newer than the last bucket stored for that
+/// client and day and has not been seen earlier in the batch, matching the
+/// per-row upsert this replaces. Device and hourly rows share the client's
+/// buckets since all are written in the same transaction. Records must be
+/// sorted by timestamp so the latest device name wins.
+fn rollup(
+    records: &[HeartbeatRecord],
+    intervals: &HashMap<NaiveDate, i64>,
+    stored_buckets: &HashMap<(ClientId, NaiveDate), i64>,
+) -> Rollups {
+    let mut clients: HashMap<(ClientId, NaiveDate), ClientAcc> = HashMap::new();
+    let mut devices: HashMap<(ClientId, NaiveDate, i16), DeviceAcc> = HashMap::new();
+    let mut hours: HashMap<(ClientId, i64), HourAcc> = HashMap::new();
+
+    for record in records {
+        let day = record.timestamp.date_naive();
+        let interval = intervals
+            .get(&day)
+            .copied()
+            .unwrap_or(DEFAULT_HEARTBEAT_INTERVAL_SECS)
+            .max(1);
+        let bucket = (record.timestamp.timestamp() / interval).max(0);
+        let key = (record.client_id, day);
+
+        let acc = clients.entry(key).or_default();
+        acc.last_heartbeat = acc.last_heartbeat.max(Some(record.timestamp));
+        acc.last_bucket = acc.last_bucket.max(bucket);
+        let fresh = stored_buckets
+            .get(&key)
+            .map_or(true, |stored| bucket > *stored)
+            && acc.buckets.insert(bucket);
+        if !fresh {
+            continue;
+        }
+
+        let info = &record.system_info;
+        acc.cpu += info.cpu_usage as f64;
+        acc.memory += info.memory_usage as f64;
+        acc.disk += info.disk_usage as f64;
+        acc.network_in = acc
+            .network_in
+            .saturating_add(info.network_rx.try_into().unwrap_or(0));
+        acc.network_out = acc
+            .network_out
+            .saturating_add(info.network_tx.try_into().unwrap_or(0));
+
+        let timestamp = record.timestamp.timestamp();
+        let hour = hours
+            .entry((record.client_id, timestamp - timestamp.rem_euclid(3600)))
+            .or_default();
+        hour.count += 1;
+        hour.cpu += info.cpu_usage as f64;
+        hour.memory += info.memory_usage as f64;
+        hour.disk += info.disk_usage as f64;
+        hour.network_in = hour
+            .network_in
+            .saturating_add(info.network_rx.try_into().unwrap_or(0));
+        hour.network_out = hour
+            .network_out
+            .saturating_add(info.network_tx.try_into().unwrap_or(0));
+        hour.last_heartbeat = hour.last_heartbeat.max(Some(record.timestamp));
+
+        for device in &record.devices_info {
+            for index in 0..(device.num as usize).min(MAX_DEVICES_PER_ENTRY) {
+                let dev = devices
+                    .entry((record.client_id, day, index as i16))
+                    .or_default();
+                dev.name = device_name(device, index);
+                dev.count += 1;
+                dev.utilization += get_u8_from_u64(device.usage, index) as f64;
+                dev.temperature += get_u8_from_u64(device.temp, index) as f64;
+                dev.power += get_u8_from_u64(device.power_usage, index) as f64;
+                dev.memory += get_u8_from_u64(device.mem_usage, index) as f64;
             }
         }
     }
 
+    let mean = |sum: f64, n: usize| if n == 0 { 0.0 } else { sum / n as f64 };
+    let mut client_rows: Vec<ClientDailyRow> = clients
+        .iter()
+        .filter_map(|((client_id, day), acc)| {
+            let n = acc.buckets.len();
+            Some(ClientDailyRow {
+                date: *day,
+                client_id: *client_id,
+                total_heartbeats: n as i32,
+                avg_cpu_usage: mean(acc.cpu, n),
+                avg_memory_usage: mean(acc.memory, n),
+                avg_disk_usage: mean(acc.disk, n),
+                network_in_bytes: acc.network_in,
+                network_out_bytes: acc.network_out,
+                last_heartbeat: acc.last_heartbeat?,
+                last_heartbeat_bucket: acc.last_bucket,
+            })
+        })
+        .collect();
+    client_rows.sort_by_key(|r| (r.client_id, r.date));
+
+    let mut device_rows: Vec<DeviceDailyRow> = devices
+        .into_iter()
+        .filter_map(|((client_id, day, device_index), dev)| {
+            let client = clients.get(&(client_id, day))?;
+            let n = dev.count as usize;
+            Some(DeviceDailyRow {
+                date: day,
+                client_id,
+                device_index,
+                device_name: dev.name,
+                total_heartbeats: dev.count,
+                avg_utilization: mean(dev.utilization, n),
+                avg_temperature: mean(dev.temperature, n),
+                avg_power_usage: mean(dev.power, n),
+                avg_memory_usage: mean(dev.memory, n),
+                last_heartbeat: client.last_heartbeat?,
+                last_heartbeat_bucket: client.last_bucket,
+            })
+        })
+        .collect();
+    device_rows.sort_by_key(|r| (r.client_id, r.date, r.device_index));
+
+    let mut hour_rows: Vec<ClientHourlyRow> = hours
+        .into_iter()
+        .filter_map(|((client_id, hour), acc)| {
+            Some(ClientHourlyRow {
+                hour: Utc.timestamp_opt(hour, 0).single()?,
+                client_id,
+                total_heartbeats: acc.count,
+                sum_cpu_usage: acc.cpu,
+                sum_memory_usage: acc.memory,
+                sum_disk_usage: acc.disk,
+                network_in_bytes: acc.network_in,
+                network_out_bytes: acc.network_out,
+                last_heartbeat: acc.last_heartbeat?,
+            })
+        })
+        .collect();
+    hour_rows.sort_by_key(|r| (r.client_id, r.hour));
+
+    Rollups {
+        clients: client_rows,
+        devices: device_rows,
+        hours: hour_rows,
+    }
+}
+
+/// Decode a Kafka batch and persist it in one transaction: one multi-row
+/// statement per table instead of a round trip per heartbeat. If the batch
+/// fails, each heartbeat is retried in its own transaction so one bad row
+/// only loses that heartbeat.
+#[allow(dead_code)]
+async fn process_batch(messages: Vec<OwnedMessage>, db_pool: Pool<Postgres>) -> Result<()> {
+    let mut records = decode_batch(messages).await;
+    if records.is_empty() {
+        return Ok(());
+    }
+    records.sort_by_key(|r| r.timestamp);
+
+    let error = match persist_records(&db_pool, &records).await {
+        Ok(()) => return Ok(()),
+        Err(e) => e,
+    };
+    warn!(
+        "Batch of {} heartbeats failed ({}), retrying one by one",
+        records.len(),
+        error
+    );
+    let mut failed = 0;
+    for record in &records {
+        if let Err(e) = persist_records(&db_pool, std::slice::from_ref(record)).await {
+            failed += 1;
+            error!(
+                "Dropping heartbeat from client {} at {}: {}",
+                record.client_id, record.timestamp, e
+            );
+        }
+    }
+    if failed == records.len() {
+        return Err(error);
+    }
+    Ok(())
+}
+
+/// Persist `records` (sorted by time) and their rollups in one transaction.
+async fn persist_records(db_pool: &Pool<Postgres>, records: &[HeartbeatRecord]) -> Result<()> {
+    let mut days: Vec<NaiveDate> = records.iter().map(|r| r.timestamp.date_naive()).collect();
+    days.sort_unstable();
+    days.dedup();
+    let mut keys: Vec<(ClientId, NaiveDate)> = records
+        .iter()
+        .map(|r| (r.client_id, r.timestamp.date_naive()))
+        .collect();
+    keys.sort_unstable();
+    keys.dedup();
+
+    let mut transaction = db_pool.begin().await?;
+    let intervals = heartbeat_intervals(&mut transaction, &days).await?;
+    let stored_buckets = ClientDailyStats::last_buckets(&mut transaction, &keys).await?;
+    let rollups = rollup(records, &intervals, &stored_buckets);
+
+    insert_heartbeats(&mut transaction, records).await?;
+    ClientDailyStats::upsert_batch(&mut transaction, &rollups.clients).await?;
+    DeviceDailyStats::upsert_batch(&mut transaction, &rollups.devices).await?;
+    upsert_client_hourly(&mut transaction, &rollups.hours).await?;
+    transaction.commit().await?;
+
+    debug!(
+        "Persisted {} heartbeats for {} clients ({} device rows, {} hourly rows)",
+        records.len(),
+        rollups.clients.len(),
+        rollups.devices.len(),
+        rollups.hours.len()
+    );
     Ok(())
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use common::{DevicesInfo, EngineType, OsType, SystemInfo};
+
+    fn record(id: u8, secs: i64, cpu: u8) -> HeartbeatRecord {
+        HeartbeatRecord {
+            client_id: ClientId([id; 16]),
+            system_info: SystemInfo {
+                cpu_usage: cpu,
+                memory_usage: 50,
+                disk_usage: 10,
+                network_rx: 100,
+                network_tx: 200,
+            },
+            devices_info: vec![DevicesInfo {
+                num: 1,
+                pod_id: 0,
+                total_tflops: 0,
+                memtotal_gb: 0,
+                port: 0,
+                ip: 0,
+                os_type: OsType::LINUX,
+                engine_type: EngineType::Llama,
+                usage: 40,
+                mem_usage: 0,
+                power_usage: 0,
+                temp: 0,
+                vendor_id: 0,
+                device_id: 0,
+                memsize_gb: 0,
+                powerlimit_w: 0,
+            }],
+            device_memtotal_gb: 0,
+            device_count: 1,
+            total_tflops: 0,
+            timestamp: Utc.timestamp_opt(secs, 0).unwrap(),
+        }
+    }
+
+    #[test]
+    fn test_rollup_dedupes_buckets() {
+        let base = 1_700_000_040; // multiple of 120
+        let records = vec![
+            record(1, base, 10),
+            record(1, base + 30, 99), // same bucket: only refreshes last_heartbeat
+            record(1, base + 120, 30),
+            record(2, base, 70),
+        ];
+        let day = records[0].timestamp.date_naive();
+        let stored = HashMap::from([((ClientId([2; 16]), day), base / 120)]);
+        let Rollups {
+            clients,
+            devices,
+            hours,
+        } = rollup(&records, &HashMap::new(), &stored);
+
+        assert_eq!(clients.len(), 2);
+        assert_eq!(clients[0].total_heartbeats, 2);
+        assert_eq!(clients[0].avg_cpu_usage, 20.0);
+        assert_eq!(clients[0].network_in_bytes, 200);
+        assert_eq!(clients[0].last_heartbeat, records[2].timestamp);
+        // Client 2's only heartbeat is already recorded.
+        assert_eq!(clients[1].total_heartbeats, 0);
+        assert_eq!(clients[1].network_in_bytes, 0);
+
+        assert_eq!(devices.len(), 1);
+        assert_eq!(devices[0].total_heartbeats, 2);
+        assert_eq!(devices[0].avg_utilization, 40.0);
+
+        // Both of client 1's counted heartbeats fall in one hour.
+        assert_eq!(hours.len(), 1);
+        assert_eq!(hours[0].total_heartbeats, 2);
+        assert_eq!(hours[0].sum_cpu_usage, 40.0);
+        assert_eq!(hours[0].hour.timestamp() % 3600, 0);
+    }
+}
@@ -17,16 +17,29 @@ struct ClientRecord {
 struct TokenInfo {
     user_id: String,
     access_level: i32,
+    expired_time: i64,
 }
 
-pub async fn get_user_client_by_token(
+/// Devices an API key may route to.
+#[derive(Debug)]
+pub struct TokenClients {
+    pub user_id: String,
+    pub client_ids: Vec<ClientId>,
+    pub access_level: AccessLevel,
+    /// Unix seconds after which the key stops being valid, -1 if never.
+    pub expired_time: i64,
+}
+
+/// Look up `token`, returning `None` when it is unknown, disabled or expired.
+/// Callers on the request path go through [`super::token_cache::TokenCache`].
+pub async fn load_token_clients(
     pool: &Pool<Postgres>,
     token: &str,
-) -> Result<(Vec<ClientId>, AccessLevel)> {
+) -> Result<Option<TokenClients>> {
     // First, get the token details including user_id and access_level
     let token_info = match sqlx::query_as::<_, TokenInfo>(
         r#"
-        SELECT user_id::text as user_id, access_level 
+        SELECT user_id::text as user_id, access_level, expired_time::bigint as expired_time
         FROM tokens 
         WHERE key = $1::varchar(48)
           AND status = 1
@@ -39,7 +52,7 @@ pub async fn get_user_client_by_token(
     .await?
     {
         Some(info) => info,
-        None => return Err(anyhow!("Invalid or expired token")),
+        None => return Ok(None),
     };
 
     let access_level = AccessLevel::from(token_info.access_level);
@@ -79,11 +92,29 @@ pub async fn get_user_client_by_token(
         })
         .collect::<Result<Vec<ClientId>>>()?;
 
-    if client_ids.is_empty() {
-        return Ok((vec![], access_level));
-    }
+    Ok(Some(TokenClients {
+        user_id: token_info.user_id,
+        client_ids,
+        access_level,
+        expired_time: token_info.expired_time,
+    }))
+}
 
-    Ok((client_ids, access_level))
+/// Every key [`load_token_clients`] would currently accept, for bulk syncs.
+#[allow(dead_code)] // Only used by the XDP prefilter
+pub async fn load_active_token_keys(pool: &Pool<Postgres>) -> Result<Vec<String>> {
+    let keys = sqlx::query_scalar::<_, String>(
+        r#"
+        SELECT key::text
+        FROM tokens
+        WHERE status = 1
+          AND (expired_time = -1 OR expired_time > EXTRACT(EPOCH FROM NOW())::bigint)
+          AND deleted_at IS NULL
+        "#,
+    )
+    .fetch_all(pool)
+    .await?;
+    Ok(keys)
 }
 
 pub async fn update_client_db(
@@ -2,6 +2,7 @@ pub mod apk;
 pub mod client;
 pub mod models;
 pub mod stats;
+pub mod token_cache;
 
 const GPU_ASSETS_TABLE: &str = "gpu_assets";
 const HEARTBEAT_TABLE: &str = "heartbeat";
@@ -11,4 +12,5 @@ const APK_VERSIONS_TABLE: &str = "apk_versions";
 #[allow(dead_code)]
 const CLIENT_MODELS_TABLE: &str = "client_models";
 const CLIENT_DAILY_STATS_TABLE: &str = "client_daily_stats";
+const CLIENT_HOURLY_STATS_TABLE: &str = "client_hourly_stats";
 const DEVICE_DAILY_STATS_TABLE: &str = "device_daily_stats";
@@ -1,42 +1,153 @@
 use crate::db::GPU_ASSETS_TABLE;
+use crate::util::db::listen_invalidations;
 use crate::util::protoc::ClientId;
 use anyhow::Result;
 use chrono::{DateTime, Utc};
 use common::{DevicesInfo, EngineType, OsType, PodModel};
 use lru::LruCache;
+use redis::Client as RedisClient;
 use sqlx::{Pool, Postgres};
+use std::collections::HashMap;
+use std::hash::Hash;
 use std::num::NonZeroUsize;
-use std::sync::Arc;
-use tokio::sync::RwLock;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
 use tracing::{error, info, warn, debug};
 
+/// Redis channel announcing that `client_models` changed.
+pub const MODEL_INVALIDATION_CHANNEL: &str = "gpuf:models-invalidate";
+
+// Upper bound on how stale a cached model lookup can get if an invalidation
+// is missed.
+const MODEL_CACHE_TTL: Duration = Duration::from_secs(300);
+
+/// Read-through LRU with a TTL. Misses on the same key are loaded one at a
+/// time so a burst of identical lookups (workers reconnecting after a
+/// restart) costs one query, while misses on other keys load in parallel. An
+/// epoch check keeps a load that raced an invalidation from being stored.
+struct ModelCache<K, V> {
+    entries: Mutex<LruCache<K, (V, Instant)>>,
+    /// Per-key load locks, present only while some caller holds or awaits one.
+    loading: Mutex<HashMap<K, Arc<tokio::sync::Mutex<()>>>>,
+    epoch: AtomicU64,
+}
+
+/// A caller's claim on a key's load lock; drops the map entry after the last
+/// claimant, including one whose load was cancelled.
+struct LoadSlot<'a, K: Hash + Eq, V> {
+    cache: &'a ModelCache<K, V>,
+    key: K,
+    lock: Arc<tokio::sync::Mutex<()>>,
+}
+
+impl<K: Hash + Eq, V> Drop for LoadSlot<'_, K, V> {
+    fn drop(&mut self) {
+        let mut loading = self.cache.loading.lock().unwrap_or_else(|e| e.into_inner());
+        // Claims are taken under this lock, so nobody can join in between.
+        if Arc::strong_count(&self.lock) == 2 {
+            loading.remove(&self.key);
+        }
+    }
+}
+
+impl<K: Hash + Eq + Clone, V: Clone> ModelCache<K, V> {
+    fn new(capacity: usize) -> Self {
+        Self {
+            entries: Mutex::new(LruCache::new(NonZeroUsize::new(capacity).unwrap())),
+            loading: Mutex::new(HashMap::new()),
+            epoch: AtomicU64::new(0),
+        }
+    }
+
+    fn get(&self, key: &K) -> Option<V> {
+        let mut entries = self.entries.lock().unwrap_or_else(|e| e.into_inner());
+        let fresh = entries
+            .get(key)
+            .map(|(value, stored)| (stored.elapsed() < MODEL_CACHE_TTL).then(|| value.clone()));
+        if let Some(None) = fresh {
+            entries.pop(key);
+        }
+        fresh.flatten()
+    }
+
+    async fn get_or_load<F, Fut>(&self, key: K, load: F) -> Result<V>
+    where
+        F: FnOnce() -> Fut,
+        Fut: std::future::Future<Output = Result<V>>,
+    {
+        if let Some(value) = self.get(&key) {
+            return Ok(value);
+        }
+        let slot = LoadSlot {
+            cache: self,
+            lock: self
+                .loading
+                .lock()
+                .unwrap_or_else(|e| e.into_inner())
+                .entry(key.clone())
+                .or_default()
+                .clone(),
+            key: key.clone(),
+        };
+        let _loading = slot.lock.lock().await;
+        // Another caller may have loaded it while we waited.
+        if let Some(value) = self.get(&key) {
+            return Ok(value);
+        }
+        let epoch = self.epoch.load(Ordering::Acquire);
+        let value = load().await?;
+        let mut entries = self.entries.lock().unwrap_or_else(|e| e.into_inner());
+        if self.epoch.load(Ordering::Acquire) == epoch {
+            entries.put(key, (value.clone(), Instant::now()));
+        }
+        Ok(value)
+    }
+
+    fn clear(&self) {
+        self.epoch.fetch_add(1, Ordering::AcqRel);
+        self.entries
+            .lock()
+            .unwrap_or_else(|e| e.into_inner())
+            .clear();
+    }
+}
+
 #[derive(Clone)]
 pub struct HotModelClass {
     pool: Arc<Pool<Postgres>>,
-    #[allow(dead_code)] // TODO: Implement caching functionality
-    cache: Arc<RwLock<LruCache<u32, String>>>,
+    cache: Arc<ModelCache<(u32, i16), ModelInfo>>,
 }
 
-#[allow(dead_code)]
-const GB50_IN_MB: u32 = 50 * 1024;
-
 impl HotModelClass {
     pub fn new(pool: Arc<Pool<Postgres>>) -> Self {
         Self {
             pool,
-            cache: Arc::new(RwLock::new(LruCache::new(NonZeroUsize::new(1000).unwrap()))),
+            cache: Arc::new(ModelCache::new(1000)),
         }
     }
-    #[allow(dead_code)]
-    fn align_gpu_memory(mem_mb: u32) -> u32 {
-        (mem_mb / GB50_IN_MB) * GB50_IN_MB
-    }
+
     pub async fn get_hot_model(&self, mem_total_gb: u32, engine_type: i16) -> Result<String> {
         let model_info = self.get_hot_model_with_details(mem_total_gb, engine_type).await?;
         Ok(model_info.name)
     }
 
-    pub async fn get_hot_model_with_details(&self, mem_total_gb: u32, engine_type: i16) -> Result<ModelInfo> {
+    /// Cached per (memory tier, engine type). The tier is the device's whole
+    /// GB figure: the query compares it against each model's
+    /// `min_gpu_memory_gb`, so any coarser alignment could change the answer.
+    pub async fn get_hot_model_with_details(
+        &self,
+        mem_total_gb: u32,
+        engine_type: i16,
+    ) -> Result<ModelInfo> {
+        self.cache
+            .get_or_load((mem_total_gb, engine_type), || {
+                self.load_hot_model(mem_total_gb, engine_type)
+            })
+            .await
+    }
+
+    async fn load_hot_model(&self, mem_total_gb: u32, engine_type: i16) -> Result<ModelInfo> {
         let model = match get_models_list(
             &self.pool,
             Some(true),
@@ -63,6 +174,10 @@ impl HotModelClass {
             expected_size: model[0].expected_size,
         })
     }
+
+    pub fn invalidate(&self) {
+        self.cache.clear();
+    }
 }
 
 /// Model information including download details
@@ -79,8 +194,7 @@ pub struct ModelInfo {
 pub struct ClientModelClass {
     #[allow(dead_code)] // Database connection pool for model queries
     pool: Arc<Pool<Postgres>>,
-    #[allow(dead_code)] // Cache for client model mappings
-    cache: Arc<RwLock<LruCache<ClientId, String>>>,
+    cache: Arc<ModelCache<ClientId, String>>,
 }
 
 impl ClientModelClass {
@@ -88,34 +202,42 @@ impl ClientModelClass {
     pub fn new(pool: Arc<Pool<Postgres>>) -> Self {
         Self {
             pool,
-            cache: Arc::new(RwLock::new(LruCache::new(NonZeroUsize::new(1000).unwrap()))),
+            cache: Arc::new(ModelCache::new(1000)),
         }
     }
 
     #[allow(dead_code)] // Client model retrieval with caching
     pub async fn get_client_model(&self, client_id: &ClientId) -> Result<String> {
-        {
-            let cache = self.cache.read().await;
-            if let Some(model) = cache.peek(client_id) {
-                return Ok(model.clone());
-            }
-        }
-
-        let model = match get_client_model_impl(&self.pool, client_id).await {
-            Ok(model) => model,
-            Err(e) => {
-                warn!("Failed to get client model: {}", e);
-                return Err(anyhow::anyhow!("Failed to get client model"));
-            }
-        };
-
-        let mut cache = self.cache.write().await;
-        cache.put(client_id.clone(), model.clone());
+        self.cache
+            .get_or_load(*client_id, || async {
+                get_client_model_impl(&self.pool, client_id)
+                    .await
+                    .map_err(|e| {
+                        warn!("Failed to get client model: {}", e);
+                        anyhow::anyhow!("Failed to get client model")
+                    })
+            })
+            .await
+    }
 
-        Ok(model)
+    pub fn invalidate(&self) {
+        self.cache.clear();
     }
 }
 
+/// Drop both model caches whenever `client_models` changes anywhere.
+pub async fn listen_for_model_invalidations(
+    redis_client: Arc<RedisClient>,
+    hot_models: Arc<HotModelClass>,
+    client_models: Arc<ClientModelClass>,
+) {
+    listen_invalidations(redis_client, MODEL_INVALIDATION_CHANNEL, |_| {
+        hot_models.invalidate();
+        client_models.invalidate();
+    })
+    .await
+}
+
 #[derive(sqlx::FromRow)]
 #[allow(dead_code)] // Database row mapping for client model queries
 struct ClientModel {
@@ -1,6 +1,6 @@
 use crate::db::{
-    CLIENT_DAILY_STATS_TABLE, DEVICE_DAILY_STATS_TABLE, DEVICE_INFO_TABLE, GPU_ASSETS_TABLE,
-    HEARTBEAT_TABLE, SYSTEM_INFO_TABLE,
+    CLIENT_DAILY_STATS_TABLE, CLIENT_HOURLY_STATS_TABLE, DEVICE_DAILY_STATS_TABLE,
+    DEVICE_INFO_TABLE, GPU_ASSETS_TABLE, HEARTBEAT_TABLE, SYSTEM_INFO_TABLE,
 };
 use crate::util::protoc::ClientId;
 use anyhow::Result;
@@ -8,6 +8,7 @@ use chrono::{DateTime, NaiveDate, NaiveDateTime, Utc};
 use common::{get_u16_from_u128, get_u8_from_u64, DevicesInfo, SystemInfo};
 use serde::{Deserialize, Serialize};
 use sqlx::{FromRow, PgPool, Pool, Postgres, QueryBuilder, Transaction};
+use std::collections::HashMap;
 use tracing::{debug, info};
 use validator::Validate;
 
@@ -46,91 +47,170 @@ pub struct DeviceDailyStats {
     pub updated_at: DateTime<Utc>,
 }
 
+/// Per-client daily aggregate for one heartbeat batch. `total_heartbeats`
+/// counts only heartbeats in buckets not yet recorded for that day.
+#[derive(Debug, Clone, PartialEq)]
+pub struct ClientDailyRow {
+    pub date: NaiveDate,
+    pub client_id: ClientId,
+    pub total_heartbeats: i32,
+    pub avg_cpu_usage: f64,
+    pub avg_memory_usage: f64,
+    pub avg_disk_usage: f64,
+    pub network_in_bytes: i64,
+    pub network_out_bytes: i64,
+    pub last_heartbeat: DateTime<Utc>,
+    pub last_heartbeat_bucket: i64,
+}
+
+/// Per-device daily aggregate for one heartbeat batch.
+#[derive(Debug, Clone, PartialEq)]
+pub struct DeviceDailyRow {
+    pub date: NaiveDate,
+    pub client_id: ClientId,
+    pub device_index: i16,
+    pub device_name: String,
+    pub total_heartbeats: i32,
+    pub avg_utilization: f64,
+    pub avg_temperature: f64,
+    pub avg_power_usage: f64,
+    pub avg_memory_usage: f64,
+    pub last_heartbeat: DateTime<Utc>,
+    pub last_heartbeat_bucket: i64,
+}
+
+/// Per-client hourly aggregate for one heartbeat batch, counting the same
+/// heartbeats as the daily row. Sums rather than averages, so batches fold
+/// into the stored row by addition.
+#[derive(Debug, Clone, PartialEq)]
+pub struct ClientHourlyRow {
+    pub hour: DateTime<Utc>,
+    pub client_id: ClientId,
+    pub total_heartbeats: i32,
+    pub sum_cpu_usage: f64,
+    pub sum_memory_usage: f64,
+    pub sum_disk_usage: f64,
+    pub network_in_bytes: i64,
+    pub network_out_bytes: i64,
+    pub last_heartbeat: DateTime<Utc>,
+}
+
+/// Default and largest page sizes of the monitor queries.
+pub const DEFAULT_PAGE_LIMIT: i64 = 200;
+pub const MAX_PAGE_LIMIT: i64 = 1000;
+
+pub fn page_limit(limit: Option<i64>) -> i64 {
+    limit.unwrap_or(DEFAULT_PAGE_LIMIT).clamp(1, MAX_PAGE_LIMIT)
+}
+
+/// Heartbeat bucket width per day; days without a config row use 120s.
+pub async fn heartbeat_intervals(
+    tx: &mut Transaction<'_, Postgres>,
+    days: &[NaiveDate],
+) -> Result<HashMap<NaiveDate, i64>, sqlx::Error> {
+    let rows: Vec<(NaiveDate, i64)> = sqlx::query_as(
+        "SELECT date, COALESCE(heartbeat_interval_secs, 120)::BIGINT FROM heartbeat_config_daily WHERE date = ANY($1)",
+    )
+    .bind(days)
+    .fetch_all(&mut **tx)
+    .await?;
+    Ok(rows.into_iter().collect())
+}
+
 impl ClientDailyStats {
-    pub async fn upsert(
+    /// Last recorded heartbeat bucket for each (client, day) that has a row.
+    pub async fn last_buckets(
+        tx: &mut Transaction<'_, Postgres>,
+        keys: &[(ClientId, NaiveDate)],
+    ) -> Result<HashMap<(ClientId, NaiveDate), i64>, sqlx::Error> {
+        let (client_ids, days): (Vec<ClientId>, Vec<NaiveDate>) = keys.iter().copied().unzip();
+        let rows: Vec<(Vec<u8>, NaiveDate, i64)> = sqlx::query_as(
+            format!(
+                "SELECT s.client_id, s.date, s.last_heartbeat_bucket FROM {} s
+                JOIN UNNEST($1::bytea[], $2::date[]) AS k(client_id, date)
+                    ON s.client_id = k.client_id AND s.date = k.date",
+                CLIENT_DAILY_STATS_TABLE
+            )
+            .as_str(),
+        )
+        .bind(&client_ids)
+        .bind(&days)
+        .fetch_all(&mut **tx)
+        .await?;
+        Ok(rows
+            .into_iter()
+            .filter_map(|(id, day, bucket)| {
+                let id: [u8; 16] = id.try_into().ok()?;
+                Some(((ClientId(id), day), bucket))
+            })
+            .collect())
+    }
+
+    /// Fold one batch of per-client aggregates into the daily stats with a
+    /// single multi-row upsert. Rows must be unique per (client, day).
+    pub async fn upsert_batch(
         tx: &mut Transaction<'_, Postgres>,
-        client_id: &ClientId,
-        cpu_usage: Option<f64>,
-        memory_usage: Option<f64>,
-        disk_usage: Option<f64>,
-        network_in: Option<i64>,
-        network_out: Option<i64>,
-        timestamp: DateTime<Utc>,
-    ) -> Result<Self, sqlx::Error> {
-        let day = timestamp.date_naive();
-
-        let record = sqlx::query_as(
-            r#"
-            INSERT INTO client_daily_stats (
-                date, client_id, 
+        rows: &[ClientDailyRow],
+    ) -> Result<u64, sqlx::Error> {
+        if rows.is_empty() {
+            return Ok(0);
+        }
+        let t = CLIENT_DAILY_STATS_TABLE;
+        let result = sqlx::query(
+            format!(
+                r#"
+            INSERT INTO {t} (
+                date, client_id,
                 avg_cpu_usage, avg_memory_usage, avg_disk_usage,
                 total_network_in_bytes, total_network_out_bytes,
                 total_heartbeats, last_heartbeat, last_heartbeat_bucket
             )
-            VALUES (
-                $1,
-                $2,
-                $3,
-                $4,
-                $5,
-                $6,
-                $7,
-                1,
-                $8,
-                (EXTRACT(EPOCH FROM $8)::BIGINT / COALESCE((SELECT heartbeat_interval_secs FROM heartbeat_config_daily WHERE date = $1), 120)::BIGINT)
+            SELECT * FROM UNNEST(
+                $1::date[], $2::bytea[],
+                $3::float8[], $4::float8[], $5::float8[],
+                $6::int8[], $7::int8[],
+                $8::int4[], $9::timestamptz[], $10::int8[]
             )
-            ON CONFLICT (client_id, date) 
+            ON CONFLICT (client_id, date)
             DO UPDATE SET
                 avg_cpu_usage = CASE
-                    WHEN EXCLUDED.last_heartbeat_bucket > client_daily_stats.last_heartbeat_bucket THEN
-                        (COALESCE(client_daily_stats.avg_cpu_usage, 0) * client_daily_stats.total_heartbeats + EXCLUDED.avg_cpu_usage) /
-                        (client_daily_stats.total_heartbeats + 1)
-                    ELSE client_daily_stats.avg_cpu_usage
+                    WHEN EXCLUDED.total_heartbeats = 0 THEN {t}.avg_cpu_usage
+                    ELSE (COALESCE({t}.avg_cpu_usage, 0) * {t}.total_heartbeats + EXCLUDED.avg_cpu_usage * EXCLUDED.total_heartbeats) /
+                        ({t}.total_heartbeats + EXCLUDED.total_heartbeats)
                 END,
                 avg_memory_usage = CASE
-                    WHEN EXCLUDED.last_heartbeat_bucket > client_daily_stats.last_heartbeat_bucket THEN
-                        (COALESCE(client_daily_stats.avg_memory_usage, 0) * client_daily_stats.total_heartbeats + EXCLUDED.avg_memory_usage) /
-                        (client_daily_stats.total_heartbeats + 1)
-                    ELSE client_daily_stats.avg_memory_usage
+                    WHEN EXCLUDED.total_heartbeats = 0 THEN {t}.avg_memory_usage
+                    ELSE (COALESCE({t}.avg_memory_usage, 0) * {t}.total_heartbeats + EXCLUDED.avg_memory_usage * EXCLUDED.total_heartbeats) /
+                        ({t}.total_heartbeats + EXCLUDED.total_heartbeats)
                 END,
                 avg_disk_usage = CASE
-                    WHEN EXCLUDED.last_heartbeat_bucket > client_daily_stats.last_heartbeat_bucket THEN
-                        (COALESCE(client_daily_stats.avg_disk_usage, 0) * client_daily_stats.total_heartbeats + EXCLUDED.avg_disk_usage) /
-                        (client_daily_stats.total_heartbeats + 1)
-                    ELSE client_daily_stats.avg_disk_usage
-                END,
-                total_network_in_bytes = CASE
-                    WHEN EXCLUDED.last_heartbeat_bucket > client_daily_stats.last_heartbeat_bucket THEN
-                        COALESCE(EXCLUDED.total_network_in_bytes, 0) + COALESCE(client_daily_stats.total_network_in_bytes, 0)
-                    ELSE client_daily_stats.total_network_in_bytes
+                    WHEN EXCLUDED.total_heartbeats = 0 THEN {t}.avg_disk_usage
+                    ELSE (COALESCE({t}.avg_disk_usage, 0) * {t}.total_heartbeats + EXCLUDED.avg_disk_usage * EXCLUDED.total_heartbeats) /
+                        ({t}.total_heartbeats + EXCLUDED.total_heartbeats)
                 END,
-                total_network_out_bytes = CASE
-                    WHEN EXCLUDED.last_heartbeat_bucket > client_daily_stats.last_heartbeat_bucket THEN
-                        COALESCE(EXCLUDED.total_network_out_bytes, 0) + COALESCE(client_daily_stats.total_network_out_bytes, 0)
-                    ELSE client_daily_stats.total_network_out_bytes
-                END,
-                total_heartbeats = client_daily_stats.total_heartbeats + CASE
-                    WHEN EXCLUDED.last_heartbeat_bucket > client_daily_stats.last_heartbeat_bucket THEN 1
-                    ELSE 0
-                END,
-                last_heartbeat = GREATEST(client_daily_stats.last_heartbeat, EXCLUDED.last_heartbeat),
-                last_heartbeat_bucket = GREATEST(client_daily_stats.last_heartbeat_bucket, EXCLUDED.last_heartbeat_bucket),
+                total_network_in_bytes = COALESCE(EXCLUDED.total_network_in_bytes, 0) + COALESCE({t}.total_network_in_bytes, 0),
+                total_network_out_bytes = COALESCE(EXCLUDED.total_network_out_bytes, 0) + COALESCE({t}.total_network_out_bytes, 0),
+                total_heartbeats = {t}.total_heartbeats + EXCLUDED.total_heartbeats,
+                last_heartbeat = GREATEST({t}.last_heartbeat, EXCLUDED.last_heartbeat),
+                last_heartbeat_bucket = GREATEST({t}.last_heartbeat_bucket, EXCLUDED.last_heartbeat_bucket),
                 updated_at = NOW()
-            RETURNING *
-            "#,
+            "#
+            )
+            .as_str(),
         )
-        .bind(day)
-        .bind(client_id)
-        .bind(cpu_usage)
-        .bind(memory_usage)
-        .bind(disk_usage)
-        .bind(network_in)
-        .bind(network_out)
-        .bind(timestamp)
-        .fetch_one(&mut **tx)
+        .bind(rows.iter().map(|r| r.date).collect::<Vec<_>>())
+        .bind(rows.iter().map(|r| r.client_id).collect::<Vec<_>>())
+        .bind(rows.iter().map(|r| r.avg_cpu_usage).collect::<Vec<_>>())
+        .bind(rows.iter().map(|r| r.avg_memory_usage).collect::<Vec<_>>())
+        .bind(rows.iter().map(|r| r.avg_disk_usage).collect::<Vec<_>>())
+        .bind(rows.iter().map(|r| r.network_in_bytes).collect::<Vec<_>>())
+        .bind(rows.iter().map(|r| r.network_out_bytes).collect::<Vec<_>>())
+        .bind(rows.iter().map(|r| r.total_heartbeats).collect::<Vec<_>>())
+        .bind(rows.iter().map(|r| r.last_heartbeat).collect::<Vec<_>>())
+        .bind(rows.iter().map(|r| r.last_heartbeat_bucket).collect::<Vec<_>>())
+        .execute(&mut **tx)
         .await?;
-
-        Ok(record)
+        Ok(result.rows_affected())
     }
 
     #[allow(dead_code)] // Get client statistics for date range
@@ -172,128 +252,79 @@ impl ClientDailyStats {
 }
 
 impl DeviceDailyStats {
+    /// Fold one batch of per-device aggregates into the daily stats with a
+    /// single multi-row upsert. Rows must be unique per (client, day, device).
     pub async fn upsert_batch(
         tx: &mut Transaction<'_, Postgres>,
-        client_id: &ClientId,
-        devices: &Vec<common::DevicesInfo>,
-        timestamp: DateTime<Utc>,
-    ) -> Result<i32, sqlx::Error> {
-        if devices.is_empty() {
+        rows: &[DeviceDailyRow],
+    ) -> Result<u64, sqlx::Error> {
+        if rows.is_empty() {
             return Ok(0);
         }
-
-        let day = timestamp.date_naive();
-        let interval_secs: i64 = sqlx::query_scalar(
-            "SELECT COALESCE(heartbeat_interval_secs, 120)::BIGINT FROM heartbeat_config_daily WHERE date = $1",
-        )
-        .bind(day)
-        .fetch_optional(&mut **tx)
-        .await?
-        .unwrap_or(120);
-
-        let interval_secs = interval_secs.max(1);
-        let bucket: i64 = (timestamp.timestamp() / interval_secs).max(0);
-        let mut query_builder = QueryBuilder::new(
+        let t = DEVICE_DAILY_STATS_TABLE;
+        let avg = |col: &str| {
             format!(
-                "
-            INSERT INTO {} (
+                "{col} = CASE
+                    WHEN EXCLUDED.total_heartbeats = 0 THEN {t}.{col}
+                    ELSE (COALESCE({t}.{col}, 0) * {t}.total_heartbeats + EXCLUDED.{col} * EXCLUDED.total_heartbeats) /
+                        ({t}.total_heartbeats + EXCLUDED.total_heartbeats)
+                END"
+            )
+        };
+        let sql = format!(
+            "
+            INSERT INTO {t} (
                 date, client_id, device_index, device_name,
                 avg_utilization, avg_temperature, avg_power_usage, avg_memory_usage,
                 total_heartbeats, last_heartbeat, last_heartbeat_bucket
             )
-            ",
-                DEVICE_DAILY_STATS_TABLE
+            SELECT * FROM UNNEST(
+                $1::date[], $2::bytea[], $3::int2[], $4::text[],
+                $5::float8[], $6::float8[], $7::float8[], $8::float8[],
+                $9::int4[], $10::timestamptz[], $11::int8[]
             )
-            .as_str(),
-        );
-        // Flatten devices into individual rows first
-        let mut flattened_devices: Vec<(i16, &common::DevicesInfo)> = Vec::new();
-        for device in devices {
-            for index in 0..device.num {
-                flattened_devices.push((index as i16, device));
-            }
-        }
-        
-        //batch insert with flattened devices
-        query_builder.push_values(&flattened_devices, |mut b, (index, device)| {
-            b.push_bind(day)
-                .push_bind(client_id)
-                .push_bind(*index)
-                .push_bind(format!(
-                    "{} {}",
-                    common::id_to_vendor(get_u16_from_u128(device.vendor_id, *index as usize))
-                        .unwrap_or("Unknown"),
-                    common::id_to_model(get_u16_from_u128(device.device_id, *index as usize))
-                        .unwrap_or("Unknown".to_string())
-                ))
-                .push_bind(Some(device.usage as f64))
-                .push_bind(Some(device.temp as f64))
-                .push_bind(Some(device.power_usage as f64))
-                .push_bind(Some(device.mem_usage as f64))
-                .push_bind(1)
-                .push_bind(timestamp)
-                .push_bind(bucket);
-        });
-
-        let t = DEVICE_DAILY_STATS_TABLE;
-        query_builder.push(format!(
-            "
             ON CONFLICT (date, client_id, device_index)
             DO UPDATE SET
                 device_name = EXCLUDED.device_name,
-                avg_utilization = CASE
-                    WHEN EXCLUDED.last_heartbeat_bucket > {t}.last_heartbeat_bucket THEN
-                        CASE 
-                            WHEN {t}.total_heartbeats = 0 THEN EXCLUDED.avg_utilization
-                            ELSE (COALESCE({t}.avg_utilization, 0) * {t}.total_heartbeats + EXCLUDED.avg_utilization) /
-                                 ({t}.total_heartbeats + 1)
-                        END
-                    ELSE {t}.avg_utilization
-                END,
-                avg_temperature = CASE
-                    WHEN EXCLUDED.last_heartbeat_bucket > {t}.last_heartbeat_bucket THEN
-                        CASE 
-                            WHEN {t}.total_heartbeats = 0 THEN EXCLUDED.avg_temperature
-                            ELSE (COALESCE({t}.avg_temperature, 0) * {t}.total_heartbeats + EXCLUDED.avg_temperature) /
-                                 ({t}.total_heartbeats + 1)
-                        END
-                    ELSE {t}.avg_temperature
-                END,
-                avg_power_usage = CASE
-                    WHEN EXCLUDED.last_heartbeat_bucket > {t}.last_heartbeat_bucket THEN
-                        CASE 
-                            WHEN {t}.total_heartbeats = 0 THEN EXCLUDED.avg_power_usage
-                            ELSE (COALESCE({t}.avg_power_usage, 0) * {t}.total_heartbeats + EXCLUDED.avg_power_usage) /
-                                 ({t}.total_heartbeats + 1)
-                        END
-                    ELSE {t}.avg_power_usage
-                END,
-                avg_memory_usage = CASE
-                    WHEN EXCLUDED.last_heartbeat_bucket > {t}.last_heartbeat_bucket THEN
-                        CASE 
-                            WHEN {t}.total_heartbeats = 0 THEN EXCLUDED.avg_memory_usage
-                            ELSE (COALESCE({t}.avg_memory_usage, 0) * {t}.total_heartbeats + EXCLUDED.avg_memory_usage) /
-                                 ({t}.total_heartbeats + 1)
-                        END
-                    ELSE {t}.avg_memory_usage
-                END,
-                total_heartbeats = {t}.total_heartbeats + CASE
-                    WHEN EXCLUDED.last_heartbeat_bucket > {t}.last_heartbeat_bucket THEN 1
-                    ELSE 0
-                END,
+                {},
+                {},
+                {},
+                {},
+                total_heartbeats = {t}.total_heartbeats + EXCLUDED.total_heartbeats,
                 last_heartbeat = GREATEST({t}.last_heartbeat, EXCLUDED.last_heartbeat),
                 last_heartbeat_bucket = GREATEST({t}.last_heartbeat_bucket, EXCLUDED.last_heartbeat_bucket),
                 updated_at = NOW()
-            RETURNING *
-            "
-        ));
-        
-        let sql = query_builder.sql();
-        tracing::info!("DeviceDailyStats upsert SQL: {}", sql);
+            ",
+            avg("avg_utilization"),
+            avg("avg_temperature"),
+            avg("avg_power_usage"),
+            avg("avg_memory_usage"),
+        );
 
-        let records = query_builder.build().execute(&mut **tx).await?;
+        let result = sqlx::query(&sql)
+            .bind(rows.iter().map(|r| r.date).collect::<Vec<_>>())
+            .bind(rows.iter().map(|r| r.client_id).collect::<Vec<_>>())
+            .bind(rows.iter().map(|r| r.device_index).collect::<Vec<_>>())
+            .bind(
+                rows.iter()
+                    .map(|r| r.device_name.clone())
+                    .collect::<Vec<_>>(),
+            )
+            .bind(rows.iter().map(|r| r.avg_utilization).collect::<Vec<_>>())
+            .bind(rows.iter().map(|r| r.avg_temperature).collect::<Vec<_>>())
+            .bind(rows.iter().map(|r| r.avg_power_usage).collect::<Vec<_>>())
+            .bind(rows.iter().map(|r| r.avg_memory_usage).collect::<Vec<_>>())
+            .bind(rows.iter().map(|r| r.total_heartbeats).collect::<Vec<_>>())
+            .bind(rows.iter().map(|r| r.last_heartbeat).collect::<Vec<_>>())
+            .bind(
+                rows.iter()
+                    .map(|r| r.last_heartbeat_bucket)
+                    .collect::<Vec<_>>(),
+            )
+            .execute(&mut **tx)
+            .await?;
 
-        Ok(records.rows_affected() as i32)
+        Ok(result.rows_affected())
     }
 
     #[allow(dead_code)] // Get device statistics for date range
@@ -329,44 +360,136 @@ impl DeviceDailyStats {
     }
 }
 
-pub async fn insert_heartbeat(
+/// Fold one batch of hourly aggregates into the hourly stats with a single
+/// multi-row upsert. Rows must be unique per (client, hour).
+pub async fn upsert_client_hourly(
+    tx: &mut Transaction<'_, Postgres>,
+    rows: &[ClientHourlyRow],
+) -> Result<u64, sqlx::Error> {
+    if rows.is_empty() {
+        return Ok(0);
+    }
+    let t = CLIENT_HOURLY_STATS_TABLE;
+    let result = sqlx::query(
+        format!(
+            "
+        INSERT INTO {t} (
+            hour, client_id, total_heartbeats,
+            sum_cpu_usage, sum_memory_usage, sum_disk_usage,
+            total_network_in_bytes, total_network_out_bytes, last_heartbeat
+        )
+        SELECT * FROM UNNEST(
+            $1::timestamptz[], $2::bytea[], $3::int4[],
+            $4::float8[], $5::float8[], $6::float8[],
+            $7::int8[], $8::int8[], $9::timestamptz[]
+        )
+        ON CONFLICT (client_id, hour)
+        DO UPDATE SET
+            total_heartbeats = {t}.total_heartbeats + EXCLUDED.total_heartbeats,
+            sum_cpu_usage = {t}.sum_cpu_usage + EXCLUDED.sum_cpu_usage,
+            sum_memory_usage = {t}.sum_memory_usage + EXCLUDED.sum_memory_usage,
+            sum_disk_usage = {t}.sum_disk_usage + EXCLUDED.sum_disk_usage,
+            total_network_in_bytes = {t}.total_network_in_bytes + EXCLUDED.total_network_in_bytes,
+            total_network_out_bytes = {t}.total_network_out_bytes + EXCLUDED.total_network_out_bytes,
+            last_heartbeat = GREATEST({t}.last_heartbeat, EXCLUDED.last_heartbeat),
+            updated_at = NOW()
+        "
+        )
+        .as_str(),
+    )
+    .bind(rows.iter().map(|r| r.hour).collect::<Vec<_>>())
+    .bind(rows.iter().map(|r| r.client_id).collect::<Vec<_>>())
+    .bind(rows.iter().map(|r| r.total_heartbeats).collect::<Vec<_>>())
+    .bind(rows.iter().map(|r| r.sum_cpu_usage).collect::<Vec<_>>())
+    .bind(rows.iter().map(|r| r.sum_memory_usage).collect::<Vec<_>>())
+    .bind(rows.iter().map(|r| r.sum_disk_usage).collect::<Vec<_>>())
+    .bind(rows.iter().map(|r| r.network_in_bytes).collect::<Vec<_>>())
+    .bind(rows.iter().map(|r| r.network_out_bytes).collect::<Vec<_>>())
+    .bind(rows.iter().map(|r| r.last_heartbeat).collect::<Vec<_>>())
+    .execute(&mut **tx)
+    .await?;
+    Ok(result.rows_affected())
+}
+
+/// One decoded heartbeat, ready for batch persistence.
+#[derive(Debug, Clone)]
+pub struct HeartbeatRecord {
+    pub client_id: ClientId,
+    pub system_info: SystemInfo,
+    pub devices_info: Vec<DevicesInfo>,
+    pub device_memtotal_gb: i32,
+    pub device_count: i32,
+    pub total_tflops: i32,
+    pub timestamp: DateTime<Utc>,
+}
+
+/// Display name of device `index` within a packed `DevicesInfo` entry.
+pub fn device_name(device: &DevicesInfo, index: usize) -> String {
+    format!(
+        "{} {}",
+        common::id_to_vendor(get_u16_from_u128(device.vendor_id, index)).unwrap_or("Unknown"),
+        common::id_to_model(get_u16_from_u128(device.device_id, index))
+            .unwrap_or("Unknown".to_string())
+    )
+}
+
+/// Persist a batch of heartbeats: every record goes into the heartbeat
+/// history, and each client's latest record refreshes its asset status,
+/// system info and device info. Each table is written with one statement.
+pub async fn insert_heartbeats(
     tx: &mut Transaction<'_, Postgres>,
-    client_id: &ClientId,
-    system_info: &SystemInfo,
-    devices_info: &Vec<DevicesInfo>,
-    device_memtotal_gb: i32,
-    device_count: i32,
-    total_tflops: i32,
-    timestamp: Option<DateTime<Utc>>,
+    records: &[HeartbeatRecord],
 ) -> anyhow::Result<()> {
-    let timestamp = timestamp.unwrap_or_else(Utc::now);
-    // Insert heartbeat record using the transaction with better conflict resolution
-    let _device_hash = format!("{:x}", md5::compute(format!("{:?}{:?}", client_id, devices_info)));
-    let _ = sqlx::query(
-        format!("
+    if records.is_empty() {
+        return Ok(());
+    }
+
+    sqlx::query(
+        format!(
+            "
         INSERT INTO {} (client_id, cpu_usage, mem_usage, disk_usage, network_up, network_down, timestamp)
-        VALUES ($1, $2, $3, $4, $5, $6, $7)
+        SELECT * FROM UNNEST($1::bytea[], $2::int2[], $3::int2[], $4::int2[], $5::int8[], $6::int8[], $7::timestamptz[])
         ON CONFLICT (client_id, timestamp) DO NOTHING
-        ", HEARTBEAT_TABLE).as_str(),
+        ",
+            HEARTBEAT_TABLE
+        )
+        .as_str(),
     )
-    .bind(client_id)
-    .bind(system_info.cpu_usage as i16)
-    .bind(system_info.memory_usage as i16)
-    .bind(system_info.disk_usage as i16)
-    .bind(system_info.network_tx as i64)
-    .bind(system_info.network_rx as i64)
-    .bind(timestamp)
+    .bind(records.iter().map(|r| r.client_id).collect::<Vec<_>>())
+    .bind(records.iter().map(|r| r.system_info.cpu_usage as i16).collect::<Vec<_>>())
+    .bind(records.iter().map(|r| r.system_info.memory_usage as i16).collect::<Vec<_>>())
+    .bind(records.iter().map(|r| r.system_info.disk_usage as i16).collect::<Vec<_>>())
+    .bind(records.iter().map(|r| r.system_info.network_tx as i64).collect::<Vec<_>>())
+    .bind(records.iter().map(|r| r.system_info.network_rx as i64).collect::<Vec<_>>())
+    .bind(records.iter().map(|r| r.timestamp).collect::<Vec<_>>())
     .execute(&mut **tx)
     .await?;
 
-    // Update GPU assets status
-    sqlx::query(&format!("UPDATE  {} SET client_status = $1, updated_at = NOW() WHERE client_id = $2 AND valid_status = 'valid' ",GPU_ASSETS_TABLE))
+    // Latest record per client; ON CONFLICT DO UPDATE rejects duplicate keys
+    // within one statement.
+    let mut latest: HashMap<ClientId, &HeartbeatRecord> = HashMap::new();
+    for record in records {
+        latest
+            .entry(record.client_id)
+            .and_modify(|cur| {
+                if record.timestamp >= cur.timestamp {
+                    *cur = record;
+                }
+            })
+            .or_insert(record);
+    }
+    let latest: Vec<&HeartbeatRecord> = latest.into_values().collect();
+    let client_ids: Vec<ClientId> = latest.iter().map(|r| r.client_id).collect();
+
+    sqlx::query(&format!(
+        "UPDATE {} SET client_status = $1, updated_at = NOW() WHERE client_id = ANY($2) AND valid_status = 'valid'",
+        GPU_ASSETS_TABLE
+    ))
     .bind("online")
-    .bind(client_id)
-    .execute(&mut **tx)  // Properly deref the transaction
+    .bind(&client_ids)
+    .execute(&mut **tx)
     .await?;
-    // let device_count = devices_info.len() as i32;
-    // 1. Insert system info
+
     sqlx::query(&format!(
         "
         INSERT INTO {} (
@@ -379,8 +502,11 @@ pub async fn insert_heartbeat(
             device_count,
             created_at,
             updated_at
-        ) VALUES ($1, $2, $3, $4, $5, $6, $7, NOW(), NOW())
-        ON CONFLICT (client_id) 
+        )
+        SELECT k.*, NOW(), NOW() FROM UNNEST(
+            $1::bytea[], $2::int2[], $3::int2[], $4::int2[], $5::int4[], $6::int4[], $7::int4[]
+        ) AS k
+        ON CONFLICT (client_id)
         DO UPDATE SET
             cpu_usage = EXCLUDED.cpu_usage,
             mem_usage = EXCLUDED.mem_usage,
@@ -392,104 +518,112 @@ pub async fn insert_heartbeat(
         ",
         SYSTEM_INFO_TABLE
     ))
-    .bind(client_id)
-    .bind(system_info.cpu_usage as i16)
-    .bind(system_info.memory_usage as i16)
-    .bind(system_info.disk_usage as i16)
-    .bind(total_tflops)
-    .bind(device_memtotal_gb)
-    .bind(device_count)
+    .bind(&client_ids)
+    .bind(
+        latest
+            .iter()
+            .map(|r| r.system_info.cpu_usage as i16)
+            .collect::<Vec<_>>(),
+    )
+    .bind(
+        latest
+            .iter()
+            .map(|r| r.system_info.memory_usage as i16)
+            .collect::<Vec<_>>(),
+    )
+    .bind(
+        latest
+            .iter()
+            .map(|r| r.system_info.disk_usage as i16)
+            .collect::<Vec<_>>(),
+    )
+    .bind(latest.iter().map(|r| r.total_tflops).collect::<Vec<_>>())
+    .bind(
+        latest
+            .iter()
+            .map(|r| r.device_memtotal_gb)
+            .collect::<Vec<_>>(),
+    )
+    .bind(latest.iter().map(|r| r.device_count).collect::<Vec<_>>())
     .execute(&mut **tx)
     .await?;
 
-    // 2. Delete old device info
-    sqlx::query(format!(r#"DELETE FROM {} WHERE client_id = $1"#, DEVICE_INFO_TABLE).as_str())
-        .bind(client_id)
-        .execute(&mut **tx) // Properly deref the transaction
-        .await?;
-
-    // 3. Batch insert device information
-    if !devices_info.is_empty() {
-        let mut values_placeholder = String::new();
-        let params_per_device = 9;
-        
-        // Count total devices first for proper parameter indexing
-        let total_devices: u32 = devices_info.iter().map(|d| d.num as u32).sum();
-        
-        // Build the values part of the query with correct global parameter indexing
-        for global_idx in 0..total_devices {
-            let base = global_idx * params_per_device;
-            if global_idx > 0 {
-                values_placeholder.push_str(", ");
-            }
-            values_placeholder.push_str(&format!(
-                "(${}, ${}, ${}, ${}, ${}, ${}, ${}, ${}, ${}, NOW(), NOW())",
-                base + 1,
-                base + 2,
-                base + 3,
-                base + 4,
-                base + 5,
-                base + 6,
-                base + 7,
-                base + 8,
-                base + 9,
-            ));
-        }
+    // Device info is replaced wholesale for every reporting client.
+    sqlx::query(
+        format!(
+            r#"DELETE FROM {} WHERE client_id = ANY($1)"#,
+            DEVICE_INFO_TABLE
+        )
+        .as_str(),
+    )
+    .bind(&client_ids)
+    .execute(&mut **tx)
+    .await?;
 
-        // Build the full query
-        let query_str = format!(
-            "INSERT INTO {} (
-                client_id,
-                device_name,
-                device_index,
-                device_id,
-                vendor_id,
-                device_memusage,
-                device_gpuusage,
-                device_powerusage,
-                device_temp,
-                created_at,
-                updated_at
-            ) VALUES {}",
-            DEVICE_INFO_TABLE, values_placeholder
-        );
-        
-        tracing::info!("Generated device_info INSERT SQL: {}", query_str);
-        tracing::info!("Total devices: {}, Total params expected: {}", total_devices, total_devices * params_per_device);
-
-        let mut query = sqlx::query(&query_str);
-        let mut param_count = 0;
-        // Bind all parameters in order
-        for device_info in devices_info {
-            for device_index in 0..device_info.num {
-                query = query
-                    .bind(&client_id)
-                    .bind(format!(
-                        "{} {}",
-                        common::id_to_vendor(get_u16_from_u128(
-                            device_info.vendor_id,
-                            device_index as usize
-                        ))
-                        .unwrap_or("Unknown"),
-                        common::id_to_model(get_u16_from_u128(
-                            device_info.device_id,
-                            device_index as usize
-                        ))
-                        .unwrap_or("Unknown".to_string())
-                    ))
-                    .bind(device_index as i16)
-                    .bind(get_u16_from_u128(device_info.device_id, device_index as usize) as i32)
-                    .bind(get_u16_from_u128(device_info.vendor_id, device_index as usize) as i32)
-                    .bind(get_u8_from_u64(device_info.mem_usage, device_index as usize) as i16)
-                    .bind(get_u8_from_u64(device_info.usage, device_index as usize) as i16)
-                    .bind(get_u8_from_u64(device_info.power_usage, device_index as usize) as i16)
-                    .bind(get_u8_from_u64(device_info.temp, device_index as usize) as i16);
-                param_count += 9;
+    let mut ids = Vec::new();
+    let mut names = Vec::new();
+    let mut indexes = Vec::new();
+    let mut device_ids = Vec::new();
+    let mut vendor_ids = Vec::new();
+    let mut mem_usage = Vec::new();
+    let mut gpu_usage = Vec::new();
+    let mut power_usage = Vec::new();
+    let mut temps = Vec::new();
+    for record in &latest {
+        for device_info in &record.devices_info {
+            for device_index in 0..(device_info.num as usize).min(8) {
+                ids.push(record.client_id);
+                names.push(device_name(device_info, device_index));
+                indexes.push(device_index as i16);
+                device_ids.push(get_u16_from_u128(device_info.device_id, device_index) as i32);
+                vendor_ids.push(get_u16_from_u128(device_info.vendor_id, device_index) as i32);
+                mem_usage.push(get_u8_from_u64(device_info.mem_usage, device_index) as i16);
+                gpu_usage.push(get_u8_from_u64(device_info.usage, device_index) as i16);
+                power_usage.push(get_u8_from_u64(device_info.power_usage, device_index) as i16);
+                temps.push(get_u8_from_u64(device_info.temp, device_index) as i16);
             }
         }
-        tracing::info!("Total params bound: {}", param_count);
-        query.execute(&mut **tx).await?;
     }
+    if ids.is_empty() {
+        return Ok(());
+    }
+
+    sqlx::query(&format!(
+        "INSERT INTO {} (
+            client_id,
+            device_name,
+            device_index,
+            device_id,
+            vendor_id,
+            device_memusage,
+            device_gpuusage,
+            device_powerusage,
+            device_temp,
+            created_at,
+            updated_at
+        )
+        SELECT k.*, NOW(), NOW() FROM UNNEST(
+            $1::bytea[], $2::text[], $3::int2[], $4::int4[], $5::int4[],
+            $6::int2[], $7::int2[], $8::int2[], $9::int2[]
+        ) AS k",
+        DEVICE_INFO_TABLE
+    ))
+    .bind(&ids)
+    .bind(&names)
+    .bind(&indexes)
+    .bind(&device_ids)
+    .bind(&vendor_ids)
+    .bind(&mem_usage)
+    .bind(&gpu_usage)
+    .bind(&power_usage)
+    .bind(&temps)
+    .execute(&mut **tx)
+    .await?;
+    debug!(
+        "Inserted {} device_info rows for {} clients",
+        ids.len(),
+        latest.len()
+    );
     Ok(())
 }
 
@@ -591,29 +725,23 @@ async fn test_device_daily_stats() {
         .unwrap();
     let client_id = [0; 16];
     let device_index = 1;
-    let device_info = common::DevicesInfo {
-        os_type: common::OsType::LINUX,
-        engine_type: common::EngineType::None,
-        port: 0,
-        ip: 0,
-        memtotal_gb: 1,
-        pod_id: 0,
-        num: 0,
-        vendor_id: 0,
-        device_id: 0,
-        usage: 1,
-        temp: 1,
-        power_usage: 1,
-        mem_usage: 1,
-        memsize_gb: 1,
-        powerlimit_w: 1,
-        total_tflops: 1,
+    let row = DeviceDailyRow {
+        date: Utc::now().date_naive(),
+        client_id: ClientId(client_id),
+        device_index,
+        device_name: "Unknown Unknown".to_string(),
+        total_heartbeats: 1,
+        avg_utilization: 1.0,
+        avg_temperature: 1.0,
+        avg_power_usage: 1.0,
+        avg_memory_usage: 1.0,
+        last_heartbeat: Utc::now(),
+        last_heartbeat_bucket: Utc::now().timestamp() / 120,
     };
     let start_date = Utc::now().date_naive();
     let end_date = Utc::now().date_naive();
     let mut tx = pool.begin().await.unwrap();
-    let _ =
-        DeviceDailyStats::upsert_batch(&mut tx, &ClientId(client_id), &vec![device_info], Utc::now())
+    let _ = DeviceDailyStats::upsert_batch(&mut tx, &[row])
         .await
         .unwrap();
     tx.commit().await.unwrap();
@@ -750,15 +878,19 @@ where
     serializer.serialize_str(&hex::encode(bytes))
 }
 
+/// One page of daily stats for a user's devices, newest day first with
+/// devices without stats last. `before` is the (date, client_id) of the last
+/// row of the previous page.
 pub async fn get_client_monitor(
     pool: &Pool<Postgres>,
     user_id: &str,
     client_id: Option<String>,
+    before: Option<(Option<NaiveDate>, String)>,
+    limit: i64,
 ) -> Result<Vec<ClientMonitorInfo>> {
-    let mut query_builder = sqlx::QueryBuilder::new(&format!(
+    let mut query_builder = sqlx::QueryBuilder::new(format!(
         "
-     WITH stats_with_avg AS (
-        SELECT 
+        SELECT
             ga.client_id,
             ga.client_name,
             ga.created_at,
@@ -771,66 +903,49 @@ pub async fn get_client_monitor(
             cds.total_network_out_bytes,
             cds.total_heartbeats,
             cds.last_heartbeat,
-            CASE 
-                WHEN cds.total_heartbeats > 0 
-                THEN cds.total_network_in_bytes::float8 / NULLIF(cds.total_heartbeats, 0) 
-                ELSE 0 
+            CASE
+                WHEN cds.total_heartbeats > 0
+                THEN cds.total_network_in_bytes::float8 / cds.total_heartbeats
+                ELSE 0
             END as avg_network_in_bytes,
-            CASE 
-                WHEN cds.total_heartbeats > 0 
-                THEN cds.total_network_out_bytes::float8 / NULLIF(cds.total_heartbeats, 0) 
-                ELSE 0 
+            CASE
+                WHEN cds.total_heartbeats > 0
+                THEN cds.total_network_out_bytes::float8 / cds.total_heartbeats
+                ELSE 0
             END as avg_network_out_bytes
         FROM {} ga
         LEFT JOIN {} cds ON ga.client_id = cds.client_id
-        WHERE ga.user_id = $1
-        AND ga.valid_status = 'valid'
-  
-   
-    ",
+        WHERE ga.user_id = ",
         GPU_ASSETS_TABLE, CLIENT_DAILY_STATS_TABLE
     ));
+    query_builder.push_bind(user_id);
+    query_builder.push(" AND ga.valid_status = 'valid'");
 
-    // Add client_id filter if provided
-    if let Some(_cid) = &client_id {
-        query_builder.push(" AND ga.client_id = $2");
-    }
-
-    // Order by most recent dates first
-    query_builder
-        .push(" ) SELECT * FROM stats_with_avg  ORDER BY date DESC NULLS LAST, updated_at DESC");
-
-    // Build the query
-    let mut query = query_builder.build_query_as::<ClientMonitorInfo>();
-
-    // Bind parameters
-    query = query.bind(user_id);
     if let Some(cid) = client_id {
-        query = query.bind(hex::decode(cid)?);
+        query_builder.push(" AND ga.client_id = ");
+        query_builder.push_bind(hex::decode(cid)?);
     }
 
-    // Execute the query
-    let mut results = query.fetch_all(pool).await?;
-
-    // Convert the average values to f64 for consistency
-    for result in &mut results {
-        // The database already calculated these, but we need to ensure they're f64
-        if let (Some(in_bytes), Some(heartbeats)) =
-            (result.total_network_in_bytes, result.total_heartbeats)
-        {
-            if heartbeats > 0 {
-                result.avg_network_in_bytes = Some(in_bytes as f64 / heartbeats as f64);
-            }
-        }
-        if let (Some(out_bytes), Some(heartbeats)) =
-            (result.total_network_out_bytes, result.total_heartbeats)
-        {
-            if heartbeats > 0 {
-                result.avg_network_out_bytes = Some(out_bytes as f64 / heartbeats as f64);
-            }
-        }
+    // Keyset pagination; '-infinity' stands in for devices without stats.
+    const DAY_KEY: &str = "COALESCE(cds.date, '-infinity'::date)";
+    if let Some((date, cid)) = before {
+        query_builder.push(format!(" AND ({}, ga.client_id) < (COALESCE(", DAY_KEY));
+        query_builder.push_bind(date);
+        query_builder.push(", '-infinity'::date), ");
+        query_builder.push_bind(hex::decode(cid)?);
+        query_builder.push(")");
     }
 
+    query_builder.push(format!(
+        " ORDER BY {} DESC, ga.client_id DESC LIMIT ",
+        DAY_KEY
+    ));
+    query_builder.push_bind(limit);
+
+    let results = query_builder
+        .build_query_as::<ClientMonitorInfo>()
+        .fetch_all(pool)
+        .await?;
     Ok(results)
 }
 
@@ -847,16 +962,52 @@ pub struct ClientHeartbeatInfo {
     pub network_down: i64,
 }
 
+/// Parse a `%Y-%m-%dT%H:%M:%S` query timestamp as UTC.
+fn parse_query_time(value: Option<&String>) -> Option<DateTime<Utc>> {
+    value.and_then(|d| {
+        NaiveDateTime::parse_from_str(d, "%Y-%m-%dT%H:%M:%S")
+            .ok()
+            .map(|ndt| ndt.and_utc())
+    })
+}
+
+/// One page of a user's heartbeats, newest first. With `hourly` the rows
+/// are the hourly rollups (averaged usage, summed traffic) instead of raw
+/// heartbeats. `before` is the (RFC 3339 timestamp, client_id) of the last
+/// row of the previous page.
+#[allow(clippy::too_many_arguments)]
 pub async fn get_client_heartbeats(
     pool: &Pool<Postgres>,
     user_id: &str,
     client_id: Option<String>,
     start_date: Option<String>,
     end_date: Option<String>,
+    hourly: bool,
+    before: Option<(String, String)>,
+    limit: i64,
 ) -> Result<Vec<ClientHeartbeatInfo>> {
-    let mut query = format!(
-        "
-        SELECT 
+    let (mut query_builder, time_col) = if hourly {
+        let query = sqlx::QueryBuilder::new(format!(
+            "
+        SELECT
+            h.client_id,
+            COALESCE(ga.client_name, '') as client_name,
+            h.hour as timestamp,
+            ROUND(h.sum_cpu_usage / NULLIF(h.total_heartbeats, 0))::int2 as cpu_usage,
+            ROUND(h.sum_memory_usage / NULLIF(h.total_heartbeats, 0))::int2 as mem_usage,
+            ROUND(h.sum_disk_usage / NULLIF(h.total_heartbeats, 0))::int2 as disk_usage,
+            h.total_network_out_bytes as network_up,
+            h.total_network_in_bytes as network_down
+        FROM {} h
+        INNER JOIN {} ga ON h.client_id = ga.client_id
+        WHERE ga.user_id = ",
+            CLIENT_HOURLY_STATS_TABLE, GPU_ASSETS_TABLE
+        ));
+        (query, "h.hour")
+    } else {
+        let query = sqlx::QueryBuilder::new(format!(
+            "
+        SELECT
             h.client_id,
             COALESCE(ga.client_name, '') as client_name,
             h.timestamp,
@@ -867,64 +1018,54 @@ pub async fn get_client_heartbeats(
             h.network_down
         FROM {} h
         INNER JOIN {} ga ON h.client_id = ga.client_id
-        WHERE ga.user_id = $1 
-        AND ga.valid_status = 'valid'
-    ",
-        HEARTBEAT_TABLE, GPU_ASSETS_TABLE
-    );
-
-    let mut params: Vec<String> = vec![user_id.to_string()];
-    let mut param_count = 2; // Start from $2
+        WHERE ga.user_id = ",
+            HEARTBEAT_TABLE, GPU_ASSETS_TABLE
+        ));
+        (query, "h.timestamp")
+    };
+    query_builder.push_bind(user_id);
+    query_builder.push(" AND ga.valid_status = 'valid'");
 
-    // Add client_id filter if provided
     if let Some(cid) = &client_id {
-        query.push_str(&format!(" AND h.client_id = ${}", param_count));
-        params.push(
-            hex::decode(cid)?
-                .into_iter()
-                .map(|b| format!("{:02x}", b))
-                .collect(),
-        );
-        param_count += 1;
+        query_builder.push(" AND h.client_id = ");
+        query_builder.push_bind(hex::decode(cid)?);
     }
 
-    let start_datetime = start_date.as_ref().and_then(|d| {
-        NaiveDateTime::parse_from_str(d, "%Y-%m-%dT%H:%M:%S")
-            .ok()
-            .map(|ndt| ndt.and_utc().naive_utc())
-    });
-    let end_datetime = end_date.as_ref().and_then(|d| {
-        NaiveDateTime::parse_from_str(d, "%Y-%m-%dT%H:%M:%S")
-            .ok()
-            .map(|ndt| ndt.and_utc().naive_utc())
-    });
-
-    // Add start date filter if provided
-    if let Some(start) = &start_datetime {
-        query.push_str(&format!(" AND h.timestamp >= ${}::timestamp", param_count));
+    // Hourly rows are keyed by the start of their hour.
+    if let Some(start) = parse_query_time(start_date.as_ref()) {
         info!("start_datetime: {}", start);
-        params.push(start.to_string());
-        param_count += 1;
+        query_builder.push(format!(" AND {} >= ", time_col));
+        if hourly {
+            query_builder.push("date_trunc('hour', ");
+            query_builder.push_bind(start);
+            query_builder.push(")");
+        } else {
+            query_builder.push_bind(start);
+        }
     }
-
-    // Add end date filter if provided
-    if let Some(end) = &end_datetime {
-        query.push_str(&format!(" AND h.timestamp < ${}::timestamp", param_count));
-        params.push(end.to_string());
-        let _ = param_count + 1; // param_count is only used for SQL parameter numbering
+    if let Some(end) = parse_query_time(end_date.as_ref()) {
+        query_builder.push(format!(" AND {} < ", time_col));
+        query_builder.push_bind(end);
     }
 
-    // Order by timestamp in descending order
-    query.push_str(" ORDER BY h.timestamp DESC");
-
-    // Execute the query with parameters
-    let mut query_builder = sqlx::query_as::<_, ClientHeartbeatInfo>(&query);
-
-    // Bind all parameters
-    for param in params {
-        query_builder = query_builder.bind(param);
+    if let Some((timestamp, cid)) = before {
+        let timestamp = DateTime::parse_from_rfc3339(&timestamp)?.with_timezone(&Utc);
+        query_builder.push(format!(" AND ({}, h.client_id) < (", time_col));
+        query_builder.push_bind(timestamp);
+        query_builder.push(", ");
+        query_builder.push_bind(hex::decode(cid)?);
+        query_builder.push(")");
     }
 
-    let heartbeats = query_builder.fetch_all(pool).await?;
+    query_builder.push(format!(
+        " ORDER BY {} DESC, h.client_id DESC LIMIT ",
+        time_col
+    ));
+    query_builder.push_bind(limit);
+
+    let heartbeats = query_builder
+        .build_query_as::<ClientHeartbeatInfo>()
+        .fetch_all(pool)
+        .await?;
     Ok(heartbeats)
 }
@@ -0,0 +1,242 @@
+//! In-process cache of API key lookups.
+//!
+//! Every public connection and gateway request resolves its API key to the
+//! set of devices it may use. Entries are kept for a short TTL (and never past
+//! the token's own expiry), and unknown keys are cached briefly as well, so a
+//! hit costs one shard read instead of a Postgres round trip.
+//!
+//! Writers publish to [`TOKEN_INVALIDATION_CHANNEL`]:
+//! - `token:<key>` drops one key,
+//! - `user:<user_id>` drops that user's keys and every metered key (metered
+//!   keys see all devices),
+//! - anything else clears the cache.
+
+use super::client::{load_token_clients, TokenClients};
+use crate::util::db::{listen_invalidations, publish_invalidation};
+
+use anyhow::{anyhow, Result};
+use redis::Client as RedisClient;
+use sqlx::{Pool, Postgres};
+use std::collections::hash_map::RandomState;
+use std::collections::HashMap;
+use std::hash::BuildHasher;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, RwLock};
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+pub const TOKEN_INVALIDATION_CHANNEL: &str = "gpuf:token-invalidate";
+
+const SHARD_COUNT: usize = 16;
+const DEFAULT_TTL: Duration = Duration::from_secs(30);
+const DEFAULT_NEGATIVE_TTL: Duration = Duration::from_secs(5);
+const DEFAULT_CAPACITY: usize = 16 * 1024;
+
+struct Entry {
+    /// `None` caches an unknown or expired key.
+    value: Option<Arc<TokenClients>>,
+    expires: Instant,
+}
+
+type Shard = RwLock<HashMap<String, Entry>>;
+
+pub struct TokenCache {
+    shards: Box<[Shard]>,
+    hasher: RandomState,
+    /// Bumped by every invalidation, so a lookup that raced one is not stored.
+    epoch: AtomicU64,
+    ttl: Duration,
+    negative_ttl: Duration,
+    shard_capacity: usize,
+}
+
+impl Default for TokenCache {
+    fn default() -> Self {
+        Self::new(DEFAULT_TTL, DEFAULT_NEGATIVE_TTL, DEFAULT_CAPACITY)
+    }
+}
+
+impl TokenCache {
+    pub fn new(ttl: Duration, negative_ttl: Duration, capacity: usize) -> Self {
+        Self {
+            shards: (0..SHARD_COUNT)
+                .map(|_| RwLock::new(HashMap::new()))
+                .collect::<Vec<_>>()
+                .into_boxed_slice(),
+            hasher: RandomState::new(),
+            epoch: AtomicU64::new(0),
+            ttl,
+            negative_ttl,
+            shard_capacity: (capacity / SHARD_COUNT).max(1),
+        }
+    }
+
+    fn shard(&self, token: &str) -> &Shard {
+        let h = self.hasher.hash_one(token);
+        &self.shards[(h as usize) % self.shards.len()]
+    }
+
+    /// Resolve `token`, loading it from Postgres on a miss.
+    pub async fn lookup(&self, pool: &Pool<Postgres>, token: &str) -> Result<Arc<TokenClients>> {
+        let cached = match self.get(token, Instant::now()) {
+            Some(cached) => cached,
+            None => {
+                let epoch = self.epoch.load(Ordering::Acquire);
+                // Database errors are returned without caching anything.
+                let value = load_token_clients(pool, token).await?.map(Arc::new);
+                self.insert(token, value.clone(), epoch, Instant::now());
+                value
+            }
+        };
+        cached.ok_or_else(|| anyhow!("Invalid or expired token"))
+    }
+
+    fn get(&self, token: &str, now: Instant) -> Option<Option<Arc<TokenClients>>> {
+        let shard = self.shard(token).read().unwrap_or_else(|e| e.into_inner());
+        shard
+            .get(token)
+            .filter(|entry| entry.expires > now)
+            .map(|entry| entry.value.clone())
+    }
+
+    fn insert(&self, token: &str, value: Option<Arc<TokenClients>>, epoch: u64, now: Instant) {
+        let expires = match &value {
+            Some(clients) => now + self.ttl.min(remaining_validity(clients.expired_time)),
+            None => now + self.negative_ttl,
+        };
+        let mut shard = self.shard(token).write().unwrap_or_else(|e| e.into_inner());
+        if self.epoch.load(Ordering::Acquire) != epoch {
+            return;
+        }
+        if shard.len() >= self.shard_capacity && !shard.contains_key(token) {
+            shard.retain(|_, entry| entry.expires > now);
+            if shard.len() >= self.shard_capacity {
+                if let Some(victim) = shard.keys().next().cloned() {
+                    shard.remove(&victim);
+                }
+            }
+        }
+        shard.insert(token.to_string(), Entry { value, expires });
+    }
+
+    /// Apply one invalidation message (see the module docs for the format).
+    pub fn invalidate(&self, message: &str) {
+        self.epoch.fetch_add(1, Ordering::AcqRel);
+        match message.split_once(':') {
+            Some(("token", token)) => {
+                self.shard(token)
+                    .write()
+                    .unwrap_or_else(|e| e.into_inner())
+                    .remove(token);
+            }
+            Some(("user", user_id)) => {
+                for shard in self.shards.iter() {
+                    shard.write().unwrap_or_else(|e| e.into_inner()).retain(
+                        |_, entry| match &entry.value {
+                            Some(clients) => {
+                                clients.user_id != user_id && !clients.access_level.is_metered()
+                            }
+                            None => true,
+                        },
+                    );
+                }
+            }
+            _ => {
+                for shard in self.shards.iter() {
+                    shard.write().unwrap_or_else(|e| e.into_inner()).clear();
+                }
+            }
+        }
+    }
+
+    /// Apply invalidations published on Redis for the lifetime of the process.
+    pub async fn listen_for_invalidations(self: Arc<Self>, redis_client: Arc<RedisClient>) {
+        listen_invalidations(redis_client, TOKEN_INVALIDATION_CHANNEL, |message| {
+            self.invalidate(message)
+        })
+        .await
+    }
+}
+
+/// Time left before a token with `expired_time` (unix seconds, -1 = never)
+/// stops being valid.
+fn remaining_validity(expired_time: i64) -> Duration {
+    if expired_time < 0 {
+        return Duration::MAX;
+    }
+    let now = SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .unwrap_or_default()
+        .as_secs() as i64;
+    Duration::from_secs(expired_time.saturating_sub(now).max(0) as u64)
+}
+
+/// Tell every server that `user_id`'s devices changed.
+pub async fn invalidate_user(redis_client: &RedisClient, user_id: &str) {
+    publish_invalidation(
+        redis_client,
+        TOKEN_INVALIDATION_CHANNEL,
+        &format!("user:{}", user_id),
+    )
+    .await;
+}
+
+/// Tell every server that `token` was created, revoked or changed.
+#[allow(dead_code)] // Token management lives outside this repository
+pub async fn invalidate_token(redis_client: &RedisClient, token: &str) {
+    publish_invalidation(
+        redis_client,
+        TOKEN_INVALIDATION_CHANNEL,
+        &format!("token:{}", token),
+    )
+    .await;
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::util::policy::AccessLevel;
+    use crate::util::protoc::ClientId;
+
+    fn clients(user_id: &str, access_level: i32) -> Option<Arc<TokenClients>> {
+        Some(Arc::new(TokenClients {
+            user_id: user_id.to_string(),
+            client_ids: vec![ClientId([1; 16])],
+            access_level: AccessLevel::from(access_level),
+            expired_time: -1,
+        }))
+    }
+
+    #[test]
+    fn test_expiry_and_invalidation() {
+        let cache = TokenCache::new(Duration::from_secs(30), Duration::from_secs(5), 64);
+        let now = Instant::now();
+        cache.insert("a", clients("u1", 1), 0, now);
+        cache.insert("b", clients("u2", 1), 0, now);
+        cache.insert("m", clients("u3", -1), 0, now);
+        cache.insert("bad", None, 0, now);
+
+        assert!(cache.get("a", now).unwrap().is_some());
+        assert!(cache.get("bad", now).unwrap().is_none());
+        assert!(cache.get("bad", now + Duration::from_secs(6)).is_none());
+        assert!(cache.get("a", now + Duration::from_secs(31)).is_none());
+
+        cache.invalidate("user:u1");
+        assert!(cache.get("a", now).is_none());
+        assert!(cache.get("m", now).is_none());
+        assert!(cache.get("b", now).is_some());
+
+        cache.invalidate("token:b");
+        assert!(cache.get("b", now).is_none());
+        assert!(cache.get("bad", now).is_some());
+    }
+
+    #[test]
+    fn test_insert_skipped_after_racing_invalidation() {
+        let cache = TokenCache::new(Duration::from_secs(30), Duration::from_secs(5), 64);
+        let now = Instant::now();
+        let epoch = cache.epoch.load(Ordering::Acquire);
+        cache.invalidate("*");
+        cache.insert("a", clients("u1", 1), epoch, now);
+        assert!(cache.get("a", now).is_none());
+    }
+}
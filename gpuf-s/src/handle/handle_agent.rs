@@ -1,18 +1,18 @@
 use super::*;
-use std::time::Duration;
 use tokio::net::TcpStream;
 use tracing::{error, info, warn};
 use uuid::Uuid;
 
-use rdkafka::producer::{FutureProducer, FutureRecord};
-
 #[cfg(all(target_os = "linux", feature = "experimental"))]
 use tokio_uring::net::TcpStream as UringTcpStream;
 
+use super::http_sniff::{RequestSniffer, Sniff};
+use super::proxy_pool::{self, ProxyPool, ProxyStream};
+use crate::util::kafka::{self, KafkaSink};
 use crate::util::protoc::{ClientId, ProxyConnId, RequestIDAndClientIDMessage};
 use bytes::BytesMut;
+use common::relay::join_streams_with_buffers;
 
-use std::collections::HashMap;
 #[cfg(feature = "experimental")]
 use std::pin::Pin;
 #[cfg(feature = "experimental")]
@@ -20,7 +20,6 @@ use std::task::{Context, Poll};
 use tokio::io::{self, AsyncRead, AsyncReadExt};
 #[cfg(feature = "experimental")]
 use tokio::io::AsyncWrite;
-use twoway;
 
 use anyhow::{anyhow, Result};
 #[cfg(feature = "experimental")]
@@ -37,7 +36,7 @@ use tokio_rustls::rustls::crypto::aws_lc_rs;
 #[cfg(feature = "ring")]
 use tokio_rustls::rustls::crypto::ring;
 
-use crate::db::client::get_user_client_by_token;
+use crate::db::token_cache::TokenCache;
 use crate::util::msg::ApiResponse;
 use crate::util::policy::{AccessLevel, REQUEST_MESSAGE_TOPIC};
 use tracing::debug;
@@ -67,8 +66,7 @@ impl ServerState {
             info!("New proxy connection from: {}", addr);
             let _ = proxy_stream.set_nodelay(true);
             let acceptor = acceptor.clone();
-            let pending_clone = self.pending_connections.clone();
-            let buffer_pool = self.buffer_pool.clone();
+            let state = self.clone();
             tokio::spawn(async move {
                 let mut buf = BytesMut::with_capacity(1024 * 1024);
 
@@ -80,60 +78,154 @@ impl ServerState {
                     }
                 };
 
-                if let Ok(Command::V1(CommandV1::NewProxyConn { proxy_conn_id })) =
+                let Ok(Command::V1(CommandV1::NewProxyConn { proxy_conn_id })) =
                     read_command(&mut tls_proxy_stream, &mut buf).await
-                {
+                else {
+                    error!("Failed to read NewProxyConn command from {}", addr);
+                    return;
+                };
+                info!(
+                    "Received proxy conn notification for id: {:?}",
+                    proxy_conn_id
+                );
+                let id = ProxyConnId(proxy_conn_id);
+                let pending = state.pending_connections.lock().await.remove(&id);
+                if let Some((client_id, user_stream, buf)) = pending {
                     info!(
-                        "Received proxy conn notification for id: {:?}",
+                        "Pairing user stream with proxy stream for id: {:?}",
                         proxy_conn_id
                     );
-                    let mut pending = pending_clone.lock().await;
-
-                    if let Some((user_stream, buf)) = pending.remove(&ProxyConnId(proxy_conn_id)) {
-                        info!(
-                            "Pairing user stream with proxy stream for id: {:?}",
-                            proxy_conn_id
-                        );
-                        let request_str = String::from_utf8_lossy(&buf);
-                        let parts: Vec<&str> = request_str.split("\r\n\r\n").collect();
-                        if parts.len() > 1 {
-                            debug!("=== HTTP Headers ===");
-                            debug!("{}", parts[0]);
-                            debug!("=== HTTP Body ===");
-                            debug!("{} len: {}", parts[1], parts[1].len());
-                        } else {
-                            debug!("Full request (no body separator): {}", request_str);
-                        }
-                        //print buffer
-                        debug!(
-                            "Sending buffer to client stream: {:?} len: {} buf len: {}",
-                            request_str,
-                            request_str.len(),
-                            buf.len()
-                        );
-                        let _ = tls_proxy_stream.write_all(buf.as_ref()).await;
-                        let _ = tls_proxy_stream.flush().await;
-                        buffer_pool.put(buf).await;
-
-                        tokio::spawn(async move {
-                            if let Err(e) = join_streams(user_stream, tls_proxy_stream).await {
-                                error!("Error joining streams: {}", e);
-                            }
-                            info!("Streams for {:?} joined and finished.", proxy_conn_id);
-                        });
-                    } else {
-                        warn!(
-                            "No pending user connection found for proxy_conn_id: {:?}",
-                            proxy_conn_id
-                        );
-                    }
+                    // The worker answers proxy requests; keep some ready.
+                    tokio::spawn(top_up_proxy_pool(
+                        state.proxy_pool.clone(),
+                        state.active_clients.clone(),
+                        client_id,
+                    ));
+                    state
+                        .relay_proxy(tls_proxy_stream, user_stream, buf, proxy_conn_id)
+                        .await;
+                } else if let Some(client_id) = state.proxy_pool.arrived(id) {
+                    state.park_proxy(client_id, id, tls_proxy_stream).await;
                 } else {
-                    error!("Failed to read NewProxyConn command from {}", addr);
+                    warn!(
+                        "No pending user connection found for proxy_conn_id: {:?}",
+                        proxy_conn_id
+                    );
                 }
             });
         }
     }
 
+    /// Send the request read so far down `tls_proxy_stream` and relay both
+    /// ways until either side closes.
+    async fn relay_proxy(
+        &self,
+        mut tls_proxy_stream: ProxyStream,
+        user_stream: TcpStream,
+        buf: BytesMut,
+        proxy_conn_id: [u8; 16],
+    ) {
+        let request_str = String::from_utf8_lossy(&buf);
+        let parts: Vec<&str> = request_str.split("\r\n\r\n").collect();
+        if parts.len() > 1 {
+            debug!("=== HTTP Headers ===");
+            debug!("{}", parts[0]);
+            debug!("=== HTTP Body ===");
+            debug!("{} len: {}", parts[1], parts[1].len());
+        } else {
+            debug!("Full request (no body separator): {}", request_str);
+        }
+        //print buffer
+        debug!(
+            "Sending buffer to client stream: {:?} len: {} buf len: {}",
+            request_str,
+            request_str.len(),
+            buf.len()
+        );
+        let _ = tls_proxy_stream.write_all(buf.as_ref()).await;
+        let _ = tls_proxy_stream.flush().await;
+        self.buffer_pool.put(buf);
+
+        let mut up = self.relay_buffers.get();
+        let mut down = self.relay_buffers.get();
+        if let Err(e) =
+            join_streams_with_buffers(user_stream, tls_proxy_stream, &mut up, &mut down).await
+        {
+            error!("Error joining streams: {}", e);
+        }
+        self.relay_buffers.put(up);
+        self.relay_buffers.put(down);
+        info!("Streams for {:?} joined and finished.", proxy_conn_id);
+    }
+
+    /// Hold an idle proxy connection of `client_id` until a request is
+    /// routed to it, the worker closes it, or it has been idle too long.
+    async fn park_proxy(
+        self: Arc<Self>,
+        client_id: ClientId,
+        id: ProxyConnId,
+        tls_proxy_stream: ProxyStream,
+    ) {
+        let mut rx = self.proxy_pool.park(client_id, id);
+        let parked_at = std::time::Instant::now();
+        // The worker sends nothing on an idle connection, so anything
+        // readable means it is gone.
+        let mut probe = [0u8; 1];
+        let (user, closed) = tokio::select! {
+            user = &mut rx => (user.ok(), false),
+            _ = tls_proxy_stream.get_ref().0.peek(&mut probe) => (None, true),
+            _ = tokio::time::sleep(proxy_pool::IDLE_TTL) => (None, false),
+        };
+        // A request may have been handed over just as the connection woke.
+        let user = match user {
+            None if !self.proxy_pool.unpark(client_id, id) => rx.try_recv().ok(),
+            user => user,
+        };
+
+        match user {
+            Some((user_stream, buf)) if !closed => {
+                debug!("Routing to idle proxy connection {:?}", id.0);
+                tokio::spawn(top_up_proxy_pool(
+                    self.proxy_pool.clone(),
+                    self.active_clients.clone(),
+                    client_id,
+                ));
+                self.relay_proxy(tls_proxy_stream, user_stream, buf, id.0)
+                    .await;
+            }
+            Some((user_stream, buf)) => {
+                if let Err(e) = route_to_new_proxy_conn(
+                    &self.pending_connections,
+                    &self.active_clients,
+                    &self.buffer_pool,
+                    client_id,
+                    user_stream,
+                    buf,
+                )
+                .await
+                {
+                    error!(
+                        "Failed to reroute request from closed proxy connection: {}",
+                        e
+                    );
+                }
+            }
+            None if parked_at.elapsed() >= proxy_pool::MIN_IDLE_LIFETIME => {
+                top_up_proxy_pool(
+                    self.proxy_pool.clone(),
+                    self.active_clients.clone(),
+                    client_id,
+                )
+                .await;
+            }
+            None => debug!(
+                "Idle proxy connection {:?} closed after {:?}",
+                id.0,
+                parked_at.elapsed()
+            ),
+        }
+    }
+
     pub async fn handle_public_connections(self: Arc<Self>, listener: TcpListener) -> Result<()> {
         loop {
             let (user_stream, addr) = listener.accept().await?;
@@ -144,9 +236,11 @@ impl ServerState {
             //let api_key = api_key.clone();
             // let _redis_client_clone = self.redis_client.clone();
             let db_pool_clone = self.db_pool.clone();
+            let token_cache_clone = self.token_cache.clone();
 
-            let producer_clone = self.producer.clone();
+            let kafka_clone = self.kafka.clone();
             let buffer_pool_clone = self.buffer_pool.clone();
+            let proxy_pool_clone = self.proxy_pool.clone();
             tokio::spawn(async move {
                 // Increment total connections counter
                 {
@@ -159,8 +253,10 @@ impl ServerState {
                     buffer_pool_clone,
                     active_clients_clone,
                     pending_connections_clone,
+                    proxy_pool_clone,
                     db_pool_clone,
-                    producer_clone,
+                    token_cache_clone,
+                    kafka_clone,
                 )
                 .await
                 {
@@ -181,7 +277,7 @@ impl ServerState {
         let pending_connections = self.pending_connections.clone();
         let db_pool = self.db_pool.clone();
         let redis_client = self.redis_client.clone();
-        let producer = self.producer.clone();
+        let kafka = self.kafka.clone();
 
         tokio_uring::start(async {
             let std_listener = listener.into_std()?;
@@ -194,7 +290,7 @@ impl ServerState {
                         let pending_connections = pending_connections.clone();
                         let db_pool = db_pool.clone();
                         let redis_client = redis_client.clone();
-                        let producer = producer.clone();
+                        let kafka = kafka.clone();
                         let api_key = api_key.clone();
 
                         // Spawn a new task to handle each connection
@@ -206,7 +302,7 @@ impl ServerState {
                                 api_key,
                                 db_pool,
                                 redis_client,
-                                producer,
+                                kafka,
                             )
                             .await
                             {
@@ -233,7 +329,7 @@ async fn route_public_connection_uring(
     _api_key: String,
     _db_pool: Arc<Pool<Postgres>>,
     _redis_client: Arc<RedisClient>,
-    _producer: Arc<FutureProducer>,
+    _kafka: Arc<KafkaSink>,
 ) -> Result<()> {
     // TODO: Implement uring version of route_public_connection
     info!("Handling connection with io_uring (not yet implemented)");
@@ -328,6 +424,7 @@ async fn parse_request(
 
 async fn authenticate_and_select_client(
     api_key: Option<String>,
+    token_cache: &TokenCache,
     db_pool: &Pool<Postgres>,
 ) -> Result<(Vec<ClientId>, AccessLevel)> {
     let api_key = api_key.ok_or_else(|| anyhow::anyhow!("Missing API key"))?;
@@ -335,11 +432,9 @@ async fn authenticate_and_select_client(
         warn!("Invalid API key length");
         return Err(anyhow::anyhow!("Invalid API key length"));
     }
-    // Validate token and client using database with Redis caching
-    match get_user_client_by_token(db_pool, api_key.as_str()).await {
-        Ok(client_ids) => Ok(client_ids),
-        Err(e) => Err(e),
-    }
+    // Validate token and client, served from the in-process cache when possible
+    let clients = token_cache.lookup(db_pool, api_key.as_str()).await?;
+    Ok((clients.client_ids.clone(), clients.access_level))
 }
 
 #[cfg(feature = "experimental")]
@@ -505,161 +600,50 @@ pub struct ChatRequestInfo {
     pub content_type: Option<String>,
     // pub reader: R,
 }
-use http::header::{HeaderMap, HeaderName, HeaderValue};
-use std::str::FromStr;
-
-fn parse_headers(data: &[u8]) -> io::Result<HeaderMap> {
-    let mut headers = HeaderMap::new();
-    let data_str = std::str::from_utf8(data)
-        .map_err(|_| io::Error::new(io::ErrorKind::InvalidData, "Invalid UTF-8 in headers"))?;
-
-    let mut lines = data_str.lines();
-    let _request_line = lines
-        .next()
-        .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidData, "Empty request"))?;
-
-    for line in lines {
-        let line = line.trim();
-        if line.is_empty() {
-            continue;
-        }
 
-        if let Some((name, value)) = line.split_once(':') {
-            let name = name.trim().to_lowercase();
-            let value = value.trim();
-
-            if let (Ok(name), Ok(value)) =
-                (HeaderName::from_str(&name), HeaderValue::from_str(value))
-            {
-                headers.insert(name, value);
-            }
-        }
-    }
-
-    Ok(headers)
-}
-
-async fn read_model_from_json_body<R: AsyncRead + Unpin>(
+/// Read the request head from `reader` into `buffer` and pick out the
+/// fields routing needs.
+pub async fn extract_chat_info<R: AsyncRead + Unpin>(
     reader: &mut R,
     buffer: &mut BytesMut,
-    body_start: usize,
-    log_buffer_len: bool,
-) -> Result<Option<String>> {
-    if body_start < buffer.len() {
-        if let Some(model) = try_parse_model_from_slice(&buffer[body_start..]) {
-            return Ok(Some(model));
-        }
-    }
-
-    let mut buf = [0u8; 1024];
+) -> Result<ChatRequestInfo> {
+    // Everything read stays in `buffer` untouched and is forwarded as-is.
+    let mut sniffer = RequestSniffer::new();
+    let mut eof = false;
     loop {
-        match reader.read(&mut buf).await {
-            Ok(0) => {
-                warn!("Connection closed");
-                return Ok(None);
-            }
-            Ok(n) => {
-                buffer.truncate(body_start + n);
-                buffer.extend_from_slice(&buf[..n]);
-                if let Some(model) = try_parse_model_from_slice(&buffer[body_start..]) {
-                    return Ok(Some(model));
-                }
-                if log_buffer_len {
-                    debug!(" buffer.len: {}", buffer.len());
-                }
-            }
-            Err(e) => return Err(e.into()),
+        match sniffer.advance(buffer, eof) {
+            Sniff::Done => break,
+            Sniff::Invalid(reason) => return Err(anyhow!(reason)),
+            Sniff::NeedMore => {}
         }
-    }
-}
-
-async fn extract_chat_info<R: AsyncRead + Unpin>(
-    reader: &mut R,
-    buffer: &mut BytesMut,
-) -> Result<ChatRequestInfo> {
-    let mut headers = None;
-    let mut body_start = 0;
-    let mut temp_buf = [0u8; 1024];
-    'header_loop: while buffer.len() < 64 * 1024 {
-        let n = match reader.read(&mut temp_buf).await {
-            Ok(0) => break,
-            Ok(n) => n,
-            Err(e) if e.kind() == io::ErrorKind::WouldBlock => break,
+        buffer.reserve(1024);
+        match reader.read_buf(buffer).await {
+            Ok(0) => eof = true,
+            Ok(_) => {}
+            Err(e) if e.kind() == io::ErrorKind::WouldBlock => eof = true,
             Err(e) => return Err(e.into()),
-        };
-
-        buffer.extend_from_slice(&temp_buf[..n]);
-
-        if let Some(pos) = twoway::find_bytes(&buffer, b"\r\n\r\n") {
-            let headers_data = &buffer[..pos + 4]; // Include \r\n\r\n
-            headers = Some(parse_headers(headers_data)?);
-            body_start = pos + 4;
-            break 'header_loop;
         }
     }
-
-    let headers = match headers {
-        Some(h) => h,
-        None => {
-            return Err(anyhow::anyhow!("Invalid HTTP headers"));
-        }
-    };
-
-    let content_type = headers
-        .get("content-type")
-        .and_then(|v| v.to_str().ok())
-        .map(|s| s.split(';').next().unwrap_or("").trim().to_lowercase())
-        .filter(|s| !s.is_empty());
-
-    let api_key = headers
-        .get("authorization")
-        .and_then(|v| v.to_str().ok())
-        .and_then(|s| s.strip_prefix("Bearer "))
-        .map(|s| s.to_string());
-
-    let request_id = headers
-        .get("request-id")
-        .and_then(|v| v.to_str().ok())
-        .map(|s| s.to_string());
+    let request = sniffer.into_request();
 
     debug!(
-        "api_key: {:?}, request_id: {:?}, content_type: {:?}",
-        api_key, request_id, content_type
+        "api_key: {:?}, request_id: {:?}, content_type: {:?}, buffer.len: {}",
+        request.api_key,
+        request.request_id,
+        request.content_type,
+        buffer.len()
     );
-
-    debug!("buffer.len: {} body_start: {} ", buffer.len(), body_start);
-
-    let Some(ct) = content_type.as_deref() else {
-        return Ok(ChatRequestInfo {
-            model: None,
-            request_id: None,
-            api_key,
-            content_type: None,
-        });
-    };
-
-    if ct != "application/json" {
-        warn!("Unsupported content type: {:?}", ct);
-        return Ok(ChatRequestInfo {
-            model: None,
-            request_id: None,
-            api_key,
-            content_type,
-        });
-    }
-
-    let model = if body_start < buffer.len() {
-        read_model_from_json_body(reader, buffer, body_start, false).await?
-    } else {
-        debug!("No body data found");
-        read_model_from_json_body(reader, buffer, body_start, true).await?
-    };
+    if let Some(ct) = request.content_type.as_deref() {
+        if ct != "application/json" {
+            warn!("Unsupported content type: {:?}", ct);
+        }
+    }
 
     Ok(ChatRequestInfo {
-        model,
-        request_id,
-        api_key,
-        content_type,
+        model: request.model,
+        request_id: request.request_id,
+        api_key: request.api_key,
+        content_type: request.content_type,
     })
 }
 
@@ -693,25 +677,6 @@ async fn parse_json_body<R: AsyncRead + Unpin>(
     try_parse_chat_info(&buffer)
 }
 
-fn try_parse_model_from_slice(data: &[u8]) -> Option<String> {
-    if let Ok(json) = serde_json::from_slice::<serde_json::Value>(data) {
-        debug!("json: {:?}", json);
-        if let Some(model) = json.get("model").and_then(|m| m.as_str()) {
-            return Some(model.to_string());
-        }
-    }
-
-    let s = String::from_utf8_lossy(data);
-    if let Some(start) = s.find(r#""model":"#) {
-        let remaining = &s[start + 8..]; // "model":"
-        if let Some(end) = remaining.find('"') {
-            return Some(remaining[..end].to_string());
-        }
-    }
-
-    None
-}
-
 #[cfg(feature = "experimental")]
 fn try_parse_chat_info(data: &[u8]) -> io::Result<Option<String>> {
     let mut data = data.to_vec();
@@ -757,22 +722,41 @@ pub async fn send_http_error_response(
     Ok(())
 }
 
+/// How long a public connection may take to send the part of its request
+/// that routing needs before it is closed.
+const REQUEST_HEAD_TIMEOUT: std::time::Duration = std::time::Duration::from_secs(15);
+
 async fn route_public_connection_new(
     mut user_stream: TcpStream,
     buffer_pool: Arc<BufferPool>,
     active_clients: ActiveClients,
     pending_connections: PendingConnections,
+    proxy_pool: Arc<ProxyPool>,
     db_pool: Arc<Pool<Postgres>>,
-    producer: Arc<FutureProducer>,
+    token_cache: Arc<TokenCache>,
+    kafka: Arc<KafkaSink>,
 ) -> Result<()> {
     // Request Parsing Module - Handle HTTP request parsing and validation
 
-    let mut buffer = buffer_pool.get().await;
-    let chat_info = match extract_chat_info(&mut user_stream, &mut buffer).await {
-        Ok(result) => result,
-        Err(e) => {
+    let mut buffer = buffer_pool.get();
+    let head = tokio::time::timeout(
+        REQUEST_HEAD_TIMEOUT,
+        extract_chat_info(&mut user_stream, &mut buffer),
+    )
+    .await;
+    let chat_info = match head {
+        Ok(Ok(result)) => result,
+        Err(_) => {
+            // Also ends connections whose request the XDP prefilter dropped.
+            buffer_pool.put(buffer);
+            return Err(anyhow::anyhow!(
+                "No complete request within {:?}",
+                REQUEST_HEAD_TIMEOUT
+            ));
+        }
+        Ok(Err(e)) => {
             error!("Request parsing failed: {}", e);
-            buffer_pool.put(buffer).await;
+            buffer_pool.put(buffer);
             return Err(anyhow::anyhow!("Request parsing failed"));
         }
     };
@@ -780,7 +764,7 @@ async fn route_public_connection_new(
     // debug!("Request Parsing Module - Handle HTTP request parsing and validation chat_info {:?}", chat_info);
     // Validate model and request_id
     if chat_info.model.is_none() || chat_info.api_key.is_none() {
-        buffer_pool.put(buffer).await;
+        buffer_pool.put(buffer);
         send_http_error_response(user_stream, 401, "Invalid model or api_key").await?;
         return Err(anyhow::anyhow!(
             "Missing model {} or api_key {}",
@@ -789,14 +773,13 @@ async fn route_public_connection_new(
         ));
     }
 
-    // TODO: use map to cacheclient info
     // Authentication Module - Handle API key validation
     debug!("Authentication Module - Handle API key validationt");
     let (client_ids, access_level) =
-        match authenticate_and_select_client(chat_info.api_key, &db_pool).await {
+        match authenticate_and_select_client(chat_info.api_key, &token_cache, &db_pool).await {
             Ok(client) => client,
             Err(e) => {
-                buffer_pool.put(buffer).await;
+                buffer_pool.put(buffer);
                 error!("Failed to authenticate and select client: {}", e);
                 send_http_error_response(
                     user_stream,
@@ -809,35 +792,44 @@ async fn route_public_connection_new(
         };
 
     if client_ids.is_empty() {
-        buffer_pool.put(buffer).await;
+        buffer_pool.put(buffer);
         send_http_error_response(user_stream, 401, "No available clients").await?;
         return Err(anyhow::anyhow!("No available clients"));
     }
 
     // Route public connection to chosen client
     debug!("Route public connection to chosen client");
-    let mut active_clients = active_clients.lock().await;
-
     let chosen_client_id = match connect_client_filter_model_and_client(
         chat_info.model.as_ref().unwrap(),
         client_ids,
-        &mut active_clients,
-    )
-    .await
-    {
-        Ok((chosen_client_id, chosen_client_proxy_conn_id)) => {
-            pending_connections
-                .lock()
-                .await
-                .insert(chosen_client_proxy_conn_id, (user_stream, buffer));
-            chosen_client_id
-        }
+        &active_clients,
+    ) {
+        Ok(chosen_client_id) => chosen_client_id,
         Err(e) => {
-            buffer_pool.put(buffer).await;
+            buffer_pool.put(buffer);
             send_http_error_response(user_stream, 400, "No available clients").await?;
             return Err(anyhow::anyhow!("No available clients {}", e));
         }
     };
+    match proxy_pool.take(chosen_client_id, (user_stream, buffer)) {
+        Ok(proxy_conn_id) => {
+            debug!(
+                "Handed request to idle proxy connection {:?}",
+                proxy_conn_id
+            );
+        }
+        Err((user_stream, buffer)) => {
+            route_to_new_proxy_conn(
+                &pending_connections,
+                &active_clients,
+                &buffer_pool,
+                chosen_client_id,
+                user_stream,
+                buffer,
+            )
+            .await?;
+        }
+    }
 
     if !access_level.is_metered() {
         debug!("Send kafka key-value (request_id, client_id) pair");
@@ -845,7 +837,7 @@ async fn route_public_connection_new(
     }
 
     // share api Send kafka key-value (request_id, client_id) pair
-    match request_to_kafka(chat_info.request_id, chosen_client_id, producer).await {
+    match request_to_kafka(chat_info.request_id, chosen_client_id, &kafka) {
         Ok(_) => Ok(()),
         Err(e) => {
             error!("Failed to send request to Kafka: {:?}", e);
@@ -854,50 +846,20 @@ async fn route_public_connection_new(
     }
 }
 
-pub async fn connect_client_filter_model_and_client(
+pub fn connect_client_filter_model_and_client(
     model_name: &str,
     client_ids: Vec<ClientId>,
-    clients: &mut HashMap<ClientId, ClientInfo>,
-) -> Result<(ClientId, ProxyConnId)> {
-    let chosen_client: Option<(&ClientInfo, ClientId)> =
-        client_ids.into_iter().find_map(|client_id| {
-            if let Some(client_info) = clients.get(&client_id) {
-                if let Some(models) = &client_info.models {
-                    if models.iter().any(|m| m.id == model_name) {
-                        return Some((client_info, client_id));
-                    }
-                }
-            }
-            None
-        });
+    clients: &DeviceRegistry,
+) -> Result<ClientId> {
+    let chosen_client: Option<(Arc<ClientInfo>, ClientId)> = clients
+        .best_for_model(model_name, Some(&client_ids))
+        .and_then(|client_id| clients.get(&client_id).map(|info| (info, client_id)));
     match chosen_client {
         Some((client_info, client_id)) => {
             if !client_info.authed {
                 return Err(anyhow!("Chosen client not authenticated"));
             }
-            let proxy_conn_id = Uuid::new_v4().as_bytes().clone();
-            let command = Command::V1(CommandV1::RequestNewProxyConn { proxy_conn_id });
-
-            info!(
-                "Requesting new proxy connection with id: {:?}",
-                proxy_conn_id
-            );
-            let mut writer = client_info.writer.lock().await;
-
-            if let Err(e) = write_command(&mut *writer, &command).await {
-                error!(
-                "Failed to send RequestNewProxyConn to client {}: {}. Removing from active list.",
-                client_id, e
-                );
-                drop(writer);
-                clients.remove(&client_id);
-                return Err(e);
-            }
-            info!(
-                "Successfully sent RequestNewProxyConn to client {}",
-                client_id
-            );
-            Ok((client_id, ProxyConnId(proxy_conn_id)))
+            Ok(client_id)
         }
         None => {
             error!("Chosen client disappeared");
@@ -906,10 +868,96 @@ pub async fn connect_client_filter_model_and_client(
     }
 }
 
-async fn request_to_kafka(
+/// Park the request until `client_id` dials in a proxy connection for it.
+async fn route_to_new_proxy_conn(
+    pending_connections: &PendingConnections,
+    clients: &DeviceRegistry,
+    buffer_pool: &BufferPool,
+    client_id: ClientId,
+    user_stream: TcpStream,
+    buffer: BytesMut,
+) -> Result<()> {
+    let proxy_conn_id = Uuid::new_v4().as_bytes().clone();
+    pending_connections
+        .lock()
+        .await
+        .insert(ProxyConnId(proxy_conn_id), (client_id, user_stream, buffer));
+    let Err(e) = request_proxy_conn(clients, client_id, proxy_conn_id).await else {
+        return Ok(());
+    };
+    let pending = pending_connections
+        .lock()
+        .await
+        .remove(&ProxyConnId(proxy_conn_id));
+    if let Some((_, user_stream, buffer)) = pending {
+        buffer_pool.put(buffer);
+        send_http_error_response(user_stream, 400, "No available clients").await?;
+    }
+    Err(anyhow::anyhow!("No available clients {}", e))
+}
+
+async fn request_proxy_conn(
+    clients: &DeviceRegistry,
+    client_id: ClientId,
+    proxy_conn_id: [u8; 16],
+) -> Result<()> {
+    let client_info = clients
+        .get(&client_id)
+        .ok_or_else(|| anyhow!("Chosen client disappeared"))?;
+    let command = Command::V1(CommandV1::RequestNewProxyConn { proxy_conn_id });
+
+    info!(
+        "Requesting new proxy connection with id: {:?}",
+        proxy_conn_id
+    );
+    let mut writer = client_info.writer.lock().await;
+
+    if let Err(e) = write_command(&mut *writer, &command).await {
+        error!(
+            "Failed to send RequestNewProxyConn to client {}: {}. Removing from active list.",
+            client_id, e
+        );
+        drop(writer);
+        clients.remove(&client_id);
+        return Err(e);
+    }
+    info!(
+        "Successfully sent RequestNewProxyConn to client {}",
+        client_id
+    );
+    Ok(())
+}
+
+/// Ask `client_id` for enough proxy connections to refill its idle pool.
+async fn top_up_proxy_pool(pool: Arc<ProxyPool>, clients: ActiveClients, client_id: ClientId) {
+    let ids = pool.want(client_id);
+    if ids.is_empty() {
+        return;
+    }
+    let Some(client_info) = clients.get(&client_id) else {
+        pool.forget(&client_id);
+        return;
+    };
+    let commands: Vec<Command> = ids
+        .iter()
+        .map(|id| {
+            Command::V1(CommandV1::RequestNewProxyConn {
+                proxy_conn_id: id.0,
+            })
+        })
+        .collect();
+    if let Err(e) = write_commands(&mut *client_info.writer.lock().await, &commands).await {
+        warn!(
+            "Failed to request idle proxy connections from {}: {}",
+            client_id, e
+        );
+    }
+}
+
+fn request_to_kafka(
     request_id: Option<String>,
     chosen_client_id: ClientId,
-    producer: Arc<FutureProducer>,
+    kafka: &KafkaSink,
 ) -> Result<()> {
     if let Some(request_id_str) = request_id {
         let message = RequestIDAndClientIDMessage {
@@ -919,19 +967,11 @@ async fn request_to_kafka(
             client_id: chosen_client_id.0,
         };
 
-        let request_message_bytes = serde_json::to_vec(&message)?;
-
-        if let Err(e) = producer
-            .send(
-                FutureRecord::to(REQUEST_MESSAGE_TOPIC)
-                    .payload(&request_message_bytes)
-                    .key(&chosen_client_id.to_string()),
-                Duration::from_secs(0),
-            )
-            .await
-        {
-            error!("Failed to send heartbeat to Kafka: {:?}", e);
-        };
+        kafka.publish(
+            REQUEST_MESSAGE_TOPIC,
+            chosen_client_id.to_string(),
+            kafka::encode(&message)?,
+        );
     }
     Ok(())
 }
@@ -4,12 +4,18 @@ use crate::db::{
     client,
     models::{self, HotModelClass},
 };
+use super::model_seeds::ModelSeeds;
+use crate::util::kafka::{self, KafkaSink};
+use crate::util::policy::HEARTBEAT_TOPIC;
 use crate::util::protoc::{ClientId, HeartbeatMessage};
 use bytes::BytesMut;
-use std::collections::HashMap;
 
 use anyhow::{anyhow, Result};
-use common::{format_bytes, os_type_str, CommandV2, DownloadStatus, Model, OsType, PodModel};
+use common::{
+    format_bytes, os_type_str, write_commands, CommandV2, DownloadStatus, Model, OsType, PodModel,
+    CONTEXT_PROFILE_MIN_VERSION, DEVICE_STATE_MIN_VERSION, LOAD_BEACON_MIN_VERSION,
+    MODEL_PEERS_MIN_VERSION, TASK_TIMINGS_MIN_VERSION,
+};
 use redis::Client as RedisClient;
 use redis::AsyncCommands;
 use sqlx::{Pool, Postgres};
@@ -17,8 +23,6 @@ use std::sync::Arc;
 
 use tokio::net::{tcp::OwnedWriteHalf, TcpListener};
 
-use bincode::config;
-use rdkafka::producer::{FutureProducer, FutureRecord};
 use std::time::Duration;
 use tracing::{debug, error, info, warn};
 
@@ -34,6 +38,9 @@ use std::mem;
 use std::os::fd::FromRawFd;
 use tokio::net::TcpStream;
 
+/// Shortest gap between load beacons from one client.
+const LOAD_BEACON_INTERVAL_MS: u32 = 2000;
+
 impl ServerState {
     pub async fn handle_client_connections(self: Arc<Self>, listener: TcpListener) -> Result<()> {
         loop {
@@ -44,7 +51,7 @@ impl ServerState {
             let redis_client_clone = self.redis_client.clone();
             let client_models = self.client_model.clone();
             let hot_models = self.hot_models.clone();
-            let producer: Arc<FutureProducer> = self.producer.clone();
+            let kafka = self.kafka.clone();
             let server_state_clone = self.clone();
             tokio::spawn(async move {
                 if let Err(e) = handle_single_client(
@@ -53,7 +60,7 @@ impl ServerState {
                     client_models,
                     hot_models,
                     db_pool_clone,
-                    producer,
+                    kafka,
                     redis_client_clone,
                     server_state_clone,
                 )
@@ -98,7 +105,7 @@ async fn handle_single_client(
     _client_models: Arc<ClientModelClass>,
     hot_models: Arc<HotModelClass>,
     db_pool: Arc<Pool<Postgres>>,
-    producer: Arc<FutureProducer>,
+    kafka: Arc<KafkaSink>,
     redis_client: Arc<RedisClient>,
     server_state: Arc<crate::handle::ServerState>,
 ) -> Result<()> {
@@ -112,6 +119,7 @@ async fn handle_single_client(
 
     let mut authed = false;
     let mut session_client_id = ClientId([0; 16]);
+    let mut session_version = 0;
     let mut buf = BytesMut::with_capacity(1024 * 1024);
 
     loop {
@@ -167,8 +175,34 @@ async fn handle_single_client(
                     }
                 };
                 session_client_id = ClientId(id);
+                session_version = version;
 
-                write_command(&mut *writer.lock().await, &Command::V1(validate_result)).await?;
+                let mut reply = match &validate_result {
+                    CommandV1::LoginResult { pods_model, .. } if authed => model_peers_for(
+                        &server_state.model_seeds,
+                        session_version,
+                        pods_model,
+                        &session_client_id,
+                        addr.ip(),
+                    ),
+                    _ => Vec::new(),
+                };
+                if authed && session_version >= CONTEXT_PROFILE_MIN_VERSION {
+                    reply.push(Command::V1(CommandV1::RequestContextProfile));
+                }
+                if authed && session_version >= DEVICE_STATE_MIN_VERSION {
+                    reply.push(Command::V1(CommandV1::RequestDeviceState));
+                }
+                if authed && session_version >= LOAD_BEACON_MIN_VERSION {
+                    reply.push(Command::V1(CommandV1::RequestLoadBeacon {
+                        interval_ms: LOAD_BEACON_INTERVAL_MS,
+                    }));
+                }
+                if authed && session_version >= TASK_TIMINGS_MIN_VERSION {
+                    reply.push(Command::V1(CommandV1::RequestTaskTimings));
+                }
+                reply.push(Command::V1(validate_result));
+                write_commands(&mut *writer.lock().await, &reply).await?;
             }
             // Device system status from client to server 120s
             Ok(Command::V1(CommandV1::Heartbeat {
@@ -180,16 +214,29 @@ async fn handle_single_client(
                 devices_info,
             })) => {
                 info!("Heartbeat received from client {}", hex::encode(id));
+                if authed {
+                    active_clients.update_load(
+                        &ClientId(id),
+                        system_info.cpu_usage,
+                        system_info.memory_usage,
+                        system_info.disk_usage,
+                    );
+                }
+                // Beacon clients omit an unchanged inventory; Kafka consumers
+                // still get the full one.
+                let devices_info = match active_clients.get(&ClientId(id)) {
+                    Some(info) if device_count > 0 => info.heartbeat_inventory(devices_info),
+                    _ => devices_info,
+                };
                 handle_heartbeat(
-                    &producer,
+                    &kafka,
                     &ClientId(id),
                     system_info,
                     devices_info,
                     device_memtotal_gb,
                     device_count as u32,
                     device_total_tflops,
-                )
-                .await;
+                );
             }
             // Device model status from client to server 300s
             Ok(Command::V1(CommandV1::ModelStatus {
@@ -205,7 +252,7 @@ async fn handle_single_client(
 
                 upsert_client_models_in_redis(&redis_client, &ClientId(id), &models).await;
 
-                let pods_model = match handle_models_status(
+                let result = match handle_models_status(
                     &hot_models,
                     &active_clients,
                     &ClientId(id),
@@ -226,11 +273,26 @@ async fn handle_single_client(
                         }
                     }
                 };
-                write_command(&mut *writer.lock().await, &Command::V1(pods_model)).await?;
+                let mut reply = match &result {
+                    CommandV1::PullModelResult { pods_model, .. } if authed => model_peers_for(
+                        &server_state.model_seeds,
+                        session_version,
+                        pods_model,
+                        &session_client_id,
+                        addr.ip(),
+                    ),
+                    _ => Vec::new(),
+                };
+                reply.push(Command::V1(result));
+                write_commands(&mut *writer.lock().await, &reply).await?;
             }
             Err(e) => {
                 info!("addr {} disconnected: {}", addr, e);
-                active_clients.lock().await.remove(&session_client_id);
+                active_clients.remove(&session_client_id);
+                server_state.proxy_pool.forget(&session_client_id);
+                if authed {
+                    server_state.model_seeds.remove_client(&session_client_id);
+                }
                 client::upsert_client_status(&db_pool, &session_client_id, "offline").await?;
                 return Ok(());
             }
@@ -290,6 +352,86 @@ async fn handle_single_client(
                     )
                     .await;
             }
+            Ok(Command::V1(CommandV1::InferenceResultChunkCompact {
+                handle,
+                seq,
+                delta,
+                phase,
+                end,
+            })) => {
+                server_state
+                    .inference_scheduler
+                    .handle_inference_result_chunk_compact(
+                        &session_client_id,
+                        handle,
+                        seq,
+                        delta,
+                        phase,
+                        end,
+                    )
+                    .await;
+            }
+            Ok(Command::V1(CommandV1::TaskDecodeStats {
+                task_id,
+                draft_tokens,
+                accepted_tokens,
+            })) => {
+                server_state.inference_scheduler.handle_task_decode_stats(
+                    &session_client_id,
+                    &task_id,
+                    draft_tokens,
+                    accepted_tokens,
+                );
+            }
+            Ok(Command::V1(CommandV1::TaskTimings { task_id, timings })) => {
+                server_state.inference_scheduler.handle_task_timings(
+                    &session_client_id,
+                    &task_id,
+                    timings,
+                );
+            }
+            Ok(Command::V1(CommandV1::ContextProfile { profile, .. })) => {
+                info!(
+                    "Context profile from client {}: {:?}",
+                    hex::encode(session_client_id.0),
+                    profile
+                );
+                if let (true, Some(info)) = (authed, active_clients.get(&session_client_id)) {
+                    info.set_context_window(profile.n_ctx);
+                }
+            }
+            Ok(Command::V1(CommandV1::LoadBeacon { delta })) => {
+                if authed {
+                    active_clients.apply_load_delta(&session_client_id, &delta);
+                }
+            }
+            Ok(Command::V1(CommandV1::DeviceState {
+                level,
+                temp_c,
+                battery_pct,
+                charging,
+                ..
+            })) => {
+                debug!(
+                    "Device state from client {}: {:?} temp={}C battery={}% charging={}",
+                    hex::encode(session_client_id.0),
+                    level,
+                    temp_c,
+                    battery_pct,
+                    charging
+                );
+                if let (true, Some(info)) = (authed, active_clients.get(&session_client_id)) {
+                    if info.throttle() != level {
+                        info!(
+                            "Client {} throttle level {:?} -> {:?}",
+                            hex::encode(session_client_id.0),
+                            info.throttle(),
+                            level
+                        );
+                    }
+                    info.set_throttle(level);
+                }
+            }
 
             Ok(Command::V1(CommandV1::ModelDownloadProgress {
                 client_id: id,
@@ -366,12 +508,11 @@ async fn handle_single_client(
                 let target_id = ClientId(target_client_id);
 
                 let (source_writer, target_writer) = {
-                    let clients = active_clients.lock().await;
-                    let source = clients
+                    let source = active_clients
                         .get(&source_id)
                         .map(|c| c.writer.clone())
                         .ok_or_else(|| anyhow!("Source client not online"))?;
-                    let target = clients
+                    let target = active_clients
                         .get(&target_id)
                         .map(|c| c.writer.clone())
                         .ok_or_else(|| anyhow!("Target client not online"))?;
@@ -479,13 +620,10 @@ async fn handle_single_client(
                     }
                 }
 
-                let target_writer = {
-                    let clients = active_clients.lock().await;
-                    clients
-                        .get(&dst)
-                        .map(|c| c.writer.clone())
-                        .ok_or_else(|| anyhow!("Target client not online"))?
-                };
+                let target_writer = active_clients
+                    .get(&dst)
+                    .map(|c| c.writer.clone())
+                    .ok_or_else(|| anyhow!("Target client not online"))?;
 
                 let forward = Command::V2(CommandV2::P2PCandidates {
                     source_client_id,
@@ -495,6 +633,36 @@ async fn handle_single_client(
                 });
                 write_command(&mut *target_writer.lock().await, &forward).await?;
             }
+
+            Ok(Command::V2(CommandV2::ModelPiecesAvailable {
+                checksum,
+                total_size,
+                piece_size,
+                have,
+                piece_hashes,
+                seed_port,
+                seed_addrs,
+            })) => {
+                if !authed {
+                    return Err(anyhow!("ModelPiecesAvailable before login"));
+                }
+                if let Err(e) = server_state.model_seeds.advertise(
+                    session_client_id,
+                    addr.ip(),
+                    &checksum,
+                    total_size,
+                    piece_size,
+                    have,
+                    piece_hashes,
+                    seed_port,
+                    seed_addrs,
+                ) {
+                    warn!(
+                        "Ignoring model pieces from client {} for {}: {}",
+                        session_client_id, checksum, e
+                    );
+                }
+            }
             _ => {
                 warn!("Received unexpected command from client addr {}", addr);
             }
@@ -504,10 +672,38 @@ async fn handle_single_client(
     Ok(()) // This is theoretically unreachable but required by compiler
 }
 
+/// ModelPeers for each model in `pods_model` that peers of `client_id` can
+/// serve, to be written just before the command naming them.
+fn model_peers_for(
+    seeds: &ModelSeeds,
+    version: u32,
+    pods_model: &[PodModel],
+    client_id: &ClientId,
+    public_ip: std::net::IpAddr,
+) -> Vec<Command> {
+    if version < MODEL_PEERS_MIN_VERSION {
+        return Vec::new();
+    }
+    pods_model
+        .iter()
+        .filter_map(|pod_model| {
+            let checksum = pod_model.checksum.as_ref()?;
+            let list = seeds.peers_for(checksum, client_id, public_ip)?;
+            Some(Command::V2(CommandV2::ModelPeers {
+                checksum: checksum.clone(),
+                total_size: list.total_size,
+                piece_size: list.piece_size,
+                piece_hashes: list.piece_hashes,
+                peers: list.peers,
+            }))
+        })
+        .collect()
+}
+
 async fn handle_login(
     version: u32,
     auto_models: bool,
-    active_clients: &Arc<Mutex<HashMap<ClientId, ClientInfo>>>,
+    active_clients: &ActiveClients,
     redis_client: &Arc<RedisClient>,
     db_pool: &Pool<Postgres>,
     hot_models: &Arc<HotModelClass>,
@@ -519,8 +715,9 @@ async fn handle_login(
     authed: &mut bool,
 ) -> Result<CommandV1> {
     info!("Registration attempt for client_id: {}", client_id);
-    let mut clients = active_clients.lock().await;
-    if clients.contains_key(&client_id) {
+    // Check-then-insert: validation below awaits the DB, so no registry lock is
+    // held here and try_insert re-checks for a concurrent login.
+    if active_clients.contains(client_id) {
         warn!("Client ID {:?} already registered.", client_id);
         return Err(anyhow!("Client ID already registered"));
     }
@@ -563,41 +760,24 @@ async fn handle_login(
         client_id, validate_result
     );
 
-    clients.insert(
-        *client_id,
-        ClientInfo {
-            writer: writer.clone(),
-            authed: *authed,
-            version,
-            system_info: Some(SystemInfo {
-                cpu_usage: system_info.cpu_usage,
-                memory_usage: system_info.memory_usage,
-                disk_usage: system_info.disk_usage,
-                device_memsize: system_info.device_memsize,
-                total_tflops: system_info.total_tflops,
-                memsize_gb: system_info.memsize_gb,
-                last_heartbeat: Utc::now().into(),
-            }),
-            connected_at: Utc::now(),
-            models: None,
-            devices_info,
-        },
-    );
+    let info = ClientInfo::new(writer.clone(), *authed, version, &system_info, devices_info);
+    if active_clients.try_insert(*client_id, info).is_none() {
+        warn!("Client ID {:?} already registered.", client_id);
+        *authed = false;
+        return Err(anyhow!("Client ID already registered"));
+    }
     Ok(validate_result)
 }
 
 async fn handle_models_status(
     hot_models: &Arc<HotModelClass>,
-    active_clients: &Arc<Mutex<HashMap<ClientId, ClientInfo>>>,
+    active_clients: &ActiveClients,
     client_id: &ClientId,
     auto_models_device: Vec<DevicesInfo>,
     models: Vec<Model>,
 ) -> Result<Vec<PodModel>> {
     //TODO: push msg-> api filter
-    let mut clients = active_clients.lock().await;
-    if let Some(client) = clients.get_mut(client_id) {
-        client.models = Some(models);
-    }
+    active_clients.set_models(client_id, models);
 
     let mut pods_model: Vec<PodModel> = Vec::with_capacity(auto_models_device.len());
 
@@ -654,8 +834,8 @@ async fn upsert_client_models_in_redis(
     let _: std::result::Result<(), _> = conn.expire(&key, 300).await;
 }
 
-async fn handle_heartbeat(
-    producer: &Arc<FutureProducer>,
+fn handle_heartbeat(
+    kafka: &KafkaSink,
     client_id: &ClientId,
     system_info: common::SystemInfo,
     devices_info: Vec<common::DevicesInfo>,
@@ -674,22 +854,18 @@ async fn handle_heartbeat(
         devices_info,
     };
 
-    let cfg = config::standard()
-        .with_fixed_int_encoding()
-        .with_little_endian();
-
-    let heartbeat_message_bytes = bincode::encode_to_vec(&heartbeat_message, cfg).unwrap();
-    if let Err(e) = producer
-        .send(
-            FutureRecord::to("client-heartbeats")
-                .payload(&heartbeat_message_bytes)
-                .key(&client_id.to_string()),
-            Duration::from_secs(0),
-        )
-        .await
-    {
-        error!("Failed to send heartbeat to Kafka: {:?}", e);
+    let heartbeat_message_bytes = match kafka::encode(&heartbeat_message) {
+        Ok(bytes) => bytes,
+        Err(e) => {
+            error!("Failed to encode heartbeat for client {}: {}", client_id, e);
+            return;
+        }
     };
+    kafka.publish(
+        HEARTBEAT_TOPIC,
+        client_id.to_string(),
+        heartbeat_message_bytes,
+    );
 }
 
 /// Update model download progress in Redis
@@ -0,0 +1,396 @@
+//! Incremental sniffer for requests arriving on the public port.
+//!
+//! Routing only needs a few header values and the body's `model` field, so
+//! [`RequestSniffer`] scans the bytes read so far without copying or parsing
+//! them, remembers where it stopped, and reports completion as soon as those
+//! fields are known. Newlines, quotes and the `"model"` key are located with
+//! `memchr`'s vectorised search; only a key of the top-level object counts, so
+//! a `model` inside `metadata` or a tool definition cannot misroute the
+//! request. The request bytes themselves are never modified, so the caller can
+//! forward its buffer as-is.
+
+use memchr::{memchr, memchr2, memmem};
+
+/// Upper bound on the request head.
+pub const MAX_HEADER_BYTES: usize = 64 * 1024;
+/// How far into a body without `Content-Length` to look for `model`.
+pub const MAX_BODY_SNIFF_BYTES: usize = 1024 * 1024;
+
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct SniffedRequest {
+    pub api_key: Option<String>,
+    pub request_id: Option<String>,
+    pub content_type: Option<String>,
+    pub content_length: Option<usize>,
+    pub model: Option<String>,
+}
+
+#[derive(Debug, PartialEq)]
+pub enum Sniff {
+    /// More bytes are needed.
+    NeedMore,
+    /// Everything routing needs is known.
+    Done,
+    /// The request head is malformed or too large.
+    Invalid(&'static str),
+}
+
+#[derive(Debug, Clone, Copy)]
+enum Phase {
+    Headers,
+    Body { start: usize },
+    Done,
+}
+
+pub struct RequestSniffer {
+    phase: Phase,
+    /// First byte not yet scanned.
+    pos: usize,
+    saw_request_line: bool,
+    request: SniffedRequest,
+    model_finder: memmem::Finder<'static>,
+    json: JsonDepth,
+}
+
+/// Just enough JSON lexing to know the nesting depth at a body offset.
+#[derive(Debug, Default)]
+struct JsonDepth {
+    /// First byte not yet lexed.
+    at: usize,
+    depth: u32,
+    in_string: bool,
+    escaped: bool,
+}
+
+impl JsonDepth {
+    /// Lex `data[self.at..to]`.
+    fn advance(&mut self, data: &[u8], to: usize) {
+        let mut i = self.at;
+        while i < to {
+            if self.escaped {
+                self.escaped = false;
+                i += 1;
+            } else if self.in_string {
+                // Strings (message contents) are most of a body; skip them
+                // with a vectorised search.
+                match memchr2(b'"', b'\\', &data[i..to]) {
+                    Some(off) => {
+                        let at = i + off;
+                        if data[at] == b'\\' {
+                            self.escaped = true;
+                        } else {
+                            self.in_string = false;
+                        }
+                        i = at + 1;
+                    }
+                    None => i = to,
+                }
+            } else {
+                match data[i] {
+                    b'"' => self.in_string = true,
+                    b'{' | b'[' => self.depth += 1,
+                    b'}' | b']' => self.depth = self.depth.saturating_sub(1),
+                    _ => {}
+                }
+                i += 1;
+            }
+        }
+        self.at = self.at.max(to);
+    }
+}
+
+impl Default for RequestSniffer {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl RequestSniffer {
+    pub fn new() -> Self {
+        Self {
+            phase: Phase::Headers,
+            pos: 0,
+            saw_request_line: false,
+            request: SniffedRequest::default(),
+            model_finder: memmem::Finder::new(br#""model""#),
+            json: JsonDepth::default(),
+        }
+    }
+
+    pub fn request(&self) -> &SniffedRequest {
+        &self.request
+    }
+
+    pub fn into_request(self) -> SniffedRequest {
+        self.request
+    }
+
+    /// Continue scanning `data`, which holds every byte read so far (earlier
+    /// calls saw a prefix of it). `eof` marks that no more bytes will come.
+    pub fn advance(&mut self, data: &[u8], eof: bool) -> Sniff {
+        if let Phase::Headers = self.phase {
+            if let Some(invalid) = self.scan_headers(data) {
+                return Sniff::Invalid(invalid);
+            }
+            if let Phase::Headers = self.phase {
+                if data.len() >= MAX_HEADER_BYTES {
+                    return Sniff::Invalid("HTTP headers too large");
+                }
+                return if eof {
+                    Sniff::Invalid("Incomplete HTTP headers")
+                } else {
+                    Sniff::NeedMore
+                };
+            }
+        }
+        if let Phase::Body { start } = self.phase {
+            self.scan_body(data, start, eof);
+        }
+        match self.phase {
+            Phase::Done => Sniff::Done,
+            _ => Sniff::NeedMore,
+        }
+    }
+
+    fn scan_headers(&mut self, data: &[u8]) -> Option<&'static str> {
+        while let Some(nl) = memchr(b'\n', &data[self.pos..]) {
+            let line_end = self.pos + nl;
+            let line = trim_cr(&data[self.pos..line_end]);
+            self.pos = line_end + 1;
+
+            if !self.saw_request_line {
+                if line.is_empty() {
+                    // Tolerate blank lines before the request line.
+                    continue;
+                }
+                self.saw_request_line = true;
+                continue;
+            }
+            if line.is_empty() {
+                self.start_body();
+                return None;
+            }
+            let Some(colon) = memchr(b':', line) else {
+                continue;
+            };
+            let name = trim(&line[..colon]);
+            let Ok(value) = std::str::from_utf8(trim(&line[colon + 1..])) else {
+                continue;
+            };
+            if name.eq_ignore_ascii_case(b"authorization") {
+                self.request.api_key = value.strip_prefix("Bearer ").map(str::to_string);
+            } else if name.eq_ignore_ascii_case(b"content-type") {
+                let ct = value.split(';').next().unwrap_or("").trim();
+                self.request.content_type = (!ct.is_empty()).then(|| ct.to_ascii_lowercase());
+            } else if name.eq_ignore_ascii_case(b"content-length") {
+                match value.parse() {
+                    Ok(len) => self.request.content_length = Some(len),
+                    Err(_) => return Some("Invalid Content-Length"),
+                }
+            } else if name.eq_ignore_ascii_case(b"request-id") {
+                self.request.request_id = Some(value.to_string());
+            }
+        }
+        None
+    }
+
+    fn start_body(&mut self) {
+        // Only JSON bodies carry a model; anything else is routed (or
+        // rejected) on the headers alone.
+        let wants_body = self.request.content_type.as_deref() == Some("application/json")
+            && self.request.content_length != Some(0);
+        self.json.at = self.pos;
+        self.phase = if wants_body {
+            Phase::Body { start: self.pos }
+        } else {
+            Phase::Done
+        };
+    }
+
+    fn scan_body(&mut self, data: &[u8], start: usize, eof: bool) {
+        let limit = start
+            + self
+                .request
+                .content_length
+                .unwrap_or(MAX_BODY_SNIFF_BYTES)
+                .min(MAX_BODY_SNIFF_BYTES);
+        let end = data.len().min(limit);
+
+        while let Some(found) = self.model_finder.find(&data[self.pos..end]) {
+            let key = self.pos + found;
+            self.json.advance(data, key);
+            if self.json.in_string || self.json.depth != 1 {
+                // Text inside a string, or a nested object's key.
+                self.pos = key + 1;
+                continue;
+            }
+            match parse_string_value(&data[key + b"\"model\"".len()..end]) {
+                Value::String(model) => {
+                    self.request.model = Some(model);
+                    self.phase = Phase::Done;
+                    return;
+                }
+                // Wait for the rest of the value; rescan from the key.
+                Value::Incomplete => {
+                    self.pos = key;
+                    return self.finish_if_exhausted(end, limit, eof);
+                }
+                Value::NotAValue => self.pos = key + 1,
+            }
+        }
+        // Keep a key-length tail so a key split across reads is still found.
+        self.pos = end.saturating_sub(b"\"model\"".len() - 1).max(self.pos);
+        self.json.advance(data, self.pos);
+        self.finish_if_exhausted(end, limit, eof);
+    }
+
+    fn finish_if_exhausted(&mut self, end: usize, limit: usize, eof: bool) {
+        if eof || end >= limit {
+            self.phase = Phase::Done;
+        }
+    }
+}
+
+enum Value {
+    String(String),
+    Incomplete,
+    /// The match was not an object key with a string value.
+    NotAValue,
+}
+
+/// Parse `: "<value>"` following a `"model"` key.
+fn parse_string_value(rest: &[u8]) -> Value {
+    let mut i = skip_ws(rest, 0);
+    match rest.get(i) {
+        None => return Value::Incomplete,
+        Some(b':') => i += 1,
+        Some(_) => return Value::NotAValue,
+    }
+    i = skip_ws(rest, i);
+    match rest.get(i) {
+        None => return Value::Incomplete,
+        Some(b'"') => i += 1,
+        Some(_) => return Value::NotAValue,
+    }
+    let value_start = i;
+    let mut escaped = false;
+    while let Some(off) = memchr2(b'"', b'\\', &rest[i..]) {
+        let at = i + off;
+        if rest[at] == b'\\' {
+            escaped = true;
+            i = at + 2;
+            if i > rest.len() {
+                return Value::Incomplete;
+            }
+            continue;
+        }
+        let raw = &rest[value_start..at];
+        let value = if escaped {
+            // Rare: let serde_json handle escape sequences.
+            match serde_json::from_slice::<String>(&rest[value_start - 1..=at]) {
+                Ok(v) => v,
+                Err(_) => return Value::NotAValue,
+            }
+        } else {
+            match std::str::from_utf8(raw) {
+                Ok(v) => v.to_string(),
+                Err(_) => return Value::NotAValue,
+            }
+        };
+        return Value::String(value);
+    }
+    Value::Incomplete
+}
+
+fn skip_ws(data: &[u8], mut i: usize) -> usize {
+    while matches!(data.get(i), Some(b' ' | b'\t' | b'\r' | b'\n')) {
+        i += 1;
+    }
+    i
+}
+
+fn trim_cr(line: &[u8]) -> &[u8] {
+    line.strip_suffix(b"\r").unwrap_or(line)
+}
+
+fn trim(data: &[u8]) -> &[u8] {
+    let start = data
+        .iter()
+        .position(|b| !b.is_ascii_whitespace())
+        .unwrap_or(data.len());
+    let end = data
+        .iter()
+        .rposition(|b| !b.is_ascii_whitespace())
+        .map_or(start, |p| p + 1);
+    &data[start..end]
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const REQUEST: &[u8] = b"POST /v1/chat/completions HTTP/1.1\r\n\
+Host: example\r\n\
+authorization: Bearer abc\r\n\
+Content-Type: application/json; charset=utf-8\r\n\
+Request-Id: r1\r\n\
+Content-Length: 64\r\n\
+\r\n\
+{\"messages\":[{\"content\":\"say \\\"model\\\"\"}], \"model\" : \"qwen\\/7b\"}";
+
+    #[test]
+    fn test_sniff_across_arbitrary_splits() {
+        for split in 1..REQUEST.len() {
+            let mut sniffer = RequestSniffer::new();
+            let mut result = sniffer.advance(&REQUEST[..split], false);
+            if result == Sniff::NeedMore {
+                result = sniffer.advance(REQUEST, false);
+            }
+            assert_eq!(result, Sniff::Done, "split at {}", split);
+            let req = sniffer.request();
+            assert_eq!(req.api_key.as_deref(), Some("abc"));
+            assert_eq!(req.request_id.as_deref(), Some("r1"));
+            assert_eq!(req.content_type.as_deref(), Some("application/json"));
+            assert_eq!(req.model.as_deref(), Some("qwen/7b"), "split at {}", split);
+        }
+    }
+
+    #[test]
+    fn test_sniff_stops_without_json_or_model() {
+        let mut sniffer = RequestSniffer::new();
+        let head = b"GET /v1/models HTTP/1.1\r\nAuthorization: Bearer k\r\n\r\n";
+        assert_eq!(sniffer.advance(head, false), Sniff::Done);
+        assert_eq!(sniffer.request().model, None);
+
+        let mut sniffer = RequestSniffer::new();
+        let req = b"POST / HTTP/1.1\r\nContent-Type: application/json\r\nContent-Length: 9\r\n\r\n{\"a\":\"b\"}";
+        assert_eq!(sniffer.advance(req, false), Sniff::Done);
+        assert_eq!(sniffer.request().model, None);
+
+        let mut sniffer = RequestSniffer::new();
+        assert_eq!(
+            sniffer.advance(b"POST / HTTP/1.1\r\nContent-Length: x\r\n", false),
+            Sniff::Invalid("Invalid Content-Length")
+        );
+    }
+
+    #[test]
+    fn test_sniff_ignores_nested_model_keys() {
+        let body = br#"{"metadata":{"model":"a"},"tools":[{"function":{"model":"b"}}],"note":"{\"model\":\"c\"}","model":"qwen"}"#;
+        let mut request = format!(
+            "POST / HTTP/1.1\r\nContent-Type: application/json\r\nContent-Length: {}\r\n\r\n",
+            body.len()
+        )
+        .into_bytes();
+        request.extend_from_slice(body);
+        for split in 1..request.len() {
+            let mut sniffer = RequestSniffer::new();
+            let mut result = sniffer.advance(&request[..split], false);
+            if result == Sniff::NeedMore {
+                result = sniffer.advance(&request, false);
+            }
+            assert_eq!(result, Sniff::Done, "split at {}", split);
+            assert_eq!(sniffer.request().model.as_deref(), Some("qwen"), "split at {}", split);
+        }
+    }
+}
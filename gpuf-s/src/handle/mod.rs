@@ -1,46 +1,165 @@
 pub mod handle_agent;
 pub mod handle_connections;
+pub mod http_sniff;
+pub mod model_index;
+pub mod model_seeds;
+pub mod proxy_pool;
+pub mod registry;
 
-use crate::db::{models::ClientModelClass, models::HotModelClass};
-use crate::inference::InferenceScheduler;
+use crate::db::{models::ClientModelClass, models::HotModelClass, token_cache::TokenCache};
+use crate::inference::{cluster::Cluster, InferenceScheduler};
 use crate::util::pack::BufferPool;
 use crate::util::{
     cmd, db,
+    kafka::{KafkaSink, ProducerSettings},
     protoc::{ClientId, ProxyConnId},
 };
 
 use anyhow::{anyhow, Result};
 use bytes::BytesMut;
 use chrono::{DateTime, Utc};
-use common::{join_streams, read_command, write_command, Command, CommandV1, DevicesInfo, Model};
+use common::{
+    read_command, write_command, write_commands, Command, CommandV1, DevicesInfo, Model,
+    ThrottleLevel,
+};
 use rdkafka::producer::FutureProducer;
-use rdkafka::producer::Producer;
 use redis::Client as RedisClient;
 use serde::{Deserialize, Serialize};
 use sqlx::{Pool, Postgres};
 use std::collections::HashMap;
+use std::sync::atomic::{AtomicU32, AtomicU8, Ordering};
 use std::sync::Arc;
 use tokio::net::{tcp::OwnedWriteHalf, TcpStream};
 use tokio::sync::Mutex;
 use tokio_rustls::rustls::pki_types::{CertificateDer, PrivateKeyDer};
 use tracing::{error, info};
 
+pub use registry::{DeviceLoad, DeviceRegistry, DeviceStats};
+
 pub type UserDb = Arc<Mutex<HashMap<String, User>>>;
 pub type TokenDb = Arc<Mutex<HashMap<String, String>>>;
-pub type ActiveClients = Arc<Mutex<HashMap<ClientId, ClientInfo>>>;
-pub type PendingConnections = Arc<Mutex<HashMap<ProxyConnId, (TcpStream, BytesMut)>>>;
+pub type ActiveClients = Arc<DeviceRegistry>;
+/// Public connections waiting for the chosen worker to dial in a proxy
+/// connection.
+pub type PendingConnections = Arc<Mutex<HashMap<ProxyConnId, (ClientId, TcpStream, BytesMut)>>>;
 
 pub struct ClientInfo {
     pub writer: Arc<Mutex<OwnedWriteHalf>>,
     pub authed: bool,
     #[allow(dead_code)] // Client protocol version
     pub version: u32,
-    pub system_info: Option<SystemInfo>,
     #[allow(dead_code)] // Connected devices information
     pub devices_info: Vec<DevicesInfo>,
     #[allow(dead_code)] // Connection timestamp
     pub connected_at: DateTime<Utc>,
-    pub models: Option<Vec<Model>>,
+    pub device_memsize: u32,
+    pub total_tflops: u32,
+    pub memsize_gb: u32,
+    pub load: DeviceLoad,
+    pub stats: DeviceStats,
+    models: std::sync::RwLock<Option<Arc<Vec<Model>>>>,
+    /// `n_ctx` from the device's ContextProfile; 0 until it reports one.
+    context_window: AtomicU32,
+    /// ThrottleLevel from the device's last DeviceState report.
+    throttle: AtomicU8,
+    /// Device inventory from the last heartbeat that carried one.
+    inventory: std::sync::Mutex<Option<Vec<DevicesInfo>>>,
+}
+
+impl ClientInfo {
+    pub fn new(
+        writer: Arc<Mutex<OwnedWriteHalf>>,
+        authed: bool,
+        version: u32,
+        system_info: &SystemInfo,
+        devices_info: Vec<DevicesInfo>,
+    ) -> Self {
+        Self {
+            writer,
+            authed,
+            version,
+            devices_info,
+            connected_at: Utc::now(),
+            device_memsize: system_info.device_memsize,
+            total_tflops: system_info.total_tflops,
+            memsize_gb: system_info.memsize_gb,
+            load: DeviceLoad::new(
+                system_info.cpu_usage,
+                system_info.memory_usage,
+                system_info.disk_usage,
+            ),
+            stats: DeviceStats::default(),
+            models: std::sync::RwLock::new(None),
+            context_window: AtomicU32::new(0),
+            throttle: AtomicU8::new(ThrottleLevel::Normal.as_u8()),
+            inventory: std::sync::Mutex::new(None),
+        }
+    }
+
+    /// Point-in-time copy of the device's capacity and load.
+    pub fn system_info(&self) -> SystemInfo {
+        SystemInfo {
+            cpu_usage: self.load.cpu_usage(),
+            memory_usage: self.load.memory_usage(),
+            disk_usage: self.load.disk_usage(),
+            device_memsize: self.device_memsize,
+            total_tflops: self.total_tflops,
+            last_heartbeat: self.load.last_heartbeat(),
+            memsize_gb: self.memsize_gb,
+        }
+    }
+
+    pub fn models(&self) -> Option<Arc<Vec<Model>>> {
+        self.models
+            .read()
+            .unwrap_or_else(|e| e.into_inner())
+            .clone()
+    }
+
+    pub fn set_context_window(&self, n_ctx: u32) {
+        self.context_window.store(n_ctx, Ordering::Relaxed);
+    }
+
+    pub fn context_window(&self) -> u32 {
+        self.context_window.load(Ordering::Relaxed)
+    }
+
+    /// Whether a request needing `tokens` of context fits this device.
+    /// Devices that never reported a profile are assumed to fit.
+    pub fn fits_context(&self, tokens: u32) -> bool {
+        let n_ctx = self.context_window();
+        n_ctx == 0 || n_ctx >= tokens
+    }
+
+    pub fn set_throttle(&self, level: ThrottleLevel) {
+        self.throttle.store(level.as_u8(), Ordering::Relaxed);
+    }
+
+    pub fn throttle(&self) -> ThrottleLevel {
+        ThrottleLevel::from_u8(self.throttle.load(Ordering::Relaxed))
+    }
+
+    /// Inventory for a heartbeat: `devices` if it carries one, otherwise the
+    /// last one seen, as clients with load beacons leave unchanged
+    /// inventories out.
+    pub fn heartbeat_inventory(&self, devices: Vec<DevicesInfo>) -> Vec<DevicesInfo> {
+        let mut last = self.inventory.lock().unwrap_or_else(|e| e.into_inner());
+        if devices.is_empty() {
+            return last.clone().unwrap_or_else(|| self.devices_info.clone());
+        }
+        *last = Some(devices.clone());
+        devices
+    }
+
+    /// Critical devices refuse new tasks until they cool down or charge.
+    pub fn accepts_tasks(&self) -> bool {
+        self.throttle() != ThrottleLevel::Critical
+    }
+
+    // Use DeviceRegistry::set_models so the model index stays in sync.
+    fn set_models(&self, models: Vec<Model>) {
+        *self.models.write().unwrap_or_else(|e| e.into_inner()) = Some(Arc::new(models));
+    }
 }
 
 pub struct User {
@@ -93,19 +212,25 @@ pub struct ServerState {
     pub db_pool: Arc<Pool<Postgres>>,
     #[allow(dead_code)] // Redis client
     pub redis_client: Arc<RedisClient>,
-    #[allow(dead_code)] // Kafka producer
-    pub producer: Arc<FutureProducer>,
+    /// Heartbeats and request metrics bound for Kafka.
+    pub kafka: Arc<KafkaSink>,
     pub inference_scheduler: Arc<InferenceScheduler>,
     pub client_model: Arc<ClientModelClass>,
     pub hot_models: Arc<HotModelClass>,
     pub cert_chain: Arc<Vec<CertificateDer<'static>>>,
     pub priv_key: Arc<PrivateKeyDer<'static>>,
     pub buffer_pool: Arc<BufferPool>,
+    /// Large buffers lent to proxied connections for the duration of a relay.
+    pub relay_buffers: Arc<BufferPool>,
+    pub token_cache: Arc<TokenCache>,
+    pub model_seeds: Arc<model_seeds::ModelSeeds>,
+    /// Idle worker proxy connections ready for the next request.
+    pub proxy_pool: Arc<proxy_pool::ProxyPool>,
 }
 
 impl Drop for ServerState {
     fn drop(&mut self) {
-        if let Err(e) = self.producer.flush(std::time::Duration::from_secs(1)) {
+        if let Err(e) = self.kafka.flush(std::time::Duration::from_secs(1)) {
             error!("Failed to flush Kafka producer: {:?}", e);
         }
         info!("ServerState is being dropped, resources cleaned up");
@@ -146,9 +271,20 @@ pub async fn new_server_state(args: &cmd::Args) -> Result<ServerState, anyhow::E
         Arc<Pool<Postgres>>,
         Arc<RedisClient>,
         Arc<FutureProducer>,
-    ) = db::init_db(&args.bootstrap_server, &args.database_url, &args.redis_url).await?;
+    ) = db::init_db(
+        &args.bootstrap_server,
+        &args.database_url,
+        &args.redis_url,
+        &ProducerSettings {
+            linger_ms: args.kafka_linger_ms,
+            batch_bytes: args.kafka_batch_bytes,
+            compression: args.kafka_compression.clone(),
+        },
+    )
+    .await?;
+    let kafka = KafkaSink::start(producer, args.kafka_queue_capacity);
 
-    let active_clients = Arc::new(Mutex::new(HashMap::new()));
+    let active_clients = Arc::new(DeviceRegistry::new());
     let pending_connections = Arc::new(Mutex::new(HashMap::new()));
     let user_db = Arc::new(Mutex::new(HashMap::<String, User>::new()));
     let token_db = Arc::new(Mutex::new(HashMap::new()));
@@ -157,8 +293,49 @@ pub async fn new_server_state(args: &cmd::Args) -> Result<ServerState, anyhow::E
     let cert_chain = crate::util::load_certs(&args.proxy_cert_chain_path)?;
     let priv_key = crate::util::load_private_key(&args.proxy_private_key_path)?;
 
+    let hot_models = Arc::new(HotModelClass::new(db_pool.clone()));
+    let client_model = Arc::new(ClientModelClass::new(db_pool.clone()));
+    tokio::spawn(crate::db::models::listen_for_model_invalidations(
+        redis_client.clone(),
+        hot_models.clone(),
+        client_model.clone(),
+    ));
+    let token_cache = Arc::new(TokenCache::default());
+    tokio::spawn(
+        token_cache
+            .clone()
+            .listen_for_invalidations(redis_client.clone()),
+    );
+
+    let cluster = match args.cluster_port {
+        Some(_) => {
+            let advertise = args
+                .cluster_advertise
+                .clone()
+                .ok_or_else(|| anyhow!("--cluster-advertise is required with --cluster-port"))?;
+            // Any peer holding the secret can run tasks on this node's devices
+            // without an API key, so an open cluster port is never allowed.
+            if args.cluster_secret.is_empty() {
+                return Err(anyhow!("--cluster-secret is required with --cluster-port"));
+            }
+            let node_id = args
+                .node_id
+                .clone()
+                .unwrap_or_else(|| uuid::Uuid::new_v4().to_string());
+            Some(Arc::new(Cluster::new(
+                node_id,
+                advertise,
+                args.cluster_secret.clone(),
+                redis_client.clone(),
+                std::time::Duration::from_secs(args.cluster_publish_secs),
+            )))
+        }
+        None => None,
+    };
+
     // Initialize inference scheduler
-    let inference_scheduler = Arc::new(InferenceScheduler::new(active_clients.clone()));
+    let inference_scheduler =
+        Arc::new(InferenceScheduler::new(active_clients.clone()).with_cluster(cluster));
 
     let app_state = ServerState {
         active_clients: active_clients.clone(),
@@ -174,13 +351,17 @@ pub async fn new_server_state(args: &cmd::Args) -> Result<ServerState, anyhow::E
             api_port: args.api_port,
         },
         buffer_pool: Arc::new(BufferPool::new(8 * 1024, 16)),
+        relay_buffers: Arc::new(BufferPool::new(common::relay::RELAY_BUFFER_SIZE, 32)),
+        token_cache,
+        model_seeds: Arc::new(model_seeds::ModelSeeds::default()),
+        proxy_pool: Arc::new(proxy_pool::ProxyPool::new(args.proxy_warm_conns)),
         db_pool: db_pool.clone(),
         redis_client: redis_client.clone(),
-        producer: producer.clone(),
+        kafka,
         cert_chain: cert_chain.into(),
         priv_key: Arc::new(priv_key),
-        hot_models: Arc::new(HotModelClass::new(db_pool.clone())),
-        client_model: Arc::new(ClientModelClass::new(db_pool.clone())),
+        hot_models,
+        client_model,
         inference_scheduler,
     };
     // If monitor flag is set, just print monitoring data and exit
@@ -191,8 +372,7 @@ pub async fn new_server_state(args: &cmd::Args) -> Result<ServerState, anyhow::E
 }
 
 pub async fn print_monitoring_data(active_clients: ActiveClients) {
-    let clients = active_clients.lock().await;
-    if clients.is_empty() {
+    if active_clients.is_empty() {
         println!("No active clients.");
         return;
     }
@@ -204,28 +384,22 @@ pub async fn print_monitoring_data(active_clients: ActiveClients) {
     );
     println!("{}", "-".repeat(80));
 
-    for (client_id, client_info) in clients.iter() {
-        if let Some(sys_info) = &client_info.system_info {
-            let duration = sys_info
-                .last_heartbeat
-                .elapsed()
-                .unwrap_or(std::time::Duration::from_secs(0));
-            let seconds = duration.as_secs();
-            println!(
-                "{:<20} {:<10.2} {:<10.2} {:<10.2} {:<20}",
-                client_id,
-                sys_info.cpu_usage,
-                sys_info.memory_usage,
-                sys_info.disk_usage,
-                format!("{}s ago", seconds)
-            );
-        } else {
-            println!(
-                "{:<20} {:<10} {:<10} {:<10} {:<20}",
-                client_id, "N/A", "N/A", "N/A", "No data"
-            );
-        }
-    }
+    active_clients.for_each(|client_id, client_info| {
+        let sys_info = client_info.system_info();
+        let duration = sys_info
+            .last_heartbeat
+            .elapsed()
+            .unwrap_or(std::time::Duration::from_secs(0));
+        let seconds = duration.as_secs();
+        println!(
+            "{:<20} {:<10.2} {:<10.2} {:<10.2} {:<20}",
+            client_id,
+            sys_info.cpu_usage,
+            sys_info.memory_usage,
+            sys_info.disk_usage,
+            format!("{}s ago", seconds)
+        );
+    });
 }
 
 // Response structure
@@ -0,0 +1,265 @@
+//! Secondary index from model id to the devices serving it, ordered by load.
+//!
+//! Each model keeps its devices in a `BTreeSet<(load, ClientId)>`, so picking
+//! the least-loaded device is O(log n) and a heartbeat repositions a device in
+//! O(log n) per served model. Every model has its own lock; the outer map is
+//! only write-locked when a model id is seen for the first time.
+
+use crate::util::protoc::ClientId;
+
+use std::collections::{BTreeSet, HashMap, HashSet};
+use std::sync::{Arc, RwLock};
+
+#[derive(Default)]
+struct ModelDevices {
+    by_load: BTreeSet<(u16, ClientId)>,
+    load_of: HashMap<ClientId, u16>,
+}
+
+impl ModelDevices {
+    fn upsert(&mut self, id: ClientId, load: u16) {
+        if let Some(old) = self.load_of.insert(id, load) {
+            self.by_load.remove(&(old, id));
+        }
+        self.by_load.insert((load, id));
+    }
+
+    fn remove(&mut self, id: &ClientId) {
+        if let Some(old) = self.load_of.remove(id) {
+            self.by_load.remove(&(old, *id));
+        }
+    }
+
+    /// `keep` is asked in load order and before the limit applies, so
+    /// ineligible devices never take a slot.
+    fn candidates(
+        &self,
+        allowed: Option<&[ClientId]>,
+        limit: usize,
+        mut keep: impl FnMut(&ClientId) -> bool,
+    ) -> Vec<ClientId> {
+        match allowed {
+            None => self
+                .by_load
+                .iter()
+                .map(|(_, id)| *id)
+                .filter(|id| keep(id))
+                .take(limit)
+                .collect(),
+            // Small allow-lists: probe each id directly.
+            Some(allowed) if allowed.len() < self.load_of.len() => {
+                let mut found: Vec<(u16, ClientId)> = allowed
+                    .iter()
+                    .filter_map(|id| self.load_of.get(id).map(|load| (*load, *id)))
+                    .collect();
+                found.sort_unstable();
+                found.dedup();
+                found
+                    .into_iter()
+                    .map(|(_, id)| id)
+                    .filter(|id| keep(id))
+                    .take(limit)
+                    .collect()
+            }
+            // Otherwise walk in load order and stop once enough are allowed.
+            Some(allowed) => {
+                let allowed: HashSet<&ClientId> = allowed.iter().collect();
+                self.by_load
+                    .iter()
+                    .map(|(_, id)| *id)
+                    .filter(|id| allowed.contains(id) && keep(id))
+                    .take(limit)
+                    .collect()
+            }
+        }
+    }
+}
+
+#[derive(Default)]
+pub struct ModelIndex {
+    models: RwLock<HashMap<String, Arc<RwLock<ModelDevices>>>>,
+}
+
+impl ModelIndex {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    fn entry(&self, model_id: &str) -> Arc<RwLock<ModelDevices>> {
+        if let Some(devices) = self
+            .models
+            .read()
+            .unwrap_or_else(|e| e.into_inner())
+            .get(model_id)
+        {
+            return devices.clone();
+        }
+        self.models
+            .write()
+            .unwrap_or_else(|e| e.into_inner())
+            .entry(model_id.to_string())
+            .or_default()
+            .clone()
+    }
+
+    fn existing(&self, model_id: &str) -> Option<Arc<RwLock<ModelDevices>>> {
+        self.models
+            .read()
+            .unwrap_or_else(|e| e.into_inner())
+            .get(model_id)
+            .cloned()
+    }
+
+    /// Replace the set of models `id` serves.
+    pub fn set_models<'a>(
+        &self,
+        id: ClientId,
+        old: impl IntoIterator<Item = &'a str>,
+        new: &[&str],
+        load: u16,
+    ) {
+        for model_id in old {
+            if !new.contains(&model_id) {
+                self.remove_from(model_id, &id);
+            }
+        }
+        for model_id in new {
+            self.entry(model_id)
+                .write()
+                .unwrap_or_else(|e| e.into_inner())
+                .upsert(id, load);
+        }
+    }
+
+    /// Reposition `id` under every model it serves after a load change.
+    pub fn update_load<'a>(
+        &self,
+        id: ClientId,
+        models: impl IntoIterator<Item = &'a str>,
+        load: u16,
+    ) {
+        for model_id in models {
+            if let Some(devices) = self.existing(model_id) {
+                devices
+                    .write()
+                    .unwrap_or_else(|e| e.into_inner())
+                    .upsert(id, load);
+            }
+        }
+    }
+
+    pub fn remove<'a>(&self, id: &ClientId, models: impl IntoIterator<Item = &'a str>) {
+        for model_id in models {
+            self.remove_from(model_id, id);
+        }
+    }
+
+    fn remove_from(&self, model_id: &str, id: &ClientId) {
+        if let Some(devices) = self.existing(model_id) {
+            devices
+                .write()
+                .unwrap_or_else(|e| e.into_inner())
+                .remove(id);
+        }
+    }
+
+    /// Least-loaded device serving `model_id`, optionally restricted to `allowed`.
+    pub fn best(&self, model_id: &str, allowed: Option<&[ClientId]>) -> Option<ClientId> {
+        self.candidates(model_id, allowed, 1, |_| true).pop()
+    }
+
+    /// Up to `limit` devices serving `model_id` that pass `keep`, least
+    /// loaded first.
+    pub fn candidates(
+        &self,
+        model_id: &str,
+        allowed: Option<&[ClientId]>,
+        limit: usize,
+        keep: impl FnMut(&ClientId) -> bool,
+    ) -> Vec<ClientId> {
+        match self.existing(model_id) {
+            Some(devices) => devices
+                .read()
+                .unwrap_or_else(|e| e.into_inner())
+                .candidates(allowed, limit, keep),
+            None => Vec::new(),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn id(n: u8) -> ClientId {
+        ClientId([n; 16])
+    }
+
+    #[test]
+    fn test_best_tracks_load_updates() {
+        let index = ModelIndex::new();
+        index.set_models(id(1), [], &["llama"], 50);
+        index.set_models(id(2), [], &["llama", "qwen"], 80);
+        assert_eq!(index.best("llama", None), Some(id(1)));
+
+        index.update_load(id(2), ["llama", "qwen"], 10);
+        assert_eq!(index.best("llama", None), Some(id(2)));
+        assert_eq!(index.best("qwen", None), Some(id(2)));
+        assert_eq!(index.best("mistral", None), None);
+    }
+
+    #[test]
+    fn test_best_respects_allowed_ids() {
+        let index = ModelIndex::new();
+        for n in 1..=4 {
+            index.set_models(id(n), [], &["llama"], n as u16 * 10);
+        }
+        assert_eq!(index.best("llama", Some(&[id(3), id(4)])), Some(id(3)));
+        let wide: Vec<ClientId> = (2..=9).map(id).collect();
+        assert_eq!(index.best("llama", Some(&wide)), Some(id(2)));
+        assert_eq!(index.best("llama", Some(&[id(9)])), None);
+        assert_eq!(
+            index.candidates("llama", Some(&[id(4), id(1), id(4)]), 8, |_| true),
+            vec![id(1), id(4)]
+        );
+        assert_eq!(
+            index.candidates("llama", None, 2, |_| true),
+            vec![id(1), id(2)]
+        );
+    }
+
+    #[test]
+    fn test_candidates_filter_before_limit() {
+        let index = ModelIndex::new();
+        for n in 1..=6 {
+            index.set_models(id(n), [], &["llama"], n as u16);
+        }
+        // The least-loaded devices refuse work; the limit covers the rest.
+        let eligible = |c: &ClientId| c.0[0] > 3;
+        assert_eq!(
+            index.candidates("llama", None, 2, eligible),
+            vec![id(4), id(5)]
+        );
+        let wide: Vec<ClientId> = (1..=9).map(id).collect();
+        assert_eq!(
+            index.candidates("llama", Some(&wide), 2, eligible),
+            vec![id(4), id(5)]
+        );
+        assert_eq!(
+            index.candidates("llama", Some(&[id(6), id(2), id(5)]), 1, eligible),
+            vec![id(5)]
+        );
+    }
+
+    #[test]
+    fn test_set_models_and_remove() {
+        let index = ModelIndex::new();
+        index.set_models(id(1), [], &["llama", "qwen"], 10);
+        index.set_models(id(1), ["llama", "qwen"], &["qwen"], 10);
+        assert_eq!(index.best("llama", None), None);
+        assert_eq!(index.best("qwen", None), Some(id(1)));
+
+        index.remove(&id(1), ["qwen"]);
+        assert_eq!(index.best("qwen", None), None);
+    }
+}
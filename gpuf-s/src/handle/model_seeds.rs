@@ -0,0 +1,307 @@
+//! Which workers can serve which pieces of a model file.
+//!
+//! Workers advertise the pieces they hold with `ModelPiecesAvailable`; before
+//! telling a worker to pull a model the server sends it `ModelPeers`, and the
+//! worker fetches pieces straight from those peers, falling back to the
+//! origin URL for anything they cannot serve.
+//!
+//! Piece hashes are accepted only from workers whose copy passed the
+//! whole-file checksum. If advertised lists disagree the one backed by the
+//! most seeds is handed out, and only peers consistent with it are listed.
+
+use crate::util::protoc::ClientId;
+
+use anyhow::{anyhow, Result};
+use common::ModelPeer;
+use std::collections::HashMap;
+use std::net::IpAddr;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, RwLock};
+
+/// Peers listed per `ModelPeers`.
+const MAX_PEERS: usize = 16;
+const MAX_SEED_ADDRS: usize = 8;
+const MAX_ADDR_LEN: usize = 128;
+const MIN_PIECE_SIZE: u32 = 64 * 1024;
+const MAX_PIECES: u64 = 1 << 20;
+
+type PieceHashes = Arc<Vec<[u8; 32]>>;
+
+struct Seed {
+    addrs: Vec<String>,
+    have: Vec<u8>,
+    public_ip: IpAddr,
+    /// Set for complete seeds.
+    hashes: Option<PieceHashes>,
+}
+
+struct SeedSet {
+    total_size: u64,
+    piece_size: u32,
+    seeds: HashMap<ClientId, Seed>,
+}
+
+impl SeedSet {
+    /// The hash list vouched for by the most complete seeds.
+    fn piece_hashes(&self) -> Option<PieceHashes> {
+        let mut votes: HashMap<&PieceHashes, usize> = HashMap::new();
+        for hashes in self.seeds.values().filter_map(|seed| seed.hashes.as_ref()) {
+            *votes.entry(hashes).or_default() += 1;
+        }
+        votes
+            .into_iter()
+            .max_by_key(|(_, count)| *count)
+            .map(|(hashes, _)| hashes.clone())
+    }
+}
+
+/// What a worker needs to fetch a model from its peers.
+pub struct ModelPeerList {
+    pub total_size: u64,
+    pub piece_size: u32,
+    pub piece_hashes: Vec<[u8; 32]>,
+    pub peers: Vec<ModelPeer>,
+}
+
+#[derive(Default)]
+pub struct ModelSeeds {
+    models: RwLock<HashMap<String, SeedSet>>,
+    /// Rotates each listing so requests are spread across seeds.
+    cursor: AtomicUsize,
+}
+
+impl ModelSeeds {
+    /// Record what `client_id` holds of the model with `checksum`, replacing
+    /// its previous advertisement. An empty `have` withdraws it.
+    pub fn advertise(
+        &self,
+        client_id: ClientId,
+        public_ip: IpAddr,
+        checksum: &str,
+        total_size: u64,
+        piece_size: u32,
+        have: Vec<u8>,
+        piece_hashes: Vec<[u8; 32]>,
+        seed_port: u16,
+        seed_addrs: Vec<String>,
+    ) -> Result<()> {
+        if checksum.is_empty() || checksum.len() > MAX_ADDR_LEN {
+            return Err(anyhow!("Invalid model checksum"));
+        }
+        if piece_size < MIN_PIECE_SIZE || total_size == 0 {
+            return Err(anyhow!("Invalid piece size"));
+        }
+        let pieces = total_size.div_ceil(piece_size as u64);
+        if pieces > MAX_PIECES {
+            return Err(anyhow!("Too many pieces"));
+        }
+        if !have.is_empty() && have.len() as u64 != pieces.div_ceil(8) {
+            return Err(anyhow!("Piece bitmap does not match the file size"));
+        }
+        if !piece_hashes.is_empty() && piece_hashes.len() as u64 != pieces {
+            return Err(anyhow!("Piece hash count does not match the file size"));
+        }
+        if seed_addrs.len() > MAX_SEED_ADDRS || seed_addrs.iter().any(|a| a.len() > MAX_ADDR_LEN) {
+            return Err(anyhow!("Too many or too long seed addresses"));
+        }
+
+        let mut models = self.models.write().unwrap_or_else(|e| e.into_inner());
+        if have.is_empty() || seed_port == 0 || have.iter().all(|b| *b == 0) {
+            if let Some(set) = models.get_mut(checksum) {
+                set.seeds.remove(&client_id);
+                if set.seeds.is_empty() {
+                    models.remove(checksum);
+                }
+            }
+            return Ok(());
+        }
+
+        let set = models
+            .entry(checksum.to_string())
+            .or_insert_with(|| SeedSet {
+                total_size,
+                piece_size,
+                seeds: HashMap::new(),
+            });
+        if set.total_size != total_size || set.piece_size != piece_size {
+            return Err(anyhow!("Model layout differs from existing seeds"));
+        }
+
+        // Seeds with the same list share one copy.
+        let hashes = (!piece_hashes.is_empty()).then(|| {
+            set.seeds
+                .values()
+                .filter_map(|seed| seed.hashes.as_ref())
+                .find(|hashes| hashes.as_slice() == piece_hashes.as_slice())
+                .cloned()
+                .unwrap_or_else(|| Arc::new(piece_hashes))
+        });
+        let mut addrs = seed_addrs;
+        // Reachable from outside the worker's network if its port is mapped.
+        let public = std::net::SocketAddr::new(public_ip, seed_port).to_string();
+        if !addrs.contains(&public) {
+            addrs.push(public);
+        }
+        set.seeds.insert(
+            client_id,
+            Seed {
+                addrs,
+                have,
+                public_ip,
+                hashes,
+            },
+        );
+        Ok(())
+    }
+
+    /// Peers `client_id` (connecting from `public_ip`) can fetch `checksum`
+    /// from. Peers behind the same public address, likely on the same LAN,
+    /// come first.
+    pub fn peers_for(
+        &self,
+        checksum: &str,
+        client_id: &ClientId,
+        public_ip: IpAddr,
+    ) -> Option<ModelPeerList> {
+        let models = self.models.read().unwrap_or_else(|e| e.into_inner());
+        let set = models.get(checksum)?;
+        // Without a vouched hash list pieces cannot be verified.
+        let piece_hashes = set.piece_hashes()?;
+
+        let mut candidates: Vec<(&ClientId, &Seed)> = set
+            .seeds
+            .iter()
+            .filter(|(id, seed)| {
+                *id != client_id
+                    && seed
+                        .hashes
+                        .as_ref()
+                        .map_or(true, |hashes| *hashes == piece_hashes)
+            })
+            .collect();
+        if candidates.is_empty() {
+            return None;
+        }
+        let offset = self.cursor.fetch_add(1, Ordering::Relaxed) % candidates.len();
+        candidates.rotate_left(offset);
+        candidates.sort_by_key(|(_, seed)| seed.public_ip != public_ip);
+
+        Some(ModelPeerList {
+            total_size: set.total_size,
+            piece_size: set.piece_size,
+            piece_hashes: piece_hashes.to_vec(),
+            peers: candidates
+                .into_iter()
+                .take(MAX_PEERS)
+                .map(|(id, seed)| ModelPeer {
+                    client_id: id.0,
+                    addrs: seed.addrs.clone(),
+                    have: seed.have.clone(),
+                })
+                .collect(),
+        })
+    }
+
+    /// Forget everything `client_id` advertised, e.g. when it disconnects.
+    pub fn remove_client(&self, client_id: &ClientId) {
+        let mut models = self.models.write().unwrap_or_else(|e| e.into_inner());
+        models.retain(|_, set| {
+            set.seeds.remove(client_id);
+            !set.seeds.is_empty()
+        });
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const MB: u32 = 1024 * 1024;
+
+    fn ip(last: u8) -> IpAddr {
+        IpAddr::from([10, 0, 0, last])
+    }
+
+    #[test]
+    fn test_peers_follow_majority_hashes() {
+        let seeds = ModelSeeds::default();
+        let (a, b, c, d) = (
+            ClientId([1; 16]),
+            ClientId([2; 16]),
+            ClientId([3; 16]),
+            ClientId([4; 16]),
+        );
+        let size = 3 * MB as u64;
+        let good = vec![[7u8; 32]; 3];
+        let bad = vec![[9u8; 32]; 3];
+        seeds
+            .advertise(
+                a,
+                ip(1),
+                "sum",
+                size,
+                MB,
+                vec![0b111],
+                good.clone(),
+                40001,
+                vec![],
+            )
+            .unwrap();
+        seeds
+            .advertise(
+                b,
+                ip(2),
+                "sum",
+                size,
+                MB,
+                vec![0b111],
+                good.clone(),
+                40001,
+                vec![],
+            )
+            .unwrap();
+        seeds
+            .advertise(c, ip(3), "sum", size, MB, vec![0b111], bad, 40001, vec![])
+            .unwrap();
+        // Still downloading: no hashes of its own.
+        seeds
+            .advertise(
+                d,
+                ip(9),
+                "sum",
+                size,
+                MB,
+                vec![0b001],
+                vec![],
+                40001,
+                vec![],
+            )
+            .unwrap();
+
+        let list = seeds.peers_for("sum", &d, ip(2)).unwrap();
+        assert_eq!(list.piece_hashes, good);
+        let ids: Vec<[u8; 16]> = list.peers.iter().map(|p| p.client_id).collect();
+        assert_eq!(ids.len(), 2);
+        assert_eq!(ids[0], b.0, "same public address first");
+        assert!(!ids.contains(&c.0));
+        assert_eq!(list.peers[0].addrs, vec!["10.0.0.2:40001".to_string()]);
+
+        assert!(seeds
+            .advertise(
+                a,
+                ip(1),
+                "sum",
+                size,
+                MB,
+                vec![0b111, 0],
+                vec![],
+                40001,
+                vec![]
+            )
+            .is_err());
+
+        seeds.remove_client(&a);
+        seeds.remove_client(&b);
+        assert!(seeds.peers_for("sum", &d, ip(2)).unwrap().peers[0].client_id == c.0);
+    }
+}
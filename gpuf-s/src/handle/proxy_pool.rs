@@ -0,0 +1,198 @@
+//! Proxy connections opened ahead of requests.
+//!
+//! Routing a public request used to send `RequestNewProxyConn` and park the
+//! request until the worker had dialled the proxy port and finished a TLS
+//! handshake, two to three round trips before the first byte reached it.
+//! Once a worker has answered one such request, the server keeps a few more
+//! of its proxy connections open and idle, and the next request for it is
+//! written to one of them at once. Workers only connect to their local
+//! service when a request's first bytes arrive, so an idle connection costs
+//! them a socket. Idle connections are recycled after [`IDLE_TTL`], before
+//! mobile NATs forget them.
+
+use crate::util::protoc::{ClientId, ProxyConnId};
+
+use bytes::BytesMut;
+use std::collections::HashMap;
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+use tokio::net::TcpStream;
+use tokio::sync::oneshot;
+use uuid::Uuid;
+
+/// How long an idle proxy connection is kept. Workers wait somewhat longer
+/// before giving up on one, so the server is always the side that closes.
+pub const IDLE_TTL: Duration = Duration::from_secs(120);
+/// Connections that close sooner than this are not replaced, so a worker
+/// that cannot hold an idle connection falls back to per-request ones
+/// instead of reconnecting in a loop.
+pub const MIN_IDLE_LIFETIME: Duration = Duration::from_secs(10);
+/// Requested connections that have not arrived by now are written off.
+const ARRIVAL_TIMEOUT: Duration = Duration::from_secs(30);
+
+/// A public connection and the request bytes already read from it.
+pub type UserConn = (TcpStream, BytesMut);
+/// A worker's connection to the proxy port.
+pub type ProxyStream = tokio_rustls::server::TlsStream<TcpStream>;
+
+struct Slot {
+    id: ProxyConnId,
+    tx: oneshot::Sender<UserConn>,
+}
+
+#[derive(Default)]
+struct Inner {
+    /// Ids sent to workers for connections that should be parked.
+    expected: HashMap<ProxyConnId, (ClientId, Instant)>,
+    idle: HashMap<ClientId, Vec<Slot>>,
+}
+
+pub struct ProxyPool {
+    /// Idle connections kept per worker; 0 disables the pool.
+    target: usize,
+    inner: Mutex<Inner>,
+}
+
+impl ProxyPool {
+    pub fn new(target: usize) -> Self {
+        Self {
+            target,
+            inner: Mutex::new(Inner::default()),
+        }
+    }
+
+    fn lock(&self) -> std::sync::MutexGuard<'_, Inner> {
+        self.inner.lock().unwrap_or_else(|e| e.into_inner())
+    }
+
+    /// Ids to request from `client_id` to bring its pool back to target,
+    /// counting connections already on their way.
+    pub fn want(&self, client_id: ClientId) -> Vec<ProxyConnId> {
+        let mut inner = self.lock();
+        let now = Instant::now();
+        inner
+            .expected
+            .retain(|_, (_, at)| now.duration_since(*at) < ARRIVAL_TIMEOUT);
+        let idle = inner.idle.get(&client_id).map_or(0, Vec::len);
+        let coming = inner
+            .expected
+            .values()
+            .filter(|(id, _)| *id == client_id)
+            .count();
+        let ids: Vec<ProxyConnId> = (idle + coming..self.target)
+            .map(|_| ProxyConnId(*Uuid::new_v4().as_bytes()))
+            .collect();
+        for id in &ids {
+            inner.expected.insert(*id, (client_id, now));
+        }
+        ids
+    }
+
+    /// A worker dialled in with `id`; the worker it was requested from, if
+    /// it was requested for the pool.
+    pub fn arrived(&self, id: ProxyConnId) -> Option<ClientId> {
+        self.lock()
+            .expected
+            .remove(&id)
+            .map(|(client_id, _)| client_id)
+    }
+
+    /// Offer connection `id` of `client_id` for the next request routed to
+    /// that worker.
+    pub fn park(&self, client_id: ClientId, id: ProxyConnId) -> oneshot::Receiver<UserConn> {
+        let (tx, rx) = oneshot::channel();
+        self.lock()
+            .idle
+            .entry(client_id)
+            .or_default()
+            .push(Slot { id, tx });
+        rx
+    }
+
+    /// Withdraw connection `id`. False if a request was already handed to
+    /// it, in which case its receiver holds that request.
+    pub fn unpark(&self, client_id: ClientId, id: ProxyConnId) -> bool {
+        let mut inner = self.lock();
+        let Some(slots) = inner.idle.get_mut(&client_id) else {
+            return false;
+        };
+        let before = slots.len();
+        slots.retain(|slot| slot.id != id);
+        let removed = slots.len() < before;
+        if slots.is_empty() {
+            inner.idle.remove(&client_id);
+        }
+        removed
+    }
+
+    /// Hand `conn` to an idle connection of `client_id`, or give it back if
+    /// there is none.
+    pub fn take(&self, client_id: ClientId, mut conn: UserConn) -> Result<ProxyConnId, UserConn> {
+        let mut inner = self.lock();
+        let Some(slots) = inner.idle.get_mut(&client_id) else {
+            return Err(conn);
+        };
+        // Most recently parked first; those are the least likely to have
+        // been dropped by a middlebox.
+        while let Some(slot) = slots.pop() {
+            match slot.tx.send(conn) {
+                Ok(()) => return Ok(slot.id),
+                Err(back) => conn = back,
+            }
+        }
+        inner.idle.remove(&client_id);
+        Err(conn)
+    }
+
+    /// Drop everything held for a worker that disconnected.
+    pub fn forget(&self, client_id: &ClientId) {
+        let mut inner = self.lock();
+        inner.idle.remove(client_id);
+        inner.expected.retain(|_, (id, _)| id != client_id);
+    }
+
+    pub fn idle_count(&self) -> usize {
+        self.lock().idle.values().map(Vec::len).sum()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use tokio::net::TcpListener;
+
+    #[tokio::test]
+    async fn test_take_uses_parked_connection() {
+        let listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+        let user = TcpStream::connect(listener.local_addr().unwrap())
+            .await
+            .unwrap();
+        let pool = ProxyPool::new(2);
+        let worker = ClientId([1; 16]);
+
+        let ids = pool.want(worker);
+        assert_eq!(ids.len(), 2);
+        assert!(pool.want(worker).is_empty());
+        assert_eq!(pool.arrived(ids[0]), Some(worker));
+        assert_eq!(pool.arrived(ids[0]), None);
+
+        // A dead slot is skipped; the request lands on the live one.
+        let mut rx = pool.park(worker, ids[1]);
+        drop(pool.park(worker, ids[0]));
+        let conn = pool
+            .take(ClientId([2; 16]), (user, BytesMut::new()))
+            .unwrap_err();
+        let conn = match pool.take(worker, conn) {
+            Ok(id) => {
+                assert_eq!(id, ids[1]);
+                rx.try_recv().unwrap()
+            }
+            Err(_) => panic!("parked connection not used"),
+        };
+        assert!(!pool.unpark(worker, ids[1]));
+        assert!(pool.take(worker, conn).is_err());
+        assert_eq!(pool.idle_count(), 0);
+        // One connection is still expected, so only one more is asked for.
+        assert_eq!(pool.want(worker).len(), 1);
+    }
+}
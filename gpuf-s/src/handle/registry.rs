@@ -0,0 +1,391 @@
+//! Concurrent registry of connected devices.
+//!
+//! The registry is split into independently locked shards, so logins and
+//! disconnects only contend with clients hashed to the same shard. Entries are
+//! `Arc<ClientInfo>`: readers clone the handle out of a shard and drop the shard
+//! lock before doing any async work. Per-client load figures live in atomics
+//! (see [`DeviceLoad`]), so heartbeats update them through a shared reference
+//! and routing reads never wait on heartbeat writes.
+//!
+//! Authenticated devices are also indexed by the models they report (see
+//! [`ModelIndex`]), so model routing does not scan the registry. Keep model
+//! and load changes flowing through [`DeviceRegistry::set_models`] and
+//! [`DeviceRegistry::update_load`] so the index stays in sync.
+//!
+//! Logins and model changes are announced on [`DeviceRegistry::changed`], so
+//! requests queued for admission are retried as soon as a device might fit.
+
+use super::model_index::ModelIndex;
+use super::ClientInfo;
+use crate::util::protoc::ClientId;
+use common::{LoadDelta, Model};
+
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicU32, AtomicU64, AtomicU8, AtomicUsize, Ordering};
+use std::sync::{Arc, RwLock, RwLockReadGuard, RwLockWriteGuard};
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+use tokio::sync::Notify;
+
+const SHARD_COUNT: usize = 64;
+
+type Shard = RwLock<HashMap<ClientId, Arc<ClientInfo>>>;
+
+pub struct DeviceRegistry {
+    shards: Box<[Shard]>,
+    len: AtomicUsize,
+    index: ModelIndex,
+    changed: Notify,
+}
+
+impl Default for DeviceRegistry {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl DeviceRegistry {
+    pub fn new() -> Self {
+        let shards = (0..SHARD_COUNT)
+            .map(|_| RwLock::new(HashMap::new()))
+            .collect::<Vec<_>>()
+            .into_boxed_slice();
+        Self {
+            shards,
+            len: AtomicUsize::new(0),
+            index: ModelIndex::new(),
+            changed: Notify::new(),
+        }
+    }
+
+    fn shard(&self, id: &ClientId) -> &Shard {
+        // Client ids are random 128-bit values, so the low bytes spread evenly.
+        let h = u64::from_le_bytes(id.0[..8].try_into().unwrap());
+        &self.shards[(h as usize) % self.shards.len()]
+    }
+
+    // Shard critical sections never panic while mutating, so a poisoned lock
+    // still guards a consistent map.
+    fn read(shard: &Shard) -> RwLockReadGuard<'_, HashMap<ClientId, Arc<ClientInfo>>> {
+        shard.read().unwrap_or_else(|e| e.into_inner())
+    }
+
+    fn write(shard: &Shard) -> RwLockWriteGuard<'_, HashMap<ClientId, Arc<ClientInfo>>> {
+        shard.write().unwrap_or_else(|e| e.into_inner())
+    }
+
+    pub fn get(&self, id: &ClientId) -> Option<Arc<ClientInfo>> {
+        Self::read(self.shard(id)).get(id).cloned()
+    }
+
+    pub fn contains(&self, id: &ClientId) -> bool {
+        Self::read(self.shard(id)).contains_key(id)
+    }
+
+    /// Insert `info` unless `id` is already registered. Returns the entry on
+    /// success, or `None` when another connection holds the id.
+    pub fn try_insert(&self, id: ClientId, info: ClientInfo) -> Option<Arc<ClientInfo>> {
+        let mut shard = Self::write(self.shard(&id));
+        if shard.contains_key(&id) {
+            return None;
+        }
+        let info = Arc::new(info);
+        shard.insert(id, info.clone());
+        self.len.fetch_add(1, Ordering::Relaxed);
+        drop(shard);
+        self.changed.notify_waiters();
+        Some(info)
+    }
+
+    pub fn remove(&self, id: &ClientId) -> Option<Arc<ClientInfo>> {
+        let removed = Self::write(self.shard(id)).remove(id);
+        if let Some(info) = &removed {
+            self.len.fetch_sub(1, Ordering::Relaxed);
+            if let Some(models) = info.models() {
+                self.index.remove(id, models.iter().map(|m| m.id.as_str()));
+            }
+        }
+        removed
+    }
+
+    /// Record the models `id` reports and reindex it.
+    pub fn set_models(&self, id: &ClientId, models: Vec<Model>) {
+        let Some(info) = self.get(id) else {
+            return;
+        };
+        let old = info.models();
+        let new_ids: Vec<&str> = models.iter().map(|m| m.id.as_str()).collect();
+        if info.authed {
+            self.index.set_models(
+                *id,
+                old.iter().flat_map(|m| m.iter().map(|m| m.id.as_str())),
+                &new_ids,
+                info.load.score(),
+            );
+        }
+        info.set_models(models);
+        self.changed.notify_waiters();
+    }
+
+    /// Notified when a device logs in, reports models or frees capacity.
+    pub fn changed(&self) -> &Notify {
+        &self.changed
+    }
+
+    /// Apply heartbeat load figures and reposition `id` in the model index.
+    pub fn update_load(&self, id: &ClientId, cpu_usage: u8, memory_usage: u8, disk_usage: u8) {
+        let Some(info) = self.get(id) else {
+            return;
+        };
+        self.set_load(id, &info, cpu_usage, memory_usage, disk_usage);
+    }
+
+    /// Apply a LoadBeacon; fields it leaves out keep their current value.
+    pub fn apply_load_delta(&self, id: &ClientId, delta: &LoadDelta) {
+        let Some(info) = self.get(id) else {
+            return;
+        };
+        if delta.cpu_usage.is_some() || delta.memory_usage.is_some() {
+            let cpu_usage = delta.cpu_usage.unwrap_or(info.load.cpu_usage());
+            let memory_usage = delta.memory_usage.unwrap_or(info.load.memory_usage());
+            self.set_load(id, &info, cpu_usage, memory_usage, info.load.disk_usage());
+        }
+        info.load.set_reported(delta.inflight, delta.queued, delta.tokens_per_sec_x10);
+        if let Some(level) = delta.throttle {
+            info.set_throttle(level);
+        }
+    }
+
+    fn set_load(
+        &self,
+        id: &ClientId,
+        info: &ClientInfo,
+        cpu_usage: u8,
+        memory_usage: u8,
+        disk_usage: u8,
+    ) {
+        info.load.update(cpu_usage, memory_usage, disk_usage);
+        if let (true, Some(models)) = (info.authed, info.models()) {
+            self.index
+                .update_load(*id, models.iter().map(|m| m.id.as_str()), info.load.score());
+        }
+    }
+
+    /// Least-loaded authenticated device serving `model_id`.
+    pub fn best_for_model(&self, model_id: &str, allowed: Option<&[ClientId]>) -> Option<ClientId> {
+        self.index.best(model_id, allowed)
+    }
+
+    /// Up to `limit` devices serving `model_id` that pass `eligible`, least
+    /// heartbeat load first.
+    pub fn model_candidates(
+        &self,
+        model_id: &str,
+        allowed: Option<&[ClientId]>,
+        limit: usize,
+        eligible: impl Fn(&ClientInfo) -> bool,
+    ) -> Vec<(ClientId, Arc<ClientInfo>)> {
+        let mut found = Vec::with_capacity(limit);
+        // Runs under the model's index lock. Nothing takes an index lock
+        // while holding a shard lock, so the shard reads here cannot deadlock.
+        self.index.candidates(model_id, allowed, limit, |id| {
+            match self.get(id) {
+                Some(info) if eligible(&info) => {
+                    found.push((*id, info));
+                    true
+                }
+                _ => false,
+            }
+        });
+        found
+    }
+
+    pub fn len(&self) -> usize {
+        self.len.load(Ordering::Relaxed)
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Visit every entry, holding one shard read lock at a time.
+    pub fn for_each<F: FnMut(&ClientId, &Arc<ClientInfo>)>(&self, mut f: F) {
+        for shard in self.shards.iter() {
+            for (id, info) in Self::read(shard).iter() {
+                f(id, info);
+            }
+        }
+    }
+
+    /// Copy out all entries so callers can await while iterating.
+    pub fn snapshot(&self) -> Vec<(ClientId, Arc<ClientInfo>)> {
+        let mut out = Vec::with_capacity(self.len());
+        self.for_each(|id, info| out.push((*id, info.clone())));
+        out
+    }
+}
+
+/// Heartbeat-driven load figures, updated in place without registry locks.
+#[derive(Debug, Default)]
+pub struct DeviceLoad {
+    cpu_usage: AtomicU8,
+    memory_usage: AtomicU8,
+    disk_usage: AtomicU8,
+    last_heartbeat_ms: AtomicU64,
+    // Figures only load beacons carry; zero until the first one.
+    reported_inflight: AtomicU32,
+    reported_queued: AtomicU32,
+    reported_tokens_per_sec_x10: AtomicU32,
+}
+
+impl DeviceLoad {
+    pub fn new(cpu_usage: u8, memory_usage: u8, disk_usage: u8) -> Self {
+        let load = Self::default();
+        load.update(cpu_usage, memory_usage, disk_usage);
+        load
+    }
+
+    pub fn update(&self, cpu_usage: u8, memory_usage: u8, disk_usage: u8) {
+        self.cpu_usage.store(cpu_usage, Ordering::Relaxed);
+        self.memory_usage.store(memory_usage, Ordering::Relaxed);
+        self.disk_usage.store(disk_usage, Ordering::Relaxed);
+        let now_ms = SystemTime::now()
+            .duration_since(UNIX_EPOCH)
+            .unwrap_or_default()
+            .as_millis() as u64;
+        self.last_heartbeat_ms.store(now_ms, Ordering::Release);
+    }
+
+    pub fn cpu_usage(&self) -> u8 {
+        self.cpu_usage.load(Ordering::Relaxed)
+    }
+
+    pub fn memory_usage(&self) -> u8 {
+        self.memory_usage.load(Ordering::Relaxed)
+    }
+
+    pub fn disk_usage(&self) -> u8 {
+        self.disk_usage.load(Ordering::Relaxed)
+    }
+
+    pub fn last_heartbeat(&self) -> SystemTime {
+        UNIX_EPOCH + Duration::from_millis(self.last_heartbeat_ms.load(Ordering::Acquire))
+    }
+
+    /// Combined cpu + memory load used for device ranking.
+    pub fn score(&self) -> u16 {
+        self.cpu_usage() as u16 + self.memory_usage() as u16
+    }
+
+    pub fn set_reported(
+        &self,
+        inflight: Option<u16>,
+        queued: Option<u16>,
+        tokens_per_sec_x10: Option<u32>,
+    ) {
+        if let Some(n) = inflight {
+            self.reported_inflight.store(n as u32, Ordering::Relaxed);
+        }
+        if let Some(n) = queued {
+            self.reported_queued.store(n as u32, Ordering::Relaxed);
+        }
+        if let Some(rate) = tokens_per_sec_x10 {
+            self.reported_tokens_per_sec_x10.store(rate, Ordering::Relaxed);
+        }
+    }
+
+    /// Sequences running or queued on the device by its own account, which
+    /// includes work the scheduler did not dispatch.
+    pub fn reported_busy(&self) -> u32 {
+        self.reported_inflight.load(Ordering::Relaxed)
+            + self.reported_queued.load(Ordering::Relaxed)
+    }
+
+    /// Decode throughput the device last reported.
+    pub fn reported_tokens_per_sec(&self) -> Option<f64> {
+        match self.reported_tokens_per_sec_x10.load(Ordering::Relaxed) {
+            0 => None,
+            v => Some(v as f64 / 10.0),
+        }
+    }
+}
+
+/// Scheduler-side counters: tasks dispatched but not yet finished, and an
+/// exponentially weighted average of observed generation throughput.
+#[derive(Debug, Default)]
+pub struct DeviceStats {
+    inflight: AtomicU32,
+    // Tokens per second scaled by 1000; zero until the first sample.
+    tokens_per_sec_milli: AtomicU32,
+}
+
+impl DeviceStats {
+    pub fn inflight(&self) -> u32 {
+        self.inflight.load(Ordering::Relaxed)
+    }
+
+    pub fn begin_task(&self) {
+        self.inflight.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn end_task(&self) {
+        let _ = self
+            .inflight
+            .fetch_update(Ordering::Relaxed, Ordering::Relaxed, |n| n.checked_sub(1));
+    }
+
+    /// Fold one completed task into the throughput average (alpha = 1/4).
+    pub fn record_throughput(&self, tokens: u32, elapsed_ms: u64) {
+        if tokens == 0 || elapsed_ms == 0 {
+            return;
+        }
+        let sample = (tokens as u64 * 1_000_000 / elapsed_ms).min(u32::MAX as u64) as u32;
+        let _ =
+            self.tokens_per_sec_milli
+                .fetch_update(Ordering::Relaxed, Ordering::Relaxed, |old| {
+                    Some(if old == 0 {
+                        sample
+                    } else {
+                        ((old as u64 * 3 + sample as u64) / 4) as u32
+                    })
+                });
+    }
+
+    pub fn tokens_per_sec(&self) -> Option<f64> {
+        match self.tokens_per_sec_milli.load(Ordering::Relaxed) {
+            0 => None,
+            v => Some(v as f64 / 1000.0),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_device_load_update() {
+        let load = DeviceLoad::new(10, 20, 30);
+        assert_eq!(load.score(), 30);
+        load.update(200, 100, 0);
+        assert_eq!(load.score(), 300);
+        assert_eq!(load.disk_usage(), 0);
+        assert!(load.last_heartbeat() > UNIX_EPOCH);
+    }
+
+    #[test]
+    fn test_device_stats_inflight_and_throughput() {
+        let stats = DeviceStats::default();
+        stats.end_task();
+        assert_eq!(stats.inflight(), 0);
+        stats.begin_task();
+        stats.begin_task();
+        stats.end_task();
+        assert_eq!(stats.inflight(), 1);
+
+        assert_eq!(stats.tokens_per_sec(), None);
+        stats.record_throughput(100, 1000);
+        assert_eq!(stats.tokens_per_sec(), Some(100.0));
+        stats.record_throughput(200, 1000);
+        assert_eq!(stats.tokens_per_sec(), Some(125.0));
+    }
+}
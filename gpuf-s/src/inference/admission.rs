@@ -0,0 +1,392 @@
+//! Waiting room for requests no device can take yet.
+//!
+//! Devices come and go and cool down within seconds, so failing a request
+//! the moment no device fits throws away work that could be served shortly.
+//! A request that cannot be placed waits in its model's queue until a device
+//! appears or its deadline passes. Queues are served metered tokens first,
+//! then round robin across API keys within a class, so one busy key cannot
+//! starve the others. Waiters are rechecked whenever the device registry
+//! changes, and every [`RETRY_INTERVAL`] for changes it does not announce,
+//! such as a device leaving thermal throttling.
+
+use crate::util::policy::AccessLevel;
+use crate::util::protoc::ClientId;
+
+use serde::Serialize;
+use std::collections::{HashMap, VecDeque};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+use tokio::sync::{oneshot, Notify};
+
+/// Wait used when the request does not ask for one.
+pub const DEFAULT_QUEUE_WAIT: Duration = Duration::from_secs(10);
+/// Longest wait a request may ask for.
+pub const MAX_QUEUE_WAIT: Duration = Duration::from_secs(60);
+const RETRY_INTERVAL: Duration = Duration::from_millis(500);
+/// Requests one API key may have waiting per model.
+const MAX_WAITING_PER_KEY: usize = 64;
+
+/// Service class; lower classes are served first.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Priority {
+    Metered = 0,
+    Free = 1,
+}
+
+const CLASSES: usize = 2;
+
+/// Who is asking and how long they will wait.
+#[derive(Debug, Clone)]
+pub struct Admission {
+    pub priority: Priority,
+    /// Fairness key, normally the API key.
+    pub key: String,
+    /// When the request arrived.
+    pub received: Instant,
+    pub deadline: Instant,
+}
+
+impl Admission {
+    /// `wait` is clamped to [`MAX_QUEUE_WAIT`].
+    pub fn new(access_level: AccessLevel, key: &str, wait: Option<Duration>) -> Self {
+        let priority = if access_level.is_metered() {
+            Priority::Metered
+        } else {
+            Priority::Free
+        };
+        let wait = wait.unwrap_or(DEFAULT_QUEUE_WAIT).min(MAX_QUEUE_WAIT);
+        let received = Instant::now();
+        Self {
+            priority,
+            key: key.to_string(),
+            received,
+            deadline: received + wait,
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum AdmitError {
+    /// Nothing could take the request before its deadline.
+    TimedOut,
+    /// The key already has too many requests waiting.
+    QueueFull,
+}
+
+impl std::fmt::Display for AdmitError {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            AdmitError::TimedOut => f.write_str("timed out waiting for a device"),
+            AdmitError::QueueFull => f.write_str("admission queue full"),
+        }
+    }
+}
+
+struct Waiter<D> {
+    demand: D,
+    deadline: Instant,
+    tx: oneshot::Sender<ClientId>,
+}
+
+impl<D> Waiter<D> {
+    fn is_gone(&self, now: Instant) -> bool {
+        self.tx.is_closed() || now >= self.deadline
+    }
+}
+
+/// Waiters of one class, by key, with keys in service order.
+struct Class<D> {
+    order: VecDeque<String>,
+    by_key: HashMap<String, VecDeque<Waiter<D>>>,
+}
+
+impl<D> Default for Class<D> {
+    fn default() -> Self {
+        Self {
+            order: VecDeque::new(),
+            by_key: HashMap::new(),
+        }
+    }
+}
+
+impl<D> Class<D> {
+    fn len(&self) -> usize {
+        self.by_key.values().map(VecDeque::len).sum()
+    }
+
+    /// Serve every key's waiters in turn, one per key per round, until
+    /// nothing more can be placed. A key whose first waiter cannot be placed
+    /// is skipped for the rest of the pass.
+    fn dispatch(&mut self, now: Instant, place: &impl Fn(&D) -> Option<ClientId>) {
+        let mut stuck = Vec::new();
+        while let Some(key) = self.order.pop_front() {
+            let Some(queue) = self.by_key.get_mut(&key) else {
+                continue;
+            };
+            queue.retain(|w| !w.is_gone(now));
+            let Some(waiter) = queue.front() else {
+                self.by_key.remove(&key);
+                continue;
+            };
+            let Some(device) = place(&waiter.demand) else {
+                stuck.push(key);
+                continue;
+            };
+            if let Some(waiter) = queue.pop_front() {
+                let _ = waiter.tx.send(device);
+            }
+            if queue.is_empty() {
+                self.by_key.remove(&key);
+            } else {
+                self.order.push_back(key);
+            }
+        }
+        // Keys that could not be served keep their turn for the next pass.
+        self.order.extend(stuck);
+    }
+}
+
+/// Queues of one model.
+struct ModelQueue<D> {
+    classes: [Class<D>; CLASSES],
+}
+
+impl<D> Default for ModelQueue<D> {
+    fn default() -> Self {
+        Self {
+            classes: [Class::default(), Class::default()],
+        }
+    }
+}
+
+impl<D> ModelQueue<D> {
+    fn is_empty(&self) -> bool {
+        self.classes.iter().all(|c| c.by_key.is_empty())
+    }
+}
+
+#[derive(Debug, Default)]
+struct Counters {
+    admitted_at_once: AtomicU64,
+    admitted_after_wait: AtomicU64,
+    timed_out: AtomicU64,
+    rejected_full: AtomicU64,
+    wait_ms_total: AtomicU64,
+    wait_ms_max: AtomicU64,
+}
+
+#[derive(Debug, Clone, Default, Serialize)]
+pub struct AdmissionStats {
+    /// Requests waiting now, by model.
+    pub waiting: HashMap<String, usize>,
+    pub admitted_at_once: u64,
+    pub admitted_after_wait: u64,
+    pub timed_out: u64,
+    pub rejected_full: u64,
+    /// Mean and longest wait of requests admitted after waiting.
+    pub mean_wait_ms: u64,
+    pub max_wait_ms: u64,
+}
+
+pub struct AdmissionQueue<D> {
+    queues: Mutex<HashMap<String, ModelQueue<D>>>,
+    counters: Counters,
+}
+
+impl<D> Default for AdmissionQueue<D> {
+    fn default() -> Self {
+        Self {
+            queues: Mutex::new(HashMap::new()),
+            counters: Counters::default(),
+        }
+    }
+}
+
+impl<D> AdmissionQueue<D> {
+    fn lock(&self) -> std::sync::MutexGuard<'_, HashMap<String, ModelQueue<D>>> {
+        self.queues.lock().unwrap_or_else(|e| e.into_inner())
+    }
+
+    /// A device for `demand`, waiting for one if needed. `place` picks a
+    /// device for a demand of this model or returns None; it is also used
+    /// for the other requests waiting on `model` and must not block.
+    /// `changed` is notified when devices appear or change.
+    pub async fn admit<F>(
+        &self,
+        model: &str,
+        admission: &Admission,
+        demand: D,
+        changed: &Notify,
+        place: F,
+    ) -> Result<ClientId, AdmitError>
+    where
+        F: Fn(&D) -> Option<ClientId>,
+    {
+        let start = Instant::now();
+        let mut rx = {
+            let mut queues = self.lock();
+            let queue = queues.entry(model.to_string()).or_default();
+            // Nobody to overtake: try at once.
+            if queue.is_empty() {
+                if let Some(device) = place(&demand) {
+                    queues.remove(model);
+                    self.counters
+                        .admitted_at_once
+                        .fetch_add(1, Ordering::Relaxed);
+                    return Ok(device);
+                }
+            }
+            let class = &mut queue.classes[admission.priority as usize];
+            let waiting = class.by_key.entry(admission.key.clone()).or_default();
+            waiting.retain(|w| !w.is_gone(start));
+            if waiting.len() >= MAX_WAITING_PER_KEY {
+                self.counters.rejected_full.fetch_add(1, Ordering::Relaxed);
+                return Err(AdmitError::QueueFull);
+            }
+            let (tx, rx) = oneshot::channel();
+            if waiting.is_empty() {
+                class.order.push_back(admission.key.clone());
+            }
+            waiting.push_back(Waiter {
+                demand,
+                deadline: admission.deadline,
+                tx,
+            });
+            rx
+        };
+
+        let deadline = tokio::time::Instant::from_std(admission.deadline);
+        loop {
+            let notified = changed.notified();
+            // Devices may have changed while this request queued.
+            self.dispatch(model, &place);
+            tokio::select! {
+                device = &mut rx => {
+                    if let Ok(device) = device {
+                        self.record_wait(start.elapsed());
+                        return Ok(device);
+                    }
+                    break;
+                }
+                _ = tokio::time::sleep_until(deadline) => break,
+                _ = notified => {}
+                _ = tokio::time::sleep(RETRY_INTERVAL) => {}
+            }
+        }
+        // Placed just as the deadline passed.
+        if let Ok(device) = rx.try_recv() {
+            self.record_wait(start.elapsed());
+            return Ok(device);
+        }
+        drop(rx);
+        self.dispatch(model, &place);
+        self.counters.timed_out.fetch_add(1, Ordering::Relaxed);
+        Err(AdmitError::TimedOut)
+    }
+
+    /// Place whoever can be placed in `model`'s queue, best class first.
+    fn dispatch(&self, model: &str, place: &impl Fn(&D) -> Option<ClientId>) {
+        let mut queues = self.lock();
+        let Some(queue) = queues.get_mut(model) else {
+            return;
+        };
+        let now = Instant::now();
+        for class in queue.classes.iter_mut() {
+            class.dispatch(now, place);
+        }
+        if queue.is_empty() {
+            queues.remove(model);
+        }
+    }
+
+    fn record_wait(&self, waited: Duration) {
+        let ms = waited.as_millis() as u64;
+        self.counters
+            .admitted_after_wait
+            .fetch_add(1, Ordering::Relaxed);
+        self.counters.wait_ms_total.fetch_add(ms, Ordering::Relaxed);
+        self.counters.wait_ms_max.fetch_max(ms, Ordering::Relaxed);
+    }
+
+    pub fn stats(&self) -> AdmissionStats {
+        let waiting = self
+            .lock()
+            .iter()
+            .map(|(model, q)| (model.clone(), q.classes.iter().map(Class::len).sum()))
+            .collect();
+        let after_wait = self.counters.admitted_after_wait.load(Ordering::Relaxed);
+        let wait_total = self.counters.wait_ms_total.load(Ordering::Relaxed);
+        AdmissionStats {
+            waiting,
+            admitted_at_once: self.counters.admitted_at_once.load(Ordering::Relaxed),
+            admitted_after_wait: after_wait,
+            timed_out: self.counters.timed_out.load(Ordering::Relaxed),
+            rejected_full: self.counters.rejected_full.load(Ordering::Relaxed),
+            mean_wait_ms: wait_total.checked_div(after_wait).unwrap_or(0),
+            max_wait_ms: self.counters.wait_ms_max.load(Ordering::Relaxed),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::atomic::AtomicBool;
+    use std::sync::Arc;
+
+    #[tokio::test]
+    async fn test_waiters_admitted_by_class_then_key() {
+        let queue = Arc::new(AdmissionQueue::<&'static str>::default());
+        let changed = Arc::new(Notify::new());
+        let online = Arc::new(AtomicBool::new(false));
+        let served = Arc::new(Mutex::new(Vec::new()));
+        let device = ClientId([9; 16]);
+
+        let wait = Some(Duration::from_secs(5));
+        let requests = [
+            (AccessLevel(0), "a", "a1"),
+            (AccessLevel(0), "a", "a2"),
+            (AccessLevel(0), "b", "b1"),
+            (AccessLevel::METERED, "m", "m1"),
+        ];
+        let mut tasks = Vec::new();
+        for (level, key, name) in requests {
+            let (queue, changed, online, served) = (
+                queue.clone(),
+                changed.clone(),
+                online.clone(),
+                served.clone(),
+            );
+            tasks.push(tokio::spawn(async move {
+                let admission = Admission::new(level, key, wait);
+                let place = |d: &&'static str| {
+                    if !online.load(Ordering::Relaxed) {
+                        return None;
+                    }
+                    served.lock().unwrap().push(*d);
+                    Some(device)
+                };
+                queue.admit("m", &admission, name, &changed, place).await
+            }));
+            tokio::task::yield_now().await;
+        }
+        assert_eq!(queue.stats().waiting["m"], 4);
+
+        online.store(true, Ordering::Relaxed);
+        changed.notify_waiters();
+        for task in tasks {
+            assert_eq!(task.await.unwrap(), Ok(device));
+        }
+        assert_eq!(*served.lock().unwrap(), ["m1", "a1", "b1", "a2"]);
+        let stats = queue.stats();
+        assert!(stats.waiting.is_empty());
+        assert_eq!(stats.admitted_after_wait, 4);
+
+        let admission = Admission::new(AccessLevel(0), "a", Some(Duration::from_millis(20)));
+        let none = queue
+            .admit("m", &admission, "late", &changed, |_| None)
+            .await;
+        assert_eq!(none, Err(AdmitError::TimedOut));
+    }
+}
@@ -0,0 +1,860 @@
+//! Device directory and task relay shared by several gpuf-s nodes.
+//!
+//! A worker keeps one control connection to the node it logged in to, so
+//! that node alone can send it tasks. With `--cluster-port` set, each node
+//! publishes a snapshot of its devices, the models they serve and their
+//! expected wait to Redis every `--cluster-publish-secs`, and reads the
+//! snapshots of every other live node into a [`RemoteView`]. When no local
+//! device fits a chat request, the scheduler picks one from the view and the
+//! request is relayed to its node over a cluster connection, which streams
+//! the reply back. Tasks relayed since the last snapshot count against a
+//! remote device, so a burst does not pile onto the one that looked idle.
+//!
+//! Snapshots expire after [`TTL_PUBLISHES`] missed publishes, so a node that
+//! dies drops out of the directory without any cleanup. Only chat requests
+//! are relayed; text completions and public TCP connections stay on the node
+//! the worker is connected to.
+
+use crate::inference::scheduler::{ChatMessage, StreamEvent};
+use crate::inference::scoring::{self, CANDIDATE_LIMIT};
+use crate::inference::InferenceScheduler;
+use crate::util::protoc::ClientId;
+
+use anyhow::{anyhow, ensure, Result};
+use redis::aio::MultiplexedConnection;
+use redis::Client as RedisClient;
+use serde::Serialize;
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering};
+use std::sync::{Arc, Mutex, RwLock};
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt, BufReader};
+use tokio::net::tcp::OwnedWriteHalf;
+use tokio::net::{TcpListener, TcpStream};
+use tokio::sync::mpsc;
+use tracing::{debug, error, info, warn};
+
+/// Sorted set of live node ids, scored by their last publish time.
+const NODES_KEY: &str = "gpuf:cluster:nodes";
+const NODE_KEY_PREFIX: &str = "gpuf:cluster:node:";
+/// Publishes a node may miss before it leaves the directory.
+const TTL_PUBLISHES: u64 = 3;
+const CONNECT_TIMEOUT: Duration = Duration::from_secs(2);
+const REDIS_TIMEOUT: Duration = Duration::from_secs(2);
+const MAX_FRAME_BYTES: usize = 16 * 1024 * 1024;
+/// Events buffered towards the handler of a relayed request.
+const STREAM_BUFFER: usize = 128;
+
+fn wire_config() -> bincode::config::Configuration {
+    bincode::config::standard()
+}
+
+fn unix_secs() -> u64 {
+    SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .unwrap_or_default()
+        .as_secs()
+}
+
+/// Compare cluster secrets without an early exit on the first differing byte.
+fn secrets_match(given: &str, expected: &str) -> bool {
+    let (given, expected) = (given.as_bytes(), expected.as_bytes());
+    if expected.is_empty() || given.len() != expected.len() {
+        return false;
+    }
+    given
+        .iter()
+        .zip(expected)
+        .fold(0u8, |diff, (a, b)| diff | (a ^ b))
+        == 0
+}
+
+/// A chat task bound for one device, local or on another node.
+#[derive(Debug, bincode::Encode, bincode::Decode)]
+pub struct ChatTask {
+    pub task_id: String,
+    pub device_id: ClientId,
+    pub model: String,
+    pub messages: Vec<ChatMessage>,
+    pub max_tokens: u32,
+    pub temperature: f32,
+    pub top_k: u32,
+    pub top_p: f32,
+    pub repeat_penalty: f32,
+    pub repeat_last_n: i32,
+    pub min_keep: u32,
+    pub draft_tokens: u32,
+}
+
+/// Frames exchanged on a cluster connection. The dialling node sends
+/// `Hello` first, then `Chat` and `Cancel`; the other node answers with
+/// `Event`s.
+#[derive(Debug, bincode::Encode, bincode::Decode)]
+enum RelayMessage {
+    Hello {
+        node_id: String,
+        secret: String,
+    },
+    Chat(ChatTask),
+    Cancel {
+        task_id: String,
+        device_id: ClientId,
+    },
+    Event {
+        task_id: String,
+        event: StreamEvent,
+    },
+}
+
+async fn write_frame<W: AsyncWrite + Unpin>(writer: &mut W, msg: &RelayMessage) -> Result<()> {
+    let mut frame = vec![0u8; 4];
+    bincode::encode_into_std_write(msg, &mut frame, wire_config())?;
+    let len = frame.len() - 4;
+    ensure!(len <= MAX_FRAME_BYTES, "relay frame too large: {len} bytes");
+    frame[..4].copy_from_slice(&(len as u32).to_be_bytes());
+    writer.write_all(&frame).await?;
+    Ok(())
+}
+
+async fn read_frame<R: AsyncRead + Unpin>(
+    reader: &mut R,
+    buf: &mut Vec<u8>,
+) -> Result<RelayMessage> {
+    let len = reader.read_u32().await? as usize;
+    ensure!(len <= MAX_FRAME_BYTES, "relay frame too large: {len} bytes");
+    buf.resize(len, 0);
+    reader.read_exact(buf).await?;
+    let (msg, _) = bincode::decode_from_slice(&buf[..], wire_config())?;
+    Ok(msg)
+}
+
+/// One device as its node publishes it.
+#[derive(Debug, Clone, bincode::Encode, bincode::Decode)]
+struct PublishedDevice {
+    id: ClientId,
+    models: Vec<String>,
+    /// The node's scoring policy for a new task, lower is better.
+    wait: f32,
+    inflight: u32,
+    /// 0 until the device reports a context profile.
+    context_window: u32,
+}
+
+#[derive(Debug, bincode::Encode, bincode::Decode)]
+struct NodeSnapshot {
+    node_id: String,
+    /// Where other nodes reach this node's cluster port.
+    addr: String,
+    devices: Vec<PublishedDevice>,
+}
+
+struct RemoteDevice {
+    published: PublishedDevice,
+    /// Index into [`RemoteView::addrs`].
+    node: usize,
+    /// Tasks this node relayed to the device since the snapshot was read.
+    relayed: AtomicU32,
+}
+
+impl RemoteDevice {
+    /// The published wait grown by the tasks relayed since; waits scale
+    /// with one more than the tasks in flight.
+    fn wait(&self) -> f64 {
+        let inflight = self.published.inflight as f64 + 1.0;
+        let relayed = self.relayed.load(Ordering::Relaxed) as f64;
+        self.published.wait as f64 * (inflight + relayed) / inflight
+    }
+
+    fn fits(&self, model: Option<&str>, needed_context: u32) -> bool {
+        let n_ctx = self.published.context_window;
+        (n_ctx == 0 || n_ctx >= needed_context)
+            && model.map_or(true, |m| self.published.models.iter().any(|id| id == m))
+    }
+}
+
+/// Devices of every other live node, rebuilt from each directory read.
+#[derive(Default)]
+struct RemoteView {
+    addrs: Vec<String>,
+    devices: Vec<RemoteDevice>,
+    by_id: HashMap<ClientId, usize>,
+    by_model: HashMap<String, Vec<usize>>,
+}
+
+impl RemoteView {
+    fn new(snapshots: Vec<NodeSnapshot>) -> Self {
+        let mut view = Self::default();
+        for snapshot in snapshots {
+            let node = view.addrs.len();
+            view.addrs.push(snapshot.addr);
+            for published in snapshot.devices {
+                let i = view.devices.len();
+                // A device that moved to another node may briefly be in two
+                // snapshots; keep the first until the next read.
+                if view.by_id.contains_key(&published.id) {
+                    continue;
+                }
+                view.by_id.insert(published.id, i);
+                for model in &published.models {
+                    view.by_model.entry(model.clone()).or_default().push(i);
+                }
+                view.devices.push(RemoteDevice {
+                    published,
+                    node,
+                    relayed: AtomicU32::new(0),
+                });
+            }
+        }
+        view
+    }
+
+    /// A device serving `model` (any device for `None`) whose context fits,
+    /// sampled from the least loaded candidates.
+    fn place(
+        &self,
+        model: Option<&str>,
+        allowed: Option<&[ClientId]>,
+        needed_context: u32,
+    ) -> Option<&RemoteDevice> {
+        let mut candidates: Vec<(f64, usize)> = Vec::with_capacity(CANDIDATE_LIMIT + 1);
+        let mut consider = |i: usize| {
+            let device = &self.devices[i];
+            if !device.fits(model, needed_context) {
+                return;
+            }
+            let wait = device.wait();
+            let pos = candidates.partition_point(|(w, _)| *w <= wait);
+            candidates.insert(pos, (wait, i));
+            candidates.truncate(CANDIDATE_LIMIT);
+        };
+        match (allowed, model) {
+            (Some(allowed), _) => allowed
+                .iter()
+                .filter_map(|id| self.by_id.get(id))
+                .for_each(|&i| consider(i)),
+            (None, Some(model)) => self
+                .by_model
+                .get(model)
+                .into_iter()
+                .flatten()
+                .for_each(|&i| consider(i)),
+            (None, None) => (0..self.devices.len()).for_each(&mut consider),
+        }
+        let scores: Vec<f64> = candidates.iter().map(|(w, _)| *w).collect();
+        let (_, i) = candidates[scoring::choose_scores(&scores)?];
+        Some(&self.devices[i])
+    }
+}
+
+/// A cluster connection this node dialled.
+struct Peer {
+    writer: tokio::sync::Mutex<OwnedWriteHalf>,
+    streams: Mutex<HashMap<String, mpsc::UnboundedSender<StreamEvent>>>,
+    closed: AtomicBool,
+}
+
+impl Peer {
+    fn streams(
+        &self,
+    ) -> std::sync::MutexGuard<'_, HashMap<String, mpsc::UnboundedSender<StreamEvent>>> {
+        self.streams.lock().unwrap_or_else(|e| e.into_inner())
+    }
+
+    /// Hand each event to its stream until the connection fails, then fail
+    /// every stream still open.
+    async fn read_events<R: AsyncRead + Unpin>(&self, mut reader: R) {
+        let mut buf = Vec::new();
+        loop {
+            match read_frame(&mut reader, &mut buf).await {
+                Ok(RelayMessage::Event { task_id, event }) => {
+                    let done = matches!(event, StreamEvent::Done);
+                    let mut streams = self.streams();
+                    if let Some(tx) = streams.get(&task_id) {
+                        let _ = tx.send(event);
+                    }
+                    if done {
+                        streams.remove(&task_id);
+                    }
+                }
+                Ok(other) => debug!("Ignoring unexpected relay frame {:?}", other),
+                Err(e) => {
+                    debug!("Cluster connection closed: {}", e);
+                    break;
+                }
+            }
+        }
+        self.closed.store(true, Ordering::Relaxed);
+        for (_, tx) in self.streams().drain() {
+            let _ = tx.send(StreamEvent::Error("cluster node disconnected".to_string()));
+            let _ = tx.send(StreamEvent::Done);
+        }
+    }
+}
+
+#[derive(Default)]
+struct Counters {
+    relayed: AtomicU64,
+    served: AtomicU64,
+    relay_errors: AtomicU64,
+    directory_errors: AtomicU64,
+}
+
+#[derive(Debug, Clone, Serialize)]
+pub struct ClusterStats {
+    pub node_id: String,
+    /// Other live nodes in the directory.
+    pub nodes: usize,
+    pub remote_devices: usize,
+    /// Chat tasks this node sent to devices on other nodes.
+    pub relayed: u64,
+    /// Chat tasks other nodes sent to this node's devices.
+    pub served: u64,
+    /// Relays that could not reach the device's node.
+    pub relay_errors: u64,
+    /// Directory publishes or reads that failed.
+    pub directory_errors: u64,
+}
+
+pub struct Cluster {
+    node_id: String,
+    advertise: String,
+    secret: String,
+    redis: Arc<RedisClient>,
+    publish_every: Duration,
+    conn: tokio::sync::Mutex<Option<MultiplexedConnection>>,
+    view: RwLock<Arc<RemoteView>>,
+    /// Dialled connections, by node address. Only held briefly; dialling
+    /// happens outside it.
+    peers: Mutex<HashMap<String, Arc<Peer>>>,
+    /// One dial at a time per address, so a slow node delays only relays
+    /// to itself.
+    dialing: Mutex<HashMap<String, Arc<tokio::sync::Mutex<()>>>>,
+    counters: Counters,
+}
+
+impl Cluster {
+    pub fn new(
+        node_id: String,
+        advertise: String,
+        secret: String,
+        redis: Arc<RedisClient>,
+        publish_every: Duration,
+    ) -> Self {
+        Self {
+            node_id,
+            advertise,
+            secret,
+            redis,
+            publish_every: publish_every.max(Duration::from_secs(1)),
+            conn: tokio::sync::Mutex::new(None),
+            view: RwLock::new(Arc::default()),
+            peers: Mutex::new(HashMap::new()),
+            dialing: Mutex::new(HashMap::new()),
+            counters: Counters::default(),
+        }
+    }
+
+    fn view(&self) -> Arc<RemoteView> {
+        self.view.read().unwrap_or_else(|e| e.into_inner()).clone()
+    }
+
+    /// A device on another node for a request no local device can take.
+    pub fn place(
+        &self,
+        model: Option<&str>,
+        allowed: Option<&[ClientId]>,
+        needed_context: u32,
+    ) -> Option<ClientId> {
+        let view = self.view();
+        let device = view.place(model, allowed, needed_context)?;
+        device.relayed.fetch_add(1, Ordering::Relaxed);
+        Some(device.published.id)
+    }
+
+    fn addr_of(&self, device_id: &ClientId) -> Option<String> {
+        let view = self.view();
+        let &i = view.by_id.get(device_id)?;
+        Some(view.addrs[view.devices[i].node].clone())
+    }
+
+    pub fn stats(&self) -> ClusterStats {
+        let view = self.view();
+        ClusterStats {
+            node_id: self.node_id.clone(),
+            nodes: view.addrs.len(),
+            remote_devices: view.devices.len(),
+            relayed: self.counters.relayed.load(Ordering::Relaxed),
+            served: self.counters.served.load(Ordering::Relaxed),
+            relay_errors: self.counters.relay_errors.load(Ordering::Relaxed),
+            directory_errors: self.counters.directory_errors.load(Ordering::Relaxed),
+        }
+    }
+
+    /// The open connection to `addr`, if any.
+    fn connected(&self, addr: &str) -> Option<Arc<Peer>> {
+        self.peers
+            .lock()
+            .unwrap_or_else(|e| e.into_inner())
+            .get(addr)
+            .filter(|peer| !peer.closed.load(Ordering::Relaxed))
+            .cloned()
+    }
+
+    async fn peer(&self, addr: &str) -> Result<Arc<Peer>> {
+        if let Some(peer) = self.connected(addr) {
+            return Ok(peer);
+        }
+        let gate = self
+            .dialing
+            .lock()
+            .unwrap_or_else(|e| e.into_inner())
+            .entry(addr.to_string())
+            .or_default()
+            .clone();
+        let _dialing = gate.lock().await;
+        // Another caller may have connected while we waited.
+        if let Some(peer) = self.connected(addr) {
+            return Ok(peer);
+        }
+        let stream = tokio::time::timeout(CONNECT_TIMEOUT, TcpStream::connect(addr))
+            .await
+            .map_err(|_| anyhow!("timed out connecting to cluster node {addr}"))??;
+        stream.set_nodelay(true)?;
+        let (reader, mut writer) = stream.into_split();
+        let hello = RelayMessage::Hello {
+            node_id: self.node_id.clone(),
+            secret: self.secret.clone(),
+        };
+        write_frame(&mut writer, &hello).await?;
+        let peer = Arc::new(Peer {
+            writer: tokio::sync::Mutex::new(writer),
+            streams: Mutex::new(HashMap::new()),
+            closed: AtomicBool::new(false),
+        });
+        let reading = peer.clone();
+        tokio::spawn(async move { reading.read_events(BufReader::new(reader)).await });
+        info!("Connected to cluster node {}", addr);
+        self.peers
+            .lock()
+            .unwrap_or_else(|e| e.into_inner())
+            .insert(addr.to_string(), peer.clone());
+        Ok(peer)
+    }
+
+    /// Run `task` on its device's node and stream the reply back.
+    pub async fn relay_chat(&self, task: ChatTask) -> Result<mpsc::Receiver<StreamEvent>> {
+        let result = self.try_relay_chat(task).await;
+        if result.is_err() {
+            self.counters.relay_errors.fetch_add(1, Ordering::Relaxed);
+        }
+        result
+    }
+
+    async fn try_relay_chat(&self, task: ChatTask) -> Result<mpsc::Receiver<StreamEvent>> {
+        let addr = self
+            .addr_of(&task.device_id)
+            .ok_or_else(|| anyhow!("Device {:?} not found in the cluster", task.device_id))?;
+        let peer = self.peer(&addr).await?;
+        let task_id = task.task_id.clone();
+        let (relay_tx, mut relay_rx) = mpsc::unbounded_channel();
+        peer.streams().insert(task_id.clone(), relay_tx);
+        if let Err(e) = write_frame(&mut *peer.writer.lock().await, &RelayMessage::Chat(task)).await
+        {
+            peer.streams().remove(&task_id);
+            peer.closed.store(true, Ordering::Relaxed);
+            return Err(e);
+        }
+        self.counters.relayed.fetch_add(1, Ordering::Relaxed);
+
+        // The connection reader never waits on one slow client; each stream
+        // drains into the handler's bounded channel on its own.
+        let (tx, rx) = mpsc::channel(STREAM_BUFFER);
+        tokio::spawn(async move {
+            while let Some(ev) = relay_rx.recv().await {
+                if tx.send(ev).await.is_err() {
+                    break;
+                }
+            }
+        });
+        Ok(rx)
+    }
+
+    /// Cancel a relayed task on its device's node.
+    pub async fn cancel(&self, task_id: &str, device_id: &ClientId) -> Result<()> {
+        let addr = self
+            .addr_of(device_id)
+            .ok_or_else(|| anyhow!("Device {:?} not found or not connected", device_id))?;
+        let Some(peer) = self.connected(&addr) else {
+            return Ok(());
+        };
+        peer.streams().remove(task_id);
+        let cancel = RelayMessage::Cancel {
+            task_id: task_id.to_string(),
+            device_id: *device_id,
+        };
+        write_frame(&mut *peer.writer.lock().await, &cancel).await
+    }
+
+    /// Accept cluster connections and keep the directory fresh.
+    pub async fn run(self: Arc<Self>, scheduler: Arc<InferenceScheduler>, listener: TcpListener) {
+        info!(
+            "Cluster node {} serving relays at {}",
+            self.node_id, self.advertise
+        );
+        tokio::spawn(self.clone().sync_directory(scheduler.clone()));
+        loop {
+            match listener.accept().await {
+                Ok((stream, addr)) => {
+                    let cluster = self.clone();
+                    let scheduler = scheduler.clone();
+                    tokio::spawn(async move {
+                        if let Err(e) = cluster.serve(scheduler, stream).await {
+                            debug!("Cluster connection from {} ended: {}", addr, e);
+                        }
+                    });
+                }
+                Err(e) => error!("Failed to accept cluster connection: {}", e),
+            }
+        }
+    }
+
+    /// Run the tasks another node relays to this node's devices.
+    async fn serve(
+        self: Arc<Self>,
+        scheduler: Arc<InferenceScheduler>,
+        stream: TcpStream,
+    ) -> Result<()> {
+        stream.set_nodelay(true)?;
+        let (reader, writer) = stream.into_split();
+        let mut reader = BufReader::new(reader);
+        let writer = Arc::new(tokio::sync::Mutex::new(writer));
+        let mut buf = Vec::new();
+        match read_frame(&mut reader, &mut buf).await? {
+            RelayMessage::Hello { node_id, secret } if secrets_match(&secret, &self.secret) => {
+                info!("Cluster node {} connected", node_id);
+            }
+            _ => return Err(anyhow!("cluster handshake rejected")),
+        }
+
+        let running: Arc<Mutex<HashMap<String, ClientId>>> = Arc::default();
+        let result = loop {
+            let msg = match read_frame(&mut reader, &mut buf).await {
+                Ok(msg) => msg,
+                Err(e) => break Err(e),
+            };
+            match msg {
+                RelayMessage::Chat(task) => {
+                    self.counters.served.fetch_add(1, Ordering::Relaxed);
+                    running
+                        .lock()
+                        .unwrap_or_else(|e| e.into_inner())
+                        .insert(task.task_id.clone(), task.device_id);
+                    tokio::spawn(forward_relayed(
+                        scheduler.clone(),
+                        task,
+                        writer.clone(),
+                        running.clone(),
+                    ));
+                }
+                RelayMessage::Cancel { task_id, device_id } => {
+                    running
+                        .lock()
+                        .unwrap_or_else(|e| e.into_inner())
+                        .remove(&task_id);
+                    let _ = scheduler.cancel_inference(&task_id, &device_id).await;
+                }
+                other => debug!("Ignoring unexpected relay frame {:?}", other),
+            }
+        };
+
+        // The requests behind the connection are gone with it.
+        let orphaned: Vec<_> = running
+            .lock()
+            .unwrap_or_else(|e| e.into_inner())
+            .drain()
+            .collect();
+        for (task_id, device_id) in orphaned {
+            let _ = scheduler.cancel_inference(&task_id, &device_id).await;
+        }
+        result
+    }
+
+    async fn connection(&self) -> Option<MultiplexedConnection> {
+        let mut conn = self.conn.lock().await;
+        if conn.is_none() {
+            match tokio::time::timeout(REDIS_TIMEOUT, self.redis.get_multiplexed_async_connection())
+                .await
+            {
+                Ok(Ok(c)) => *conn = Some(c),
+                Ok(Err(e)) => warn!("cluster directory: Redis connect failed: {}", e),
+                Err(_) => warn!("cluster directory: Redis connect timed out"),
+            }
+        }
+        conn.clone()
+    }
+
+    /// Publish this node's devices and read everyone else's, forever.
+    async fn sync_directory(self: Arc<Self>, scheduler: Arc<InferenceScheduler>) {
+        let mut interval = tokio::time::interval(self.publish_every);
+        interval.set_missed_tick_behavior(tokio::time::MissedTickBehavior::Delay);
+        loop {
+            interval.tick().await;
+            let snapshot = NodeSnapshot {
+                node_id: self.node_id.clone(),
+                addr: self.advertise.clone(),
+                devices: local_devices(&scheduler),
+            };
+            let Some(mut conn) = self.connection().await else {
+                self.counters
+                    .directory_errors
+                    .fetch_add(1, Ordering::Relaxed);
+                continue;
+            };
+            let synced =
+                tokio::time::timeout(REDIS_TIMEOUT, self.sync_once(&mut conn, &snapshot)).await;
+            match synced {
+                Ok(Ok(view)) => {
+                    *self.view.write().unwrap_or_else(|e| e.into_inner()) = Arc::new(view);
+                    // Requests waiting for a device may fit one just read.
+                    scheduler.registry().changed().notify_waiters();
+                }
+                Ok(Err(e)) => {
+                    warn!("cluster directory sync failed: {}", e);
+                    self.counters
+                        .directory_errors
+                        .fetch_add(1, Ordering::Relaxed);
+                    *self.conn.lock().await = None;
+                }
+                Err(_) => {
+                    warn!("cluster directory sync timed out");
+                    self.counters
+                        .directory_errors
+                        .fetch_add(1, Ordering::Relaxed);
+                }
+            }
+        }
+    }
+
+    async fn sync_once(
+        &self,
+        conn: &mut MultiplexedConnection,
+        snapshot: &NodeSnapshot,
+    ) -> Result<RemoteView> {
+        let now = unix_secs();
+        let ttl = self.publish_every.as_secs().max(1) * TTL_PUBLISHES;
+        let payload = bincode::encode_to_vec(snapshot, wire_config())?;
+        redis::pipe()
+            .cmd("SET")
+            .arg(format!("{NODE_KEY_PREFIX}{}", self.node_id))
+            .arg(payload)
+            .arg("EX")
+            .arg(ttl)
+            .ignore()
+            .cmd("ZADD")
+            .arg(NODES_KEY)
+            .arg(now)
+            .arg(&self.node_id)
+            .ignore()
+            .cmd("ZREMRANGEBYSCORE")
+            .arg(NODES_KEY)
+            .arg("-inf")
+            .arg(format!("({}", now.saturating_sub(ttl)))
+            .ignore()
+            .query_async::<_, ()>(conn)
+            .await?;
+
+        let nodes: Vec<String> = redis::cmd("ZRANGE")
+            .arg(NODES_KEY)
+            .arg(0)
+            .arg(-1)
+            .query_async(conn)
+            .await?;
+        let keys: Vec<String> = nodes
+            .iter()
+            .filter(|id| **id != self.node_id)
+            .map(|id| format!("{NODE_KEY_PREFIX}{id}"))
+            .collect();
+        if keys.is_empty() {
+            return Ok(RemoteView::default());
+        }
+        let payloads: Vec<Option<Vec<u8>>> =
+            redis::cmd("MGET").arg(&keys).query_async(conn).await?;
+        let snapshots: Vec<NodeSnapshot> = payloads
+            .into_iter()
+            .flatten()
+            .filter_map(|p| match bincode::decode_from_slice(&p, wire_config()) {
+                Ok((snapshot, _)) => Some(snapshot),
+                Err(e) => {
+                    warn!("Skipping unreadable cluster snapshot: {}", e);
+                    None
+                }
+            })
+            .collect();
+        Ok(RemoteView::new(snapshots))
+    }
+}
+
+/// Devices of this node that can take a task now.
+fn local_devices(scheduler: &InferenceScheduler) -> Vec<PublishedDevice> {
+    let registry = scheduler.registry();
+    let mut devices = Vec::with_capacity(registry.len());
+    registry.for_each(|id, info| {
+        if !info.authed || !info.accepts_tasks() {
+            return;
+        }
+        devices.push(PublishedDevice {
+            id: *id,
+            models: info
+                .models()
+                .map(|models| models.iter().map(|m| m.id.clone()).collect())
+                .unwrap_or_default(),
+            wait: scheduler.score(info) as f32,
+            inflight: info.stats.inflight().max(info.load.reported_busy()),
+            context_window: info.context_window(),
+        });
+    });
+    devices
+}
+
+/// Stream one relayed task's events back to the node that sent it.
+async fn forward_relayed(
+    scheduler: Arc<InferenceScheduler>,
+    task: ChatTask,
+    writer: Arc<tokio::sync::Mutex<OwnedWriteHalf>>,
+    running: Arc<Mutex<HashMap<String, ClientId>>>,
+) {
+    let task_id = task.task_id.clone();
+    let device_id = task.device_id;
+    let send = |event: StreamEvent| {
+        let writer = writer.clone();
+        let msg = RelayMessage::Event {
+            task_id: task_id.clone(),
+            event,
+        };
+        async move { write_frame(&mut *writer.lock().await, &msg).await }
+    };
+    match scheduler.run_relayed_chat(task).await {
+        Ok(mut rx) => {
+            while let Some(ev) = rx.recv().await {
+                let done = matches!(ev, StreamEvent::Done);
+                if send(ev).await.is_err() {
+                    let _ = scheduler.cancel_inference(&task_id, &device_id).await;
+                    break;
+                }
+                if done {
+                    break;
+                }
+            }
+        }
+        Err(e) => {
+            let _ = send(StreamEvent::Error(e.to_string())).await;
+            let _ = send(StreamEvent::Done).await;
+        }
+    }
+    running
+        .lock()
+        .unwrap_or_else(|e| e.into_inner())
+        .remove(&task_id);
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use common::OutputPhase;
+
+    fn device(id: u8, models: &[&str], wait: f32, context_window: u32) -> PublishedDevice {
+        PublishedDevice {
+            id: ClientId([id; 16]),
+            models: models.iter().map(|m| m.to_string()).collect(),
+            wait,
+            inflight: 0,
+            context_window,
+        }
+    }
+
+    fn view() -> RemoteView {
+        RemoteView::new(vec![
+            NodeSnapshot {
+                node_id: "a".to_string(),
+                addr: "10.0.0.1:17100".to_string(),
+                devices: vec![
+                    device(1, &["llama"], 1.0, 0),
+                    device(2, &["qwen"], 1.0, 512),
+                ],
+            },
+            NodeSnapshot {
+                node_id: "b".to_string(),
+                addr: "10.0.0.2:17100".to_string(),
+                devices: vec![device(3, &["qwen"], 2.0, 0), device(1, &["llama"], 1.0, 0)],
+            },
+        ])
+    }
+
+    #[test]
+    fn test_view_places_by_model_context_and_allowed() {
+        let view = view();
+        assert_eq!(view.devices.len(), 3);
+        assert_eq!(view.by_model["qwen"].len(), 2);
+
+        let llama = view.place(Some("llama"), None, 100).unwrap();
+        assert_eq!(llama.published.id, ClientId([1; 16]));
+        assert_eq!(view.addrs[llama.node], "10.0.0.1:17100");
+
+        // Device 2 serves qwen but its context is too small.
+        let qwen = view.place(Some("qwen"), None, 4096).unwrap();
+        assert_eq!(qwen.published.id, ClientId([3; 16]));
+
+        let allowed = [ClientId([2; 16])];
+        assert!(view.place(Some("llama"), Some(&allowed), 0).is_none());
+        let any = view.place(None, Some(&allowed), 0).unwrap();
+        assert_eq!(any.published.id, ClientId([2; 16]));
+        assert!(view.place(Some("mistral"), None, 0).is_none());
+    }
+
+    #[test]
+    fn test_relayed_tasks_raise_wait() {
+        let view = view();
+        let device = &view.devices[view.by_id[&ClientId([1; 16])]];
+        assert_eq!(device.wait(), 1.0);
+        device.relayed.fetch_add(2, Ordering::Relaxed);
+        assert_eq!(device.wait(), 3.0);
+    }
+
+    #[test]
+    fn test_secrets_match() {
+        assert!(secrets_match("s3cret", "s3cret"));
+        assert!(!secrets_match("s3crex", "s3cret"));
+        assert!(!secrets_match("s3cre", "s3cret"));
+        assert!(!secrets_match("", ""));
+    }
+
+    #[tokio::test]
+    async fn test_frame_round_trip() {
+        let (mut a, mut b) = tokio::io::duplex(1024);
+        let event = RelayMessage::Event {
+            task_id: "t1".to_string(),
+            event: StreamEvent::Delta("hi".to_string(), OutputPhase::Final),
+        };
+        write_frame(&mut a, &event).await.unwrap();
+        write_frame(
+            &mut a,
+            &RelayMessage::Cancel {
+                task_id: "t1".to_string(),
+                device_id: ClientId([9; 16]),
+            },
+        )
+        .await
+        .unwrap();
+
+        let mut buf = Vec::new();
+        assert!(matches!(
+            read_frame(&mut b, &mut buf).await.unwrap(),
+            RelayMessage::Event { task_id, event: StreamEvent::Delta(text, OutputPhase::Final) }
+                if task_id == "t1" && text == "hi"
+        ));
+        assert!(matches!(
+            read_frame(&mut b, &mut buf).await.unwrap(),
+            RelayMessage::Cancel { device_id, .. } if device_id == ClientId([9; 16])
+        ));
+    }
+}
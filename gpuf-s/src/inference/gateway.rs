@@ -6,21 +6,22 @@ use axum::{
     routing::{get, post},
     Router,
 };
-use rdkafka::producer::FutureProducer;
 use sqlx::{Pool, Postgres};
 use std::sync::Arc;
 use tower_http::cors::CorsLayer;
 use tracing::{debug, error, info};
 
-use crate::db::client::get_user_client_by_token;
+use crate::db::token_cache::TokenCache;
 #[cfg(feature = "experimental")]
 use crate::handle::ActiveClients;
-use crate::inference::{handlers, InferenceScheduler};
+use crate::inference::{handlers, response_cache::ResponseCache, InferenceScheduler};
+use crate::util::kafka::{self, KafkaSink};
+use crate::util::pack::BufferPool;
 use crate::util::protoc::{ClientId, RequestIDAndClientIDMessage};
+#[cfg(all(feature = "xdp", target_os = "linux"))]
+use crate::xdp::xdp_filter::XdpFilter;
 use crate::util::policy::{AccessLevel, REQUEST_MESSAGE_TOPIC};
 use anyhow::anyhow;
-use rdkafka::producer::FutureRecord;
-use std::time::Duration;
 
 #[derive(Clone, Debug)]
 pub struct AuthContext {
@@ -33,37 +34,73 @@ pub struct AuthContext {
 pub struct InferenceGateway {
     pub scheduler: Arc<InferenceScheduler>,
     pub db_pool: Arc<Pool<Postgres>>,
-    pub producer: Arc<FutureProducer>,
+    pub token_cache: Arc<TokenCache>,
+    pub kafka: Arc<KafkaSink>,
+    /// Pools reported by the buffer metrics route, by name.
+    pub buffer_pools: Vec<(&'static str, Arc<BufferPool>)>,
+    /// Replays deterministic chat completions when enabled.
+    pub response_cache: Option<Arc<ResponseCache>>,
+    /// Reported by the XDP metrics route when the prefilter is attached.
+    #[cfg(all(feature = "xdp", target_os = "linux"))]
+    pub xdp_filter: Option<Arc<XdpFilter>>,
 }
 
 impl InferenceGateway {
     pub fn new(
         scheduler: Arc<InferenceScheduler>,
         db_pool: Arc<Pool<Postgres>>,
-        producer: Arc<FutureProducer>,
+        token_cache: Arc<TokenCache>,
+        kafka: Arc<KafkaSink>,
     ) -> Self {
         Self {
             scheduler,
             db_pool,
-            producer,
+            token_cache,
+            kafka,
+            buffer_pools: Vec::new(),
+            response_cache: None,
+            #[cfg(all(feature = "xdp", target_os = "linux"))]
+            xdp_filter: None,
         }
     }
     #[cfg(feature = "experimental")]
     pub fn with_active_clients(
         active_clients: ActiveClients,
         db_pool: Arc<Pool<Postgres>>,
-        producer: Arc<FutureProducer>,
+        token_cache: Arc<TokenCache>,
+        kafka: Arc<KafkaSink>,
     ) -> Self {
         let scheduler = Arc::new(InferenceScheduler::new(active_clients));
         Self {
             scheduler,
             db_pool,
-            producer,
+            token_cache,
+            kafka,
+            buffer_pools: Vec::new(),
+            response_cache: None,
+            #[cfg(all(feature = "xdp", target_os = "linux"))]
+            xdp_filter: None,
         }
     }
 
+    pub fn with_buffer_pools(mut self, pools: Vec<(&'static str, Arc<BufferPool>)>) -> Self {
+        self.buffer_pools = pools;
+        self
+    }
+
+    pub fn with_response_cache(mut self, cache: Option<Arc<ResponseCache>>) -> Self {
+        self.response_cache = cache;
+        self
+    }
+
+    #[cfg(all(feature = "xdp", target_os = "linux"))]
+    pub fn with_xdp_filter(mut self, xdp_filter: Option<Arc<XdpFilter>>) -> Self {
+        self.xdp_filter = xdp_filter;
+        self
+    }
+
     async fn auth_middleware(
-        axum::extract::State(db_pool): axum::extract::State<Arc<Pool<Postgres>>>,
+        axum::extract::State(gateway): axum::extract::State<Arc<Self>>,
         req: Request<axum::body::Body>,
         next: Next,
     ) -> Response {
@@ -83,12 +120,16 @@ impl InferenceGateway {
             return StatusCode::UNAUTHORIZED.into_response();
         };
         debug!("Received token: {}", token);
-        match get_user_client_by_token(&db_pool, token.as_str()).await {
-            Ok((client_ids, access_level)) => {
+        match gateway
+            .token_cache
+            .lookup(&gateway.db_pool, token.as_str())
+            .await
+        {
+            Ok(clients) => {
                 let mut req = req;
                 req.extensions_mut().insert(AuthContext {
-                    client_ids,
-                    access_level,
+                    client_ids: clients.client_ids.clone(),
+                    access_level: clients.access_level,
                     token,
                 });
                 next.run(req).await
@@ -97,8 +138,8 @@ impl InferenceGateway {
         }
     }
 
-    /// Send request metrics to Kafka if access_level requires it
-    pub async fn send_request_metrics(
+    /// Queue request metrics for Kafka if access_level requires it
+    pub fn send_request_metrics(
         &self,
         request_id: Option<String>,
         chosen_client_id: ClientId,
@@ -123,17 +164,11 @@ impl InferenceGateway {
                 client_id: chosen_client_id.0,
             };
 
-            let request_message_bytes = serde_json::to_vec(&message)?;
-
-            self.producer
-                .send(
-                    FutureRecord::to(REQUEST_MESSAGE_TOPIC)
-                        .payload(&request_message_bytes)
-                        .key(&chosen_client_id.to_string()),
-                    Duration::from_secs(0),
-                )
-                .await
-                .map_err(|(e, _)| anyhow!("Failed to send to Kafka: {}", e))?;
+            self.kafka.publish(
+                REQUEST_MESSAGE_TOPIC,
+                chosen_client_id.to_string(),
+                kafka::encode(&message)?,
+            );
         }
 
         Ok(())
@@ -151,7 +186,7 @@ impl InferenceGateway {
     /// Create API router for inference endpoints
     pub async fn create_router(self: Arc<Self>) -> Router {
         let state = Arc::clone(&self);
-        Router::new()
+        let router = Router::new()
             // OpenAI Compatible Inference APIs
             .route("/v1/completions", post(handlers::handle_completion))
             .route(
@@ -165,8 +200,23 @@ impl InferenceGateway {
                 "/api/v1/devices/:id/status",
                 get(handlers::get_device_status),
             )
+            .route(
+                "/api/v1/metrics/buffer_pools",
+                get(handlers::buffer_pool_stats),
+            )
+            .route("/api/v1/metrics/kafka", get(handlers::kafka_stats))
+            .route("/api/v1/metrics/admission", get(handlers::admission_stats))
+            .route("/api/v1/metrics/cluster", get(handlers::cluster_stats))
+            .route(
+                "/api/v1/metrics/response-cache",
+                get(handlers::response_cache_stats),
+            )
+            .route("/metrics", get(handlers::prometheus_metrics));
+        #[cfg(all(feature = "xdp", target_os = "linux"))]
+        let router = router.route("/api/v1/metrics/xdp", get(handlers::xdp_stats));
+        router
             .route_layer(middleware::from_fn_with_state(
-                self.db_pool.clone(),
+                self.clone(),
                 Self::auth_middleware,
             ))
             .layer(CorsLayer::permissive())
@@ -1,26 +1,34 @@
 use axum::{
+    body::Body,
     extract::{Extension, Path, State},
-    http::{HeaderMap, StatusCode},
-    response::{sse::Event, sse::Sse, IntoResponse, Response},
+    http::{header, HeaderMap, StatusCode},
+    response::{IntoResponse, Response},
     Json,
 };
-use futures_util::StreamExt;
 use serde_json::{json, Value};
+use std::collections::HashMap;
 use std::str::FromStr;
-use std::sync::atomic::{AtomicBool, Ordering};
 use std::sync::Arc;
-use tokio::sync::Mutex;
-use tokio_stream::wrappers::ReceiverStream;
+use std::time::{Duration, Instant};
+use tokio::sync::mpsc;
 use tracing::{debug, error, info};
 
 use crate::inference::{
+    admission::{Admission, AdmissionStats},
+    cluster::ClusterStats,
     gateway::{AuthContext, InferenceGateway},
+    latency::Stage,
+    response_cache::{CacheKey, ChatKey, Lookup, ResponseCacheStats, REPLAY_DEVICE},
     scheduler::{
         ChatCompletionRequest, ChatCompletionResponse, CompletionRequest, DeviceInfo, ModelInfo,
         StreamEvent,
     },
+    sse::{ChunkKind, ChunkWriter},
 };
+use crate::util::kafka::SinkStats;
+use crate::util::pack::BufferPoolStats;
 use crate::util::protoc::ClientId;
+use common::markers::{MarkerSet, MarkerStream, Piece};
 use common::OutputPhase;
 
 #[cfg(feature = "experimental")]
@@ -45,20 +53,27 @@ fn detect_model_family(model_name: &str) -> ModelFamily {
 }
 
 #[cfg(feature = "experimental")]
-fn stop_markers_for_family(family: ModelFamily) -> &'static [&'static str] {
+fn stop_markers_for_family(family: ModelFamily) -> &'static MarkerSet<()> {
+    static LLAMA3: std::sync::OnceLock<MarkerSet<()>> = std::sync::OnceLock::new();
+    static CHATML: std::sync::OnceLock<MarkerSet<()>> = std::sync::OnceLock::new();
+    static LEGACY: std::sync::OnceLock<MarkerSet<()>> = std::sync::OnceLock::new();
     match family {
-        ModelFamily::Llama3Instruct => &["<|eot_id|>", "\n\n###"],
-        ModelFamily::ChatMLLike => &[
-            "<|end|>",
-            "<|start|>",
-            "<|channel|>",
-            "<|call|>",
-            "<|tool|>",
-            "<|im_end|>",
-            "<|im_start|>",
-            "\n\n###",
-        ],
-        ModelFamily::LegacyHashPrompt => &["\n\n###"],
+        ModelFamily::Llama3Instruct => {
+            LLAMA3.get_or_init(|| MarkerSet::new(&[("<|eot_id|>", ()), ("\n\n###", ())]))
+        }
+        ModelFamily::ChatMLLike => CHATML.get_or_init(|| {
+            MarkerSet::new(&[
+                ("<|end|>", ()),
+                ("<|start|>", ()),
+                ("<|channel|>", ()),
+                ("<|call|>", ()),
+                ("<|tool|>", ()),
+                ("<|im_end|>", ()),
+                ("<|im_start|>", ()),
+                ("\n\n###", ()),
+            ])
+        }),
+        ModelFamily::LegacyHashPrompt => LEGACY.get_or_init(|| MarkerSet::new(&[("\n\n###", ())])),
     }
 }
 
@@ -91,77 +106,142 @@ struct StreamCancelGuard {
     scheduler: Arc<crate::inference::InferenceScheduler>,
     task_id: String,
     device_id: ClientId,
-    finished: Arc<AtomicBool>,
+    finished: bool,
 }
 
 struct StopMarkerState {
     stopped: bool,
-    carry: String,
-    markers: &'static [&'static str],
+    /// None when there are no stop markers, so text passes straight through.
+    stream: Option<MarkerStream<()>>,
 }
 
 impl StopMarkerState {
-    fn new(markers: &'static [&'static str]) -> Self {
+    fn new(markers: Option<&'static MarkerSet<()>>) -> Self {
         Self {
             stopped: false,
-            carry: String::new(),
-            markers,
+            stream: markers.map(MarkerStream::new),
         }
     }
 
-    fn flush(&mut self) -> String {
-        std::mem::take(&mut self.carry)
+    /// The held-back tail, at the end of a stream that did not stop early.
+    fn flush(&mut self) -> &str {
+        match self.stream.as_mut() {
+            Some(stream) if !self.stopped => stream.finish(),
+            _ => "",
+        }
     }
 
-    fn consume(&mut self, text: &str) -> (String, bool) {
+    /// The part of `text` to send on, borrowed from `text` itself or from
+    /// the matcher's buffer.
+    fn consume<'a>(&'a mut self, text: &'a str) -> &'a str {
         if self.stopped {
-            return (String::new(), true);
+            return "";
         }
-
-        let combined = if self.carry.is_empty() {
-            text.to_string()
-        } else {
-            let mut s = std::mem::take(&mut self.carry);
-            s.push_str(text);
-            s
+        let Some(stream) = self.stream.as_mut() else {
+            return text;
         };
 
-        let mut stop_at: Option<usize> = None;
-        for m in self.markers {
-            if let Some(idx) = combined.find(m) {
-                stop_at = Some(stop_at.map(|cur| cur.min(idx)).unwrap_or(idx));
+        let mut out = "";
+        for piece in stream.push(text) {
+            match piece {
+                Piece::Text(s) => out = s,
+                Piece::Marker(()) => {
+                    self.stopped = true;
+                    break;
+                }
             }
         }
-        if let Some(idx) = stop_at {
-            self.stopped = true;
-            return (combined[..idx].to_string(), true);
-        }
+        out
+    }
+}
 
-        let keep = self
-            .markers
-            .iter()
-            .map(|m| m.len())
-            .max()
-            .unwrap_or(0)
-            .saturating_sub(1);
-        if combined.len() > keep {
-            let mut split_at = combined.len() - keep;
-            while split_at > 0 && !combined.is_char_boundary(split_at) {
-                split_at -= 1;
+/// Largest body frame packed from events already waiting in the channel.
+const MAX_SSE_FRAME_BYTES: usize = 64 * 1024;
+
+/// SSE body of a streamed completion.
+struct SseStream {
+    rx: mpsc::Receiver<StreamEvent>,
+    writer: ChunkWriter,
+    /// Latency labels of the task.
+    model: String,
+    device_class: &'static str,
+    stop: StopMarkerState,
+    guard: StreamCancelGuard,
+    max_tokens: u32,
+    done: bool,
+}
+
+impl SseStream {
+    fn write(&mut self, ev: StreamEvent) {
+        match ev {
+            StreamEvent::Delta(text, phase) => {
+                let out = self.stop.consume(&text);
+                if !out.is_empty() {
+                    self.writer.delta(phase, out);
+                }
+            }
+            StreamEvent::Finish(usage) => {
+                let finish_reason = usage
+                    .as_ref()
+                    .filter(|u| u.completion_tokens >= self.max_tokens)
+                    .map(|_| "length")
+                    .unwrap_or("stop");
+                let tail = self.stop.flush();
+                self.writer.finish(tail, finish_reason, usage.as_ref());
+            }
+            StreamEvent::Error(msg) => self.writer.error(&msg),
+            StreamEvent::Done => {
+                self.guard.finished = true;
+                self.writer.done();
+                self.done = true;
             }
-            let (out, tail) = combined.split_at(split_at);
-            self.carry = tail.to_string();
-            (out.to_string(), false)
-        } else {
-            self.carry = combined;
-            (String::new(), false)
         }
     }
+
+    /// Each body frame holds every event already queued when the client
+    /// polls for more, so a slow reader gets fewer, larger frames instead of
+    /// a backlog of one-token ones.
+    fn respond(self) -> Response {
+        let body = futures_util::stream::unfold(self, |mut st| async move {
+            loop {
+                if st.done {
+                    return None;
+                }
+                let ev = st.rx.recv().await?;
+                let packing = Instant::now();
+                st.write(ev);
+                while !st.done && st.writer.len() < MAX_SSE_FRAME_BYTES {
+                    match st.rx.try_recv() {
+                        Ok(ev) => st.write(ev),
+                        Err(_) => break,
+                    }
+                }
+                if !st.writer.is_empty() {
+                    let frame = st.writer.take();
+                    st.guard.scheduler.latency().record(
+                        Stage::SseWrite,
+                        &st.model,
+                        st.device_class,
+                        packing.elapsed(),
+                    );
+                    return Some((Ok::<_, std::convert::Infallible>(frame), st));
+                }
+            }
+        });
+        (
+            [
+                (header::CONTENT_TYPE, "text/event-stream"),
+                (header::CACHE_CONTROL, "no-cache"),
+            ],
+            Body::from_stream(body),
+        )
+            .into_response()
+    }
 }
 
 impl Drop for StreamCancelGuard {
     fn drop(&mut self) {
-        if self.finished.load(Ordering::SeqCst) {
+        if self.finished {
             return;
         }
         let scheduler = self.scheduler.clone();
@@ -176,6 +256,17 @@ impl Drop for StreamCancelGuard {
 // OpenAI Compatible API Handlers
 
 /// Handle text completion requests
+/// Queue class, fairness key and deadline of a request. Clients may set how
+/// long they are willing to wait for a device with `x-queue-timeout-ms`.
+fn admission_for(auth: &AuthContext, headers: &HeaderMap) -> Admission {
+    let wait = headers
+        .get("x-queue-timeout-ms")
+        .and_then(|v| v.to_str().ok())
+        .and_then(|s| s.trim().parse::<u64>().ok())
+        .map(Duration::from_millis);
+    Admission::new(auth.access_level, &auth.token, wait)
+}
+
 pub async fn handle_completion(
     State(gateway): State<Arc<InferenceGateway>>,
     Extension(auth): Extension<AuthContext>,
@@ -241,6 +332,8 @@ pub async fn handle_completion(
         }
     }
 
+    let admission = admission_for(&auth, &headers);
+
     if request.stream.unwrap_or(false) {
         let max_tokens_effective: u32 = request.max_tokens.unwrap_or(4090);
         let model_name = request.model.clone().unwrap_or_else(|| "gpuf".to_string());
@@ -256,114 +349,33 @@ pub async fn handle_completion(
 
         let stream_res = gateway
             .scheduler
-            .execute_inference_stream(request, Some(allowed_ids))
+            .execute_inference_stream(request, Some(allowed_ids), &admission)
             .await;
 
         match stream_res {
             Ok((task_id, device_id, rx)) => {
-                if auth.access_level.is_metered() {
-                    let gateway = gateway.clone();
-                    let request_id = request_id.clone();
-                    let access_level = auth.access_level;
-                    tokio::spawn(async move {
-                        if let Err(e) = gateway
-                            .send_request_metrics(request_id, device_id, access_level)
-                            .await
-                        {
-                            error!("Failed to send request metrics: {}", e);
-                        }
-                    });
+                if let Err(e) =
+                    gateway.send_request_metrics(request_id.clone(), device_id, auth.access_level)
+                {
+                    error!("Failed to send request metrics: {}", e);
                 }
 
-                let finished = Arc::new(AtomicBool::new(false));
-                let guard = Arc::new(StreamCancelGuard {
-                    scheduler: gateway.scheduler.clone(),
-                    task_id: task_id.clone(),
-                    device_id,
-                    finished: finished.clone(),
-                });
-                let stop_state: Arc<Mutex<StopMarkerState>> =
-                    Arc::new(Mutex::new(StopMarkerState::new(&[])));
-                let s = ReceiverStream::new(rx)
-                    .then(move |ev| {
-                        let guard = guard.clone();
-                        let stop_state = stop_state.clone();
-                        let task_id = task_id.clone();
-                        let model_name = model_name.clone();
-                        let finished = finished.clone();
-                        async move {
-                            let _guard = guard;
-                            let data = match ev {
-                                StreamEvent::Delta(text, _phase) => {
-                                    let text = {
-                                        let mut st = stop_state.lock().await;
-                                        let (out, _hit_stop) = st.consume(&text);
-                                        out
-                                    };
-
-                                    if text.is_empty() {
-                                        return None;
-                                    }
-                                    let payload = json!({
-                                        "id": task_id,
-                                        "object": "text_completion",
-                                        "created": created,
-                                        "model": model_name,
-                                        "choices": [{
-                                            "index": 0,
-                                            "text": text,
-                                            "finish_reason": null
-                                        }]
-                                    });
-                                    payload.to_string()
-                                }
-                                StreamEvent::Finish(usage) => {
-                                    let tail = {
-                                        let mut st = stop_state.lock().await;
-                                        if st.stopped {
-                                            String::new()
-                                        } else {
-                                            st.flush()
-                                        }
-                                    };
-                                    let finish_reason = usage
-                                        .as_ref()
-                                        .filter(|u| u.completion_tokens >= max_tokens_effective)
-                                        .map(|_| "length")
-                                        .unwrap_or("stop");
-                                    let payload = json!({
-                                        "id": task_id,
-                                        "object": "text_completion",
-                                        "created": created,
-                                        "model": model_name,
-                                        "choices": [{
-                                            "index": 0,
-                                            "text": tail,
-                                            "finish_reason": finish_reason
-                                        }],
-                                        "usage": usage
-                                    });
-                                    payload.to_string()
-                                }
-                                StreamEvent::Error(msg) => {
-                                    let payload = json!({
-                                        "error": {"message": msg, "type": "api_error", "code": 500}
-                                    });
-                                    payload.to_string()
-                                }
-                                StreamEvent::Done => {
-                                    finished.store(true, Ordering::SeqCst);
-                                    "[DONE]".to_string()
-                                }
-                            };
-                            Some(Ok::<Event, std::convert::Infallible>(
-                                Event::default().data(data),
-                            ))
-                        }
-                    })
-                    .filter_map(|ev| async move { ev });
-
-                return Sse::new(s).into_response();
+                let stream = SseStream {
+                    rx,
+                    writer: ChunkWriter::new(ChunkKind::Completion, &task_id, &model_name, created),
+                    model: model_name,
+                    device_class: gateway.scheduler.device_class(&device_id),
+                    stop: StopMarkerState::new(None),
+                    guard: StreamCancelGuard {
+                        scheduler: gateway.scheduler.clone(),
+                        task_id,
+                        device_id,
+                        finished: false,
+                    },
+                    max_tokens: max_tokens_effective,
+                    done: false,
+                };
+                return stream.respond();
             }
             Err(e) => {
                 error!("Completion request failed: {}", e);
@@ -384,17 +396,18 @@ pub async fn handle_completion(
 
     match gateway
         .scheduler
-        .execute_inference(request, Some(allowed_ids))
+        .execute_inference(request, Some(allowed_ids), &admission)
         .await
     {
         Ok(response) => {
             // Send metrics to Kafka if needed
             if auth.access_level.is_metered() {
                 if let Some(chosen_client_id) = auth.client_ids.first() {
-                    if let Err(e) = gateway
-                        .send_request_metrics(request_id, *chosen_client_id, auth.access_level)
-                        .await
-                    {
+                    if let Err(e) = gateway.send_request_metrics(
+                        request_id,
+                        *chosen_client_id,
+                        auth.access_level,
+                    ) {
                         error!("Failed to send request metrics: {}", e);
                         // Don't fail the request, just log the error
                     }
@@ -512,6 +525,8 @@ pub async fn handle_chat_completion(
         }
     }
 
+    let admission = admission_for(&auth, &headers);
+
     if request.stream.unwrap_or(false) {
         let max_tokens_effective: u32 = request.max_tokens.unwrap_or(4090);
         let model_name = request.model.clone().unwrap_or_else(|| "gpuf".to_string());
@@ -525,140 +540,43 @@ pub async fn handle_chat_completion(
             .map(std::slice::from_ref)
             .unwrap_or(auth.client_ids.as_slice());
         debug!("Allowed IDs: {:?}", allowed_ids);
-        let stream_res = gateway
-            .scheduler
-            .execute_chat_inference_stream(
-                model_name.clone(),
-                request.messages.clone(),
-                request.max_tokens.unwrap_or(4090),
-                request.temperature.unwrap_or(0.7),
-                request.top_k.unwrap_or(40),
-                request.top_p.unwrap_or(0.9),
-                request.repeat_penalty.unwrap_or(1.1),
-                request.repeat_last_n.unwrap_or(64),
-                request.min_keep.unwrap_or(1),
-                Some(allowed_ids),
-            )
-            .await;
+        let stream_res = start_chat_stream(
+            &gateway,
+            &request,
+            &model_name,
+            allowed_ids,
+            &admission,
+        )
+        .await;
 
         match stream_res {
-            Ok((task_id, device_id, rx)) => {
-                if auth.access_level.is_metered() {
-                    let gateway = gateway.clone();
-                    let request_id = request_id.clone();
-                    let access_level = auth.access_level;
-                    tokio::spawn(async move {
-                        if let Err(e) = gateway
-                            .send_request_metrics(request_id, device_id, access_level)
-                            .await
-                        {
-                            error!("Failed to send request metrics: {}", e);
-                        }
-                    });
+            Ok((task_id, device_id, rx, origin)) => {
+                if let Err(e) = gateway.send_request_metrics(
+                    request_id.clone(),
+                    origin.metered_device(device_id),
+                    auth.access_level,
+                ) {
+                    error!("Failed to send request metrics: {}", e);
                 }
 
-                let finished = Arc::new(AtomicBool::new(false));
-                let guard = Arc::new(StreamCancelGuard {
-                    scheduler: gateway.scheduler.clone(),
-                    task_id: task_id.clone(),
-                    device_id,
-                    finished: finished.clone(),
-                });
-                let stop_state: Arc<Mutex<StopMarkerState>> =
-                    Arc::new(Mutex::new(StopMarkerState::new(&[])));
-                let s = ReceiverStream::new(rx)
-                    .then(move |ev| {
-                        let guard = guard.clone();
-                        let stop_state = stop_state.clone();
-                        let task_id = task_id.clone();
-                        let model_name = model_name.clone();
-                        let finished = finished.clone();
-                        async move {
-                            let _guard = guard;
-                            let data = match ev {
-                                StreamEvent::Delta(text, phase) => {
-                                    let text = {
-                                        let mut st = stop_state.lock().await;
-                                        let (out, _hit_stop) = st.consume(&text);
-                                        out
-                                    };
-
-                                    if text.is_empty() {
-                                        return None;
-                                    }
-
-                                    let delta = match phase {
-                                        OutputPhase::Analysis => {
-                                            json!({"role": "assistant", "reasoning_content": text})
-                                        }
-                                        _ => json!({"role": "assistant", "content": text}),
-                                    };
-                                    let payload = json!({
-                                        "id": task_id,
-                                        "object": "chat.completion.chunk",
-                                        "created": created,
-                                        "model": model_name,
-                                        "choices": [{
-                                            "index": 0,
-                                            "delta": delta,
-                                            "finish_reason": null
-                                        }]
-                                    });
-                                    payload.to_string()
-                                }
-                                StreamEvent::Finish(usage) => {
-                                    let tail = {
-                                        let mut st = stop_state.lock().await;
-                                        if st.stopped {
-                                            String::new()
-                                        } else {
-                                            st.flush()
-                                        }
-                                    };
-                                    let finish_reason = usage
-                                        .as_ref()
-                                        .filter(|u| u.completion_tokens >= max_tokens_effective)
-                                        .map(|_| "length")
-                                        .unwrap_or("stop");
-
-                                    let delta = if tail.is_empty() {
-                                        json!({"role": "assistant"})
-                                    } else {
-                                        json!({"role": "assistant", "content": tail})
-                                    };
-                                    let payload = json!({
-                                        "id": task_id,
-                                        "object": "chat.completion.chunk",
-                                        "created": created,
-                                        "model": model_name,
-                                        "choices": [{
-                                            "index": 0,
-                                            "delta": delta,
-                                            "finish_reason": finish_reason
-                                        }],
-                                        "usage": usage
-                                    });
-                                    payload.to_string()
-                                }
-                                StreamEvent::Error(msg) => {
-                                    let payload = json!({
-                                        "error": {"message": msg, "type": "api_error", "code": 500}
-                                    });
-                                    payload.to_string()
-                                }
-                                StreamEvent::Done => {
-                                    finished.store(true, Ordering::SeqCst);
-                                    "[DONE]".to_string()
-                                }
-                            };
-                            Some(Ok::<Event, std::convert::Infallible>(
-                                Event::default().data(data),
-                            ))
-                        }
-                    })
-                    .filter_map(|ev| async move { ev });
-
-                return Sse::new(s).into_response();
+                let stream = SseStream {
+                    rx,
+                    writer: ChunkWriter::new(ChunkKind::Chat, &task_id, &model_name, created),
+                    model: model_name,
+                    device_class: gateway.scheduler.device_class(&device_id),
+                    stop: StopMarkerState::new(None),
+                    guard: StreamCancelGuard {
+                        scheduler: gateway.scheduler.clone(),
+                        task_id,
+                        device_id,
+                        // A cached stream is cancelled by the cache once
+                        // every request reading it has gone.
+                        finished: origin != ChatOrigin::Device,
+                    },
+                    max_tokens: max_tokens_effective,
+                    done: false,
+                };
+                return stream.respond();
             }
             Err(e) => {
                 error!("Chat completion request failed: {}", e);
@@ -680,37 +598,24 @@ pub async fn handle_chat_completion(
         .as_ref()
         .map(std::slice::from_ref)
         .unwrap_or(auth.client_ids.as_slice());
-    
-    let stream_res = gateway
-        .scheduler
-        .execute_chat_inference_stream(
-            model_name.clone(),
-            request.messages.clone(),
-            request.max_tokens.unwrap_or(4090),
-            request.temperature.unwrap_or(0.7),
-            request.top_k.unwrap_or(40),
-            request.top_p.unwrap_or(0.9),
-            request.repeat_penalty.unwrap_or(1.1),
-            request.repeat_last_n.unwrap_or(64),
-            request.min_keep.unwrap_or(1),
-            Some(allowed_ids),
-        )
-        .await;
+
+    let stream_res = start_chat_stream(
+        &gateway,
+        &request,
+        &model_name,
+        allowed_ids,
+        &admission,
+    )
+    .await;
 
     match stream_res {
-        Ok((task_id, device_id, mut rx)) => {
-            if auth.access_level.is_metered() {
-                let gateway = gateway.clone();
-                let request_id = request_id.clone();
-                let access_level = auth.access_level;
-                tokio::spawn(async move {
-                    if let Err(e) = gateway
-                        .send_request_metrics(request_id, device_id, access_level)
-                        .await
-                    {
-                        error!("Failed to send request metrics: {}", e);
-                    }
-                });
+        Ok((task_id, device_id, mut rx, origin)) => {
+            if let Err(e) = gateway.send_request_metrics(
+                request_id.clone(),
+                origin.metered_device(device_id),
+                auth.access_level,
+            ) {
+                error!("Failed to send request metrics: {}", e);
             }
 
             let mut text = String::new();
@@ -743,6 +648,7 @@ pub async fn handle_chat_completion(
                 total_tokens: 0,
                 analysis_tokens: None,
                 final_tokens: None,
+                speculative: None,
             });
             let max_tokens_effective: u32 = request.max_tokens.unwrap_or(1024);
             let finish_reason = if usage.completion_tokens >= max_tokens_effective {
@@ -779,6 +685,117 @@ pub async fn handle_chat_completion(
     }
 }
 
+/// Run a chat request on a device chosen for it.
+async fn run_chat(
+    gateway: &InferenceGateway,
+    request: &ChatCompletionRequest,
+    model_name: &str,
+    allowed_ids: &[ClientId],
+    admission: &Admission,
+) -> anyhow::Result<(String, ClientId, mpsc::Receiver<StreamEvent>)> {
+    gateway
+        .scheduler
+        .execute_chat_inference_stream(
+            model_name.to_string(),
+            request.messages.clone(),
+            request.max_tokens.unwrap_or(4090),
+            request.temperature.unwrap_or(0.7),
+            request.top_k.unwrap_or(40),
+            request.top_p.unwrap_or(0.9),
+            request.repeat_penalty.unwrap_or(1.1),
+            request.repeat_last_n.unwrap_or(64),
+            request.min_keep.unwrap_or(1),
+            request.draft_tokens.unwrap_or(0),
+            Some(allowed_ids),
+            admission,
+        )
+        .await
+}
+
+/// Where the events of a chat stream come from.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum ChatOrigin {
+    /// Generated for this request only.
+    Device,
+    /// Generated for this request through the cache, which owns cancelling
+    /// the task.
+    Cached,
+    /// Another request's generation, stored or still running.
+    Replay,
+}
+
+impl ChatOrigin {
+    /// Device the request metrics credit: a replay computed nothing here.
+    fn metered_device(self, device_id: ClientId) -> ClientId {
+        match self {
+            ChatOrigin::Replay => REPLAY_DEVICE,
+            ChatOrigin::Device | ChatOrigin::Cached => device_id,
+        }
+    }
+}
+
+/// Start a chat request, through the response cache when it is enabled and
+/// the request samples at temperature 0.
+async fn start_chat_stream(
+    gateway: &InferenceGateway,
+    request: &ChatCompletionRequest,
+    model_name: &str,
+    allowed_ids: &[ClientId],
+    admission: &Admission,
+) -> anyhow::Result<(String, ClientId, mpsc::Receiver<StreamEvent>, ChatOrigin)> {
+    let cache = match &gateway.response_cache {
+        Some(cache) if request.temperature == Some(0.0) => cache,
+        _ => {
+            let (task_id, device_id, rx) =
+                run_chat(gateway, request, model_name, allowed_ids, admission).await?;
+            return Ok((task_id, device_id, rx, ChatOrigin::Device));
+        }
+    };
+
+    let mut devices = allowed_ids.to_vec();
+    devices.sort_unstable();
+    devices.dedup();
+    let key = CacheKey::chat(&ChatKey {
+        model: model_name,
+        messages: &request.messages,
+        max_tokens: request.max_tokens.unwrap_or(4090),
+        top_k: request.top_k.unwrap_or(40),
+        top_p: request.top_p.unwrap_or(0.9),
+        repeat_penalty: request.repeat_penalty.unwrap_or(1.1),
+        repeat_last_n: request.repeat_last_n.unwrap_or(64),
+        min_keep: request.min_keep.unwrap_or(1),
+        devices: &devices,
+    });
+    let leader = match cache.lookup(key).await {
+        Lookup::Hit(source) => {
+            return Ok((
+                uuid::Uuid::new_v4().to_string(),
+                source.device_id,
+                source.rx,
+                ChatOrigin::Replay,
+            ))
+        }
+        Lookup::Join(joined) => {
+            if let Some(source) = joined.attach(cache).await {
+                return Ok((
+                    uuid::Uuid::new_v4().to_string(),
+                    source.device_id,
+                    source.rx,
+                    ChatOrigin::Replay,
+                ));
+            }
+            let (task_id, device_id, rx) =
+                run_chat(gateway, request, model_name, allowed_ids, admission).await?;
+            return Ok((task_id, device_id, rx, ChatOrigin::Device));
+        }
+        Lookup::Miss(leader) => leader,
+    };
+    let (task_id, device_id, rx) =
+        run_chat(gateway, request, model_name, allowed_ids, admission).await?;
+    let rx = leader.tee(gateway.scheduler.clone(), task_id.clone(), device_id, rx);
+    Ok((task_id, device_id, rx, ChatOrigin::Cached))
+}
+
 /// List available models
 pub async fn list_models() -> Json<Vec<ModelInfo>> {
     let models = vec![ModelInfo {
@@ -833,3 +850,82 @@ pub async fn get_device_status(
         Err(StatusCode::NOT_FOUND)
     }
 }
+
+/// Buffer pool counters, for sizing the pools
+pub async fn buffer_pool_stats(
+    State(gateway): State<Arc<InferenceGateway>>,
+) -> Json<HashMap<&'static str, BufferPoolStats>> {
+    Json(
+        gateway
+            .buffer_pools
+            .iter()
+            .map(|(name, pool)| (*name, pool.stats()))
+            .collect(),
+    )
+}
+
+/// Per-stage latency histograms in the Prometheus text format
+pub async fn prometheus_metrics(State(gateway): State<Arc<InferenceGateway>>) -> Response {
+    (
+        [(header::CONTENT_TYPE, "text/plain; version=0.0.4")],
+        gateway.scheduler.latency().render(),
+    )
+        .into_response()
+}
+
+/// Admission queue depth and wait times
+pub async fn admission_stats(State(gateway): State<Arc<InferenceGateway>>) -> Json<AdmissionStats> {
+    Json(gateway.scheduler.admission_stats())
+}
+
+/// Directory size and relay counters of this cluster node
+pub async fn cluster_stats(State(gateway): State<Arc<InferenceGateway>>) -> Response {
+    match gateway.scheduler.cluster() {
+        Some(cluster) => Json::<ClusterStats>(cluster.stats()).into_response(),
+        None => (
+            StatusCode::NOT_FOUND,
+            Json(json!({"error": "Clustering not enabled"})),
+        )
+            .into_response(),
+    }
+}
+
+/// Hit, join and store counters of the response cache
+pub async fn response_cache_stats(State(gateway): State<Arc<InferenceGateway>>) -> Response {
+    match &gateway.response_cache {
+        Some(cache) => Json::<ResponseCacheStats>(cache.stats()).into_response(),
+        None => (
+            StatusCode::NOT_FOUND,
+            Json(json!({"error": "Response cache not enabled"})),
+        )
+            .into_response(),
+    }
+}
+
+/// Delivery and drop counters of the Kafka producer stage
+pub async fn kafka_stats(State(gateway): State<Arc<InferenceGateway>>) -> Json<SinkStats> {
+    Json(gateway.kafka.stats())
+}
+
+/// Per-CPU pass/drop counters of the XDP prefilter.
+#[cfg(all(feature = "xdp", target_os = "linux"))]
+pub async fn xdp_stats(State(gateway): State<Arc<InferenceGateway>>) -> Response {
+    let Some(filter) = &gateway.xdp_filter else {
+        return (
+            StatusCode::NOT_FOUND,
+            Json(json!({"error": "XDP filter not attached"})),
+        )
+            .into_response();
+    };
+    match filter.stats() {
+        Ok(stats) => Json(stats).into_response(),
+        Err(e) => {
+            error!("Failed to read XDP stats: {}", e);
+            (
+                StatusCode::INTERNAL_SERVER_ERROR,
+                Json(json!({"error": "Failed to read XDP stats"})),
+            )
+                .into_response()
+        }
+    }
+}
@@ -0,0 +1,357 @@
+//! Latency histograms for the stages of an inference task.
+//!
+//! The gateway times routing, dispatch, first token, SSE frame writes and
+//! task totals itself. Workers that received RequestTaskTimings add their own
+//! stage times, so prompt building, tokenization, prefill and decode can be
+//! told apart. Samples land in fixed log-spaced buckets per stage, model and
+//! device class, and [`LatencyMetrics::render`] writes them in the Prometheus
+//! text format. Buckets are cumulative counters, so histograms from several
+//! gateways can be summed.
+
+use crate::handle::ClientInfo;
+
+use common::{os_type_str, TaskTimings, TIMING_TOKEN_STRIDE};
+use std::collections::HashMap;
+use std::fmt::Write;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, RwLock};
+use std::time::Duration;
+
+/// Series kept before new models are counted as `other`, since model names
+/// come from requests.
+const MAX_SERIES: usize = 1024;
+
+/// Stage bucket bounds, in microseconds.
+const STAGE_BOUNDS_US: &[u64] = &[
+    100,
+    250,
+    500,
+    1_000,
+    2_500,
+    5_000,
+    10_000,
+    25_000,
+    50_000,
+    100_000,
+    250_000,
+    500_000,
+    1_000_000,
+    2_500_000,
+    5_000_000,
+    10_000_000,
+    30_000_000,
+    60_000_000,
+    120_000_000,
+];
+/// Rate bucket bounds, in tokens per second.
+const RATE_BOUNDS: &[u64] = &[
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1_000, 2_000, 5_000, 10_000,
+];
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum Stage {
+    /// Request received until a device was chosen, admission wait included.
+    Route,
+    /// Writing the task to the device.
+    Dispatch,
+    /// Request received until the first result chunk arrived.
+    FirstToken,
+    /// Packing one SSE body frame.
+    SseWrite,
+    /// Request received until the final chunk arrived.
+    Total,
+    /// Task read until its prompt was built, on the worker.
+    WorkerPrompt,
+    /// Prompt built until it was queued for decoding, on the worker.
+    WorkerTokenize,
+    /// Queued until the first token was sampled, on the worker.
+    WorkerPrefill,
+    /// Time per token over each stride of decoding, on the worker.
+    WorkerDecodeToken,
+}
+
+impl Stage {
+    fn label(self) -> &'static str {
+        match self {
+            Stage::Route => "route",
+            Stage::Dispatch => "dispatch",
+            Stage::FirstToken => "first_token",
+            Stage::SseWrite => "sse_write",
+            Stage::Total => "total",
+            Stage::WorkerPrompt => "worker_prompt",
+            Stage::WorkerTokenize => "worker_tokenize",
+            Stage::WorkerPrefill => "worker_prefill",
+            Stage::WorkerDecodeToken => "worker_decode_token",
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum Rate {
+    Prefill,
+    Decode,
+}
+
+impl Rate {
+    fn label(self) -> &'static str {
+        match self {
+            Rate::Prefill => "prefill",
+            Rate::Decode => "decode",
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+enum Metric {
+    Stage(Stage),
+    Rate(Rate),
+}
+
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+struct SeriesKey {
+    metric: Metric,
+    model: String,
+    class: &'static str,
+}
+
+struct Histogram {
+    bounds: &'static [u64],
+    /// One counter per bound plus the overflow bucket; not cumulative.
+    counts: Box<[AtomicU64]>,
+    sum: AtomicU64,
+}
+
+impl Histogram {
+    fn new(bounds: &'static [u64]) -> Self {
+        Self {
+            bounds,
+            counts: (0..=bounds.len()).map(|_| AtomicU64::new(0)).collect(),
+            sum: AtomicU64::new(0),
+        }
+    }
+
+    fn record(&self, value: u64) {
+        let i = self.bounds.partition_point(|b| *b < value);
+        self.counts[i].fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(value, Ordering::Relaxed);
+    }
+}
+
+/// Device class label of `info`: the OS of its first device.
+pub fn device_class(info: &ClientInfo) -> &'static str {
+    info.devices_info
+        .first()
+        .and_then(|d| os_type_str(&d.os_type))
+        .unwrap_or("unknown")
+}
+
+#[derive(Default)]
+pub struct LatencyMetrics {
+    series: RwLock<HashMap<SeriesKey, Arc<Histogram>>>,
+}
+
+impl LatencyMetrics {
+    pub fn record(&self, stage: Stage, model: &str, class: &'static str, elapsed: Duration) {
+        let us = u64::try_from(elapsed.as_micros()).unwrap_or(u64::MAX);
+        self.histogram(Metric::Stage(stage), model, class, STAGE_BOUNDS_US)
+            .record(us);
+    }
+
+    pub fn record_rate(&self, rate: Rate, model: &str, class: &'static str, tokens_per_sec: f64) {
+        if !tokens_per_sec.is_finite() || tokens_per_sec <= 0.0 {
+            return;
+        }
+        self.histogram(Metric::Rate(rate), model, class, RATE_BOUNDS)
+            .record(tokens_per_sec.round() as u64);
+    }
+
+    /// Fold a worker's stage times into the histograms. Rates need the
+    /// token counts from the task's final chunk.
+    pub fn record_worker(
+        &self,
+        model: &str,
+        class: &'static str,
+        t: &TaskTimings,
+        prompt_tokens: u32,
+        completion_tokens: u32,
+    ) {
+        let us = |v: u32| Duration::from_micros(u64::from(v));
+        if t.prompt_ready_us > 0 {
+            self.record(Stage::WorkerPrompt, model, class, us(t.prompt_ready_us));
+        }
+        if t.submitted_us >= t.prompt_ready_us && t.prompt_ready_us > 0 {
+            let tokenize = t.submitted_us - t.prompt_ready_us;
+            self.record(Stage::WorkerTokenize, model, class, us(tokenize));
+        }
+        if t.first_token_us == 0 || t.first_token_us < t.submitted_us {
+            return;
+        }
+        let prefill = us(t.first_token_us - t.submitted_us);
+        self.record(Stage::WorkerPrefill, model, class, prefill);
+        self.record_rate(
+            Rate::Prefill,
+            model,
+            class,
+            f64::from(prompt_tokens) / prefill.as_secs_f64(),
+        );
+        // Per-token time over each stride, so slowdowns within a task show.
+        let mut last = t.first_token_us;
+        for &mark in &t.token_marks_us {
+            if mark > last {
+                let per_token = us(mark - last) / TIMING_TOKEN_STRIDE;
+                self.record(Stage::WorkerDecodeToken, model, class, per_token);
+            }
+            last = mark;
+        }
+        let decoded = completion_tokens.saturating_sub(1);
+        if decoded > 0 && t.done_us > t.first_token_us {
+            let decode = us(t.done_us - t.first_token_us);
+            self.record_rate(
+                Rate::Decode,
+                model,
+                class,
+                f64::from(decoded) / decode.as_secs_f64(),
+            );
+        }
+    }
+
+    fn histogram(
+        &self,
+        metric: Metric,
+        model: &str,
+        class: &'static str,
+        bounds: &'static [u64],
+    ) -> Arc<Histogram> {
+        let mut key = SeriesKey {
+            metric,
+            model: model.to_string(),
+            class,
+        };
+        if let Some(h) = self.read().get(&key) {
+            return h.clone();
+        }
+        let mut series = self.series.write().unwrap_or_else(|e| e.into_inner());
+        if series.len() >= MAX_SERIES && !series.contains_key(&key) {
+            key.model = "other".to_string();
+        }
+        series
+            .entry(key)
+            .or_insert_with(|| Arc::new(Histogram::new(bounds)))
+            .clone()
+    }
+
+    fn read(&self) -> std::sync::RwLockReadGuard<'_, HashMap<SeriesKey, Arc<Histogram>>> {
+        self.series.read().unwrap_or_else(|e| e.into_inner())
+    }
+
+    /// All histograms in the Prometheus text exposition format.
+    pub fn render(&self) -> String {
+        let series = self.read();
+        let mut keys: Vec<&SeriesKey> = series.keys().collect();
+        keys.sort_by_key(|k| {
+            (
+                matches!(k.metric, Metric::Rate(_)),
+                k.model.as_str(),
+                k.class,
+            )
+        });
+        let mut out = String::new();
+        let families = [
+            (
+                "gpuf_task_stage_seconds",
+                "Time spent in each stage of an inference task.",
+                false,
+            ),
+            (
+                "gpuf_task_tokens_per_second",
+                "Prefill and decode rates reported by workers.",
+                true,
+            ),
+        ];
+        for (name, help, rates) in families {
+            let _ = writeln!(out, "# HELP {name} {help}");
+            let _ = writeln!(out, "# TYPE {name} histogram");
+            for key in keys
+                .iter()
+                .filter(|k| matches!(k.metric, Metric::Rate(_)) == rates)
+            {
+                let (label, value, scale) = match key.metric {
+                    Metric::Stage(stage) => ("stage", stage.label(), 1e6),
+                    Metric::Rate(rate) => ("phase", rate.label(), 1.0),
+                };
+                let labels = format!(
+                    "{label}=\"{value}\",model=\"{}\",device_class=\"{}\"",
+                    escape(&key.model),
+                    key.class
+                );
+                let h = &series[*key];
+                let mut cumulative = 0;
+                for (i, count) in h.counts.iter().enumerate() {
+                    cumulative += count.load(Ordering::Relaxed);
+                    match h.bounds.get(i) {
+                        Some(bound) => {
+                            let le = *bound as f64 / scale;
+                            let _ =
+                                writeln!(out, "{name}_bucket{{{labels},le=\"{le}\"}} {cumulative}");
+                        }
+                        None => {
+                            let _ =
+                                writeln!(out, "{name}_bucket{{{labels},le=\"+Inf\"}} {cumulative}");
+                        }
+                    }
+                }
+                let sum = h.sum.load(Ordering::Relaxed) as f64 / scale;
+                let _ = writeln!(out, "{name}_sum{{{labels}}} {sum}");
+                let _ = writeln!(out, "{name}_count{{{labels}}} {cumulative}");
+            }
+        }
+        out
+    }
+}
+
+fn escape(label: &str) -> String {
+    label
+        .replace('\\', "\\\\")
+        .replace('"', "\\\"")
+        .replace('\n', "\\n")
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_render_cumulative_buckets() {
+        let metrics = LatencyMetrics::default();
+        metrics.record(Stage::Route, "m\"1", "android", Duration::from_micros(300));
+        metrics.record(Stage::Route, "m\"1", "android", Duration::from_secs(500));
+        let timings = TaskTimings {
+            prompt_ready_us: 100,
+            submitted_us: 600,
+            first_token_us: 100_600,
+            token_marks_us: vec![260_600],
+            done_us: 260_600,
+        };
+        metrics.record_worker("m", "ios", &timings, 50, 17);
+
+        let text = metrics.render();
+        let labels = "stage=\"route\",model=\"m\\\"1\",device_class=\"android\"";
+        assert!(text.contains(&format!(
+            "gpuf_task_stage_seconds_bucket{{{labels},le=\"0.00025\"}} 0"
+        )));
+        assert!(text.contains(&format!(
+            "gpuf_task_stage_seconds_bucket{{{labels},le=\"0.0005\"}} 1"
+        )));
+        assert!(text.contains(&format!(
+            "gpuf_task_stage_seconds_bucket{{{labels},le=\"+Inf\"}} 2"
+        )));
+        assert!(text.contains(&format!("gpuf_task_stage_seconds_count{{{labels}}} 2")));
+        // 50 prompt tokens in 0.1s, 16 tokens in 0.16s.
+        assert!(text.contains(
+            "gpuf_task_tokens_per_second_sum{phase=\"prefill\",model=\"m\",device_class=\"ios\"} 500"
+        ));
+        assert!(text.contains(
+            "gpuf_task_tokens_per_second_sum{phase=\"decode\",model=\"m\",device_class=\"ios\"} 100"
+        ));
+    }
+}
@@ -1,6 +1,13 @@
+pub mod admission;
+pub mod cluster;
 pub mod gateway;
 pub mod handlers;
+pub mod latency;
+pub mod response_cache;
 pub mod scheduler;
+pub mod scoring;
+pub mod sse;
+pub mod task_table;
 
 // Re-export main components
 pub use gateway::InferenceGateway;
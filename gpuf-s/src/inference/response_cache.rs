@@ -0,0 +1,569 @@
+//! Cache of deterministic chat completions.
+//!
+//! A chat request sampled at temperature 0 gets the same reply for the same
+//! model, messages and sampling parameters. With `--response-cache-ttl-secs`
+//! set, the gateway stores finished replies in Redis and replays them to
+//! later identical requests without choosing a device. Identical requests
+//! that arrive while one is still generating join it and get its events as
+//! they arrive.
+//!
+//! Entries keep the usage of the original generation and the device that
+//! produced it. A replayed request reports the same tokens, so the caller is
+//! metered as for an uncached run, but its request metrics name
+//! [`REPLAY_DEVICE`]: only the request that generated a reply credits its
+//! device. The devices a request may use are part of its key, so a reply is
+//! never served to a request whose allowed devices exclude its producer.
+
+use crate::inference::scheduler::{ChatMessage, CompletionUsage, StreamEvent};
+use crate::inference::InferenceScheduler;
+use crate::util::protoc::ClientId;
+
+use common::OutputPhase;
+use redis::aio::MultiplexedConnection;
+use redis::Client as RedisClient;
+use serde::{Deserialize, Serialize};
+use sha1::{Digest, Sha1};
+use std::collections::HashMap;
+use std::str::FromStr;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+use tokio::sync::{mpsc, Notify};
+use tracing::debug;
+
+const KEY_PREFIX: &str = "gpuf:response:";
+/// A Redis round trip slower than this counts as a miss, so a struggling
+/// Redis slows no request down by more.
+const REDIS_TIMEOUT: Duration = Duration::from_millis(100);
+/// Replies longer than this are served but not stored.
+const MAX_ENTRY_BYTES: usize = 256 * 1024;
+/// Events buffered towards each joined request.
+const JOIN_BUFFER: usize = 128;
+
+/// Device named in the request metrics of a reply served from the cache or
+/// joined from another request, which no device computed for this request.
+pub const REPLAY_DEVICE: ClientId = ClientId([0; 16]);
+
+/// What makes two chat requests produce the same reply.
+pub struct ChatKey<'a> {
+    pub model: &'a str,
+    pub messages: &'a [ChatMessage],
+    pub max_tokens: u32,
+    pub top_k: u32,
+    pub top_p: f32,
+    pub repeat_penalty: f32,
+    pub repeat_last_n: i32,
+    pub min_keep: u32,
+    /// Sorted ids of the devices the request may use.
+    pub devices: &'a [ClientId],
+}
+
+/// Redis key of a cacheable request.
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+pub struct CacheKey(String);
+
+impl CacheKey {
+    pub fn chat(key: &ChatKey<'_>) -> Self {
+        let mut h = Sha1::new();
+        let mut field = |bytes: &[u8]| {
+            h.update((bytes.len() as u64).to_le_bytes());
+            h.update(bytes);
+        };
+        field(key.model.as_bytes());
+        for m in key.messages {
+            field(m.role.trim().to_ascii_lowercase().as_bytes());
+            field(m.content.as_bytes());
+        }
+        field(&key.max_tokens.to_le_bytes());
+        field(&key.top_k.to_le_bytes());
+        field(&key.top_p.to_bits().to_le_bytes());
+        field(&key.repeat_penalty.to_bits().to_le_bytes());
+        field(&key.repeat_last_n.to_le_bytes());
+        field(&key.min_keep.to_le_bytes());
+        key.devices.iter().for_each(|id| field(&id.0));
+        Self(format!("{KEY_PREFIX}{}", hex::encode(h.finalize())))
+    }
+}
+
+#[derive(Serialize, Deserialize)]
+struct Segment {
+    analysis: bool,
+    text: String,
+}
+
+/// A stored reply.
+#[derive(Serialize, Deserialize)]
+struct Entry {
+    device: String,
+    segments: Vec<Segment>,
+    prompt_tokens: u32,
+    completion_tokens: u32,
+    analysis_tokens: Option<u32>,
+    final_tokens: Option<u32>,
+}
+
+impl Entry {
+    /// The reply of a stream that finished cleanly; `None` if it failed.
+    fn from_events(device_id: ClientId, events: &[StreamEvent]) -> Option<Self> {
+        let mut segments: Vec<Segment> = Vec::new();
+        let mut usage = None;
+        for ev in events {
+            match ev {
+                StreamEvent::Delta(text, phase) => {
+                    let analysis = *phase == OutputPhase::Analysis;
+                    match segments.last_mut() {
+                        Some(last) if last.analysis == analysis => last.text.push_str(text),
+                        _ => segments.push(Segment {
+                            analysis,
+                            text: text.clone(),
+                        }),
+                    }
+                }
+                StreamEvent::Finish(u) => usage = u.clone(),
+                StreamEvent::Error(_) => return None,
+                StreamEvent::Done => break,
+            }
+        }
+        let usage = usage?;
+        Some(Self {
+            device: device_id.to_string(),
+            segments,
+            prompt_tokens: usage.prompt_tokens,
+            completion_tokens: usage.completion_tokens,
+            analysis_tokens: usage.analysis_tokens,
+            final_tokens: usage.final_tokens,
+        })
+    }
+
+    fn events(self) -> Vec<StreamEvent> {
+        let usage = CompletionUsage {
+            prompt_tokens: self.prompt_tokens,
+            completion_tokens: self.completion_tokens,
+            total_tokens: self.prompt_tokens + self.completion_tokens,
+            analysis_tokens: self.analysis_tokens,
+            final_tokens: self.final_tokens,
+            speculative: None,
+        };
+        let mut events: Vec<StreamEvent> = self
+            .segments
+            .into_iter()
+            .map(|s| {
+                let phase = if s.analysis {
+                    OutputPhase::Analysis
+                } else {
+                    OutputPhase::Final
+                };
+                StreamEvent::Delta(s.text, phase)
+            })
+            .collect();
+        events.push(StreamEvent::Finish(Some(usage)));
+        events.push(StreamEvent::Done);
+        events
+    }
+}
+
+#[derive(Default)]
+struct FlightState {
+    device_id: Option<ClientId>,
+    events: Vec<StreamEvent>,
+    /// The leader's stream ended, or it failed before it started.
+    closed: bool,
+    /// Nobody was reading when the leader's client left, so the task was
+    /// cancelled; requests joining now must run on their own.
+    abandoned: bool,
+    /// Joined requests still reading.
+    readers: usize,
+}
+
+/// A generation that identical requests can join.
+#[derive(Default)]
+struct Flight {
+    state: Mutex<FlightState>,
+    changed: Notify,
+}
+
+impl Flight {
+    fn lock(&self) -> std::sync::MutexGuard<'_, FlightState> {
+        self.state.lock().unwrap_or_else(|e| e.into_inner())
+    }
+
+    fn update(&self, f: impl FnOnce(&mut FlightState)) {
+        f(&mut self.lock());
+        self.changed.notify_waiters();
+    }
+}
+
+#[derive(Default)]
+struct Counters {
+    hits: AtomicU64,
+    joined: AtomicU64,
+    misses: AtomicU64,
+    stored: AtomicU64,
+    redis_errors: AtomicU64,
+}
+
+#[derive(Debug, Clone, Copy, Default, Serialize)]
+pub struct ResponseCacheStats {
+    pub hits: u64,
+    /// Requests served by joining an identical one in flight.
+    pub joined: u64,
+    pub misses: u64,
+    pub stored: u64,
+    /// Redis calls that failed or timed out; each counts as a miss.
+    pub redis_errors: u64,
+}
+
+pub struct ResponseCache {
+    redis: Arc<RedisClient>,
+    conn: tokio::sync::Mutex<Option<MultiplexedConnection>>,
+    ttl: Duration,
+    inflight: Mutex<HashMap<CacheKey, Arc<Flight>>>,
+    counters: Counters,
+}
+
+/// A stream of events and the device behind it.
+pub struct Source {
+    pub device_id: ClientId,
+    pub rx: mpsc::Receiver<StreamEvent>,
+}
+
+pub enum Lookup {
+    /// A stored reply.
+    Hit(Source),
+    /// An identical request is generating; [`Joined::attach`] to it.
+    Join(Joined),
+    /// Run the request and pass its stream through [`Leader::tee`].
+    Miss(Leader),
+}
+
+impl ResponseCache {
+    pub fn new(redis: Arc<RedisClient>, ttl: Duration) -> Self {
+        Self {
+            redis,
+            conn: tokio::sync::Mutex::new(None),
+            ttl,
+            inflight: Mutex::new(HashMap::new()),
+            counters: Counters::default(),
+        }
+    }
+
+    fn inflight(&self) -> std::sync::MutexGuard<'_, HashMap<CacheKey, Arc<Flight>>> {
+        self.inflight.lock().unwrap_or_else(|e| e.into_inner())
+    }
+
+    pub async fn lookup(self: &Arc<Self>, key: CacheKey) -> Lookup {
+        if let Some(flight) = self.inflight().get(&key).cloned() {
+            return self.join(key, flight);
+        }
+        if let Some(entry) = self.load(&key).await {
+            if let Ok(device_id) = ClientId::from_str(&entry.device) {
+                self.counters.hits.fetch_add(1, Ordering::Relaxed);
+                let events = entry.events();
+                let (tx, rx) = mpsc::channel(events.len());
+                for ev in events {
+                    let _ = tx.try_send(ev);
+                }
+                return Lookup::Hit(Source { device_id, rx });
+            }
+        }
+        let mut inflight = self.inflight();
+        if let Some(flight) = inflight.get(&key).cloned() {
+            drop(inflight);
+            return self.join(key, flight);
+        }
+        let flight = Arc::new(Flight::default());
+        inflight.insert(key.clone(), flight.clone());
+        self.counters.misses.fetch_add(1, Ordering::Relaxed);
+        Lookup::Miss(Leader {
+            cache: self.clone(),
+            key,
+            flight,
+        })
+    }
+
+    fn join(&self, key: CacheKey, flight: Arc<Flight>) -> Lookup {
+        debug!("joining in-flight response {}", key.0);
+        Lookup::Join(Joined { flight })
+    }
+
+    pub fn stats(&self) -> ResponseCacheStats {
+        ResponseCacheStats {
+            hits: self.counters.hits.load(Ordering::Relaxed),
+            joined: self.counters.joined.load(Ordering::Relaxed),
+            misses: self.counters.misses.load(Ordering::Relaxed),
+            stored: self.counters.stored.load(Ordering::Relaxed),
+            redis_errors: self.counters.redis_errors.load(Ordering::Relaxed),
+        }
+    }
+
+    async fn connection(&self) -> Option<MultiplexedConnection> {
+        let mut conn = self.conn.lock().await;
+        if conn.is_none() {
+            match tokio::time::timeout(REDIS_TIMEOUT, self.redis.get_multiplexed_async_connection())
+                .await
+            {
+                Ok(Ok(c)) => *conn = Some(c),
+                Ok(Err(e)) => debug!("response cache: Redis connect failed: {}", e),
+                Err(_) => debug!("response cache: Redis connect timed out"),
+            }
+        }
+        conn.clone()
+    }
+
+    /// Run `cmd`, dropping the connection if it fails so the next call
+    /// reconnects.
+    async fn query<T: redis::FromRedisValue>(&self, cmd: &redis::Cmd) -> Option<T> {
+        let result = match self.connection().await {
+            Some(mut conn) => {
+                tokio::time::timeout(REDIS_TIMEOUT, cmd.query_async::<_, T>(&mut conn)).await
+            }
+            None => {
+                self.counters.redis_errors.fetch_add(1, Ordering::Relaxed);
+                return None;
+            }
+        };
+        match result {
+            Ok(Ok(v)) => Some(v),
+            Ok(Err(e)) => {
+                debug!("response cache: Redis error: {}", e);
+                self.counters.redis_errors.fetch_add(1, Ordering::Relaxed);
+                *self.conn.lock().await = None;
+                None
+            }
+            Err(_) => {
+                self.counters.redis_errors.fetch_add(1, Ordering::Relaxed);
+                None
+            }
+        }
+    }
+
+    async fn load(&self, key: &CacheKey) -> Option<Entry> {
+        let payload: Option<String> = self.query(redis::cmd("GET").arg(&key.0)).await?;
+        serde_json::from_str(&payload?).ok()
+    }
+
+    async fn store(&self, key: &CacheKey, entry: &Entry) {
+        let Ok(payload) = serde_json::to_string(entry) else {
+            return;
+        };
+        if payload.len() > MAX_ENTRY_BYTES {
+            return;
+        }
+        let mut cmd = redis::cmd("SET");
+        cmd.arg(&key.0)
+            .arg(payload)
+            .arg("EX")
+            .arg(self.ttl.as_secs().max(1));
+        if self.query::<()>(&cmd).await.is_some() {
+            self.counters.stored.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    fn finish(&self, key: &CacheKey, flight: &Arc<Flight>) {
+        let mut inflight = self.inflight();
+        if inflight.get(key).is_some_and(|f| Arc::ptr_eq(f, flight)) {
+            inflight.remove(key);
+        }
+        drop(inflight);
+        flight.update(|st| st.closed = true);
+    }
+}
+
+/// The request running a generation others may join. Dropping it without
+/// calling [`Leader::tee`] lets the joined requests run on their own.
+pub struct Leader {
+    cache: Arc<ResponseCache>,
+    key: CacheKey,
+    flight: Arc<Flight>,
+}
+
+impl Leader {
+    /// Pass the leader's stream through: the returned receiver gets every
+    /// event, joined requests get copies, and a clean finish is stored.
+    /// Cancelling the task is left to this tee, which does so once the
+    /// leader's client and every joined one have gone.
+    pub fn tee(
+        self,
+        scheduler: Arc<InferenceScheduler>,
+        task_id: String,
+        device_id: ClientId,
+        mut upstream: mpsc::Receiver<StreamEvent>,
+    ) -> mpsc::Receiver<StreamEvent> {
+        let (tx, rx) = mpsc::channel(JOIN_BUFFER);
+        self.flight.update(|st| st.device_id = Some(device_id));
+        tokio::spawn(async move {
+            let mut listening = true;
+            let mut done = false;
+            while let Some(ev) = upstream.recv().await {
+                done = matches!(ev, StreamEvent::Done);
+                self.flight.update(|st| st.events.push(ev.clone()));
+                if listening && tx.send(ev).await.is_err() {
+                    listening = false;
+                }
+                if done {
+                    break;
+                }
+                if !listening && self.abandon() {
+                    let _ = scheduler.cancel_inference(&task_id, &device_id).await;
+                    break;
+                }
+            }
+            if done {
+                let entry = Entry::from_events(device_id, &self.flight.lock().events);
+                if let Some(entry) = entry {
+                    self.cache.store(&self.key, &entry).await;
+                }
+            }
+            // Dropping self closes the flight.
+        });
+        rx
+    }
+}
+
+impl Leader {
+    /// Give the generation up if no joined request is reading it.
+    fn abandon(&self) -> bool {
+        let mut st = self.flight.lock();
+        st.abandoned = st.readers == 0;
+        st.abandoned
+    }
+}
+
+impl Drop for Leader {
+    fn drop(&mut self) {
+        self.cache.finish(&self.key, &self.flight);
+    }
+}
+
+/// A request waiting on an identical one.
+pub struct Joined {
+    flight: Arc<Flight>,
+}
+
+impl Joined {
+    /// Follow the leader's stream from its start. `None` if the leader
+    /// failed before reaching a device or was abandoned; the request should
+    /// then run on its own.
+    pub async fn attach(self, cache: &ResponseCache) -> Option<Source> {
+        let device_id = loop {
+            let notified = self.flight.changed.notified();
+            tokio::pin!(notified);
+            notified.as_mut().enable();
+            {
+                let mut st = self.flight.lock();
+                if st.abandoned {
+                    return None;
+                }
+                if let Some(device_id) = st.device_id {
+                    st.readers += 1;
+                    break device_id;
+                }
+                if st.closed {
+                    return None;
+                }
+            }
+            notified.await;
+        };
+        cache.counters.joined.fetch_add(1, Ordering::Relaxed);
+
+        let (tx, rx) = mpsc::channel(JOIN_BUFFER);
+        let flight = self.flight;
+        tokio::spawn(async move {
+            let mut next = 0;
+            'follow: loop {
+                let notified = flight.changed.notified();
+                tokio::pin!(notified);
+                notified.as_mut().enable();
+                let (batch, closed) = {
+                    let st = flight.lock();
+                    (st.events[next..].to_vec(), st.closed)
+                };
+                next += batch.len();
+                for ev in batch {
+                    let done = matches!(ev, StreamEvent::Done);
+                    if tx.send(ev).await.is_err() || done {
+                        break 'follow;
+                    }
+                }
+                if closed {
+                    break;
+                }
+                notified.await;
+            }
+            flight.lock().readers -= 1;
+        });
+        Some(Source { device_id, rx })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn messages(content: &str) -> Vec<ChatMessage> {
+        vec![ChatMessage {
+            role: "user".to_string(),
+            content: content.to_string(),
+        }]
+    }
+
+    fn key(model: &str, messages: &[ChatMessage], devices: &[ClientId]) -> CacheKey {
+        CacheKey::chat(&ChatKey {
+            model,
+            messages,
+            max_tokens: 16,
+            top_k: 40,
+            top_p: 0.9,
+            repeat_penalty: 1.1,
+            repeat_last_n: 64,
+            min_keep: 1,
+            devices,
+        })
+    }
+
+    #[test]
+    fn test_key_and_entry_round_trip() {
+        let m = messages("Classify: great product");
+        let devices = [ClientId([1; 16]), ClientId([2; 16])];
+        let mut shouted = m.clone();
+        shouted[0].role = " User".to_string();
+        assert_eq!(key("m", &m, &devices), key("m", &shouted, &devices));
+        assert_ne!(key("m", &m, &devices), key("n", &m, &devices));
+        assert_ne!(
+            key("m", &m, &devices),
+            key("m", &messages("Classify"), &devices)
+        );
+        assert_ne!(key("m", &m, &devices), key("m", &m, &devices[..1]));
+
+        let usage = CompletionUsage {
+            prompt_tokens: 7,
+            completion_tokens: 3,
+            total_tokens: 10,
+            analysis_tokens: Some(1),
+            final_tokens: Some(2),
+            speculative: None,
+        };
+        let events = vec![
+            StreamEvent::Delta("hm".to_string(), OutputPhase::Analysis),
+            StreamEvent::Delta("posi".to_string(), OutputPhase::Final),
+            StreamEvent::Delta("tive".to_string(), OutputPhase::Final),
+            StreamEvent::Finish(Some(usage)),
+            StreamEvent::Done,
+        ];
+        let entry = Entry::from_events(devices[0], &events).unwrap();
+        let json = serde_json::to_string(&entry).unwrap();
+        let replayed = serde_json::from_str::<Entry>(&json).unwrap().events();
+        assert_eq!(replayed.len(), 4);
+        assert!(
+            matches!(&replayed[1], StreamEvent::Delta(t, OutputPhase::Final) if t == "positive")
+        );
+        assert!(matches!(
+            &replayed[2],
+            StreamEvent::Finish(Some(u)) if u.total_tokens == 10 && u.final_tokens == Some(2)
+        ));
+        assert_eq!(ClientId::from_str(&entry.device).unwrap(), devices[0]);
+
+        let failed = [events[0].clone(), StreamEvent::Error("oom".to_string())];
+        assert!(Entry::from_events(devices[0], &failed).is_none());
+    }
+}
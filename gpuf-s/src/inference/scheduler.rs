@@ -1,16 +1,33 @@
 use anyhow::{anyhow, Result};
 use serde::{Deserialize, Serialize};
-use std::collections::HashMap;
 use std::sync::Arc;
 use tokio::io::AsyncWriteExt;
 use tokio::sync::mpsc;
-use tokio::sync::{oneshot, Mutex};
+use tokio::sync::oneshot;
 use tracing::{debug, error, info, warn};
 use uuid::Uuid;
 
 use crate::handle::ActiveClients;
+use crate::inference::admission::{Admission, AdmissionQueue, AdmissionStats};
+use crate::inference::cluster::{ChatTask, Cluster};
+use crate::inference::latency::{self, LatencyMetrics, Stage};
+use crate::inference::scoring::{self, CapacityScoring, ScoringPolicy, CANDIDATE_LIMIT};
+use crate::inference::task_table::{TaskSink, TaskState, TaskTable};
 use crate::util::protoc::ClientId;
-use common::{Command, CommandV1, OutputPhase};
+use common::{Command, CommandV1, OutputPhase, TaskTimings};
+use std::time::Instant;
+
+/// Tokens kept free for the reply when checking a prompt against a
+/// device's reported context window.
+const CONTEXT_REPLY_RESERVE: u32 = 256;
+
+/// Rough context a prompt of `prompt_bytes` needs: about four bytes of text
+/// per token, plus room for the reply.
+fn required_context(prompt_bytes: usize) -> u32 {
+    u32::try_from(prompt_bytes / 4)
+        .unwrap_or(u32::MAX)
+        .saturating_add(CONTEXT_REPLY_RESERVE)
+}
 
 // Type aliases for easier function signatures
 // Note: Can't create type alias for enum variants in Rust
@@ -26,7 +43,6 @@ pub struct CompletionRequest {
     pub repeat_penalty: Option<f32>,
     pub repeat_last_n: Option<i32>,
     pub min_keep: Option<u32>,
-    #[allow(dead_code)] // Part of OpenAI API spec, will be used later
     pub model: Option<String>,
     #[allow(dead_code)] // Streaming support to be implemented later
     pub stream: Option<bool>,
@@ -44,9 +60,12 @@ pub struct ChatCompletionRequest {
     pub repeat_last_n: Option<i32>,
     pub min_keep: Option<u32>,
     pub stream: Option<bool>,
+    /// Draft tokens per step for speculative decoding on workers with a
+    /// draft model loaded; unset or 0 decodes normally.
+    pub draft_tokens: Option<u32>,
 }
 
-#[derive(Debug, Deserialize, Serialize, Clone)]
+#[derive(Debug, Deserialize, Serialize, Clone, bincode::Encode, bincode::Decode)]
 pub struct ChatMessage {
     pub role: String,
     pub content: String,
@@ -87,13 +106,38 @@ pub struct ChatCompletionChoice {
     pub finish_reason: String,
 }
 
-#[derive(Debug, Serialize, Clone)]
+#[derive(Debug, Serialize, Clone, bincode::Encode, bincode::Decode)]
 pub struct CompletionUsage {
     pub prompt_tokens: u32,
     pub completion_tokens: u32,
     pub total_tokens: u32,
     pub analysis_tokens: Option<u32>,
     pub final_tokens: Option<u32>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub speculative: Option<SpeculativeUsage>,
+}
+
+/// How many draft tokens the worker proposed and the target model accepted.
+#[derive(Debug, Serialize, Clone, Copy, bincode::Encode, bincode::Decode)]
+pub struct SpeculativeUsage {
+    pub draft_tokens: u32,
+    pub accepted_tokens: u32,
+    pub acceptance_rate: f32,
+}
+
+impl SpeculativeUsage {
+    pub fn new(draft_tokens: u32, accepted_tokens: u32) -> Self {
+        let accepted_tokens = accepted_tokens.min(draft_tokens);
+        Self {
+            draft_tokens,
+            accepted_tokens,
+            acceptance_rate: if draft_tokens == 0 {
+                0.0
+            } else {
+                accepted_tokens as f32 / draft_tokens as f32
+            },
+        }
+    }
 }
 
 #[derive(Debug, Serialize)]
@@ -104,10 +148,7 @@ pub struct ModelInfo {
     pub owned_by: String,
 }
 
-// Task result tracking
-type PendingTask = oneshot::Sender<Result<CompletionResponse>>;
-
-#[derive(Debug)]
+#[derive(Debug, Clone, bincode::Encode, bincode::Decode)]
 pub enum StreamEvent {
     Delta(String, OutputPhase),
     Finish(Option<CompletionUsage>),
@@ -115,40 +156,257 @@ pub enum StreamEvent {
     Error(String),
 }
 
+/// Admission queue of requests that name no model.
+const ANY_MODEL: &str = "*";
+/// Model name reported for requests that name none.
+pub const DEFAULT_MODEL: &str = "gpuf";
+
+/// What a request needs from a device, kept while it waits for one.
+struct Demand {
+    model: Option<String>,
+    allowed: Option<Vec<ClientId>>,
+    needed_context: u32,
+    /// Whether a device on another cluster node may take it.
+    relayable: bool,
+}
+
 // Inference Scheduler
 pub struct InferenceScheduler {
-    pending_tasks: Arc<Mutex<HashMap<String, PendingTask>>>,
-    partial_results: Arc<Mutex<HashMap<String, String>>>,
-    pending_streams: Arc<Mutex<HashMap<String, mpsc::Sender<StreamEvent>>>>,
-    stream_usages: Arc<Mutex<HashMap<String, CompletionUsage>>>,
+    tasks: TaskTable,
+    policy: Arc<dyn ScoringPolicy>,
     active_clients: ActiveClients,
+    admission: AdmissionQueue<Demand>,
+    latency: LatencyMetrics,
+    cluster: Option<Arc<Cluster>>,
 }
 
 impl InferenceScheduler {
     pub fn new(active_clients: ActiveClients) -> Self {
         Self {
-            pending_tasks: Arc::new(Mutex::new(HashMap::new())),
-            partial_results: Arc::new(Mutex::new(HashMap::new())),
-            pending_streams: Arc::new(Mutex::new(HashMap::new())),
-            stream_usages: Arc::new(Mutex::new(HashMap::new())),
+            tasks: TaskTable::new(),
+            policy: Arc::new(CapacityScoring),
             active_clients,
+            admission: AdmissionQueue::default(),
+            latency: LatencyMetrics::default(),
+            cluster: None,
+        }
+    }
+
+    /// Let chat requests run on devices of other cluster nodes.
+    pub fn with_cluster(mut self, cluster: Option<Arc<Cluster>>) -> Self {
+        self.cluster = cluster;
+        self
+    }
+
+    pub fn cluster(&self) -> Option<&Arc<Cluster>> {
+        self.cluster.as_ref()
+    }
+
+    /// Devices connected to this node.
+    pub fn registry(&self) -> &ActiveClients {
+        &self.active_clients
+    }
+
+    /// The scoring policy's figure for a new task on `info`.
+    pub fn score(&self, info: &crate::handle::ClientInfo) -> f64 {
+        self.policy.score(info)
+    }
+
+    /// Replace the device scoring policy (defaults to [`CapacityScoring`]).
+    #[allow(dead_code)]
+    pub fn with_policy(mut self, policy: Arc<dyn ScoringPolicy>) -> Self {
+        self.policy = policy;
+        self
+    }
+
+    /// Track a task before it is sent so early results always find it. The
+    /// time since the request arrived is its routing time.
+    fn register_task(
+        &self,
+        task_id: &str,
+        device_id: &ClientId,
+        sink: TaskSink,
+        model: &str,
+        received: Instant,
+    ) -> Arc<TaskState> {
+        let device_class = self.device_class(device_id);
+        if let Some(client_info) = self.active_clients.get(device_id) {
+            client_info.stats.begin_task();
+        }
+        let state = TaskState::new(*device_id, sink).with_labels(model, device_class, received);
+        let state = self.tasks.insert(task_id.to_string(), state);
+        self.observe(&state, Stage::Route, received.elapsed());
+        state
+    }
+
+    /// Device class label latency of `device_id` is recorded under.
+    pub fn device_class(&self, device_id: &ClientId) -> &'static str {
+        self.active_clients
+            .get(device_id)
+            .map_or("unknown", |info| latency::device_class(&info))
+    }
+
+    /// Per-stage latency histograms.
+    pub fn latency(&self) -> &LatencyMetrics {
+        &self.latency
+    }
+
+    fn observe(&self, state: &TaskState, stage: Stage, elapsed: std::time::Duration) {
+        self.latency
+            .record(stage, &state.model, state.device_class, elapsed);
+    }
+
+    /// Record the totals of a task that finished successfully.
+    fn observe_finished(&self, state: &TaskState, prompt_tokens: u32, completion_tokens: u32) {
+        self.observe(state, Stage::Total, state.received.elapsed());
+        if let Some(timings) = state.take_timings() {
+            self.latency.record_worker(
+                &state.model,
+                state.device_class,
+                &timings,
+                prompt_tokens,
+                completion_tokens,
+            );
+        }
+    }
+
+    /// Remove `task_id`, release its in-flight slot and, for successful tasks,
+    /// fold its throughput into the device's average. Returns the state only
+    /// to the first caller.
+    fn complete_task(
+        &self,
+        task_id: &str,
+        completion_tokens: u32,
+        execution_time_ms: u64,
+    ) -> Option<Arc<TaskState>> {
+        let state = self.tasks.remove(task_id)?;
+        if let Some(client_info) = self.active_clients.get(&state.device_id) {
+            client_info.stats.end_task();
+            self.active_clients.changed().notify_waiters();
+            let elapsed_ms = if execution_time_ms > 0 {
+                execution_time_ms
+            } else {
+                state.started.elapsed().as_millis() as u64
+            };
+            client_info
+                .stats
+                .record_throughput(completion_tokens, elapsed_ms);
+        }
+        Some(state)
+    }
+
+    /// Handle announcement sent ahead of a task to workers that support
+    /// compact result chunks.
+    fn task_handle_command(
+        &self,
+        client_info: &crate::handle::ClientInfo,
+        task_id: &str,
+    ) -> Option<Command> {
+        if client_info.version < common::COMPACT_CHUNK_MIN_VERSION {
+            return None;
+        }
+        let state = self.tasks.get(task_id)?;
+        Some(Command::V1(CommandV1::TaskHandle {
+            task_id: task_id.to_string(),
+            handle: state.handle,
+        }))
+    }
+
+    /// Decode options sent ahead of a chat task to workers that support
+    /// speculative decoding, when the request asked for it.
+    fn decode_options_command(
+        client_info: &crate::handle::ClientInfo,
+        task_id: &str,
+        draft_tokens: u32,
+    ) -> Option<Command> {
+        if draft_tokens == 0 || client_info.version < common::SPECULATIVE_MIN_VERSION {
+            return None;
+        }
+        Some(Command::V1(CommandV1::TaskDecodeOptions {
+            task_id: task_id.to_string(),
+            draft_tokens,
+        }))
+    }
+
+    fn choose_device(
+        &self,
+        candidates: Vec<(ClientId, Arc<crate::handle::ClientInfo>)>,
+    ) -> Option<ClientId> {
+        let (ids, infos): (Vec<ClientId>, Vec<_>) = candidates.into_iter().unzip();
+        scoring::choose(self.policy.as_ref(), &infos).map(|i| ids[i])
+    }
+
+    /// A device for `demand`: one serving its model if any fits, else any
+    /// device that fits. Local devices come first, then those of other
+    /// cluster nodes if the request can be relayed.
+    fn try_place(&self, demand: &Demand) -> Option<ClientId> {
+        let allowed = demand.allowed.as_deref();
+        let cluster = self.cluster.as_ref().filter(|_| demand.relayable);
+        if let Some(model) = &demand.model {
+            match self.select_best_device_for_model(model, allowed, demand.needed_context) {
+                Ok(device_id) => return Some(device_id),
+                Err(e) => debug!("{e}; trying other nodes, then generic device selection"),
+            }
+            let remote = cluster.and_then(|c| c.place(Some(model), allowed, demand.needed_context));
+            if remote.is_some() {
+                return remote;
+            }
         }
+        self.select_best_device(allowed, demand.needed_context)
+            .ok()
+            .or_else(|| cluster.and_then(|c| c.place(None, allowed, demand.needed_context)))
+    }
+
+    /// Place `demand`, queueing behind earlier requests for the same model
+    /// until a device frees up or the admission deadline passes.
+    async fn place(&self, demand: Demand, admission: &Admission) -> Result<ClientId> {
+        let queue = demand
+            .model
+            .clone()
+            .unwrap_or_else(|| ANY_MODEL.to_string());
+        self.admission
+            .admit(
+                &queue,
+                admission,
+                demand,
+                self.active_clients.changed(),
+                |demand| self.try_place(demand),
+            )
+            .await
+            // Callers answer 503 for this message.
+            .map_err(|e| anyhow!("No available Android devices found: {e}"))
+    }
+
+    /// Admission queue depth and wait times.
+    pub fn admission_stats(&self) -> AdmissionStats {
+        self.admission.stats()
     }
 
     pub async fn execute_inference_stream(
         &self,
         request: CompletionRequest,
         allowed_client_ids: Option<&[ClientId]>,
+        admission: &Admission,
     ) -> Result<(String, ClientId, mpsc::Receiver<StreamEvent>)> {
         let task_id = Uuid::new_v4().to_string();
         let (tx, rx) = mpsc::channel::<StreamEvent>(128);
 
-        {
-            let mut streams = self.pending_streams.lock().await;
-            streams.insert(task_id.clone(), tx);
-        }
-
-        let device_id = self.select_best_device(allowed_client_ids).await?;
+        let demand = Demand {
+            model: None,
+            allowed: allowed_client_ids.map(<[ClientId]>::to_vec),
+            needed_context: required_context(request.prompt.len()),
+            relayable: false,
+        };
+        let model = request.model.as_deref().unwrap_or(DEFAULT_MODEL);
+        let device_id = self.place(demand, admission).await?;
+        let state = self.register_task(
+            &task_id,
+            &device_id,
+            TaskSink::Stream(tx),
+            model,
+            admission.received,
+        );
+        let dispatched = Instant::now();
         if let Err(e) = self
             .send_task_to_device(
                 &device_id,
@@ -164,58 +422,30 @@ impl InferenceScheduler {
             )
             .await
         {
-            let mut streams = self.pending_streams.lock().await;
-            streams.remove(&task_id);
+            self.complete_task(&task_id, 0, 0);
             return Err(e);
         }
+        self.observe(&state, Stage::Dispatch, dispatched.elapsed());
 
         Ok((task_id, device_id, rx))
     }
 
-    async fn select_best_device_for_model(
+    /// Choose a device that serves `model_name` among the indexed
+    /// candidates, optionally restricted to `allowed_client_ids`.
+    pub fn select_best_device_for_model(
         &self,
         model_name: &str,
         allowed_client_ids: Option<&[ClientId]>,
+        needed_context: u32,
     ) -> Result<ClientId> {
-        let clients = self.active_clients.lock().await;
-
-        let mut best_device: Option<(ClientId, u16)> = None;
-
-        debug!("online Clients: {}", clients.len());
-        for (client_id, client_info) in clients.iter() {
-            if let Some(allowed) = allowed_client_ids {
-                if !allowed.iter().any(|id| id == client_id) {
-                    debug!("Client {} is not allowed", client_id);
-                    continue;
-                }
-            }
-            debug!("Client {} is authed {} model {}", client_id, client_info.authed, model_name);
-            if !client_info.authed {
-                continue;
-            }
-            let Some(models) = &client_info.models else {
-                continue;
-            };
-            if !models.iter().any(|m| m.id == model_name) {
-                continue;
-            }
-
-            let Some(system_info) = &client_info.system_info else {
-                continue;
-            };
-            let total_load: u16 = (system_info.cpu_usage + system_info.memory_usage) as u16;
-
-            match best_device {
-                None => best_device = Some((*client_id, total_load)),
-                Some((_best_id, best_load)) if total_load < best_load => {
-                    best_device = Some((*client_id, total_load))
-                }
-                _ => {}
-            }
-        }
-
-        best_device
-            .map(|(id, _)| id)
+        debug!("online Clients: {}", self.active_clients.len());
+        let candidates = self.active_clients.model_candidates(
+            model_name,
+            allowed_client_ids,
+            CANDIDATE_LIMIT,
+            |info| info.fits_context(needed_context) && info.accepts_tasks(),
+        );
+        self.choose_device(candidates)
             .ok_or_else(|| anyhow!("No compatible client found for model '{model_name}'"))
     }
 
@@ -230,31 +460,64 @@ impl InferenceScheduler {
         repeat_penalty: f32,
         repeat_last_n: i32,
         min_keep: u32,
+        draft_tokens: u32,
         allowed_client_ids: Option<&[ClientId]>,
+        admission: &Admission,
     ) -> Result<(String, ClientId, mpsc::Receiver<StreamEvent>)> {
         let task_id = Uuid::new_v4().to_string();
-        let (tx, rx) = mpsc::channel::<StreamEvent>(128);
-
-        {
-            let mut streams = self.pending_streams.lock().await;
-            streams.insert(task_id.clone(), tx);
-        }
 
-        let device_id = match self
-            .select_best_device_for_model(&model, allowed_client_ids)
-            .await
-        {
-            Ok(d) => d,
-            Err(e) => {
-                warn!(
-                    "No model-compatible device found for model '{}': {}. Falling back to generic device selection.",
-                    model, e
-                );
-                self.select_best_device(allowed_client_ids).await?
-            }
+        let demand = Demand {
+            model: Some(model.clone()),
+            allowed: allowed_client_ids.map(<[ClientId]>::to_vec),
+            needed_context: required_context(messages.iter().map(|m| m.content.len()).sum()),
+            relayable: true,
         };
+        let device_id = self.place(demand, admission).await?;
         debug!("Selected device {} for model {}", device_id, model);
-        let common_messages = messages
+        let task = ChatTask {
+            task_id: task_id.clone(),
+            device_id,
+            model,
+            messages,
+            max_tokens,
+            temperature,
+            top_k,
+            top_p,
+            repeat_penalty,
+            repeat_last_n,
+            min_keep,
+            draft_tokens,
+        };
+        let rx = match &self.cluster {
+            Some(cluster) if !self.active_clients.contains(&device_id) => {
+                cluster.relay_chat(task).await?
+            }
+            _ => self.start_chat(task, admission.received).await?,
+        };
+
+        Ok((task_id, device_id, rx))
+    }
+
+    /// Run a chat task another cluster node placed on one of our devices.
+    pub async fn run_relayed_chat(&self, task: ChatTask) -> Result<mpsc::Receiver<StreamEvent>> {
+        self.start_chat(task, Instant::now()).await
+    }
+
+    async fn start_chat(
+        &self,
+        task: ChatTask,
+        received: Instant,
+    ) -> Result<mpsc::Receiver<StreamEvent>> {
+        let (tx, rx) = mpsc::channel::<StreamEvent>(128);
+        let state = self.register_task(
+            &task.task_id,
+            &task.device_id,
+            TaskSink::Stream(tx),
+            &task.model,
+            received,
+        );
+        let common_messages = task
+            .messages
             .into_iter()
             .map(|m| common::ChatMessage {
                 role: m.role,
@@ -262,28 +525,30 @@ impl InferenceScheduler {
             })
             .collect::<Vec<_>>();
 
+        let dispatched = Instant::now();
         if let Err(e) = self
             .send_chat_task_to_device(
-                &device_id,
-                task_id.clone(),
-                model,
+                &task.device_id,
+                task.task_id.clone(),
+                task.model,
                 common_messages,
-                max_tokens,
-                temperature,
-                top_k,
-                top_p,
-                repeat_penalty,
-                repeat_last_n,
-                min_keep,
+                task.max_tokens,
+                task.temperature,
+                task.top_k,
+                task.top_p,
+                task.repeat_penalty,
+                task.repeat_last_n,
+                task.min_keep,
+                task.draft_tokens,
             )
             .await
         {
-            let mut streams = self.pending_streams.lock().await;
-            streams.remove(&task_id);
+            self.complete_task(&task.task_id, 0, 0);
             return Err(e);
         }
+        self.observe(&state, Stage::Dispatch, dispatched.elapsed());
 
-        Ok((task_id, device_id, rx))
+        Ok(rx)
     }
 
     pub async fn cancel_inference(&self, task_id: &str, device_id: &ClientId) -> Result<()> {
@@ -291,17 +556,16 @@ impl InferenceScheduler {
             "Cancelling inference for task {} on device {}",
             task_id, device_id
         );
-        {
-            let mut streams = self.pending_streams.lock().await;
-            streams.remove(task_id);
-        }
+        self.complete_task(task_id, 0, 0);
 
         use common::write_command;
 
-        let mut clients = self.active_clients.lock().await;
-        let client_info = clients
-            .get_mut(device_id)
-            .ok_or_else(|| anyhow!("Device {:?} not found or not connected", device_id))?;
+        let Some(client_info) = self.active_clients.get(device_id) else {
+            if let Some(cluster) = &self.cluster {
+                return cluster.cancel(task_id, device_id).await;
+            }
+            return Err(anyhow!("Device {:?} not found or not connected", device_id));
+        };
 
         if !client_info.authed {
             return Err(anyhow!("Device {:?} not authenticated", device_id));
@@ -331,12 +595,13 @@ impl InferenceScheduler {
         repeat_penalty: f32,
         repeat_last_n: i32,
         min_keep: u32,
+        draft_tokens: u32,
     ) -> Result<()> {
-        use common::write_command;
+        use common::write_commands;
 
-        let mut clients = self.active_clients.lock().await;
-        let client_info = clients
-            .get_mut(device_id)
+        let client_info = self
+            .active_clients
+            .get(device_id)
             .ok_or_else(|| anyhow!("Device {:?} not found or not connected", device_id))?;
 
         if !client_info.authed {
@@ -367,11 +632,53 @@ impl InferenceScheduler {
             "sent chat inference task {} to device {:?} :{:?}",
             task_id, device_id, command
         );
-        write_command(&mut *writer, &command).await?;
+        let mut commands: Vec<Command> = self
+            .task_handle_command(&client_info, &task_id)
+            .into_iter()
+            .chain(Self::decode_options_command(
+                &client_info,
+                &task_id,
+                draft_tokens,
+            ))
+            .collect();
+        commands.push(command);
+        write_commands(&mut *writer, &commands).await?;
         writer.flush().await?;
         Ok(())
     }
 
+    /// Record the speculative decoding counters a worker reports ahead of a
+    /// task's final chunk.
+    pub fn handle_task_decode_stats(
+        &self,
+        device_id: &ClientId,
+        task_id: &str,
+        draft_tokens: u32,
+        accepted_tokens: u32,
+    ) {
+        match self.tasks.get(task_id) {
+            Some(state) if state.device_id == *device_id => {
+                state.set_speculative(SpeculativeUsage::new(draft_tokens, accepted_tokens));
+            }
+            _ => debug!(
+                "Dropping decode stats for task {} from device {:?}",
+                task_id, device_id
+            ),
+        }
+    }
+
+    /// Keep a worker's stage times until the task's final chunk brings the
+    /// token counts they are read against.
+    pub fn handle_task_timings(&self, device_id: &ClientId, task_id: &str, timings: TaskTimings) {
+        match self.tasks.get(task_id) {
+            Some(state) if state.device_id == *device_id => state.set_timings(timings),
+            _ => debug!(
+                "Dropping timings for task {} from device {:?}",
+                task_id, device_id
+            ),
+        }
+    }
+
     pub async fn handle_inference_result_chunk(
         &self,
         task_id: String,
@@ -385,19 +692,23 @@ impl InferenceScheduler {
         analysis_tokens: u32,
         final_tokens: u32,
     ) {
-        let stream_sender = {
-            let streams = self.pending_streams.lock().await;
-            streams.get(&task_id).cloned()
+        let Some(state) = self.tasks.get(&task_id) else {
+            debug!(
+                "Dropping chunk for task {} because it is no longer pending",
+                task_id
+            );
+            return;
         };
+        if state.first_chunk() {
+            self.observe(&state, Stage::FirstToken, state.received.elapsed());
+        }
 
-        if let Some(sender) = stream_sender {
+        if let TaskSink::Stream(sender) = &state.sink {
             if let Some(err) = error {
-                let _ = sender.send(StreamEvent::Error(err)).await;
-                let _ = sender.send(StreamEvent::Done).await;
-                let mut streams = self.pending_streams.lock().await;
-                streams.remove(&task_id);
-                let mut usages = self.stream_usages.lock().await;
-                usages.remove(&task_id);
+                if self.complete_task(&task_id, 0, 0).is_some() {
+                    let _ = sender.send(StreamEvent::Error(err)).await;
+                    let _ = sender.send(StreamEvent::Done).await;
+                }
                 return;
             }
 
@@ -405,30 +716,18 @@ impl InferenceScheduler {
                 let _ = sender.send(StreamEvent::Delta(delta, phase)).await;
             }
 
-            if done {
+            if done && self.complete_task(&task_id, completion_tokens, 0).is_some() {
+                self.observe_finished(&state, prompt_tokens, completion_tokens);
                 let usage = CompletionUsage {
                     prompt_tokens,
                     completion_tokens,
                     total_tokens: prompt_tokens.saturating_add(completion_tokens),
                     analysis_tokens: Some(analysis_tokens),
                     final_tokens: Some(final_tokens),
+                    speculative: state.take_speculative(),
                 };
-                {
-                    let mut usages = self.stream_usages.lock().await;
-                    usages.insert(task_id.clone(), usage.clone());
-                }
-
-                let usage_for_finish = {
-                    let usages = self.stream_usages.lock().await;
-                    usages.get(&task_id).cloned()
-                };
-
-                let _ = sender.send(StreamEvent::Finish(usage_for_finish)).await;
+                let _ = sender.send(StreamEvent::Finish(Some(usage))).await;
                 let _ = sender.send(StreamEvent::Done).await;
-                let mut streams = self.pending_streams.lock().await;
-                streams.remove(&task_id);
-                let mut usages = self.stream_usages.lock().await;
-                usages.remove(&task_id);
             }
             return;
         }
@@ -439,17 +738,10 @@ impl InferenceScheduler {
             return;
         }
 
-        {
-            let mut partial = self.partial_results.lock().await;
-            let entry = partial.entry(task_id.clone()).or_insert_with(String::new);
-            entry.push_str(&delta);
-        }
+        state.push_partial(&delta);
 
         if done {
-            let result = {
-                let mut partial = self.partial_results.lock().await;
-                partial.remove(&task_id).unwrap_or_default()
-            };
+            let result = state.take_partial();
             self.handle_inference_result(
                 task_id,
                 true,
@@ -463,6 +755,51 @@ impl InferenceScheduler {
         }
     }
 
+    /// Resolve a compact chunk's handle and process it like a full chunk.
+    /// Only the device the task was dispatched to may use its handle.
+    pub async fn handle_inference_result_chunk_compact(
+        &self,
+        device_id: &ClientId,
+        handle: u32,
+        seq: u32,
+        delta: String,
+        phase: OutputPhase,
+        end: Option<common::ChunkEnd>,
+    ) {
+        let Some(task_id) = self.tasks.task_id_for(handle) else {
+            debug!(
+                "Dropping chunk for handle {} because it is no longer pending",
+                handle
+            );
+            return;
+        };
+        match self.tasks.get(&task_id) {
+            Some(state) if state.device_id == *device_id => {}
+            _ => {
+                warn!(
+                    "Dropping chunk for handle {} from device {:?}: task not assigned to it",
+                    handle, device_id
+                );
+                return;
+            }
+        }
+        let done = end.is_some();
+        let end = end.unwrap_or_default();
+        self.handle_inference_result_chunk(
+            task_id,
+            seq,
+            delta,
+            phase,
+            done,
+            end.error,
+            end.prompt_tokens,
+            end.completion_tokens,
+            end.analysis_tokens,
+            end.final_tokens,
+        )
+        .await;
+    }
+
     /// Handle inference result from device
     pub async fn handle_inference_result(
         &self,
@@ -470,7 +807,7 @@ impl InferenceScheduler {
         success: bool,
         result: Option<String>,
         error: Option<String>,
-        _execution_time_ms: u64,
+        execution_time_ms: u64,
         prompt_tokens: u32,
         completion_tokens: u32,
     ) {
@@ -478,19 +815,37 @@ impl InferenceScheduler {
             "Handling inference result for task {} (success: {})",
             task_id, success
         );
+        let sampled_tokens = if success { completion_tokens } else { 0 };
+        let Some(state) = self.complete_task(&task_id, sampled_tokens, execution_time_ms) else {
+            // This commonly happens when the SSE client disconnects and we cancel/remove the
+            // stream sender before the device finishes sending its final chunks.
+            debug!(
+                "Dropping inference result for task {} because it is no longer pending (likely canceled/disconnected)",
+                task_id
+            );
+            return;
+        };
+
+        if success {
+            self.observe_finished(&state, prompt_tokens, completion_tokens);
+        }
+
+        if let TaskSink::Stream(sender) = &state.sink {
+            // Streams normally finish through chunks; close them if a plain
+            // result arrives instead.
+            if success {
+                let _ = sender.send(StreamEvent::Finish(None)).await;
+            } else {
+                let _ = sender
+                    .send(StreamEvent::Error(error.unwrap_or_default()))
+                    .await;
+            }
+            let _ = sender.send(StreamEvent::Done).await;
+            return;
+        }
 
-        let mut tasks = self.pending_tasks.lock().await;
-        let all_tasks_before: Vec<String> = tasks.keys().cloned().collect();
-        info!("Current pending tasks count: {}", tasks.len());
-        info!("All tasks before removal: {:?}", all_tasks_before);
-
-        // Find the sender for this taskretain
-        let sender = tasks.remove(&task_id);
-        info!("pop sender : {:?}", sender);
-        if let Some(sender) = sender {
-            info!("Found and removed task {} from pending_tasks", task_id);
-            let remaining_tasks: Vec<String> = tasks.keys().cloned().collect();
-            info!("Remaining tasks after removal: {:?}", remaining_tasks);
+        if let Some(sender) = state.take_oneshot() {
+            info!("Found and removed task {} from pending tasks", task_id);
             let response = if success {
                 Ok(CompletionResponse {
                     id: task_id.clone(),
@@ -512,6 +867,7 @@ impl InferenceScheduler {
                         total_tokens: prompt_tokens.saturating_add(completion_tokens),
                         analysis_tokens: None,
                         final_tokens: None,
+                        speculative: state.take_speculative(),
                     },
                 })
             } else {
@@ -521,74 +877,70 @@ impl InferenceScheduler {
             if let Err(_) = sender.send(response) {
                 warn!("Failed to send result for task {}", task_id);
             }
-        } else {
-            {
-                let mut partial = self.partial_results.lock().await;
-                partial.remove(&task_id);
-            }
-
-            // This commonly happens when the SSE client disconnects and we cancel/remove the
-            // stream sender before the device finishes sending its final chunks.
-            debug!(
-                "Dropping inference result for task {} because it is no longer pending (likely canceled/disconnected). Available tasks were: {:?}",
-                task_id,
-                all_tasks_before
-            );
         }
     }
 
-    /// Select best Android device for inference
-    async fn select_best_device(
+    /// Select best Android device for inference whose context window fits
+    /// `needed_context` tokens
+    pub fn select_best_device(
         &self,
         allowed_client_ids: Option<&[ClientId]>,
+        needed_context: u32,
     ) -> Result<ClientId> {
-        let clients = self.active_clients.lock().await;
-
-        let mut best_device: Option<(ClientId, u16)> = None;
+        // Keep the CANDIDATE_LIMIT least heartbeat-loaded devices, then let
+        // the scoring policy choose among them.
+        let mut candidates: Vec<(u16, ClientId, Arc<crate::handle::ClientInfo>)> =
+            Vec::with_capacity(CANDIDATE_LIMIT + 1);
         let mut device_count = 0;
 
         let mut consider_device =
-            |client_id: &ClientId, client_info: &crate::handle::ClientInfo| {
+            |client_id: &ClientId, client_info: &Arc<crate::handle::ClientInfo>| {
                 // Only consider authenticated Android devices
-                if !client_info.authed {
+                if !client_info.authed
+                    || !client_info.fits_context(needed_context)
+                    || !client_info.accepts_tasks()
+                {
                     return;
                 }
-
-                // Check if device has system info (Android devices should have this)
-                let Some(system_info) = &client_info.system_info else {
-                    return;
-                };
-
-                // Simple load balancing: choose device with lowest CPU + Memory usage
-                let total_load: u16 = (system_info.cpu_usage + system_info.memory_usage) as u16;
                 device_count += 1;
 
-                if best_device.is_none() || total_load < best_device.as_ref().unwrap().1 {
-                    best_device = Some((*client_id, total_load));
+                let total_load = client_info.load.score();
+                if candidates.len() == CANDIDATE_LIMIT
+                    && total_load >= candidates[CANDIDATE_LIMIT - 1].0
+                {
+                    return;
                 }
+                let pos = candidates.partition_point(|(load, _, _)| *load <= total_load);
+                candidates.insert(pos, (total_load, *client_id, client_info.clone()));
+                candidates.truncate(CANDIDATE_LIMIT);
             };
 
         match allowed_client_ids {
             Some(allowed) => {
                 // Base set = allowed ids; lookup active client info from map (O(1) average)
                 for client_id in allowed {
-                    if let Some(client_info) = clients.get(client_id) {
-                        consider_device(client_id, client_info);
+                    if let Some(client_info) = self.active_clients.get(client_id) {
+                        consider_device(client_id, &client_info);
                     }
                 }
             }
             None => {
                 // No restriction; base set = all active clients
-                for (client_id, client_info) in clients.iter() {
-                    consider_device(client_id, client_info);
-                }
+                self.active_clients
+                    .for_each(|client_id, client_info| consider_device(client_id, client_info));
             }
         }
 
-        if let Some((client_id, _load)) = best_device {
+        let chosen = self.choose_device(
+            candidates
+                .into_iter()
+                .map(|(_, id, info)| (id, info))
+                .collect(),
+        );
+        if let Some(client_id) = chosen {
             info!(
-                "Selected device {:?} for inference (load: {}%, available devices: {})",
-                client_id, _load, device_count
+                "Selected device {:?} for inference (available devices: {})",
+                client_id, device_count
             );
             Ok(client_id)
         } else {
@@ -610,12 +962,12 @@ impl InferenceScheduler {
         repeat_last_n: i32,
         min_keep: u32,
     ) -> Result<()> {
-        use common::write_command;
+        use common::{write_command, write_commands};
 
         // Find active client connection
-        let mut clients = self.active_clients.lock().await;
-        let client_info = clients
-            .get_mut(device_id)
+        let client_info = self
+            .active_clients
+            .get(device_id)
             .ok_or_else(|| anyhow!("Device {:?} not found or not connected", device_id))?;
 
         // Check if client is authenticated and ready
@@ -648,7 +1000,10 @@ impl InferenceScheduler {
             "sent inference task {} to device {:?} :{:?}",
             task_id, device_id, command
         );
-        write_command(&mut *writer, &command).await?;
+        match self.task_handle_command(&client_info, &task_id) {
+            Some(handle) => write_commands(&mut *writer, &[handle, command]).await?,
+            None => write_command(&mut *writer, &command).await?,
+        }
         writer.flush().await?;
 
         info!(
@@ -663,30 +1018,38 @@ impl InferenceScheduler {
         &self,
         request: CompletionRequest,
         allowed_client_ids: Option<&[ClientId]>,
+        admission: &Admission,
     ) -> Result<CompletionResponse> {
         let task_id = Uuid::new_v4().to_string();
 
+        // Select best available device, waiting for one if all are busy
+        let demand = Demand {
+            model: None,
+            allowed: allowed_client_ids.map(<[ClientId]>::to_vec),
+            needed_context: required_context(request.prompt.len()),
+            relayable: false,
+        };
+        let model = request.model.as_deref().unwrap_or(DEFAULT_MODEL);
+        let device_id = self.place(demand, admission).await?;
+
         // Create response channel
         let (sender, receiver) = oneshot::channel();
-        {
-            let mut tasks = self.pending_tasks.lock().await;
-            let existing_tasks: Vec<String> = tasks.keys().cloned().collect();
-            info!("Existing tasks before insert: {:?}", existing_tasks);
-            tasks.insert(task_id.clone(), sender);
-            let all_tasks: Vec<String> = tasks.keys().cloned().collect();
-            info!(
-                "Stored task {} in pending_tasks (total: {})",
-                task_id,
-                tasks.len()
-            );
-            info!("All tasks in pending_tasks: {:?}", all_tasks);
-        }
-
-        // Select best available device
-        let device_id = self.select_best_device(allowed_client_ids).await?;
+        let state = self.register_task(
+            &task_id,
+            &device_id,
+            TaskSink::Oneshot(std::sync::Mutex::new(Some(sender))),
+            model,
+            admission.received,
+        );
+        info!(
+            "Stored task {} in pending tasks (total: {})",
+            task_id,
+            self.tasks.len()
+        );
 
         // Send task to device
         info!("About to send task {} to device {:?}", task_id, device_id);
+        let dispatched = Instant::now();
         if let Err(e) = self
             .send_task_to_device(
                 &device_id,
@@ -703,8 +1066,7 @@ impl InferenceScheduler {
             .await
         {
             // Clean up pending task on failure
-            let mut tasks = self.pending_tasks.lock().await;
-            tasks.remove(&task_id);
+            self.complete_task(&task_id, 0, 0);
             error!(
                 "Failed to send inference task to device {:?}: {}",
                 device_id, e
@@ -712,24 +1074,12 @@ impl InferenceScheduler {
             return Err(e);
         }
 
+        self.observe(&state, Stage::Dispatch, dispatched.elapsed());
         info!(
             "Task {} sent successfully, now waiting for result...",
             task_id
         );
 
-        // Check if task is still in pending_tasks before waiting
-        {
-            let tasks = self.pending_tasks.lock().await;
-            info!("Pending tasks count before timeout wait: {}", tasks.len());
-            if !tasks.contains_key(&task_id) {
-                error!("Task {} missing from pending_tasks before wait!", task_id);
-                return Err(anyhow!(
-                    "Task {} was removed from pending_tasks unexpectedly",
-                    task_id
-                ));
-            }
-        }
-
         // Wait for result with timeout
         let timeout_secs: u64 = std::env::var("GPUF_INFERENCE_TIMEOUT_SECS")
             .ok()
@@ -752,8 +1102,7 @@ impl InferenceScheduler {
             }
             Err(_) => {
                 // Clean up pending task on timeout
-                let mut tasks = self.pending_tasks.lock().await;
-                tasks.remove(&task_id);
+                self.complete_task(&task_id, 0, 0);
                 warn!("Task {} timed out after {} seconds", task_id, timeout_secs);
                 Err(anyhow!(
                     "Inference task timed out after {} seconds",
@@ -768,7 +1117,6 @@ impl InferenceScheduler {
         &self,
         allowed_client_ids: Option<&[ClientId]>,
     ) -> Vec<DeviceInfo> {
-        let clients = self.active_clients.lock().await;
         let mut devices = Vec::new();
 
         let mut maybe_push_device =
@@ -778,21 +1126,10 @@ impl InferenceScheduler {
                 }
                 let device = DeviceInfo {
                     client_id: hex::encode(&client_id.0),
-                    status: if client_info.system_info.is_some() {
-                        "online".to_string()
-                    } else {
-                        "initializing".to_string()
-                    },
-                    cpu_usage: client_info
-                        .system_info
-                        .as_ref()
-                        .map(|s| s.cpu_usage)
-                        .unwrap_or(0),
-                    memory_usage: client_info
-                        .system_info
-                        .as_ref()
-                        .map(|s| s.memory_usage)
-                        .unwrap_or(0),
+                    // Load figures are seeded at login, so every registered device is online.
+                    status: "online".to_string(),
+                    cpu_usage: client_info.load.cpu_usage(),
+                    memory_usage: client_info.load.memory_usage(),
                     device_count: client_info.devices_info.len() as u32,
                 };
                 devices.push(device);
@@ -801,15 +1138,14 @@ impl InferenceScheduler {
         match allowed_client_ids {
             Some(allowed) => {
                 for client_id in allowed {
-                    if let Some(client_info) = clients.get(client_id) {
-                        maybe_push_device(client_id, client_info);
+                    if let Some(client_info) = self.active_clients.get(client_id) {
+                        maybe_push_device(client_id, &client_info);
                     }
                 }
             }
             None => {
-                for (client_id, client_info) in clients.iter() {
-                    maybe_push_device(client_id, client_info);
-                }
+                self.active_clients
+                    .for_each(|client_id, client_info| maybe_push_device(client_id, client_info));
             }
         }
 
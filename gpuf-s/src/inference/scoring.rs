@@ -0,0 +1,129 @@
+//! Device scoring policies for the inference scheduler.
+//!
+//! Heartbeat load is up to 120s stale and says nothing about tasks the
+//! scheduler has already dispatched, so ranking on it alone sends a burst of
+//! requests to the same device. Policies here combine in-flight counts,
+//! capacity reported at login and observed throughput into an expected wait,
+//! and [`choose`] samples two candidates (power of two choices) so concurrent
+//! requests spread across comparable devices.
+
+use crate::handle::ClientInfo;
+
+use common::ThrottleLevel;
+use rand::Rng;
+use std::sync::Arc;
+
+/// How many devices are pre-selected by heartbeat load before scoring.
+pub const CANDIDATE_LIMIT: usize = 8;
+
+/// Rough decode speed per reported TFLOP, used until a device has completed
+/// a task and its throughput has been observed.
+const TOKENS_PER_SEC_PER_TFLOP: f64 = 2.0;
+
+pub trait ScoringPolicy: Send + Sync {
+    /// Lower is better.
+    fn score(&self, info: &ClientInfo) -> f64;
+}
+
+/// Default policy: expected seconds until a new task would finish its first
+/// share of work, scaled by heartbeat load and memory headroom.
+#[derive(Debug, Default, Clone, Copy)]
+pub struct CapacityScoring;
+
+impl CapacityScoring {
+    pub fn expected_wait(
+        inflight: u32,
+        tokens_per_sec: Option<f64>,
+        total_tflops: u32,
+        load_score: u16,
+        memory_usage: u8,
+        memsize_gb: u32,
+    ) -> f64 {
+        let throughput = tokens_per_sec
+            .unwrap_or(total_tflops.max(1) as f64 * TOKENS_PER_SEC_PER_TFLOP)
+            .max(0.1);
+        // load_score is cpu + memory percent, 0..=200.
+        let load_factor = 1.0 + load_score.min(200) as f64 / 200.0;
+        let free_gb = memsize_gb as f64 * (100 - memory_usage.min(100)) as f64 / 100.0;
+        let memory_factor = 1.0 + 1.0 / (1.0 + free_gb);
+        (inflight as f64 + 1.0) / throughput * load_factor * memory_factor
+    }
+
+    /// Penalty for a device throttling for heat or battery. Its observed
+    /// throughput lags the throttling, so the level is weighed directly.
+    pub fn throttle_factor(level: ThrottleLevel) -> f64 {
+        match level {
+            ThrottleLevel::Normal => 1.0,
+            ThrottleLevel::Warm => 1.5,
+            ThrottleLevel::Hot => 4.0,
+            // Critical devices refuse tasks and are filtered out beforehand.
+            ThrottleLevel::Critical => 16.0,
+        }
+    }
+}
+
+impl ScoringPolicy for CapacityScoring {
+    fn score(&self, info: &ClientInfo) -> f64 {
+        Self::expected_wait(
+            info.stats.inflight().max(info.load.reported_busy()),
+            info.load.reported_tokens_per_sec().or(info.stats.tokens_per_sec()),
+            info.total_tflops,
+            info.load.score(),
+            info.load.memory_usage(),
+            info.memsize_gb,
+        ) * Self::throttle_factor(info.throttle())
+    }
+}
+
+/// Pick an index from `candidates` with power-of-two-choices sampling.
+pub fn choose(policy: &dyn ScoringPolicy, candidates: &[Arc<ClientInfo>]) -> Option<usize> {
+    let scores: Vec<f64> = candidates.iter().map(|c| policy.score(c)).collect();
+    pick_two(&scores, &mut rand::thread_rng())
+}
+
+/// Pick an index from precomputed scores the same way, for candidates
+/// scored elsewhere.
+pub fn choose_scores(scores: &[f64]) -> Option<usize> {
+    pick_two(scores, &mut rand::thread_rng())
+}
+
+fn pick_two<R: Rng>(scores: &[f64], rng: &mut R) -> Option<usize> {
+    match scores.len() {
+        0 => None,
+        1 => Some(0),
+        n => {
+            let a = rng.gen_range(0..n);
+            let mut b = rng.gen_range(0..n - 1);
+            if b >= a {
+                b += 1;
+            }
+            Some(if scores[b] < scores[a] { b } else { a })
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_expected_wait_prefers_idle_fast_devices() {
+        let idle = CapacityScoring::expected_wait(0, None, 10, 40, 20, 8);
+        let busy = CapacityScoring::expected_wait(3, None, 10, 40, 20, 8);
+        let slow = CapacityScoring::expected_wait(0, Some(2.0), 10, 40, 20, 8);
+        let fast = CapacityScoring::expected_wait(0, Some(40.0), 10, 40, 20, 8);
+        assert!(idle < busy);
+        assert!(fast < slow);
+    }
+
+    #[test]
+    fn test_pick_two_never_picks_worst_of_many() {
+        let scores = [1.0, 2.0, 3.0, 4.0];
+        let mut rng = rand::thread_rng();
+        for _ in 0..100 {
+            assert_ne!(pick_two(&scores, &mut rng), Some(3));
+        }
+        assert_eq!(pick_two(&[], &mut rng), None);
+        assert_eq!(pick_two(&[5.0], &mut rng), Some(0));
+    }
+}
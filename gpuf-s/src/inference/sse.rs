@@ -0,0 +1,178 @@
+//! Server-sent event framing for streamed completions.
+//!
+//! Every chunk of a stream repeats the same id, model and creation time, so
+//! building a `serde_json::Value` per token and formatting it again is most of
+//! the gateway's per-token work. A [`ChunkWriter`] serializes that common
+//! head once per stream and then writes each chunk as head, escaped text and
+//! a fixed tail straight into one reused buffer. Several chunks can sit in the
+//! buffer before it is taken, which is how pending deltas are packed into a
+//! single body frame for a slow client.
+
+use super::scheduler::CompletionUsage;
+use bytes::{BufMut, Bytes, BytesMut};
+use common::OutputPhase;
+use serde::Serialize;
+
+/// Response shape of the stream.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ChunkKind {
+    /// `text_completion` chunks for `/v1/completions`.
+    Completion,
+    /// `chat.completion.chunk` chunks for `/v1/chat/completions`.
+    Chat,
+}
+
+pub struct ChunkWriter {
+    kind: ChunkKind,
+    /// `data: {"id":..,"object":..,"created":..,"model":..,"choices":[{"index":0,`
+    head: Vec<u8>,
+    buf: BytesMut,
+}
+
+impl ChunkWriter {
+    pub fn new(kind: ChunkKind, id: &str, model: &str, created: u64) -> Self {
+        let object = match kind {
+            ChunkKind::Completion => "text_completion",
+            ChunkKind::Chat => "chat.completion.chunk",
+        };
+        let mut head = b"data: {\"id\":".to_vec();
+        json_into(&mut head, id);
+        head.extend_from_slice(b",\"object\":\"");
+        head.extend_from_slice(object.as_bytes());
+        head.extend_from_slice(b"\",\"created\":");
+        head.extend_from_slice(created.to_string().as_bytes());
+        head.extend_from_slice(b",\"model\":");
+        json_into(&mut head, model);
+        head.extend_from_slice(b",\"choices\":[{\"index\":0,");
+        Self {
+            kind,
+            head,
+            buf: BytesMut::with_capacity(4096),
+        }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.buf.is_empty()
+    }
+
+    pub fn len(&self) -> usize {
+        self.buf.len()
+    }
+
+    /// A chunk carrying `text`; analysis text goes to `reasoning_content` in
+    /// chat streams.
+    pub fn delta(&mut self, phase: OutputPhase, text: &str) {
+        self.buf.extend_from_slice(&self.head);
+        match self.kind {
+            ChunkKind::Completion => self.buf.extend_from_slice(b"\"text\":"),
+            ChunkKind::Chat if phase == OutputPhase::Analysis => self
+                .buf
+                .extend_from_slice(b"\"delta\":{\"role\":\"assistant\",\"reasoning_content\":"),
+            ChunkKind::Chat => self
+                .buf
+                .extend_from_slice(b"\"delta\":{\"role\":\"assistant\",\"content\":"),
+        }
+        self.json(text);
+        if self.kind == ChunkKind::Chat {
+            self.buf.put_u8(b'}');
+        }
+        self.buf
+            .extend_from_slice(b",\"finish_reason\":null}]}\n\n");
+    }
+
+    /// The last chunk, with any held-back `tail` text and the usage.
+    pub fn finish(&mut self, tail: &str, finish_reason: &str, usage: Option<&CompletionUsage>) {
+        self.buf.extend_from_slice(&self.head);
+        match self.kind {
+            ChunkKind::Completion => {
+                self.buf.extend_from_slice(b"\"text\":");
+                self.json(tail);
+            }
+            ChunkKind::Chat if tail.is_empty() => {
+                self.buf
+                    .extend_from_slice(b"\"delta\":{\"role\":\"assistant\"}");
+            }
+            ChunkKind::Chat => {
+                self.buf
+                    .extend_from_slice(b"\"delta\":{\"role\":\"assistant\",\"content\":");
+                self.json(tail);
+                self.buf.put_u8(b'}');
+            }
+        }
+        self.buf.extend_from_slice(b",\"finish_reason\":");
+        self.json(finish_reason);
+        self.buf.extend_from_slice(b"}],\"usage\":");
+        self.json(&usage);
+        self.buf.extend_from_slice(b"}\n\n");
+    }
+
+    pub fn error(&mut self, message: &str) {
+        self.buf
+            .extend_from_slice(b"data: {\"error\":{\"message\":");
+        self.json(message);
+        self.buf
+            .extend_from_slice(b",\"type\":\"api_error\",\"code\":500}}\n\n");
+    }
+
+    pub fn done(&mut self) {
+        self.buf.extend_from_slice(b"data: [DONE]\n\n");
+    }
+
+    /// Everything written since the last take, as one body frame. The buffer
+    /// gets its space back once the frame has been sent and dropped.
+    pub fn take(&mut self) -> Bytes {
+        self.buf.split().freeze()
+    }
+
+    fn json<T: Serialize + ?Sized>(&mut self, value: &T) {
+        // Writing to memory cannot fail.
+        let _ = serde_json::to_writer((&mut self.buf).writer(), value);
+    }
+}
+
+fn json_into(out: &mut Vec<u8>, value: &str) {
+    let _ = serde_json::to_writer(out, value);
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use serde_json::{json, Value};
+
+    fn events(frame: &[u8]) -> Vec<Value> {
+        std::str::from_utf8(frame)
+            .unwrap()
+            .split("\n\n")
+            .filter_map(|e| e.strip_prefix("data: "))
+            .filter(|e| *e != "[DONE]")
+            .map(|e| serde_json::from_str(e).unwrap())
+            .collect()
+    }
+
+    #[test]
+    fn test_chunks_pack_into_one_frame() {
+        let mut w = ChunkWriter::new(ChunkKind::Chat, "task-1", "m\"x", 7);
+        w.delta(OutputPhase::Analysis, "think\n");
+        w.delta(OutputPhase::Final, "say \"hi\"");
+        w.finish("", "stop", None);
+        w.done();
+        let frame = w.take();
+        assert!(w.is_empty());
+        assert!(frame.ends_with(b"data: [DONE]\n\n"));
+
+        let chunks = events(&frame);
+        assert_eq!(chunks.len(), 3);
+        assert_eq!(chunks[0]["model"], "m\"x");
+        assert_eq!(chunks[0]["created"], 7);
+        assert_eq!(
+            chunks[0]["choices"][0]["delta"]["reasoning_content"],
+            "think\n"
+        );
+        assert_eq!(chunks[1]["choices"][0]["delta"]["content"], "say \"hi\"");
+        assert_eq!(
+            chunks[2]["choices"][0],
+            json!({"index": 0, "delta": {"role": "assistant"}, "finish_reason": "stop"})
+        );
+        assert_eq!(chunks[2]["usage"], Value::Null);
+    }
+}
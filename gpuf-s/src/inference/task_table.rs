@@ -0,0 +1,251 @@
+//! Per-task state for dispatched inference requests.
+//!
+//! Each task owns one [`TaskState`] holding its result sink, the device it runs
+//! on and any partial output. The table that maps task ids to states is
+//! sharded, so a result chunk costs one uncontended shard read to find its
+//! state, and removal on completion is a single O(1) delete. Removal is also
+//! the completion point: only the caller that removes a task finishes it.
+//!
+//! Every task also gets a numeric handle that workers can use in compact
+//! result chunks instead of the UUID string.
+
+use super::scheduler::{CompletionResponse, SpeculativeUsage, StreamEvent};
+use crate::util::protoc::ClientId;
+
+use anyhow::Result;
+use common::TaskTimings;
+use std::collections::hash_map::RandomState;
+use std::collections::HashMap;
+use std::hash::BuildHasher;
+use std::sync::atomic::{AtomicBool, AtomicU32, Ordering};
+use std::sync::{Arc, Mutex, RwLock};
+use std::time::Instant;
+use tokio::sync::{mpsc, oneshot};
+
+const SHARD_COUNT: usize = 64;
+
+pub enum TaskSink {
+    /// Streaming request: chunks are forwarded as they arrive.
+    Stream(mpsc::Sender<StreamEvent>),
+    /// Blocking request: output is accumulated and sent once.
+    Oneshot(Mutex<Option<oneshot::Sender<Result<CompletionResponse>>>>),
+}
+
+pub struct TaskState {
+    pub handle: u32,
+    pub device_id: ClientId,
+    pub started: Instant,
+    pub sink: TaskSink,
+    /// Labels the task's latency is recorded under.
+    pub model: String,
+    pub device_class: &'static str,
+    /// When the request reached the gateway.
+    pub received: Instant,
+    partial: Mutex<String>,
+    speculative: Mutex<Option<SpeculativeUsage>>,
+    timings: Mutex<Option<TaskTimings>>,
+    chunk_seen: AtomicBool,
+}
+
+impl TaskState {
+    pub fn new(device_id: ClientId, sink: TaskSink) -> Self {
+        let now = Instant::now();
+        Self {
+            handle: 0,
+            device_id,
+            started: now,
+            sink,
+            model: String::new(),
+            device_class: "unknown",
+            received: now,
+            partial: Mutex::new(String::new()),
+            speculative: Mutex::new(None),
+            timings: Mutex::new(None),
+            chunk_seen: AtomicBool::new(false),
+        }
+    }
+
+    pub fn with_labels(
+        mut self,
+        model: &str,
+        device_class: &'static str,
+        received: Instant,
+    ) -> Self {
+        self.model = model.to_string();
+        self.device_class = device_class;
+        self.received = received;
+        self
+    }
+
+    /// True for the first result chunk of the task only.
+    pub fn first_chunk(&self) -> bool {
+        !self.chunk_seen.swap(true, Ordering::Relaxed)
+    }
+
+    pub fn set_timings(&self, timings: TaskTimings) {
+        *self.timings.lock().unwrap_or_else(|e| e.into_inner()) = Some(timings);
+    }
+
+    pub fn take_timings(&self) -> Option<TaskTimings> {
+        self.timings
+            .lock()
+            .unwrap_or_else(|e| e.into_inner())
+            .take()
+    }
+
+    pub fn set_speculative(&self, usage: SpeculativeUsage) {
+        *self.speculative.lock().unwrap_or_else(|e| e.into_inner()) = Some(usage);
+    }
+
+    pub fn take_speculative(&self) -> Option<SpeculativeUsage> {
+        self.speculative
+            .lock()
+            .unwrap_or_else(|e| e.into_inner())
+            .take()
+    }
+
+    pub fn push_partial(&self, delta: &str) {
+        self.partial
+            .lock()
+            .unwrap_or_else(|e| e.into_inner())
+            .push_str(delta);
+    }
+
+    pub fn take_partial(&self) -> String {
+        std::mem::take(&mut *self.partial.lock().unwrap_or_else(|e| e.into_inner()))
+    }
+
+    pub fn take_oneshot(&self) -> Option<oneshot::Sender<Result<CompletionResponse>>> {
+        match &self.sink {
+            TaskSink::Oneshot(sender) => sender.lock().unwrap_or_else(|e| e.into_inner()).take(),
+            TaskSink::Stream(_) => None,
+        }
+    }
+}
+
+type Shard = RwLock<HashMap<String, Arc<TaskState>>>;
+
+pub struct TaskTable {
+    shards: Box<[Shard]>,
+    handles: Box<[RwLock<HashMap<u32, String>>]>,
+    next_handle: AtomicU32,
+    hasher: RandomState,
+}
+
+impl Default for TaskTable {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl TaskTable {
+    pub fn new() -> Self {
+        Self {
+            shards: (0..SHARD_COUNT)
+                .map(|_| RwLock::new(HashMap::new()))
+                .collect::<Vec<_>>()
+                .into_boxed_slice(),
+            handles: (0..SHARD_COUNT)
+                .map(|_| RwLock::new(HashMap::new()))
+                .collect::<Vec<_>>()
+                .into_boxed_slice(),
+            next_handle: AtomicU32::new(1),
+            hasher: RandomState::new(),
+        }
+    }
+
+    fn shard(&self, task_id: &str) -> &Shard {
+        let h = self.hasher.hash_one(task_id);
+        &self.shards[(h as usize) % self.shards.len()]
+    }
+
+    fn handle_shard(&self, handle: u32) -> &RwLock<HashMap<u32, String>> {
+        &self.handles[handle as usize % self.handles.len()]
+    }
+
+    /// Store `state` under `task_id` and assign it a fresh handle.
+    pub fn insert(&self, task_id: String, mut state: TaskState) -> Arc<TaskState> {
+        state.handle = self.next_handle.fetch_add(1, Ordering::Relaxed);
+        self.handle_shard(state.handle)
+            .write()
+            .unwrap_or_else(|e| e.into_inner())
+            .insert(state.handle, task_id.clone());
+        let state = Arc::new(state);
+        self.shard(&task_id)
+            .write()
+            .unwrap_or_else(|e| e.into_inner())
+            .insert(task_id, state.clone());
+        state
+    }
+
+    pub fn get(&self, task_id: &str) -> Option<Arc<TaskState>> {
+        self.shard(task_id)
+            .read()
+            .unwrap_or_else(|e| e.into_inner())
+            .get(task_id)
+            .cloned()
+    }
+
+    pub fn remove(&self, task_id: &str) -> Option<Arc<TaskState>> {
+        let state = self
+            .shard(task_id)
+            .write()
+            .unwrap_or_else(|e| e.into_inner())
+            .remove(task_id)?;
+        self.handle_shard(state.handle)
+            .write()
+            .unwrap_or_else(|e| e.into_inner())
+            .remove(&state.handle);
+        Some(state)
+    }
+
+    pub fn task_id_for(&self, handle: u32) -> Option<String> {
+        self.handle_shard(handle)
+            .read()
+            .unwrap_or_else(|e| e.into_inner())
+            .get(&handle)
+            .cloned()
+    }
+
+    pub fn contains(&self, task_id: &str) -> bool {
+        self.shard(task_id)
+            .read()
+            .unwrap_or_else(|e| e.into_inner())
+            .contains_key(task_id)
+    }
+
+    pub fn len(&self) -> usize {
+        self.shards
+            .iter()
+            .map(|s| s.read().unwrap_or_else(|e| e.into_inner()).len())
+            .sum()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_remove_completes_once() {
+        let table = TaskTable::new();
+        let (tx, _rx) = oneshot::channel();
+        let state = table.insert(
+            "t1".to_string(),
+            TaskState::new(ClientId([1; 16]), TaskSink::Oneshot(Mutex::new(Some(tx)))),
+        );
+        state.push_partial("hello ");
+        state.push_partial("world");
+        assert!(table.contains("t1"));
+        assert_eq!(table.len(), 1);
+        assert_eq!(table.task_id_for(state.handle).as_deref(), Some("t1"));
+
+        let removed = table.remove("t1").unwrap();
+        assert_eq!(removed.take_partial(), "hello world");
+        assert!(removed.take_oneshot().is_some());
+        assert!(removed.take_oneshot().is_none());
+        assert!(table.remove("t1").is_none());
+        assert!(table.task_id_for(state.handle).is_none());
+        assert!(table.get("t1").is_none());
+    }
+}
@@ -5,3 +5,5 @@ pub mod db;
 pub mod handle;
 pub mod inference;
 pub mod util;
+#[cfg(all(feature = "xdp", target_os = "linux"))]
+pub mod xdp;
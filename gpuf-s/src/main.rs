@@ -10,6 +10,8 @@ mod xdp;
 use anyhow::Result;
 use clap::Parser;
 use std::sync::Arc;
+#[cfg(all(feature = "xdp", target_os = "linux"))]
+use std::time::Duration;
 use tokio::net::TcpListener;
 #[cfg(target_os = "linux")]
 use tokio::signal::unix::{signal, SignalKind};
@@ -47,12 +49,64 @@ async fn main() -> Result<()> {
     let server_state3 = Arc::clone(&server_state);
     let _server_state4 = Arc::clone(&server_state);
 
+    #[cfg(all(feature = "xdp", target_os = "linux"))]
+    let xdp_filter = match &args.xdp_interface {
+        Some(interface) => {
+            let filter = Arc::new(xdp::xdp_filter::XdpFilter::attach(
+                interface,
+                args.xdp_object.as_deref(),
+                args.public_port,
+            )?);
+            tokio::spawn(filter.clone().run_key_sync(
+                server_state.db_pool.clone(),
+                server_state.redis_client.clone(),
+                Duration::from_secs(args.xdp_sync_secs.max(1)),
+            ));
+            Some(filter)
+        }
+        None => None,
+    };
+    #[cfg(not(all(feature = "xdp", target_os = "linux")))]
+    if args.xdp_interface.is_some() {
+        tracing::warn!("--xdp-interface ignored: built without the xdp feature");
+    }
+
+    if let (Some(port), Some(cluster)) = (
+        args.cluster_port,
+        server_state.inference_scheduler.cluster().cloned(),
+    ) {
+        // Relays carry the cluster secret in the clear, so the port is only
+        // opened on the advertised (private) interface, never 0.0.0.0.
+        let host = args
+            .cluster_advertise
+            .as_deref()
+            .and_then(|addr| addr.rsplit_once(':'))
+            .map(|(host, _)| host)
+            .ok_or_else(|| anyhow::anyhow!("--cluster-advertise must be host:port"))?;
+        let cluster_listener = TcpListener::bind(format!("{}:{}", host, port)).await?;
+        tokio::spawn(cluster.run(server_state.inference_scheduler.clone(), cluster_listener));
+    }
+
     // Start inference gateway on port 8081
-    let inference_gateway = Arc::new(inference::InferenceGateway::new(
+    let inference_gateway = inference::InferenceGateway::new(
         server_state.inference_scheduler.clone(),
         server_state.db_pool.clone(),
-        server_state.producer.clone(),
-    ));
+        server_state.token_cache.clone(),
+        server_state.kafka.clone(),
+    )
+    .with_buffer_pools(vec![
+        ("public", server_state.buffer_pool.clone()),
+        ("relay", server_state.relay_buffers.clone()),
+    ])
+    .with_response_cache(args.response_cache_ttl_secs.map(|ttl| {
+        Arc::new(inference::response_cache::ResponseCache::new(
+            server_state.redis_client.clone(),
+            std::time::Duration::from_secs(ttl),
+        ))
+    }));
+    #[cfg(all(feature = "xdp", target_os = "linux"))]
+    let inference_gateway = inference_gateway.with_xdp_filter(xdp_filter);
+    let inference_gateway = Arc::new(inference_gateway);
     let inference_gateway_task = tokio::spawn(async move {
         info!("Starting Inference Gateway on port 8081...");
         if let Err(e) = inference_gateway.run(8081).await {
@@ -14,6 +14,31 @@ pub struct Args {
     #[arg(long, default_value_t = 18081)]
     pub api_port: u16,
 
+    /// Idle proxy connections kept open per worker for incoming requests (0 disables)
+    #[arg(long, default_value_t = 2)]
+    pub proxy_warm_conns: usize,
+
+    /// Port other gpuf-s nodes relay tasks through; unset runs this node alone
+    #[arg(long)]
+    pub cluster_port: Option<u16>,
+
+    /// host:port other nodes reach the cluster port at (required with --cluster-port);
+    /// the cluster port listens on this host only, so use a private interface address
+    #[arg(long)]
+    pub cluster_advertise: Option<String>,
+
+    /// Secret every node of the cluster presents when it connects (required with --cluster-port)
+    #[arg(long, default_value = "")]
+    pub cluster_secret: String,
+
+    /// Name of this node in the cluster directory; random when unset
+    #[arg(long)]
+    pub node_id: Option<String>,
+
+    /// Seconds between publishes of this node's devices to the cluster directory
+    #[arg(long, default_value_t = 2)]
+    pub cluster_publish_secs: u64,
+
     /// Print client monitoring data
     #[arg(long)]
     pub monitor: bool,
@@ -41,6 +66,38 @@ pub struct Args {
     #[arg(long, default_value = "redis://127.0.0.1:6379")]
     pub redis_url: String,
 
+    /// Cache temperature-0 chat replies in Redis for this many seconds (unset disables)
+    #[arg(long)]
+    pub response_cache_ttl_secs: Option<u64>,
+
     #[arg(long, default_value = "localhost:9092")]
     pub bootstrap_server: String,
+
+    /// Milliseconds the Kafka producer waits to fill a batch
+    #[arg(long, default_value_t = 50)]
+    pub kafka_linger_ms: u32,
+
+    /// Upper bound on a Kafka producer batch, in bytes
+    #[arg(long, default_value_t = 256 * 1024)]
+    pub kafka_batch_bytes: u32,
+
+    /// Kafka batch compression: lz4, zstd, snappy, gzip or none
+    #[arg(long, default_value = "lz4")]
+    pub kafka_compression: String,
+
+    /// Events buffered ahead of the Kafka producer before new ones are dropped
+    #[arg(long, default_value_t = 16 * 1024)]
+    pub kafka_queue_capacity: usize,
+
+    /// Attach the XDP API key prefilter to this interface (requires the xdp feature)
+    #[arg(long)]
+    pub xdp_interface: Option<String>,
+
+    /// Load the XDP program from this object instead of the one built into the binary
+    #[arg(long)]
+    pub xdp_object: Option<String>,
+
+    /// Seconds between full XDP key syncs from the tokens table
+    #[arg(long, default_value_t = 30)]
+    pub xdp_sync_secs: u64,
 }
@@ -1,16 +1,21 @@
-use anyhow::Result;
+use anyhow::{anyhow, Result};
+use futures_util::StreamExt;
 use rdkafka::config::ClientConfig;
 use rdkafka::producer::FutureProducer;
-use redis::Client;
+
+use super::kafka::ProducerSettings;
+use redis::{AsyncCommands, Client};
 use sqlx::{Pool, Postgres};
 use std::sync::Arc;
-use tracing::{error, info};
+use std::time::Duration;
+use tracing::{debug, error, info, warn};
 
 // Database functions
 pub async fn init_db(
     bootstrap_server: &str,
     database_url: &str,
     redis_url: &str,
+    producer_settings: &ProducerSettings,
 ) -> Result<(Arc<Pool<Postgres>>, Arc<Client>, Arc<FutureProducer>)> {
     let db_pool = match sqlx::postgres::PgPoolOptions::new()
         .max_connections(10)
@@ -34,12 +39,70 @@ pub async fn init_db(
     });
     info!("Connected to Redis successfully");
 
-    let producer: FutureProducer = ClientConfig::new()
-        .set("bootstrap.servers", bootstrap_server)
-        // #[cfg(debug_assertions)]
-        // .set("debug", "all")
-        .create()
-        .expect("Producer creation error");
+    let mut producer_config = ClientConfig::new();
+    producer_config.set("bootstrap.servers", bootstrap_server);
+    // #[cfg(debug_assertions)]
+    // producer_config.set("debug", "all");
+    producer_settings.apply(&mut producer_config);
+    let producer: FutureProducer = producer_config.create().expect("Producer creation error");
 
     Ok((Arc::new(db_pool), redis_client, Arc::new(producer)))
 }
+
+/// Message delivered to cache listeners when they must drop everything.
+pub const INVALIDATE_ALL: &str = "*";
+
+/// Feed messages published on `channel` to `on_message` for the lifetime of
+/// the process. [`INVALIDATE_ALL`] is delivered whenever the subscription
+/// (re)connects or drops, since messages may have been missed meanwhile.
+pub async fn listen_invalidations<F>(
+    redis_client: Arc<Client>,
+    channel: &'static str,
+    on_message: F,
+) where
+    F: Fn(&str),
+{
+    loop {
+        if let Err(e) = subscribe_invalidations(&redis_client, channel, &on_message).await {
+            warn!("Invalidation subscription to {} failed: {}", channel, e);
+        }
+        on_message(INVALIDATE_ALL);
+        tokio::time::sleep(Duration::from_secs(1)).await;
+    }
+}
+
+async fn subscribe_invalidations<F>(
+    redis_client: &Client,
+    channel: &str,
+    on_message: &F,
+) -> Result<()>
+where
+    F: Fn(&str),
+{
+    let mut pubsub = redis_client.get_async_connection().await?.into_pubsub();
+    pubsub.subscribe(channel).await?;
+    on_message(INVALIDATE_ALL);
+    let mut messages = pubsub.on_message();
+    while let Some(msg) = messages.next().await {
+        let message: String = msg.get_payload()?;
+        debug!("Invalidation on {}: {}", channel, message);
+        on_message(&message);
+    }
+    Err(anyhow!("subscription stream ended"))
+}
+
+/// Publish `message` on `channel`; failures are logged, since the caches
+/// listening also expire entries on their own.
+pub async fn publish_invalidation(redis_client: &Client, channel: &str, message: &str) {
+    let result: Result<i64> = async {
+        let mut conn = redis_client.get_async_connection().await?;
+        Ok(conn.publish(channel, message).await?)
+    }
+    .await;
+    if let Err(e) = result {
+        warn!(
+            "Failed to publish invalidation {} on {}: {}",
+            message, channel, e
+        );
+    }
+}
@@ -0,0 +1,211 @@
+//! Fire-and-forget Kafka producer stage.
+//!
+//! Heartbeats and request metrics used to `await` a `producer.send` inside
+//! the connection task, so a slow broker stalled the client read loop. Events
+//! now go into a bounded channel drained by one task that hands them to
+//! librdkafka, which batches them per partition (`linger.ms`, `batch.size`)
+//! and compresses each batch. When the channel or librdkafka's queue is full
+//! the event is dropped and counted; callers never wait on the broker.
+
+use bincode::config::{self, Configuration, Fixint, LittleEndian};
+use futures_util::stream::{FuturesUnordered, StreamExt};
+use rdkafka::config::ClientConfig;
+use rdkafka::producer::{FutureProducer, FutureRecord, Producer};
+use serde::Serialize;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::Duration;
+use tokio::sync::mpsc;
+use tracing::{info, warn};
+
+/// Events taken off the channel per wakeup of the drain task.
+const DRAIN_BATCH: usize = 256;
+/// Log one drop in this many, so a broker outage does not flood the log.
+const DROP_LOG_EVERY: u64 = 1000;
+
+/// Bincode settings shared by every topic, producers and consumers alike.
+pub fn wire_config() -> Configuration<LittleEndian, Fixint> {
+    config::standard()
+        .with_fixed_int_encoding()
+        .with_little_endian()
+}
+
+/// Encode a message for any of our topics.
+pub fn encode<T: bincode::Encode>(message: &T) -> Result<Vec<u8>, bincode::error::EncodeError> {
+    bincode::encode_to_vec(message, wire_config())
+}
+
+/// Producer batching settings.
+#[derive(Debug, Clone)]
+pub struct ProducerSettings {
+    pub linger_ms: u32,
+    pub batch_bytes: u32,
+    /// lz4, zstd, snappy, gzip or none.
+    pub compression: String,
+}
+
+impl ProducerSettings {
+    pub fn apply(&self, config: &mut ClientConfig) {
+        config
+            .set("linger.ms", self.linger_ms.to_string())
+            .set("batch.size", self.batch_bytes.to_string())
+            .set("compression.type", &self.compression);
+    }
+}
+
+struct Event {
+    topic: &'static str,
+    key: String,
+    payload: Vec<u8>,
+}
+
+#[derive(Debug, Default)]
+struct Counters {
+    delivered: AtomicU64,
+    dropped: AtomicU64,
+    failed: AtomicU64,
+}
+
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq, Serialize)]
+pub struct SinkStats {
+    pub delivered: u64,
+    /// Never handed to librdkafka because a queue was full.
+    pub dropped: u64,
+    /// Handed over but not acknowledged by the broker.
+    pub failed: u64,
+}
+
+pub struct KafkaSink {
+    tx: mpsc::Sender<Event>,
+    counters: Arc<Counters>,
+    producer: Arc<FutureProducer>,
+}
+
+impl KafkaSink {
+    /// Spawn the drain task for `producer`, buffering up to `capacity`
+    /// events ahead of it.
+    pub fn start(producer: Arc<FutureProducer>, capacity: usize) -> Arc<Self> {
+        let (tx, rx) = mpsc::channel(capacity.max(1));
+        let counters = Arc::new(Counters::default());
+        tokio::spawn(drain(producer.clone(), rx, counters.clone()));
+        Arc::new(Self {
+            tx,
+            counters,
+            producer,
+        })
+    }
+
+    /// Queue `payload` for `topic`; returns at once whether or not there was
+    /// room for it.
+    pub fn publish(&self, topic: &'static str, key: String, payload: Vec<u8>) {
+        let event = Event {
+            topic,
+            key,
+            payload,
+        };
+        if self.tx.try_send(event).is_err() {
+            self.note_drop(topic);
+        }
+    }
+
+    pub fn stats(&self) -> SinkStats {
+        SinkStats {
+            delivered: self.counters.delivered.load(Ordering::Relaxed),
+            dropped: self.counters.dropped.load(Ordering::Relaxed),
+            failed: self.counters.failed.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Block until librdkafka has sent what it holds, for shutdown.
+    pub fn flush(&self, timeout: Duration) -> rdkafka::error::KafkaResult<()> {
+        self.producer.flush(timeout)
+    }
+
+    fn note_drop(&self, topic: &str) {
+        if count_drop(&self.counters) {
+            warn!("Kafka queue full, dropping events (latest on {})", topic);
+        }
+    }
+}
+
+/// Count a dropped event; true when this one should be logged.
+fn count_drop(counters: &Counters) -> bool {
+    counters.dropped.fetch_add(1, Ordering::Relaxed) % DROP_LOG_EVERY == 0
+}
+
+async fn drain(
+    producer: Arc<FutureProducer>,
+    mut rx: mpsc::Receiver<Event>,
+    counters: Arc<Counters>,
+) {
+    let mut batch = Vec::with_capacity(DRAIN_BATCH);
+    let mut deliveries = FuturesUnordered::new();
+    loop {
+        tokio::select! {
+            n = rx.recv_many(&mut batch, DRAIN_BATCH) => {
+                if n == 0 {
+                    break;
+                }
+                for event in batch.drain(..) {
+                    let record = FutureRecord::to(event.topic)
+                        .key(&event.key)
+                        .payload(&event.payload);
+                    match producer.send_result(record) {
+                        Ok(delivery) => deliveries.push(delivery),
+                        Err((e, _)) => {
+                            if count_drop(&counters) {
+                                warn!("Kafka producer refused event on {}: {}", event.topic, e);
+                            }
+                        }
+                    }
+                }
+            }
+            Some(result) = deliveries.next(), if !deliveries.is_empty() => {
+                record_delivery(&counters, result.is_ok_and(|r| r.is_ok()));
+            }
+        }
+    }
+    while let Some(result) = deliveries.next().await {
+        record_delivery(&counters, result.is_ok_and(|r| r.is_ok()));
+    }
+    info!("Kafka drain task stopped");
+}
+
+fn record_delivery(counters: &Counters, ok: bool) {
+    let counter = if ok {
+        &counters.delivered
+    } else {
+        &counters.failed
+    };
+    counter.fetch_add(1, Ordering::Relaxed);
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::util::protoc::RequestIDAndClientIDMessage;
+
+    #[tokio::test]
+    async fn test_publish_drops_when_full() {
+        let producer: FutureProducer = ClientConfig::new()
+            .set("bootstrap.servers", "127.0.0.1:1")
+            .create()
+            .unwrap();
+        let (tx, _rx) = mpsc::channel(1);
+        let sink = KafkaSink {
+            tx,
+            counters: Arc::new(Counters::default()),
+            producer: Arc::new(producer),
+        };
+        sink.publish("t", String::new(), vec![1]);
+        sink.publish("t", String::new(), vec![2]);
+        assert_eq!(sink.stats().dropped, 1);
+
+        let message = RequestIDAndClientIDMessage {
+            client_id: [1; 16],
+            request_id: [2; 16],
+        };
+        let bytes = encode(&message).unwrap();
+        assert_eq!(bytes.len(), 32);
+    }
+}
@@ -1,50 +1,207 @@
 use bytes::BytesMut;
-use std::sync::Arc;
-use tokio::sync::Mutex;
+use serde::Serialize;
+use std::cell::Cell;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::Mutex;
 
-// Buffer pool structure
-#[derive(Clone)]
+// Growth factor between size classes and the number of classes per pool.
+const CLASS_SHIFT: u32 = 2;
+const CLASS_COUNT: usize = 3;
+// Buffers kept per class in each shard.
+const MAX_PER_CLASS: usize = 32;
+const MAX_SHARDS: usize = 64;
+
+static NEXT_SHARD: AtomicUsize = AtomicUsize::new(0);
+
+thread_local! {
+    // Each runtime worker thread settles on its own shard.
+    static SHARD_HINT: Cell<usize> = Cell::new(NEXT_SHARD.fetch_add(1, Ordering::Relaxed));
+}
+
+// Counters exposed through the gateway's metrics route.
+#[derive(Debug, Clone, Copy, Default, Serialize)]
+pub struct BufferPoolStats {
+    /// Served from the calling thread's shard.
+    pub hits: u64,
+    /// Served from another thread's shard.
+    pub steals: u64,
+    /// Nothing pooled; a new buffer was allocated.
+    pub misses: u64,
+    pub allocated_bytes: u64,
+    /// Buffers accepted back, including ones that grew while in use.
+    pub reclaimed: u64,
+    /// Buffers too small, too large or over the per-class limit.
+    pub dropped: u64,
+    pub pooled: usize,
+}
+
+#[derive(Default)]
+struct Counters {
+    hits: AtomicU64,
+    steals: AtomicU64,
+    misses: AtomicU64,
+    allocated_bytes: AtomicU64,
+    reclaimed: AtomicU64,
+    dropped: AtomicU64,
+}
+
+type Shard = Mutex<[Vec<BytesMut>; CLASS_COUNT]>;
+
+// Size-classed buffer pool sharded per worker thread. Critical sections are a
+// push or pop on a plain mutex and never await, so get/put are synchronous and
+// nearly always uncontended; a thread whose shard is empty steals from the
+// others before allocating.
 pub struct BufferPool {
-    pool: Arc<Mutex<Vec<BytesMut>>>,
-    buffer_size: usize,
+    classes: [usize; CLASS_COUNT],
+    shards: Box<[Shard]>,
+    counters: Counters,
 }
 
 impl BufferPool {
-    // Create a new buffer pool
+    // Create a pool whose smallest class is `buffer_size`, with larger classes
+    // at 4x and 16x that grown buffers are reclaimed into.
     pub fn new(buffer_size: usize, initial_capacity: usize) -> Self {
-        let mut pool = Vec::with_capacity(initial_capacity);
-        for _ in 0..initial_capacity {
-            pool.push(BytesMut::with_capacity(buffer_size));
+        let mut classes = [buffer_size.max(1); CLASS_COUNT];
+        for i in 1..CLASS_COUNT {
+            classes[i] = classes[i - 1] << CLASS_SHIFT;
+        }
+        let shard_count = std::thread::available_parallelism()
+            .map_or(1, |n| n.get())
+            .min(MAX_SHARDS);
+        let shards: Box<[Shard]> = (0..shard_count)
+            .map(|_| Mutex::new(Default::default()))
+            .collect();
+
+        for i in 0..initial_capacity.min(shard_count * MAX_PER_CLASS) {
+            lock(&shards[i % shard_count])[0].push(BytesMut::with_capacity(classes[0]));
         }
 
         BufferPool {
-            pool: Arc::new(Mutex::new(pool)),
-            buffer_size,
+            classes,
+            shards,
+            counters: Counters::default(),
         }
     }
 
-    // Get a buffer from the pool
-    pub async fn get(&self) -> BytesMut {
-        let mut pool = self.pool.lock().await;
-        if let Some(mut buf) = pool.pop() {
-            buf.clear(); // Clear buffer but retain capacity
-            buf
-        } else {
-            // If pool is empty, create new buffer
-            BytesMut::with_capacity(self.buffer_size)
+    // Get a buffer of the base size
+    pub fn get(&self) -> BytesMut {
+        self.get_with_capacity(self.classes[0])
+    }
+
+    // Get an empty buffer with at least `min_capacity` bytes of capacity. A
+    // larger class serves the request when the fitting one is empty, so
+    // grown buffers filed there are reused by plain `get` too.
+    pub fn get_with_capacity(&self, min_capacity: usize) -> BytesMut {
+        let Some(class) = self.classes.iter().position(|&c| c >= min_capacity) else {
+            return self.allocate(min_capacity);
+        };
+        let own = self.own_shard();
+        if let Some(buf) = pop_from(&mut lock(&self.shards[own]), class) {
+            self.counters.hits.fetch_add(1, Ordering::Relaxed);
+            return buf;
         }
+        for offset in 1..self.shards.len() {
+            let shard = &self.shards[(own + offset) % self.shards.len()];
+            // Skip shards that are busy rather than wait on them.
+            if let Ok(mut shard) = shard.try_lock() {
+                if let Some(buf) = pop_from(&mut shard, class) {
+                    self.counters.steals.fetch_add(1, Ordering::Relaxed);
+                    return buf;
+                }
+            }
+        }
+        self.allocate(self.classes[class])
     }
 
     // Return buffer to the pool
-    pub async fn put(&self, mut buf: BytesMut) {
-        if buf.capacity() == self.buffer_size {
-            let mut pool = self.pool.lock().await;
-            if pool.len() < 100 {
-                // Limit pool size to avoid excessive memory usage
-                buf.clear();
-                pool.push(buf);
+    pub fn put(&self, mut buf: BytesMut) {
+        let capacity = buf.capacity();
+        // A grown buffer goes to the largest class it can still serve.
+        let class = self.classes.iter().rposition(|&c| c <= capacity);
+        match class {
+            Some(class) if capacity <= self.classes[CLASS_COUNT - 1] << CLASS_SHIFT => {
+                let mut shard = lock(&self.shards[self.own_shard()]);
+                if shard[class].len() < MAX_PER_CLASS {
+                    buf.clear();
+                    shard[class].push(buf);
+                    self.counters.reclaimed.fetch_add(1, Ordering::Relaxed);
+                    return;
+                }
             }
+            _ => {}
         }
-        // If buffer size doesn't match or pool is full, let buf be dropped
+        // Otherwise let buf be dropped
+        self.counters.dropped.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn stats(&self) -> BufferPoolStats {
+        BufferPoolStats {
+            hits: self.counters.hits.load(Ordering::Relaxed),
+            steals: self.counters.steals.load(Ordering::Relaxed),
+            misses: self.counters.misses.load(Ordering::Relaxed),
+            allocated_bytes: self.counters.allocated_bytes.load(Ordering::Relaxed),
+            reclaimed: self.counters.reclaimed.load(Ordering::Relaxed),
+            dropped: self.counters.dropped.load(Ordering::Relaxed),
+            pooled: self
+                .shards
+                .iter()
+                .map(|s| lock(s).iter().map(Vec::len).sum::<usize>())
+                .sum(),
+        }
+    }
+
+    fn own_shard(&self) -> usize {
+        SHARD_HINT.with(|hint| hint.get()) % self.shards.len()
+    }
+
+    fn allocate(&self, capacity: usize) -> BytesMut {
+        self.counters.misses.fetch_add(1, Ordering::Relaxed);
+        self.counters
+            .allocated_bytes
+            .fetch_add(capacity as u64, Ordering::Relaxed);
+        BytesMut::with_capacity(capacity)
+    }
+}
+
+// Pop from the smallest non-empty class at or above `class`.
+fn pop_from(classes: &mut [Vec<BytesMut>; CLASS_COUNT], class: usize) -> Option<BytesMut> {
+    classes[class..].iter_mut().find_map(Vec::pop)
+}
+
+fn lock(shard: &Shard) -> std::sync::MutexGuard<'_, [Vec<BytesMut>; CLASS_COUNT]> {
+    shard.lock().unwrap_or_else(|e| e.into_inner())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_pool_reclaims_grown_buffers() {
+        let pool = BufferPool::new(1024, 0);
+        let mut buf = pool.get();
+        assert_eq!(pool.stats().misses, 1);
+
+        // Grows past the 4 KB class; comes back as a 4 KB-class buffer.
+        buf.extend_from_slice(&[0u8; 5000]);
+        pool.put(buf);
+        assert_eq!(pool.stats().reclaimed, 1);
+        let buf = pool.get_with_capacity(4096);
+        assert!(buf.is_empty() && buf.capacity() >= 4096);
+        assert_eq!(pool.stats().hits, 1);
+
+        // With the base class empty, get() reuses a grown buffer.
+        pool.put(buf);
+        let buf = pool.get();
+        assert!(buf.capacity() >= 4096);
+        assert_eq!(pool.stats().hits, 2);
+        assert_eq!(pool.stats().misses, 1);
+        drop(buf);
+
+        // Far beyond the largest class: dropped.
+        pool.put(BytesMut::with_capacity(1024 * 1024));
+        pool.put(BytesMut::with_capacity(16));
+        assert_eq!(pool.stats().dropped, 2);
+        assert_eq!(pool.stats().pooled, 0);
     }
 }
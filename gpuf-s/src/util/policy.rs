@@ -22,3 +22,4 @@ impl From<AccessLevel> for i32 {
 }
 
 pub const REQUEST_MESSAGE_TOPIC: &str = "request-message";
+pub const HEARTBEAT_TOPIC: &str = "client-heartbeats";
@@ -7,7 +7,9 @@ use std::str::FromStr;
 use common::{DevicesInfo, SystemInfo};
 use serde::{de, ser::SerializeTuple, Deserialize, Deserializer, Serialize, Serializer};
 
-#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, Default, bincode::Encode, bincode::Decode)]
+#[derive(
+    Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Hash, Default, bincode::Encode, bincode::Decode,
+)]
 pub struct ClientId(pub [u8; 16]);
 
 impl ToBytes for ClientId {
@@ -172,7 +174,7 @@ where
     ClientId::from_str(&s).map_err(serde::de::Error::custom)
 }
 
-#[derive(Debug, Serialize, Deserialize)]
+#[derive(Debug, Serialize, Deserialize, bincode::Encode, bincode::Decode)]
 pub struct RequestIDAndClientIDMessage {
     pub client_id: [u8; 16],
     pub request_id: [u8; 16],
@@ -3,31 +3,86 @@
 #include <linux/ip.h>
 #include <linux/tcp.h>
 #include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
 
 #define IPPROTO_TCP 6
 
-#define MAX_SCAN_LEN 256
-#define TOKEN_LEN 16
+#define MAX_SCAN_LEN 512
+#define API_KEY_LEN 48      /* full API key, as stored in the tokens table */
+#define MAX_API_KEYS 65536
+
+/* "uthorization: Bearer " -- the leading 'A'/'a' is matched separately */
+#define AUTH_TAIL "uthorization: Bearer "
+#define AUTH_TAIL_LEN 21
+#define AUTH_LEN (1 + AUTH_TAIL_LEN)
+
+enum {
+    STAT_PASS = 0,        /* not a request head on the public port, or no key seen */
+    STAT_AUTHORIZED = 1,  /* request head carrying a known key */
+    STAT_DROP = 2,        /* request head carrying an unknown key */
+    STAT_MAX,
+};
 
 struct {
     __uint(type, BPF_MAP_TYPE_HASH);
-    __uint(max_entries, 128);
-    __type(key, __u8[TOKEN_LEN]);
+    __uint(max_entries, MAX_API_KEYS);
+    __type(key, __u8[API_KEY_LEN]);
     __type(value, __u8);
 } api_keys SEC(".maps");
 
+/* Slot 0: public port in host order; 0 disables filtering (fail open). */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u32);
+} xdp_config SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, STAT_MAX);
+    __type(key, __u32);
+    __type(value, __u64);
+} xdp_stats SEC(".maps");
+
+static __always_inline int count(__u32 stat, int action) {
+    __u64 *value = bpf_map_lookup_elem(&xdp_stats, &stat);
+    if (value)
+        *value += 1;
+    return action;
+}
+
+/* A request head starts with "METHOD /"; body continuation segments do not,
+ * so only heads are scanned and a body quoting a header is never dropped. */
+static __always_inline int is_request_head(unsigned char *payload, void *data_end) {
+    #pragma unroll
+    for (int i = 0; i < 8; i++) {
+        if (payload + i + 2 > (unsigned char *)data_end)
+            return 0;
+        unsigned char c = payload[i];
+        if (c == ' ')
+            return i > 0 && payload[i + 1] == '/';
+        if (c < 'A' || c > 'Z')
+            return 0;
+    }
+    return 0;
+}
+
 SEC("xdp")
 int xdp_auth_filter(struct xdp_md *ctx) {
     void *data = (void *)(long)ctx->data;
     void *data_end = (void *)(long)ctx->data_end;
 
+    __u32 zero = 0;
+    __u32 *port = bpf_map_lookup_elem(&xdp_config, &zero);
+    if (!port || *port == 0)
+        return XDP_PASS;
+
     /* Ethernet header */
     struct ethhdr *eth = data;
     if ((void *)(eth + 1) > data_end)
         return XDP_PASS;
-
-    __u16 h_proto = eth->h_proto;
-    if (h_proto != __constant_htons(ETH_P_IP))
+    if (eth->h_proto != bpf_htons(ETH_P_IP))
         return XDP_PASS;
 
     /* IP header: make sure ihl valid and within packet */
@@ -45,52 +100,40 @@ int xdp_auth_filter(struct xdp_md *ctx) {
     struct tcphdr *tcph = (void *)iph + iph->ihl * 4;
     if ((void *)(tcph + 1) > data_end)
         return XDP_PASS;
+    if (bpf_ntohs(tcph->dest) != *port)
+        return XDP_PASS;
     if (tcph->doff < 5)
         return XDP_PASS;
     if ((void *)tcph + tcph->doff * 4 > data_end)
         return XDP_PASS;
 
-    /* payload pointer */
+    /* payload pointer; SYNs and pure ACKs have none */
     unsigned char *payload = (unsigned char *)tcph + tcph->doff * 4;
     if (payload >= (unsigned char *)data_end)
         return XDP_PASS;
+    if (!is_request_head(payload, data_end))
+        return count(STAT_PASS, XDP_PASS);
 
-    /* compute how many bytes we can safely scan */
-    __u64 available = (__u64)((unsigned char *)data_end - payload);
-    __u64 limit = available;
-    if (limit > MAX_SCAN_LEN)
-        limit = MAX_SCAN_LEN;
-
-    /* prefix we search for */
-    const char prefix[] = "Authorization:"; /* length 14 */
-    const int prefix_len = 14;
-
-    /* scan loop: *always* check pointer arithmetic before any read */
-    #pragma unroll
     for (int i = 0; i < MAX_SCAN_LEN; i++) {
-        /* ensure we don't run past our computed limit */
-        if ((__u64)i + prefix_len + TOKEN_LEN > limit)
-            break;
-
+        unsigned char *p = payload + i;
         /* explicit pointer check so verifier can see it */
-        if (payload + i + prefix_len + TOKEN_LEN > (unsigned char *)data_end)
+        if (p + AUTH_LEN + API_KEY_LEN > (unsigned char *)data_end)
             break;
-
-        /* now it's safe to compare prefix */
-        if (__builtin_memcmp(payload + i, prefix, prefix_len) == 0) {
-            /* safe to copy token (we already checked bounds) */
-            __u8 token[TOKEN_LEN];
-            __builtin_memcpy(token, payload + i + prefix_len, TOKEN_LEN);
-
-            __u8 *val = bpf_map_lookup_elem(&api_keys, token);
-            if (val)
-                return XDP_PASS;
-            else
-                return XDP_DROP;
-        }
+        if (p[0] != 'A' && p[0] != 'a')
+            continue;
+        if (__builtin_memcmp(p + 1, AUTH_TAIL, AUTH_TAIL_LEN) != 0)
+            continue;
+
+        __u8 key[API_KEY_LEN];
+        __builtin_memcpy(key, p + AUTH_LEN, API_KEY_LEN);
+        if (bpf_map_lookup_elem(&api_keys, key))
+            return count(STAT_AUTHORIZED, XDP_PASS);
+        return count(STAT_DROP, XDP_DROP);
     }
 
-    return XDP_PASS;
+    /* Header beyond the scan window or split across segments: let the
+     * server decide. */
+    return count(STAT_PASS, XDP_PASS);
 }
 
 char _license[] SEC("license") = "GPL";
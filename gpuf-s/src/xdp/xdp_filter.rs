@@ -1,84 +1,297 @@
-use anyhow::{Context, Result};
-use aya::{maps::HashMap, Ebpf, EbpfLoader};
-use std::sync::Arc;
-use tokio::sync::Mutex;
+//! XDP prefilter for the public port.
+//!
+//! `xdp_auth_filter.o` drops request heads whose `Authorization: Bearer` key
+//! is not in its `api_keys` map before they reach the TCP stack; everything
+//! else (other ports, continuation segments, heads without a key) passes and
+//! is authenticated by the server as usual.
+//!
+//! The map is kept in step with the tokens table by [`XdpFilter::run_key_sync`],
+//! which reloads the full key set periodically and whenever a token
+//! invalidation is published, and applies only the difference. Filtering stays
+//! disabled until the first sync succeeds and is disabled again if a sync
+//! fails, so a stale or partial map never drops valid keys.
+
+use crate::db::client::load_active_token_keys;
+use crate::db::token_cache::TOKEN_INVALIDATION_CHANNEL;
+use crate::util::db::listen_invalidations;
+
+use anyhow::{anyhow, Context, Result};
+use aya::maps::{Array, HashMap, MapData, PerCpuArray};
+use aya::programs::{Xdp, XdpFlags};
+use aya::{Ebpf, EbpfLoader};
+use redis::Client as RedisClient;
+use serde::Serialize;
+use sqlx::{Pool, Postgres};
+use std::collections::HashSet;
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+use tokio::sync::Notify;
+use tracing::{error, info, warn};
+
+/// Length of an API key, and of a key in the `api_keys` map.
+pub const API_KEY_LEN: usize = 48;
+
+const PROGRAM_NAME: &str = "xdp_auth_filter";
+/// `xdp_auth_filter.c` as compiled by build.rs for this build; empty when
+/// clang was unavailable.
+static EMBEDDED_OBJECT: &[u8] =
+    aya::include_bytes_aligned!(concat!(env!("OUT_DIR"), "/xdp_auth_filter.o"));
+// Indices into the per-CPU `xdp_stats` map, as in xdp_auth_filter.c.
+const STAT_PASS: u32 = 0;
+const STAT_AUTHORIZED: u32 = 1;
+const STAT_DROP: u32 = 2;
+
+type ApiKey = [u8; API_KEY_LEN];
+
+struct KeyMap {
+    map: HashMap<MapData, ApiKey, u8>,
+    /// Mirror of the map's keys, so a sync diffs in memory instead of
+    /// walking the map with one syscall per key.
+    installed: HashSet<ApiKey>,
+    config: Array<MapData, u32>,
+}
+
+/// Per-CPU packet counters, indexed by CPU.
+#[derive(Debug, Clone, Default, Serialize)]
+pub struct XdpStats {
+    pub enabled: bool,
+    pub keys: usize,
+    /// Not a request head on the public port, or no key within the scan window.
+    pub passed: Vec<u64>,
+    /// Request heads carrying a known key.
+    pub authorized: Vec<u64>,
+    /// Request heads carrying an unknown key.
+    pub dropped: Vec<u64>,
+}
+
+#[derive(Debug, Default, PartialEq)]
+pub struct SyncReport {
+    pub added: usize,
+    pub removed: usize,
+    /// Keys of the wrong length, which the program can never match.
+    pub skipped: usize,
+}
 
-#[allow(dead_code)] // Experimental XDP implementation for high-performance packet filtering
 pub struct XdpFilter {
-    bpf: Arc<Mutex<Ebpf>>,
+    keys: Mutex<KeyMap>,
+    stats: PerCpuArray<MapData, u64>,
+    public_port: u16,
+    // Owns the attached program; dropping it detaches the filter.
+    _bpf: Mutex<Ebpf>,
 }
 
 impl XdpFilter {
-    #[allow(dead_code)] // Experimental XDP implementation for high-performance packet filtering
-    pub async fn new(interface: &str, obj_path: &str) -> Result<Self> {
-        let mut bpf = EbpfLoader::new()
-            .load_file(obj_path)
-            .context(format!("Failed to load XDP eBPF object file: {}", obj_path))?;
-
-        // get XDP program
-        let program: &mut aya::programs::Xdp = bpf
-            .program_mut("xdp_auth_filter")
-            .ok_or(anyhow::anyhow!("Optional value was None"))? // eBPF program name
-            .try_into()?;
+    /// Load the program built with this binary, or `obj_path` when given,
+    /// and attach it to `interface`, filtering `public_port`. Falls back to
+    /// generic (SKB) mode when the driver lacks native XDP.
+    pub fn attach(interface: &str, obj_path: Option<&str>, public_port: u16) -> Result<Self> {
+        let mut bpf = match obj_path {
+            Some(path) => EbpfLoader::new()
+                .load_file(path)
+                .context(format!("Failed to load XDP eBPF object file: {}", path))?,
+            None if EMBEDDED_OBJECT.is_empty() => {
+                return Err(anyhow!(
+                    "this build has no embedded XDP object (clang was unavailable); \
+                     pass --xdp-object"
+                ))
+            }
+            None => EbpfLoader::new()
+                .load(EMBEDDED_OBJECT)
+                .context("Failed to load the embedded XDP eBPF object")?,
+        };
+        let source = obj_path.unwrap_or("the embedded object");
 
-        // TODO: if the interface has already attached eBPF program, need to detach
+        let program: &mut Xdp = bpf
+            .program_mut(PROGRAM_NAME)
+            .ok_or_else(|| anyhow!("XDP program {} not found in {}", PROGRAM_NAME, source))?
+            .try_into()?;
         program.load()?;
-        program.attach(interface, aya::programs::XdpFlags::default())?;
+        if let Err(e) = program.attach(interface, XdpFlags::default()) {
+            warn!(
+                "Native XDP attach on {} failed ({}), falling back to SKB mode",
+                interface, e
+            );
+            program
+                .attach(interface, XdpFlags::SKB_MODE)
+                .context(format!("Failed to attach XDP program to {}", interface))?;
+        }
+
+        let map = HashMap::try_from(take_map(&mut bpf, "api_keys")?)
+            .context("api_keys map does not match this build; the object is out of date")?;
+        let mut config = Array::try_from(take_map(&mut bpf, "xdp_config")?)?;
+        let stats = PerCpuArray::try_from(take_map(&mut bpf, "xdp_stats")?)?;
+        // Fail open until the first key sync.
+        config.set(0, 0u32, 0)?;
+
+        info!(
+            "XDP API key filter attached to {} for port {}",
+            interface, public_port
+        );
         Ok(Self {
-            bpf: Arc::new(Mutex::new(bpf)),
+            keys: Mutex::new(KeyMap {
+                map,
+                installed: HashSet::new(),
+                config,
+            }),
+            stats,
+            public_port,
+            _bpf: Mutex::new(bpf),
         })
     }
 
-    #[allow(dead_code)] // Experimental XDP implementation for high-performance packet filtering
-    pub async fn add_api_key(&self, key: &[u8]) -> Result<()> {
-        let mut bpf = self.bpf.lock().await;
-        // corresponding eBPF map key length is 16
-        let mut api_keys: HashMap<_, [u8; 16], u8> = HashMap::try_from(
-            bpf.map_mut("api_keys")
-                .ok_or(anyhow::anyhow!("Failed to get map"))?,
-        )?;
-
-        let mut padded_key = [0u8; 16];
-        let len = key.len().min(16);
-        padded_key[..len].copy_from_slice(&key[..len]);
-
-        api_keys.insert(&padded_key, &1, 0)?;
-        println!("Added API key: {:?}", String::from_utf8_lossy(&padded_key));
+    /// Make the map hold exactly `keys`, then enable filtering. On failure
+    /// filtering is disabled and the error returned. Blocking: issues one map
+    /// syscall per changed key under a single lock.
+    pub fn sync_keys(&self, keys: &[String]) -> Result<SyncReport> {
+        let mut report = SyncReport::default();
+        let desired: HashSet<ApiKey> = keys
+            .iter()
+            .filter_map(|key| {
+                let key = map_key(key.as_bytes());
+                report.skipped += key.is_none() as usize;
+                key
+            })
+            .collect();
+
+        let mut guard = self.keys.lock().unwrap_or_else(|e| e.into_inner());
+        let km = &mut *guard;
+        let result = apply_diff(km, &desired, &mut report);
+        let port = if result.is_ok() { self.public_port } else { 0 };
+        km.config.set(0, port as u32, 0)?;
+        result.map(|()| report)
+    }
+
+    /// Allow a single key ahead of the next sync.
+    #[allow(dead_code)] // Kept for manual testing; syncs normally cover additions
+    pub fn add_api_key(&self, key: &[u8]) -> Result<()> {
+        let key = map_key(key).ok_or_else(|| anyhow!("API key must be {} bytes", API_KEY_LEN))?;
+        let mut km = self.keys.lock().unwrap_or_else(|e| e.into_inner());
+        km.map.insert(key, 1u8, 0)?;
+        km.installed.insert(key);
         Ok(())
     }
 
-    #[allow(dead_code)] // Experimental XDP implementation for high-performance packet filtering
-    pub async fn remove_api_key(&self, key: &[u8]) -> Result<()> {
-        let mut bpf = self.bpf.lock().await;
-        let mut api_keys: HashMap<_, [u8; 16], u8> = HashMap::try_from(
-            bpf.map_mut("api_keys")
-                .ok_or(anyhow::anyhow!("Failed to get map"))?,
-        )?;
-
-        let mut padded_key = [0u8; 16];
-        let len = key.len().min(16);
-        padded_key[..len].copy_from_slice(&key[..len]);
-
-        api_keys.remove(&padded_key)?;
-        println!(
-            "Removed API key: {:?}",
-            String::from_utf8_lossy(&padded_key)
-        );
+    #[allow(dead_code)] // Kept for manual testing; syncs normally cover removals
+    pub fn remove_api_key(&self, key: &[u8]) -> Result<()> {
+        let key = map_key(key).ok_or_else(|| anyhow!("API key must be {} bytes", API_KEY_LEN))?;
+        let mut km = self.keys.lock().unwrap_or_else(|e| e.into_inner());
+        km.map.remove(&key)?;
+        km.installed.remove(&key);
         Ok(())
     }
+
+    pub fn stats(&self) -> Result<XdpStats> {
+        let per_cpu = |index| -> Result<Vec<u64>> { Ok(self.stats.get(&index, 0)?.to_vec()) };
+        let (enabled, keys) = {
+            let km = self.keys.lock().unwrap_or_else(|e| e.into_inner());
+            (km.config.get(&0, 0)? != 0, km.installed.len())
+        };
+        Ok(XdpStats {
+            enabled,
+            keys,
+            passed: per_cpu(STAT_PASS)?,
+            authorized: per_cpu(STAT_AUTHORIZED)?,
+            dropped: per_cpu(STAT_DROP)?,
+        })
+    }
+
+    /// Keep the map in step with the tokens table for the lifetime of the
+    /// process: resync every `interval`, and promptly after any token
+    /// invalidation (bursts of messages collapse into one resync).
+    pub async fn run_key_sync(
+        self: Arc<Self>,
+        db_pool: Arc<Pool<Postgres>>,
+        redis_client: Arc<RedisClient>,
+        interval: Duration,
+    ) {
+        let changed = Arc::new(Notify::new());
+        let notify = changed.clone();
+        tokio::spawn(listen_invalidations(
+            redis_client,
+            TOKEN_INVALIDATION_CHANNEL,
+            move |_| notify.notify_one(),
+        ));
+
+        loop {
+            match load_active_token_keys(&db_pool).await {
+                Ok(keys) => {
+                    let filter = self.clone();
+                    match tokio::task::spawn_blocking(move || filter.sync_keys(&keys)).await {
+                        Ok(Ok(report)) if report != SyncReport::default() => {
+                            info!("XDP key sync: {:?}", report)
+                        }
+                        Ok(Ok(_)) => {}
+                        Ok(Err(e)) => error!("XDP key sync failed, filter disabled: {}", e),
+                        Err(e) => error!("XDP key sync task failed: {}", e),
+                    }
+                }
+                // Keep the last synced set; the server still authenticates.
+                Err(e) => warn!("Failed to load API keys for XDP sync: {}", e),
+            }
+            tokio::select! {
+                _ = tokio::time::sleep(interval) => {}
+                _ = changed.notified() => {}
+            }
+        }
+    }
+}
+
+fn take_map(bpf: &mut Ebpf, name: &str) -> Result<aya::maps::Map> {
+    bpf.take_map(name)
+        .ok_or_else(|| anyhow!("XDP map {} not found; the object is out of date", name))
+}
+
+fn map_key(key: &[u8]) -> Option<ApiKey> {
+    key.try_into().ok()
+}
+
+fn apply_diff(km: &mut KeyMap, desired: &HashSet<ApiKey>, report: &mut SyncReport) -> Result<()> {
+    let stale: Vec<ApiKey> = km.installed.difference(desired).copied().collect();
+    for key in stale {
+        km.map.remove(&key)?;
+        km.installed.remove(&key);
+        report.removed += 1;
+    }
+    for key in desired
+        .difference(&km.installed)
+        .copied()
+        .collect::<Vec<_>>()
+    {
+        km.map
+            .insert(key, 1u8, 0)
+            .context("Failed to insert API key; the map may be full")?;
+        km.installed.insert(key);
+        report.added += 1;
+    }
+    Ok(())
 }
 
-#[tokio::test]
-async fn test_xdp_filter() {
-    let xdp_filter = XdpFilter::new("enp5s0", "./gpuf-s/src/xdp/xdp_auth_filter.o")
-        .await
-        .expect("Failed to create XDP filter");
+/// Attaches to a real interface, so it needs CAP_NET_ADMIN:
+/// `GPUF_XDP_TEST_IFACE=eth0 cargo test -- --ignored test_xdp_filter`
+#[test]
+#[ignore]
+fn test_xdp_filter() {
+    let interface =
+        std::env::var("GPUF_XDP_TEST_IFACE").expect("set GPUF_XDP_TEST_IFACE to an interface");
+    let xdp_filter =
+        XdpFilter::attach(&interface, None, 18080).expect("Failed to create XDP filter");
+    let key = "HSSb0OFrZon7wapKUduWqSxqpELMI62eTPyW017QanhnMyy4";
     xdp_filter
-        .add_api_key(b"1234567890")
-        .await
+        .add_api_key(key.as_bytes())
         .expect("Failed to add API key");
     xdp_filter
-        .remove_api_key(b"1234567890")
-        .await
+        .remove_api_key(key.as_bytes())
         .expect("Failed to remove API key");
+    let report = xdp_filter
+        .sync_keys(&[key.to_string(), "short".to_string()])
+        .expect("Failed to sync API keys");
+    assert_eq!(
+        report,
+        SyncReport {
+            added: 1,
+            removed: 0,
+            skipped: 1
+        }
+    );
+    assert!(xdp_filter.stats().expect("Failed to read stats").enabled);
 }
@@ -51,6 +51,11 @@ CREATE TABLE  IF NOT EXISTS  "public"."gpu_assets" (
  CREATE INDEX IF NOT EXISTS idx_gpu_assets_user_id_client_name
  ON "public"."gpu_assets" ("user_id", "client_name");
 
+-- Covers the per-user device lookups of the monitor endpoints
+CREATE INDEX IF NOT EXISTS idx_gpu_assets_user_id_valid
+ON "public"."gpu_assets" ("user_id", "valid_status")
+INCLUDE ("client_name", "created_at", "updated_at");
+
 CREATE TABLE IF NOT EXISTS "public"."pod_info" (
     "pod_id" UUID PRIMARY KEY DEFAULT gen_random_uuid(),
     "client_id" BYTEA NOT NULL REFERENCES "public"."gpu_assets" ("client_id") ON DELETE CASCADE,
@@ -157,8 +162,28 @@ CREATE TABLE IF NOT EXISTS client_daily_stats (
 ALTER TABLE client_daily_stats
 ADD COLUMN IF NOT EXISTS last_heartbeat_bucket BIGINT NOT NULL DEFAULT 0;
 
-CREATE INDEX IF NOT EXISTS idx_client_daily_stats_client_id_date 
-ON client_daily_stats (client_id, date DESC);
+-- Covers the client monitor query, which pages on (date, client_id)
+DROP INDEX IF EXISTS idx_client_daily_stats_client_id_date;
+CREATE INDEX IF NOT EXISTS idx_client_daily_stats_client_id_date_covering
+ON client_daily_stats (client_id, date DESC)
+INCLUDE (total_heartbeats, avg_cpu_usage, avg_memory_usage, avg_disk_usage,
+         total_network_in_bytes, total_network_out_bytes, last_heartbeat);
+
+-- Hourly per-client rollup maintained by the heartbeat processor. Sums are
+-- stored rather than averages so each batch folds in by addition.
+CREATE TABLE IF NOT EXISTS client_hourly_stats (
+    client_id BYTEA NOT NULL,
+    hour TIMESTAMPTZ NOT NULL,
+    total_heartbeats INTEGER NOT NULL DEFAULT 0,
+    sum_cpu_usage FLOAT NOT NULL DEFAULT 0,
+    sum_memory_usage FLOAT NOT NULL DEFAULT 0,
+    sum_disk_usage FLOAT NOT NULL DEFAULT 0,
+    total_network_in_bytes BIGINT NOT NULL DEFAULT 0,
+    total_network_out_bytes BIGINT NOT NULL DEFAULT 0,
+    last_heartbeat TIMESTAMPTZ NOT NULL DEFAULT NOW(),
+    updated_at TIMESTAMPTZ NOT NULL DEFAULT NOW(),
+    PRIMARY KEY (client_id, hour)
+);
 
 CREATE TABLE IF NOT EXISTS device_daily_stats (
     id BIGSERIAL,